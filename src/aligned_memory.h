@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+namespace nakamir {
+
+	// Alignments must be a power of two. MF reports alignment as "bytes - 1"
+	// (e.g. MF_16_BYTE_ALIGNMENT == 15), so callers converting from
+	// MFT_OUTPUT_STREAM_INFO::cbAlignment should add one first.
+	inline size_t aligned_normalize(size_t alignment)
+	{
+		size_t result = alignof(std::max_align_t);
+		while (result < alignment) result <<= 1;
+		return result;
+	}
+
+	inline size_t aligned_round_up(size_t size, size_t alignment)
+	{
+		return (size + alignment - 1) & ~(alignment - 1);
+	}
+
+	inline void* aligned_malloc(size_t size, size_t alignment)
+	{
+		alignment = aligned_normalize(alignment);
+		size = aligned_round_up(size == 0 ? 1 : size, alignment);
+#ifdef _MSC_VER
+		void* result = _aligned_malloc(size, alignment);
+#else
+		void* result = std::aligned_alloc(alignment, size);
+#endif
+		if (result == nullptr) throw std::bad_alloc();
+		return result;
+	}
+
+	inline void aligned_free(void* ptr)
+	{
+#ifdef _MSC_VER
+		_aligned_free(ptr);
+#else
+		std::free(ptr);
+#endif
+	}
+
+} // namespace nakamir
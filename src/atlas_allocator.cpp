@@ -0,0 +1,321 @@
+#include "atlas_allocator.h"
+#include <algorithm>
+
+namespace nakamir {
+
+	void atlas_allocator::reset(uint32_t width, uint32_t height, uint32_t alignment, uint32_t padding)
+	{
+		_width = width;
+		_height = height;
+		_alignment = alignment ? alignment : 1;
+		_padding = padding;
+		_top = 0;
+		_frame = 0;
+		_shelves.clear();
+		_entries.clear();
+		_free_ids.clear();
+		_stats = {};
+	}
+
+	uint32_t atlas_allocator::padded(uint32_t size) const
+	{
+		uint32_t total = size + _padding;
+		return (total + _alignment - 1) / _alignment * _alignment;
+	}
+
+	int32_t atlas_allocator::allocate(uint32_t width, uint32_t height)
+	{
+		atlas_rect_t rect;
+		if (width == 0 || height == 0 || !place(padded(width), padded(height), &rect))
+		{
+			_stats.failed++;
+			return -1;
+		}
+
+		int32_t id;
+		if (!_free_ids.empty())
+		{
+			id = _free_ids.back();
+			_free_ids.pop_back();
+		}
+		else
+		{
+			id = static_cast<int32_t>(_entries.size());
+			_entries.push_back({});
+		}
+		_entries[id] = { true, rect, width, height, _frame };
+		_stats.allocated++;
+		return id;
+	}
+
+	void atlas_allocator::release(int32_t id)
+	{
+		if (id < 0 || id >= static_cast<int32_t>(_entries.size()) || !_entries[id].live)
+			return;
+
+		entry_t& entry = _entries[id];
+		size_t index = find_shelf(entry.rect.y);
+		shelf_t& shelf = _shelves[index];
+		give_span(shelf, entry.rect.x, entry.rect.width);
+		if (--shelf.used == 0)
+			collapse_empty(index);
+
+		entry.live = false;
+		_free_ids.push_back(id);
+	}
+
+	bool atlas_allocator::get_rect(int32_t id, atlas_rect_t* rect) const
+	{
+		if (id < 0 || id >= static_cast<int32_t>(_entries.size()) || !_entries[id].live)
+			return false;
+		const entry_t& entry = _entries[id];
+		*rect = { entry.rect.x, entry.rect.y, entry.width, entry.height };
+		return true;
+	}
+
+	void atlas_allocator::touch(int32_t id, uint64_t frame)
+	{
+		if (frame > _frame)
+			_frame = frame;
+		if (id >= 0 && id < static_cast<int32_t>(_entries.size()) && _entries[id].live)
+			_entries[id].last_used = frame;
+	}
+
+	uint32_t atlas_allocator::evict(uint64_t before_frame, std::vector<int32_t>* evicted)
+	{
+		std::vector<int32_t> stale;
+		for (size_t i = 0; i < _entries.size(); i++)
+		{
+			if (_entries[i].live && _entries[i].last_used < before_frame)
+				stale.push_back(static_cast<int32_t>(i));
+		}
+		for (int32_t id : stale)
+			release(id);
+		if (evicted)
+			evicted->insert(evicted->end(), stale.begin(), stale.end());
+		_stats.evicted += stale.size();
+		return static_cast<uint32_t>(stale.size());
+	}
+
+	bool atlas_allocator::defragment(std::vector<atlas_move_t>* moves)
+	{
+		std::vector<int32_t> live;
+		for (size_t i = 0; i < _entries.size(); i++)
+		{
+			if (_entries[i].live)
+				live.push_back(static_cast<int32_t>(i));
+		}
+		// Tallest first, so each shelf is opened by the rect that sets its height
+		// and shorter ones fill in behind
+		std::sort(live.begin(), live.end(), [this](int32_t a, int32_t b) {
+			const atlas_rect_t& ra = _entries[a].rect;
+			const atlas_rect_t& rb = _entries[b].rect;
+			return ra.height != rb.height ? ra.height > rb.height : ra.width > rb.width;
+		});
+
+		std::vector<shelf_t> old_shelves = std::move(_shelves);
+		uint32_t old_top = _top;
+		_shelves.clear();
+		_top = 0;
+
+		std::vector<atlas_rect_t> placed(live.size());
+		for (size_t i = 0; i < live.size(); i++)
+		{
+			const atlas_rect_t& rect = _entries[live[i]].rect;
+			if (!place(rect.width, rect.height, &placed[i]))
+			{
+				_shelves = std::move(old_shelves);
+				_top = old_top;
+				return false;
+			}
+		}
+
+		uint64_t moved = 0;
+		for (size_t i = 0; i < live.size(); i++)
+		{
+			entry_t& entry = _entries[live[i]];
+			if (placed[i].x != entry.rect.x || placed[i].y != entry.rect.y)
+			{
+				if (moves)
+				{
+					moves->push_back({ live[i], { entry.rect.x, entry.rect.y, entry.width, entry.height },
+						{ placed[i].x, placed[i].y, entry.width, entry.height } });
+				}
+				moved++;
+			}
+			entry.rect = placed[i];
+		}
+		_stats.defragments++;
+		_stats.moved += moved;
+		return true;
+	}
+
+	atlas_allocator_stats_t atlas_allocator::get_stats() const
+	{
+		atlas_allocator_stats_t stats = _stats;
+		stats.width = _width;
+		stats.height = _height;
+		stats.shelves = static_cast<uint32_t>(_shelves.size());
+		for (const entry_t& entry : _entries)
+		{
+			if (!entry.live)
+				continue;
+			stats.allocations++;
+			stats.used_area += static_cast<uint64_t>(entry.rect.width) * entry.rect.height;
+		}
+		stats.free_area = static_cast<uint64_t>(_width) * _height - stats.used_area;
+		stats.free_top_area = static_cast<uint64_t>(_width) * (_height - _top);
+		return stats;
+	}
+
+	bool atlas_allocator::place(uint32_t width, uint32_t height, atlas_rect_t* rect)
+	{
+		if (width > _width || height > _height)
+			return false;
+
+		// 1. The shortest shelf in use that fits without wasting more than half
+		//    the rect's height again
+		size_t best = SIZE_MAX;
+		for (size_t i = 0; i < _shelves.size(); i++)
+		{
+			const shelf_t& shelf = _shelves[i];
+			if (shelf.used == 0 || shelf.height < height || shelf.height - height > height / 2)
+				continue;
+			if (best != SIZE_MAX && _shelves[best].height <= shelf.height)
+				continue;
+			for (const span_t& span : shelf.free)
+			{
+				if (span.width >= width)
+				{
+					best = i;
+					break;
+				}
+			}
+		}
+
+		// 2. The shortest empty shelf that is tall enough, cut down to size
+		if (best == SIZE_MAX)
+		{
+			for (size_t i = 0; i < _shelves.size(); i++)
+			{
+				const shelf_t& shelf = _shelves[i];
+				if (shelf.used == 0 && shelf.height >= height && (best == SIZE_MAX || shelf.height < _shelves[best].height))
+					best = i;
+			}
+			if (best != SIZE_MAX && _shelves[best].height > height)
+			{
+				shelf_t rest = { _shelves[best].y + height, _shelves[best].height - height, 0, { { 0, _width } } };
+				_shelves[best].height = height;
+				if (best == _shelves.size() - 1)
+					_top -= rest.height;
+				else
+					_shelves.insert(_shelves.begin() + best + 1, rest);
+			}
+		}
+
+		// 3. A new shelf on top
+		if (best == SIZE_MAX && _height - _top >= height)
+		{
+			_shelves.push_back({ _top, height, 0, { { 0, _width } } });
+			_top += height;
+			best = _shelves.size() - 1;
+		}
+
+		// 4. Any shelf with room, however much height it wastes
+		if (best == SIZE_MAX)
+		{
+			for (size_t i = 0; i < _shelves.size() && best == SIZE_MAX; i++)
+			{
+				if (_shelves[i].height < height)
+					continue;
+				for (const span_t& span : _shelves[i].free)
+				{
+					if (span.width >= width)
+					{
+						best = i;
+						break;
+					}
+				}
+			}
+		}
+
+		uint32_t x;
+		if (best == SIZE_MAX || !take_span(_shelves[best], width, &x))
+			return false;
+		_shelves[best].used++;
+		*rect = { x, _shelves[best].y, width, height };
+		return true;
+	}
+
+	bool atlas_allocator::take_span(shelf_t& shelf, uint32_t width, uint32_t* x)
+	{
+		for (size_t i = 0; i < shelf.free.size(); i++)
+		{
+			span_t& span = shelf.free[i];
+			if (span.width < width)
+				continue;
+			*x = span.x;
+			span.x += width;
+			span.width -= width;
+			if (span.width == 0)
+				shelf.free.erase(shelf.free.begin() + i);
+			return true;
+		}
+		return false;
+	}
+
+	void atlas_allocator::give_span(shelf_t& shelf, uint32_t x, uint32_t width)
+	{
+		auto it = std::lower_bound(shelf.free.begin(), shelf.free.end(), x,
+			[](const span_t& span, uint32_t value) { return span.x < value; });
+		it = shelf.free.insert(it, { x, width });
+
+		// Merge with the span after, then the one before
+		auto next = it + 1;
+		if (next != shelf.free.end() && it->x + it->width == next->x)
+		{
+			it->width += next->width;
+			shelf.free.erase(next);
+		}
+		if (it != shelf.free.begin())
+		{
+			auto prev = it - 1;
+			if (prev->x + prev->width == it->x)
+			{
+				prev->width += it->width;
+				shelf.free.erase(it);
+			}
+		}
+	}
+
+	size_t atlas_allocator::find_shelf(uint32_t y) const
+	{
+		auto it = std::lower_bound(_shelves.begin(), _shelves.end(), y,
+			[](const shelf_t& shelf, uint32_t value) { return shelf.y < value; });
+		return static_cast<size_t>(it - _shelves.begin());
+	}
+
+	void atlas_allocator::collapse_empty(size_t index)
+	{
+		if (index + 1 < _shelves.size() && _shelves[index + 1].used == 0)
+		{
+			_shelves[index].height += _shelves[index + 1].height;
+			_shelves.erase(_shelves.begin() + index + 1);
+		}
+		if (index > 0 && _shelves[index - 1].used == 0)
+		{
+			_shelves[index - 1].height += _shelves[index].height;
+			_shelves.erase(_shelves.begin() + index);
+			index--;
+		}
+		_shelves[index].free.assign(1, { 0, _width });
+
+		// The topmost shelf hands its height back for rects of any size
+		if (index == _shelves.size() - 1)
+		{
+			_top -= _shelves[index].height;
+			_shelves.pop_back();
+		}
+	}
+
+} // namespace nakamir
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nakamir {
+
+	struct atlas_rect_t {
+		uint32_t x;
+		uint32_t y;
+		uint32_t width;
+		uint32_t height;
+	};
+
+	// Where defragment put an allocation. The texels at from are not copied;
+	// the owner re-uploads them to to.
+	struct atlas_move_t {
+		int32_t id;
+		atlas_rect_t from;
+		atlas_rect_t to;
+	};
+
+	struct atlas_allocator_stats_t {
+		uint32_t width;
+		uint32_t height;
+		uint32_t allocations;     // Live right now
+		uint32_t shelves;
+		uint64_t used_area;       // Texels in live rects, padding included
+		uint64_t free_area;       // Texels not in any live rect
+		uint64_t free_top_area;   // Of which unclaimed by any shelf, i.e. usable at any height
+		uint64_t allocated;       // Successful allocate calls
+		uint64_t failed;          // allocate calls that found no room
+		uint64_t evicted;
+		uint64_t defragments;
+		uint64_t moved;           // Allocations relocated by defragment
+	};
+
+	// Packs rectangles into a fixed 2D area, e.g. video tiles into a shared
+	// texture. Rects go on horizontal shelves: each shelf is as tall as the
+	// first rect placed on it and keeps a sorted list of free x spans, so
+	// streams of similar sizes pack tightly and freeing is cheap. Shelves that
+	// empty out merge with empty neighbours and can be split again for shorter
+	// rects, and the topmost gives its height back.
+	//
+	// What shelves can't fix is space stranded between long-lived rects. For
+	// that there is evict, which frees allocations not touched since a given
+	// frame, and defragment, which repacks everything from scratch, tallest
+	// first, and reports what moved.
+	//
+	// Not thread safe; the owner locks around it.
+	class atlas_allocator {
+	public:
+		atlas_allocator() = default;
+		// alignment rounds every rect's origin and size up to a multiple, e.g. 2
+		// so NV12 chroma lands on whole texels; padding is kept free to the right
+		// of and below each rect so filtering doesn't bleed between neighbours
+		atlas_allocator(uint32_t width, uint32_t height, uint32_t alignment = 1, uint32_t padding = 0) { reset(width, height, alignment, padding); }
+
+		// Forgets every allocation
+		void reset(uint32_t width, uint32_t height, uint32_t alignment = 1, uint32_t padding = 0);
+
+		// Returns an id for a width x height rect, or -1 if it doesn't fit
+		int32_t allocate(uint32_t width, uint32_t height);
+		void release(int32_t id);
+		// The rect as asked for, without alignment or padding
+		bool get_rect(int32_t id, /**[out]**/ atlas_rect_t* rect) const;
+		// Marks an allocation as used in frame, for evict
+		void touch(int32_t id, uint64_t frame);
+
+		// Releases every allocation last touched before frame, appending their
+		// ids to evicted. Returns how many went.
+		uint32_t evict(uint64_t before_frame, /**[out]**/ std::vector<int32_t>* evicted = nullptr);
+		// Repacks every allocation, keeping their ids, and appends those that
+		// moved to moves. If they wouldn't all fit the layout is left as it was
+		// and it returns false.
+		bool defragment(/**[out]**/ std::vector<atlas_move_t>* moves = nullptr);
+
+		atlas_allocator_stats_t get_stats() const;
+
+	private:
+		struct span_t {
+			uint32_t x;
+			uint32_t width;
+		};
+
+		struct shelf_t {
+			uint32_t y;
+			uint32_t height;
+			uint32_t used;               // Live rects on it
+			std::vector<span_t> free;    // Sorted by x, never adjacent
+		};
+
+		struct entry_t {
+			bool live;
+			atlas_rect_t rect;           // Padded and aligned
+			uint32_t width;              // As asked for
+			uint32_t height;
+			uint64_t last_used;
+		};
+
+		uint32_t padded(uint32_t size) const;
+		bool place(uint32_t width, uint32_t height, /**[out]**/ atlas_rect_t* rect);
+		bool take_span(shelf_t& shelf, uint32_t width, /**[out]**/ uint32_t* x);
+		void give_span(shelf_t& shelf, uint32_t x, uint32_t width);
+		size_t find_shelf(uint32_t y) const;
+		void collapse_empty(size_t index);
+
+		uint32_t _width = 0;
+		uint32_t _height = 0;
+		uint32_t _alignment = 1;
+		uint32_t _padding = 0;
+		uint32_t _top = 0;               // Height claimed by shelves
+		uint64_t _frame = 0;             // Latest touch, given to new allocations
+		std::vector<shelf_t> _shelves;   // Sorted by y, contiguous from 0 to _top
+		std::vector<entry_t> _entries;   // Indexed by id
+		std::vector<int32_t> _free_ids;
+		atlas_allocator_stats_t _stats = {};
+	};
+
+} // namespace nakamir
@@ -0,0 +1,718 @@
+#include "bench.h"
+#include "../cpu_features.h"
+#include "../h264_nal.h"
+#include "../nv12_convert.h"
+#include "../parallel_for.h"
+#include "../plane_copy.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace nakamir {
+
+	struct bench_case_t {
+		std::string name;
+		bench_fn fn;
+		void* context;
+	};
+
+	struct bench_result_t {
+		std::string name;
+		const char* skip_reason;
+		uint64_t iterations;          // Per repetition
+		std::vector<double> ns_per_iteration;
+		uint64_t bytes_per_iteration;
+		uint64_t items_per_iteration;
+		std::vector<bench_counter_t> counters;
+		double min_ns;
+		double median_ns;
+		double mean_ns;
+		double stddev_ns;
+	};
+
+	enum bench_format_ {
+		bench_format_text,
+		bench_format_json,
+		bench_format_csv,
+	};
+
+	struct bench_options_t {
+		const char* filter = nullptr;
+		int32_t repetitions = 5;
+		double min_time = 0.1;        // Seconds per repetition
+		bench_format_ format = bench_format_text;
+		int32_t pin_cpu = -1;
+		bool list = false;
+		const char* abr_trace = nullptr;
+	};
+
+	static std::vector<bench_case_t>& bench_cases()
+	{
+		static std::vector<bench_case_t> cases;
+		return cases;
+	}
+
+	void bench_register(const char* name, bench_fn fn, void* context)
+	{
+		bench_cases().push_back({ name, fn, context });
+	}
+
+	uint64_t bench_now_ns()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	void bench_skip(bench_state_t* state, const char* reason)
+	{
+		state->skip_reason = reason;
+	}
+
+	void bench_counter(bench_state_t* state, const char* name, double value)
+	{
+		for (uint32_t i = 0; i < state->counter_count; i++)
+		{
+			if (strcmp(state->counters[i].name, name) == 0)
+			{
+				state->counters[i].value = value;
+				return;
+			}
+		}
+		if (state->counter_count < bench_max_counters)
+			state->counters[state->counter_count++] = { name, value };
+	}
+
+	void bench_do_not_optimize(const void* value)
+	{
+		static std::atomic<const void*> sink;
+		sink.store(value, std::memory_order_relaxed);
+	}
+
+	///////////////////////////////////////////
+	// Inputs
+	///////////////////////////////////////////
+
+	static uint64_t bench_next_random(uint64_t* state)
+	{
+		// xorshift64*, plenty for filler data
+		uint64_t x = *state;
+		x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+		*state = x;
+		return x * 0x2545F4914F6CDD1DULL;
+	}
+
+	void bench_fill_random(uint8_t* data, size_t size, uint64_t seed)
+	{
+		uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8)
+		{
+			uint64_t value = bench_next_random(&state);
+			memcpy(data + i, &value, 8);
+		}
+		uint64_t value = bench_next_random(&state);
+		memcpy(data + i, &value, size - i);
+	}
+
+	void bench_fill_nv12(uint8_t* data, int32_t width, int32_t height, int32_t stride, uint64_t seed)
+	{
+		uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+		uint8_t* uv_plane = data + static_cast<size_t>(stride) * height;
+		for (int32_t y = 0; y < height; y++)
+		{
+			uint8_t* row = data + static_cast<size_t>(stride) * y;
+			for (int32_t x = 0; x < width; x++)
+				row[x] = static_cast<uint8_t>(16 + ((x + y) * 219) / (width + height) + (bench_next_random(&state) & 7));
+		}
+		for (int32_t y = 0; y < nv12_chroma_rows(height); y++)
+		{
+			uint8_t* row = uv_plane + static_cast<size_t>(stride) * y;
+			for (int32_t x = 0; x < nv12_chroma_row_bytes(width); x += 2)
+			{
+				row[x] = static_cast<uint8_t>(96 + (x * 64) / width + (bench_next_random(&state) & 3));
+				row[x + 1] = static_cast<uint8_t>(160 - (y * 64) / height + (bench_next_random(&state) & 3));
+			}
+		}
+	}
+
+	// 1920x1080 High profile level 4.0, and a matching PPS
+	static const uint8_t bench_sps[] = { 0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40, 0x78, 0x02, 0x27, 0xe5, 0xc0, 0x44, 0x00, 0x00, 0x03, 0x00, 0x04, 0x00, 0x00, 0x03, 0x00, 0xf0, 0x3c, 0x60, 0xc6, 0x58 };
+	static const uint8_t bench_pps[] = { 0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0 };
+
+	static void bench_append_nal(std::vector<uint8_t>* data, const uint8_t* nal, size_t size)
+	{
+		static const uint8_t start_code[] = { 0, 0, 0, 1 };
+		data->insert(data->end(), start_code, start_code + sizeof(start_code));
+		data->insert(data->end(), nal, nal + size);
+	}
+
+	void bench_make_h264_stream(bench_h264_stream_t* stream, uint32_t frames, uint32_t gop_length, size_t p_frame_bytes, uint64_t seed)
+	{
+		stream->data.clear();
+		stream->frame_offsets.clear();
+		uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+		std::vector<uint8_t> nal;
+		for (uint32_t f = 0; f < frames; f++)
+		{
+			stream->frame_offsets.push_back(stream->data.size());
+			bool idr = gop_length == 0 || f % gop_length == 0;
+			if (idr)
+			{
+				bench_append_nal(&stream->data, bench_sps, sizeof(bench_sps));
+				bench_append_nal(&stream->data, bench_pps, sizeof(bench_pps));
+			}
+
+			// Payload size varies by +-25% around the target
+			size_t payload = (idr ? p_frame_bytes * 8 : p_frame_bytes);
+			payload = payload * 3 / 4 + bench_next_random(&state) % (payload / 2 + 1);
+
+			nal.clear();
+			nal.push_back(idr ? 0x65 : 0x41);
+			uint32_t zeros = 0;
+			for (size_t i = 0; i < payload; i++)
+			{
+				// Entropy coded data is mostly high entropy, with zero runs now and then
+				uint64_t r = bench_next_random(&state);
+				uint8_t byte = (r & 0xF00) == 0 ? 0 : static_cast<uint8_t>(r >> 56);
+				if (zeros >= 2 && byte <= 3)
+				{
+					nal.push_back(3);
+					zeros = 0;
+				}
+				nal.push_back(byte);
+				zeros = byte == 0 ? zeros + 1 : 0;
+			}
+			nal.push_back(0x80); // rbsp_stop_one_bit, so the NAL never ends in zero
+			bench_append_nal(&stream->data, nal.data(), nal.size());
+		}
+		stream->frame_offsets.push_back(stream->data.size());
+	}
+
+	static void bench_put32(std::vector<uint8_t>* v, uint32_t value)
+	{
+		for (int32_t shift = 24; shift >= 0; shift -= 8)
+			v->push_back(static_cast<uint8_t>(value >> shift));
+	}
+
+	static void bench_put16(std::vector<uint8_t>* v, uint32_t value)
+	{
+		v->push_back(static_cast<uint8_t>(value >> 8));
+		v->push_back(static_cast<uint8_t>(value));
+	}
+
+	static void bench_put_zeros(std::vector<uint8_t>* v, size_t count)
+	{
+		v->insert(v->end(), count, 0);
+	}
+
+	// Opens a box, returning where its size goes once bench_end_box closes it
+	static size_t bench_begin_box(std::vector<uint8_t>* v, const char* type, int32_t full_box_version = -1)
+	{
+		size_t start = v->size();
+		bench_put32(v, 0);
+		v->insert(v->end(), type, type + 4);
+		if (full_box_version >= 0)
+			bench_put32(v, static_cast<uint32_t>(full_box_version) << 24);
+		return start;
+	}
+
+	static void bench_end_box(std::vector<uint8_t>* v, size_t start)
+	{
+		uint32_t size = static_cast<uint32_t>(v->size() - start);
+		for (int32_t i = 0; i < 4; i++)
+			(*v)[start + i] = static_cast<uint8_t>(size >> (24 - i * 8));
+	}
+
+	void bench_make_mp4(std::vector<uint8_t>* file, const bench_h264_stream_t& stream, uint32_t gop_length, uint32_t chunk_frames)
+	{
+		const uint32_t timescale = 90000, frame_duration = 3000;
+		const uint32_t width = 1920, height = 1080;
+		std::vector<uint8_t>& v = *file;
+		v.clear();
+
+		size_t box = bench_begin_box(&v, "ftyp");
+		v.insert(v.end(), { 'i', 's', 'o', 'm', 0, 0, 2, 0, 'i', 's', 'o', 'm', 'a', 'v', 'c', '1' });
+		bench_end_box(&v, box);
+
+		// Samples as AVCC, without the parameter sets that go in avcC
+		std::vector<uint32_t> sample_sizes;
+		std::vector<uint32_t> chunk_offsets;
+		size_t mdat = bench_begin_box(&v, "mdat");
+		uint32_t frames = static_cast<uint32_t>(stream.frame_offsets.size() - 1);
+		for (uint32_t f = 0; f < frames; f++)
+		{
+			if (f % chunk_frames == 0)
+				chunk_offsets.push_back(static_cast<uint32_t>(v.size()));
+			size_t sample_start = v.size();
+			const uint8_t* frame = stream.data.data() + stream.frame_offsets[f];
+			size_t frame_size = stream.frame_offsets[f + 1] - stream.frame_offsets[f];
+			size_t offset = 0;
+			h264_nal_t nal;
+			while (h264_next_nal(frame, frame_size, &offset, &nal))
+			{
+				if (nal.type == h264_nal_sps || nal.type == h264_nal_pps)
+					continue;
+				bench_put32(&v, static_cast<uint32_t>(nal.size));
+				v.insert(v.end(), nal.data, nal.data + nal.size);
+			}
+			sample_sizes.push_back(static_cast<uint32_t>(v.size() - sample_start));
+		}
+		bench_end_box(&v, mdat);
+
+		size_t moov = bench_begin_box(&v, "moov");
+		box = bench_begin_box(&v, "mvhd", 0);
+		bench_put_zeros(&v, 8);
+		bench_put32(&v, timescale);
+		bench_put32(&v, frames * frame_duration);
+		bench_put_zeros(&v, 80);
+		bench_end_box(&v, box);
+
+		size_t trak = bench_begin_box(&v, "trak");
+		box = bench_begin_box(&v, "tkhd", 0);
+		bench_put_zeros(&v, 8);
+		bench_put32(&v, 1);
+		bench_put_zeros(&v, 4);
+		bench_put32(&v, frames * frame_duration);
+		bench_put_zeros(&v, 52);
+		bench_put32(&v, width << 16);
+		bench_put32(&v, height << 16);
+		bench_end_box(&v, box);
+
+		size_t mdia = bench_begin_box(&v, "mdia");
+		box = bench_begin_box(&v, "mdhd", 0);
+		bench_put_zeros(&v, 8);
+		bench_put32(&v, timescale);
+		bench_put32(&v, frames * frame_duration);
+		bench_put_zeros(&v, 4);
+		bench_end_box(&v, box);
+		box = bench_begin_box(&v, "hdlr", 0);
+		bench_put_zeros(&v, 4);
+		v.insert(v.end(), { 'v', 'i', 'd', 'e' });
+		bench_put_zeros(&v, 13);
+		bench_end_box(&v, box);
+
+		size_t minf = bench_begin_box(&v, "minf");
+		size_t stbl = bench_begin_box(&v, "stbl");
+		size_t stsd = bench_begin_box(&v, "stsd", 0);
+		bench_put32(&v, 1);
+		size_t avc1 = bench_begin_box(&v, "avc1");
+		bench_put_zeros(&v, 6);
+		bench_put16(&v, 1);
+		bench_put_zeros(&v, 16);
+		bench_put16(&v, width);
+		bench_put16(&v, height);
+		bench_put32(&v, 0x00480000);
+		bench_put32(&v, 0x00480000);
+		bench_put_zeros(&v, 4);
+		bench_put16(&v, 1);
+		bench_put_zeros(&v, 32);
+		bench_put16(&v, 0x18);
+		bench_put16(&v, 0xFFFF);
+		box = bench_begin_box(&v, "avcC");
+		v.insert(v.end(), { 1, bench_sps[1], bench_sps[2], bench_sps[3], 0xFF, 0xE1 });
+		bench_put16(&v, sizeof(bench_sps));
+		v.insert(v.end(), bench_sps, bench_sps + sizeof(bench_sps));
+		v.push_back(1);
+		bench_put16(&v, sizeof(bench_pps));
+		v.insert(v.end(), bench_pps, bench_pps + sizeof(bench_pps));
+		bench_end_box(&v, box);
+		bench_end_box(&v, avc1);
+		bench_end_box(&v, stsd);
+
+		box = bench_begin_box(&v, "stts", 0);
+		bench_put32(&v, 1);
+		bench_put32(&v, frames);
+		bench_put32(&v, frame_duration);
+		bench_end_box(&v, box);
+
+		box = bench_begin_box(&v, "stss", 0);
+		bench_put32(&v, (frames + gop_length - 1) / gop_length);
+		for (uint32_t f = 0; f < frames; f += gop_length)
+			bench_put32(&v, f + 1);
+		bench_end_box(&v, box);
+
+		box = bench_begin_box(&v, "stsz", 0);
+		bench_put32(&v, 0);
+		bench_put32(&v, frames);
+		for (uint32_t size : sample_sizes)
+			bench_put32(&v, size);
+		bench_end_box(&v, box);
+
+		// The last chunk may be short, which takes a second run
+		uint32_t full_chunks = frames / chunk_frames;
+		uint32_t last_chunk = frames % chunk_frames;
+		box = bench_begin_box(&v, "stsc", 0);
+		bench_put32(&v, last_chunk && full_chunks ? 2 : 1);
+		if (full_chunks)
+		{
+			bench_put32(&v, 1);
+			bench_put32(&v, chunk_frames);
+			bench_put32(&v, 1);
+		}
+		if (last_chunk)
+		{
+			bench_put32(&v, full_chunks + 1);
+			bench_put32(&v, last_chunk);
+			bench_put32(&v, 1);
+		}
+		bench_end_box(&v, box);
+
+		box = bench_begin_box(&v, "stco", 0);
+		bench_put32(&v, static_cast<uint32_t>(chunk_offsets.size()));
+		for (uint32_t offset : chunk_offsets)
+			bench_put32(&v, offset);
+		bench_end_box(&v, box);
+
+		bench_end_box(&v, stbl);
+		bench_end_box(&v, minf);
+		bench_end_box(&v, mdia);
+		bench_end_box(&v, trak);
+		bench_end_box(&v, moov);
+	}
+
+	///////////////////////////////////////////
+	// Driver
+	///////////////////////////////////////////
+
+	static bool bench_pin_thread(int32_t cpu)
+	{
+#ifdef _WIN32
+		if (cpu >= static_cast<int32_t>(sizeof(DWORD_PTR) * 8))
+			return false;
+		return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu) != 0;
+#elif defined(__linux__)
+		if (cpu >= CPU_SETSIZE)
+			return false;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		(void)cpu;
+		return false;
+#endif
+	}
+
+	static uint64_t bench_run_once(const bench_case_t& c, uint64_t iterations, bench_state_t* state)
+	{
+		*state = {};
+		state->iterations = iterations;
+		c.fn(state, c.context);
+		if (state->skip_reason)
+			return 0;
+		// A case that never ran its loop reports nothing useful
+		if (state->done <= iterations)
+		{
+			state->skip_reason = "loop did not complete";
+			return 0;
+		}
+		return state->end_ns - state->start_ns;
+	}
+
+	static void bench_run_case(const bench_case_t& c, const bench_options_t& options, bench_result_t* result)
+	{
+		*result = {};
+		result->name = c.name;
+
+		// Grow the iteration count until one repetition takes min_time, which
+		// doubles as the warm up
+		uint64_t min_ns = static_cast<uint64_t>(options.min_time * 1e9);
+		uint64_t iterations = 1;
+		bench_state_t state;
+		for (;;)
+		{
+			uint64_t elapsed = bench_run_once(c, iterations, &state);
+			if (state.skip_reason)
+			{
+				result->skip_reason = state.skip_reason;
+				return;
+			}
+			if (elapsed >= min_ns || iterations >= (1ull << 40))
+				break;
+			double scale = elapsed ? 1.4 * min_ns / elapsed : 100;
+			if (scale > 100) scale = 100;
+			if (scale < 2) scale = 2;
+			iterations = static_cast<uint64_t>(iterations * scale);
+		}
+
+		result->iterations = iterations;
+		result->bytes_per_iteration = state.bytes_per_iteration;
+		result->items_per_iteration = state.items_per_iteration;
+		for (int32_t r = 0; r < options.repetitions; r++)
+		{
+			uint64_t elapsed = bench_run_once(c, iterations, &state);
+			if (state.skip_reason)
+			{
+				result->skip_reason = state.skip_reason;
+				return;
+			}
+			result->ns_per_iteration.push_back(static_cast<double>(elapsed) / iterations);
+		}
+		result->counters.assign(state.counters, state.counters + state.counter_count);
+
+		std::vector<double> sorted = result->ns_per_iteration;
+		std::sort(sorted.begin(), sorted.end());
+		size_t n = sorted.size();
+		result->min_ns = sorted[0];
+		result->median_ns = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+		double sum = 0;
+		for (double ns : sorted) sum += ns;
+		result->mean_ns = sum / n;
+		double variance = 0;
+		for (double ns : sorted) variance += (ns - result->mean_ns) * (ns - result->mean_ns);
+		result->stddev_ns = n > 1 ? sqrt(variance / (n - 1)) : 0;
+	}
+
+	static std::string bench_cpu_feature_names()
+	{
+		static const struct { cpu_feature_ feature; const char* name; } names[] = {
+			{ cpu_feature_sse2, "sse2" }, { cpu_feature_ssse3, "ssse3" }, { cpu_feature_sse41, "sse4.1" },
+			{ cpu_feature_avx2, "avx2" }, { cpu_feature_neon, "neon" },
+		};
+		std::string result;
+		for (const auto& n : names)
+		{
+			if (!cpu_has(n.feature))
+				continue;
+			if (!result.empty()) result += ' ';
+			result += n.name;
+		}
+		return result;
+	}
+
+	static const char* bench_compiler()
+	{
+#if defined(__clang__)
+		return "clang " __clang_version__;
+#elif defined(__GNUC__)
+		return "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+		return "msvc";
+#else
+		return "unknown";
+#endif
+	}
+
+#ifdef NDEBUG
+	static const bool bench_optimized = true;
+#else
+	static const bool bench_optimized = false;
+#endif
+
+	static double bench_per_second(uint64_t per_iteration, double ns)
+	{
+		return per_iteration && ns > 0 ? per_iteration * 1e9 / ns : 0;
+	}
+
+	static void bench_print_text(const std::vector<bench_result_t>& results)
+	{
+		printf("%-48s %14s %14s %8s %12s %14s\n", "benchmark", "median", "min", "+-%", "MB/s", "items/s");
+		for (const bench_result_t& r : results)
+		{
+			if (r.skip_reason)
+			{
+				printf("%-48s skipped: %s\n", r.name.c_str(), r.skip_reason);
+				continue;
+			}
+			char mbps[32] = "-", items[32] = "-";
+			if (r.bytes_per_iteration)
+				snprintf(mbps, sizeof(mbps), "%.1f", bench_per_second(r.bytes_per_iteration, r.median_ns) / (1024.0 * 1024.0));
+			if (r.items_per_iteration)
+				snprintf(items, sizeof(items), "%.0f", bench_per_second(r.items_per_iteration, r.median_ns));
+			printf("%-48s %11.1f ns %11.1f ns %7.1f%% %12s %14s", r.name.c_str(), r.median_ns, r.min_ns,
+				r.mean_ns > 0 ? 100.0 * r.stddev_ns / r.mean_ns : 0.0, mbps, items);
+			for (const bench_counter_t& counter : r.counters)
+				printf("  %s=%.4g", counter.name, counter.value);
+			printf("\n");
+		}
+	}
+
+	static void bench_print_json(const std::vector<bench_result_t>& results, const bench_options_t& options)
+	{
+		printf("{\n\t\"context\": {\n");
+		printf("\t\t\"cpu_features\": \"%s\",\n", bench_cpu_feature_names().c_str());
+		printf("\t\t\"threads\": %d,\n", parallel_for_thread_count());
+		printf("\t\t\"pinned_cpu\": %d,\n", options.pin_cpu);
+		printf("\t\t\"compiler\": \"%s\",\n", bench_compiler());
+		printf("\t\t\"optimized\": %s,\n", bench_optimized ? "true" : "false");
+		printf("\t\t\"repetitions\": %d,\n", options.repetitions);
+		printf("\t\t\"min_time\": %.3f,\n", options.min_time);
+		printf("\t\t\"plane_copy_impl\": \"%s\",\n", plane_copy_impl_name(plane_copy_get_impl()));
+		printf("\t\t\"nv12_convert_impl\": \"%s\",\n", nv12_convert_impl_name(nv12_convert_get_impl()));
+		printf("\t\t\"h264_scan_impl\": \"%s\"\n", h264_scan_impl_name(h264_scan_get_impl()));
+		printf("\t},\n\t\"benchmarks\": [");
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const bench_result_t& r = results[i];
+			printf("%s\n\t\t{\"name\": \"%s\", ", i ? "," : "", r.name.c_str());
+			if (r.skip_reason)
+			{
+				printf("\"skipped\": \"%s\"}", r.skip_reason);
+				continue;
+			}
+			printf("\"iterations\": %llu, \"median_ns\": %.2f, \"min_ns\": %.2f, \"mean_ns\": %.2f, \"stddev_ns\": %.2f, "
+				"\"bytes_per_second\": %.0f, \"items_per_second\": %.1f, \"runs_ns\": [",
+				static_cast<unsigned long long>(r.iterations), r.median_ns, r.min_ns, r.mean_ns, r.stddev_ns,
+				bench_per_second(r.bytes_per_iteration, r.median_ns), bench_per_second(r.items_per_iteration, r.median_ns));
+			for (size_t j = 0; j < r.ns_per_iteration.size(); j++)
+				printf("%s%.2f", j ? ", " : "", r.ns_per_iteration[j]);
+			printf("]");
+			if (!r.counters.empty())
+			{
+				printf(", \"counters\": {");
+				for (size_t j = 0; j < r.counters.size(); j++)
+					printf("%s\"%s\": %g", j ? ", " : "", r.counters[j].name, r.counters[j].value);
+				printf("}");
+			}
+			printf("}");
+		}
+		printf("\n\t]\n}\n");
+	}
+
+	static void bench_print_csv(const std::vector<bench_result_t>& results)
+	{
+		printf("name,iterations,median_ns,min_ns,mean_ns,stddev_ns,bytes_per_second,items_per_second,skipped,counters\n");
+		for (const bench_result_t& r : results)
+		{
+			if (r.skip_reason)
+			{
+				printf("%s,,,,,,,,%s,\n", r.name.c_str(), r.skip_reason);
+				continue;
+			}
+			printf("%s,%llu,%.2f,%.2f,%.2f,%.2f,%.0f,%.1f,,", r.name.c_str(), static_cast<unsigned long long>(r.iterations),
+				r.median_ns, r.min_ns, r.mean_ns, r.stddev_ns,
+				bench_per_second(r.bytes_per_iteration, r.median_ns), bench_per_second(r.items_per_iteration, r.median_ns));
+			// name=value pairs, ; separated, so the column count stays fixed
+			for (size_t j = 0; j < r.counters.size(); j++)
+				printf("%s%s=%g", j ? ";" : "", r.counters[j].name, r.counters[j].value);
+			printf("\n");
+		}
+	}
+
+	static void bench_usage()
+	{
+		fprintf(stderr,
+			"usage: skmf_bench [options]\n"
+			"  --filter TEXT      only run benchmarks whose name contains TEXT\n"
+			"  --list             list benchmark names and exit\n"
+			"  --format FORMAT    text (default), json or csv, written to stdout\n"
+			"  --repetitions N    timed runs per benchmark (default 5)\n"
+			"  --min-time SEC     minimum length of each run (default 0.1)\n"
+			"  --pin CPU          pin the benchmark thread to a CPU; worker threads\n"
+			"                     (parallel_for, transform_driver) are not pinned\n"
+			"  --abr-trace FILE   also replay this bandwidth trace as abr/trace/file,\n"
+			"                     one \"seconds kbps\" pair per line\n");
+	}
+
+	static bool bench_parse_options(int argc, char** argv, bench_options_t* options)
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			const char* arg = argv[i];
+			const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+			if (strcmp(arg, "--list") == 0)
+			{
+				options->list = true;
+				continue;
+			}
+			if (!value)
+				return false;
+			i++;
+			if (strcmp(arg, "--filter") == 0)
+				options->filter = value;
+			else if (strcmp(arg, "--repetitions") == 0)
+				options->repetitions = atoi(value);
+			else if (strcmp(arg, "--min-time") == 0)
+				options->min_time = atof(value);
+			else if (strcmp(arg, "--pin") == 0)
+				options->pin_cpu = atoi(value);
+			else if (strcmp(arg, "--abr-trace") == 0)
+				options->abr_trace = value;
+			else if (strcmp(arg, "--format") == 0)
+			{
+				if (strcmp(value, "text") == 0) options->format = bench_format_text;
+				else if (strcmp(value, "json") == 0) options->format = bench_format_json;
+				else if (strcmp(value, "csv") == 0) options->format = bench_format_csv;
+				else return false;
+			}
+			else
+				return false;
+		}
+		return options->repetitions > 0 && options->min_time >= 0;
+	}
+
+	static int bench_main(int argc, char** argv)
+	{
+		bench_options_t options;
+		if (!bench_parse_options(argc, argv, &options))
+		{
+			bench_usage();
+			return 2;
+		}
+
+		bench_register_memory();
+		bench_register_pipeline();
+		bench_register_h264();
+		bench_register_network(options.abr_trace);
+
+		std::vector<const bench_case_t*> selected;
+		for (const bench_case_t& c : bench_cases())
+		{
+			if (!options.filter || strstr(c.name.c_str(), options.filter))
+				selected.push_back(&c);
+		}
+		if (options.list)
+		{
+			for (const bench_case_t* c : selected)
+				printf("%s\n", c->name.c_str());
+			return 0;
+		}
+
+		if (options.pin_cpu >= 0 && !bench_pin_thread(options.pin_cpu))
+		{
+			fprintf(stderr, "Could not pin to CPU %d\n", options.pin_cpu);
+			return 1;
+		}
+		if (!bench_optimized)
+			fprintf(stderr, "Warning: this is an unoptimized build, numbers won't mean much\n");
+
+		std::vector<bench_result_t> results(selected.size());
+		for (size_t i = 0; i < selected.size(); i++)
+		{
+			fprintf(stderr, "[%zu/%zu] %s\n", i + 1, selected.size(), selected[i]->name.c_str());
+			bench_run_case(*selected[i], options, &results[i]);
+		}
+
+		switch (options.format)
+		{
+		case bench_format_json: bench_print_json(results, options); break;
+		case bench_format_csv:  bench_print_csv(results); break;
+		default:                bench_print_text(results); break;
+		}
+		return 0;
+	}
+
+} // namespace nakamir
+
+int main(int argc, char** argv)
+{
+	return nakamir::bench_main(argc, argv);
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "../aligned_memory.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Small self-contained benchmark harness for skmf_bench. Every case runs its
+// timed loop for a calibrated number of iterations, several times over, and
+// the driver in bench.cpp reports per-iteration times and throughput as text,
+// JSON or CSV. Inputs are synthetic and seeded, so runs are comparable across
+// machines and commits.
+
+namespace nakamir {
+
+	// A figure a case reports besides time, e.g. bytes copied per frame
+	struct bench_counter_t {
+		const char* name;
+		double value;
+	};
+	const uint32_t bench_max_counters = 4;
+
+	struct bench_state_t {
+		uint64_t iterations;          // Loop bodies to run in this repetition
+		uint64_t done;
+		uint64_t start_ns;
+		uint64_t end_ns;
+		uint64_t bytes_per_iteration; // Set by the case for MB/s, 0 for none
+		uint64_t items_per_iteration; // Set by the case for items/s, 0 for none
+		const char* skip_reason;      // Set through bench_skip
+		bench_counter_t counters[bench_max_counters]; // Set through bench_counter
+		uint32_t counter_count;
+	};
+
+	typedef void(*bench_fn)(bench_state_t* state, void* context);
+
+	// Adds a case. Names are slash separated, group first, e.g.
+	// "plane_copy/1080p/avx2", and --filter matches on any substring.
+	void bench_register(const char* name, bench_fn fn, void* context = nullptr);
+
+	uint64_t bench_now_ns();
+
+	// Drives the timed loop: for (; bench_loop(state);) { ... }. Setup before
+	// the first call and teardown after the last aren't timed.
+	inline bool bench_loop(bench_state_t* state)
+	{
+		if (state->done == 0)
+			state->start_ns = bench_now_ns();
+		if (state->done++ < state->iterations)
+			return true;
+		state->end_ns = bench_now_ns();
+		return false;
+	}
+
+	// Marks the case as not runnable here, e.g. a SIMD path the CPU lacks
+	void bench_skip(bench_state_t* state, const char* reason);
+
+	// Reports a figure alongside the timings, from the last timed run. Setting
+	// a name again replaces its value; past bench_max_counters they're ignored.
+	void bench_counter(bench_state_t* state, const char* name, double value);
+
+	// Keeps the compiler from discarding a result
+	void bench_do_not_optimize(const void* value);
+
+	// Page aligned scratch memory for inputs and outputs
+	class bench_buffer {
+	public:
+		explicit bench_buffer(size_t size) : _data(static_cast<uint8_t*>(aligned_malloc(size, 4096))), _size(size) {}
+		~bench_buffer() { aligned_free(_data); }
+
+		bench_buffer(const bench_buffer&) = delete;
+		bench_buffer& operator=(const bench_buffer&) = delete;
+
+		uint8_t* data() const { return _data; }
+		size_t size() const { return _size; }
+
+	private:
+		uint8_t* _data;
+		size_t _size;
+	};
+
+	// Fixed seed inputs. Random bytes, and a frame with smooth gradients plus
+	// noise that compresses and converts like camera content.
+	void bench_fill_random(/**[out]**/ uint8_t* data, size_t size, uint64_t seed);
+	void bench_fill_nv12(/**[out]**/ uint8_t* data, int32_t width, int32_t height, int32_t stride, uint64_t seed);
+
+	// An Annex-B H.264 stream shaped like encoder output: SPS and PPS before
+	// each IDR, one slice per frame, IDR frames gop_length apart and about
+	// eight times the size of the others, with emulation prevention applied to
+	// the random payloads so start codes only appear at NAL boundaries
+	struct bench_h264_stream_t {
+		std::vector<uint8_t> data;
+		std::vector<size_t> frame_offsets; // Start of each access unit, plus the end
+	};
+	void bench_make_h264_stream(/**[out]**/ bench_h264_stream_t* stream, uint32_t frames, uint32_t gop_length, size_t p_frame_bytes, uint64_t seed);
+
+	// A progressive MP4 holding the stream above as a single avc1 track at
+	// 30 fps, in chunks of chunk_frames samples, with the moov at the end
+	void bench_make_mp4(/**[out]**/ std::vector<uint8_t>* file, const bench_h264_stream_t& stream, uint32_t gop_length, uint32_t chunk_frames);
+
+	// Registration of each group of cases, called once from main
+	void bench_register_memory();
+	void bench_register_pipeline();
+	void bench_register_h264();
+	// abr_trace is a bandwidth trace file to replay besides the built in
+	// ones, nullptr for none
+	void bench_register_network(const char* abr_trace);
+
+} // namespace nakamir
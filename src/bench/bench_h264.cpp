@@ -0,0 +1,227 @@
+#include "bench.h"
+#include "../h264_nal.h"
+#include "../mp4_demux.h"
+#include "../mp4_recorder.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// Bitstream work: finding NAL units in encoder output, indexing and
+// reading samples out of an MP4, and recording encoder output into one
+
+namespace nakamir {
+
+	// 10 seconds of 30 fps with a one second GOP, ~40KB P frames (about 10Mbps)
+	const uint32_t bench_stream_frames = 300;
+	const uint32_t bench_stream_gop = 30;
+	const size_t bench_stream_p_frame_bytes = 40 * 1024;
+
+	static const bench_h264_stream_t& bench_stream()
+	{
+		static bench_h264_stream_t stream;
+		if (stream.data.empty())
+			bench_make_h264_stream(&stream, bench_stream_frames, bench_stream_gop, bench_stream_p_frame_bytes, 4);
+		return stream;
+	}
+
+	static const std::vector<uint8_t>& bench_mp4()
+	{
+		static std::vector<uint8_t> file;
+		if (file.empty())
+			bench_make_mp4(&file, bench_stream(), bench_stream_gop, 10);
+		return file;
+	}
+
+	///////////////////////////////////////////
+	// NAL scanning
+	///////////////////////////////////////////
+
+	static void bench_h264_scan(bench_state_t* state, void* context)
+	{
+		h264_scan_impl_ impl = *static_cast<const h264_scan_impl_*>(context);
+		if (!h264_scan_set_impl(impl))
+		{
+			bench_skip(state, "not supported on this CPU");
+			return;
+		}
+
+		// Scan frame by frame, the way mf_scan_h264_sample sees encoder output
+		const bench_h264_stream_t& stream = bench_stream();
+		uint32_t frames = static_cast<uint32_t>(stream.frame_offsets.size() - 1);
+		uint32_t nals = 0;
+		state->bytes_per_iteration = stream.data.size();
+		state->items_per_iteration = frames;
+		for (; bench_loop(state);)
+		{
+			for (uint32_t f = 0; f < frames; f++)
+			{
+				h264_access_unit_info_t info = h264_scan_access_unit(stream.data.data() + stream.frame_offsets[f],
+					stream.frame_offsets[f + 1] - stream.frame_offsets[f]);
+				nals += info.nal_count;
+			}
+		}
+		bench_do_not_optimize(&nals);
+		h264_scan_set_impl(h264_scan_impl_auto);
+	}
+
+	///////////////////////////////////////////
+	// MP4 demux
+	///////////////////////////////////////////
+
+	static void bench_mp4_open(bench_state_t* state, void* /*context*/)
+	{
+		const std::vector<uint8_t>& file = bench_mp4();
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			mp4_demuxer demuxer;
+			if (!demuxer.open_memory(file.data(), file.size()))
+			{
+				bench_skip(state, "synthetic MP4 didn't parse");
+				return;
+			}
+			bench_do_not_optimize(&demuxer);
+		}
+	}
+
+	static void bench_mp4_read(bench_state_t* state, void* /*context*/)
+	{
+		// Everything mf_mp4_source does per sample short of creating the IMFSample:
+		// look it up, and rewrite it as Annex-B with the header on sync samples
+		const std::vector<uint8_t>& file = bench_mp4();
+		mp4_demuxer demuxer;
+		int32_t track = demuxer.open_memory(file.data(), file.size()) ? demuxer.find_track(mp4_fourcc('v', 'i', 'd', 'e')) : -1;
+		if (track < 0)
+		{
+			bench_skip(state, "synthetic MP4 didn't parse");
+			return;
+		}
+		const mp4_track_t& info = demuxer.tracks()[track];
+		std::vector<uint8_t> header = mp4_track_annexb_header(info);
+		std::vector<uint8_t> annexb;
+		size_t count = info.samples.count();
+
+		state->bytes_per_iteration = file.size();
+		state->items_per_iteration = count;
+		for (; bench_loop(state);)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				mp4_sample_t sample;
+				demuxer.get_sample(track, i, &sample);
+				size_t max_size = header.size() + mp4_annexb_max_size(sample.size, info.nal_length_size);
+				if (annexb.size() < max_size)
+					annexb.resize(max_size);
+				size_t offset = 0;
+				if (sample.sync)
+				{
+					memcpy(annexb.data(), header.data(), header.size());
+					offset = header.size();
+				}
+				mp4_avcc_to_annexb(sample.data, sample.size, info.nal_length_size, annexb.data() + offset);
+			}
+			bench_do_not_optimize(annexb.data());
+		}
+	}
+
+	static void bench_mp4_seek(bench_state_t* state, void* /*context*/)
+	{
+		const std::vector<uint8_t>& file = bench_mp4();
+		mp4_demuxer demuxer;
+		int32_t track = demuxer.open_memory(file.data(), file.size()) ? demuxer.find_track(mp4_fourcc('v', 'i', 'd', 'e')) : -1;
+		if (track < 0)
+		{
+			bench_skip(state, "synthetic MP4 didn't parse");
+			return;
+		}
+		const mp4_track_t& info = demuxer.tracks()[track];
+		uint64_t duration = info.samples.end_dts;
+		uint64_t pts = 0, found = 0;
+
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			// Stride through the file by a prime fraction so every seek lands somewhere new
+			pts = (pts + duration / 7 + 1) % duration;
+			found += demuxer.find_sync_sample(track, static_cast<int64_t>(pts));
+			found += demuxer.find_sample(track, static_cast<int64_t>(pts));
+		}
+		bench_do_not_optimize(&found);
+	}
+
+	///////////////////////////////////////////
+	// MP4 recording
+	///////////////////////////////////////////
+
+	static void bench_mp4_annexb_to_avcc(bench_state_t* state, void* /*context*/)
+	{
+		const bench_h264_stream_t& stream = bench_stream();
+		uint32_t frames = static_cast<uint32_t>(stream.frame_offsets.size() - 1);
+		std::vector<uint8_t> avcc(mp4_avcc_max_size(stream.data.size()));
+		state->bytes_per_iteration = stream.data.size();
+		state->items_per_iteration = frames;
+		for (; bench_loop(state);)
+		{
+			size_t offset = 0;
+			for (uint32_t f = 0; f < frames; f++)
+			{
+				offset += mp4_annexb_to_avcc(stream.data.data() + stream.frame_offsets[f], stream.frame_offsets[f + 1] - stream.frame_offsets[f],
+					1u << h264_nal_aud, avcc.data() + offset);
+			}
+			bench_do_not_optimize(avcc.data());
+		}
+	}
+
+	static void bench_mp4_record(bench_state_t* state, void* /*context*/)
+	{
+		// What the encoder thread pays per sample, disk included: the writer
+		// thread's stalls, if any, land in the timed loop
+		const bench_h264_stream_t& stream = bench_stream();
+		uint32_t frames = static_cast<uint32_t>(stream.frame_offsets.size() - 1);
+		const char* path = "skmf_bench_record.mp4";
+		const int64_t frame_duration = 10000000 / 30;
+		{
+			mp4_recorder probe;
+			if (!probe.open(path, 10000000))
+			{
+				bench_skip(state, "couldn't create the output file");
+				return;
+			}
+		}
+		state->bytes_per_iteration = stream.data.size();
+		state->items_per_iteration = frames;
+		for (; bench_loop(state);)
+		{
+			mp4_recorder recorder;
+			recorder.open(path, 10000000);
+			for (uint32_t f = 0; f < frames; f++)
+			{
+				recorder.write_sample(stream.data.data() + stream.frame_offsets[f], stream.frame_offsets[f + 1] - stream.frame_offsets[f],
+					f * frame_duration, f * frame_duration);
+			}
+			recorder.close();
+		}
+		std::remove(path);
+	}
+
+	void bench_register_h264()
+	{
+		static const struct { h264_scan_impl_ impl; const char* name; } scan_impls[] = {
+			{ h264_scan_impl_scalar, "scalar" }, { h264_scan_impl_sse2, "sse2" },
+			{ h264_scan_impl_avx2, "avx2" }, { h264_scan_impl_neon, "neon" },
+		};
+		static h264_scan_impl_ scan_configs[4];
+		for (int32_t i = 0; i < 4; i++)
+		{
+			scan_configs[i] = scan_impls[i].impl;
+			bench_register((std::string("h264/scan_access_units/") + scan_impls[i].name).c_str(), bench_h264_scan, &scan_configs[i]);
+		}
+
+		bench_register("mp4/open_memory", bench_mp4_open);
+		bench_register("mp4/read_annexb", bench_mp4_read);
+		bench_register("mp4/seek", bench_mp4_seek);
+		bench_register("mp4/annexb_to_avcc", bench_mp4_annexb_to_avcc);
+		bench_register("mp4/record", bench_mp4_record);
+	}
+
+} // namespace nakamir
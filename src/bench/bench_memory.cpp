@@ -0,0 +1,380 @@
+#include "bench.h"
+#include "../atlas_allocator.h"
+#include "../frame_pool.h"
+#include "../nv12_convert.h"
+#include "../nv12_scale.h"
+#include "../plane_copy.h"
+#include "../tile_diff.h"
+#include <string>
+#include <vector>
+
+// Per-frame memory work: the plane copy behind nv12_tex_set_buffer, color
+// conversion, scaling down to a panel's level of detail, where output samples come from, where tiles go in an atlas,
+// and finding which tiles of a frame need uploading at all
+
+namespace nakamir {
+
+	const int32_t bench_width = 1920;
+	const int32_t bench_height = 1080;
+	// Mapped D3D11 textures come back with a padded RowPitch; this is a typical one
+	const int32_t bench_texture_pitch = 2048;
+
+	///////////////////////////////////////////
+	// Plane copy
+	///////////////////////////////////////////
+
+	struct bench_plane_copy_t {
+		plane_copy_impl_ impl;
+		bool nontemporal;
+	};
+
+	static void bench_plane_copy(bench_state_t* state, void* context)
+	{
+		const bench_plane_copy_t* config = static_cast<const bench_plane_copy_t*>(context);
+		if (!plane_copy_set_impl(config->impl))
+		{
+			bench_skip(state, "not supported on this CPU");
+			return;
+		}
+		size_t threshold = plane_copy_get_nontemporal_threshold();
+		plane_copy_set_nontemporal_threshold(config->nontemporal ? 1 : 0);
+
+		// Packed decoder output into a texture laid out like nv12_tex_set_buffer's
+		int32_t src_stride = nv12_packed_stride(bench_width);
+		bench_buffer src(nv12_packed_size(bench_width, bench_height));
+		bench_buffer dst(static_cast<size_t>(bench_texture_pitch) * (bench_height + nv12_chroma_rows(bench_height)));
+		bench_fill_nv12(src.data(), bench_width, bench_height, src_stride, 1);
+		uint8_t* src_uv = src.data() + static_cast<size_t>(src_stride) * bench_height;
+		uint8_t* dst_uv = dst.data() + static_cast<size_t>(bench_texture_pitch) * bench_height;
+
+		state->bytes_per_iteration = nv12_packed_size(bench_width, bench_height);
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			nv12_copy(dst.data(), bench_texture_pitch, dst_uv, bench_texture_pitch,
+				src.data(), src_stride, src_uv, src_stride, bench_width, bench_height);
+			bench_do_not_optimize(dst.data());
+		}
+
+		plane_copy_set_nontemporal_threshold(threshold);
+		plane_copy_set_impl(plane_copy_impl_auto);
+	}
+
+	///////////////////////////////////////////
+	// Dirty tiles
+	///////////////////////////////////////////
+
+	struct bench_tile_diff_t {
+		tile_diff_impl_ impl;
+		uint32_t changed_tiles;   // Flipped between every frame
+	};
+
+	static void bench_tile_diff(bench_state_t* state, void* context)
+	{
+		const bench_tile_diff_t* config = static_cast<const bench_tile_diff_t*>(context);
+		if (!tile_diff_set_impl(config->impl))
+		{
+			bench_skip(state, "not supported on this CPU");
+			return;
+		}
+
+		int32_t stride = nv12_packed_stride(bench_width);
+		bench_buffer frame(nv12_packed_size(bench_width, bench_height));
+		bench_fill_nv12(frame.data(), bench_width, bench_height, stride, 1);
+		uint8_t* frame_uv = frame.data() + static_cast<size_t>(stride) * bench_height;
+
+		// Static content compares every byte of both planes, and anything that
+		// changed costs a copy into the reference on top
+		tile_differ differ(bench_width, bench_height);
+		std::vector<tile_diff_rect_t> dirty;
+		differ.diff(frame.data(), stride, frame_uv, stride, &dirty);
+		uint32_t tiles_x = (bench_width + tile_diff_size - 1) / tile_diff_size;
+
+		state->bytes_per_iteration = nv12_packed_size(bench_width, bench_height);
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			for (uint32_t i = 0; i < config->changed_tiles; i++)
+			{
+				size_t x = (i % tiles_x) * tile_diff_size;
+				size_t y = (i / tiles_x) * tile_diff_size;
+				frame.data()[y * stride + x] ^= 0xFF;
+			}
+			differ.diff(frame.data(), stride, frame_uv, stride, &dirty);
+			bench_do_not_optimize(dirty.data());
+		}
+
+		tile_diff_set_impl(tile_diff_impl_auto);
+	}
+
+	///////////////////////////////////////////
+	// Color conversion
+	///////////////////////////////////////////
+
+	struct bench_convert_t {
+		nv12_convert_impl_ impl;
+		int32_t max_threads;
+	};
+
+	static void bench_nv12_to_rgb(bench_state_t* state, void* context)
+	{
+		const bench_convert_t* config = static_cast<const bench_convert_t*>(context);
+		if (!nv12_convert_set_impl(config->impl))
+		{
+			bench_skip(state, "not supported on this CPU");
+			return;
+		}
+
+		int32_t stride = nv12_packed_stride(bench_width);
+		bench_buffer src(nv12_packed_size(bench_width, bench_height));
+		bench_buffer dst(static_cast<size_t>(bench_width) * 4 * bench_height);
+		bench_fill_nv12(src.data(), bench_width, bench_height, stride, 2);
+		uint8_t* src_uv = src.data() + static_cast<size_t>(stride) * bench_height;
+
+		state->bytes_per_iteration = dst.size();
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			nv12_to_rgb(dst.data(), bench_width * 4, src.data(), stride, src_uv, stride, bench_width, bench_height,
+				rgb_format_bgra, color_matrix_bt709, color_range_limited);
+			bench_do_not_optimize(dst.data());
+		}
+
+		nv12_convert_set_impl(nv12_convert_impl_auto);
+	}
+
+	static void bench_rgb_to_nv12(bench_state_t* state, void* context)
+	{
+		const bench_convert_t* config = static_cast<const bench_convert_t*>(context);
+		if (!nv12_convert_set_impl(config->impl))
+		{
+			bench_skip(state, "not supported on this CPU");
+			return;
+		}
+
+		int32_t stride = nv12_packed_stride(bench_width);
+		bench_buffer src(static_cast<size_t>(bench_width) * 4 * bench_height);
+		bench_buffer dst(nv12_packed_size(bench_width, bench_height));
+		bench_fill_random(src.data(), src.size(), 3);
+		uint8_t* dst_uv = dst.data() + static_cast<size_t>(stride) * bench_height;
+
+		state->bytes_per_iteration = src.size();
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			rgb_to_nv12(dst.data(), stride, dst_uv, stride, src.data(), bench_width * 4, bench_width, bench_height,
+				rgb_format_bgra, color_matrix_bt709, color_range_limited, config->max_threads);
+			bench_do_not_optimize(dst.data());
+		}
+
+		nv12_convert_set_impl(nv12_convert_impl_auto);
+	}
+
+	///////////////////////////////////////////
+	// Scaling
+	///////////////////////////////////////////
+
+	struct bench_scale_t {
+		nv12_scale_impl_ impl;
+		nv12_scale_filter_ filter;
+		int32_t max_threads;
+	};
+
+	// A 4K stream brought down to 1080p, the LOD step a wall of panels sees most
+	static void bench_nv12_scale(bench_state_t* state, void* context)
+	{
+		const bench_scale_t* config = static_cast<const bench_scale_t*>(context);
+		if (!nv12_scale_set_impl(config->impl))
+		{
+			bench_skip(state, "not supported on this CPU");
+			return;
+		}
+
+		const int32_t src_width = bench_width * 2;
+		const int32_t src_height = bench_height * 2;
+		int32_t src_stride = nv12_packed_stride(src_width);
+		int32_t dst_stride = nv12_packed_stride(bench_width);
+		bench_buffer src(nv12_packed_size(src_width, src_height));
+		bench_buffer dst(nv12_packed_size(bench_width, bench_height));
+		bench_fill_nv12(src.data(), src_width, src_height, src_stride, 4);
+		const uint8_t* src_uv = src.data() + static_cast<size_t>(src_stride) * src_height;
+		uint8_t* dst_uv = dst.data() + static_cast<size_t>(dst_stride) * bench_height;
+
+		state->bytes_per_iteration = src.size();
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			nv12_scale(dst.data(), dst_stride, dst_uv, dst_stride, bench_width, bench_height,
+				src.data(), src_stride, src_uv, src_stride, src_width, src_height, config->filter, config->max_threads);
+			bench_do_not_optimize(dst.data());
+		}
+
+		nv12_scale_set_impl(nv12_scale_impl_auto);
+	}
+
+	///////////////////////////////////////////
+	// Sample pooling
+	///////////////////////////////////////////
+
+	// Encoded frame sizes cycle through a spread like a real encoder's, so the
+	// pool sees a few neighbouring size classes rather than one
+	static const uint32_t bench_encoded_sizes[] = { 96 * 1024, 12 * 1024, 9 * 1024, 14 * 1024, 11 * 1024, 10 * 1024, 13 * 1024, 8 * 1024 };
+	const size_t bench_encoded_size_count = sizeof(bench_encoded_sizes) / sizeof(bench_encoded_sizes[0]);
+
+	static void bench_sample_alloc(bench_state_t* state, sample_allocator* allocator, bool touch)
+	{
+		transform_stream_info_t info = { transform_stream_flags_none, 0, 16 };
+		size_t i = 0;
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			info.size = bench_encoded_sizes[i++ % bench_encoded_size_count];
+			media_sample* sample = allocator ? allocator->allocate(info) : memory_sample_create(info.size, info.alignment);
+			if (touch)
+			{
+				// Write it like a transform would, so fresh pages cost what they cost
+				size_t max_length, current_length;
+				uint8_t* data = sample->get_buffer()->lock(&max_length, &current_length);
+				for (size_t offset = 0; offset < info.size; offset += 4096)
+					data[offset] = static_cast<uint8_t>(offset);
+				sample->get_buffer()->unlock();
+			}
+			bench_do_not_optimize(sample);
+			sample->release();
+		}
+	}
+
+	static void bench_pool_frame_pool(bench_state_t* state, void* context)
+	{
+		frame_pool pool;
+		frame_pool_allocator allocator(&pool);
+		bench_sample_alloc(state, &allocator, context != nullptr);
+	}
+
+	static void bench_pool_heap(bench_state_t* state, void* context)
+	{
+		bench_sample_alloc(state, nullptr, context != nullptr);
+	}
+
+	///////////////////////////////////////////
+	// Texture atlas
+	///////////////////////////////////////////
+
+	static void bench_atlas_churn(bench_state_t* state, void* /*context*/)
+	{
+		// Thumbnails of a few common sizes coming and going in a 2048^2 atlas
+		// kept about two thirds full, the way nv12_atlas configures it
+		static const uint32_t sizes[][2] = { { 320, 180 }, { 480, 270 }, { 640, 360 }, { 256, 144 }, { 426, 240 } };
+		atlas_allocator allocator(2048, 2048, 2, 2);
+		std::vector<int32_t> live;
+		uint32_t seed = 1;
+		for (int32_t i = 0; i < 24; i++)
+			live.push_back(allocator.allocate(sizes[i % 5][0], sizes[i % 5][1]));
+
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			seed = seed * 1664525 + 1013904223;
+			size_t victim = (seed >> 8) % live.size();
+			allocator.release(live[victim]);
+			const uint32_t* size = sizes[(seed >> 20) % 5];
+			live[victim] = allocator.allocate(size[0], size[1]);
+			if (live[victim] < 0)
+			{
+				allocator.defragment();
+				live[victim] = allocator.allocate(size[0], size[1]);
+			}
+		}
+		bench_do_not_optimize(live.data());
+	}
+
+	static void bench_atlas_defragment(bench_state_t* state, void* /*context*/)
+	{
+		atlas_allocator allocator(2048, 2048, 2, 2);
+		for (int32_t i = 0; i < 64; i++)
+			allocator.allocate(160 + (i % 7) * 32, 90 + (i % 5) * 18);
+		std::vector<atlas_move_t> moves;
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			moves.clear();
+			allocator.defragment(&moves);
+		}
+		bench_do_not_optimize(moves.data());
+	}
+
+	void bench_register_memory()
+	{
+		static const struct { plane_copy_impl_ impl; const char* name; } copy_impls[] = {
+			{ plane_copy_impl_scalar, "scalar" }, { plane_copy_impl_sse2, "sse2" },
+			{ plane_copy_impl_avx2, "avx2" }, { plane_copy_impl_neon, "neon" },
+		};
+		static bench_plane_copy_t copy_configs[2][4];
+		for (int32_t nt = 0; nt < 2; nt++)
+		{
+			for (int32_t i = 0; i < 4; i++)
+			{
+				copy_configs[nt][i] = { copy_impls[i].impl, nt != 0 };
+				std::string name = std::string("plane_copy/nv12_1080p/") + copy_impls[i].name + (nt ? "/nontemporal" : "/cached");
+				bench_register(name.c_str(), bench_plane_copy, &copy_configs[nt][i]);
+			}
+		}
+
+		static const struct { tile_diff_impl_ impl; const char* name; } diff_impls[] = {
+			{ tile_diff_impl_scalar, "scalar" }, { tile_diff_impl_sse2, "sse2" },
+			{ tile_diff_impl_avx2, "avx2" }, { tile_diff_impl_neon, "neon" },
+		};
+		static bench_tile_diff_t diff_configs[4];
+		for (int i = 0; i < 4; i++)
+		{
+			diff_configs[i] = { diff_impls[i].impl, 0 };
+			bench_register((std::string("tile_diff/1080p/") + diff_impls[i].name + "/static").c_str(), bench_tile_diff, &diff_configs[i]);
+		}
+		// A cursor's worth of change, and a scrolling window's
+		static bench_tile_diff_t diff_cursor = { tile_diff_impl_auto, 1 };
+		static bench_tile_diff_t diff_scroll = { tile_diff_impl_auto, 120 };
+		bench_register("tile_diff/1080p/auto/1_tile", bench_tile_diff, &diff_cursor);
+		bench_register("tile_diff/1080p/auto/120_tiles", bench_tile_diff, &diff_scroll);
+
+		static const struct { nv12_convert_impl_ impl; const char* name; } convert_impls[] = {
+			{ nv12_convert_impl_scalar, "scalar" }, { nv12_convert_impl_sse41, "sse41" },
+			{ nv12_convert_impl_avx2, "avx2" }, { nv12_convert_impl_neon, "neon" },
+		};
+		static bench_convert_t convert_configs[4];
+		static bench_convert_t convert_threaded = { nv12_convert_impl_auto, 0 };
+		for (int32_t i = 0; i < 4; i++)
+		{
+			convert_configs[i] = { convert_impls[i].impl, 1 };
+			bench_register((std::string("nv12_to_rgb/1080p/") + convert_impls[i].name).c_str(), bench_nv12_to_rgb, &convert_configs[i]);
+		}
+		for (int32_t i = 0; i < 4; i++)
+		{
+			bench_register((std::string("rgb_to_nv12/1080p/") + convert_impls[i].name).c_str(), bench_rgb_to_nv12, &convert_configs[i]);
+		}
+		bench_register("rgb_to_nv12/1080p/auto/threaded", bench_rgb_to_nv12, &convert_threaded);
+
+		static const struct { nv12_scale_impl_ impl; const char* name; } scale_impls[] = {
+			{ nv12_scale_impl_scalar, "scalar" }, { nv12_scale_impl_sse2, "sse2" }, { nv12_scale_impl_neon, "neon" },
+		};
+		static bench_scale_t scale_configs[3];
+		for (int32_t i = 0; i < 3; i++)
+		{
+			scale_configs[i] = { scale_impls[i].impl, nv12_scale_filter_box, 1 };
+			bench_register((std::string("nv12_scale/4k_to_1080p/") + scale_impls[i].name + "/box").c_str(), bench_nv12_scale, &scale_configs[i]);
+		}
+		static bench_scale_t scale_bilinear = { nv12_scale_impl_auto, nv12_scale_filter_bilinear, 1 };
+		static bench_scale_t scale_threaded = { nv12_scale_impl_auto, nv12_scale_filter_box, 0 };
+		bench_register("nv12_scale/4k_to_1080p/auto/bilinear", bench_nv12_scale, &scale_bilinear);
+		bench_register("nv12_scale/4k_to_1080p/auto/box/threaded", bench_nv12_scale, &scale_threaded);
+
+		static int touch = 1;
+		bench_register("sample_pool/frame_pool", bench_pool_frame_pool);
+		bench_register("sample_pool/frame_pool/touched", bench_pool_frame_pool, &touch);
+		bench_register("sample_pool/heap", bench_pool_heap);
+		bench_register("sample_pool/heap/touched", bench_pool_heap, &touch);
+
+		bench_register("atlas/churn", bench_atlas_churn);
+		bench_register("atlas/defragment_64", bench_atlas_defragment);
+	}
+
+} // namespace nakamir
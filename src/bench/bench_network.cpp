@@ -0,0 +1,359 @@
+#include "bench.h"
+#include "../rtp_h264.h"
+#include "../udp_socket.h"
+#include "../sim_channel.h"
+#include "../sim_link.h"
+#include "../bitrate_controller.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <thread>
+
+// Network work: splitting encoder output into RTP packets, pushing them
+// through a loopback UDP socket the way the roundtrip webcam stream would go,
+// putting them back together after a simulated lossy path, and adapting the
+// encoder's bitrate to bandwidth traces replayed through a simulated link
+
+namespace nakamir {
+
+	// 10 seconds of the roundtrip webcam stream: 30 fps with a one second GOP
+	// and ~12KB P frames, about 3Mbps
+	const uint32_t bench_rtp_frames = 300;
+	const uint32_t bench_rtp_gop = 30;
+	const size_t bench_rtp_p_frame_bytes = 12 * 1024;
+	const uint32_t bench_rtp_frame_ticks = rtp_h264_clock_rate / 30;
+
+	static const bench_h264_stream_t& bench_rtp_stream()
+	{
+		static bench_h264_stream_t stream;
+		if (stream.data.empty())
+			bench_make_h264_stream(&stream, bench_rtp_frames, bench_rtp_gop, bench_rtp_p_frame_bytes, 6);
+		return stream;
+	}
+
+	struct bench_rtp_t {
+		size_t mtu;
+		bool contiguous;    // Copy each packet out, as a transport without scatter-gather would
+	};
+
+	// Packets the whole stream makes at this MTU
+	static uint64_t bench_rtp_packet_count(size_t mtu)
+	{
+		const bench_h264_stream_t& stream = bench_rtp_stream();
+		rtp_h264_packetizer packetizer(0x1234, 96, mtu);
+		uint64_t packets = 0;
+		for (uint32_t f = 0; f + 1 < stream.frame_offsets.size(); f++)
+			packets += packetizer.packetize(stream.data.data() + stream.frame_offsets[f], stream.frame_offsets[f + 1] - stream.frame_offsets[f], f * bench_rtp_frame_ticks);
+		return packets;
+	}
+
+	///////////////////////////////////////////
+	// Packetizing
+	///////////////////////////////////////////
+
+	static void bench_rtp_packetize(bench_state_t* state, void* context)
+	{
+		const bench_rtp_t* config = static_cast<const bench_rtp_t*>(context);
+		const bench_h264_stream_t& stream = bench_rtp_stream();
+		uint32_t frames = static_cast<uint32_t>(stream.frame_offsets.size() - 1);
+		rtp_h264_packetizer packetizer(0x1234, 96, config->mtu);
+		std::vector<uint8_t> wire(config->mtu);
+		uint64_t copied = 0;
+
+		state->bytes_per_iteration = stream.data.size();
+		state->items_per_iteration = bench_rtp_packet_count(config->mtu);
+		for (; bench_loop(state);)
+		{
+			for (uint32_t f = 0; f < frames; f++)
+			{
+				packetizer.packetize(stream.data.data() + stream.frame_offsets[f], stream.frame_offsets[f + 1] - stream.frame_offsets[f], f * bench_rtp_frame_ticks);
+				if (!config->contiguous)
+					continue;
+				for (const rtp_packet_t& packet : packetizer.packets())
+				{
+					packetizer.copy_packet(packet, wire.data());
+					copied += packet.size;
+				}
+				bench_do_not_optimize(wire.data());
+			}
+			bench_do_not_optimize(&packetizer);
+		}
+
+		const rtp_packetizer_stats_t& stats = packetizer.get_stats();
+		bench_counter(state, "copied_B/frame", static_cast<double>(stats.copied_bytes + copied) / stats.access_units);
+	}
+
+	///////////////////////////////////////////
+	// Loopback UDP
+	///////////////////////////////////////////
+
+	static void bench_rtp_loopback(bench_state_t* state, void* context)
+	{
+		// Sender and receiver on 127.0.0.1, the receiver on its own thread
+		// draining the socket, so this is the cost of getting packets to the
+		// kernel and back out again with the payload never copied in user space
+		const bench_rtp_t* config = static_cast<const bench_rtp_t*>(context);
+		udp_socket receiver, sender;
+		if (!receiver.open() || !sender.open() || !sender.connect("127.0.0.1", receiver.local_port()))
+		{
+			bench_skip(state, "no loopback UDP");
+			return;
+		}
+		receiver.set_receive_buffer(8 * 1024 * 1024);
+
+		std::atomic<bool> stop = false;
+		std::atomic<uint64_t> received = 0;
+		std::thread receive_thread([&] {
+			std::vector<uint8_t> buffer(64 * 1024);
+			while (!stop.load(std::memory_order_relaxed))
+			{
+				if (receiver.receive(buffer.data(), buffer.size(), 20) > 0)
+					received.fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+
+		const bench_h264_stream_t& stream = bench_rtp_stream();
+		uint32_t frames = static_cast<uint32_t>(stream.frame_offsets.size() - 1);
+		rtp_h264_packetizer packetizer(0x1234, 96, config->mtu);
+		uint64_t sent = 0;
+
+		state->bytes_per_iteration = stream.data.size();
+		state->items_per_iteration = bench_rtp_packet_count(config->mtu);
+		for (; bench_loop(state);)
+		{
+			for (uint32_t f = 0; f < frames; f++)
+			{
+				packetizer.packetize(stream.data.data() + stream.frame_offsets[f], stream.frame_offsets[f + 1] - stream.frame_offsets[f], f * bench_rtp_frame_ticks);
+				for (const rtp_packet_t& packet : packetizer.packets())
+					sent += sender.send(packetizer.packet_spans(packet), packet.span_count) ? 1 : 0;
+			}
+		}
+
+		// Give the receiver a moment to drain what is still queued
+		for (int32_t i = 0; i < 50 && received.load() < sent; i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		stop = true;
+		receive_thread.join();
+
+		const rtp_packetizer_stats_t& stats = packetizer.get_stats();
+		bench_counter(state, "copied_B/frame", static_cast<double>(stats.copied_bytes) / stats.access_units);
+		bench_counter(state, "received_%", sent ? 100.0 * received.load() / sent : 0.0);
+	}
+
+	///////////////////////////////////////////
+	// Depacketizing
+	///////////////////////////////////////////
+
+	struct bench_rtp_receive_t {
+		size_t mtu;
+		sim_channel_config_t channel;
+	};
+
+	static void bench_rtp_depacketize(bench_state_t* state, void* context)
+	{
+		// The stream goes through the simulated channel once, up front, so the
+		// loop times just the receive side: reordering, reassembly and loss
+		// handling over the packets as they would arrive
+		const bench_rtp_receive_t* config = static_cast<const bench_rtp_receive_t*>(context);
+		const bench_h264_stream_t& stream = bench_rtp_stream();
+		uint32_t frames = static_cast<uint32_t>(stream.frame_offsets.size() - 1);
+		rtp_h264_packetizer packetizer(0x1234, 96, config->mtu);
+		sim_channel channel(config->channel);
+		std::vector<uint8_t> wire;
+		std::vector<size_t> wire_offsets;
+		auto take_arrivals = [&] {
+			const uint8_t* data;
+			size_t size;
+			while (channel.receive(&data, &size))
+			{
+				wire_offsets.push_back(wire.size());
+				wire.insert(wire.end(), data, data + size);
+			}
+		};
+		for (uint32_t f = 0; f < frames; f++)
+		{
+			packetizer.packetize(stream.data.data() + stream.frame_offsets[f], stream.frame_offsets[f + 1] - stream.frame_offsets[f], f * bench_rtp_frame_ticks);
+			for (const rtp_packet_t& packet : packetizer.packets())
+			{
+				channel.send(packetizer.packet_spans(packet), packet.span_count);
+				take_arrivals();
+			}
+		}
+		channel.flush();
+		take_arrivals();
+		wire_offsets.push_back(wire.size());
+
+		rtp_h264_depacketizer depacketizer;
+		uint64_t delivered = 0;
+		state->bytes_per_iteration = wire.size();
+		state->items_per_iteration = wire_offsets.size() - 1;
+		for (; bench_loop(state);)
+		{
+			depacketizer.reset();
+			delivered = 0;
+			for (size_t p = 0; p + 1 < wire_offsets.size(); p++)
+				delivered += depacketizer.receive(wire.data() + wire_offsets[p], wire_offsets[p + 1] - wire_offsets[p]);
+			delivered += depacketizer.flush();
+			bench_do_not_optimize(&depacketizer);
+		}
+
+		const rtp_depacketizer_stats_t& stats = depacketizer.get_stats();
+		bench_counter(state, "frames_%", 100.0 * delivered / frames);
+		bench_counter(state, "lost", static_cast<double>(stats.lost));
+		bench_counter(state, "reordered", static_cast<double>(stats.reordered));
+		bench_counter(state, "damaged", static_cast<double>(stats.frames_damaged));
+	}
+
+	///////////////////////////////////////////
+	// Adaptive bitrate
+	///////////////////////////////////////////
+
+	struct bench_abr_t {
+		std::vector<sim_link_trace_point_t> trace;  // The last point is where it ends
+		double random_loss;
+		const char* missing_reason;                 // Set if the trace couldn't be had
+	};
+
+	// 4Mbps, a drop to 1Mbps, then 2.5Mbps, 20 seconds each
+	static void bench_abr_step_trace(/**[out]**/ std::vector<sim_link_trace_point_t>* trace)
+	{
+		*trace = { { 0, 4000000 }, { 20000000, 1000000 }, { 40000000, 2500000 }, { 60000000, 2500000 } };
+	}
+
+	// A cellular-like minute: capacity wandering between 0.3 and 8Mbps every
+	// half second, with a one second outage in the middle
+	static void bench_abr_mobile_trace(/**[out]**/ std::vector<sim_link_trace_point_t>* trace)
+	{
+		trace->clear();
+		uint64_t random = 11;
+		double rate = 3000000;
+		for (uint64_t t = 0; t < 60000000; t += 500000)
+		{
+			random ^= random >> 12;
+			random ^= random << 25;
+			random ^= random >> 27;
+			double step = static_cast<double>((random * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+			rate *= std::exp((step - 0.5) * 0.8);
+			rate = rate < 300000 ? 300000 : rate > 8000000 ? 8000000 : rate;
+			bool outage = t >= 30000000 && t < 31000000;
+			trace->push_back({ t, outage ? 0u : static_cast<uint32_t>(rate) });
+		}
+		trace->push_back({ 60000000, trace->back().bitrate });
+	}
+
+	static void bench_abr_replay(bench_state_t* state, void* context)
+	{
+		// A 720p30 camera stream, once through the trace. The encoder is a
+		// model: frames sized to the bitrate it was given, 10% over on
+		// average, +-30% noise and a keyframe five times the size every two
+		// seconds, sent as 1200 byte packets the moment they're encoded.
+		// Feedback comes back every 100ms. What's timed is the controller
+		// and link model per frame; the counters say how well it tracked.
+		const bench_abr_t* config = static_cast<const bench_abr_t*>(context);
+		if (config->missing_reason)
+		{
+			bench_skip(state, config->missing_reason);
+			return;
+		}
+
+		const uint64_t feedback_interval_us = 100000;
+		const size_t packet_bytes = 1200;
+		uint64_t duration_us = config->trace.back().time_us;
+
+		bitrate_controller_config_t controller_config;
+		controller_config.max_bitrate = 8000000;
+		controller_config.allow_resolution = true;
+		controller_config.min_fps = 15;
+		bitrate_controller controller;
+
+		sim_link_config_t link_config;
+		link_config.trace = config->trace;
+		link_config.random_loss = config->random_loss;
+		sim_link link;
+
+		uint64_t frames = 0;
+		for (; bench_loop(state);)
+		{
+			controller.reset(controller_config);
+			link.reset(link_config);
+			uint64_t random = 5;
+			uint64_t next_frame_us = 0, next_feedback_us = feedback_interval_us;
+			frames = 0;
+			while (next_frame_us < duration_us)
+			{
+				if (next_feedback_us <= next_frame_us)
+				{
+					controller.on_feedback(link.feedback(next_feedback_us));
+					next_feedback_us += feedback_interval_us;
+					continue;
+				}
+
+				const bitrate_settings_t& settings = controller.settings();
+				random ^= random >> 12;
+				random ^= random << 25;
+				random ^= random >> 27;
+				double noise = 0.7 + 0.6 * static_cast<double>((random * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+				double bytes = settings.bitrate / 8.0 / settings.fps * 1.1 * noise;
+				if (frames % (2 * settings.fps) == 0)
+					bytes *= 5;
+				size_t size = static_cast<size_t>(bytes);
+				controller.on_frame(size, next_frame_us);
+				for (size_t sent = 0; sent < size; sent += packet_bytes)
+					link.send(size - sent < packet_bytes ? size - sent : packet_bytes, next_frame_us);
+
+				frames++;
+				next_frame_us += 1000000 / settings.fps;
+			}
+			link.feedback(duration_us);
+		}
+
+		// Frames simulated, fewer once the frame rate steps down
+		state->items_per_iteration = frames;
+		const sim_link_stats_t& stats = link.get_stats();
+		bitrate_controller_stats_t controller_stats = controller.get_stats();
+		bench_counter(state, "util_%", stats.capacity_bytes ? 100.0 * stats.delivered_bytes / stats.capacity_bytes : 0.0);
+		bench_counter(state, "delay_ms", stats.delivered ? stats.queue_delay_us / 1000.0 / stats.delivered : 0.0);
+		bench_counter(state, "late_%", stats.packets ? 100.0 * (stats.late + stats.dropped + stats.lost) / stats.packets : 0.0);
+		bench_counter(state, "updates", static_cast<double>(controller_stats.updates));
+	}
+
+	void bench_register_network(const char* abr_trace)
+	{
+		static bench_rtp_t configs[] = { { 1200, false }, { 1400, false }, { 1200, true } };
+		bench_register("rtp/packetize/1200", bench_rtp_packetize, &configs[0]);
+		bench_register("rtp/packetize/1400", bench_rtp_packetize, &configs[1]);
+		bench_register("rtp/packetize/1200/contiguous", bench_rtp_packetize, &configs[2]);
+		bench_register("rtp/loopback_udp/1200", bench_rtp_loopback, &configs[0]);
+
+		// A clean path; one that reorders 5% of packets by up to 8 and repeats
+		// 1%; and the same again losing 1% in bursts of 2
+		static bench_rtp_receive_t receive_configs[3] = {};
+		for (bench_rtp_receive_t& receive : receive_configs)
+			receive.mtu = 1200;
+		receive_configs[1].channel.reorder = 0.05;
+		receive_configs[1].channel.duplicate = 0.01;
+		receive_configs[2].channel = receive_configs[1].channel;
+		receive_configs[2].channel.loss = 0.01;
+		receive_configs[2].channel.loss_burst = 2;
+		bench_register("rtp/depacketize/1200", bench_rtp_depacketize, &receive_configs[0]);
+		bench_register("rtp/depacketize/1200/reordered", bench_rtp_depacketize, &receive_configs[1]);
+		bench_register("rtp/depacketize/1200/lossy", bench_rtp_depacketize, &receive_configs[2]);
+
+		static bench_abr_t abr_configs[4] = {};
+		bench_abr_step_trace(&abr_configs[0].trace);
+		bench_abr_mobile_trace(&abr_configs[1].trace);
+		abr_configs[2].trace = abr_configs[1].trace;
+		abr_configs[2].random_loss = 0.01;
+		bench_register("abr/trace/step", bench_abr_replay, &abr_configs[0]);
+		bench_register("abr/trace/mobile", bench_abr_replay, &abr_configs[1]);
+		bench_register("abr/trace/mobile/lossy", bench_abr_replay, &abr_configs[2]);
+		if (abr_trace)
+		{
+			if (!sim_link_load_trace(abr_trace, &abr_configs[3].trace) || abr_configs[3].trace.back().time_us == 0)
+				abr_configs[3].missing_reason = "could not read the --abr-trace file";
+			bench_register("abr/trace/file", bench_abr_replay, &abr_configs[3]);
+		}
+	}
+
+} // namespace nakamir
@@ -0,0 +1,359 @@
+#include "bench.h"
+#include "../frame_mailbox.h"
+#include "../slot_ring.h"
+#include "../frame_pool.h"
+#include "../frame_presenter.h"
+#include "../metrics.h"
+#include "../quad_batch.h"
+#include "../decode_session.h"
+#include "../session_scheduler.h"
+#include "../sim_transform.h"
+#include "../spsc_ring.h"
+#include "../transform_driver.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Per-frame overhead of moving samples through the pipeline: the pump loop
+// and driver against the stand-in transform, the queues between threads, and
+// the metrics recorded along the way. Payloads are kept small so the numbers
+// are the plumbing, not memcpy.
+
+namespace nakamir {
+
+	const size_t bench_sample_bytes = 4096;
+	const int64_t bench_frame_duration = 333333; // 30 fps in 100ns units
+
+	///////////////////////////////////////////
+	// Pump loop and driver
+	///////////////////////////////////////////
+
+	struct bench_transform_t {
+		bool async;
+		uint32_t latency;
+		uint32_t input_queue_depth;
+		bool driver;                // transform_driver rather than transform_sample_to_buffer
+	};
+
+	static void bench_on_output(media_transform* /*transform*/, media_sample* /*sample*/, void* context)
+	{
+		(*static_cast<uint64_t*>(context))++;
+	}
+
+	static media_sample* bench_input_sample(sample_allocator* allocator, uint64_t index)
+	{
+		transform_stream_info_t info = { transform_stream_flags_none, static_cast<uint32_t>(bench_sample_bytes), 16 };
+		media_sample* sample = allocator->allocate(info);
+		sample->get_buffer()->set_current_length(bench_sample_bytes);
+		sample->set_sample_time(static_cast<int64_t>(index) * bench_frame_duration);
+		sample->set_sample_duration(bench_frame_duration);
+		return sample;
+	}
+
+	static void bench_transform(bench_state_t* state, void* context)
+	{
+		const bench_transform_t* config = static_cast<const bench_transform_t*>(context);
+		// The pool outlives the transform, which may still hold samples from it
+		frame_pool pool;
+		frame_pool_allocator allocator(&pool);
+
+		sim_transform_config_t sim_config;
+		sim_config.async = config->async;
+		sim_config.latency = config->latency;
+		sim_config.input_queue_depth = config->input_queue_depth;
+		sim_transform sim(sim_config);
+		uint64_t outputs = 0;
+		uint64_t index = 0;
+		state->items_per_iteration = 1;
+
+		if (config->driver)
+		{
+			transform_driver driver(&sim, bench_on_output, &outputs, &allocator);
+			driver.start();
+			for (; bench_loop(state);)
+			{
+				media_sample* sample = bench_input_sample(&allocator, index++);
+				driver.submit(sample);
+				sample->release();
+				// Wait for the last output inside the timed region
+				if (state->done == state->iterations)
+					driver.drain();
+			}
+			driver.stop();
+		}
+		else
+		{
+			for (; bench_loop(state);)
+			{
+				media_sample* sample = bench_input_sample(&allocator, index++);
+				transform_sample_to_buffer(&sim, sample, bench_on_output, &outputs, &allocator);
+				sample->release();
+			}
+			sim.shutdown();
+		}
+		bench_do_not_optimize(&outputs);
+	}
+
+	///////////////////////////////////////////
+	// Queues
+	///////////////////////////////////////////
+
+	static void bench_spsc_ring_same_thread(bench_state_t* state, void* /*context*/)
+	{
+		spsc_ring<media_sample*> ring(8);
+		media_sample* item = nullptr;
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			ring.try_push(item);
+			ring.try_pop(item);
+		}
+		bench_do_not_optimize(item);
+	}
+
+	static void bench_spsc_ring_cross_thread(bench_state_t* state, void* /*context*/)
+	{
+		// Items flow from a producer thread to the benchmark thread, which pays for
+		// the cache line transfers on every pop
+		spsc_ring<uint64_t> ring(256);
+		std::atomic_bool stop = false;
+		std::thread producer([&]() {
+			for (uint64_t i = 0; !stop.load(std::memory_order_relaxed);)
+			{
+				if (ring.try_push(i))
+					i++;
+				else
+					std::this_thread::yield();
+			}
+		});
+
+		uint64_t item = 0, sum = 0;
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			while (!ring.try_pop(item))
+				std::this_thread::yield();
+			sum += item;
+		}
+		stop = true;
+		producer.join();
+		bench_do_not_optimize(&sum);
+	}
+
+	static void bench_frame_mailbox(bench_state_t* state, void* /*context*/)
+	{
+		frame_mailbox mailbox(64);
+		uint64_t sequence = 0;
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			mailbox_frame_t* frame = mailbox.begin_write();
+			frame->sequence = sequence++;
+			mailbox.publish();
+			bench_do_not_optimize(mailbox.acquire_latest());
+		}
+	}
+
+	static void bench_slot_ring(bench_state_t* state, void* context)
+	{
+		// One upload and one rendered frame per iteration
+		slot_ring ring(*static_cast<const uint32_t*>(context));
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			int32_t write = ring.begin_write();
+			ring.publish();
+			int32_t read = ring.acquire_latest();
+			bench_do_not_optimize(&write);
+			bench_do_not_optimize(&read);
+		}
+	}
+
+	static void bench_frame_presenter(bench_state_t* state, void* /*context*/)
+	{
+		frame_presenter presenter(64, 8);
+		int64_t time = 0;
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			mailbox_frame_t* frame = presenter.begin_write();
+			frame->time = time;
+			presenter.publish();
+			bench_do_not_optimize(presenter.present(time));
+			time += bench_frame_duration;
+		}
+	}
+
+	///////////////////////////////////////////
+	// Session scheduler
+	///////////////////////////////////////////
+
+	// A panel's worth of decode session: a fixed number of frames to read, and
+	// room for a few decoded frames before the session has to block
+	struct bench_session_t {
+		sim_transform sim;
+		decode_session session;
+		uint32_t reads = 0;
+		uint32_t frames = 0;
+		std::atomic<uint32_t> queued = 0;
+		int32_t id = -1;
+
+		bench_session_t(const sim_transform_config_t& config, uint32_t frame_count)
+			: sim(config), session(&sim, bench_session_read, bench_session_deliver, this), frames(frame_count) {}
+
+		static media_sample* bench_session_read(void* context)
+		{
+			bench_session_t* s = static_cast<bench_session_t*>(context);
+			if (s->reads == s->frames)
+				return nullptr;
+			media_sample* sample = memory_sample_create(256);
+			sample->get_buffer()->set_current_length(256);
+			sample->set_sample_time(static_cast<int64_t>(s->reads++) * bench_frame_duration);
+			return sample;
+		}
+
+		static bool bench_session_deliver(media_transform* /*transform*/, media_sample* /*sample*/, void* context)
+		{
+			bench_session_t* s = static_cast<bench_session_t*>(context);
+			// Only this side adds, so the count can't pass the limit between the two
+			if (s->queued.load(std::memory_order_acquire) >= 4)
+				return false;
+			s->queued.fetch_add(1, std::memory_order_acq_rel);
+			return true;
+		}
+	};
+
+	static void bench_session_scheduler(bench_state_t* state, void* context)
+	{
+		// Plays a wall of sessions to the end, the bench thread standing in for
+		// the renderer that takes frames and wakes whichever sessions it freed up
+		const uint32_t sessions = *static_cast<const uint32_t*>(context);
+		const uint32_t frames = 30;
+		session_scheduler scheduler;
+		sim_transform_config_t config;
+		config.latency = 2;
+
+		state->items_per_iteration = static_cast<uint64_t>(sessions) * frames;
+		for (; bench_loop(state);)
+		{
+			std::vector<std::unique_ptr<bench_session_t>> wall;
+			for (uint32_t i = 0; i < sessions; i++)
+			{
+				wall.push_back(std::make_unique<bench_session_t>(config, frames));
+				wall.back()->id = scheduler.add(decode_session::on_step, &wall.back()->session);
+			}
+
+			uint64_t consumed = 0;
+			while (consumed < state->items_per_iteration)
+			{
+				bool idle = true;
+				for (std::unique_ptr<bench_session_t>& s : wall)
+				{
+					uint32_t taken = s->queued.exchange(0, std::memory_order_acq_rel);
+					if (taken)
+					{
+						consumed += taken;
+						scheduler.wake(s->id);
+						idle = false;
+					}
+				}
+				if (idle)
+					std::this_thread::yield();
+			}
+
+			for (std::unique_ptr<bench_session_t>& s : wall)
+				scheduler.remove(s->id);
+		}
+	}
+
+	///////////////////////////////////////////
+	// Quad batching
+	///////////////////////////////////////////
+
+	static void bench_quad_batch(bench_state_t* state, void* context)
+	{
+		// A wall of panels a frame, spread over a few atlases plus some
+		// streams that didn't fit and draw with their own material
+		const uint32_t quads = *static_cast<const uint32_t*>(context);
+		int materials[8];
+		float transform[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+		float uv_rect[4] = { 0, 0, 1, 1 };
+		quad_batch batch;
+		state->items_per_iteration = quads;
+		for (; bench_loop(state);)
+		{
+			for (uint32_t i = 0; i < quads; i++)
+			{
+				transform[12] = static_cast<float>(i);
+				batch.add(&materials[(i * 5) % 8], transform, uv_rect);
+			}
+			batch.build();
+			bench_do_not_optimize(batch.draws().data());
+			batch.clear();
+		}
+	}
+
+	///////////////////////////////////////////
+	// Metrics
+	///////////////////////////////////////////
+
+	static void bench_metrics_record(bench_state_t* state, void* /*context*/)
+	{
+		uint64_t latency = 0;
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+			metrics_record(metric_stage_decode, latency++ & 0xFFFF, 4096);
+	}
+
+	static void bench_metrics_latency_tracker(bench_state_t* state, void* /*context*/)
+	{
+		metrics_latency_tracker tracker(metric_stage_decode);
+		int64_t key = 0;
+		state->items_per_iteration = 1;
+		for (; bench_loop(state);)
+		{
+			// A few frames in flight, like a decoder with some reorder depth
+			tracker.begin(key);
+			tracker.end(key - 3);
+			key++;
+		}
+	}
+
+	void bench_register_pipeline()
+	{
+		static bench_transform_t sync_pump = { false, 0, 1, false };
+		static bench_transform_t sync_latency_pump = { false, 3, 1, false };
+		static bench_transform_t async_pump = { true, 0, 1, false };
+		static bench_transform_t async_driver = { true, 0, 1, true };
+		static bench_transform_t async_driver_queued = { true, 3, 4, true };
+		static bench_transform_t sync_driver = { false, 0, 1, true };
+		bench_register("transform/sync/sample_to_buffer", bench_transform, &sync_pump);
+		bench_register("transform/sync_latency3/sample_to_buffer", bench_transform, &sync_latency_pump);
+		bench_register("transform/sync/driver", bench_transform, &sync_driver);
+		bench_register("transform/async/sample_to_buffer", bench_transform, &async_pump);
+		bench_register("transform/async/driver", bench_transform, &async_driver);
+		bench_register("transform/async_latency3_depth4/driver", bench_transform, &async_driver_queued);
+
+		bench_register("queue/spsc_ring/same_thread", bench_spsc_ring_same_thread);
+		bench_register("queue/spsc_ring/cross_thread", bench_spsc_ring_cross_thread);
+		bench_register("queue/frame_mailbox/publish_acquire", bench_frame_mailbox);
+		bench_register("queue/frame_presenter/publish_present", bench_frame_presenter);
+		static uint32_t ring_slots[] = { 4, 6 };
+		for (uint32_t& slots : ring_slots)
+			bench_register((std::string("queue/slot_ring/") + std::to_string(slots) + "/publish_acquire").c_str(), bench_slot_ring, &slots);
+
+		static uint32_t session_counts[] = { 1, 16, 64 };
+		for (uint32_t& count : session_counts)
+			bench_register((std::string("scheduler/decode_sessions/") + std::to_string(count)).c_str(), bench_session_scheduler, &count);
+
+		static uint32_t quad_counts[] = { 16, 256, 2048 };
+		for (uint32_t& count : quad_counts)
+			bench_register((std::string("render/quad_batch/") + std::to_string(count)).c_str(), bench_quad_batch, &count);
+
+		bench_register("metrics/record", bench_metrics_record);
+		bench_register("metrics/latency_tracker", bench_metrics_latency_tracker);
+	}
+
+} // namespace nakamir
@@ -0,0 +1,231 @@
+#include "bitrate_controller.h"
+#include <cmath>
+
+namespace nakamir {
+
+	// Encoded sizes are averaged over this long, keyframes and all
+	const uint64_t bitrate_window_us = 1000000;
+	// Overshoot is only measured once the encoder has run this long on the
+	// rate it was last given, and correcting for it is capped
+	const uint64_t bitrate_overshoot_settle_us = 1000000;
+	const double bitrate_max_overshoot = 1.5;
+
+	void bitrate_controller::reset(const bitrate_controller_config_t& config)
+	{
+		_config = config;
+		if (_config.max_bitrate < _config.min_bitrate)
+			_config.max_bitrate = _config.min_bitrate;
+
+		_levels.clear();
+		_levels.push_back({ config.width, config.height, config.fps });
+		if (config.allow_resolution)
+		{
+			for (int32_t step = 1; ; step++)
+			{
+				// Even sizes, as NV12 needs
+				double scale = std::pow(2.0, -step / 2.0);
+				uint32_t width = static_cast<uint32_t>(std::lround(config.width * scale / 2)) * 2;
+				uint32_t height = static_cast<uint32_t>(std::lround(config.height * scale / 2)) * 2;
+				if (width < config.min_width || width < 2 || height < 2)
+					break;
+				_levels.push_back({ width, height, config.fps });
+			}
+		}
+		for (uint32_t fps = config.fps / 2; fps >= config.min_fps && fps > 0; fps /= 2)
+			_levels.push_back({ _levels.back().width, _levels.back().height, fps });
+		_level = 0;
+		_level_since_us = 0;
+		_level_wish = 0;
+
+		_target = config.start_bitrate < _config.min_bitrate ? _config.min_bitrate : config.start_bitrate > _config.max_bitrate ? _config.max_bitrate : config.start_bitrate;
+		_last_overuse = 0;
+		_overused = false;
+		_previous_delay = 0;
+		_last_feedback_us = 0;
+		_has_feedback = false;
+		_state = bitrate_state_increase;
+
+		_frames.clear();
+		_frames_head = 0;
+		_window_bytes = 0;
+		_overshoot = 1;
+
+		_settings = { static_cast<uint32_t>(_target), config.width, config.height, config.fps };
+		_last_update_us = 0;
+		_feedbacks = 0;
+		_decreases = 0;
+		_updates = 0;
+		_format_changes = 0;
+	}
+
+	double bitrate_controller::pixel_rate(uint32_t level) const
+	{
+		return static_cast<double>(_levels[level].width) * _levels[level].height * _levels[level].fps;
+	}
+
+	void bitrate_controller::on_frame(size_t bytes, uint64_t time_us)
+	{
+		_frames.push_back({ time_us, bytes });
+		_window_bytes += bytes;
+		while (_frames_head < _frames.size() && _frames[_frames_head].time_us + bitrate_window_us < time_us)
+			_window_bytes -= _frames[_frames_head++].bytes;
+		// Compact now and then rather than shifting every frame
+		if (_frames_head > 64 && _frames_head * 2 > _frames.size())
+		{
+			_frames.erase(_frames.begin(), _frames.begin() + _frames_head);
+			_frames_head = 0;
+		}
+	}
+
+	uint32_t bitrate_controller::encoded_rate(uint64_t* span_us) const
+	{
+		// N frames cover N - 1 intervals, so the oldest frame's bytes fall outside
+		uint64_t span = _frames.size() - _frames_head < 2 ? 0 : _frames.back().time_us - _frames[_frames_head].time_us;
+		if (span_us)
+			*span_us = span;
+		if (span == 0)
+			return 0;
+		return static_cast<uint32_t>((_window_bytes - _frames[_frames_head].bytes) * 8 * 1000000 / span);
+	}
+
+	bool bitrate_controller::on_feedback(const bitrate_feedback_t& feedback)
+	{
+		_feedbacks++;
+		double dt = _has_feedback && feedback.time_us > _last_feedback_us ? (feedback.time_us - _last_feedback_us) / 1e6 : 0;
+		dt = dt > 1 ? 1 : dt;
+		_has_feedback = true;
+		_last_feedback_us = feedback.time_us;
+
+		double delay = feedback.queue_delay_us;
+		double trend = delay - _previous_delay;
+		_previous_delay = delay;
+		double received = feedback.received_bitrate;
+		double target = _target;
+
+		// Delay first: it rises before anything is lost
+		if (delay > _config.delay_threshold_us && trend >= 0)
+		{
+			double base = received > 0 ? received : target;
+			double cut = base * _config.decrease_factor;
+			if (cut < target)
+			{
+				target = cut;
+				_decreases++;
+			}
+			_last_overuse = base;
+			_overused = true;
+			_state = bitrate_state_decrease;
+		}
+		else if (delay > _config.delay_threshold_us / 2)
+			_state = bitrate_state_hold;
+		else
+		{
+			// Near the last overuse the path is probably close to full: creep.
+			// Well past it, capacity has moved and the old mark is no use.
+			if (_last_overuse > 0 && target > _last_overuse * 1.5)
+				_last_overuse = 0;
+			if (_last_overuse > 0 && target > _last_overuse * 0.85)
+				target += _config.additive_increase_per_second * dt;
+			else
+				target *= std::pow(1.0 + (_overused ? _config.increase_per_second : _config.startup_increase_per_second), dt);
+			// Don't run away from what the path has shown it carries
+			if (received > 0 && target > received * 1.5 + 10000 && target > _target)
+				target = _target > received * 1.5 + 10000 ? _target : received * 1.5 + 10000;
+			_state = bitrate_state_increase;
+		}
+
+		if (feedback.loss > _config.loss_high)
+		{
+			// Never below half of what got through, so a burst of drops while a
+			// queue overflows doesn't spiral down
+			double cut = _target * (1 - 0.5 * feedback.loss);
+			cut = received > 0 && cut < received * 0.5 ? received * 0.5 : cut;
+			if (cut < target)
+			{
+				target = cut;
+				if (_state != bitrate_state_decrease)
+					_decreases++;
+			}
+			_overused = true;
+			_state = bitrate_state_decrease;
+		}
+		else if (feedback.loss > _config.loss_low && target > _target)
+		{
+			target = _target;
+			_state = bitrate_state_hold;
+		}
+
+		_target = target < _config.min_bitrate ? _config.min_bitrate : target > _config.max_bitrate ? _config.max_bitrate : target;
+
+		// How far the encoder overshoots, once it has settled on its rate
+		uint64_t span_us = 0;
+		uint32_t encoded = encoded_rate(&span_us);
+		if (encoded > 0 && span_us * 2 >= bitrate_window_us && feedback.time_us >= _last_update_us + bitrate_overshoot_settle_us)
+			_overshoot = 0.9 * _overshoot + 0.1 * encoded / _settings.bitrate;
+
+		bool level_changed = update_level(feedback.time_us);
+		return update_settings(feedback.time_us) || level_changed;
+	}
+
+	bool bitrate_controller::update_level(uint64_t time_us)
+	{
+		int32_t wish = 0;
+		if (_level + 1 < _levels.size() && _target / pixel_rate(_level) < _config.degrade_bpp)
+			wish = 1;
+		else if (_level > 0 && _target / pixel_rate(_level - 1) >= _config.restore_bpp)
+			wish = -1;
+
+		if (wish != _level_wish)
+		{
+			_level_wish = wish;
+			_level_since_us = time_us;
+			return false;
+		}
+		if (wish == 0 || time_us - _level_since_us < (wish > 0 ? _config.degrade_us : _config.restore_us))
+			return false;
+
+		_level += wish;
+		_level_wish = 0;
+		_format_changes++;
+		return true;
+	}
+
+	bool bitrate_controller::update_settings(uint64_t time_us)
+	{
+		double overshoot = _overshoot < 1 ? 1 : _overshoot > bitrate_max_overshoot ? bitrate_max_overshoot : _overshoot;
+		double desired = _target / overshoot;
+		desired = desired < _config.min_bitrate ? _config.min_bitrate : desired;
+
+		const level_t& level = _levels[_level];
+		bool format_changed = level.width != _settings.width || level.height != _settings.height || level.fps != _settings.fps;
+		double change = std::fabs(desired - _settings.bitrate) / _settings.bitrate;
+		// Cuts go out straight away; growth waits its turn
+		bool due = desired < _settings.bitrate || time_us >= _last_update_us + _config.min_update_interval_us;
+		if (!format_changed && (change < _config.min_change || !due))
+			return false;
+
+		_settings.bitrate = static_cast<uint32_t>(desired);
+		_settings.width = level.width;
+		_settings.height = level.height;
+		_settings.fps = level.fps;
+		_last_update_us = time_us;
+		_updates++;
+		return true;
+	}
+
+	bitrate_controller_stats_t bitrate_controller::get_stats() const
+	{
+		bitrate_controller_stats_t stats = {};
+		stats.target_bitrate = static_cast<uint32_t>(_target);
+		stats.encoded_bitrate = encoded_rate();
+		stats.overshoot = static_cast<float>(_overshoot);
+		stats.state = _state;
+		stats.level = _level;
+		stats.feedbacks = _feedbacks;
+		stats.decreases = _decreases;
+		stats.updates = _updates;
+		stats.format_changes = _format_changes;
+		return stats;
+	}
+
+} // namespace nakamir
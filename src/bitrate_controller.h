@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nakamir {
+
+	struct bitrate_controller_config_t {
+		uint32_t min_bitrate = 150000;
+		uint32_t max_bitrate = 6000000;
+		uint32_t start_bitrate = 1000000;
+
+		// Queuing delay past which the path counts as overused. Only a delay
+		// that is also still rising triggers a cut; one that is high but
+		// draining is left to drain.
+		uint32_t delay_threshold_us = 40000;
+		// Cut to this share of what got through when overused
+		float decrease_factor = 0.85f;
+		// Growth per second when nothing says the path is near capacity, and
+		// the gentler linear growth near the rate that last overused it. Until
+		// the path has overused once, growth is startup_increase_per_second,
+		// to find its capacity in a few seconds rather than a minute.
+		float startup_increase_per_second = 0.5f;
+		float increase_per_second = 0.08f;
+		uint32_t additive_increase_per_second = 100000;
+		// Loss above high cuts in proportion; below low allows growth; between holds
+		float loss_high = 0.10f;
+		float loss_low = 0.02f;
+
+		// The encoder is told about changes of at least min_change, and about
+		// increases at most once per min_update_interval_us. Rate control
+		// restarts on every change, so small wiggles aren't worth it.
+		float min_change = 0.05f;
+		uint32_t min_update_interval_us = 500000;
+
+		// Source format, and how far it may be traded away when bits run short.
+		// Each step down halves the pixels per second: first resolution, by
+		// sqrt(2) a side down to min_width, then frame rate down to min_fps.
+		// Leave allow_resolution off where the encoder can't change size
+		// mid-stream, and min_fps at fps to keep the frame rate.
+		uint32_t width = 1280;
+		uint32_t height = 720;
+		uint32_t fps = 30;
+		bool allow_resolution = false;
+		uint32_t min_width = 320;
+		uint32_t min_fps = 30;
+		// Step down when bits per pixel fall below degrade_bpp; step back up
+		// once the step above would get restore_bpp. Down after degrade_us
+		// below, up after restore_us above.
+		float degrade_bpp = 0.04f;
+		float restore_bpp = 0.07f;
+		uint32_t degrade_us = 1000000;
+		uint32_t restore_us = 4000000;
+	};
+
+	// What the transport reports back, e.g. from RTCP receiver reports or a
+	// depacketizer at the far end, every 50 to 500ms
+	struct bitrate_feedback_t {
+		uint64_t time_us;
+		uint32_t queue_delay_us;   // Delay over the lowest seen: what is queued along the path
+		float loss;                // Share of packets lost since the last feedback
+		uint32_t received_bitrate; // Got through since the last feedback, 0 if unknown
+	};
+
+	// What the encoder should be running at
+	struct bitrate_settings_t {
+		uint32_t bitrate;          // To hand the encoder, overshoot corrected
+		uint32_t width;
+		uint32_t height;
+		uint32_t fps;
+	};
+
+	enum bitrate_state_ {
+		bitrate_state_increase,
+		bitrate_state_hold,
+		bitrate_state_decrease,
+	};
+
+	struct bitrate_controller_stats_t {
+		uint32_t target_bitrate;   // What the path is thought to carry
+		uint32_t encoded_bitrate;  // What the encoder actually put out, over the last second
+		float overshoot;           // Encoded over asked for, smoothed; 1 is on target
+		bitrate_state_ state;
+		uint32_t level;            // Format step, 0 is the source format
+		uint64_t feedbacks;
+		uint64_t decreases;        // Cuts for delay or loss
+		uint64_t updates;          // Settings changes handed to the encoder
+		uint64_t format_changes;
+	};
+
+	// Closed loop bitrate adaptation for a live encoder, the control law only:
+	// no codec or transport calls, so it runs the same in the roundtrip
+	// example, where mf_set_encoder_bitrate applies it through ICodecAPI, and
+	// in skmf_bench, which replays bandwidth traces through a sim_link.
+	//
+	// A simplified Google congestion control: rising queuing delay or heavy
+	// loss cuts the target to a share of what actually got through; quiet
+	// feedback grows it, multiplicatively while the path's capacity is
+	// unknown and linearly close to where it last gave out. Encoded frame
+	// sizes show how far the encoder overshoots what it's asked for, and the
+	// rate handed to it is lowered to match. When the target leaves too few
+	// bits per pixel the format steps down, damped like lod_selector so it
+	// doesn't flap.
+	//
+	// One thread, e.g. the encoder's output callback, or a lock around it.
+	class bitrate_controller {
+	public:
+		bitrate_controller() { reset({}); }
+		explicit bitrate_controller(const bitrate_controller_config_t& config) { reset(config); }
+
+		void reset(const bitrate_controller_config_t& config);
+
+		// An encoded frame came out of the encoder
+		void on_frame(size_t bytes, uint64_t time_us);
+		// Feedback arrived. Returns true if settings() changed and should be
+		// applied to the encoder.
+		bool on_feedback(const bitrate_feedback_t& feedback);
+
+		const bitrate_settings_t& settings() const { return _settings; }
+		bitrate_controller_stats_t get_stats() const;
+
+	private:
+		struct level_t {
+			uint32_t width;
+			uint32_t height;
+			uint32_t fps;
+		};
+		struct frame_t {
+			uint64_t time_us;
+			size_t bytes;
+		};
+
+		double pixel_rate(uint32_t level) const;
+		// Encoded bits per second over the window, 0 until there are two frames
+		uint32_t encoded_rate(/**[out]**/ uint64_t* span_us = nullptr) const;
+		bool update_level(uint64_t time_us);
+		bool update_settings(uint64_t time_us);
+
+		bitrate_controller_config_t _config;
+		std::vector<level_t> _levels;     // Source format first
+		uint32_t _level = 0;
+		uint64_t _level_since_us = 0;     // When the current wish to step started, 0 for none
+		int32_t _level_wish = 0;          // +1 a step down the ladder, -1 back up, 0 neither
+
+		double _target = 0;
+		double _last_overuse = 0;         // Received rate when the path last overused, 0 if not lately
+		bool _overused = false;           // Ever, so past startup
+		double _previous_delay = 0;
+		uint64_t _last_feedback_us = 0;
+		bool _has_feedback = false;
+		bitrate_state_ _state = bitrate_state_increase;
+
+		// Encoded sizes over the last second, for the encoder's real rate
+		std::vector<frame_t> _frames;
+		size_t _frames_head = 0;
+		uint64_t _window_bytes = 0;
+		double _overshoot = 1;
+
+		bitrate_settings_t _settings = {};
+		uint64_t _last_update_us = 0;
+
+		uint64_t _feedbacks = 0;
+		uint64_t _decreases = 0;
+		uint64_t _updates = 0;
+		uint64_t _format_changes = 0;
+	};
+
+} // namespace nakamir
@@ -0,0 +1,296 @@
+#include "codec_registry.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+
+namespace nakamir {
+
+	// First line of a cache file; bump the version when the format changes
+	const char* codec_cache_magic = "skmf-codec-cache";
+	const uint32_t codec_cache_version = 1;
+
+	bool codec_registry::load(const char* path, const char* environment)
+	{
+#ifdef _WIN32
+		int length = MultiByteToWideChar(CP_UTF8, 0, path, -1, nullptr, 0);
+		if (length <= 0)
+			return false;
+		std::wstring wide(static_cast<size_t>(length), L'\0');
+		MultiByteToWideChar(CP_UTF8, 0, path, -1, wide.data(), length);
+		return load(wide.c_str(), environment);
+	}
+
+	bool codec_registry::load(const wchar_t* path, const char* environment)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_path = path;
+		_environment = environment;
+		FILE* file = _wfopen(path, L"rb");
+#else
+		std::lock_guard<std::mutex> lock(_mutex);
+		_path = path;
+		_environment = environment;
+		FILE* file = fopen(path, "rb");
+#endif
+		if (!file)
+			return false;
+		bool loaded = parse(file);
+		fclose(file);
+		if (!loaded)
+			_stats.rejected++;
+		return loaded;
+	}
+
+	// Reads a line without its line break. False at the end of the file or
+	// on a line too long to be ours.
+	static bool codec_cache_line(FILE* file, char* line, size_t size)
+	{
+		if (!fgets(line, static_cast<int>(size), file))
+			return false;
+		size_t length = strlen(line);
+		if (length > 0 && line[length - 1] != '\n' && !feof(file))
+			return false;
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+			line[--length] = 0;
+		return true;
+	}
+
+	bool codec_registry::parse(FILE* file)
+	{
+		char line[1024];
+		char magic[32];
+		uint32_t version = 0;
+		if (!codec_cache_line(file, line, sizeof(line)) || sscanf(line, "%31s %u", magic, &version) != 2 || strcmp(magic, codec_cache_magic) != 0 || version != codec_cache_version)
+			return false;
+		const char* environment_tag = "environment ";
+		if (!codec_cache_line(file, line, sizeof(line)) || strncmp(line, environment_tag, strlen(environment_tag)) != 0 || _environment != line + strlen(environment_tag))
+			return false;
+
+		// All or nothing: a torn or hand-edited file is enumerated over
+		std::vector<entry_t> entries;
+		while (codec_cache_line(file, line, sizeof(line)))
+		{
+			if (line[0] == 0)
+				continue;
+			char word[16];
+			char token[256];
+			int offset = 0;
+			if (sscanf(line, "%15s %255s%n", word, token, &offset) != 2)
+				return false;
+			if (strcmp(word, "key") == 0)
+			{
+				entries.push_back({ token, {} });
+				continue;
+			}
+			codec_candidate_t candidate = {};
+			if (strcmp(word, "candidate") != 0 || entries.empty() ||
+				sscanf(line, "%*s %u %u %u %u %255s %n", &candidate.flags, &candidate.order, &candidate.init_us, &candidate.failures, token, &offset) != 5)
+				return false;
+			candidate.id = token;
+			candidate.name = line + offset;
+			entries.back().candidates.push_back(std::move(candidate));
+		}
+		if (ferror(file))
+			return false;
+
+		for (entry_t& entry : entries)
+		{
+			// What this run has already enumerated is newer than the file
+			if (entry.candidates.empty() || find(entry.key.c_str()))
+				continue;
+			rank(&entry.candidates);
+			_entries.push_back(std::move(entry));
+			_stats.loads++;
+		}
+		return true;
+	}
+
+	bool codec_registry::save()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_path.empty())
+			return false;
+		if (!_dirty)
+			return true;
+
+		// Written aside and moved over, so a crash mid-write leaves the old file
+#ifdef _WIN32
+		std::wstring temp = _path + L".tmp";
+		FILE* file = _wfopen(temp.c_str(), L"wb");
+#else
+		std::string temp = _path + ".tmp";
+		FILE* file = fopen(temp.c_str(), "wb");
+#endif
+		if (!file)
+			return false;
+		fprintf(file, "%s %u\nenvironment %s\n", codec_cache_magic, codec_cache_version, _environment.c_str());
+		for (const entry_t& entry : _entries)
+		{
+			fprintf(file, "key %s\n", entry.key.c_str());
+			for (const codec_candidate_t& candidate : entry.candidates)
+				fprintf(file, "candidate %u %u %u %u %s %s\n", candidate.flags, candidate.order, candidate.init_us, candidate.failures, candidate.id.c_str(), candidate.name.c_str());
+		}
+		bool written = !ferror(file);
+		written = fclose(file) == 0 && written;
+#ifdef _WIN32
+		written = written && MoveFileExW(temp.c_str(), _path.c_str(), MOVEFILE_REPLACE_EXISTING);
+		if (!written)
+			DeleteFileW(temp.c_str());
+#else
+		written = written && rename(temp.c_str(), _path.c_str()) == 0;
+		if (!written)
+			remove(temp.c_str());
+#endif
+		if (!written)
+			return false;
+		_dirty = false;
+		_stats.saves++;
+		return true;
+	}
+
+	codec_registry::entry_t* codec_registry::find(const char* key)
+	{
+		for (entry_t& entry : _entries)
+		{
+			if (entry.key == key)
+				return &entry;
+		}
+		return nullptr;
+	}
+
+	void codec_registry::rank(std::vector<codec_candidate_t>* candidates)
+	{
+		auto score = [](const codec_candidate_t& candidate) {
+			return ((candidate.flags & codec_flag_hardware) ? 4 : 0) + ((candidate.flags & codec_flag_d3d_aware) ? 2 : 0) + ((candidate.flags & codec_flag_async) ? 1 : 0);
+		};
+		std::stable_sort(candidates->begin(), candidates->end(), [&](const codec_candidate_t& a, const codec_candidate_t& b) {
+			if (a.failures != b.failures)
+				return a.failures < b.failures;
+			if (score(a) != score(b))
+				return score(a) > score(b);
+			uint32_t a_init = a.init_us ? a.init_us : UINT32_MAX;
+			uint32_t b_init = b.init_us ? b.init_us : UINT32_MAX;
+			if (a_init != b_init)
+				return a_init < b_init;
+			return a.order < b.order;
+		});
+	}
+
+	bool codec_registry::candidates(const char* key, codec_enumerator* enumerator, std::vector<codec_candidate_t>* ranked)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stats.lookups++;
+		ranked->clear();
+
+		entry_t* entry = find(key);
+		if (entry)
+		{
+			_stats.hits++;
+			*ranked = entry->candidates;
+			return !ranked->empty();
+		}
+		if (!enumerator)
+			return false;
+
+		_stats.enumerations++;
+		std::vector<codec_candidate_t> found;
+		if (!enumerator->enumerate(key, &found))
+			return false;
+
+		// Whatever goes in must read back: ids are one token, names one line
+		entry_t added = { key, {} };
+		for (uint32_t i = 0; i < found.size(); i++)
+		{
+			codec_candidate_t& candidate = found[i];
+			if (candidate.id.empty() || candidate.id.find_first_of(" \t\r\n") != std::string::npos)
+				continue;
+			std::replace_if(candidate.name.begin(), candidate.name.end(), [](char c) { return c == '\r' || c == '\n'; }, ' ');
+			candidate.order = i;
+			added.candidates.push_back(std::move(candidate));
+		}
+		if (added.candidates.empty())
+			return false;
+		rank(&added.candidates);
+		*ranked = added.candidates;
+		_entries.push_back(std::move(added));
+		_dirty = true;
+		return true;
+	}
+
+	void codec_registry::record_activation(const char* key, const char* id, bool succeeded, uint32_t init_us, uint32_t flags)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stats.activations++;
+		if (!succeeded)
+			_stats.failures++;
+
+		entry_t* entry = find(key);
+		if (!entry)
+			return;
+		auto it = std::find_if(entry->candidates.begin(), entry->candidates.end(), [&](const codec_candidate_t& candidate) { return candidate.id == id; });
+		if (it == entry->candidates.end())
+			return;
+
+		codec_candidate_t& candidate = *it;
+		size_t place = it - entry->candidates.begin();
+		if (!succeeded)
+		{
+			candidate.failures++;
+			_dirty = true;
+		}
+		else
+		{
+			if (candidate.failures)
+			{
+				candidate.failures = 0;
+				_dirty = true;
+			}
+			// Smoothed, as the first activation after boot pays for loading
+			// the DLL; only worth a write when it moves by a quarter
+			uint32_t previous = candidate.init_us;
+			candidate.init_us = previous ? (previous * 3 + init_us) / 4 : (init_us ? init_us : 1);
+			uint32_t change = candidate.init_us > previous ? candidate.init_us - previous : previous - candidate.init_us;
+			if (!previous || change * 4 > previous)
+				_dirty = true;
+		}
+		// Whether it is hardware is the enumerator's to say; the live object
+		// knows whether it is asynchronous and D3D aware
+		if (flags)
+		{
+			uint32_t learned = (candidate.flags & codec_flag_hardware) | (flags & ~codec_flag_hardware);
+			if (learned != candidate.flags)
+			{
+				candidate.flags = learned;
+				_dirty = true;
+			}
+		}
+
+		std::string kept = candidate.id;
+		rank(&entry->candidates);
+		if (entry->candidates[place].id != kept)
+			_dirty = true;
+	}
+
+	void codec_registry::invalidate(const char* key)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto it = std::find_if(_entries.begin(), _entries.end(), [&](const entry_t& entry) { return entry.key == key; });
+		if (it == _entries.end())
+			return;
+		_entries.erase(it);
+		_dirty = true;
+	}
+
+	codec_registry_stats_t codec_registry::get_stats()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _stats;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nakamir {
+
+	enum codec_flag_ {
+		codec_flag_hardware = 1 << 0,
+		codec_flag_async = 1 << 1,
+		codec_flag_d3d_aware = 1 << 2,   // Only known once it has been activated
+	};
+
+	struct codec_candidate_t {
+		std::string id;          // How to create it without enumerating, e.g. a CLSID. No whitespace.
+		std::string name;        // Friendly name, for logs
+		uint32_t flags;          // codec_flag_ bits
+		uint32_t order;          // Place in the enumerator's own ranking
+		uint32_t init_us;        // Measured activation time, smoothed; 0 until measured
+		uint32_t failures;       // Activations failed in a row
+	};
+
+	// Lists the codecs that can handle key, in the platform's own order of
+	// preference, e.g. MFTEnumEx with MFT_ENUM_FLAG_SORTANDFILTER. A stub can
+	// stand in for it off Windows.
+	class codec_enumerator {
+	public:
+		virtual ~codec_enumerator() = default;
+		// False if enumerating failed; an empty list is a valid answer
+		virtual bool enumerate(const char* key, /**[out]**/ std::vector<codec_candidate_t>* candidates) = 0;
+	};
+
+	struct codec_registry_stats_t {
+		uint64_t lookups;
+		uint64_t hits;           // Answered without enumerating
+		uint64_t enumerations;
+		uint64_t activations;    // Recorded, successful or not
+		uint64_t failures;
+		uint64_t loads;          // Keys read from the cache file
+		uint64_t rejected;       // Cache files ignored: stale environment, wrong version or malformed
+		uint64_t saves;
+	};
+
+	// What codecs a machine has, enumerated once and ranked, so creating a
+	// codec session takes one activation instead of an enumeration that loads
+	// every candidate's DLL. Rankings persist to a small text file, tagged
+	// with an environment string (OS build, GPU driver) so that an update
+	// throws the cache away rather than steering towards a codec that moved.
+	//
+	// Candidates rank by fewest recent failures, then hardware, D3D awareness
+	// and asynchronous processing, then measured activation time, then the
+	// enumerator's order. Unmeasured candidates rank behind measured ones of
+	// the same kind, so the choice only moves when one fails.
+	//
+	// Keys name a codec category and format pair, e.g. "encoder:NV12:H264",
+	// and mustn't contain whitespace. Thread safe; enumerations run under the
+	// registry's lock, so concurrent lookups of one key enumerate once.
+	class codec_registry {
+	public:
+		codec_registry() = default;
+
+		codec_registry(const codec_registry&) = delete;
+		codec_registry& operator=(const codec_registry&) = delete;
+
+		// Takes the cache at path (UTF-8) if it was saved under the same
+		// environment, and remembers both for save. False if nothing was
+		// taken, which is fine: keys get enumerated as they are asked for.
+		bool load(const char* path, const char* environment);
+#ifdef _WIN32
+		bool load(const wchar_t* path, const char* environment);
+#endif
+		// Writes the cache back if rankings changed since the last load or
+		// save, replacing the file in one step. True if the file is current.
+		bool save();
+
+		// Candidates for key, best first. Enumerates through enumerator only
+		// if key isn't cached; a null enumerator answers from the cache alone.
+		// False if there are none.
+		bool candidates(const char* key, /**[in]**/ codec_enumerator* enumerator, /**[out]**/ std::vector<codec_candidate_t>* ranked);
+		// How activating id went, and the flags learned from the live object
+		// (0 to keep the known ones). Re-ranks key.
+		void record_activation(const char* key, const char* id, bool succeeded, uint32_t init_us, uint32_t flags = 0);
+		// Forgets key, so the next lookup enumerates again, e.g. after every
+		// cached candidate failed
+		void invalidate(const char* key);
+
+		codec_registry_stats_t get_stats();
+
+	private:
+		struct entry_t {
+			std::string key;
+			std::vector<codec_candidate_t> candidates;   // Ranked
+		};
+
+		entry_t* find(const char* key);
+		bool parse(/**[in]**/ FILE* file);
+		static void rank(/**[in,out]**/ std::vector<codec_candidate_t>* candidates);
+
+		std::mutex _mutex;
+		std::vector<entry_t> _entries;   // A handful of keys at most
+		std::string _environment;
+#ifdef _WIN32
+		std::wstring _path;
+#else
+		std::string _path;
+#endif
+		bool _dirty = false;
+		codec_registry_stats_t _stats = {};
+	};
+
+} // namespace nakamir
@@ -0,0 +1,75 @@
+#include "cpu_features.h"
+
+#if SKMF_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace nakamir {
+
+#if SKMF_X86
+	static void cpuid(int leaf, int subleaf, int regs[4])
+	{
+#ifdef _MSC_VER
+		__cpuidex(regs, leaf, subleaf);
+#else
+		unsigned int a = 0, b = 0, c = 0, d = 0;
+		__cpuid_count(leaf, subleaf, a, b, c, d);
+		regs[0] = static_cast<int>(a); regs[1] = static_cast<int>(b);
+		regs[2] = static_cast<int>(c); regs[3] = static_cast<int>(d);
+#endif
+	}
+
+	static uint64_t xgetbv0()
+	{
+#ifdef _MSC_VER
+		return _xgetbv(0);
+#else
+		unsigned int lo = 0, hi = 0;
+		__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		return (static_cast<uint64_t>(hi) << 32) | lo;
+#endif
+	}
+
+	static uint32_t detect_features()
+	{
+		uint32_t features = cpu_feature_none;
+		int regs[4] = {};
+
+		cpuid(0, 0, regs);
+		int max_leaf = regs[0];
+		if (max_leaf < 1)
+			return features;
+
+		cpuid(1, 0, regs);
+		if (regs[3] & (1 << 26)) features |= cpu_feature_sse2;
+		if (regs[2] & (1 << 9))  features |= cpu_feature_ssse3;
+		if (regs[2] & (1 << 19)) features |= cpu_feature_sse41;
+
+		// AVX state must be enabled by the OS (OSXSAVE + XCR0 XMM/YMM bits)
+		bool os_avx = (regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && (xgetbv0() & 0x6) == 0x6;
+		if (os_avx && max_leaf >= 7)
+		{
+			cpuid(7, 0, regs);
+			if (regs[1] & (1 << 5)) features |= cpu_feature_avx2;
+		}
+		return features;
+	}
+#else
+	static uint32_t detect_features()
+	{
+		// NEON is mandatory on every ARM target we build for
+		return SKMF_NEON ? cpu_feature_neon : cpu_feature_none;
+	}
+#endif
+
+	uint32_t cpu_features()
+	{
+		static const uint32_t features = detect_features();
+		return features;
+	}
+
+} // namespace nakamir
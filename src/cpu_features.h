@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SKMF_X86 1
+#else
+#define SKMF_X86 0
+#endif
+
+#if defined(_M_ARM64) || defined(_M_ARM) || defined(__ARM_NEON)
+#define SKMF_NEON 1
+#else
+#define SKMF_NEON 0
+#endif
+
+namespace nakamir {
+
+	enum cpu_feature_ {
+		cpu_feature_none   = 0,
+		cpu_feature_sse2   = 1 << 0,
+		cpu_feature_ssse3  = 1 << 1,
+		cpu_feature_sse41  = 1 << 2,
+		cpu_feature_avx2   = 1 << 3,
+		cpu_feature_neon   = 1 << 4,
+	};
+
+	// Instruction sets usable on this machine (CPU and OS support), detected once
+	uint32_t cpu_features();
+
+	inline bool cpu_has(cpu_feature_ feature)
+	{
+		return (cpu_features() & feature) != 0;
+	}
+
+	// Index of the lowest set bit, value must not be 0
+	inline uint32_t bit_scan_forward(uint32_t value)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, value);
+		return index;
+#else
+		return static_cast<uint32_t>(__builtin_ctz(value));
+#endif
+	}
+
+	inline uint32_t bit_scan_forward64(uint64_t value)
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+		unsigned long index;
+		_BitScanForward64(&index, value);
+		return index;
+#elif defined(_MSC_VER)
+		uint32_t low = static_cast<uint32_t>(value);
+		return low ? bit_scan_forward(low) : 32 + bit_scan_forward(static_cast<uint32_t>(value >> 32));
+#else
+		return static_cast<uint32_t>(__builtin_ctzll(value));
+#endif
+	}
+
+	// Index of the highest set bit, value must not be 0
+	inline uint32_t bit_scan_reverse64(uint64_t value)
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		return index;
+#elif defined(_MSC_VER)
+		unsigned long index;
+		uint32_t high = static_cast<uint32_t>(value >> 32);
+		if (high)
+		{
+			_BitScanReverse(&index, high);
+			return 32 + index;
+		}
+		_BitScanReverse(&index, static_cast<uint32_t>(value));
+		return index;
+#else
+		return 63 - static_cast<uint32_t>(__builtin_clzll(value));
+#endif
+	}
+
+} // namespace nakamir
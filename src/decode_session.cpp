@@ -0,0 +1,143 @@
+#include "decode_session.h"
+#include <stdexcept>
+
+namespace nakamir {
+
+	decode_session::decode_session(media_transform* transform, decode_session_read_fn read, decode_session_deliver_fn deliver,
+		void* context, sample_allocator* allocator, uint32_t inputs_per_step)
+		: _transform(transform), _read(read), _deliver(deliver), _context(context), _allocator(allocator),
+		_inputs_per_step(inputs_per_step ? inputs_per_step : 1)
+	{
+	}
+
+	decode_session::~decode_session()
+	{
+		for (media_sample* sample : _pending)
+			sample->release();
+	}
+
+	session_step_ decode_session::on_step(void* context)
+	{
+		return static_cast<decode_session*>(context)->step();
+	}
+
+	session_step_ decode_session::step()
+	{
+		// Whatever the consumer turned away last time goes first, so frames stay in order
+		if (!deliver_pending())
+		{
+			_blocked++;
+			return session_step_blocked;
+		}
+		if (_drained)
+			return session_step_finished;
+
+		if (_transform->is_async())
+			step_async();
+		else
+			step_sync();
+
+		if (!deliver_pending())
+		{
+			_blocked++;
+			return session_step_blocked;
+		}
+		return _drained ? session_step_finished : session_step_continue;
+	}
+
+	void decode_session::step_sync()
+	{
+		for (uint32_t i = 0; i < _inputs_per_step && _pending.empty(); i++)
+		{
+			ref_ptr<media_sample> sample = ref_ptr<media_sample>::attach(_read(_context));
+			if (!sample)
+			{
+				// Out of input, so collect the frames the decoder held back for reordering
+				_end_of_stream = true;
+				_transform->drain();
+				transform_process_output(_transform, on_receive_sample, this, _allocator);
+				_drained = true;
+				return;
+			}
+
+			if (_transform->process_input(sample.get()) != transform_status_ok)
+				throw std::runtime_error("Transform rejected the input sample");
+			_inputs++;
+			transform_process_output(_transform, on_receive_sample, this, _allocator);
+		}
+	}
+
+	void decode_session::step_async()
+	{
+		uint32_t inputs = 0;
+		while (inputs < _inputs_per_step && _pending.empty())
+		{
+			transform_event_ event = _transform->get_event(true);
+			if (event == transform_event_need_input)
+			{
+				// Requests can still be outstanding after we started draining
+				if (_end_of_stream)
+					continue;
+
+				ref_ptr<media_sample> sample = ref_ptr<media_sample>::attach(_read(_context));
+				if (!sample)
+				{
+					_end_of_stream = true;
+					_transform->drain();
+					continue;
+				}
+				if (_transform->process_input(sample.get()) != transform_status_ok)
+					throw std::runtime_error("Transform rejected the input sample");
+				_inputs++;
+				inputs++;
+			}
+			else if (event == transform_event_have_output)
+			{
+				transform_process_output(_transform, on_receive_sample, this, _allocator, 1);
+			}
+			else
+			{
+				// Drain complete, or the transform was shut down under us
+				_drained = true;
+				return;
+			}
+		}
+	}
+
+	bool decode_session::deliver_pending()
+	{
+		while (!_pending.empty())
+		{
+			media_sample* sample = _pending.front();
+			if (!_deliver(_transform, sample, _context))
+				return false;
+			_pending.pop_front();
+			_pending_count--;
+			sample->release();
+			_outputs++;
+		}
+		return true;
+	}
+
+	void decode_session::on_receive_sample(media_transform* /*transform*/, media_sample* sample, void* context)
+	{
+		// Keep it until the consumer has room; transform_process_output drops its reference on return
+		decode_session* session = static_cast<decode_session*>(context);
+		sample->add_ref();
+		session->_pending.push_back(sample);
+		session->_pending_count++;
+	}
+
+	decode_session_stats_t decode_session::get_stats()
+	{
+		decode_session_stats_t stats = {};
+		stats.inputs = _inputs.load();
+		stats.outputs = _outputs.load();
+		stats.blocked = _blocked.load();
+		stats.pending = _pending_count.load();
+		stats.end_of_stream = _end_of_stream.load();
+		stats.drained = _drained.load();
+		return stats;
+	}
+
+} // namespace nakamir
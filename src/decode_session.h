@@ -0,0 +1,75 @@
+#pragma once
+
+#include "session_scheduler.h"
+#include "transform.h"
+#include <atomic>
+#include <cstdint>
+#include <deque>
+
+namespace nakamir {
+
+	// Returns the next compressed sample as a new reference, or nullptr at the
+	// end of the stream
+	typedef media_sample*(*decode_session_read_fn)(void* context);
+	// Hands a decoded sample on. Returns false if the consumer has no room, in
+	// which case the session keeps the sample, blocks, and offers it again
+	// after the consumer calls session_scheduler::wake.
+	typedef bool(*decode_session_deliver_fn)(media_transform* transform, media_sample* sample, void* context);
+
+	struct decode_session_stats_t {
+		uint64_t inputs;          // Samples fed to the transform
+		uint64_t outputs;         // Samples the consumer took
+		uint64_t blocked;         // Steps that ended on a full consumer
+		uint32_t pending;         // Decoded samples waiting for the consumer
+		bool end_of_stream;       // The reader ran out and the transform is draining
+		bool drained;             // ...and the transform has given up its last frame
+	};
+
+	// One decoder's read -> decode -> deliver loop cut into steps for a
+	// session_scheduler, so a wall of videos shares a few threads rather than
+	// running a thread each. A step feeds up to inputs_per_step samples, stopping
+	// early once there is output, and hands the output on; when the consumer is
+	// full the step reports session_step_blocked instead of waiting.
+	//
+	// Asynchronous transforms are stepped by waiting on their events, so a step
+	// holds its worker until the transform asks for input or has output.
+	class decode_session {
+	public:
+		decode_session(/**[in]**/ media_transform* transform, /**[in]**/ decode_session_read_fn read, /**[in]**/ decode_session_deliver_fn deliver,
+			/**[in]**/ void* context = nullptr, /**[in]**/ sample_allocator* allocator = nullptr, uint32_t inputs_per_step = 1);
+		~decode_session();
+
+		decode_session(const decode_session&) = delete;
+		decode_session& operator=(const decode_session&) = delete;
+
+		session_step_ step();
+		// session_step_fn for session_scheduler::add, with the session as context
+		static session_step_ on_step(void* context);
+
+		decode_session_stats_t get_stats();
+
+	private:
+		void step_sync();
+		void step_async();
+		bool deliver_pending();
+		static void on_receive_sample(media_transform* transform, media_sample* sample, void* context);
+
+		media_transform* _transform;
+		decode_session_read_fn _read;
+		decode_session_deliver_fn _deliver;
+		void* _context;
+		sample_allocator* _allocator;
+		uint32_t _inputs_per_step;
+
+		// Only touched from inside step, which the scheduler never runs twice at once
+		std::deque<media_sample*> _pending;
+
+		std::atomic<uint64_t> _inputs = 0;
+		std::atomic<uint64_t> _outputs = 0;
+		std::atomic<uint64_t> _blocked = 0;
+		std::atomic<uint32_t> _pending_count = 0;
+		std::atomic<bool> _end_of_stream = false;
+		std::atomic<bool> _drained = false;
+	};
+
+} // namespace nakamir
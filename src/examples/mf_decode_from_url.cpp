@@ -2,45 +2,53 @@
 #include <stereokit_ui.h>
 #include "../nv12_tex.h"
 #include "../nv12_sprite.h"
-#include "../mf_video_decoder.h"
-#include "../mf_utility.h"
+#include "../mf_decode_session.h"
+#include "../session_scheduler.h"
+#include "../metrics_ui.h"
 #include "../error.h"
-#include <wrl/client.h>
 #include <mfapi.h>
-#include <mfplay.h>
-#include <mfreadwrite.h>
-#include <codecapi.h>
-#include <atomic>
-#include <thread>
-
-using Microsoft::WRL::ComPtr;
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <vector>
 
 using namespace sk;
 
 namespace nakamir {
 
 	// PRIVATE METHODS
-	static void mf_decode_from_url_impl(/**[in]**/ const wchar_t* filename, /**[out]**/ UINT32* width, /**[out]**/ UINT32* height);
-	static void mf_decode_source_reader_to_buffer(/**[in]**/ const ComPtr<IMFSourceReader>& pSourceReader, /**[in]**/ const ComPtr<IMFTransform>& pDecoderTransform);
-	static void mf_shutdown_thread();
+	static void mf_shutdown_sessions();
+
+	// One video in the wall, decoded as a session on the shared scheduler
+	struct _video_panel_t {
+		mf_decode_session session;
+		nv12_tex_t nv12_tex;
+		nv12_sprite_t nv12_sprite;
+		pose_t window_pose;
+		vec2 aspect_ratio;
+		matrix render_matrix;
+	};
 
-	static IMFActivate** ppActivate = NULL;
-	static ComPtr<IMFSourceReader> pSourceReader;
-	static ComPtr<IMFTransform> pDecoderTransform;
-	static std::thread sourceReaderThread;
-	static std::atomic_bool _cancellationToken;
+	// Decoding for every panel runs on this pool rather than a thread per video
+	static std::unique_ptr<session_scheduler> scheduler;
+	static std::vector<std::unique_ptr<_video_panel_t>> panels;
 
-	static pose_t window_pose = { {0,0.25f,-0.3f}, quat_from_angles(20,-180,0) };
+	static pose_t metrics_window_pose = { {0.4f,0.25f,-0.3f}, quat_from_angles(20,-200,0) };
 
 	const float video_plane_width = 0.6f;
+	const float video_panel_spacing = 0.05f;
 	const vec2 video_window_padding = { 0.02f, 0.02f };
-	static vec2 video_aspect_ratio;
-	static matrix video_render_matrix;
 
-	static nv12_tex_t nv12_tex;
-	static nv12_sprite_t nv12_sprite;
+	// Frames decoded ahead of the clock, and how far ahead the first one is
+	// scheduled, which is what absorbs uneven decode times
+	const uint32_t presenter_frames = 8;
+	const int64_t presenter_latency = 1000000; // 100ms
 
 	void mf_decode_from_url(const wchar_t* filename) {
+		mf_decode_wall(&filename, 1);
+	}
+
+	void mf_decode_wall(const wchar_t* const* filenames, uint32_t count) {
 		sk_settings_t settings = {};
 		settings.app_name = "MF Decode from URL";
 		settings.assets_folder = "Assets";
@@ -51,170 +59,92 @@ namespace nakamir {
 		if (FAILED(MFStartup(MF_VERSION)))
 			return;
 
-		// Decode an MP4 file from a local or online source as fast as possible.
-		UINT32 video_width;
-		UINT32 video_height;
-		mf_decode_from_url_impl(L"http://commondatastorage.googleapis.com/gtv-videos-bucket/sample/BigBuckBunny.mp4", &video_width, &video_height);
-
-		// Set up the render plane based on the video dimensions
-		video_aspect_ratio = { video_plane_width, video_height / (float)video_width * video_plane_width };
-		video_render_matrix = matrix_ts({ 0, -video_aspect_ratio.y / 2, -.002f }, { (video_aspect_ratio.x - video_window_padding.x), (video_aspect_ratio.y - video_window_padding.y), 0 });
+		scheduler = std::make_unique<session_scheduler>();
+		log_info(std::format("Decoding {} video(s) on {} worker thread(s)", count, scheduler->thread_count()).c_str());
 
-		nv12_tex = nv12_tex_create(video_width, video_height);
-		nv12_sprite = nv12_sprite_create(nv12_tex, sprite_type_atlased);
-
-		// Run the source reader on a separate thread
-		sourceReaderThread = std::thread(mf_decode_source_reader_to_buffer, pSourceReader, pDecoderTransform);
+		// Lay the panels out in a grid facing the user, the first where a single video would be
+		uint32_t columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(count))));
+		for (uint32_t i = 0; i < count; i++)
+		{
+			std::unique_ptr<_video_panel_t> panel = std::make_unique<_video_panel_t>();
+			// Decode an MP4 file from a local or online source, played back in real time.
+			panel->session.open(filenames[i], presenter_frames, presenter_latency);
+			UINT32 width = panel->session.width();
+			UINT32 height = panel->session.height();
+
+			// Set up the render plane based on the video dimensions
+			panel->aspect_ratio = { video_plane_width, height / (float)width * video_plane_width };
+			panel->render_matrix = matrix_ts({ 0, -panel->aspect_ratio.y / 2, -.002f }, { (panel->aspect_ratio.x - video_window_padding.x), (panel->aspect_ratio.y - video_window_padding.y), 0 });
+			float column = static_cast<float>(i % columns);
+			float row = static_cast<float>(i / columns);
+			panel->window_pose = { { -column * (video_plane_width + video_panel_spacing), 0.25f - row * (panel->aspect_ratio.y + video_panel_spacing), -0.3f }, quat_from_angles(20,-180,0) };
+
+			// Streams too big for the atlas draw from their own textures, which
+			// go round a ring so uploads never touch the set being drawn
+			panel->nv12_tex = nv12_tex_create(width, height, nv12_tex_upload_ring);
+			// and only at the size the panel is on screen, not the stream's
+			nv12_tex_set_lod(panel->nv12_tex, true);
+			panel->nv12_sprite = nv12_sprite_create(panel->nv12_tex, sprite_type_atlased);
+			panel->session.start(scheduler.get());
+			panels.push_back(std::move(panel));
+		}
 
 		sk_run(
 			[]() {
-				ui_window_begin("Video", window_pose, video_aspect_ratio, ui_win_normal, ui_move_face_user);
-				nv12_sprite_ui_image(nv12_sprite, video_render_matrix);
-				ui_window_end();
-			}, mf_shutdown_thread);
-
-		nv12_tex_release(nv12_tex);
-		nv12_sprite_release(nv12_sprite);
+				// Upload the frames due now, if they changed, from the main thread
+				int64_t now = std::chrono::duration_cast<std::chrono::duration<int64_t, std::ratio<1, 10000000>>>(
+					std::chrono::steady_clock::now().time_since_epoch()).count();
+				for (size_t i = 0; i < panels.size(); i++)
+				{
+					_video_panel_t* panel = panels[i].get();
+					mailbox_frame_t* frame = panel->session.present(now);
+					if (frame)
+					{
+						metrics_scope upload(metric_stage_upload, frame->size);
+						nv12_tex_set_buffer(panel->nv12_tex, frame->data, 0, frame->stride);
+					}
+
+					frame_presenter_stats_t stats = panel->session.get_presenter_stats();
+					// The windows share a title, so give each its own id scope
+					ui_push_idi(static_cast<int32_t>(i));
+					ui_window_begin("Video", panel->window_pose, panel->aspect_ratio, ui_win_normal, ui_move_face_user);
+					ui_text(std::format("\tQueued {}/{}, late drops {}, underruns {}, drift {:.1f}ms", stats.depth, stats.capacity,
+						stats.dropped_late, stats.underruns, stats.mean_drift / 10000.0).c_str());
+					slot_ring_stats_t ring_stats = nv12_tex_get_ring_stats(panel->nv12_tex);
+					ui_text(std::format("\tTexture ring: {} uploads, {} stalls avoided", ring_stats.published, ring_stats.stalls_avoided).c_str());
+					lod_selector_stats_t lod_stats = nv12_tex_get_lod_stats(panel->nv12_tex);
+					ui_text(std::format("\tUploading {}x{}, level {}/{}, {} size changes", lod_stats.width, lod_stats.height,
+						lod_stats.level, lod_stats.levels, lod_stats.changes).c_str());
+					// Queued rather than drawn, so the whole wall goes out as one draw per atlas
+					nv12_sprite_batch_add(panel->nv12_sprite, panel->render_matrix);
+					ui_window_end();
+					ui_pop_id();
+				}
+				nv12_sprite_batch_submit();
 
-		if (FAILED(MFShutdown())) {
-			log_err("MFShutdown call failed!");
-			return;
-		}
-	}
+				metrics_ui_window(&metrics_window_pose);
+			}, mf_shutdown_sessions);
 
-	static void mf_decode_from_url_impl(const wchar_t* filename, UINT32* width, UINT32* height)
-	{
-		_cancellationToken = false;
-		try
-		{
-			// Set up the reader for the file
-			ComPtr<IMFSourceResolver> pSourceResolver;
-			ThrowIfFailed(MFCreateSourceResolver(&pSourceResolver));
-
-			// Create a media source object from a URL
-			MF_OBJECT_TYPE objectType = MF_OBJECT_INVALID;
-			ComPtr<IUnknown> uSource;
-			ThrowIfFailed(pSourceResolver->CreateObjectFromURL(
-				filename,					// URL of the source.
-				MF_RESOLUTION_MEDIASOURCE | MF_RESOLUTION_READ,  // Create a source object.
-				NULL,                       // Optional property store.
-				&objectType,				// Receives the created object type. 
-				&uSource					// Receives a pointer to the media source.
-			));
-
-			// Get a pointer to the media source
-			ComPtr<IMFMediaSource> mediaFileSource;
-			ThrowIfFailed(uSource->QueryInterface(IID_PPV_ARGS(mediaFileSource.GetAddressOf())));
-
-			// Create attributes for the source reader
-			ComPtr<IMFAttributes> pVideoReaderAttributes;
-			ThrowIfFailed(MFCreateAttributes(pVideoReaderAttributes.GetAddressOf(), 1));
-			ThrowIfFailed(pVideoReaderAttributes->SetUINT32(MF_READWRITE_ENABLE_HARDWARE_TRANSFORMS, TRUE));
-
-			// Create a source reader from the media source
-			ThrowIfFailed(MFCreateSourceReaderFromMediaSource(mediaFileSource.Get(), pVideoReaderAttributes.Get(), pSourceReader.GetAddressOf()));
-
-			// Get the current media type of the first video stream
-			ComPtr<IMFMediaType> pInputMediaType;
-			ThrowIfFailed(pSourceReader->GetCurrentMediaType((DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM, pInputMediaType.GetAddressOf()));
-
-			ComPtr<IMFMediaType> pOutputMediaType;
-			ThrowIfFailed(MFCreateMediaType(pOutputMediaType.GetAddressOf()));
-			ThrowIfFailed(pInputMediaType->CopyAllItems(pOutputMediaType.Get()));
-			ThrowIfFailed(pOutputMediaType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_NV12));
-
-			// Get the width and height of the output video
-			ThrowIfFailed(MFGetAttributeSize(pOutputMediaType.Get(), MF_MT_FRAME_SIZE, width, height));
-
-			_MFT_TYPE decoderType = mf_create_mft_video_decoder(pInputMediaType.Get(), pOutputMediaType.Get(), pDecoderTransform.GetAddressOf(), &ppActivate);
-			ComPtr<IMFAttributes> pAttributes;
-			ThrowIfFailed(pDecoderTransform->GetAttributes(pAttributes.GetAddressOf()));
-			ThrowIfFailed(pAttributes->SetUINT32(CODECAPI_AVDecVideoAcceleration_H264, TRUE));
-		}
-		catch (const std::exception& e)
+		for (std::unique_ptr<_video_panel_t>& panel : panels)
 		{
-			log_err(e.what());
-			throw;
+			// Sprites first, an atlased one hands its texture's tile back
+			nv12_sprite_release(panel->nv12_sprite);
+			nv12_tex_release(panel->nv12_tex);
 		}
-	}
-
-	static void mf_decode_source_reader_to_buffer(const ComPtr<IMFSourceReader>& pSourceReader, const ComPtr<IMFTransform>& pDecoderTransform)
-	{
-		try
-		{
-			// Send messages to decoder to flush data and start streaming
-			ThrowIfFailed(pDecoderTransform->ProcessMessage(MFT_MESSAGE_COMMAND_FLUSH, NULL));
-			ThrowIfFailed(pDecoderTransform->ProcessMessage(MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, NULL));
-			ThrowIfFailed(pDecoderTransform->ProcessMessage(MFT_MESSAGE_NOTIFY_START_OF_STREAM, NULL));
-
-			// Start processing frames
-			LONGLONG llSampleTime = 0, llSampleDuration = 0;
-			while (!_cancellationToken)
-			{
-				ComPtr<IMFSample> pVideoSample;
-				DWORD streamIndex, flags;
-				ThrowIfFailed(pSourceReader->ReadSample(
-					MF_SOURCE_READER_FIRST_VIDEO_STREAM,
-					0,                              // Flags.
-					&streamIndex,                   // Receives the actual stream index. 
-					&flags,                         // Receives status flags.
-					&llSampleTime,					// Receives the timestamp.
-					pVideoSample.GetAddressOf()     // Receives the sample or NULL.
-				));
-
-				if (flags & MF_SOURCE_READERF_STREAMTICK)
-				{
-					log_info("\tStream tick.");
-				}
-				if (flags & MF_SOURCE_READERF_ENDOFSTREAM)
-				{
-					log_info("\tEnd of stream.");
-					break;
-				}
+		panels.clear();
+		nv12_sprite_batch_release();
 
-				if (pVideoSample)
-				{
-					ThrowIfFailed(pVideoSample->SetSampleTime(llSampleTime));
-					ThrowIfFailed(pVideoSample->GetSampleDuration(&llSampleDuration));
-
-					mf_transform_sample_to_buffer(pDecoderTransform.Get(), pVideoSample.Get(),
-						[](IMFTransform* pDecoderTransform, IMFSample* pDecodedSample, void* pContext) {
-							// Write the decoded sample to the nv12 texture
-							ComPtr<IMFMediaBuffer> buffer;
-							ThrowIfFailed(pDecodedSample->GetBufferByIndex(0, buffer.GetAddressOf()));
-
-							DWORD bufferLength;
-							ThrowIfFailed(buffer->GetCurrentLength(&bufferLength));
-
-							//log_info(std::format("Sample size {}", bufferLength).c_str());
-
-							byte* byteBuffer = NULL;
-							DWORD maxLength = 0, currentLength = 0;
-							ThrowIfFailed(buffer->Lock(&byteBuffer, &maxLength, &currentLength));
-							nv12_tex_set_buffer(nv12_tex, byteBuffer);
-							ThrowIfFailed(buffer->Unlock());
-						});
-				}
-			}
-		}
-		catch (const std::exception& e)
-		{
-			log_err(e.what());
-			throw;
+		if (FAILED(MFShutdown())) {
+			log_err("MFShutdown call failed!");
+			return;
 		}
 	}
 
-	static void mf_shutdown_thread()
+	static void mf_shutdown_sessions()
 	{
-		_cancellationToken = true;
-		sourceReaderThread.join();
-
-		pSourceReader.Reset();
-		pDecoderTransform.Reset();
-
-		if (ppActivate && *ppActivate)
-		{
-			CoTaskMemFree(ppActivate);
-		}
+		// Take every session off the workers before the pool goes away
+		for (std::unique_ptr<_video_panel_t>& panel : panels)
+			panel->session.close();
+		scheduler.reset();
 	}
-} // namespace nakamir
\ No newline at end of file
+} // namespace nakamir
@@ -6,6 +6,13 @@
 #include "../mf_video_encoder.h"
 #include "../mf_video_decoder.h"
 #include "../mf_utility.h"
+#include "../mp4_recorder.h"
+#include "../rtp_h264.h"
+#include "../udp_socket.h"
+#include "../sim_channel.h"
+#include "../bitrate_controller.h"
+#include "../startup_graph.h"
+#include "../metrics_ui.h"
 #include "../error.h"
 #include <wrl/client.h>
 #include <mfapi.h>
@@ -14,31 +21,67 @@
 #include <mfreadwrite.h>
 #include <codecapi.h>
 #include <atomic>
+#include <chrono>
 #include <format>
+#include <memory>
 #include <thread>
 
-// Settings
-#define PRINT_MBPS 1
-
 using Microsoft::WRL::ComPtr;
 using namespace sk;
 
 namespace nakamir {
 
+	// Starting and highest bitrate; the controller backs off from it when the
+	// RTP receive path reports loss
 	const UINT32 bitrate = 3000000;
+	// The encoder's output is also kept, as a fragmented MP4 next to the executable
+	const char* recording_path = "mf_roundtrip_webcam.mp4";
+	// and streamed as RTP to this local port, e.g. for a player given an SDP file
+	const uint16_t rtp_port = 5004;
+	// The decoder is fed the way a network receiver would be: packetized, sent
+	// through a simulated channel and put back together. Give the channel loss
+	// or reordering to see how the receive path copes.
+	const bool decode_over_rtp = true;
+	const sim_channel_config_t rtp_loopback_channel = {};
+
+	// The frame size textures are created at before the webcam has said, as
+	// the webcam gave it last run
+	const char* predicted_size_path = "mf_roundtrip_webcam.size";
 
 	// PRIVATE METHODS
-	static void mf_roundtrip_webcam_impl(/**[out]**/ UINT32* width, /**[out]**/ UINT32* height, /**[out]**/ UINT32* fps);
+	static bool mf_startup_sk(/**[in]**/ void* pContext);
+	static bool mf_startup_mf(/**[in]**/ void* pContext);
+	static bool mf_startup_webcam(/**[in]**/ void* pContext);
+	static bool mf_startup_encoder(/**[in]**/ void* pContext);
+	static bool mf_startup_decoder(/**[in]**/ void* pContext);
+	static bool mf_startup_textures(/**[in]**/ void* pContext);
+	static bool mf_startup_video(/**[in]**/ void* pContext);
+	static bool mf_startup_recorder(/**[in]**/ void* pContext);
+	static bool mf_startup_rtp(/**[in]**/ void* pContext);
 	static void mf_source_reader_roundtrip(/**[in]**/ const ComPtr<IMFSourceReader>& pSourceReader, /**[in]**/ const ComPtr<IMFTransform>& pEncoderTransform, /**[in]**/ const ComPtr<IMFTransform>& pDecoderTransform);
+	static void mf_on_encoded_sample(/**[in]**/ IMFTransform* pEncoderTransform, /**[in]**/ IMFSample* pEncodedSample, /**[in]**/ void* pContext);
+	static void mf_handle_encoded_sample(/**[in]**/ IMFSample* pEncodedSample);
+	static void mf_decode_rtp_arrivals(LONGLONG sampleDuration);
+	static void mf_on_decoded_sample(/**[in]**/ IMFTransform* pDecoderTransform, /**[in]**/ IMFSample* pDecodedSample, /**[in]**/ void* pContext);
 	static void mf_shutdown_thread();
+	static void mf_release_objects();
 
 	static IMFActivate** ppEncoderActivate = NULL;
 	static IMFActivate** ppDecoderActivate = NULL;
 	static IMFActivate** ppVideoActivate = NULL;
 	static ComPtr<IMFMediaSource> pVideoSource;
 	static ComPtr<IMFSourceReader> pSourceReader;
+	// The webcam's format as NV12, and the H.264 it is encoded to
+	static ComPtr<IMFMediaType> pInputMediaType;
+	static ComPtr<IMFMediaType> pOutputMediaType;
 	static ComPtr<IMFTransform> pEncoderTransform;
 	static ComPtr<IMFTransform> pDecoderTransform;
+	static ComPtr<mf_sample_pool> pEncoderSamplePool;
+	static ComPtr<mf_sample_pool> pDecoderSamplePool;
+	// Keep both MFTs fed from their own event threads, so a hardware encoder can
+	// work on several frames while the decoder catches up
+	static std::unique_ptr<mf_transform_driver> encoderDriver;
+	static std::unique_ptr<mf_transform_driver> decoderDriver;
 	static std::thread sourceReaderThread;
 	static std::atomic_bool _cancellationToken;
 
@@ -55,46 +98,138 @@ namespace nakamir {
 
 	static nv12_tex_t nv12_tex;
 	static nv12_sprite_t nv12_sprite;
-
-#if PRINT_MBPS
-	static UINT64 _avg_byte_size = 0;
-	static UINT64 _num_frames = 0;
-#endif
+	// Decoded frames handed from the source reader thread to the render step
+	static frame_mailbox decoded_frames;
+	// Encoded samples that start a new GOP
+	static std::atomic<uint32_t> _encoded_keyframes;
+	// Whether the encoder's first SPS has been checked against what we asked for
+	static bool _encoder_sps_checked = false;
+	// Written from the encoder's event thread; file writes happen on its own thread
+	static mp4_recorder recorder;
+	// Also only touched from the encoder's event thread, after setup
+	static udp_socket rtp_socket;
+	static rtp_h264_packetizer rtp_packetizer;
+	static std::atomic<uint64_t> _rtp_packets;
+	// The receive side of decode_over_rtp, on the encoder's event thread too
+	static rtp_h264_packetizer loopback_packetizer;
+	static sim_channel loopback_channel;
+	static rtp_h264_depacketizer rtp_depacketizer;
+	static std::atomic<uint64_t> _rtp_packets_lost;
+	static std::atomic<uint64_t> _rtp_frames_dropped;
+	// Adapts the encoder to what the receive path reports back, also from the
+	// encoder's event thread. Frame size is left alone, as the encoder's media
+	// types are fixed, but it may halve the frame rate the source is sampled at.
+	static bitrate_controller rate_controller;
+	static rtp_depacketizer_stats_t _rtp_reported;
+	static uint64_t _rtp_reported_us;
+	static std::atomic<uint32_t> _encode_fps;
+	static std::atomic<uint32_t> _encode_bitrate;
+	const uint64_t rtp_feedback_interval_us = 200000;
+
+	// Per-stage latency, matched up across threads by sample time
+	static metrics_latency_tracker _encode_latency(metric_stage_encode);
+	static metrics_latency_tracker _decode_latency(metric_stage_decode);
+	static metrics_latency_tracker _present_latency(metric_stage_present);
+	static pose_t metrics_window_pose = { {0.4f,0.25f,-0.3f}, quat_from_angles(20,-200,0) };
+
+	// Brings everything up before sk_run, overlapping what doesn't depend on
+	// each other, and times it through to the first frame on screen
+	static startup_graph startup;
+	static bool _sk_started = false;
+	static bool _mf_started = false;
+	static uint64_t _first_frame_us = 0;
 
 	void mf_roundtrip_webcam() {
-		sk_settings_t settings = {};
-		settings.app_name = "MF Roundtrip Webcam";
-		settings.assets_folder = "Assets";
-		settings.display_preference = display_mode_mixedreality;
-		if (!sk_init(settings))
-			return;
-
-		if (FAILED(MFStartup(MF_VERSION)))
+		// The webcam and both codecs only need Media Foundation, the decoder
+		// StereoKit's D3D device too, so camera and codec bring-up overlap
+		// graphics init. The encoder takes the source reader's system memory
+		// samples and doesn't wait on StereoKit. Window and textures stay on
+		// this thread.
+		int32_t sk = startup.add("sk_init", mf_startup_sk, nullptr, {}, true);
+		int32_t mf = startup.add("mf_startup", mf_startup_mf, nullptr);
+		int32_t webcam = startup.add("webcam", mf_startup_webcam, nullptr, { mf });
+		startup.add("encoder", mf_startup_encoder, nullptr, { webcam });
+		startup.add("decoder", mf_startup_decoder, nullptr, { sk, webcam });
+		int32_t textures = startup.add("textures", mf_startup_textures, nullptr, { sk }, true);
+		startup.add("video", mf_startup_video, nullptr, { textures, webcam }, true);
+		startup.add("recorder", mf_startup_recorder, nullptr);
+		startup.add("rtp", mf_startup_rtp, nullptr);
+
+		// Workers join the COM apartment that MF objects made on them live in
+		bool started = startup.run(3,
+			[]() { CoInitializeEx(nullptr, COINIT_MULTITHREADED); },
+			[]() { CoUninitialize(); });
+		if (!started)
+		{
+			log_err(std::format("Startup failed\n{}", startup.to_text()).c_str());
+			// Whatever the steps that did finish made has to go before MFShutdown
+			mf_release_objects();
+			if (_mf_started)
+				MFShutdown();
+			// sk_run never ran to shut StereoKit down for us
+			if (_sk_started)
+				sk_shutdown();
 			return;
-
-		mf_roundtrip_webcam_impl(&video_width, &video_height, &video_fps);
-
-		// Set up the render plane based on the video dimensions
-		video_aspect_ratio = { video_plane_width, video_height / (float)video_width * video_plane_width };
-		video_render_matrix = matrix_ts({ 0, -video_aspect_ratio.y / 2, -.002f }, { (video_aspect_ratio.x - video_window_padding.x), (video_aspect_ratio.y - video_window_padding.y), 0 });
-
-		nv12_tex = nv12_tex_create(video_width, video_height);
-		nv12_sprite = nv12_sprite_create(nv12_tex, sprite_type_atlased);
+		}
 
 		// Run the source reader on a separate thread
 		sourceReaderThread = std::thread(mf_source_reader_roundtrip, pSourceReader, pEncoderTransform, pDecoderTransform);
 
 		sk_run(
 			[]() {
+				// Upload at most once per rendered frame, from the main thread
+				mailbox_frame_t* frame = decoded_frames.acquire_latest();
+				if (frame)
+				{
+					_present_latency.end(frame->time);
+					metrics_scope upload(metric_stage_upload, frame->size);
+					nv12_tex_set_buffer(nv12_tex, frame->data, 0, frame->stride);
+					if (!_first_frame_us)
+					{
+						_first_frame_us = startup.mark("first frame");
+						log_info(startup.to_text().c_str());
+					}
+				}
+
+				frame_mailbox_stats_t frame_stats = decoded_frames.get_stats();
 				ui_window_begin("Video", window_pose, video_aspect_ratio, ui_win_normal, ui_move_face_user);
 				ui_nextline();
 				ui_text(std::format("\t{}x{} @ {} fps", video_width, video_height, video_fps).c_str());
+				if (_first_frame_us)
+					ui_text(std::format("\tFirst frame {:.0f} ms after start", _first_frame_us / 1000.0).c_str());
+				ui_text(std::format("\tDecoded {}, overwritten {}, dropped {}", frame_stats.published, frame_stats.overwritten, frame_stats.dropped).c_str());
+				ui_text(std::format("\tKeyframes {}", _encoded_keyframes.load()).c_str());
+				tile_diff_stats_t upload_stats = nv12_tex_get_upload_stats(nv12_tex);
+				ui_text(std::format("\tDirty tiles {} of {}, {:.1f} MB upload saved", upload_stats.dirty_tiles, upload_stats.tiles,
+					(upload_stats.bytes - upload_stats.dirty_bytes) / (1024.0 * 1024.0)).c_str());
+				if (recorder.is_open())
+				{
+					mp4_recorder_stats_t record_stats = recorder.get_stats();
+					ui_text(std::format("\tRecorded {} fragments, {:.1f} MB, {} writer stalls", record_stats.fragments,
+						record_stats.writer.bytes / (1024.0 * 1024.0), record_stats.writer.stalls).c_str());
+				}
+				if (rtp_socket.is_open())
+					ui_text(std::format("\tRTP to port {}: {} packets", rtp_port, _rtp_packets.load()).c_str());
+				if (decode_over_rtp)
+				{
+					ui_text(std::format("\tRTP receive: {} packets lost, {} frames dropped", _rtp_packets_lost.load(), _rtp_frames_dropped.load()).c_str());
+					ui_text(std::format("\tEncoding at {:.2f} Mbps, {} fps", _encode_bitrate.load() / 1e6, _encode_fps.load()).c_str());
+				}
+				if (encoderDriver && decoderDriver)
+				{
+					transform_driver_stats_t encoder_stats = encoderDriver->get_stats();
+					transform_driver_stats_t decoder_stats = decoderDriver->get_stats();
+					ui_text(std::format("\tIn flight: encoder {} (max {}), decoder {} (max {})", encoder_stats.in_flight, encoder_stats.max_in_flight,
+						decoder_stats.in_flight, decoder_stats.max_in_flight).c_str());
+				}
 				nv12_sprite_ui_image(nv12_sprite, video_render_matrix);
 				ui_window_end();
+
+				metrics_ui_window(&metrics_window_pose);
 			}, mf_shutdown_thread);
 
-		nv12_tex_release(nv12_tex);
 		nv12_sprite_release(nv12_sprite);
+		nv12_tex_release(nv12_tex);
 
 		if (FAILED(MFShutdown())) {
 			log_err("MFShutdown call failed!");
@@ -102,7 +237,23 @@ namespace nakamir {
 		}
 	}
 
-	static void mf_roundtrip_webcam_impl(UINT32* width, UINT32* height, UINT32* fps)
+	static bool mf_startup_sk(void* pContext)
+	{
+		sk_settings_t settings = {};
+		settings.app_name = "MF Roundtrip Webcam";
+		settings.assets_folder = "Assets";
+		settings.display_preference = display_mode_mixedreality;
+		_sk_started = sk_init(settings);
+		return _sk_started;
+	}
+
+	static bool mf_startup_mf(void* pContext)
+	{
+		_mf_started = SUCCEEDED(MFStartup(MF_VERSION));
+		return _mf_started;
+	}
+
+	static bool mf_startup_webcam(void* pContext)
 	{
 		try
 		{
@@ -125,12 +276,10 @@ namespace nakamir {
 			if (!friendlyName) throw std::exception("Could not get the friendly name of the webcam!");
 			// Log the webcam name
 			int requiredSize = WideCharToMultiByte(CP_UTF8, 0, friendlyName, -1, nullptr, 0, nullptr, nullptr);
-			char* friendlyNameBuffer = new char[requiredSize];
-			WideCharToMultiByte(CP_UTF8, 0, friendlyName, -1, friendlyNameBuffer, requiredSize, nullptr, nullptr);
-			std::string result = "Using webcam: ";
-			result += friendlyNameBuffer;
-			log_info(result.c_str());
-			delete[] friendlyNameBuffer;
+			std::string result(requiredSize > 0 ? requiredSize - 1 : 0, '\0');
+			WideCharToMultiByte(CP_UTF8, 0, friendlyName, -1, result.data(), requiredSize, nullptr, nullptr);
+			CoTaskMemFree(friendlyName);
+			log_info(("Using webcam: " + result).c_str());
 
 			ThrowIfFailed(ppVideoActivate[0]->ActivateObject(IID_PPV_ARGS(pVideoSource.GetAddressOf())));
 
@@ -142,33 +291,148 @@ namespace nakamir {
 			ThrowIfFailed(MFCreateSourceReaderFromMediaSource(pVideoSource.Get(), pSourceReaderAttributes.Get(), pSourceReader.GetAddressOf()));
 
 			// Get the current media type of the first video stream
-			ComPtr<IMFMediaType> pInputMediaType;
 			ThrowIfFailed(pSourceReader->GetCurrentMediaType((DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM, pInputMediaType.GetAddressOf()));
 
 			UINT32 num, den;
-			ThrowIfFailed(MFGetAttributeSize(pInputMediaType.Get(), MF_MT_FRAME_SIZE, width, height));
+			ThrowIfFailed(MFGetAttributeSize(pInputMediaType.Get(), MF_MT_FRAME_SIZE, &video_width, &video_height));
 			ThrowIfFailed(MFGetAttributeRatio(pInputMediaType.Get(), MF_MT_FRAME_RATE, &num, &den));
-			*fps = static_cast<double>(num) / den;
-			mf_set_default_media_type(pInputMediaType.Get(), MFVideoFormat_NV12, bitrate, *width, *height, *fps);
+			video_fps = static_cast<double>(num) / den;
+			mf_set_default_media_type(pInputMediaType.Get(), MFVideoFormat_NV12, bitrate, video_width, video_height, video_fps);
 
-			ComPtr<IMFMediaType> pOutputMediaType;
 			ThrowIfFailed(MFCreateMediaType(pOutputMediaType.GetAddressOf()));
-			mf_set_default_media_type(pOutputMediaType.Get(), MFVideoFormat_H264, bitrate, *width, *height, *fps);
+			mf_set_default_media_type(pOutputMediaType.Get(), MFVideoFormat_H264, bitrate, video_width, video_height, video_fps);
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			return false;
+		}
+		return true;
+	}
+
+	static bool mf_startup_encoder(void* pContext)
+	{
+		try
+		{
+			mf_create_mft_video_encoder(pInputMediaType.Get(), pOutputMediaType.Get(), pEncoderTransform.GetAddressOf(), &ppEncoderActivate);
+			// Recycle output samples for transforms that don't provide their own
+			mf_sample_pool_create(0, pEncoderSamplePool.GetAddressOf());
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			return false;
+		}
+		return true;
+	}
 
-			// Create encoder
-			_MFT_TYPE encoderType = mf_create_mft_video_encoder(pInputMediaType.Get(), pOutputMediaType.Get(), pEncoderTransform.GetAddressOf(), &ppEncoderActivate);
-			// Create decoder
-			_MFT_TYPE decoderType = mf_create_mft_video_decoder(pOutputMediaType.Get(), pInputMediaType.Get(), pDecoderTransform.GetAddressOf(), &ppDecoderActivate);
+	static bool mf_startup_decoder(void* pContext)
+	{
+		try
+		{
+			// Copies of the types, as the encoder is being set up from the
+			// originals at the same time
+			ComPtr<IMFMediaType> pDecoderInputType;
+			ComPtr<IMFMediaType> pDecoderOutputType;
+			ThrowIfFailed(MFCreateMediaType(pDecoderInputType.GetAddressOf()));
+			ThrowIfFailed(MFCreateMediaType(pDecoderOutputType.GetAddressOf()));
+			ThrowIfFailed(pOutputMediaType->CopyAllItems(pDecoderInputType.Get()));
+			ThrowIfFailed(pInputMediaType->CopyAllItems(pDecoderOutputType.Get()));
+
+			mf_create_mft_video_decoder(pDecoderInputType.Get(), pDecoderOutputType.Get(), pDecoderTransform.GetAddressOf(), &ppDecoderActivate);
+			mf_sample_pool_create(0, pDecoderSamplePool.GetAddressOf());
 
 			// Apply H264 settings and update the media types
-			ThrowIfFailed(pInputMediaType->SetUINT32(MF_MT_MPEG2_PROFILE, eAVEncH264VProfile_Base));
-			ThrowIfFailed(pDecoderTransform->SetOutputType(0, pInputMediaType.Get(), 0));
+			ThrowIfFailed(pDecoderOutputType->SetUINT32(MF_MT_MPEG2_PROFILE, eAVEncH264VProfile_Base));
+			ThrowIfFailed(pDecoderTransform->SetOutputType(0, pDecoderOutputType.Get(), 0));
 		}
 		catch (const std::exception& e)
 		{
 			log_err(e.what());
-			throw;
+			return false;
+		}
+		return true;
+	}
+
+	static void mf_create_video_textures(UINT32 width, UINT32 height)
+	{
+		// A webcam on a desk is mostly background, and what the decoder skips
+		// comes out identical to the frame before, so only changed tiles upload
+		nv12_tex = nv12_tex_create(width, height, nv12_tex_upload_dirty_tiles);
+		nv12_sprite = nv12_sprite_create(nv12_tex, sprite_type_atlased);
+	}
+
+	static bool mf_startup_textures(void* pContext)
+	{
+		// Webcams rarely change size, so the textures can be ready before the
+		// webcam has opened
+		UINT32 width = 0, height = 0;
+		FILE* file = fopen(predicted_size_path, "r");
+		if (file)
+		{
+			if (fscanf(file, "%u %u", &width, &height) == 2 && width > 0 && height > 0 && width <= 8192 && height <= 8192)
+				mf_create_video_textures(width, height);
+			fclose(file);
+		}
+		return true;
+	}
+
+	static bool mf_startup_video(void* pContext)
+	{
+		if (!nv12_tex || static_cast<UINT32>(nv12_tex->width) != video_width || static_cast<UINT32>(nv12_tex->height) != video_height)
+		{
+			if (nv12_tex)
+			{
+				log_info("Webcam size changed since the last run, remaking its textures");
+				nv12_sprite_release(nv12_sprite);
+				nv12_tex_release(nv12_tex);
+			}
+			mf_create_video_textures(video_width, video_height);
+			FILE* file = fopen(predicted_size_path, "w");
+			if (file)
+			{
+				fprintf(file, "%u %u\n", video_width, video_height);
+				fclose(file);
+			}
 		}
+		decoded_frames.resize(nv12_packed_size(video_width, video_height));
+
+		// Set up the render plane based on the video dimensions
+		video_aspect_ratio = { video_plane_width, video_height / (float)video_width * video_plane_width };
+		video_render_matrix = matrix_ts({ 0, -video_aspect_ratio.y / 2, -.002f }, { (video_aspect_ratio.x - video_window_padding.x), (video_aspect_ratio.y - video_window_padding.y), 0 });
+
+		loopback_packetizer.reset(1);
+		loopback_channel.reset(rtp_loopback_channel);
+		bitrate_controller_config_t rate_config;
+		rate_config.start_bitrate = bitrate;
+		rate_config.max_bitrate = bitrate;
+		rate_config.width = video_width;
+		rate_config.height = video_height;
+		rate_config.fps = video_fps;
+		rate_config.min_fps = video_fps / 2;
+		rate_controller.reset(rate_config);
+		_encode_fps = video_fps;
+		_encode_bitrate = bitrate;
+		return true;
+	}
+
+	// Neither of these is needed to show video, so failing only logs
+	static bool mf_startup_recorder(void* pContext)
+	{
+		if (!recorder.open(recording_path, 10000000))
+			log_warn(std::format("Could not create {}, not recording", recording_path).c_str());
+		return true;
+	}
+
+	static bool mf_startup_rtp(void* pContext)
+	{
+		rtp_packetizer.reset(static_cast<uint32_t>(std::chrono::steady_clock::now().time_since_epoch().count()));
+		if (!rtp_socket.open() || !rtp_socket.connect("127.0.0.1", rtp_port))
+		{
+			log_warn("Could not open a UDP socket, not streaming");
+			rtp_socket.close();
+		}
+		return true;
 	}
 
 	static void mf_source_reader_roundtrip(const ComPtr<IMFSourceReader>& pSourceReader, const ComPtr<IMFTransform>& pEncoderTransform, const ComPtr<IMFTransform>& pDecoderTransform)
@@ -187,12 +451,18 @@ namespace nakamir {
 			ThrowIfFailed(pDecoderTransform->ProcessMessage(MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, NULL));
 			ThrowIfFailed(pDecoderTransform->ProcessMessage(MFT_MESSAGE_NOTIFY_START_OF_STREAM, NULL));
 
+			// Encoded samples go straight from the encoder's event thread to the decoder
+			decoderDriver = std::make_unique<mf_transform_driver>(pDecoderTransform.Get(), mf_on_decoded_sample, nullptr, pDecoderSamplePool.Get());
+			encoderDriver = std::make_unique<mf_transform_driver>(pEncoderTransform.Get(), mf_on_encoded_sample, nullptr, pEncoderSamplePool.Get());
+
 			// Start processing frames
 			LONGLONG llSampleTime = 0, llSampleDuration = 0;
+			uint32_t frameCredit = 0;
 			while (!_cancellationToken)
 			{
 				ComPtr<IMFSample> pVideoSample;
 				DWORD streamIndex, flags;
+				uint64_t read_start = metrics_now_us();
 				ThrowIfFailed(pSourceReader->ReadSample(
 					MF_SOURCE_READER_FIRST_VIDEO_STREAM,
 					0,                              // Flags.
@@ -216,43 +486,23 @@ namespace nakamir {
 				{
 					ThrowIfFailed(pVideoSample->SetSampleTime(llSampleTime));
 					ThrowIfFailed(pVideoSample->GetSampleDuration(&llSampleDuration));
-
-					// Encode the sample
-					mf_transform_sample_to_buffer(pEncoderTransform.Get(), pVideoSample.Get(),
-						[](IMFTransform* pEncoderTransform, IMFSample* pEncodedSample, void* pContext) {
-#if PRINT_MBPS
-							double cur_weight = 1.0 / ++_num_frames;
-							DWORD bufferLength;
-							ThrowIfFailed(pEncodedSample->GetTotalLength(&bufferLength));
-							_avg_byte_size = bufferLength * cur_weight + _avg_byte_size * (1 - cur_weight);
-
-							ComPtr<IMFMediaType> pInputType;
-							ThrowIfFailed(pEncoderTransform->GetInputCurrentType(0, &pInputType));
-							UINT32 num = 0, den = 0;
-							ThrowIfFailed(MFGetAttributeRatio(pInputType.Get(), MF_MT_FRAME_RATE, &num, &den));
-							double frameRate = static_cast<double>(num) / den;
-							double avg_megabytes_per_second = (_avg_byte_size * frameRate) / (1024.0 * 1024.0);
-							printf("\rAvg Encoding Size: %.2f MBps", avg_megabytes_per_second);
-#endif
-							// Decode the sample
-							IMFTransform* pDecoderTransform = static_cast<IMFTransform*>(pContext);
-							mf_transform_sample_to_buffer(pDecoderTransform, pEncodedSample,
-								[](IMFTransform* pDecoderTransform, IMFSample* pDecodedSample, void* pContext) {
-									// Write the decoded sample to the nv12 texture
-									ComPtr<IMFMediaBuffer> buffer;
-									ThrowIfFailed(pDecodedSample->GetBufferByIndex(0, buffer.GetAddressOf()));
-
-									DWORD bufferLength;
-									ThrowIfFailed(buffer->GetCurrentLength(&bufferLength));
-
-									byte* byteBuffer = NULL;
-									DWORD maxLength = 0, currentLength = 0;
-									ThrowIfFailed(buffer->Lock(&byteBuffer, &maxLength, &currentLength));
-									nv12_tex_set_buffer(nv12_tex, byteBuffer);
-									ThrowIfFailed(buffer->Unlock());
-								});
-						}, pDecoderTransform.Get()
-					);
+					DWORD sampleLength = 0;
+					ThrowIfFailed(pVideoSample->GetTotalLength(&sampleLength));
+					metrics_record(metric_stage_capture, metrics_now_us() - read_start, sampleLength);
+
+					// Pass over frames while the bitrate controller has the frame rate down
+					uint32_t encodeFps = _encode_fps.load(std::memory_order_relaxed);
+					if (encodeFps && encodeFps < video_fps)
+					{
+						frameCredit += encodeFps;
+						if (frameCredit < video_fps)
+							continue;
+						frameCredit -= video_fps;
+					}
+
+					// Encode the sample; output flows on through mf_on_encoded_sample
+					_encode_latency.begin(llSampleTime);
+					encoderDriver->submit(pVideoSample.Get());
 				}
 			}
 		}
@@ -263,26 +513,183 @@ namespace nakamir {
 		}
 	}
 
+	static void mf_on_encoded_sample(IMFTransform* pEncoderTransform, IMFSample* pEncodedSample, void* pContext)
+	{
+		// Runs on the encoder's event thread, which an exception would end,
+		// so a frame that can't be handled is logged and dropped instead
+		try
+		{
+			mf_handle_encoded_sample(pEncodedSample);
+		}
+		catch (const std::exception& e)
+		{
+			log_err(std::format("Dropped an encoded frame: {}", e.what()).c_str());
+		}
+	}
+
+	static void mf_handle_encoded_sample(IMFSample* pEncodedSample)
+	{
+		// Encoded bytes per second show up as the encode stage's MB/s
+		LONGLONG sampleTime = 0;
+		DWORD bufferLength = 0;
+		ThrowIfFailed(pEncodedSample->GetSampleTime(&sampleTime));
+		ThrowIfFailed(pEncodedSample->GetTotalLength(&bufferLength));
+		_encode_latency.end(sampleTime, bufferLength);
+		startup.mark("first encoded frame");
+		rate_controller.on_frame(bufferLength, metrics_now_us());
+
+		h264_access_unit_info_t info = mf_scan_h264_sample(pEncodedSample);
+		if (info.idr)
+			_encoded_keyframes++;
+
+		// Encoders are free to pick a different profile or size, so look at what we got
+		h264_sps_t sps = {};
+		if (info.has_sps && !_encoder_sps_checked && mf_h264_sample_parameter_sets(pEncodedSample, &sps))
+		{
+			_encoder_sps_checked = true;
+			log_info(std::format("Encoder output: H.264 {} level {}.{}, {}x{}", h264_profile_name(sps.profile_idc),
+				sps.level_idc / 10, sps.level_idc % 10, sps.width, sps.height).c_str());
+			if (sps.profile_idc != eAVEncH264VProfile_Base || sps.width != video_width || sps.height != video_height)
+				log_warn("Encoder output doesn't match the requested baseline profile and frame size");
+		}
+
+		if (recorder.is_open())
+			mf_record_h264_sample(&recorder, pEncodedSample);
+		if (rtp_socket.is_open())
+			_rtp_packets += mf_send_h264_sample(&rtp_packetizer, &rtp_socket, pEncodedSample);
+
+		if (decode_over_rtp)
+		{
+			LONGLONG sampleDuration = 0;
+			ThrowIfFailed(pEncodedSample->GetSampleDuration(&sampleDuration));
+			mf_send_h264_sample(&loopback_packetizer, &loopback_channel, pEncodedSample);
+			mf_decode_rtp_arrivals(sampleDuration);
+			return;
+		}
+
+		// Decode the sample
+		_decode_latency.begin(sampleTime);
+		decoderDriver->submit(pEncodedSample);
+	}
+
+	static void mf_decode_rtp_arrivals(LONGLONG sampleDuration)
+	{
+		// Whole frames only, each in a sample of its own, as the decoder wants
+		const uint8_t* packet = nullptr;
+		size_t size = 0;
+		while (loopback_channel.receive(&packet, &size))
+		{
+			rtp_depacketizer.receive(packet, size);
+			for (const rtp_frame_t& frame : rtp_depacketizer.frames())
+			{
+				// One frame failing to go through doesn't stop the rest, or the feedback
+				try
+				{
+					ComPtr<IMFSample> pSample;
+					mf_create_rtp_frame_sample(frame, sampleDuration, pSample.GetAddressOf());
+					// Timed from the RTP clock now, so latency is matched on that
+					LONGLONG sampleTime = 0;
+					ThrowIfFailed(pSample->GetSampleTime(&sampleTime));
+					_decode_latency.begin(sampleTime);
+					decoderDriver->submit(pSample.Get());
+				}
+				catch (const std::exception& e)
+				{
+					log_err(std::format("Dropped a received frame: {}", e.what()).c_str());
+				}
+			}
+		}
+
+		const rtp_depacketizer_stats_t& stats = rtp_depacketizer.get_stats();
+		_rtp_packets_lost = stats.lost;
+		_rtp_frames_dropped = stats.frames_damaged + stats.frames_skipped;
+
+		// Report back what the receiver saw, as RTCP would. Nothing queues on
+		// the way, so loss is the only sign of trouble.
+		uint64_t now = metrics_now_us();
+		if (now < _rtp_reported_us + rtp_feedback_interval_us)
+			return;
+		if (_rtp_reported_us)
+		{
+			uint64_t received = stats.packets - _rtp_reported.packets;
+			uint64_t lost = stats.lost - _rtp_reported.lost;
+			bitrate_feedback_t feedback = {};
+			feedback.time_us = now;
+			feedback.loss = received + lost ? static_cast<float>(lost) / (received + lost) : 0.0f;
+			feedback.received_bitrate = static_cast<uint32_t>((stats.copied_bytes - _rtp_reported.copied_bytes) * 8 * 1000000 / (now - _rtp_reported_us));
+			if (rate_controller.on_feedback(feedback))
+			{
+				// If the encoder won't take it, carry on as before rather than
+				// skip frames for a rate it isn't running at
+				const bitrate_settings_t& settings = rate_controller.settings();
+				if (SUCCEEDED(mf_set_encoder_bitrate(pEncoderTransform.Get(), settings.bitrate)))
+				{
+					_encode_bitrate = settings.bitrate;
+					_encode_fps = settings.fps;
+				}
+			}
+		}
+		_rtp_reported = stats;
+		_rtp_reported_us = now;
+	}
+
+	static void mf_on_decoded_sample(IMFTransform* pDecoderTransform, IMFSample* pDecodedSample, void* pContext)
+	{
+		LONGLONG sampleTime = 0;
+		DWORD bufferLength = 0;
+		ThrowIfFailed(pDecodedSample->GetSampleTime(&sampleTime));
+		ThrowIfFailed(pDecodedSample->GetTotalLength(&bufferLength));
+		_decode_latency.end(sampleTime, bufferLength);
+		startup.mark("first decoded frame");
+
+		// Hand the decoded sample to the render thread
+		_present_latency.begin(sampleTime);
+		mf_mailbox_publish_sample(&decoded_frames, pDecodedSample, video_width, video_height);
+	}
+
 	static void mf_shutdown_thread()
 	{
 		_cancellationToken = true;
 		sourceReaderThread.join();
 
+		// Encoder first, its event thread feeds the decoder
+		if (encoderDriver) encoderDriver->stop();
+		if (decoderDriver) decoderDriver->stop();
+		encoderDriver.reset();
+		decoderDriver.reset();
+		// Nothing feeds the recorder now, so its last GOP can go out
+		if (!recorder.close())
+			log_err("Writing the recording failed");
+		rtp_socket.close();
+
+		mf_release_objects();
+	}
+
+	static void mf_release_objects()
+	{
 		pSourceReader.Reset();
+		pVideoSource.Reset();
 		pEncoderTransform.Reset();
 		pDecoderTransform.Reset();
+		pEncoderSamplePool.Reset();
+		pDecoderSamplePool.Reset();
+		pInputMediaType.Reset();
+		pOutputMediaType.Reset();
 
-		if (ppEncoderActivate && *ppEncoderActivate)
+		if (ppEncoderActivate)
 		{
 			CoTaskMemFree(ppEncoderActivate);
+			ppEncoderActivate = NULL;
 		}
-		if (ppDecoderActivate && *ppDecoderActivate)
+		if (ppDecoderActivate)
 		{
 			CoTaskMemFree(ppDecoderActivate);
+			ppDecoderActivate = NULL;
 		}
-		if (ppVideoActivate && *ppVideoActivate)
+		if (ppVideoActivate)
 		{
 			CoTaskMemFree(ppVideoActivate);
+			ppVideoActivate = NULL;
 		}
 	}
 } // namespace nakamir
@@ -0,0 +1,233 @@
+#include "file_writer.h"
+#include "aligned_memory.h"
+#include <chrono>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <string>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace nakamir {
+
+	// Buffers are a multiple of this, which covers sector and page sizes
+	const size_t file_writer_granularity = 64 * 1024;
+
+	file_writer::~file_writer()
+	{
+		close();
+	}
+
+#ifdef _WIN32
+	bool file_writer::open(const char* path, size_t buffer_size)
+	{
+		int length = MultiByteToWideChar(CP_UTF8, 0, path, -1, nullptr, 0);
+		if (length <= 0)
+			return false;
+		std::wstring wide(static_cast<size_t>(length), L'\0');
+		MultiByteToWideChar(CP_UTF8, 0, path, -1, wide.data(), length);
+		return open(wide.c_str(), buffer_size);
+	}
+
+	bool file_writer::open(const wchar_t* path, size_t buffer_size)
+	{
+		close();
+
+		HANDLE file = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		_file = file;
+		start(buffer_size);
+		return true;
+	}
+
+	bool file_writer::write_file(const uint8_t* data, size_t size)
+	{
+		while (size > 0)
+		{
+			DWORD chunk = size > 0x40000000 ? 0x40000000 : static_cast<DWORD>(size);
+			DWORD written = 0;
+			if (!WriteFile(_file, data, chunk, &written, nullptr) || written == 0)
+				return false;
+			data += written;
+			size -= written;
+		}
+		return true;
+	}
+
+	void file_writer::close_file()
+	{
+		if (_file)
+			CloseHandle(_file);
+		_file = nullptr;
+	}
+#else
+	bool file_writer::open(const char* path, size_t buffer_size)
+	{
+		close();
+
+		int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return false;
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+		_file = fd;
+		start(buffer_size);
+		return true;
+	}
+
+	bool file_writer::write_file(const uint8_t* data, size_t size)
+	{
+		while (size > 0)
+		{
+			ssize_t written = ::write(_file, data, size);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+				return false;
+			data += written;
+			size -= static_cast<size_t>(written);
+		}
+		return true;
+	}
+
+	void file_writer::close_file()
+	{
+		if (_file >= 0)
+			::close(_file);
+		_file = -1;
+	}
+#endif
+
+	void file_writer::start(size_t buffer_size)
+	{
+		_buffer_size = aligned_round_up(buffer_size ? buffer_size : file_writer_granularity, file_writer_granularity);
+		_buffers[0] = static_cast<uint8_t*>(aligned_malloc(_buffer_size, 4096));
+		_buffers[1] = static_cast<uint8_t*>(aligned_malloc(_buffer_size, 4096));
+		_filling = 0;
+		_filled = 0;
+		_position = 0;
+		_pending = -1;
+		_pending_size = 0;
+		_stopping = false;
+		_failed = false;
+		_stats = {};
+		_file_open = true;
+		_thread = std::thread(&file_writer::run, this);
+	}
+
+	bool file_writer::close()
+	{
+		if (!_file_open)
+			return true;
+
+		// The tail is the one write that isn't a whole buffer
+		if (_filled > 0)
+			submit();
+		{
+			std::unique_lock<std::mutex> lock(_mtx);
+			_done_cv.wait(lock, [this] { return _pending < 0; });
+			_stopping = true;
+		}
+		_work_cv.notify_one();
+		_thread.join();
+
+		close_file();
+		aligned_free(_buffers[0]);
+		aligned_free(_buffers[1]);
+		_buffers[0] = _buffers[1] = nullptr;
+		_file_open = false;
+		return !_failed;
+	}
+
+	bool file_writer::write(const void* data, size_t size)
+	{
+		if (!_file_open || _failed.load(std::memory_order_relaxed))
+			return false;
+
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		_position.fetch_add(size, std::memory_order_relaxed);
+		while (size > 0)
+		{
+			size_t chunk = _buffer_size - _filled;
+			if (chunk > size)
+				chunk = size;
+			memcpy(_buffers[_filling] + _filled, bytes, chunk);
+			_filled += chunk;
+			bytes += chunk;
+			size -= chunk;
+			if (_filled == _buffer_size)
+				submit();
+		}
+		return true;
+	}
+
+	void file_writer::submit()
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		if (_pending >= 0)
+		{
+			// The disk is a whole buffer behind
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			_done_cv.wait(lock, [this] { return _pending < 0; });
+			_stats.stalls++;
+			_stats.stall_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		}
+		_pending = static_cast<int32_t>(_filling);
+		_pending_size = _filled;
+		lock.unlock();
+		_work_cv.notify_one();
+
+		_filling ^= 1;
+		_filled = 0;
+	}
+
+	void file_writer::run()
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		for (;;)
+		{
+			_work_cv.wait(lock, [this] { return _stopping || _pending >= 0; });
+			if (_pending < 0)
+				break;
+
+			const uint8_t* data = _buffers[_pending];
+			size_t size = _pending_size;
+			lock.unlock();
+			// After a failure the rest is dropped, but buffers still cycle so
+			// the producer never waits on a dead file
+			bool ok = !_failed.load(std::memory_order_relaxed) && write_file(data, size);
+			lock.lock();
+
+			if (ok)
+			{
+				_stats.writes++;
+				_stats.written += size;
+			}
+			else
+				_failed = true;
+			_pending = -1;
+			_done_cv.notify_all();
+		}
+	}
+
+	file_writer_stats_t file_writer::get_stats()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		file_writer_stats_t stats = _stats;
+		stats.bytes = _position.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+} // namespace nakamir
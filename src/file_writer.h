@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace nakamir {
+
+	struct file_writer_stats_t {
+		uint64_t bytes;           // Handed to write
+		uint64_t written;         // Handed to the OS
+		uint64_t writes;          // Write calls made to the OS
+		uint64_t stalls;          // Times write waited for the writer thread to free a buffer
+		uint64_t stall_us;        // Time spent waiting in total
+	};
+
+	// Sequential file output from a thread that mustn't block on disk, the write
+	// side counterpart of mapped_file. write copies into one of two aligned
+	// buffers; a full buffer goes to a writer thread while the other fills, so
+	// the OS sees large, aligned, strictly sequential writes and the caller only
+	// waits if the disk falls a whole buffer behind. Memory is the two buffers,
+	// however long the file gets.
+	//
+	// One producer thread; open and close belong to it too.
+	class file_writer {
+	public:
+		static const size_t default_buffer_size = 4 * 1024 * 1024;
+
+		file_writer() = default;
+		~file_writer();
+
+		file_writer(const file_writer&) = delete;
+		file_writer& operator=(const file_writer&) = delete;
+
+		// Creates or truncates a file, UTF-8 path. buffer_size is rounded up to
+		// a multiple of 64KB. Returns false, leaving the writer closed, on failure.
+		bool open(const char* path, size_t buffer_size = default_buffer_size);
+#ifdef _WIN32
+		bool open(const wchar_t* path, size_t buffer_size = default_buffer_size);
+#endif
+		// Writes out what is buffered and closes the file. False if any write
+		// failed since open.
+		bool close();
+
+		bool is_open() const { return _file_open; }
+		// A write to the file failed; everything after it is dropped
+		bool failed() const { return _failed.load(std::memory_order_relaxed); }
+		// Appends bytes. False once a write has failed; what follows is dropped.
+		bool write(const void* data, size_t size);
+		// Bytes appended since open, i.e. the offset of the next write
+		uint64_t position() const { return _position.load(std::memory_order_relaxed); }
+
+		file_writer_stats_t get_stats();
+
+	private:
+		// Allocates the buffers and starts the writer thread on the open file
+		void start(size_t buffer_size);
+		bool write_file(const uint8_t* data, size_t size);
+		void close_file();
+		// Hands the filling buffer to the writer thread and takes the other one
+		void submit();
+		void run();
+
+		uint8_t* _buffers[2] = {};
+		size_t _buffer_size = 0;
+		uint32_t _filling = 0;            // Buffer the producer appends to
+		size_t _filled = 0;
+		std::atomic<uint64_t> _position = 0;   // Producer writes, get_stats reads
+		bool _file_open = false;
+#ifdef _WIN32
+		void* _file = nullptr;
+#else
+		int _file = -1;
+#endif
+
+		std::thread _thread;
+		std::mutex _mtx;
+		std::condition_variable _work_cv;
+		std::condition_variable _done_cv;
+		// Submitted to the writer thread and not yet written, -1 for none
+		int32_t _pending = -1;
+		size_t _pending_size = 0;
+		bool _stopping = false;
+		std::atomic<bool> _failed = false;
+		file_writer_stats_t _stats = {};
+	};
+
+} // namespace nakamir
@@ -0,0 +1,69 @@
+#include "frame_mailbox.h"
+#include "aligned_memory.h"
+
+namespace nakamir {
+
+	frame_mailbox::~frame_mailbox()
+	{
+		for (mailbox_frame_t& slot : _slots)
+			aligned_free(slot.data);
+	}
+
+	void frame_mailbox::resize(size_t frame_capacity)
+	{
+		for (mailbox_frame_t& slot : _slots)
+		{
+			aligned_free(slot.data);
+			slot = {};
+			// Cache line aligned so plane copies in and out can use wide stores
+			slot.data = static_cast<uint8_t*>(aligned_malloc(frame_capacity, 64));
+			slot.capacity = frame_capacity;
+		}
+		_write = 0;
+		_read = 1;
+		_shared.store(2, std::memory_order_release);
+	}
+
+	mailbox_frame_t* frame_mailbox::begin_write()
+	{
+		return &_slots[_write];
+	}
+
+	void frame_mailbox::publish()
+	{
+		_slots[_write].sequence = _published.fetch_add(1, std::memory_order_relaxed);
+
+		// Swap our freshly written slot into the middle and take whatever was there
+		uint32_t previous = _shared.exchange(_write | fresh_bit, std::memory_order_acq_rel);
+		_write = previous & ~fresh_bit;
+		if (previous & fresh_bit)
+			_overwritten.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void frame_mailbox::drop()
+	{
+		_dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	mailbox_frame_t* frame_mailbox::acquire_latest()
+	{
+		if ((_shared.load(std::memory_order_relaxed) & fresh_bit) == 0)
+			return nullptr;
+
+		uint32_t previous = _shared.exchange(_read, std::memory_order_acq_rel);
+		_read = previous & ~fresh_bit;
+		_consumed.fetch_add(1, std::memory_order_relaxed);
+		return &_slots[_read];
+	}
+
+	frame_mailbox_stats_t frame_mailbox::get_stats() const
+	{
+		frame_mailbox_stats_t stats = {};
+		stats.published = _published.load(std::memory_order_relaxed);
+		stats.consumed = _consumed.load(std::memory_order_relaxed);
+		stats.overwritten = _overwritten.load(std::memory_order_relaxed);
+		stats.dropped = _dropped.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace nakamir {
+
+	struct mailbox_frame_t {
+		uint8_t* data;
+		size_t capacity;
+		size_t size;       // Bytes of data written by the producer
+		int32_t width;
+		int32_t height;
+		int32_t stride;    // Bytes per luma row; the chroma plane follows the luma plane
+		int64_t time;      // Presentation time in 100ns units, as on IMFSample
+		uint64_t sequence; // Producer's running frame count
+	};
+
+	struct frame_mailbox_stats_t {
+		uint64_t published;   // Frames handed over by the producer
+		uint64_t consumed;    // Frames picked up by the consumer
+		uint64_t overwritten; // Published frames replaced before the consumer saw them
+		uint64_t dropped;     // Frames the producer discarded, e.g. too large for a slot
+	};
+
+	// Latest-wins handoff of decoded frames from one producer thread (the decoder)
+	// to one consumer thread (the render step). It's a lock-free triple buffer:
+	// the producer always has a slot to write into, the consumer always owns the
+	// slot it is reading, and the third slot holds the newest published frame.
+	// Publishing over an unread frame replaces it, so a slow consumer never
+	// blocks the decoder and only ever sees the most recent picture.
+	class frame_mailbox {
+	public:
+		frame_mailbox() = default;
+		explicit frame_mailbox(size_t frame_capacity) { resize(frame_capacity); }
+		~frame_mailbox();
+
+		frame_mailbox(const frame_mailbox&) = delete;
+		frame_mailbox& operator=(const frame_mailbox&) = delete;
+
+		// (Re)allocates all three slots. Not thread safe; call it before the
+		// producer and consumer start.
+		void resize(size_t frame_capacity);
+
+		// Producer side. The returned slot stays the producer's until publish.
+		mailbox_frame_t* begin_write();
+		void publish();
+		// Producer side. Counts a frame that never made it into the mailbox.
+		void drop();
+
+		// Consumer side. Returns the newest frame if one was published since the
+		// last call, or nullptr. The frame stays valid until the next call.
+		mailbox_frame_t* acquire_latest();
+
+		frame_mailbox_stats_t get_stats() const;
+
+	private:
+		static const uint32_t fresh_bit = 0x4; // Set on the shared index when it holds an unread frame
+
+		mailbox_frame_t _slots[3] = {};
+		uint32_t _write = 0;                   // Owned by the producer
+		uint32_t _read = 1;                    // Owned by the consumer
+		alignas(64) std::atomic<uint32_t> _shared = 2;
+
+		alignas(64) std::atomic<uint64_t> _published = 0;
+		std::atomic<uint64_t> _overwritten = 0;
+		std::atomic<uint64_t> _dropped = 0;
+		alignas(64) std::atomic<uint64_t> _consumed = 0;
+	};
+
+} // namespace nakamir
@@ -0,0 +1,243 @@
+#include "frame_pool.h"
+#include "aligned_memory.h"
+#include <atomic>
+#include <stdexcept>
+
+namespace nakamir {
+
+	// Smallest class; anything below this isn't worth pooling separately
+	const uint32_t frame_pool_min_shift = 12;
+
+	static uint32_t floor_log2(size_t value)
+	{
+		uint32_t result = 0;
+		while (value >>= 1) result++;
+		return result;
+	}
+
+	uint32_t frame_pool::size_class_of(size_t size)
+	{
+		if (size <= (size_t(1) << frame_pool_min_shift))
+			return 0;
+
+		// size lands in (base, 2 * base], split into four steps of base / 4
+		uint32_t shift = floor_log2(size - 1);
+		size_t base = size_t(1) << shift;
+		size_t step = base >> 2;
+		size_t k = (size - base + step - 1) / step;
+		return (shift - frame_pool_min_shift) * 4 + static_cast<uint32_t>(k);
+	}
+
+	size_t frame_pool::size_class_capacity(uint32_t size_class)
+	{
+		if (size_class == 0)
+			return size_t(1) << frame_pool_min_shift;
+
+		uint32_t shift = frame_pool_min_shift + (size_class - 1) / 4;
+		size_t base = size_t(1) << shift;
+		return base + ((size_class - 1) % 4 + 1) * (base >> 2);
+	}
+
+	frame_pool::frame_pool(size_t max_pooled_bytes) : _max_pooled_bytes(max_pooled_bytes)
+	{
+	}
+
+	frame_pool::~frame_pool()
+	{
+		trim();
+	}
+
+	frame_block_t* frame_pool::acquire(size_t size, size_t alignment)
+	{
+		uint32_t size_class = size_class_of(size);
+		alignment = aligned_normalize(alignment);
+
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (size_class < _free.size())
+		{
+			std::vector<frame_block_t*>& list = _free[size_class];
+			for (size_t i = list.size(); i-- > 0;)
+			{
+				frame_block_t* block = list[i];
+				if (block->alignment < alignment)
+					continue;
+
+				list[i] = list.back();
+				list.pop_back();
+
+				_stats.hits++;
+				_stats.pooled_blocks--;
+				_stats.pooled_bytes -= block->capacity;
+				_stats.outstanding_blocks++;
+				_stats.outstanding_bytes += block->capacity;
+				return block;
+			}
+		}
+
+		_stats.misses++;
+		frame_block_t* block = allocate_block_locked(size_class, alignment);
+		_stats.outstanding_blocks++;
+		_stats.outstanding_bytes += block->capacity;
+		return block;
+	}
+
+	void frame_pool::release(frame_block_t* block)
+	{
+		bool evict = false;
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			_stats.releases++;
+			_stats.outstanding_blocks--;
+			_stats.outstanding_bytes -= block->capacity;
+
+			evict = _max_pooled_bytes && _stats.pooled_bytes + block->capacity > _max_pooled_bytes;
+			if (evict)
+			{
+				_stats.evictions++;
+			}
+			else
+			{
+				if (_free.size() <= block->size_class)
+					_free.resize(block->size_class + 1);
+				_free[block->size_class].push_back(block);
+				_stats.pooled_blocks++;
+				_stats.pooled_bytes += block->capacity;
+			}
+		}
+
+		// Destroying the backend payload can re-enter the pool, so stay unlocked
+		if (evict)
+			free_block(block);
+	}
+
+	void frame_pool::reserve(size_t size, size_t alignment, size_t count)
+	{
+		uint32_t size_class = size_class_of(size);
+		alignment = aligned_normalize(alignment);
+
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_free.size() <= size_class)
+			_free.resize(size_class + 1);
+		while (_free[size_class].size() < count)
+		{
+			frame_block_t* block = allocate_block_locked(size_class, alignment);
+			_free[size_class].push_back(block);
+			_stats.pooled_blocks++;
+			_stats.pooled_bytes += block->capacity;
+		}
+	}
+
+	void frame_pool::trim()
+	{
+		std::vector<frame_block_t*> blocks;
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			for (std::vector<frame_block_t*>& list : _free)
+			{
+				blocks.insert(blocks.end(), list.begin(), list.end());
+				list.clear();
+			}
+			_stats.pooled_blocks = 0;
+			_stats.pooled_bytes = 0;
+		}
+
+		for (frame_block_t* block : blocks)
+			free_block(block);
+	}
+
+	frame_pool_stats_t frame_pool::get_stats()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		return _stats;
+	}
+
+	frame_block_t* frame_pool::allocate_block_locked(uint32_t size_class, size_t alignment)
+	{
+		frame_block_t* block = new frame_block_t();
+		block->capacity = size_class_capacity(size_class);
+		block->alignment = alignment;
+		block->size_class = size_class;
+		block->data = static_cast<uint8_t*>(aligned_malloc(block->capacity, alignment));
+
+		size_t blocks = _stats.outstanding_blocks + _stats.pooled_blocks + 1;
+		size_t bytes = _stats.outstanding_bytes + _stats.pooled_bytes + block->capacity;
+		if (blocks > _stats.high_water_blocks) _stats.high_water_blocks = blocks;
+		if (bytes > _stats.high_water_bytes) _stats.high_water_bytes = bytes;
+		return block;
+	}
+
+	void frame_pool::free_block(frame_block_t* block)
+	{
+		if (block->user && block->user_destroy)
+			block->user_destroy(block->user);
+		aligned_free(block->data);
+		delete block;
+	}
+
+	// Memory sample living inside a pooled block's payload
+	class frame_pool_sample final : public media_sample, public media_buffer {
+	public:
+		frame_pool_sample(frame_pool* pool, frame_block_t* block) : _pool(pool), _block(block) {}
+
+		static void destroy(void* user) { delete static_cast<frame_pool_sample*>(user); }
+
+		void revive()
+		{
+			_refs = 1;
+			_length = 0;
+			_time = 0;
+			_duration = 0;
+		}
+
+		uint32_t add_ref() override { return ++_refs; }
+		uint32_t release() override
+		{
+			uint32_t refs = --_refs;
+			if (refs == 0) _pool->release(_block);
+			return refs;
+		}
+		media_buffer* get_buffer() override { return this; }
+		int64_t get_sample_time() override { return _time; }
+		void set_sample_time(int64_t time) override { _time = time; }
+		int64_t get_sample_duration() override { return _duration; }
+		void set_sample_duration(int64_t duration) override { _duration = duration; }
+
+		uint8_t* lock(size_t* max_length, size_t* current_length) override
+		{
+			if (max_length) *max_length = _block->capacity;
+			if (current_length) *current_length = _length;
+			return _block->data;
+		}
+		void unlock() override {}
+		size_t get_max_length() override { return _block->capacity; }
+		size_t get_current_length() override { return _length; }
+		void set_current_length(size_t length) override
+		{
+			if (length > _block->capacity) throw std::length_error("Buffer length exceeds its capacity");
+			_length = length;
+		}
+
+	private:
+		frame_pool* _pool;
+		frame_block_t* _block;
+		std::atomic<uint32_t> _refs = 0;
+		size_t _length = 0;
+		int64_t _time = 0;
+		int64_t _duration = 0;
+	};
+
+	media_sample* frame_pool_allocator::allocate(const transform_stream_info_t& info)
+	{
+		frame_block_t* block = _pool->acquire(info.size, info.alignment);
+		if (!block->user)
+		{
+			block->user = new frame_pool_sample(_pool, block);
+			block->user_destroy = frame_pool_sample::destroy;
+		}
+
+		frame_pool_sample* sample = static_cast<frame_pool_sample*>(block->user);
+		sample->revive();
+		return sample;
+	}
+
+} // namespace nakamir
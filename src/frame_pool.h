@@ -0,0 +1,81 @@
+#pragma once
+
+#include "transform.h"
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace nakamir {
+
+	struct frame_pool_stats_t {
+		uint64_t hits;                // acquire served from a pooled block
+		uint64_t misses;              // acquire had to allocate
+		uint64_t releases;
+		uint64_t evictions;           // Released blocks freed because the pool was over budget
+		size_t outstanding_blocks;
+		size_t outstanding_bytes;
+		size_t pooled_blocks;
+		size_t pooled_bytes;
+		size_t high_water_blocks;     // Most blocks ever alive at once, pooled or not
+		size_t high_water_bytes;
+	};
+
+	struct frame_block_t {
+		uint8_t* data;
+		size_t capacity;
+		size_t alignment;
+		uint32_t size_class;
+		// Backend payload that stays with the block across recycling, e.g. the
+		// IMFSample wrapping it, so a pool hit doesn't allocate anything at all
+		void* user;
+		void (*user_destroy)(void* user);
+	};
+
+	// Size-classed pool of aligned frame buffers. Classes step by a quarter of a
+	// power of two (so at most 25% slack), which keeps a steady stream of
+	// similarly sized encoded frames hitting the same free list.
+	// acquire/release are thread-safe; blocks are commonly released from
+	// whichever thread drops the last reference to a sample.
+	class frame_pool {
+	public:
+		// max_pooled_bytes bounds idle memory kept around, 0 for unbounded
+		explicit frame_pool(size_t max_pooled_bytes = 0);
+		~frame_pool();
+
+		frame_pool(const frame_pool&) = delete;
+		frame_pool& operator=(const frame_pool&) = delete;
+
+		frame_block_t* acquire(size_t size, size_t alignment);
+		void release(/**[in]**/ frame_block_t* block);
+		// Pre-allocates blocks so the first frames don't miss
+		void reserve(size_t size, size_t alignment, size_t count);
+		// Frees every idle block
+		void trim();
+		frame_pool_stats_t get_stats();
+
+		static uint32_t size_class_of(size_t size);
+		static size_t size_class_capacity(uint32_t size_class);
+
+	private:
+		frame_block_t* allocate_block_locked(uint32_t size_class, size_t alignment);
+		void free_block(frame_block_t* block);
+
+		std::mutex _mtx;
+		std::vector<std::vector<frame_block_t*>> _free; // Indexed by size class
+		size_t _max_pooled_bytes;
+		frame_pool_stats_t _stats = {};
+	};
+
+	// Portable sample_allocator handing out memory samples backed by a frame_pool.
+	// Released samples go straight back to the pool.
+	class frame_pool_allocator final : public sample_allocator {
+	public:
+		explicit frame_pool_allocator(/**[in]**/ frame_pool* pool) : _pool(pool) {}
+		media_sample* allocate(const transform_stream_info_t& info) override;
+
+	private:
+		frame_pool* _pool;
+	};
+
+} // namespace nakamir
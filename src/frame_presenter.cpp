@@ -0,0 +1,166 @@
+#include "frame_presenter.h"
+#include "aligned_memory.h"
+#include <algorithm>
+
+namespace nakamir {
+
+	frame_presenter::~frame_presenter()
+	{
+		for (mailbox_frame_t& slot : _slots)
+			aligned_free(slot.data);
+	}
+
+	void frame_presenter::resize(size_t frame_capacity, uint32_t frame_count)
+	{
+		for (mailbox_frame_t& slot : _slots)
+			aligned_free(slot.data);
+
+		_slots.assign(frame_count + 1, mailbox_frame_t{});
+		_free.clear();
+		_queue.clear();
+		_queue.reserve(frame_count + 1);
+		for (uint32_t i = 0; i < _slots.size(); i++)
+		{
+			_slots[i].data = static_cast<uint8_t*>(aligned_malloc(frame_capacity, 64));
+			_slots[i].capacity = frame_capacity;
+			_free.push_back(i);
+		}
+		_writing = no_slot;
+		_showing = no_slot;
+		_closed = false;
+		_anchored = false;
+		_starved = false;
+		_stats = {};
+		_stats.capacity = frame_count;
+	}
+
+	mailbox_frame_t* frame_presenter::begin_write(bool wait)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		if (wait)
+			_space.wait(lock, [this] { return _closed || has_space(); });
+		if (_closed)
+			return nullptr;
+		if (!has_space())
+		{
+			_stats.dropped_full++;
+			return nullptr;
+		}
+
+		_writing = _free.back();
+		_free.pop_back();
+		return &_slots[_writing];
+	}
+
+	bool frame_presenter::can_write()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		return !_closed && has_space();
+	}
+
+	bool frame_presenter::has_space() const
+	{
+		// Until the first present the slot for the screen is free too, but
+		// queuing into it would hold more than capacity frames of latency
+		return !_free.empty() && _queue.size() < _stats.capacity;
+	}
+
+	void frame_presenter::publish()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_writing == no_slot)
+			return;
+
+		// Decoders emit in presentation order, so this is nearly always an append
+		int64_t time = _slots[_writing].time;
+		auto it = std::upper_bound(_queue.begin(), _queue.end(), time,
+			[this](int64_t t, uint32_t slot) { return t < _slots[slot].time; });
+		_queue.insert(it, _writing);
+		_slots[_writing].sequence = _stats.queued++;
+		_writing = no_slot;
+
+		_stats.depth = static_cast<uint32_t>(_queue.size());
+		_stats.max_depth = std::max(_stats.max_depth, _stats.depth);
+	}
+
+	void frame_presenter::cancel_write()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_writing == no_slot)
+			return;
+		_free.push_back(_writing);
+		_writing = no_slot;
+		_space.notify_one();
+	}
+
+	mailbox_frame_t* frame_presenter::present(int64_t now)
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_queue.empty())
+		{
+			// Only count running dry once per gap, and not before playback starts
+			if (_anchored && !_starved)
+				_stats.underruns++;
+			_starved = _anchored;
+			return nullptr;
+		}
+
+		if (!_anchored)
+		{
+			_anchor = now + _latency - _slots[_queue.front()].time;
+			_anchored = true;
+		}
+
+		// Newest queued frame whose time has come
+		int64_t media_now = now - _anchor;
+		size_t due = 0;
+		while (due < _queue.size() && _slots[_queue[due]].time <= media_now)
+			due++;
+		if (due == 0)
+			return nullptr;
+
+		// Everything before it missed its turn
+		for (size_t i = 0; i + 1 < due; i++)
+			_free.push_back(_queue[i]);
+		_stats.dropped_late += due - 1;
+		if (_showing != no_slot)
+			_free.push_back(_showing);
+		_showing = _queue[due - 1];
+		_queue.erase(_queue.begin(), _queue.begin() + due);
+		_space.notify_one();
+
+		int64_t drift = media_now - _slots[_showing].time;
+		_stats.presented++;
+		_stats.depth = static_cast<uint32_t>(_queue.size());
+		_stats.drift = drift;
+		_stats.mean_drift += (drift - _stats.mean_drift) / 16;
+		_stats.max_drift = std::max(_stats.max_drift, drift);
+		_starved = false;
+		return &_slots[_showing];
+	}
+
+	void frame_presenter::reset()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		_free.insert(_free.end(), _queue.begin(), _queue.end());
+		_queue.clear();
+		_anchored = false;
+		_starved = false;
+		_stats.depth = 0;
+		_space.notify_one();
+	}
+
+	void frame_presenter::close()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		_closed = true;
+		_space.notify_all();
+	}
+
+	frame_presenter_stats_t frame_presenter::get_stats()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		return _stats;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "frame_mailbox.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace nakamir {
+
+	struct frame_presenter_stats_t {
+		uint64_t queued;          // Frames published into the jitter buffer
+		uint64_t presented;       // Frames returned by present
+		uint64_t dropped_late;    // Frames skipped because a newer one was already due
+		uint64_t dropped_full;    // Frames the producer gave up on because the buffer was full
+		uint64_t underruns;       // Times the buffer ran dry during playback
+		uint32_t depth;           // Frames waiting right now
+		uint32_t max_depth;
+		uint32_t capacity;        // Frames the buffer can hold, besides the one on screen
+		int64_t drift;            // Clock minus pts of the last presented frame, 100ns units; > 0 is late
+		int64_t mean_drift;       // Smoothed drift
+		int64_t max_drift;        // Latest any frame has been presented
+	};
+
+	// Paces decoded frames by their timestamps. The decoder thread queues frames
+	// into a fixed set of slots, kept in presentation order, and blocks once
+	// they are all in use; the render step asks for whichever frame the clock
+	// says is due. Frames that are overtaken before being shown are dropped, so
+	// a slow renderer skips frames rather than falling behind, and a fast
+	// decoder is held back instead of playing at decode speed.
+	//
+	// The clock is whatever the caller passes to present, in 100ns units. The
+	// first frame is anchored to be shown latency after the call that first
+	// sees it, which is the headroom the buffer has to absorb decode jitter.
+	class frame_presenter {
+	public:
+		frame_presenter() = default;
+		frame_presenter(size_t frame_capacity, uint32_t frame_count) { resize(frame_capacity, frame_count); }
+		~frame_presenter();
+
+		frame_presenter(const frame_presenter&) = delete;
+		frame_presenter& operator=(const frame_presenter&) = delete;
+
+		// (Re)allocates frame_count slots for queued frames plus one for the frame
+		// on screen, so memory is fixed up front. Not thread safe; call it before
+		// the producer and consumer start.
+		void resize(size_t frame_capacity, uint32_t frame_count);
+		void set_latency(int64_t latency) { _latency = latency; }
+
+		// Producer side. Returns a free slot, waiting for one if wait is set, or
+		// nullptr if none is free (counted as dropped_full) or after close.
+		mailbox_frame_t* begin_write(bool wait = true);
+		// Whether begin_write would get a slot without waiting. Unlike a failed
+		// begin_write(false), a full buffer isn't counted as a drop, so a producer
+		// that backs off and retries later can ask first.
+		bool can_write();
+		// Queues the slot from begin_write by its time
+		void publish();
+		// Hands the slot from begin_write back without queuing it
+		void cancel_write();
+
+		// Consumer side. Returns the newest frame due at clock time now, dropping
+		// any older ones, or nullptr if nothing new is due (keep showing the last
+		// frame). The frame stays valid until the next call.
+		mailbox_frame_t* present(int64_t now);
+
+		// Drops everything queued and re-anchors the clock on the next frame,
+		// e.g. after a seek. Consumer side.
+		void reset();
+		// Wakes a producer waiting in begin_write and makes further calls fail
+		void close();
+
+		frame_presenter_stats_t get_stats();
+
+	private:
+		static const uint32_t no_slot = UINT32_MAX;
+
+		bool has_space() const;
+
+		std::mutex _mtx;
+		std::condition_variable _space;
+		std::vector<mailbox_frame_t> _slots;
+		std::vector<uint32_t> _free;
+		std::vector<uint32_t> _queue;     // Sorted by time
+		uint32_t _writing = no_slot;      // Owned by the producer between begin_write and publish
+		uint32_t _showing = no_slot;      // Owned by the consumer until the next present
+		bool _closed = false;
+		bool _anchored = false;
+		bool _starved = false;
+		int64_t _anchor = 0;              // Clock time minus media time
+		int64_t _latency = 0;
+		frame_presenter_stats_t _stats = {};
+	};
+
+} // namespace nakamir
@@ -0,0 +1,227 @@
+#include "h264_nal.h"
+#include "cpu_features.h"
+#include <atomic>
+#include <cstring>
+
+#if SKMF_X86
+#include <emmintrin.h>
+#endif
+#if SKMF_NEON
+#include <arm_neon.h>
+#endif
+
+namespace nakamir {
+
+	static std::atomic<int> _h264_scan_impl = h264_scan_impl_auto;
+
+	static bool h264_scan_impl_supported(h264_scan_impl_ impl)
+	{
+		switch (impl)
+		{
+		case h264_scan_impl_auto:
+		case h264_scan_impl_scalar: return true;
+		case h264_scan_impl_sse2:   return SKMF_X86 && cpu_has(cpu_feature_sse2);
+		case h264_scan_impl_avx2:   return SKMF_X86 && cpu_has(cpu_feature_avx2);
+		case h264_scan_impl_neon:   return SKMF_NEON && cpu_has(cpu_feature_neon);
+		default:                    return false;
+		}
+	}
+
+	static h264_scan_impl_ h264_scan_resolve(h264_scan_impl_ impl)
+	{
+		if (impl != h264_scan_impl_auto)
+			return impl;
+		if (h264_scan_impl_supported(h264_scan_impl_avx2)) return h264_scan_impl_avx2;
+		if (h264_scan_impl_supported(h264_scan_impl_sse2)) return h264_scan_impl_sse2;
+		if (h264_scan_impl_supported(h264_scan_impl_neon)) return h264_scan_impl_neon;
+		return h264_scan_impl_scalar;
+	}
+
+	static h264_find_start_code_fn h264_find_start_code_kernel(h264_scan_impl_ impl)
+	{
+		switch (impl)
+		{
+		case h264_scan_impl_sse2: return h264_find_start_code_sse2;
+		case h264_scan_impl_avx2: return h264_find_start_code_avx2;
+		case h264_scan_impl_neon: return h264_find_start_code_neon;
+		default:                  return h264_find_start_code_scalar;
+		}
+	}
+
+	bool h264_scan_set_impl(h264_scan_impl_ impl)
+	{
+		if (!h264_scan_impl_supported(impl))
+			return false;
+		_h264_scan_impl = impl;
+		return true;
+	}
+
+	h264_scan_impl_ h264_scan_get_impl()
+	{
+		return h264_scan_resolve(static_cast<h264_scan_impl_>(_h264_scan_impl.load()));
+	}
+
+	const char* h264_scan_impl_name(h264_scan_impl_ impl)
+	{
+		switch (impl)
+		{
+		case h264_scan_impl_auto:   return "auto";
+		case h264_scan_impl_scalar: return "scalar";
+		case h264_scan_impl_sse2:   return "sse2";
+		case h264_scan_impl_avx2:   return "avx2";
+		case h264_scan_impl_neon:   return "neon";
+		default:                    return "unknown";
+		}
+	}
+
+	size_t h264_find_start_code(const uint8_t* data, size_t size, size_t from)
+	{
+		return h264_find_start_code_kernel(h264_scan_get_impl())(data, size, from);
+	}
+
+	bool h264_next_nal(const uint8_t* data, size_t size, size_t* offset, h264_nal_t* nal)
+	{
+		h264_find_start_code_fn find = h264_find_start_code_kernel(h264_scan_get_impl());
+		size_t start = find(data, size, *offset);
+		while (start < size)
+		{
+			size_t begin = start + 3;
+			size_t next = find(data, size, begin);
+			// Zero bytes before the next start code are its leading zero_byte or
+			// trailing_zero_8bits, never part of this NAL unit
+			size_t end = next;
+			while (end > begin && data[end - 1] == 0)
+				end--;
+
+			if (end > begin)
+			{
+				nal->data = data + begin;
+				nal->size = end - begin;
+				nal->type = data[begin] & 0x1F;
+				nal->ref_idc = (data[begin] >> 5) & 0x3;
+				nal->start_code_size = start > 0 && data[start - 1] == 0 ? 4 : 3;
+				*offset = next;
+				return true;
+			}
+			start = next;
+		}
+		*offset = size;
+		return false;
+	}
+
+	size_t h264_split_nals(const uint8_t* data, size_t size, h264_nal_t* nals, size_t max_nals)
+	{
+		size_t count = 0;
+		size_t offset = 0;
+		h264_nal_t nal;
+		while (h264_next_nal(data, size, &offset, &nal))
+		{
+			if (count < max_nals)
+				nals[count] = nal;
+			count++;
+		}
+		return count;
+	}
+
+	h264_access_unit_info_t h264_scan_access_unit(const uint8_t* data, size_t size)
+	{
+		h264_access_unit_info_t info = {};
+		size_t offset = 0;
+		h264_nal_t nal;
+		while (h264_next_nal(data, size, &offset, &nal))
+		{
+			info.nal_count++;
+			info.type_mask |= 1u << nal.type;
+			if (nal.type == h264_nal_slice || nal.type == h264_nal_slice_idr)
+				info.slice_count++;
+		}
+		info.idr     = (info.type_mask & (1u << h264_nal_slice_idr)) != 0;
+		info.has_sps = (info.type_mask & (1u << h264_nal_sps)) != 0;
+		info.has_pps = (info.type_mask & (1u << h264_nal_pps)) != 0;
+		return info;
+	}
+
+	size_t h264_filter_nals(uint8_t* data, size_t size, uint32_t drop_type_mask)
+	{
+		// Each kept unit keeps its own start code length, so the write position
+		// never passes the read position
+		size_t write = 0;
+		size_t offset = 0;
+		h264_nal_t nal;
+		while (h264_next_nal(data, size, &offset, &nal))
+		{
+			if (drop_type_mask & (1u << nal.type))
+				continue;
+			uint8_t* out = data + write;
+			memset(out, 0, nal.start_code_size - 1u);
+			out[nal.start_code_size - 1] = 1;
+			memmove(out + nal.start_code_size, nal.data, nal.size);
+			write += nal.start_code_size + nal.size;
+		}
+		return write;
+	}
+
+	size_t h264_find_start_code_scalar(const uint8_t* data, size_t size, size_t from)
+	{
+		size_t i = from;
+		while (i + 2 < size)
+		{
+			// A third byte above 1 rules out a start code at i, i + 1 and i + 2
+			if (data[i + 2] > 1)
+				i += 3;
+			else if (data[i + 2] == 1 && data[i + 1] == 0 && data[i] == 0)
+				return i;
+			else
+				i++;
+		}
+		return size;
+	}
+
+#if SKMF_X86
+	size_t h264_find_start_code_sse2(const uint8_t* data, size_t size, size_t from)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i one  = _mm_set1_epi8(1);
+		size_t i = from;
+		for (; i + 18 <= size; i += 16)
+		{
+			__m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+			__m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+			__m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 2));
+			__m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)), _mm_cmpeq_epi8(b2, one));
+			uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hit));
+			if (mask)
+				return i + bit_scan_forward(mask);
+		}
+		return h264_find_start_code_scalar(data, size, i);
+	}
+#else
+	size_t h264_find_start_code_sse2(const uint8_t* data, size_t size, size_t from)
+	{
+		return h264_find_start_code_scalar(data, size, from);
+	}
+#endif
+
+#if SKMF_NEON
+	size_t h264_find_start_code_neon(const uint8_t* data, size_t size, size_t from)
+	{
+		size_t i = from;
+		for (; i + 18 <= size; i += 16)
+		{
+			uint8x16_t hit = vandq_u8(vandq_u8(vceqzq_u8(vld1q_u8(data + i)), vceqzq_u8(vld1q_u8(data + i + 1))),
+				vceqq_u8(vld1q_u8(data + i + 2), vdupq_n_u8(1)));
+			// Narrow to a nibble per byte so the first hit can be found with one ctz
+			uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+			if (mask)
+				return i + bit_scan_forward64(mask) / 4;
+		}
+		return h264_find_start_code_scalar(data, size, i);
+	}
+#else
+	size_t h264_find_start_code_neon(const uint8_t* data, size_t size, size_t from)
+	{
+		return h264_find_start_code_scalar(data, size, from);
+	}
+#endif
+
+} // namespace nakamir
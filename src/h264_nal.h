@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nakamir {
+
+	// nal_unit_type values from ITU-T H.264 table 7-1 that we care about
+	enum h264_nal_type_ {
+		h264_nal_slice           = 1,
+		h264_nal_slice_idr       = 5,
+		h264_nal_sei             = 6,
+		h264_nal_sps             = 7,
+		h264_nal_pps             = 8,
+		h264_nal_aud             = 9,
+		h264_nal_end_of_sequence = 10,
+		h264_nal_end_of_stream   = 11,
+		h264_nal_filler          = 12,
+	};
+
+	// One NAL unit inside an Annex-B buffer. data points into the scanned
+	// buffer at the NAL header byte and runs up to, not including, the next
+	// start code (trailing zero bytes belong to that start code), so nothing
+	// is copied and the span is only valid while the buffer is.
+	struct h264_nal_t {
+		const uint8_t* data;
+		size_t size;
+		uint8_t type;            // h264_nal_type_, the low 5 bits of the header
+		uint8_t ref_idc;
+		uint8_t start_code_size; // 3 or 4, for rewriting in place
+	};
+
+	// Summary of the NAL units in one encoded sample
+	struct h264_access_unit_info_t {
+		uint32_t nal_count;
+		uint32_t slice_count;
+		uint32_t type_mask;      // Bit (1 << type) set for every NAL type seen
+		bool idr;
+		bool has_sps;
+		bool has_pps;
+	};
+
+	// Offset of the next 00 00 01 at or after from, or size if there is none
+	size_t h264_find_start_code(const uint8_t* data, size_t size, size_t from = 0);
+
+	// Iterates NAL units; start *offset at 0 and call until it returns false.
+	// Bytes before the first start code are skipped.
+	bool h264_next_nal(const uint8_t* data, size_t size, /**[in,out]**/ size_t* offset, /**[out]**/ h264_nal_t* nal);
+
+	// Fills up to max_nals spans, returning how many NAL units the buffer has in
+	// total (which may be more than max_nals)
+	size_t h264_split_nals(const uint8_t* data, size_t size, /**[out]**/ h264_nal_t* nals, size_t max_nals);
+
+	h264_access_unit_info_t h264_scan_access_unit(const uint8_t* data, size_t size);
+
+	// Compacts the buffer in place, dropping every NAL unit whose type bit is in
+	// drop_type_mask, e.g. (1 << h264_nal_aud) | (1 << h264_nal_filler). Kept
+	// units keep the start code length they had, 3 or 4 bytes, so the output
+	// never outgrows the input; bytes before the first start code and zero
+	// padding between units go. Returns the new size.
+	size_t h264_filter_nals(uint8_t* data, size_t size, uint32_t drop_type_mask);
+
+	enum h264_scan_impl_ {
+		h264_scan_impl_auto,    // Best available on this CPU
+		h264_scan_impl_scalar,
+		h264_scan_impl_sse2,
+		h264_scan_impl_avx2,
+		h264_scan_impl_neon,
+	};
+
+	// Forces a specific start code search, for benchmarking or to rule out a SIMD
+	// path. Returns false, leaving the current choice alone, if the CPU can't run it.
+	bool h264_scan_set_impl(h264_scan_impl_ impl);
+	h264_scan_impl_ h264_scan_get_impl();
+	const char* h264_scan_impl_name(h264_scan_impl_ impl);
+
+	// Start code searches, exposed for the dispatcher and benchmarks. Same
+	// contract as h264_find_start_code.
+	typedef size_t(*h264_find_start_code_fn)(const uint8_t* data, size_t size, size_t from);
+	size_t h264_find_start_code_scalar(const uint8_t* data, size_t size, size_t from);
+	size_t h264_find_start_code_sse2(const uint8_t* data, size_t size, size_t from);
+	size_t h264_find_start_code_avx2(const uint8_t* data, size_t size, size_t from);
+	size_t h264_find_start_code_neon(const uint8_t* data, size_t size, size_t from);
+
+} // namespace nakamir
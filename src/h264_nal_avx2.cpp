@@ -0,0 +1,41 @@
+#include "h264_nal.h"
+#include "cpu_features.h"
+
+// Built with AVX2 code generation enabled (see CMakeLists.txt), and only ever
+// called after the dispatcher has checked the CPU supports it
+#if SKMF_X86
+#include <immintrin.h>
+#endif
+
+namespace nakamir {
+
+#if SKMF_X86
+	size_t h264_find_start_code_avx2(const uint8_t* data, size_t size, size_t from)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i one  = _mm256_set1_epi8(1);
+		size_t i = from;
+		for (; i + 34 <= size; i += 32)
+		{
+			__m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+			__m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 1));
+			__m256i b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 2));
+			__m256i hit = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)), _mm256_cmpeq_epi8(b2, one));
+			uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+			if (mask)
+			{
+				_mm256_zeroupper();
+				return i + bit_scan_forward(mask);
+			}
+		}
+		_mm256_zeroupper();
+		return h264_find_start_code_sse2(data, size, i);
+	}
+#else
+	size_t h264_find_start_code_avx2(const uint8_t* data, size_t size, size_t from)
+	{
+		return h264_find_start_code_scalar(data, size, from);
+	}
+#endif
+
+} // namespace nakamir
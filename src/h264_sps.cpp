@@ -0,0 +1,515 @@
+#include "h264_sps.h"
+#include "h264_nal.h"
+#include <algorithm>
+#include <vector>
+
+namespace nakamir {
+
+	// MSB-first reader over an RBSP. Reads past the end return zeros and set
+	// overrun, so parsers can read a whole structure and check once at the end.
+	class h264_bit_reader {
+	public:
+		h264_bit_reader(const uint8_t* data, size_t size) : _data(data), _size_bits(size * 8)
+		{
+			// The rbsp_stop_one_bit is the last set bit in the buffer
+			_end_bits = _size_bits;
+			while (size > 0 && data[size - 1] == 0)
+			{
+				size--;
+				_end_bits -= 8;
+			}
+			if (size > 0)
+			{
+				uint8_t last = data[size - 1];
+				int32_t trailing = 0;
+				while (!(last & (1 << trailing)))
+					trailing++;
+				_end_bits -= trailing + 1;
+			}
+		}
+
+		uint32_t u(uint32_t bits)
+		{
+			uint32_t value = 0;
+			for (uint32_t i = 0; i < bits; i++)
+			{
+				uint32_t bit = 0;
+				if (_pos < _size_bits)
+					bit = (_data[_pos >> 3] >> (7 - (_pos & 7))) & 1;
+				else
+					_overrun = true;
+				_pos++;
+				value = (value << 1) | bit;
+			}
+			return value;
+		}
+
+		bool flag() { return u(1) != 0; }
+
+		uint32_t ue()
+		{
+			uint32_t leading_zeros = 0;
+			while (!flag())
+			{
+				if (++leading_zeros > 31 || _overrun)
+				{
+					_overrun = true;
+					return 0;
+				}
+			}
+			if (leading_zeros == 0)
+				return 0;
+			return static_cast<uint32_t>((1ull << leading_zeros) - 1 + u(leading_zeros));
+		}
+
+		int32_t se()
+		{
+			uint32_t code = ue();
+			// 1, 2, 3, 4 ... map to 1, -1, 2, -2 ...
+			int32_t magnitude = static_cast<int32_t>((code + 1) / 2);
+			return (code & 1) ? magnitude : -magnitude;
+		}
+
+		bool more_rbsp_data() const { return _pos < _end_bits; }
+		bool overrun() const { return _overrun; }
+
+	private:
+		const uint8_t* _data;
+		size_t _size_bits;
+		size_t _end_bits;
+		size_t _pos = 0;
+		bool _overrun = false;
+	};
+
+	size_t h264_nal_to_rbsp(const uint8_t* nal, size_t size, uint8_t* rbsp)
+	{
+		size_t out = 0;
+		uint32_t zeros = 0;
+		for (size_t i = 0; i < size; i++)
+		{
+			uint8_t byte = nal[i];
+			if (zeros >= 2 && byte == 3)
+			{
+				zeros = 0;
+				continue;
+			}
+			zeros = byte == 0 ? zeros + 1 : 0;
+			rbsp[out++] = byte;
+		}
+		return out;
+	}
+
+	static void skip_scaling_list(h264_bit_reader& bits, uint32_t size)
+	{
+		int32_t last_scale = 8;
+		int32_t next_scale = 8;
+		for (uint32_t j = 0; j < size; j++)
+		{
+			if (next_scale != 0)
+			{
+				int32_t delta_scale = bits.se();
+				next_scale = (last_scale + delta_scale + 256) % 256;
+			}
+			last_scale = next_scale == 0 ? last_scale : next_scale;
+		}
+	}
+
+	static void skip_hrd_parameters(h264_bit_reader& bits)
+	{
+		uint32_t cpb_cnt = bits.ue() + 1;
+		bits.u(4); // bit_rate_scale
+		bits.u(4); // cpb_size_scale
+		for (uint32_t i = 0; i < cpb_cnt && !bits.overrun(); i++)
+		{
+			bits.ue(); // bit_rate_value_minus1
+			bits.ue(); // cpb_size_value_minus1
+			bits.u(1); // cbr_flag
+		}
+		bits.u(5 * 4); // Delay and offset field lengths
+	}
+
+	static bool profile_has_chroma_info(uint8_t profile_idc)
+	{
+		switch (profile_idc)
+		{
+		case 100: case 110: case 122: case 244: case 44:
+		case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	static void parse_vui(h264_bit_reader& bits, h264_sps_t* sps)
+	{
+		// Table E-1
+		static const uint8_t sar_table[17][2] = {
+			{ 0, 0 }, { 1, 1 }, { 12, 11 }, { 10, 11 }, { 16, 11 }, { 40, 33 }, { 24, 11 }, { 20, 11 }, { 32, 11 },
+			{ 80, 33 }, { 18, 11 }, { 15, 11 }, { 64, 33 }, { 160, 99 }, { 4, 3 }, { 3, 2 }, { 2, 1 },
+		};
+
+		if (bits.flag()) // aspect_ratio_info_present_flag
+		{
+			uint32_t aspect_ratio_idc = bits.u(8);
+			if (aspect_ratio_idc == 255)
+			{
+				sps->sar_width = bits.u(16);
+				sps->sar_height = bits.u(16);
+			}
+			else if (aspect_ratio_idc > 0 && aspect_ratio_idc < 17)
+			{
+				sps->sar_width = sar_table[aspect_ratio_idc][0];
+				sps->sar_height = sar_table[aspect_ratio_idc][1];
+			}
+		}
+		if (bits.flag()) // overscan_info_present_flag
+			bits.u(1);
+		if (bits.flag()) // video_signal_type_present_flag
+		{
+			bits.u(3); // video_format
+			sps->video_full_range = bits.flag();
+			if (bits.flag()) // colour_description_present_flag
+			{
+				sps->colour_primaries = static_cast<uint8_t>(bits.u(8));
+				sps->transfer_characteristics = static_cast<uint8_t>(bits.u(8));
+				sps->matrix_coefficients = static_cast<uint8_t>(bits.u(8));
+			}
+		}
+		if (bits.flag()) // chroma_loc_info_present_flag
+		{
+			bits.ue();
+			bits.ue();
+		}
+		sps->timing_info_present = bits.flag();
+		if (sps->timing_info_present)
+		{
+			sps->num_units_in_tick = bits.u(32);
+			sps->time_scale = bits.u(32);
+			sps->fixed_frame_rate = bits.flag();
+		}
+		bool nal_hrd = bits.flag();
+		if (nal_hrd)
+			skip_hrd_parameters(bits);
+		bool vcl_hrd = bits.flag();
+		if (vcl_hrd)
+			skip_hrd_parameters(bits);
+		if (nal_hrd || vcl_hrd)
+			bits.u(1); // low_delay_hrd_flag
+		bits.u(1); // pic_struct_present_flag
+		sps->bitstream_restriction = bits.flag();
+		if (sps->bitstream_restriction)
+		{
+			bits.u(1); // motion_vectors_over_pic_boundaries_flag
+			bits.ue(); // max_bytes_per_pic_denom
+			bits.ue(); // max_bits_per_mb_denom
+			bits.ue(); // log2_max_mv_length_horizontal
+			bits.ue(); // log2_max_mv_length_vertical
+			sps->max_num_reorder_frames = bits.ue();
+			sps->max_dec_frame_buffering = bits.ue();
+		}
+	}
+
+	bool h264_parse_sps(const uint8_t* nal, size_t size, h264_sps_t* sps)
+	{
+		if (size < 4 || (nal[0] & 0x1F) != h264_nal_sps)
+			return false;
+
+		std::vector<uint8_t> rbsp(size);
+		rbsp.resize(h264_nal_to_rbsp(nal + 1, size - 1, rbsp.data()));
+		h264_bit_reader bits(rbsp.data(), rbsp.size());
+
+		h264_sps_t result = {};
+		result.profile_idc = static_cast<uint8_t>(bits.u(8));
+		result.constraint_flags = static_cast<uint8_t>(bits.u(8));
+		result.level_idc = static_cast<uint8_t>(bits.u(8));
+		result.sps_id = bits.ue();
+		if (result.sps_id > 31)
+			return false;
+
+		result.chroma_format_idc = 1;
+		result.bit_depth_luma = 8;
+		result.bit_depth_chroma = 8;
+		bool separate_colour_plane = false;
+		if (profile_has_chroma_info(result.profile_idc))
+		{
+			result.chroma_format_idc = bits.ue();
+			if (result.chroma_format_idc > 3)
+				return false;
+			if (result.chroma_format_idc == 3)
+				separate_colour_plane = bits.flag();
+			result.bit_depth_luma = bits.ue() + 8;
+			result.bit_depth_chroma = bits.ue() + 8;
+			bits.u(1); // qpprime_y_zero_transform_bypass_flag
+			if (bits.flag()) // seq_scaling_matrix_present_flag
+			{
+				uint32_t lists = result.chroma_format_idc != 3 ? 8 : 12;
+				for (uint32_t i = 0; i < lists; i++)
+				{
+					if (bits.flag())
+						skip_scaling_list(bits, i < 6 ? 16 : 64);
+				}
+			}
+		}
+
+		result.log2_max_frame_num = bits.ue() + 4;
+		result.pic_order_cnt_type = bits.ue();
+		if (result.pic_order_cnt_type == 0)
+		{
+			bits.ue(); // log2_max_pic_order_cnt_lsb_minus4
+		}
+		else if (result.pic_order_cnt_type == 1)
+		{
+			bits.u(1); // delta_pic_order_always_zero_flag
+			bits.se(); // offset_for_non_ref_pic
+			bits.se(); // offset_for_top_to_bottom_field
+			uint32_t cycle = bits.ue();
+			if (cycle > 255)
+				return false;
+			for (uint32_t i = 0; i < cycle; i++)
+				bits.se();
+		}
+		else if (result.pic_order_cnt_type > 2)
+		{
+			return false;
+		}
+
+		result.max_num_ref_frames = bits.ue();
+		bits.u(1); // gaps_in_frame_num_value_allowed_flag
+		uint32_t width_mbs = bits.ue() + 1;
+		uint32_t height_map_units = bits.ue() + 1;
+		result.frame_mbs_only = bits.flag();
+		if (!result.frame_mbs_only)
+			bits.u(1); // mb_adaptive_frame_field_flag
+		bits.u(1); // direct_8x8_inference_flag
+
+		result.coded_width = width_mbs * 16;
+		result.coded_height = (result.frame_mbs_only ? 1 : 2) * height_map_units * 16;
+		if (result.coded_width > 16384 || result.coded_height > 16384)
+			return false;
+
+		if (bits.flag()) // frame_cropping_flag
+		{
+			uint32_t chroma_array_type = separate_colour_plane ? 0 : result.chroma_format_idc;
+			uint32_t crop_unit_x = chroma_array_type == 0 ? 1 : (chroma_array_type == 3 ? 1 : 2);
+			uint32_t crop_unit_y = (chroma_array_type == 0 ? 1 : (chroma_array_type == 1 ? 2 : 1)) * (result.frame_mbs_only ? 1 : 2);
+			result.crop_left   = bits.ue() * crop_unit_x;
+			result.crop_right  = bits.ue() * crop_unit_x;
+			result.crop_top    = bits.ue() * crop_unit_y;
+			result.crop_bottom = bits.ue() * crop_unit_y;
+			if (result.crop_left + result.crop_right >= result.coded_width || result.crop_top + result.crop_bottom >= result.coded_height)
+				return false;
+		}
+		result.width = result.coded_width - result.crop_left - result.crop_right;
+		result.height = result.coded_height - result.crop_top - result.crop_bottom;
+
+		result.sar_width = 1;
+		result.sar_height = 1;
+		result.colour_primaries = 2;
+		result.transfer_characteristics = 2;
+		result.matrix_coefficients = 2;
+		result.vui_present = bits.flag();
+		if (result.vui_present)
+			parse_vui(bits, &result);
+
+		if (bits.overrun())
+			return false;
+		*sps = result;
+		return true;
+	}
+
+	bool h264_parse_pps(const uint8_t* nal, size_t size, const h264_sps_t* sps, h264_pps_t* pps)
+	{
+		if (size < 2 || (nal[0] & 0x1F) != h264_nal_pps)
+			return false;
+
+		std::vector<uint8_t> rbsp(size);
+		rbsp.resize(h264_nal_to_rbsp(nal + 1, size - 1, rbsp.data()));
+		h264_bit_reader bits(rbsp.data(), rbsp.size());
+
+		h264_pps_t result = {};
+		result.pps_id = bits.ue();
+		result.sps_id = bits.ue();
+		if (result.pps_id > 255 || result.sps_id > 31)
+			return false;
+		result.entropy_coding_mode = bits.flag();
+		result.bottom_field_pic_order_in_frame_present = bits.flag();
+		result.num_slice_groups = bits.ue() + 1;
+		if (result.num_slice_groups > 8)
+			return false;
+		if (result.num_slice_groups > 1)
+		{
+			uint32_t map_type = bits.ue();
+			if (map_type == 0)
+			{
+				for (uint32_t i = 0; i < result.num_slice_groups; i++)
+					bits.ue(); // run_length_minus1
+			}
+			else if (map_type == 2)
+			{
+				for (uint32_t i = 0; i + 1 < result.num_slice_groups; i++)
+				{
+					bits.ue(); // top_left
+					bits.ue(); // bottom_right
+				}
+			}
+			else if (map_type >= 3 && map_type <= 5)
+			{
+				bits.u(1); // slice_group_change_direction_flag
+				bits.ue(); // slice_group_change_rate_minus1
+			}
+			else if (map_type == 6)
+			{
+				uint32_t id_bits = 0;
+				while ((1u << id_bits) < result.num_slice_groups)
+					id_bits++;
+				uint32_t map_units = bits.ue() + 1;
+				for (uint32_t i = 0; i < map_units && !bits.overrun(); i++)
+					bits.u(id_bits);
+			}
+		}
+		result.num_ref_idx_l0_default_active = bits.ue() + 1;
+		result.num_ref_idx_l1_default_active = bits.ue() + 1;
+		result.weighted_pred = bits.flag();
+		result.weighted_bipred_idc = bits.u(2);
+		result.pic_init_qp = 26 + bits.se();
+		bits.se(); // pic_init_qs_minus26
+		result.chroma_qp_index_offset = bits.se();
+		result.deblocking_filter_control_present = bits.flag();
+		result.constrained_intra_pred = bits.flag();
+		bits.u(1); // redundant_pic_cnt_present_flag
+
+		result.second_chroma_qp_index_offset = result.chroma_qp_index_offset;
+		if (bits.more_rbsp_data())
+		{
+			result.transform_8x8_mode = bits.flag();
+			if (bits.flag()) // pic_scaling_matrix_present_flag
+			{
+				uint32_t chroma_format_idc = sps ? sps->chroma_format_idc : 1;
+				uint32_t lists = 6 + (result.transform_8x8_mode ? (chroma_format_idc != 3 ? 2 : 6) : 0);
+				for (uint32_t i = 0; i < lists; i++)
+				{
+					if (bits.flag())
+						skip_scaling_list(bits, i < 6 ? 16 : 64);
+				}
+			}
+			result.second_chroma_qp_index_offset = bits.se();
+		}
+
+		if (bits.overrun())
+			return false;
+		*pps = result;
+		return true;
+	}
+
+	bool h264_parse_parameter_sets(const uint8_t* data, size_t size, h264_sps_t* sps, h264_pps_t* pps)
+	{
+		bool have_sps = false;
+		bool have_pps = pps == nullptr;
+		size_t offset = 0;
+		h264_nal_t nal;
+		while ((!have_sps || !have_pps) && h264_next_nal(data, size, &offset, &nal))
+		{
+			if (!have_sps && nal.type == h264_nal_sps)
+				have_sps = h264_parse_sps(nal.data, nal.size, sps);
+			else if (!have_pps && nal.type == h264_nal_pps)
+				have_pps = h264_parse_pps(nal.data, nal.size, have_sps ? sps : nullptr, pps);
+		}
+		return have_sps && have_pps;
+	}
+
+	// MaxDpbMbs from table A-1
+	static uint32_t level_max_dpb_mbs(const h264_sps_t* sps)
+	{
+		// Level 1b is level_idc 11 with constraint_set3_flag outside the High profiles
+		bool level_1b = sps->level_idc == 9 || (sps->level_idc == 11 && (sps->constraint_flags & 0x10) && !profile_has_chroma_info(sps->profile_idc));
+		if (level_1b)
+			return 396;
+		switch (sps->level_idc)
+		{
+		case 10:          return 396;
+		case 11:          return 900;
+		case 12: case 13:
+		case 20:          return 2376;
+		case 21:          return 4752;
+		case 22: case 30: return 8100;
+		case 31:          return 18000;
+		case 32:          return 20480;
+		case 40: case 41: return 32768;
+		case 42:          return 34816;
+		case 50:          return 110400;
+		case 51: case 52: return 184320;
+		default:          return sps->level_idc > 52 ? 696320 : 0;
+		}
+	}
+
+	uint32_t h264_sps_dpb_frames(const h264_sps_t* sps)
+	{
+		if (sps->bitstream_restriction && sps->max_dec_frame_buffering > 0)
+			return std::min<uint32_t>(sps->max_dec_frame_buffering, 16);
+
+		uint32_t frame_mbs = (sps->coded_width / 16) * (sps->coded_height / 16);
+		uint32_t max_dpb_mbs = level_max_dpb_mbs(sps);
+		if (frame_mbs == 0 || max_dpb_mbs == 0)
+			return 16;
+		return std::clamp<uint32_t>(max_dpb_mbs / frame_mbs, std::max<uint32_t>(sps->max_num_ref_frames, 1), 16);
+	}
+
+	uint32_t h264_sps_reorder_depth(const h264_sps_t* sps)
+	{
+		if (sps->bitstream_restriction)
+			return sps->max_num_reorder_frames;
+		// Baseline has no B frames, and neither do the intra-only profiles
+		// (constraint_set3_flag on High 10/4:2:2/4:4:4 and CAVLC 4:4:4)
+		bool intra_only = (sps->constraint_flags & 0x10) && (sps->profile_idc == 110 || sps->profile_idc == 122 || sps->profile_idc == 244 || sps->profile_idc == 44);
+		if (sps->profile_idc == 66 || sps->profile_idc == 44 || intra_only)
+			return 0;
+		return h264_sps_dpb_frames(sps);
+	}
+
+	bool h264_sps_frame_rate(const h264_sps_t* sps, uint32_t* numerator, uint32_t* denominator)
+	{
+		if (!sps->timing_info_present || sps->num_units_in_tick == 0 || sps->time_scale == 0)
+			return false;
+		// A tick is one field, so a frame takes two
+		uint64_t num = sps->time_scale;
+		uint64_t den = 2ull * sps->num_units_in_tick;
+		uint64_t a = num, b = den;
+		while (b) { uint64_t t = a % b; a = b; b = t; }
+		*numerator = static_cast<uint32_t>(num / a);
+		*denominator = static_cast<uint32_t>(den / a);
+		return true;
+	}
+
+	color_matrix_ h264_sps_color_matrix(const h264_sps_t* sps)
+	{
+		// Table E-5: 1 is BT.709, 5 and 6 are BT.601, 2 is unspecified, in which
+		// case go by the usual convention of BT.709 for HD
+		if (sps->matrix_coefficients == 1)
+			return color_matrix_bt709;
+		if (sps->matrix_coefficients == 2 && sps->height >= 720)
+			return color_matrix_bt709;
+		return color_matrix_bt601;
+	}
+
+	color_range_ h264_sps_color_range(const h264_sps_t* sps)
+	{
+		return sps->video_full_range ? color_range_full : color_range_limited;
+	}
+
+	const char* h264_profile_name(uint8_t profile_idc)
+	{
+		switch (profile_idc)
+		{
+		case 66:  return "Baseline";
+		case 77:  return "Main";
+		case 88:  return "Extended";
+		case 100: return "High";
+		case 110: return "High 10";
+		case 122: return "High 4:2:2";
+		case 244: return "High 4:4:4 Predictive";
+		case 44:  return "CAVLC 4:4:4 Intra";
+		default:  return "Unknown";
+		}
+	}
+
+} // namespace nakamir
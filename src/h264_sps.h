@@ -0,0 +1,96 @@
+#pragma once
+
+#include "nv12_convert.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace nakamir {
+
+	// Sequence parameter set fields (ITU-T H.264 7.3.2.1.1 and Annex E), plus
+	// the sizes derived from them. Only what we act on is kept; everything else
+	// is parsed past.
+	struct h264_sps_t {
+		uint8_t profile_idc;         // 66 baseline, 77 main, 100 high, ...
+		uint8_t constraint_flags;    // constraint_set0_flag in the top bit
+		uint8_t level_idc;           // Level * 10, e.g. 31 for 3.1
+		uint32_t sps_id;
+		uint32_t chroma_format_idc;  // 1 for 4:2:0
+		uint32_t bit_depth_luma;
+		uint32_t bit_depth_chroma;
+		uint32_t log2_max_frame_num;
+		uint32_t pic_order_cnt_type;
+		uint32_t max_num_ref_frames;
+		bool frame_mbs_only;
+
+		// Decoded picture size in pixels (multiples of 16), and the displayed
+		// size after frame_cropping is applied
+		uint32_t coded_width;
+		uint32_t coded_height;
+		uint32_t width;
+		uint32_t height;
+		uint32_t crop_left, crop_right, crop_top, crop_bottom; // In pixels
+
+		bool vui_present;
+		uint32_t sar_width;          // Sample aspect ratio, 1:1 when not signalled
+		uint32_t sar_height;
+		bool video_full_range;
+		uint8_t colour_primaries;    // 2 (unspecified) when not signalled
+		uint8_t transfer_characteristics;
+		uint8_t matrix_coefficients;
+		bool timing_info_present;
+		uint32_t num_units_in_tick;
+		uint32_t time_scale;
+		bool fixed_frame_rate;
+		bool bitstream_restriction;
+		uint32_t max_num_reorder_frames;
+		uint32_t max_dec_frame_buffering;
+	};
+
+	// Picture parameter set fields (7.3.2.2)
+	struct h264_pps_t {
+		uint32_t pps_id;
+		uint32_t sps_id;
+		bool entropy_coding_mode;    // CABAC
+		bool bottom_field_pic_order_in_frame_present;
+		uint32_t num_slice_groups;
+		uint32_t num_ref_idx_l0_default_active;
+		uint32_t num_ref_idx_l1_default_active;
+		bool weighted_pred;
+		uint32_t weighted_bipred_idc;
+		int32_t pic_init_qp;
+		int32_t chroma_qp_index_offset;
+		bool deblocking_filter_control_present;
+		bool constrained_intra_pred;
+		bool transform_8x8_mode;
+		int32_t second_chroma_qp_index_offset;
+	};
+
+	// Strips emulation prevention bytes (the 03 in 00 00 03) from a NAL unit.
+	// rbsp needs room for size bytes; returns the unescaped size.
+	size_t h264_nal_to_rbsp(const uint8_t* nal, size_t size, /**[out]**/ uint8_t* rbsp);
+
+	// Parse one NAL unit, header byte included, as found by h264_next_nal.
+	// Return false for the wrong NAL type or a malformed/truncated set.
+	bool h264_parse_sps(const uint8_t* nal, size_t size, /**[out]**/ h264_sps_t* sps);
+	// sps (the one pps->sps_id refers to) is needed to parse the optional
+	// scaling lists of 4:4:4 streams; may be null otherwise
+	bool h264_parse_pps(const uint8_t* nal, size_t size, /**[in]**/ const h264_sps_t* sps, /**[out]**/ h264_pps_t* pps);
+
+	// Parses the first SPS, and PPS if pps isn't null, of an Annex-B buffer such
+	// as MF_MT_MPEG_SEQUENCE_HEADER or a keyframe. False if there's no valid SPS
+	// (or PPS, when asked for).
+	bool h264_parse_parameter_sets(const uint8_t* data, size_t size, /**[out]**/ h264_sps_t* sps, /**[out]**/ h264_pps_t* pps = nullptr);
+
+	// Frames the decoder may hold back before output: max_num_reorder_frames when
+	// signalled, 0 for profiles without B frames, otherwise the level's DPB size
+	uint32_t h264_sps_reorder_depth(const h264_sps_t* sps);
+	// Most frames the decoder keeps for reference and reordering
+	uint32_t h264_sps_dpb_frames(const h264_sps_t* sps);
+	// Frame rate from VUI timing info as a ratio; false when not signalled
+	bool h264_sps_frame_rate(const h264_sps_t* sps, /**[out]**/ uint32_t* numerator, /**[out]**/ uint32_t* denominator);
+	// YUV matrix and range for nv12_to_rgb, from the VUI (BT.601 limited if absent)
+	color_matrix_ h264_sps_color_matrix(const h264_sps_t* sps);
+	color_range_ h264_sps_color_range(const h264_sps_t* sps);
+	const char* h264_profile_name(uint8_t profile_idc);
+
+} // namespace nakamir
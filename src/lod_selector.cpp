@@ -0,0 +1,83 @@
+#include "lod_selector.h"
+#include <cmath>
+
+namespace nakamir {
+
+	void lod_selector::reset(int32_t source_width, int32_t source_height, int32_t min_width, float hysteresis, uint32_t settle_frames)
+	{
+		_levels.clear();
+		_levels.push_back({ source_width, source_height });
+		for (int32_t step = 1; ; step++)
+		{
+			// Even sizes, so the chroma plane is exactly half of luma
+			double scale = std::pow(2.0, -step / 2.0);
+			int32_t width = static_cast<int32_t>(std::lround(source_width * scale / 2)) * 2;
+			int32_t height = static_cast<int32_t>(std::lround(source_height * scale / 2)) * 2;
+			if (width < min_width || width < 2 || height < 2)
+				break;
+			_levels.push_back({ width, height });
+		}
+
+		_hysteresis = hysteresis;
+		_settle_frames = settle_frames;
+		_settling = 0;
+		_updates = 0;
+		_changes = 0;
+		_level = 0;
+		_size.store(static_cast<uint64_t>(source_width) << 32 | static_cast<uint32_t>(source_height), std::memory_order_relaxed);
+	}
+
+	void lod_selector::select(uint32_t level)
+	{
+		_level = level;
+		_settling = 0;
+		_changes++;
+		_size.store(static_cast<uint64_t>(_levels[level].width) << 32 | static_cast<uint32_t>(_levels[level].height), std::memory_order_relaxed);
+	}
+
+	bool lod_selector::update(float screen_width)
+	{
+		_updates++;
+		if (_levels.empty() || !(screen_width > 0))
+			return false;
+
+		// Too small for the screen: go sharp now, to the smallest level that covers it
+		float current = static_cast<float>(_levels[_level].width);
+		if (_level > 0 && screen_width > current * (1 + _hysteresis))
+		{
+			uint32_t level = _level;
+			while (level > 0 && static_cast<float>(_levels[level].width) < screen_width)
+				level--;
+			select(level);
+			return true;
+		}
+
+		// Comfortably bigger than the next level down needs to be: soften, but
+		// only once it has been so for a while
+		uint32_t level = _level;
+		while (level + 1 < _levels.size() && screen_width * (1 + _hysteresis) < static_cast<float>(_levels[level + 1].width))
+			level++;
+		if (level == _level)
+		{
+			_settling = 0;
+			return false;
+		}
+		if (++_settling < _settle_frames)
+			return false;
+		select(level);
+		return true;
+	}
+
+	lod_selector_stats_t lod_selector::get_stats() const
+	{
+		lod_selector_stats_t stats = {};
+		stats.width = width();
+		stats.height = height();
+		stats.level = _level;
+		stats.levels = static_cast<uint32_t>(_levels.size());
+		stats.updates = _updates;
+		stats.changes = _changes;
+		return stats;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace nakamir {
+
+	struct lod_selector_stats_t {
+		int32_t width;            // Chosen size
+		int32_t height;
+		uint32_t level;           // 0 is full size
+		uint32_t levels;
+		uint64_t updates;
+		uint64_t changes;         // Times the chosen size moved, i.e. texture reallocations
+	};
+
+	// Picks the resolution to upload a video at from how many pixels wide it
+	// shows up on screen, so a 4K stream on a panel a few hundred pixels across
+	// doesn't upload every byte. Sizes come from a fixed ladder, each a
+	// factor of sqrt(2) smaller than the last, so every other step is an
+	// exact halving.
+	//
+	// Every change reallocates textures, so changes are damped: a sharper
+	// level is taken straight away once the panel outgrows the current one by
+	// the hysteresis margin, but a softer one only after the panel has stayed
+	// that much below it for settle_frames updates in a row.
+	//
+	// update belongs to one thread (the render thread); width and height may
+	// be read from any.
+	class lod_selector {
+	public:
+		lod_selector() = default;
+		lod_selector(int32_t source_width, int32_t source_height, int32_t min_width = 128, float hysteresis = 0.15f, uint32_t settle_frames = 30) {
+			reset(source_width, source_height, min_width, hysteresis, settle_frames);
+		}
+
+		void reset(int32_t source_width, int32_t source_height, int32_t min_width = 128, float hysteresis = 0.15f, uint32_t settle_frames = 30);
+
+		// Feeds this frame's on-screen width in pixels. Returns true if the
+		// chosen size changed. Widths of 0 or less, e.g. a panel behind the
+		// viewer, leave the choice alone.
+		bool update(float screen_width);
+
+		int32_t width() const { return static_cast<int32_t>(_size.load(std::memory_order_relaxed) >> 32); }
+		int32_t height() const { return static_cast<int32_t>(_size.load(std::memory_order_relaxed) & 0xFFFFFFFF); }
+		lod_selector_stats_t get_stats() const;
+
+	private:
+		struct level_t {
+			int32_t width;
+			int32_t height;
+		};
+
+		void select(uint32_t level);
+
+		std::vector<level_t> _levels;   // Largest first
+		float _hysteresis = 0;
+		uint32_t _settle_frames = 0;
+		uint32_t _level = 0;
+		uint32_t _settling = 0;         // Updates in a row that wanted a softer level
+		uint64_t _updates = 0;
+		uint64_t _changes = 0;
+		std::atomic<uint64_t> _size = 0;   // width << 32 | height
+	};
+
+} // namespace nakamir
@@ -4,9 +4,13 @@ using namespace nakamir;
 
 // Only one scenario may be run at a time
 int main(void) {
-	// SCENARIO 1: Decode an MP4 file from a local or online source as fast as possible
+	// SCENARIO 1: Decode an MP4 file from a local or online source, played back in real time
 	//mf_decode_from_url(L"http://commondatastorage.googleapis.com/gtv-videos-bucket/sample/BigBuckBunny.mp4");
 
+	// SCENARIO 1b: A wall of videos, decoded side by side on a shared pool of worker threads
+	//const wchar_t* wall[] = { L"video0.mp4", L"video1.mp4", L"video2.mp4", L"video3.mp4" };
+	//mf_decode_wall(wall, 4);
+
 	// SCENARIO 2: Read from the webcam, encode the sample, decode the sample, and render
 	mf_roundtrip_webcam();
 	return 0;
@@ -0,0 +1,147 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <memoryapi.h>
+#include <string>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace nakamir {
+
+	mapped_file::~mapped_file()
+	{
+		close();
+	}
+
+#ifdef _WIN32
+	bool mapped_file::open(const char* path)
+	{
+		int length = MultiByteToWideChar(CP_UTF8, 0, path, -1, nullptr, 0);
+		if (length <= 0)
+			return false;
+		std::wstring wide(static_cast<size_t>(length), L'\0');
+		MultiByteToWideChar(CP_UTF8, 0, path, -1, wide.data(), length);
+		return open(wide.c_str());
+	}
+
+	bool mapped_file::open(const wchar_t* path)
+	{
+		close();
+
+		HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size = {};
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+		{
+			CloseHandle(file);
+			return false;
+		}
+
+		HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping)
+		{
+			CloseHandle(file);
+			return false;
+		}
+
+		void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!view)
+		{
+			CloseHandle(mapping);
+			CloseHandle(file);
+			return false;
+		}
+
+		_file = file;
+		_mapping = mapping;
+		_data = static_cast<const uint8_t*>(view);
+		_size = static_cast<uint64_t>(size.QuadPart);
+		return true;
+	}
+
+	void mapped_file::close()
+	{
+		if (_data)
+			UnmapViewOfFile(_data);
+		if (_mapping)
+			CloseHandle(_mapping);
+		if (_file)
+			CloseHandle(_file);
+		_data = nullptr;
+		_mapping = nullptr;
+		_file = nullptr;
+		_size = 0;
+	}
+
+	void mapped_file::prefetch(uint64_t offset, uint64_t length) const
+	{
+		if (!_data || offset >= _size)
+			return;
+		if (length > _size - offset)
+			length = _size - offset;
+
+		WIN32_MEMORY_RANGE_ENTRY range = {};
+		range.VirtualAddress = const_cast<uint8_t*>(_data + offset);
+		range.NumberOfBytes = static_cast<SIZE_T>(length);
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+	}
+#else
+	bool mapped_file::open(const char* path)
+	{
+		close();
+
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat info = {};
+		if (fstat(fd, &info) != 0 || info.st_size <= 0)
+		{
+			::close(fd);
+			return false;
+		}
+
+		void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		// The mapping keeps its own reference to the file
+		::close(fd);
+		if (view == MAP_FAILED)
+			return false;
+
+		_data = static_cast<const uint8_t*>(view);
+		_size = static_cast<uint64_t>(info.st_size);
+		return true;
+	}
+
+	void mapped_file::close()
+	{
+		if (_data)
+			munmap(const_cast<uint8_t*>(_data), static_cast<size_t>(_size));
+		_data = nullptr;
+		_size = 0;
+	}
+
+	void mapped_file::prefetch(uint64_t offset, uint64_t length) const
+	{
+		if (!_data || offset >= _size)
+			return;
+		if (length > _size - offset)
+			length = _size - offset;
+
+		// madvise wants a page aligned start
+		uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+		uint64_t start = offset & ~(page - 1);
+		madvise(const_cast<uint8_t*>(_data + start), static_cast<size_t>(offset + length - start), MADV_WILLNEED);
+	}
+#endif
+
+} // namespace nakamir
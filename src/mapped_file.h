@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nakamir {
+
+	// Read-only memory mapping of a whole file. Pages are read in by the OS on
+	// first touch; prefetch asks for a range to be read in the background so a
+	// streaming consumer doesn't stall on page faults.
+	class mapped_file {
+	public:
+		mapped_file() = default;
+		~mapped_file();
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		// UTF-8 path. Returns false, leaving the object closed, on failure.
+		bool open(const char* path);
+#ifdef _WIN32
+		bool open(const wchar_t* path);
+#endif
+		void close();
+
+		bool is_open() const { return _data != nullptr; }
+		const uint8_t* data() const { return _data; }
+		uint64_t size() const { return _size; }
+
+		// Hints that [offset, offset + length) will be read soon
+		void prefetch(uint64_t offset, uint64_t length) const;
+
+	private:
+		const uint8_t* _data = nullptr;
+		uint64_t _size = 0;
+#ifdef _WIN32
+		void* _file = nullptr;
+		void* _mapping = nullptr;
+#endif
+	};
+
+} // namespace nakamir
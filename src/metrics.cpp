@@ -0,0 +1,260 @@
+#include "metrics.h"
+#include "cpu_features.h"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace nakamir {
+
+	// One thread's counters. Only the owning thread writes them, so updates
+	// are a relaxed load and store; snapshots read them from any thread.
+	struct metrics_thread_block_t {
+		struct stage_t {
+			std::atomic<uint64_t> count;
+			std::atomic<uint64_t> bytes;
+			std::atomic<uint64_t> total_us;
+			std::atomic<uint64_t> max_us;
+			std::atomic<uint64_t> buckets[metric_histogram_buckets];
+		};
+		stage_t stages[metric_stage_count];
+		bool in_use;
+	};
+
+	// Blocks are never freed, so a snapshot can walk them while threads come
+	// and go. A thread that exits hands its block, totals and all, to the next
+	// thread that registers.
+	static std::mutex _metrics_registry_mtx;
+	static std::vector<std::unique_ptr<metrics_thread_block_t>> _metrics_blocks;
+
+	static metrics_thread_block_t* metrics_register_thread()
+	{
+		std::lock_guard<std::mutex> lock(_metrics_registry_mtx);
+		for (std::unique_ptr<metrics_thread_block_t>& block : _metrics_blocks)
+		{
+			if (!block->in_use)
+			{
+				block->in_use = true;
+				return block.get();
+			}
+		}
+		_metrics_blocks.push_back(std::make_unique<metrics_thread_block_t>());
+		_metrics_blocks.back()->in_use = true;
+		return _metrics_blocks.back().get();
+	}
+
+	struct metrics_thread_handle_t {
+		metrics_thread_block_t* block = nullptr;
+		~metrics_thread_handle_t()
+		{
+			if (block)
+			{
+				std::lock_guard<std::mutex> lock(_metrics_registry_mtx);
+				block->in_use = false;
+			}
+		}
+	};
+	static thread_local metrics_thread_handle_t _metrics_thread;
+
+	static int32_t metrics_bucket_of(uint64_t us)
+	{
+		if (us < 8)
+			return static_cast<int32_t>(us);
+		uint32_t exponent = bit_scan_reverse64(us);
+		uint32_t sub = static_cast<uint32_t>(us >> (exponent - 3)) & 7;
+		int32_t bucket = static_cast<int32_t>(8 + (exponent - 3) * 8 + sub);
+		return bucket < metric_histogram_buckets ? bucket : metric_histogram_buckets - 1;
+	}
+
+	// Exclusive upper end of a bucket's range
+	static double metrics_bucket_limit(int32_t bucket)
+	{
+		if (bucket < 8)
+			return bucket + 1.0;
+		int32_t exponent = (bucket - 8) / 8 + 3;
+		int32_t sub = (bucket - 8) % 8;
+		return static_cast<double>(static_cast<uint64_t>(9 + sub) << (exponent - 3));
+	}
+
+	static void metrics_add(std::atomic<uint64_t>& counter, uint64_t value)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	uint64_t metrics_now_us()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	void metrics_record(metric_stage_ stage, uint64_t latency_us, uint64_t bytes)
+	{
+		if (stage < 0 || stage >= metric_stage_count)
+			return;
+		if (!_metrics_thread.block)
+			_metrics_thread.block = metrics_register_thread();
+
+		metrics_thread_block_t::stage_t& counters = _metrics_thread.block->stages[stage];
+		metrics_add(counters.count, 1);
+		metrics_add(counters.bytes, bytes);
+		metrics_add(counters.total_us, latency_us);
+		if (latency_us > counters.max_us.load(std::memory_order_relaxed))
+			counters.max_us.store(latency_us, std::memory_order_relaxed);
+		metrics_add(counters.buckets[metrics_bucket_of(latency_us)], 1);
+	}
+
+	void metrics_snapshot(metrics_snapshot_t* snapshot)
+	{
+		*snapshot = {};
+		snapshot->time_us = metrics_now_us();
+
+		std::lock_guard<std::mutex> lock(_metrics_registry_mtx);
+		for (const std::unique_ptr<metrics_thread_block_t>& block : _metrics_blocks)
+		{
+			for (int32_t s = 0; s < metric_stage_count; s++)
+			{
+				const metrics_thread_block_t::stage_t& counters = block->stages[s];
+				metric_stage_stats_t& stats = snapshot->stages[s];
+				stats.count += counters.count.load(std::memory_order_relaxed);
+				stats.bytes += counters.bytes.load(std::memory_order_relaxed);
+				stats.total_us += counters.total_us.load(std::memory_order_relaxed);
+				uint64_t max_us = counters.max_us.load(std::memory_order_relaxed);
+				if (max_us > stats.max_us)
+					stats.max_us = max_us;
+				for (int32_t b = 0; b < metric_histogram_buckets; b++)
+					stats.buckets[b] += counters.buckets[b].load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void metrics_delta(const metrics_snapshot_t& from, const metrics_snapshot_t& to, metrics_snapshot_t* delta)
+	{
+		delta->time_us = to.time_us - from.time_us;
+		for (int32_t s = 0; s < metric_stage_count; s++)
+		{
+			const metric_stage_stats_t& a = from.stages[s];
+			const metric_stage_stats_t& b = to.stages[s];
+			metric_stage_stats_t& d = delta->stages[s];
+			d.count = b.count - a.count;
+			d.bytes = b.bytes - a.bytes;
+			d.total_us = b.total_us - a.total_us;
+			d.max_us = b.max_us;
+			for (int32_t i = 0; i < metric_histogram_buckets; i++)
+				d.buckets[i] = b.buckets[i] - a.buckets[i];
+		}
+	}
+
+	double metrics_percentile_us(const metric_stage_stats_t& stats, double fraction)
+	{
+		// The buckets are read one by one while being written, so go by their own
+		// total rather than count
+		uint64_t total = 0;
+		for (int32_t b = 0; b < metric_histogram_buckets; b++)
+			total += stats.buckets[b];
+		if (total == 0)
+			return 0;
+
+		uint64_t rank = static_cast<uint64_t>(fraction * total + 0.5);
+		if (rank < 1) rank = 1;
+		if (rank > total) rank = total;
+		int32_t bucket = 0;
+		for (uint64_t seen = 0; bucket < metric_histogram_buckets - 1; bucket++)
+		{
+			seen += stats.buckets[bucket];
+			if (seen >= rank)
+				break;
+		}
+		// The last bucket also holds everything past its range, so only the
+		// max bounds it
+		if (bucket == metric_histogram_buckets - 1 && stats.max_us)
+			return static_cast<double>(stats.max_us);
+		// Nothing was slower than the max, which tightens the top buckets
+		double limit = metrics_bucket_limit(bucket);
+		return stats.max_us && limit > stats.max_us ? static_cast<double>(stats.max_us) : limit;
+	}
+
+	void metrics_summarize(const metric_stage_stats_t& stats, double seconds, metric_stage_summary_t* summary)
+	{
+		*summary = {};
+		summary->count = stats.count;
+		summary->bytes = stats.bytes;
+		if (seconds > 0)
+		{
+			summary->per_second = stats.count / seconds;
+			summary->bytes_per_second = stats.bytes / seconds;
+		}
+		if (stats.count)
+			summary->mean_us = static_cast<double>(stats.total_us) / stats.count;
+		summary->p50_us = metrics_percentile_us(stats, 0.5);
+		summary->p99_us = metrics_percentile_us(stats, 0.99);
+		summary->p999_us = metrics_percentile_us(stats, 0.999);
+		summary->max_us = static_cast<double>(stats.max_us);
+	}
+
+	const char* metric_stage_name(metric_stage_ stage)
+	{
+		switch (stage)
+		{
+		case metric_stage_capture: return "capture";
+		case metric_stage_encode:  return "encode";
+		case metric_stage_decode:  return "decode";
+		case metric_stage_upload:  return "upload";
+		case metric_stage_present: return "present";
+		default:                   return "unknown";
+		}
+	}
+
+	std::string metrics_to_json(const metrics_snapshot_t& snapshot, double seconds)
+	{
+		char line[512];
+		snprintf(line, sizeof(line), "{\"time_us\":%llu,\"seconds\":%.3f,\"stages\":{",
+			static_cast<unsigned long long>(snapshot.time_us), seconds);
+		std::string json = line;
+
+		for (int32_t s = 0; s < metric_stage_count; s++)
+		{
+			metric_stage_summary_t summary;
+			metrics_summarize(snapshot.stages[s], seconds, &summary);
+			snprintf(line, sizeof(line),
+				"%s\"%s\":{\"count\":%llu,\"bytes\":%llu,\"per_second\":%.3f,\"bytes_per_second\":%.1f,"
+				"\"mean_us\":%.1f,\"p50_us\":%.0f,\"p99_us\":%.0f,\"p999_us\":%.0f,\"max_us\":%.0f}",
+				s ? "," : "", metric_stage_name(static_cast<metric_stage_>(s)),
+				static_cast<unsigned long long>(summary.count), static_cast<unsigned long long>(summary.bytes),
+				summary.per_second, summary.bytes_per_second, summary.mean_us,
+				summary.p50_us, summary.p99_us, summary.p999_us, summary.max_us);
+			json += line;
+		}
+		json += "}}";
+		return json;
+	}
+
+	void metrics_latency_tracker::begin(int64_t key)
+	{
+		slot_t& slot = _slots[_next.fetch_add(1, std::memory_order_relaxed) % slot_count];
+		slot.start_us.store(metrics_now_us(), std::memory_order_relaxed);
+		slot.key.store(key, std::memory_order_release);
+	}
+
+	bool metrics_latency_tracker::end(int64_t key, uint64_t bytes)
+	{
+		if (key == empty_key)
+			return false;
+
+		uint64_t now = metrics_now_us();
+		for (slot_t& slot : _slots)
+		{
+			int64_t expected = key;
+			if (slot.key.load(std::memory_order_acquire) != key)
+				continue;
+			uint64_t start = slot.start_us.load(std::memory_order_relaxed);
+			// Claim it, unless begin reused the slot in the meantime
+			if (!slot.key.compare_exchange_strong(expected, empty_key, std::memory_order_acq_rel))
+				continue;
+			metrics_record(_stage, now > start ? now - start : 0, bytes);
+			return true;
+		}
+		return false;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace nakamir {
+
+	enum metric_stage_ {
+		metric_stage_capture,   // Reading a frame from the camera/source
+		metric_stage_encode,    // Raw frame in to encoded frame out
+		metric_stage_decode,    // Encoded frame in to decoded frame out
+		metric_stage_upload,    // Copying a frame into its texture
+		metric_stage_present,   // Decoded frame handed over to it reaching the screen
+		metric_stage_count,
+	};
+
+	// Latencies land in log-linear buckets: exact below 8us, then 8 buckets per
+	// power of two up to ~71 minutes, so a percentile overstates by at most 12.5%.
+	// Anything longer shares the last bucket, which reports the max.
+	const int32_t metric_histogram_buckets = 240;
+
+	struct metric_stage_stats_t {
+		uint64_t count;
+		uint64_t bytes;
+		uint64_t total_us;
+		uint64_t max_us;
+		uint64_t buckets[metric_histogram_buckets];
+	};
+
+	// Every stage's counters summed over all threads at one moment
+	struct metrics_snapshot_t {
+		uint64_t time_us;
+		metric_stage_stats_t stages[metric_stage_count];
+	};
+
+	struct metric_stage_summary_t {
+		uint64_t count;
+		uint64_t bytes;
+		double per_second;        // 0 when the summary isn't over an interval
+		double bytes_per_second;
+		double mean_us;
+		double p50_us;
+		double p99_us;
+		double p999_us;
+		double max_us;
+	};
+
+	// Microseconds on a monotonic clock, the time base for everything here
+	uint64_t metrics_now_us();
+
+	// Records one event for a stage. Each thread writes its own counters with
+	// plain stores (no locks or read-modify-writes), so this is cheap enough
+	// to call per frame from any thread; the first call on a thread registers it.
+	void metrics_record(metric_stage_ stage, uint64_t latency_us, uint64_t bytes = 0);
+
+	// Sums every thread's counters without stopping the writers. Counters of
+	// threads that have exited are kept.
+	void metrics_snapshot(/**[out]**/ metrics_snapshot_t* snapshot);
+	// What happened between two snapshots; max_us stays the all-time max
+	void metrics_delta(const metrics_snapshot_t& from, const metrics_snapshot_t& to, /**[out]**/ metrics_snapshot_t* delta);
+
+	// Upper end of the bucket holding the given fraction (0..1) of samples, capped at max_us
+	double metrics_percentile_us(const metric_stage_stats_t& stats, double fraction);
+	// Rates are per second over seconds, e.g. from metrics_delta; pass 0 for none
+	void metrics_summarize(const metric_stage_stats_t& stats, double seconds, /**[out]**/ metric_stage_summary_t* summary);
+	const char* metric_stage_name(metric_stage_ stage);
+
+	// {"time_us":..,"seconds":..,"stages":{"capture":{"count":..,"p99_us":..,...},...}}
+	std::string metrics_to_json(const metrics_snapshot_t& snapshot, double seconds = 0);
+
+	// Times a scope and records it on destruction
+	class metrics_scope {
+	public:
+		explicit metrics_scope(metric_stage_ stage, uint64_t bytes = 0) : _stage(stage), _bytes(bytes), _start(metrics_now_us()) {}
+		~metrics_scope() { metrics_record(_stage, metrics_now_us() - _start, _bytes); }
+		void set_bytes(uint64_t bytes) { _bytes = bytes; }
+
+	private:
+		metric_stage_ _stage;
+		uint64_t _bytes;
+		uint64_t _start;
+	};
+
+	// Measures latency across threads for stages where a frame goes in on one
+	// side and comes out the other, matched by a key such as the sample time.
+	// Lock-free; holds the last slot_count keys, older unmatched ones are lost.
+	class metrics_latency_tracker {
+	public:
+		static const int32_t slot_count = 64;
+
+		explicit metrics_latency_tracker(metric_stage_ stage) : _stage(stage) {}
+
+		void begin(int64_t key);
+		// Records the time since begin(key); false if the key isn't tracked
+		bool end(int64_t key, uint64_t bytes = 0);
+
+	private:
+		static const int64_t empty_key = INT64_MIN;
+
+		struct slot_t {
+			std::atomic<int64_t> key = empty_key;
+			std::atomic<uint64_t> start_us = 0;
+		};
+
+		metric_stage_ _stage;
+		std::atomic<uint32_t> _next = 0;
+		slot_t _slots[slot_count];
+	};
+
+} // namespace nakamir
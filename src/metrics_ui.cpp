@@ -0,0 +1,39 @@
+#include "metrics_ui.h"
+#include <stereokit_ui.h>
+#include <format>
+
+namespace nakamir {
+
+	static metrics_snapshot_t _metrics_ui_last = {};
+	static metrics_snapshot_t _metrics_ui_interval = {};
+	static double _metrics_ui_seconds = 0;
+
+	void metrics_ui_window(pose_t* pose)
+	{
+		// Snapshots are ~10KB each, so they live in statics rather than on the stack
+		static metrics_snapshot_t now;
+		metrics_snapshot(&now);
+		if (_metrics_ui_last.time_us == 0)
+			_metrics_ui_last = now;
+		else if (now.time_us - _metrics_ui_last.time_us >= 1000000)
+		{
+			metrics_delta(_metrics_ui_last, now, &_metrics_ui_interval);
+			_metrics_ui_seconds = _metrics_ui_interval.time_us / 1000000.0;
+			_metrics_ui_last = now;
+		}
+
+		ui_window_begin("Metrics", *pose, vec2{ 0.3f, 0 });
+		for (int32_t s = 0; s < metric_stage_count; s++)
+		{
+			metric_stage_summary_t summary;
+			metrics_summarize(_metrics_ui_interval.stages[s], _metrics_ui_seconds, &summary);
+			ui_text(std::format("{:<8} {:6.1f}/s {:7.2f} MB/s  p50 {:.0f}us  p99 {:.0f}us  p999 {:.0f}us",
+				metric_stage_name(static_cast<metric_stage_>(s)), summary.per_second, summary.bytes_per_second / (1024.0 * 1024.0),
+				summary.p50_us, summary.p99_us, summary.p999_us).c_str());
+		}
+		if (ui_button("Dump JSON"))
+			log_info(metrics_to_json(_metrics_ui_interval, _metrics_ui_seconds).c_str());
+		ui_window_end();
+	}
+
+} // namespace nakamir
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stereokit.h>
+#include "metrics.h"
+
+using namespace sk;
+
+namespace nakamir {
+
+	// Draws a window with one line per pipeline stage: rate, throughput and
+	// p50/p99/p999 latency over the last second. Call it once per frame from
+	// the render step; the numbers refresh once a second.
+	void metrics_ui_window(/**[in/out]**/ pose_t* pose);
+
+} // namespace nakamir
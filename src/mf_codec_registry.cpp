@@ -0,0 +1,283 @@
+#include "mf_codec_registry.h"
+#include "error.h"
+#include "metrics.h"
+#include <mfapi.h>
+#include <d3d11.h>
+#include <dxgi.h>
+#include <wrl/client.h>
+#include <mutex>
+#include <string>
+
+using Microsoft::WRL::ComPtr;
+
+namespace nakamir {
+
+	// Shared by every encoder and decoder the process creates; loaded from
+	// disk on first use
+	static codec_registry registry;
+	static std::once_flag registry_loaded;
+
+	static std::string mf_to_utf8(LPCWSTR text)
+	{
+		int length = WideCharToMultiByte(CP_UTF8, 0, text, -1, nullptr, 0, nullptr, nullptr);
+		if (length <= 1)
+			return std::string();
+		std::string result(static_cast<size_t>(length - 1), '\0');
+		WideCharToMultiByte(CP_UTF8, 0, text, -1, result.data(), length, nullptr, nullptr);
+		return result;
+	}
+
+	static std::string mf_guid_to_string(const GUID& guid)
+	{
+		wchar_t text[40] = {};
+		StringFromGUID2(guid, text, ARRAYSIZE(text));
+		return mf_to_utf8(text);
+	}
+
+	// What a cached ranking depends on: the OS build, as it ships the
+	// software MFTs, and the GPU driver, as it ships the hardware ones
+	static std::string mf_codec_environment()
+	{
+		std::string environment = std::format("mf={:x}", MF_VERSION);
+#ifndef WINDOWS_UWP
+		wchar_t build[32] = {};
+		DWORD size = sizeof(build);
+		DWORD revision = 0;
+		DWORD revisionSize = sizeof(revision);
+		if (SUCCEEDED(HRESULT_FROM_WIN32(RegGetValueW(HKEY_LOCAL_MACHINE, L"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion", L"CurrentBuildNumber", RRF_RT_REG_SZ, nullptr, build, &size))))
+		{
+			RegGetValueW(HKEY_LOCAL_MACHINE, L"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion", L"UBR", RRF_RT_REG_DWORD, nullptr, &revision, &revisionSize);
+			environment += std::format(" os={}.{}", mf_to_utf8(build), revision);
+		}
+#endif
+		try
+		{
+			ID3D11Device* pD3DDevice = (ID3D11Device*)backend_d3d11_get_d3d_device();
+			ComPtr<IDXGIDevice> pDXGIDevice;
+			ThrowIfFailed(pD3DDevice->QueryInterface(IID_PPV_ARGS(pDXGIDevice.GetAddressOf())));
+			ComPtr<IDXGIAdapter> pAdapter;
+			ThrowIfFailed(pDXGIDevice->GetAdapter(pAdapter.GetAddressOf()));
+			DXGI_ADAPTER_DESC desc = {};
+			ThrowIfFailed(pAdapter->GetDesc(&desc));
+			LARGE_INTEGER driver = {};
+			ThrowIfFailed(pAdapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &driver));
+			environment += std::format(" gpu={:04x}:{:04x} driver={}.{}.{}.{}", desc.VendorId, desc.DeviceId,
+				HIWORD(driver.HighPart), LOWORD(driver.HighPart), HIWORD(driver.LowPart), LOWORD(driver.LowPart));
+		}
+		catch (const std::exception& e)
+		{
+			// Without the driver version a stale ranking can't be told apart
+			environment += " gpu=unknown";
+			log_err(e.what());
+		}
+		return environment;
+	}
+
+	static void mf_codec_registry_load()
+	{
+		// %LOCALAPPDATA%\SKMediaFoundation\codec_cache.txt; without it the
+		// ranking lives for this run only
+		wchar_t folder[MAX_PATH] = {};
+		DWORD length = GetEnvironmentVariableW(L"LOCALAPPDATA", folder, MAX_PATH);
+		if (length == 0 || length >= MAX_PATH)
+			return;
+		std::wstring path = std::wstring(folder) + L"\\SKMediaFoundation";
+		CreateDirectoryW(path.c_str(), nullptr);
+		path += L"\\codec_cache.txt";
+
+		std::string environment = mf_codec_environment();
+		if (registry.load(path.c_str(), environment.c_str()))
+			log_info("Codec cache loaded");
+		else
+			log_info(std::format("No codec cache for {}", environment).c_str());
+	}
+
+	// MFTEnumEx behind codec_enumerator. Every activation object gets a
+	// candidate, in order, so a candidate's order indexes the array.
+	class mf_codec_enumerator : public codec_enumerator {
+	public:
+		mf_codec_enumerator(const GUID& category, const MFT_REGISTER_TYPE_INFO& inputType, const MFT_REGISTER_TYPE_INFO& outputType)
+			: _category(category), _inputType(inputType), _outputType(outputType) {}
+
+		bool enumerate(const char* key, std::vector<codec_candidate_t>* candidates) override
+		{
+			if (FAILED(MFTEnumEx(_category, MFT_ENUM_FLAG_HARDWARE | MFT_ENUM_FLAG_ALL | MFT_ENUM_FLAG_SORTANDFILTER, &_inputType, &_outputType, &_ppActivate, &_count)))
+				return false;
+
+			for (UINT32 i = 0; i < _count; i++)
+			{
+				codec_candidate_t candidate = {};
+				GUID clsid = {};
+				if (SUCCEEDED(_ppActivate[i]->GetGUID(MFT_TRANSFORM_CLSID_Attribute, &clsid)))
+					candidate.id = mf_guid_to_string(clsid);
+
+				LPWSTR pszName = nullptr;
+				UINT32 pszLength;
+				if (SUCCEEDED(_ppActivate[i]->GetAllocatedString(MFT_FRIENDLY_NAME_Attribute, &pszName, &pszLength)) && pszName)
+				{
+					candidate.name = mf_to_utf8(pszName);
+					CoTaskMemFree(pszName);
+				}
+
+				UINT32 flags = 0;
+				_ppActivate[i]->GetUINT32(MF_TRANSFORM_FLAGS_Attribute, &flags);
+				candidate.flags = ((flags & MFT_ENUM_FLAG_HARDWARE) ? codec_flag_hardware : 0) | ((flags & MFT_ENUM_FLAG_ASYNCMFT) ? codec_flag_async : 0);
+				candidates->push_back(std::move(candidate));
+			}
+			return true;
+		}
+
+		IMFActivate** activate_objects() const { return _ppActivate; }
+		UINT32 count() const { return _count; }
+
+	private:
+		GUID _category;
+		MFT_REGISTER_TYPE_INFO _inputType;
+		MFT_REGISTER_TYPE_INFO _outputType;
+		IMFActivate** _ppActivate = nullptr;
+		UINT32 _count = 0;
+	};
+
+	// Asynchronous and D3D aware are only known from the live object
+	static uint32_t mf_codec_flags(IMFTransform* pTransform)
+	{
+		ComPtr<IMFAttributes> pAttributes;
+		if (FAILED(pTransform->GetAttributes(pAttributes.GetAddressOf())))
+			return 0;
+		UINT32 async = FALSE;
+		UINT32 isD3DAware = FALSE;
+		pAttributes->GetUINT32(MF_TRANSFORM_ASYNC, &async);
+		pAttributes->GetUINT32(MF_SA_D3D_AWARE, &isD3DAware);
+		return (async ? codec_flag_async : 0) | (isD3DAware ? codec_flag_d3d_aware : 0);
+	}
+
+	// Hardware MFTs have to come from MFTEnumEx, whose activation objects tie
+	// them to the adapter; CoCreateInstance on the CLSID only suits software
+	// ones. Enumerates the hardware MFTs alone and activates the one with clsid.
+	static HRESULT mf_activate_hardware_codec(const GUID& category, const MFT_REGISTER_TYPE_INFO& inputType, const MFT_REGISTER_TYPE_INFO& outputType, const CLSID& clsid, IMFTransform** ppTransform)
+	{
+		IMFActivate** ppActivate = nullptr;
+		UINT32 count = 0;
+		HRESULT hr = MFTEnumEx(category, MFT_ENUM_FLAG_HARDWARE | MFT_ENUM_FLAG_SORTANDFILTER, &inputType, &outputType, &ppActivate, &count);
+		if (FAILED(hr))
+			return hr;
+
+		hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+		for (UINT32 i = 0; i < count; i++)
+		{
+			GUID found = {};
+			if (hr == HRESULT_FROM_WIN32(ERROR_NOT_FOUND) && SUCCEEDED(ppActivate[i]->GetGUID(MFT_TRANSFORM_CLSID_Attribute, &found)) && IsEqualGUID(found, clsid))
+				hr = ppActivate[i]->ActivateObject(IID_PPV_ARGS(ppTransform));
+			ppActivate[i]->Release();
+		}
+		CoTaskMemFree(ppActivate);
+		return hr;
+	}
+
+	// Creates the first of ranked that will without enumerating everything:
+	// software MFTs straight from their CLSID, hardware ones from a hardware
+	// only enumeration. False if none would.
+	static bool mf_create_ranked_codec(const GUID& category, const MFT_REGISTER_TYPE_INFO& inputType, const MFT_REGISTER_TYPE_INFO& outputType,
+		const std::string& key, const std::vector<codec_candidate_t>& ranked, bool isEncoder, IMFTransform** ppTransform)
+	{
+		for (const codec_candidate_t& candidate : ranked)
+		{
+			std::wstring id(candidate.id.begin(), candidate.id.end());
+			CLSID clsid = {};
+			uint64_t start = metrics_now_us();
+			HRESULT hr = CLSIDFromString(id.c_str(), &clsid);
+			if (SUCCEEDED(hr))
+			{
+				if (candidate.flags & codec_flag_hardware)
+					hr = mf_activate_hardware_codec(category, inputType, outputType, clsid, ppTransform);
+				else
+					hr = CoCreateInstance(clsid, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(ppTransform));
+			}
+			uint32_t init_us = static_cast<uint32_t>(metrics_now_us() - start);
+			if (SUCCEEDED(hr))
+			{
+				registry.record_activation(key.c_str(), candidate.id.c_str(), true, init_us, mf_codec_flags(*ppTransform));
+				registry.save();
+				log_info(std::format("Video {} from the codec cache: {} ({} us)", isEncoder ? "encoder" : "decoder", candidate.name, init_us).c_str());
+				return true;
+			}
+			registry.record_activation(key.c_str(), candidate.id.c_str(), false, init_us);
+			log_warn(std::format("Cached codec {} failed to activate with HRESULT {:08X}", candidate.name, static_cast<unsigned int>(hr)).c_str());
+		}
+		return false;
+	}
+
+	void mf_activate_video_codec(const GUID& category, const MFT_REGISTER_TYPE_INFO& inputType, const MFT_REGISTER_TYPE_INFO& outputType, IMFTransform** ppTransform, IMFActivate*** pppActivate)
+	{
+		try
+		{
+			std::call_once(registry_loaded, mf_codec_registry_load);
+
+			bool isEncoder = IsEqualGUID(category, MFT_CATEGORY_VIDEO_ENCODER);
+			std::string key = std::format("{}:{}:{}", isEncoder ? "encoder" : "decoder", mf_guid_to_string(inputType.guidSubtype), mf_guid_to_string(outputType.guidSubtype));
+			*pppActivate = nullptr;
+
+			// Straight from the ranking when there is one
+			std::vector<codec_candidate_t> ranked;
+			if (registry.candidates(key.c_str(), nullptr, &ranked))
+			{
+				if (mf_create_ranked_codec(category, inputType, outputType, key, ranked, isEncoder, ppTransform))
+					return;
+				// Nothing cached works any more; ask the system again
+				registry.invalidate(key.c_str());
+			}
+
+			mf_codec_enumerator enumerator(category, inputType, outputType);
+			bool found = registry.candidates(key.c_str(), &enumerator, &ranked);
+			*pppActivate = enumerator.activate_objects();
+			if (!found)
+			{
+				throw std::exception(isEncoder ? "No hardware encoders found! :(" : "No decoders found! :(");
+			}
+			if (!*pppActivate)
+			{
+				// Another thread enumerated the pair first and its ranking answered
+				if (mf_create_ranked_codec(category, inputType, outputType, key, ranked, isEncoder, ppTransform))
+					return;
+				throw std::exception(isEncoder ? "No encoder could be activated" : "No decoder could be activated");
+			}
+
+			log_info(isEncoder ? "ENCODERS FOUND:" : "DECODERS FOUND:");
+			for (uint32_t i = 0; i < ranked.size(); i++)
+			{
+				std::string result = "\t- ";
+				result += i == 0 ? "[" + ranked[i].name + "]" : ranked[i].name;
+				log_info(result.c_str());
+			}
+
+			// Activate the best ranked that will
+			for (const codec_candidate_t& candidate : ranked)
+			{
+				if (candidate.order >= enumerator.count())
+					continue;
+				uint64_t start = metrics_now_us();
+				HRESULT hr = (*pppActivate)[candidate.order]->ActivateObject(IID_PPV_ARGS(ppTransform));
+				uint32_t init_us = static_cast<uint32_t>(metrics_now_us() - start);
+				registry.record_activation(key.c_str(), candidate.id.c_str(), SUCCEEDED(hr), init_us, SUCCEEDED(hr) ? mf_codec_flags(*ppTransform) : 0);
+				if (SUCCEEDED(hr))
+				{
+					registry.save();
+					return;
+				}
+				log_warn(std::format("{} failed to activate with HRESULT {:08X}", candidate.name, static_cast<unsigned int>(hr)).c_str());
+			}
+			registry.save();
+			throw std::exception(isEncoder ? "No encoder could be activated" : "No decoder could be activated");
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw e;
+		}
+	}
+
+	codec_registry_stats_t mf_codec_registry_stats()
+	{
+		return registry.get_stats();
+	}
+} // namespace nakamir
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "mf_utility.h"
+#include "codec_registry.h"
+
+namespace nakamir {
+	// Activates the best MFT in category (MFT_CATEGORY_VIDEO_ENCODER or
+	// MFT_CATEGORY_VIDEO_DECODER) for the type pair. A pair seen before, this
+	// run or a previous one, is created straight from the cached ranking;
+	// only a new pair, or one whose cached candidates all fail, runs
+	// MFTEnumEx, and a cached hardware MFT only has the hardware ones
+	// enumerated to activate it through. *pppActivate gets the enumeration's activation objects for
+	// the caller to free as before, or null when the cache answered.
+	void mf_activate_video_codec(const GUID& category, const MFT_REGISTER_TYPE_INFO& inputType, const MFT_REGISTER_TYPE_INFO& outputType, /**[out]**/ IMFTransform** ppTransform, /**[out]**/ IMFActivate*** pppActivate);
+
+	// Cache hits, enumerations and failures so far, process wide
+	codec_registry_stats_t mf_codec_registry_stats();
+} // namespace nakamir
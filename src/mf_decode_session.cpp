@@ -0,0 +1,174 @@
+#include "mf_decode_session.h"
+#include "mf_video_decoder.h"
+#include "error.h"
+#include <mfapi.h>
+#include <codecapi.h>
+
+namespace nakamir {
+
+	void mf_decode_session::open(const wchar_t* filename, uint32_t presenter_frames, int64_t presenter_latency)
+	{
+		try
+		{
+			// Local MP4s skip the source resolver; anything else (URLs, other
+			// containers, fragmented files) falls back to the source reader
+			ComPtr<IMFMediaType> pInputMediaType;
+			_useMp4Source = wcsstr(filename, L"://") == nullptr && _mp4Source.open(filename);
+			if (_useMp4Source)
+			{
+				_mp4Source.get_media_type(pInputMediaType.GetAddressOf());
+				log_info(std::format("Demuxing {} samples from a mapped MP4", _mp4Source.track().samples.count()).c_str());
+			}
+			else
+			{
+				ComPtr<IMFSourceResolver> pSourceResolver;
+				ThrowIfFailed(MFCreateSourceResolver(&pSourceResolver));
+
+				MF_OBJECT_TYPE objectType = MF_OBJECT_INVALID;
+				ComPtr<IUnknown> uSource;
+				ThrowIfFailed(pSourceResolver->CreateObjectFromURL(filename, MF_RESOLUTION_MEDIASOURCE | MF_RESOLUTION_READ, NULL, &objectType, &uSource));
+
+				ComPtr<IMFMediaSource> mediaFileSource;
+				ThrowIfFailed(uSource->QueryInterface(IID_PPV_ARGS(mediaFileSource.GetAddressOf())));
+
+				ComPtr<IMFAttributes> pVideoReaderAttributes;
+				ThrowIfFailed(MFCreateAttributes(pVideoReaderAttributes.GetAddressOf(), 1));
+				ThrowIfFailed(pVideoReaderAttributes->SetUINT32(MF_READWRITE_ENABLE_HARDWARE_TRANSFORMS, TRUE));
+				ThrowIfFailed(MFCreateSourceReaderFromMediaSource(mediaFileSource.Get(), pVideoReaderAttributes.Get(), _pSourceReader.GetAddressOf()));
+				ThrowIfFailed(_pSourceReader->GetCurrentMediaType((DWORD)MF_SOURCE_READER_FIRST_VIDEO_STREAM, pInputMediaType.GetAddressOf()));
+			}
+
+			ComPtr<IMFMediaType> pOutputMediaType;
+			ThrowIfFailed(MFCreateMediaType(pOutputMediaType.GetAddressOf()));
+			ThrowIfFailed(pInputMediaType->CopyAllItems(pOutputMediaType.Get()));
+			ThrowIfFailed(pOutputMediaType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_NV12));
+			ThrowIfFailed(MFGetAttributeSize(pOutputMediaType.Get(), MF_MT_FRAME_SIZE, &_width, &_height));
+
+			// Recycles decoded frames when the decoder doesn't provide its own samples
+			mf_sample_pool_create(0, _pDecoderSamplePool.GetAddressOf());
+
+			// Size everything from the SPS when the source has it, as in mf_decode_from_url
+			h264_sps_t sps = {};
+			if (mf_h264_media_type_parameter_sets(pInputMediaType.Get(), &sps))
+			{
+				_width = sps.width;
+				_height = sps.height;
+				mf_set_h264_output_media_type(pOutputMediaType.Get(), &sps);
+				// Decoded frames also wait in the session for the presenter to take them
+				_pDecoderSamplePool->reserve(nv12_packed_size(sps.coded_width, sps.coded_height), 64, h264_sps_dpb_frames(&sps) + 2);
+			}
+
+			mf_create_mft_video_decoder(pInputMediaType.Get(), pOutputMediaType.Get(), _pDecoderTransform.GetAddressOf(), &_ppActivate);
+			ComPtr<IMFAttributes> pAttributes;
+			ThrowIfFailed(_pDecoderTransform->GetAttributes(pAttributes.GetAddressOf()));
+			ThrowIfFailed(pAttributes->SetUINT32(CODECAPI_AVDecVideoAcceleration_H264, TRUE));
+
+			_frames.resize(nv12_packed_size(_width, _height), presenter_frames);
+			_frames.set_latency(presenter_latency);
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw;
+		}
+	}
+
+	void mf_decode_session::start(session_scheduler* pScheduler)
+	{
+		try
+		{
+			ThrowIfFailed(_pDecoderTransform->ProcessMessage(MFT_MESSAGE_COMMAND_FLUSH, NULL));
+			ThrowIfFailed(_pDecoderTransform->ProcessMessage(MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, NULL));
+			ThrowIfFailed(_pDecoderTransform->ProcessMessage(MFT_MESSAGE_NOTIFY_START_OF_STREAM, NULL));
+
+			_transform = std::make_unique<mf_transform>(_pDecoderTransform.Get());
+			_session = std::make_unique<decode_session>(_transform.get(), read_sample, deliver_sample, this, _pDecoderSamplePool.Get());
+			_scheduler = pScheduler;
+			_id = _scheduler->add(decode_session::on_step, _session.get());
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw;
+		}
+	}
+
+	mailbox_frame_t* mf_decode_session::present(int64_t now)
+	{
+		mailbox_frame_t* frame = _frames.present(now);
+		// Taking a frame frees a slot, which is what a blocked session waits for
+		if (frame && _scheduler)
+			_scheduler->wake(_id);
+		return frame;
+	}
+
+	void mf_decode_session::close()
+	{
+		_frames.close();
+		if (_scheduler)
+		{
+			// An async decoder's step may be waiting on its events; shutting it
+			// down lets the step return so remove doesn't wait on it forever
+			if (_transform && _transform->is_async())
+				_transform->shutdown();
+			_scheduler->remove(_id);
+			_scheduler = nullptr;
+			_id = -1;
+		}
+
+		_session.reset();
+		_transform.reset();
+		_pSourceReader.Reset();
+		_mp4Source.close();
+		_pDecoderTransform.Reset();
+		_pDecoderSamplePool.Reset();
+
+		if (_ppActivate && *_ppActivate)
+		{
+			CoTaskMemFree(_ppActivate);
+		}
+		_ppActivate = nullptr;
+	}
+
+	media_sample* mf_decode_session::read_sample(void* context)
+	{
+		mf_decode_session* pSession = static_cast<mf_decode_session*>(context);
+		ComPtr<IMFSample> pVideoSample;
+		if (pSession->_useMp4Source)
+		{
+			if (!pSession->_mp4Source.read_sample(pVideoSample.GetAddressOf()))
+			{
+				log_info("\tEnd of stream.");
+				return nullptr;
+			}
+			return mf_media_sample::create(pVideoSample.Get());
+		}
+
+		// Stream ticks and gaps come back without a sample, so read until one does
+		while (!pVideoSample)
+		{
+			DWORD streamIndex, flags;
+			LONGLONG llSampleTime = 0;
+			ThrowIfFailed(pSession->_pSourceReader->ReadSample(MF_SOURCE_READER_FIRST_VIDEO_STREAM, 0, &streamIndex, &flags, &llSampleTime, pVideoSample.GetAddressOf()));
+			if (flags & MF_SOURCE_READERF_ENDOFSTREAM)
+			{
+				log_info("\tEnd of stream.");
+				return nullptr;
+			}
+			if (pVideoSample)
+				ThrowIfFailed(pVideoSample->SetSampleTime(llSampleTime));
+		}
+		return mf_media_sample::create(pVideoSample.Get());
+	}
+
+	bool mf_decode_session::deliver_sample(media_transform* /*transform*/, media_sample* sample, void* context)
+	{
+		// Check first, so a full presenter blocks the session rather than the worker
+		mf_decode_session* pSession = static_cast<mf_decode_session*>(context);
+		if (!pSession->_frames.can_write())
+			return false;
+		mf_presenter_queue_sample(&pSession->_frames, static_cast<mf_media_sample*>(sample)->get(), pSession->_width, pSession->_height);
+		return true;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "mf_utility.h"
+#include "mf_mp4_source.h"
+#include "mf_sample_pool.h"
+#include "decode_session.h"
+#include "frame_presenter.h"
+#include <mfidl.h>
+#include <mfreadwrite.h>
+#include <memory>
+
+namespace nakamir {
+
+	// One video, from file or URL to paced NV12 frames, decoded as a session on
+	// a shared session_scheduler rather than on a thread of its own, so that
+	// many can play side by side. The presenter is the backpressure: when it is
+	// full the session blocks, and present wakes it once a frame is taken.
+	//
+	// Local MP4s are demuxed from a mapping; anything else goes through a
+	// source reader, whose ReadSample holds up the worker while it waits on
+	// the network.
+	class mf_decode_session {
+	public:
+		mf_decode_session() = default;
+		~mf_decode_session() { close(); }
+
+		mf_decode_session(const mf_decode_session&) = delete;
+		mf_decode_session& operator=(const mf_decode_session&) = delete;
+
+		// Opens the source and creates a decoder for it. Throws on failure.
+		void open(/**[in]**/ const wchar_t* filename, uint32_t presenter_frames = 8, int64_t presenter_latency = 1000000);
+		// Starts decoding on the scheduler, which must outlive close
+		void start(/**[in]**/ session_scheduler* pScheduler);
+		// Render thread. The frame due at clock time now, or nullptr to keep
+		// showing the last one; see frame_presenter::present.
+		mailbox_frame_t* present(int64_t now);
+		// Takes the session off its scheduler and releases the decoder and source
+		void close();
+
+		UINT32 width() const { return _width; }
+		UINT32 height() const { return _height; }
+		frame_presenter_stats_t get_presenter_stats() { return _frames.get_stats(); }
+		decode_session_stats_t get_decode_stats() { return _session ? _session->get_stats() : decode_session_stats_t{}; }
+
+	private:
+		static media_sample* read_sample(void* context);
+		static bool deliver_sample(media_transform* transform, media_sample* sample, void* context);
+
+		IMFActivate** _ppActivate = nullptr;
+		ComPtr<IMFSourceReader> _pSourceReader;
+		mf_mp4_source _mp4Source;
+		bool _useMp4Source = false;
+		ComPtr<IMFTransform> _pDecoderTransform;
+		ComPtr<mf_sample_pool> _pDecoderSamplePool;
+		std::unique_ptr<mf_transform> _transform;
+		std::unique_ptr<decode_session> _session;
+		frame_presenter _frames;
+		session_scheduler* _scheduler = nullptr;
+		int32_t _id = -1;
+		UINT32 _width = 0;
+		UINT32 _height = 0;
+	};
+
+} // namespace nakamir
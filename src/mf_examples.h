@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstdint>
+
 namespace nakamir {
 	void mf_decode_from_url(/**[in]**/ const wchar_t* filename);
+	// Plays several videos at once, one panel each, decoded on a shared thread pool
+	void mf_decode_wall(/**[in]**/ const wchar_t* const* filenames, uint32_t count);
 #ifndef WINDOWS_UWP
 	void mf_roundtrip_webcam();
 #endif
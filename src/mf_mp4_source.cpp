@@ -0,0 +1,179 @@
+#include "mf_mp4_source.h"
+#include <cstring>
+
+namespace nakamir {
+
+	// Samples to keep requested from the OS ahead of the reader, about two
+	// seconds of 30fps video
+	static const size_t mp4_read_ahead_samples = 64;
+
+	static LONGLONG mf_mp4_to_hns(int64_t value, uint32_t timescale)
+	{
+		return mp4_rescale(value, timescale, 10000000);
+	}
+
+	bool mf_mp4_source::open(const wchar_t* path)
+	{
+		close();
+		if (!_demuxer.open(path))
+			return false;
+
+		// avc3 keeps its parameter sets in band, which the decoder copes with too
+		_track = _demuxer.find_track(mp4_fourcc('v', 'i', 'd', 'e'), mp4_fourcc('a', 'v', 'c', '1'));
+		if (_track < 0)
+			_track = _demuxer.find_track(mp4_fourcc('v', 'i', 'd', 'e'), mp4_fourcc('a', 'v', 'c', '3'));
+		if (_track < 0)
+		{
+			close();
+			return false;
+		}
+
+		_header = mp4_track_annexb_header(track());
+		return true;
+	}
+
+	void mf_mp4_source::close()
+	{
+		_demuxer.close();
+		_track = -1;
+		_next = 0;
+		_prefetched = 0;
+		_header.clear();
+	}
+
+	LONGLONG mf_mp4_source::duration() const
+	{
+		const mp4_track_t& t = track();
+		return mf_mp4_to_hns(t.samples.end_dts, t.timescale);
+	}
+
+	void mf_mp4_source::get_media_type(IMFMediaType** ppMediaType)
+	{
+		try
+		{
+			const mp4_track_t& t = track();
+			ComPtr<IMFMediaType> pMediaType;
+			ThrowIfFailed(MFCreateMediaType(pMediaType.GetAddressOf()));
+			ThrowIfFailed(pMediaType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video));
+			ThrowIfFailed(pMediaType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264));
+			ThrowIfFailed(pMediaType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_MixedInterlaceOrProgressive));
+			if (!_header.empty())
+				ThrowIfFailed(pMediaType->SetBlob(MF_MT_MPEG_SEQUENCE_HEADER, _header.data(), static_cast<UINT32>(_header.size())));
+
+			// The SPS is the authority on size and rate; the sample entry and the
+			// first frame's duration are what's left when it doesn't say
+			h264_sps_t sps = {};
+			uint32_t numerator = 0, denominator = 0;
+			if (h264_parse_parameter_sets(_header.data(), _header.size(), &sps))
+			{
+				ThrowIfFailed(MFSetAttributeSize(pMediaType.Get(), MF_MT_FRAME_SIZE, sps.width, sps.height));
+				ThrowIfFailed(MFSetAttributeRatio(pMediaType.Get(), MF_MT_PIXEL_ASPECT_RATIO, sps.sar_width, sps.sar_height));
+				h264_sps_frame_rate(&sps, &numerator, &denominator);
+			}
+			else
+			{
+				ThrowIfFailed(MFSetAttributeSize(pMediaType.Get(), MF_MT_FRAME_SIZE, t.width, t.height));
+			}
+			if (denominator == 0 && t.samples.count() > 1 && t.samples.dts[1] > t.samples.dts[0])
+			{
+				numerator = t.timescale;
+				denominator = static_cast<uint32_t>(t.samples.dts[1] - t.samples.dts[0]);
+			}
+			if (denominator != 0)
+				ThrowIfFailed(MFSetAttributeRatio(pMediaType.Get(), MF_MT_FRAME_RATE, numerator, denominator));
+
+			*ppMediaType = pMediaType.Detach();
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw e;
+		}
+	}
+
+	bool mf_mp4_source::read_sample(IMFSample** ppSample, sample_allocator* pAllocator)
+	{
+		try
+		{
+			const mp4_track_t& t = track();
+			mp4_sample_t sample;
+			while (_demuxer.get_sample(_track, _next, &sample))
+			{
+				_next++;
+
+				// Keep the next stretch of the file on its way in
+				if (_prefetched < _next + mp4_read_ahead_samples / 2)
+				{
+					size_t from = _prefetched > _next ? _prefetched : _next;
+					_demuxer.prefetch(_track, from, mp4_read_ahead_samples);
+					_prefetched = from + mp4_read_ahead_samples;
+				}
+
+				size_t header = sample.sync ? _header.size() : 0;
+				DWORD maxSize = static_cast<DWORD>(header + mp4_annexb_max_size(sample.size, t.nal_length_size));
+
+				ComPtr<IMFSample> pSample;
+				ComPtr<IMFMediaBuffer> pBuffer;
+				if (pAllocator)
+				{
+					transform_stream_info_t info = {};
+					info.size = maxSize;
+					info.alignment = 16;
+					// pSample holds its own reference once the wrapper's goes
+					ref_ptr<media_sample> pPooled = ref_ptr<media_sample>::attach(pAllocator->allocate(info));
+					pSample = static_cast<mf_media_sample*>(pPooled.get())->get();
+					ThrowIfFailed(pSample->GetBufferByIndex(0, pBuffer.GetAddressOf()));
+				}
+				else
+				{
+					ThrowIfFailed(MFCreateSample(pSample.GetAddressOf()));
+					ThrowIfFailed(MFCreateMemoryBuffer(maxSize, pBuffer.GetAddressOf()));
+					ThrowIfFailed(pSample->AddBuffer(pBuffer.Get()));
+				}
+
+				// The one copy: out of the mapping and into the decoder's buffer,
+				// rewriting length prefixes as start codes on the way
+				BYTE* pData = nullptr;
+				ThrowIfFailed(pBuffer->Lock(&pData, nullptr, nullptr));
+				if (header)
+					memcpy(pData, _header.data(), header);
+				size_t written = mp4_avcc_to_annexb(sample.data, sample.size, t.nal_length_size, pData + header);
+				ThrowIfFailed(pBuffer->Unlock());
+				if (written == 0)
+				{
+					log_warn(std::format("Skipping malformed MP4 sample {}", _next - 1).c_str());
+					continue;
+				}
+				ThrowIfFailed(pBuffer->SetCurrentLength(static_cast<DWORD>(header + written)));
+
+				ThrowIfFailed(pSample->SetSampleTime(mf_mp4_to_hns(sample.pts, t.timescale)));
+				ThrowIfFailed(pSample->SetSampleDuration(mf_mp4_to_hns(sample.duration, t.timescale)));
+				ThrowIfFailed(pSample->SetUINT32(MFSampleExtension_CleanPoint, sample.sync ? TRUE : FALSE));
+
+				*ppSample = pSample.Detach();
+				return true;
+			}
+			return false;
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw e;
+		}
+	}
+
+	LONGLONG mf_mp4_source::seek(LONGLONG time)
+	{
+		const mp4_track_t& t = track();
+		int64_t pts = mp4_rescale(time, 10000000, t.timescale);
+		size_t target = _demuxer.find_sample(_track, pts);
+		_next = _demuxer.find_sync_sample(_track, pts);
+		_prefetched = _next;
+
+		mp4_sample_t sample;
+		if (!_demuxer.get_sample(_track, target, &sample))
+			return time;
+		return mf_mp4_to_hns(sample.pts, t.timescale);
+	}
+
+} // namespace nakamir
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "mf_utility.h"
+#include "mp4_demux.h"
+#include <mfidl.h>
+#include <vector>
+
+namespace nakamir {
+
+	// Feeds the H.264 track of a local MP4 to a decoder straight from a memory
+	// mapped file, in place of IMFSourceReader. Samples come out in decode order
+	// as Annex-B, with times in 100ns units, and the file is read ahead of the
+	// caller so a paced reader doesn't wait on disk.
+	class mf_mp4_source {
+	public:
+		// False if the file can't be mapped or has no H.264 video track
+		bool open(/**[in]**/ const wchar_t* path);
+		void close();
+
+		// H.264 input type for the decoder, parameter sets included as
+		// MF_MT_MPEG_SEQUENCE_HEADER
+		void get_media_type(/**[out]**/ IMFMediaType** ppMediaType);
+
+		// Next sample, with the SPS/PPS in front of sync samples so the decoder
+		// can start on any of them. Returns false at the end of the track.
+		// pAllocator is optional, e.g. an mf_sample_pool.
+		bool read_sample(/**[out]**/ IMFSample** ppSample, /**[in]**/ sample_allocator* pAllocator = nullptr);
+
+		// Moves to the sync sample before time, in 100ns units. Returns the
+		// presentation time of the frame actually asked for: decoded frames
+		// before it are only there to build references and should be dropped.
+		LONGLONG seek(LONGLONG time);
+
+		const mp4_track_t& track() const { return _demuxer.tracks()[_track]; }
+		LONGLONG duration() const;
+
+	private:
+		mp4_demuxer _demuxer;
+		int32_t _track = -1;
+		size_t _next = 0;
+		size_t _prefetched = 0;
+		std::vector<uint8_t> _header;
+	};
+
+} // namespace nakamir
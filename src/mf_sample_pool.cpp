@@ -0,0 +1,164 @@
+#include "mf_sample_pool.h"
+#include "error.h"
+#include <mferror.h>
+#include <utility>
+
+using Microsoft::WRL::Make;
+using Microsoft::WRL::RuntimeClass;
+using Microsoft::WRL::RuntimeClassFlags;
+using Microsoft::WRL::ClassicCom;
+
+namespace nakamir {
+
+	// The wrapper the pipeline sees. It lives as long as its slot and is revived
+	// instead of reallocated; dropping its last reference lets go of the IMFSample
+	// so the tracked sample can report back to the pool.
+	class mf_pooled_sample final : public mf_media_sample {
+	public:
+		mf_pooled_sample() : mf_media_sample(nullptr) { _refs = 0; }
+
+		void revive(ComPtr<IMFSample>&& pSample)
+		{
+			_sample = std::move(pSample);
+			_refs = 1;
+		}
+
+		uint32_t release() override
+		{
+			uint32_t refs = --_refs;
+			if (refs == 0)
+			{
+				_buffer.attach(nullptr);
+				_sample.Reset();
+			}
+			return refs;
+		}
+	};
+
+	// IMFMediaBuffer over a frame_pool block. It also owns everything else that
+	// stays with the block between uses, and is the block's user payload.
+	class mf_pool_buffer : public RuntimeClass<RuntimeClassFlags<ClassicCom>, IMFMediaBuffer> {
+	public:
+		explicit mf_pool_buffer(frame_block_t* block) : block(block) {}
+
+		static void destroy(void* user)
+		{
+			mf_pool_buffer* slot = static_cast<mf_pool_buffer*>(user);
+			// The idle sample holds the buffer and the buffer holds the idle sample
+			slot->idleSample.Reset();
+			slot->Release();
+		}
+
+		STDMETHODIMP Lock(BYTE** ppbBuffer, DWORD* pcbMaxLength, DWORD* pcbCurrentLength) override
+		{
+			if (!ppbBuffer) return E_POINTER;
+			*ppbBuffer = block->data;
+			if (pcbMaxLength) *pcbMaxLength = static_cast<DWORD>(block->capacity);
+			if (pcbCurrentLength) *pcbCurrentLength = currentLength;
+			return S_OK;
+		}
+		STDMETHODIMP Unlock() override { return S_OK; }
+		STDMETHODIMP GetCurrentLength(DWORD* pcbCurrentLength) override
+		{
+			if (!pcbCurrentLength) return E_POINTER;
+			*pcbCurrentLength = currentLength;
+			return S_OK;
+		}
+		STDMETHODIMP SetCurrentLength(DWORD cbCurrentLength) override
+		{
+			if (cbCurrentLength > block->capacity) return E_INVALIDARG;
+			currentLength = cbCurrentLength;
+			return S_OK;
+		}
+		STDMETHODIMP GetMaxLength(DWORD* pcbMaxLength) override
+		{
+			if (!pcbMaxLength) return E_POINTER;
+			*pcbMaxLength = static_cast<DWORD>(block->capacity);
+			return S_OK;
+		}
+
+		frame_block_t* block;
+		DWORD currentLength = 0;
+		ComPtr<IMFSample> idleSample; // Held only while the block sits in the pool
+		mf_pooled_sample wrapper;
+	};
+
+	void mf_sample_pool_create(size_t max_pooled_bytes, mf_sample_pool** ppPool)
+	{
+		ComPtr<mf_sample_pool> pPool = Make<mf_sample_pool>(max_pooled_bytes);
+		if (!pPool) ThrowIfFailed(E_OUTOFMEMORY);
+		*ppPool = pPool.Detach();
+	}
+
+	media_sample* mf_sample_pool::allocate(const transform_stream_info_t& info)
+	{
+		frame_block_t* block = _pool.acquire(info.size, info.alignment);
+		mf_pool_buffer* slot = static_cast<mf_pool_buffer*>(block->user);
+
+		try
+		{
+			if (!slot)
+			{
+				ComPtr<mf_pool_buffer> pBuffer = Make<mf_pool_buffer>(block);
+				if (!pBuffer) ThrowIfFailed(E_OUTOFMEMORY);
+
+				ComPtr<IMFTrackedSample> pTrackedSample;
+				ThrowIfFailed(MFCreateTrackedSample(pTrackedSample.GetAddressOf()));
+				ThrowIfFailed(pTrackedSample.As(&pBuffer->idleSample));
+				ThrowIfFailed(pBuffer->idleSample->AddBuffer(pBuffer.Get()));
+
+				slot = pBuffer.Detach();
+				block->user = slot;
+				block->user_destroy = mf_pool_buffer::destroy;
+			}
+
+			ComPtr<IMFSample> pSample = std::move(slot->idleSample);
+			slot->currentLength = 0;
+
+			// Don't leak flags like MFSampleExtension_CleanPoint into the next frame
+			ThrowIfFailed(pSample->DeleteAllItems());
+
+			// Arms a single callback for when the sample is next fully released
+			ComPtr<IMFTrackedSample> pTrackedSample;
+			ThrowIfFailed(pSample.As(&pTrackedSample));
+			ThrowIfFailed(pTrackedSample->SetAllocator(this, static_cast<IMFMediaBuffer*>(slot)));
+
+			slot->wrapper.revive(std::move(pSample));
+			return &slot->wrapper;
+		}
+		catch (...)
+		{
+			_pool.release(block);
+			throw;
+		}
+	}
+
+	STDMETHODIMP mf_sample_pool::GetParameters(DWORD* pdwFlags, DWORD* pdwQueue)
+	{
+		// Use the default work queue
+		return E_NOTIMPL;
+	}
+
+	STDMETHODIMP mf_sample_pool::Invoke(IMFAsyncResult* pAsyncResult)
+	{
+		ComPtr<IUnknown> pState;
+		ComPtr<IUnknown> pObject;
+		HRESULT hr = pAsyncResult->GetState(pState.GetAddressOf());
+		if (SUCCEEDED(hr))
+			hr = pAsyncResult->GetObject(pObject.GetAddressOf());
+		if (FAILED(hr))
+			return hr;
+
+		ComPtr<IMFMediaBuffer> pBuffer;
+		ComPtr<IMFSample> pSample;
+		if (FAILED(pState.As(&pBuffer)) || FAILED(pObject.As(&pSample)))
+			return E_UNEXPECTED;
+
+		// The sample comes back to us with a fresh reference, park it with its block
+		mf_pool_buffer* slot = static_cast<mf_pool_buffer*>(pBuffer.Get());
+		slot->idleSample = pSample;
+		_pool.release(slot->block);
+		return S_OK;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "frame_pool.h"
+#include "mf_transform.h"
+#include <mfapi.h>
+#include <mfidl.h>
+#include <wrl/client.h>
+#include <wrl/implements.h>
+
+using Microsoft::WRL::ComPtr;
+
+namespace nakamir {
+
+	// sample_allocator handing out IMFTrackedSamples whose single buffer lives in a
+	// frame_pool block. When the last reference to a sample is released (wherever
+	// that happens, e.g. inside a decoder that queued it as input), MF invokes us
+	// and the block, with its sample and buffer still attached, goes back into the
+	// pool. Streaming at a steady frame size therefore allocates nothing per frame.
+	// Every outstanding sample holds a reference to the pool.
+	class mf_sample_pool : public Microsoft::WRL::RuntimeClass<Microsoft::WRL::RuntimeClassFlags<Microsoft::WRL::ClassicCom>, IMFAsyncCallback>, public sample_allocator {
+	public:
+		// max_pooled_bytes bounds idle memory kept around, 0 for unbounded
+		explicit mf_sample_pool(size_t max_pooled_bytes = 0) : _pool(max_pooled_bytes) {}
+
+		media_sample* allocate(const transform_stream_info_t& info) override;
+		// Pre-allocates blocks, e.g. a decoder's DPB worth once the SPS is known.
+		// The IMFSample for each is still created on its first use.
+		void reserve(size_t size, size_t alignment, size_t count) { _pool.reserve(size, alignment, count); }
+		frame_pool_stats_t get_stats() { return _pool.get_stats(); }
+		void trim() { _pool.trim(); }
+
+		// IMFAsyncCallback
+		STDMETHODIMP GetParameters(/**[out]**/ DWORD* pdwFlags, /**[out]**/ DWORD* pdwQueue) override;
+		STDMETHODIMP Invoke(/**[in]**/ IMFAsyncResult* pAsyncResult) override;
+
+	private:
+		frame_pool _pool;
+	};
+
+	void mf_sample_pool_create(size_t max_pooled_bytes, /**[out]**/ mf_sample_pool** ppPool);
+
+} // namespace nakamir
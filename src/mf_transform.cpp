@@ -0,0 +1,228 @@
+#include "mf_transform.h"
+#include "error.h"
+#include <mferror.h>
+#include <mfidl.h>
+
+namespace nakamir {
+
+	uint8_t* mf_media_buffer::lock(size_t* max_length, size_t* current_length)
+	{
+		BYTE* pData = nullptr;
+		DWORD maxLength = 0, currentLength = 0;
+		ThrowIfFailed(_buffer->Lock(&pData, &maxLength, &currentLength));
+		if (max_length) *max_length = maxLength;
+		if (current_length) *current_length = currentLength;
+		return pData;
+	}
+
+	void mf_media_buffer::unlock()
+	{
+		ThrowIfFailed(_buffer->Unlock());
+	}
+
+	size_t mf_media_buffer::get_max_length()
+	{
+		DWORD maxLength = 0;
+		ThrowIfFailed(_buffer->GetMaxLength(&maxLength));
+		return maxLength;
+	}
+
+	size_t mf_media_buffer::get_current_length()
+	{
+		DWORD currentLength = 0;
+		ThrowIfFailed(_buffer->GetCurrentLength(&currentLength));
+		return currentLength;
+	}
+
+	void mf_media_buffer::set_current_length(size_t length)
+	{
+		ThrowIfFailed(_buffer->SetCurrentLength(static_cast<DWORD>(length)));
+	}
+
+	mf_media_sample* mf_media_sample::create(IMFSample* pSample)
+	{
+		return new mf_media_sample(pSample);
+	}
+
+	uint32_t mf_media_sample::add_ref()
+	{
+		return ++_refs;
+	}
+
+	uint32_t mf_media_sample::release()
+	{
+		uint32_t refs = --_refs;
+		if (refs == 0) delete this;
+		return refs;
+	}
+
+	media_buffer* mf_media_sample::get_buffer()
+	{
+		if (!_buffer.get())
+		{
+			// Our transforms only accept a single buffer per sample
+			ComPtr<IMFMediaBuffer> pBuffer;
+			ThrowIfFailed(_sample->GetBufferByIndex(0, pBuffer.GetAddressOf()));
+			_buffer.attach(pBuffer.Get());
+		}
+		return &_buffer;
+	}
+
+	int64_t mf_media_sample::get_sample_time()
+	{
+		LONGLONG time = 0;
+		ThrowIfFailed(_sample->GetSampleTime(&time));
+		return time;
+	}
+
+	void mf_media_sample::set_sample_time(int64_t time)
+	{
+		ThrowIfFailed(_sample->SetSampleTime(time));
+	}
+
+	int64_t mf_media_sample::get_sample_duration()
+	{
+		LONGLONG duration = 0;
+		ThrowIfFailed(_sample->GetSampleDuration(&duration));
+		return duration;
+	}
+
+	void mf_media_sample::set_sample_duration(int64_t duration)
+	{
+		ThrowIfFailed(_sample->SetSampleDuration(duration));
+	}
+
+	mf_transform::mf_transform(IMFTransform* pTransform) : _transform(pTransform)
+	{
+		// Only asynchronous MFTs expose an event generator
+		_transform.As(&_eventGen);
+	}
+
+	transform_stream_info_t mf_transform::get_output_stream_info()
+	{
+		MFT_OUTPUT_STREAM_INFO StreamInfo = {};
+		ThrowIfFailed(_transform->GetOutputStreamInfo(0, &StreamInfo));
+
+		transform_stream_info_t info = {};
+		info.flags = (StreamInfo.dwFlags & MFT_OUTPUT_STREAM_PROVIDES_SAMPLES) ? transform_stream_flags_provides_samples : transform_stream_flags_none;
+		info.size = StreamInfo.cbSize;
+		// MF reports alignment as one less than a power of two, e.g. MF_16_BYTE_ALIGNMENT
+		info.alignment = StreamInfo.cbAlignment + 1;
+		return info;
+	}
+
+	transform_status_ mf_transform::process_input(media_sample* sample)
+	{
+		HRESULT hr = _transform->ProcessInput(0, static_cast<mf_media_sample*>(sample)->get(), 0);
+		if (hr == MF_E_NOTACCEPTING)
+			return transform_status_not_accepting;
+		ThrowIfFailed(hr);
+		return transform_status_ok;
+	}
+
+	transform_status_ mf_transform::process_output(media_sample* output, media_sample** ppResult)
+	{
+		*ppResult = nullptr;
+
+		MFT_OUTPUT_DATA_BUFFER outputDataBuffer = {};
+		outputDataBuffer.dwStreamID = 0;
+		outputDataBuffer.pSample = output ? static_cast<mf_media_sample*>(output)->get() : NULL;
+
+		DWORD mftProcessStatus = 0;
+		HRESULT hr = _transform->ProcessOutput(0, 1, &outputDataBuffer, &mftProcessStatus);
+
+		if (outputDataBuffer.pEvents)
+			outputDataBuffer.pEvents->Release();
+
+		// Release the sample the MFT allocated if we didn't hand it one
+		ComPtr<IMFSample> pProvidedSample;
+		if (!output && outputDataBuffer.pSample)
+			pProvidedSample.Attach(outputDataBuffer.pSample);
+
+		if (hr == MF_E_TRANSFORM_NEED_MORE_INPUT)
+			return transform_status_need_more_input;
+		if (hr == MF_E_TRANSFORM_STREAM_CHANGE)
+			return transform_status_stream_change;
+		ThrowIfFailed(hr);
+
+		if (output)
+		{
+			output->add_ref();
+			*ppResult = output;
+		}
+		else
+		{
+			*ppResult = mf_media_sample::create(pProvidedSample.Get());
+		}
+		return transform_status_ok;
+	}
+
+	void mf_transform::renegotiate_output_type()
+	{
+		// Get the new media type for the stream
+		ComPtr<IMFMediaType> pNewMediaType;
+		ThrowIfFailed(_transform->GetOutputAvailableType(0, 0, pNewMediaType.GetAddressOf()));
+		ThrowIfFailed(_transform->SetOutputType(0, pNewMediaType.Get(), 0));
+	}
+
+	void mf_transform::flush()
+	{
+		ThrowIfFailed(_transform->ProcessMessage(MFT_MESSAGE_COMMAND_FLUSH, 0));
+	}
+
+	void mf_transform::drain()
+	{
+		ThrowIfFailed(_transform->ProcessMessage(MFT_MESSAGE_COMMAND_DRAIN, 0));
+	}
+
+	bool mf_transform::is_async()
+	{
+		return _eventGen != nullptr;
+	}
+
+	transform_event_ mf_transform::get_event(bool wait)
+	{
+		if (!_eventGen)
+			return transform_event_none;
+
+		ComPtr<IMFMediaEvent> pEvent;
+		HRESULT hr = _eventGen->GetEvent(wait ? 0 : MF_EVENT_FLAG_NO_WAIT, pEvent.GetAddressOf());
+		if ((!wait && FAILED(hr)) || hr == MF_E_SHUTDOWN)
+			return transform_event_none;
+		ThrowIfFailed(hr);
+
+		MediaEventType eventType;
+		ThrowIfFailed(pEvent->GetType(&eventType));
+
+		switch (eventType)
+		{
+		case METransformNeedInput: return transform_event_need_input;
+		case METransformHaveOutput: return transform_event_have_output;
+		case METransformDrainComplete: return transform_event_drain_complete;
+		default: return transform_event_none;
+		}
+	}
+
+	void mf_transform::shutdown()
+	{
+		// Async MFTs must implement IMFShutdown, which also releases a thread
+		// blocked in GetEvent with MF_E_SHUTDOWN
+		ComPtr<IMFShutdown> pShutdown;
+		if (SUCCEEDED(_transform.As(&pShutdown)))
+			pShutdown->Shutdown();
+	}
+
+	media_sample* mf_transform::create_output_sample(const transform_stream_info_t& info)
+	{
+		ComPtr<IMFSample> pOutSample;
+		ThrowIfFailed(MFCreateSample(pOutSample.GetAddressOf()));
+
+		ComPtr<IMFMediaBuffer> pBuffer;
+		// MF takes alignment as one less than a power of two
+		ThrowIfFailed(MFCreateAlignedMemoryBuffer(info.size, info.alignment ? info.alignment - 1 : 0, pBuffer.GetAddressOf()));
+		ThrowIfFailed(pOutSample->AddBuffer(pBuffer.Get()));
+
+		return mf_media_sample::create(pOutSample.Get());
+	}
+
+} // namespace nakamir
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "transform.h"
+#include <mfapi.h>
+#include <mftransform.h>
+#include <wrl/client.h>
+
+using Microsoft::WRL::ComPtr;
+
+namespace nakamir {
+
+	// media_buffer backed by an IMFMediaBuffer
+	class mf_media_buffer final : public media_buffer {
+	public:
+		void attach(IMFMediaBuffer* pBuffer) { _buffer = pBuffer; }
+		IMFMediaBuffer* get() const { return _buffer.Get(); }
+
+		uint8_t* lock(size_t* max_length, size_t* current_length) override;
+		void unlock() override;
+		size_t get_max_length() override;
+		size_t get_current_length() override;
+		void set_current_length(size_t length) override;
+
+	private:
+		ComPtr<IMFMediaBuffer> _buffer;
+	};
+
+	// media_sample backed by an IMFSample. The wrapper holds one reference to the
+	// IMFSample for as long as it lives.
+	class mf_media_sample : public media_sample {
+	public:
+		// Starts with a refcount of one
+		static mf_media_sample* create(/**[in]**/ IMFSample* pSample);
+		IMFSample* get() const { return _sample.Get(); }
+
+		uint32_t add_ref() override;
+		uint32_t release() override;
+		media_buffer* get_buffer() override;
+		int64_t get_sample_time() override;
+		void set_sample_time(int64_t time) override;
+		int64_t get_sample_duration() override;
+		void set_sample_duration(int64_t duration) override;
+
+	protected:
+		explicit mf_media_sample(IMFSample* pSample) : _sample(pSample) {}
+
+		std::atomic<uint32_t> _refs = 1;
+		ComPtr<IMFSample> _sample;
+		mf_media_buffer _buffer;
+	};
+
+	// media_transform backed by an IMFTransform, used by the mf_* helpers in
+	// mf_utility.h so the pump logic is shared with the portable backends
+	class mf_transform final : public media_transform {
+	public:
+		explicit mf_transform(/**[in]**/ IMFTransform* pTransform);
+		IMFTransform* get() const { return _transform.Get(); }
+
+		transform_stream_info_t get_output_stream_info() override;
+		transform_status_ process_input(media_sample* sample) override;
+		transform_status_ process_output(media_sample* output, media_sample** ppResult) override;
+		void renegotiate_output_type() override;
+		void flush() override;
+		void drain() override;
+		bool is_async() override;
+		transform_event_ get_event(bool wait) override;
+		void shutdown() override;
+		media_sample* create_output_sample(const transform_stream_info_t& info) override;
+
+	private:
+		ComPtr<IMFTransform> _transform;
+		ComPtr<IMFMediaEventGenerator> _eventGen;
+	};
+
+} // namespace nakamir
@@ -1,11 +1,26 @@
 #pragma once
 
 #include "error.h"
+#include "mf_transform.h"
+#include "mf_sample_pool.h"
+#include "transform_driver.h"
+#include "frame_mailbox.h"
+#include "frame_presenter.h"
+#include "plane_copy.h"
+#include "nv12_convert.h"
+#include "h264_nal.h"
+#include "h264_sps.h"
+#include "mp4_demux.h"
+#include "mp4_recorder.h"
+#include "rtp_h264.h"
+#include "udp_socket.h"
+#include "sim_channel.h"
 #include <mfapi.h>
 #include <mferror.h>
 #include <mftransform.h>
 #include <wrl/client.h>
 #include <format>
+#include <vector>
 #include <stereokit.h>
 
 using namespace sk;
@@ -73,115 +88,355 @@ namespace nakamir {
 		}
 	}
 
-	static void mf_process_output(/**[in]**/ IMFTransform* pTransform, /**[in]**/ void(*onReceiveBuffer)(IMFTransform*, IMFSample*, void*) = nullptr, /**[in]**/ void* pContext = nullptr)
+	// Converts a 32 bit RGB image straight into a new NV12 sample for the encoder,
+	// in the packed layout (see nv12_packed_stride) the encoder's input type
+	// describes. The matrix/range should match the MF_MT_YUV_MATRIX and
+	// MF_MT_VIDEO_NOMINAL_RANGE given to the encoder (mf_set_default_media_type
+	// uses limited range). pAllocator is optional, e.g. an mf_sample_pool.
+	static void mf_create_sample_from_rgb(const unsigned char* rgb, int stride, int width, int height, rgb_format_ format,
+		long long sample_duration, long long sample_time, /**[out]**/ IMFSample** ppSample,
+		color_matrix_ matrix = color_matrix_bt601, color_range_ range = color_range_limited, sample_allocator* pAllocator = nullptr)
 	{
-		HRESULT mftProcessOutput = S_OK;
+		try
+		{
+			int32_t nv12_stride = nv12_packed_stride(width);
+			DWORD nv12_size = static_cast<DWORD>(nv12_packed_size(width, height));
 
-		MFT_OUTPUT_STREAM_INFO StreamInfo = {};
-		ThrowIfFailed(pTransform->GetOutputStreamInfo(0, &StreamInfo));
+			ComPtr<IMFMediaBuffer> pBuffer;
+			if (pAllocator)
+			{
+				transform_stream_info_t info = {};
+				info.size = nv12_size;
+				info.alignment = 16;
+				// Our own reference keeps the IMFSample once the wrapper's goes;
+				// the pool gets it back when the encoder lets go of it
+				ref_ptr<media_sample> pPooled = ref_ptr<media_sample>::attach(pAllocator->allocate(info));
+				mf_media_sample* pMfSample = static_cast<mf_media_sample*>(pPooled.get());
+				*ppSample = pMfSample->get();
+				(*ppSample)->AddRef();
+				ThrowIfFailed((*ppSample)->GetBufferByIndex(0, pBuffer.GetAddressOf()));
+			}
+			else
+			{
+				ThrowIfFailed(MFCreateSample(ppSample));
+				ThrowIfFailed(MFCreateAlignedMemoryBuffer(nv12_size, MF_16_BYTE_ALIGNMENT, pBuffer.GetAddressOf()));
+				ThrowIfFailed((*ppSample)->AddBuffer(pBuffer.Get()));
+			}
 
-		MFT_OUTPUT_DATA_BUFFER outputDataBuffer = {};
-		outputDataBuffer.dwStreamID = 0;
-		outputDataBuffer.dwStatus = 0;
-		outputDataBuffer.pEvents = NULL;
-		outputDataBuffer.pSample = NULL;
+			BYTE* pData = nullptr;
+			ThrowIfFailed(pBuffer->Lock(&pData, nullptr, nullptr));
+			rgb_to_nv12(pData, nv12_stride, pData + static_cast<size_t>(nv12_stride) * height, nv12_stride,
+				rgb, stride, width, height, format, matrix, range);
+			ThrowIfFailed(pBuffer->Unlock());
+			ThrowIfFailed(pBuffer->SetCurrentLength(nv12_size));
 
-		DWORD mftProccessStatus = 0;
+			ThrowIfFailed((*ppSample)->SetSampleDuration(sample_duration));
+			ThrowIfFailed((*ppSample)->SetSampleTime(sample_time));
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw e;
+		}
+	}
 
-		ComPtr<IMFSample> pOutSample;
+	// Summarizes the NAL units of an Annex-B H.264 sample, e.g. encoder output,
+	// without copying it (unless it is spread over several buffers)
+	static h264_access_unit_info_t mf_scan_h264_sample(/**[in]**/ IMFSample* pSample)
+	{
+		try
+		{
+			ComPtr<IMFMediaBuffer> pBuffer;
+			ThrowIfFailed(pSample->ConvertToContiguousBuffer(pBuffer.GetAddressOf()));
 
-		// If the transform returns MF_E_NOTACCEPTING then it means that it has enough
-		// data to produce one or more output samples.
-		// Here, we generate new output by calling IMFTransform::ProcessOutput until it
-		// results in MF_E_TRANSFORM_NEED_MORE_INPUT which breaks out of the loop.
-		while (mftProcessOutput == S_OK)
+			BYTE* pData = nullptr;
+			DWORD currentLength = 0;
+			ThrowIfFailed(pBuffer->Lock(&pData, nullptr, &currentLength));
+			h264_access_unit_info_t info = h264_scan_access_unit(pData, currentLength);
+			ThrowIfFailed(pBuffer->Unlock());
+			return info;
+		}
+		catch (const std::exception& e)
 		{
-			if ((StreamInfo.dwFlags & MFT_OUTPUT_STREAM_PROVIDES_SAMPLES) == 0)
-			{
-				ThrowIfFailed(MFCreateSample(pOutSample.ReleaseAndGetAddressOf()));
+			log_err(e.what());
+			throw e;
+		}
+	}
 
-				ComPtr<IMFMediaBuffer> pBuffer;
-				ThrowIfFailed(MFCreateMemoryBuffer(StreamInfo.cbSize, pBuffer.GetAddressOf()));
-				ThrowIfFailed(pOutSample->AddBuffer(pBuffer.Get()));
+	// Parses the SPS (and PPS if asked for) of an H.264 sample, e.g. an encoder
+	// keyframe. Returns false when the sample doesn't carry valid ones.
+	static bool mf_h264_sample_parameter_sets(/**[in]**/ IMFSample* pSample, /**[out]**/ h264_sps_t* sps, /**[out]**/ h264_pps_t* pps = nullptr)
+	{
+		try
+		{
+			ComPtr<IMFMediaBuffer> pBuffer;
+			ThrowIfFailed(pSample->ConvertToContiguousBuffer(pBuffer.GetAddressOf()));
 
-				outputDataBuffer.pSample = pOutSample.Get();
-			}
+			BYTE* pData = nullptr;
+			DWORD currentLength = 0;
+			ThrowIfFailed(pBuffer->Lock(&pData, nullptr, &currentLength));
+			bool parsed = h264_parse_parameter_sets(pData, currentLength, sps, pps);
+			ThrowIfFailed(pBuffer->Unlock());
+			return parsed;
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw e;
+		}
+	}
 
-			mftProcessOutput = pTransform->ProcessOutput(0, 1, &outputDataBuffer, &mftProccessStatus);
+	// Appends an encoded H.264 sample to a recording, using the encoder's
+	// decode timestamp when it sets one (B frames) and the sample time otherwise.
+	// The recorder's timescale has to be MF's, 10000000.
+	static bool mf_record_h264_sample(/**[in]**/ mp4_recorder* pRecorder, /**[in]**/ IMFSample* pSample)
+	{
+		try
+		{
+			LONGLONG sampleTime = 0;
+			ThrowIfFailed(pSample->GetSampleTime(&sampleTime));
+			UINT64 decodeTime = MFGetAttributeUINT64(pSample, MFSampleExtension_DecodeTimestamp, static_cast<UINT64>(sampleTime));
 
-			if (outputDataBuffer.dwStatus & MFT_OUTPUT_DATA_BUFFER_FORMAT_CHANGE)
-			{
-				// Get the new media type for the stream
-				ComPtr<IMFMediaType> pNewMediaType;
-				ThrowIfFailed(pTransform->GetOutputAvailableType(0, 0, pNewMediaType.GetAddressOf()));
-				ThrowIfFailed(pTransform->SetOutputType(0, pNewMediaType.Get(), 0));
+			ComPtr<IMFMediaBuffer> pBuffer;
+			ThrowIfFailed(pSample->ConvertToContiguousBuffer(pBuffer.GetAddressOf()));
 
-				ThrowIfFailed(pTransform->ProcessMessage(MFT_MESSAGE_COMMAND_FLUSH, 0));
+			BYTE* pData = nullptr;
+			DWORD currentLength = 0;
+			ThrowIfFailed(pBuffer->Lock(&pData, nullptr, &currentLength));
+			bool written = pRecorder->write_sample(pData, currentLength, sampleTime, static_cast<int64_t>(decodeTime));
+			ThrowIfFailed(pBuffer->Unlock());
+			return written;
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw e;
+		}
+	}
 
-				mftProcessOutput = pTransform->ProcessOutput(0, 1, &outputDataBuffer, &mftProccessStatus);
-			}
+	// Sends an encoded H.264 sample as RTP, each packet gathered straight from
+	// the locked sample buffer. The sink is a udp_socket, or a sim_channel to
+	// try the receive side against loss. Returns the packets sent.
+	template <typename packet_sink_t>
+	static size_t mf_send_h264_sample(/**[in]**/ rtp_h264_packetizer* pPacketizer, /**[in]**/ packet_sink_t* pSocket, /**[in]**/ IMFSample* pSample)
+	{
+		try
+		{
+			LONGLONG sampleTime = 0;
+			ThrowIfFailed(pSample->GetSampleTime(&sampleTime));
+			uint32_t timestamp = static_cast<uint32_t>(mp4_rescale(sampleTime, 10000000, rtp_h264_clock_rate));
 
-			//char buffer[1024];
-			//std::snprintf(buffer, sizeof(buffer), "MFT ProcessOutput error result %.2X, MFT status %.2X", mftProcessOutput, mftProccessStatus);
-			//log_info(buffer);
+			ComPtr<IMFMediaBuffer> pBuffer;
+			ThrowIfFailed(pSample->ConvertToContiguousBuffer(pBuffer.GetAddressOf()));
 
-			if (mftProcessOutput == S_OK)
-			{
-				if (onReceiveBuffer)
-				{
-					onReceiveBuffer(pTransform, outputDataBuffer.pSample, pContext);
-				}
-
-				// Release the completed sample if our smart pointer doesn't do it for us
-				if (outputDataBuffer.pSample && !pOutSample)
-					outputDataBuffer.pSample->Release();
-				if (outputDataBuffer.pEvents)
-					outputDataBuffer.pEvents->Release();
-				break;
-			}
+			BYTE* pData = nullptr;
+			DWORD currentLength = 0;
+			ThrowIfFailed(pBuffer->Lock(&pData, nullptr, &currentLength));
+			size_t sent = 0;
+			pPacketizer->packetize(pData, currentLength, timestamp);
+			for (const rtp_packet_t& packet : pPacketizer->packets())
+				sent += pSocket->send(pPacketizer->packet_spans(packet), packet.span_count) ? 1 : 0;
+			ThrowIfFailed(pBuffer->Unlock());
+			return sent;
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw e;
+		}
+	}
 
-			// More input is not an error condition but it means the allocated output sample is empty
-			if (mftProcessOutput != S_OK && mftProcessOutput != MF_E_TRANSFORM_NEED_MORE_INPUT)
-			{
-				char buffer[1024];
-				std::snprintf(buffer, sizeof(buffer), "Error getting transform output, error code %.2X", mftProcessOutput);
-				throw std::exception(buffer);
-			}
+	// Wraps an access unit the depacketizer put back together in a sample for
+	// the decoder, which wants whole frames. Timed from the RTP timestamp.
+	static void mf_create_rtp_frame_sample(const rtp_frame_t& frame, long long sample_duration, /**[out]**/ IMFSample** ppSample)
+	{
+		try
+		{
+			mf_create_sample(frame.data, static_cast<int>(frame.size), sample_duration, mp4_rescale(frame.time, rtp_h264_clock_rate, 10000000), ppSample);
+			if (frame.keyframe)
+				ThrowIfFailed((*ppSample)->SetUINT32(MFSampleExtension_CleanPoint, TRUE));
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw e;
 		}
 	}
 
-	static void mf_transform_sample_to_buffer(/**[in]**/ IMFTransform* pTransform, /**[in]**/ IMFSample* pVideoSample, /**[in]**/ void(*onReceiveBuffer)(IMFTransform*, IMFSample*, void*), /**[in]**/ void* pContext = nullptr)
+	// Parses the SPS/PPS a source puts in MF_MT_MPEG_SEQUENCE_HEADER, so the
+	// stream can be sized before any decoder exists. False if it has none.
+	static bool mf_h264_media_type_parameter_sets(/**[in]**/ IMFMediaType* pMediaType, /**[out]**/ h264_sps_t* sps, /**[out]**/ h264_pps_t* pps = nullptr)
+	{
+		UINT32 blobSize = 0;
+		if (FAILED(pMediaType->GetBlobSize(MF_MT_MPEG_SEQUENCE_HEADER, &blobSize)) || blobSize == 0)
+			return false;
+
+		std::vector<UINT8> blob(blobSize);
+		if (FAILED(pMediaType->GetBlob(MF_MT_MPEG_SEQUENCE_HEADER, blob.data(), blobSize, nullptr)))
+			return false;
+		return h264_parse_parameter_sets(blob.data(), blob.size(), sps, pps);
+	}
+
+	// Fills in everything about the decoder's NV12 output that the SPS tells us,
+	// so SetOutputType succeeds first time instead of after a stream change
+	static void mf_set_h264_output_media_type(/**[in]**/ IMFMediaType* pMediaType, const h264_sps_t* sps)
 	{
 		try
 		{
-			ComPtr<IMFMediaEventGenerator> pEventGen;
-			HRESULT hr = pTransform->QueryInterface(IID_PPV_ARGS(pEventGen.GetAddressOf()));
-			if (SUCCEEDED(hr))
-			{
-				ComPtr<IMFMediaEventGenerator> pEventGen;
-				ThrowIfFailed(pTransform->QueryInterface(IID_PPV_ARGS(pEventGen.GetAddressOf())));
+			ThrowIfFailed(MFSetAttributeSize(pMediaType, MF_MT_FRAME_SIZE, sps->coded_width, sps->coded_height));
+			ThrowIfFailed(pMediaType->SetUINT32(MF_MT_DEFAULT_STRIDE, sps->coded_width));
+
+			MFVideoArea aperture = {};
+			aperture.OffsetX.value = static_cast<short>(sps->crop_left);
+			aperture.OffsetY.value = static_cast<short>(sps->crop_top);
+			aperture.Area.cx = sps->width;
+			aperture.Area.cy = sps->height;
+			ThrowIfFailed(pMediaType->SetBlob(MF_MT_MINIMUM_DISPLAY_APERTURE, reinterpret_cast<UINT8*>(&aperture), sizeof(aperture)));
+
+			ThrowIfFailed(MFSetAttributeRatio(pMediaType, MF_MT_PIXEL_ASPECT_RATIO, sps->sar_width, sps->sar_height));
+			UINT32 num = 0, den = 0;
+			if (h264_sps_frame_rate(sps, &num, &den))
+				ThrowIfFailed(MFSetAttributeRatio(pMediaType, MF_MT_FRAME_RATE, num, den));
+
+			ThrowIfFailed(pMediaType->SetUINT32(MF_MT_YUV_MATRIX,
+				h264_sps_color_matrix(sps) == color_matrix_bt709 ? MFVideoTransferMatrix_BT709 : MFVideoTransferMatrix_BT601));
+			ThrowIfFailed(pMediaType->SetUINT32(MF_MT_VIDEO_NOMINAL_RANGE,
+				h264_sps_color_range(sps) == color_range_full ? MFNominalRange_0_255 : MFNominalRange_16_235));
+			ThrowIfFailed(pMediaType->SetUINT32(MF_MT_INTERLACE_MODE,
+				sps->frame_mbs_only ? MFVideoInterlace_Progressive : MFVideoInterlace_MixedInterlaceOrProgressive));
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw e;
+		}
+	}
 
-				ComPtr<IMFMediaEvent> pEvent;
-				ThrowIfFailed(pEventGen->GetEvent(0, pEvent.GetAddressOf()));
+	typedef void(*mf_on_receive_buffer)(IMFTransform*, IMFSample*, void*);
 
-				MediaEventType eventType;
-				ThrowIfFailed(pEvent->GetType(&eventType));
+	struct _mf_receive_context_t {
+		mf_on_receive_buffer onReceiveBuffer;
+		void* pContext;
+	};
 
-				if (eventType == METransformNeedInput)
-				{
-					ThrowIfFailed(pTransform->ProcessInput(0, pVideoSample, 0));
-				}
+	// Unwraps the portable pipeline's callback back into MF types
+	static void mf_on_receive_sample(media_transform* transform, media_sample* sample, void* context)
+	{
+		_mf_receive_context_t* receive = static_cast<_mf_receive_context_t*>(context);
+		if (receive->onReceiveBuffer)
+		{
+			receive->onReceiveBuffer(static_cast<mf_transform*>(transform)->get(), static_cast<mf_media_sample*>(sample)->get(), receive->pContext);
+		}
+	}
 
-				if (eventType == METransformHaveOutput)
-				{
-					mf_process_output(pTransform, onReceiveBuffer, pContext);
-				}
-			}
-			else
-			{
-				ThrowIfFailed(pTransform->ProcessInput(0, pVideoSample, 0));
-				mf_process_output(pTransform, onReceiveBuffer, pContext);
-			}
+	// Rows in the luma plane of an NV12 buffer, padding included (e.g. 1088 for
+	// 1080p H.264 output), derived from the buffer length and pitch
+	static int mf_nv12_plane_rows(DWORD bufferLength, LONG pitch, int height)
+	{
+		LONG absPitch = pitch < 0 ? -pitch : pitch;
+		int rows = absPitch ? static_cast<int>(bufferLength / absPitch * 2 / 3) : 0;
+		return rows > height ? rows : height;
+	}
+
+	// Copies a decoded NV12 sample into a frame in the packed layout (see
+	// nv12_packed_stride). False if the frame is too small or the buffer is
+	// shorter than its pitch says.
+	static bool mf_copy_nv12_sample(/**[in]**/ IMFSample* pSample, /**[out]**/ mailbox_frame_t* frame, int width, int height)
+	{
+		ComPtr<IMFMediaBuffer> buffer;
+		ThrowIfFailed(pSample->GetBufferByIndex(0, buffer.GetAddressOf()));
+
+		DWORD bufferLength = 0;
+		ThrowIfFailed(buffer->GetCurrentLength(&bufferLength));
+
+		int32_t stride = nv12_packed_stride(width);
+		if (frame->capacity < nv12_packed_size(width, height))
+			return false;
+
+		// 2D buffers give us their real pitch, which is often wider than the frame
+		// (and negative for bottom-up images) and saves the MF copy into a contiguous buffer
+		BYTE* scanline0 = NULL;
+		LONG pitch = 0;
+		ComPtr<IMF2DBuffer> buffer2D;
+		bool locked2D = SUCCEEDED(buffer.As(&buffer2D)) && SUCCEEDED(buffer2D->Lock2D(&scanline0, &pitch));
+		if (!locked2D)
+		{
+			DWORD maxLength = 0, currentLength = 0;
+			ThrowIfFailed(buffer->Lock(&scanline0, &maxLength, &currentLength));
+			pitch = stride;
+		}
+
+		int planeRows = mf_nv12_plane_rows(bufferLength, pitch, height);
+		bool fits = locked2D || bufferLength >= static_cast<DWORD>(pitch) * (planeRows + nv12_chroma_rows(height));
+		if (fits)
+		{
+			nv12_copy(frame->data, stride, frame->data + static_cast<size_t>(stride) * height, stride,
+				scanline0, pitch, scanline0 + static_cast<ptrdiff_t>(pitch) * planeRows, pitch,
+				width, height);
+		}
+
+		if (locked2D) ThrowIfFailed(buffer2D->Unlock2D());
+		else ThrowIfFailed(buffer->Unlock());
+
+		if (!fits)
+			return false;
+
+		LONGLONG sampleTime = 0;
+		pSample->GetSampleTime(&sampleTime);
+
+		frame->size = nv12_packed_size(width, height);
+		frame->width = width;
+		frame->height = height;
+		frame->stride = stride;
+		frame->time = sampleTime;
+		return true;
+	}
+
+	// Copies a decoded NV12 sample into the mailbox so the render thread can upload
+	// it, instead of mapping the texture from the decoder thread
+	static void mf_mailbox_publish_sample(/**[in]**/ frame_mailbox* pMailbox, /**[in]**/ IMFSample* pSample, int width, int height)
+	{
+		if (mf_copy_nv12_sample(pSample, pMailbox->begin_write(), width, height))
+			pMailbox->publish();
+		else
+			pMailbox->drop();
+	}
+
+	// Queues a decoded NV12 sample for timed presentation. Blocks while the
+	// presenter is full, which is what paces the decoder to the render clock.
+	// Returns false once the presenter is closed.
+	static bool mf_presenter_queue_sample(/**[in]**/ frame_presenter* pPresenter, /**[in]**/ IMFSample* pSample, int width, int height)
+	{
+		mailbox_frame_t* frame = pPresenter->begin_write();
+		if (!frame)
+			return false;
+		if (mf_copy_nv12_sample(pSample, frame, width, height))
+			pPresenter->publish();
+		else
+			pPresenter->cancel_write();
+		return true;
+	}
+
+	// Pass an mf_sample_pool as pAllocator to recycle output samples for transforms
+	// that don't provide their own, rather than allocating a new buffer per frame
+	static void mf_process_output(/**[in]**/ IMFTransform* pTransform, /**[in]**/ mf_on_receive_buffer onReceiveBuffer = nullptr, /**[in]**/ void* pContext = nullptr, /**[in]**/ sample_allocator* pAllocator = nullptr)
+	{
+		mf_transform transform(pTransform);
+		_mf_receive_context_t receive = { onReceiveBuffer, pContext };
+
+		// Async MFTs only hand out one sample per METransformHaveOutput event
+		transform_process_output(&transform, mf_on_receive_sample, &receive, pAllocator, transform.is_async() ? 1 : SIZE_MAX);
+	}
+
+	static void mf_transform_sample_to_buffer(/**[in]**/ IMFTransform* pTransform, /**[in]**/ IMFSample* pVideoSample, /**[in]**/ mf_on_receive_buffer onReceiveBuffer, /**[in]**/ void* pContext = nullptr, /**[in]**/ sample_allocator* pAllocator = nullptr)
+	{
+		try
+		{
+			mf_transform transform(pTransform);
+			_mf_receive_context_t receive = { onReceiveBuffer, pContext };
+
+			ref_ptr<media_sample> sample = ref_ptr<media_sample>::attach(mf_media_sample::create(pVideoSample));
+			transform_sample_to_buffer(&transform, sample.get(), mf_on_receive_sample, &receive, pAllocator);
 		}
 		catch (const std::exception& e)
 		{
@@ -190,34 +445,47 @@ namespace nakamir {
 		}
 	}
 
-	static void mf_drain_pending_outputs(/**[in]**/ IMFTransform* pTransform)
+	static void mf_drain_pending_outputs(/**[in]**/ IMFTransform* pTransform, /**[in]**/ sample_allocator* pAllocator = nullptr)
 	{
-		ComPtr<IMFMediaEventGenerator> pEventGen;
-		HRESULT hr = pTransform->QueryInterface(IID_PPV_ARGS(pEventGen.GetAddressOf()));
-		if (SUCCEEDED(hr))
+		try
 		{
-			try
-			{
-				ComPtr<IMFMediaEventGenerator> pEventGen;
-				ThrowIfFailed(pTransform->QueryInterface(IID_PPV_ARGS(pEventGen.GetAddressOf())));
-
-				ComPtr<IMFMediaEvent> pEvent;
-				while (SUCCEEDED(pEventGen->GetEvent(MF_EVENT_FLAG_NO_WAIT, pEvent.GetAddressOf())))
-				{
-					MediaEventType eventType;
-					ThrowIfFailed(pEvent->GetType(&eventType));
-
-					if (eventType == METransformHaveOutput)
-					{
-						mf_process_output(pTransform);
-					}
-				}
-			}
-			catch (const std::exception& e)
-			{
-				log_err(e.what());
-				throw e;
-			}
+			mf_transform transform(pTransform);
+			transform_drain_pending_outputs(&transform, nullptr, nullptr, pAllocator);
+		}
+		catch (const std::exception& e)
+		{
+			log_err(e.what());
+			throw e;
 		}
 	}
+
+	// Keeps an MFT saturated from its own event thread, several frames deep,
+	// instead of one mf_transform_sample_to_buffer round trip per frame (see
+	// transform_driver). onReceiveBuffer runs on that thread for async MFTs, and
+	// on the submitting thread for sync ones.
+	class mf_transform_driver {
+	public:
+		mf_transform_driver(/**[in]**/ IMFTransform* pTransform, /**[in]**/ mf_on_receive_buffer onReceiveBuffer, /**[in]**/ void* pContext = nullptr,
+			/**[in]**/ sample_allocator* pAllocator = nullptr, uint32_t maxQueued = 0)
+			: _transform(pTransform), _receive{ onReceiveBuffer, pContext }, _driver(&_transform, mf_on_receive_sample, &_receive, pAllocator, maxQueued)
+		{
+			_driver.start();
+		}
+
+		bool submit(/**[in]**/ IMFSample* pSample)
+		{
+			ref_ptr<media_sample> sample = ref_ptr<media_sample>::attach(mf_media_sample::create(pSample));
+			return _driver.submit(sample.get());
+		}
+		void drain() { _driver.drain(); }
+		void flush() { _driver.flush(); }
+		// Shuts the MFT down; release it afterwards
+		void stop() { _driver.stop(); }
+		transform_driver_stats_t get_stats() { return _driver.get_stats(); }
+
+	private:
+		mf_transform _transform;
+		_mf_receive_context_t _receive;
+		transform_driver _driver;
+	};
 } // namespace nakamir
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "mf_video_decoder.h"
 #include "mf_utility.h"
+#include "mf_codec_registry.h"
 #include "error.h"
 #include <mfplay.h>
 #include <mfreadwrite.h>
@@ -41,50 +42,9 @@ namespace nakamir {
 			outputType.guidMajorType = outputMajorType;
 			outputType.guidSubtype = outputSubType;
 
-			// Enumerate decoders that match the input type
-			UINT32 count = 0;
-			ThrowIfFailed(MFTEnumEx(
-				MFT_CATEGORY_VIDEO_DECODER,
-				MFT_ENUM_FLAG_HARDWARE | MFT_ENUM_FLAG_ALL | MFT_ENUM_FLAG_SORTANDFILTER,
-				&inputType,
-				&outputType,
-				pppActivate,
-				&count
-			));
-
-			// Check if any decoders were found
-			if (count <= 0)
-			{
-				throw std::exception("No decoders found! :(");
-			}
-
-			log_info("DECODERS FOUND:");
-
-			for (UINT32 i = 0; i < count; i++)
-			{
-				LPWSTR pszName = nullptr;
-				UINT32 pszLength;
-				if (FAILED((*pppActivate)[i]->GetAllocatedString(MFT_FRIENDLY_NAME_Attribute, &pszName, &pszLength)) || !pszName)
-				{
-					continue;
-				}
-
-				int requiredSize = WideCharToMultiByte(CP_UTF8, 0, pszName, -1, nullptr, 0, nullptr, nullptr);
-				char* pszNameBuffer = new char[requiredSize];
-				WideCharToMultiByte(CP_UTF8, 0, pszName, -1, pszNameBuffer, requiredSize, nullptr, nullptr);
-
-				std::string result = "\t- ";
-				if (i == 0) result += "[";
-				result += pszNameBuffer;
-				if (i == 0) result += "]";
-				log_info(result.c_str());
-
-				delete[] pszNameBuffer;
-				CoTaskMemFree(pszName);
-			}
-
-			// Activate first decoder object and get a pointer to it
-			ThrowIfFailed((*pppActivate)[0]->ActivateObject(IID_PPV_ARGS(ppDecoderTransform)));
+			// Pick and activate the best decoder for the pair, from the codec cache
+			// when it knows the pair
+			mf_activate_video_codec(MFT_CATEGORY_VIDEO_DECODER, inputType, outputType, ppDecoderTransform, pppActivate);
 
 			ComPtr<IMFAttributes> pAttributes;
 			ThrowIfFailed((*ppDecoderTransform)->GetAttributes(pAttributes.GetAddressOf()));
@@ -1,5 +1,6 @@
 #include "mf_video_encoder.h"
 #include "mf_utility.h"
+#include "mf_codec_registry.h"
 #include "error.h"
 #include <mfplay.h>
 #include <mfreadwrite.h>
@@ -40,50 +41,10 @@ namespace nakamir {
 			outputType.guidMajorType = outputMajorType;
 			outputType.guidSubtype = outputSubType;
 
-			// Enumerate encoders that match the input type
-			UINT32 count = 0;
-			ThrowIfFailed(MFTEnumEx(
-				MFT_CATEGORY_VIDEO_ENCODER, //MFT_CATEGORY_VIDEO_PROCESSOR // process from rgba -> nv12
-				MFT_ENUM_FLAG_HARDWARE | MFT_ENUM_FLAG_ALL | MFT_ENUM_FLAG_SORTANDFILTER,
-				&inputType,
-				&outputType,
-				pppActivate,
-				&count
-			));
-
-			// Check if any encoders were found
-			if (count <= 0)
-			{
-				throw std::exception("No hardware encoders found! :(");
-			}
-
-			log_info("ENCODERS FOUND:");
-
-			for (UINT32 i = 0; i < count; i++)
-			{
-				LPWSTR pszName = nullptr;
-				UINT32 pszLength;
-				if (FAILED((*pppActivate)[i]->GetAllocatedString(MFT_FRIENDLY_NAME_Attribute, &pszName, &pszLength)) || !pszName)
-				{
-					continue;
-				}
-
-				int requiredSize = WideCharToMultiByte(CP_UTF8, 0, pszName, -1, nullptr, 0, nullptr, nullptr);
-				char* pszNameBuffer = new char[requiredSize];
-				WideCharToMultiByte(CP_UTF8, 0, pszName, -1, pszNameBuffer, requiredSize, nullptr, nullptr);
-
-				std::string result = "\t- ";
-				if (i == 0) result += "[";
-				result += pszNameBuffer;
-				if (i == 0) result += "]";
-				log_info(result.c_str());
-
-				delete[] pszNameBuffer;
-				CoTaskMemFree(pszName);
-			}
-
-			// Activate first encoder object and get a pointer to it
-			ThrowIfFailed((*pppActivate)[0]->ActivateObject(IID_PPV_ARGS(ppEncoderTransform)));
+			// Pick and activate the best encoder for the pair, from the codec cache
+			// when it knows the pair
+			mf_activate_video_codec(MFT_CATEGORY_VIDEO_ENCODER, // RGB sources go through rgb_to_nv12/mf_create_sample_from_rgb first
+				inputType, outputType, ppEncoderTransform, pppActivate);
 
 			ComPtr<IMFAttributes> pAttributes;
 			ThrowIfFailed((*ppEncoderTransform)->GetAttributes(pAttributes.GetAddressOf()));
@@ -136,7 +97,14 @@ namespace nakamir {
 			try
 			{
 				ThrowIfFailed(pAttributes->GetUINT32(MF_SA_D3D_AWARE, &isD3DAware));
-				if (isD3DAware)
+				// The encoder may be brought up before StereoKit has a device; it
+				// takes system memory samples fine without one
+				ID3D11Device* pD3DDevice = (ID3D11Device*)backend_d3d11_get_d3d_device();
+				if (isD3DAware && !pD3DDevice)
+				{
+					log_info("No D3D11 device yet, the video encoder takes system memory samples");
+				}
+				else if (isD3DAware)
 				{
 					// Create the DXGI Device Manager
 					UINT resetToken;
@@ -144,7 +112,6 @@ namespace nakamir {
 					ThrowIfFailed(MFCreateDXGIDeviceManager(&resetToken, pDXGIDeviceManager.GetAddressOf()));
 
 					// Set the Direct3D 11 device on the DXGI Device Manager
-					ID3D11Device* pD3DDevice = (ID3D11Device*)backend_d3d11_get_d3d_device();
 					ThrowIfFailed(pDXGIDeviceManager->ResetDevice(pD3DDevice, resetToken));
 
 					// The Topology Loader calls IMFTransform::ProcessMessage with the MFT_MESSAGE_SET_D3D_MANAGER message
@@ -182,6 +149,22 @@ namespace nakamir {
 		return mft_type;
 	}
 
+	HRESULT mf_set_encoder_bitrate(IMFTransform* pEncoderTransform, UINT32 bitrate)
+	{
+		ComPtr<ICodecAPI> pCodecAPI;
+		HRESULT hr = pEncoderTransform->QueryInterface(IID_PPV_ARGS(pCodecAPI.GetAddressOf()));
+		if (SUCCEEDED(hr))
+		{
+			VARIANT variant = {};
+			variant.vt = VT_UI4;
+			variant.ulVal = bitrate;
+			hr = pCodecAPI->SetValue(&CODECAPI_AVEncCommonMeanBitRate, &variant);
+		}
+		if (FAILED(hr))
+			log_err(std::format("Setting the encoder bitrate to {} failed with HRESULT {:08X}", bitrate, static_cast<unsigned int>(hr)).c_str());
+		return hr;
+	}
+
 	static void mf_validate_stream_info(IMFTransform* pEncoderTransform)
 	{
 		try
@@ -4,4 +4,9 @@
 
 namespace nakamir {
 	_MFT_TYPE mf_create_mft_video_encoder(/**[in]**/ IMFMediaType* pInputMediaType, /**[in]**/ IMFMediaType* pOutputMediaType, /**[out]**/ IMFTransform** ppEncoderTransform, /**[out]**/ IMFActivate*** pppActivate);
+	// Retunes a running encoder's CBR target through ICodecAPI, e.g. from a
+	// bitrate_controller. Takes effect from the next frames without a restart.
+	// Logs and returns a failure rather than throwing, as it is usually called
+	// from the encoder's event thread; the encoder keeps its old target then.
+	HRESULT mf_set_encoder_bitrate(/**[in]**/ IMFTransform* pEncoderTransform, UINT32 bitrate);
 } // namespace nakamir
\ No newline at end of file
@@ -0,0 +1,601 @@
+#include "mp4_demux.h"
+#include <algorithm>
+#include <cstring>
+
+namespace nakamir {
+
+	// Payload of one box; the header (and uuid extended type) is already skipped
+	struct mp4_box_t {
+		uint32_t type;
+		const uint8_t* data;
+		size_t size;
+	};
+
+	// Boxes of interest inside one trak, found before any of them is parsed
+	struct mp4_stbl_boxes_t {
+		mp4_box_t stsd, stts, ctts, stss, stsz, stz2, stsc, stco, co64;
+	};
+
+	static uint16_t mp4_be16(const uint8_t* p) { return static_cast<uint16_t>((p[0] << 8) | p[1]); }
+	static uint32_t mp4_be32(const uint8_t* p) { return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+	static uint64_t mp4_be64(const uint8_t* p) { return (static_cast<uint64_t>(mp4_be32(p)) << 32) | mp4_be32(p + 4); }
+
+	// Reads the box at p and advances past it. False at the end or when the
+	// header doesn't fit what is left.
+	static bool mp4_next_box(const uint8_t*& p, const uint8_t* end, /**[out]**/ mp4_box_t* box)
+	{
+		size_t left = static_cast<size_t>(end - p);
+		if (left < 8)
+			return false;
+
+		uint64_t size = mp4_be32(p);
+		uint32_t type = mp4_be32(p + 4);
+		size_t header = 8;
+		if (size == 1)
+		{
+			// 64 bit largesize follows the type
+			if (left < 16)
+				return false;
+			size = mp4_be64(p + 8);
+			header = 16;
+		}
+		else if (size == 0)
+		{
+			// Runs to the end of the enclosing box (or file)
+			size = left;
+		}
+		if (type == mp4_fourcc('u', 'u', 'i', 'd'))
+			header += 16;
+		if (size < header || size > left)
+			return false;
+
+		box->type = type;
+		box->data = p + header;
+		box->size = static_cast<size_t>(size - header);
+		p += size;
+		return true;
+	}
+
+	// First child of the given type, or false
+	static bool mp4_find_box(const mp4_box_t& parent, uint32_t type, /**[out]**/ mp4_box_t* box)
+	{
+		const uint8_t* p = parent.data;
+		const uint8_t* end = parent.data + parent.size;
+		while (mp4_next_box(p, end, box))
+		{
+			if (box->type == type)
+				return true;
+		}
+		return false;
+	}
+
+	// Full boxes start with a version byte and 24 bits of flags
+	static bool mp4_full_box(const mp4_box_t& box, size_t payload, /**[out]**/ uint8_t* version)
+	{
+		if (!box.data || box.size < 4 + payload)
+			return false;
+		*version = box.data[0];
+		return true;
+	}
+
+	static bool mp4_parse_avcc(const mp4_box_t& avcc, mp4_track_t* track)
+	{
+		const uint8_t* p = avcc.data;
+		const uint8_t* end = avcc.data + avcc.size;
+		if (avcc.size < 7 || p[0] != 1)
+			return false;
+
+		track->profile_idc = p[1];
+		track->level_idc = p[3];
+		track->nal_length_size = (p[4] & 3) + 1;
+		if (track->nal_length_size == 3)
+			return false;
+
+		// numOfSequenceParameterSets, then numOfPictureParameterSets after them
+		p += 5;
+		for (int32_t list = 0; list < 2; list++)
+		{
+			if (p >= end)
+				return false;
+			uint32_t count = list == 0 ? (*p & 0x1F) : *p;
+			p++;
+			for (uint32_t i = 0; i < count; i++)
+			{
+				if (end - p < 2)
+					return false;
+				size_t length = mp4_be16(p);
+				p += 2;
+				if (static_cast<size_t>(end - p) < length)
+					return false;
+				(list == 0 ? track->sps : track->pps).emplace_back(p, p + length);
+				p += length;
+			}
+		}
+		return true;
+	}
+
+	static bool mp4_parse_stsd(const mp4_box_t& stsd, mp4_track_t* track)
+	{
+		uint8_t version;
+		if (!mp4_full_box(stsd, 4, &version) || mp4_be32(stsd.data + 4) == 0)
+			return false;
+
+		// Only the first sample description is used; streams that switch
+		// descriptions mid-track are rare enough not to bother
+		const uint8_t* p = stsd.data + 8;
+		mp4_box_t entry;
+		if (!mp4_next_box(p, stsd.data + stsd.size, &entry))
+			return false;
+		track->codec = entry.type;
+
+		if (track->handler != mp4_fourcc('v', 'i', 'd', 'e'))
+			return true;
+
+		// VisualSampleEntry: 8 bytes of SampleEntry, 16 reserved, width, height,
+		// then 50 more bytes of fixed fields before the child boxes
+		const size_t visual_size = 78;
+		if (entry.size < visual_size)
+			return false;
+		track->width = mp4_be16(entry.data + 24);
+		track->height = mp4_be16(entry.data + 26);
+
+		mp4_box_t children = { entry.type, entry.data + visual_size, entry.size - visual_size };
+		mp4_box_t avcc;
+		if (mp4_find_box(children, mp4_fourcc('a', 'v', 'c', 'C'), &avcc))
+			return mp4_parse_avcc(avcc, track);
+		return true;
+	}
+
+	// Flattens the sample table into track->samples. False if the tables are
+	// missing or inconsistent; samples past the end of the file (a truncated
+	// download) are dropped rather than failing the track.
+	static bool mp4_build_index(const mp4_stbl_boxes_t& stbl, uint64_t file_size, mp4_track_t* track)
+	{
+		mp4_sample_index_t& index = track->samples;
+		uint8_t version;
+
+		// Sample sizes, from stsz or the compact stz2
+		uint32_t count = 0;
+		if (mp4_full_box(stbl.stsz, 8, &version))
+		{
+			uint32_t constant = mp4_be32(stbl.stsz.data + 4);
+			count = mp4_be32(stbl.stsz.data + 8);
+			if (count > file_size || (constant == 0 && (stbl.stsz.size - 12) / 4 < count))
+				return false;
+			index.size.resize(count, constant);
+			if (constant == 0)
+			{
+				for (uint32_t i = 0; i < count; i++)
+					index.size[i] = mp4_be32(stbl.stsz.data + 12 + i * 4);
+			}
+		}
+		else if (mp4_full_box(stbl.stz2, 8, &version))
+		{
+			uint32_t field_size = stbl.stz2.data[7];
+			count = mp4_be32(stbl.stz2.data + 8);
+			if ((field_size != 4 && field_size != 8 && field_size != 16) ||
+				(stbl.stz2.size - 12) * 8 / field_size < count)
+				return false;
+			index.size.resize(count);
+			const uint8_t* p = stbl.stz2.data + 12;
+			for (uint32_t i = 0; i < count; i++)
+			{
+				switch (field_size)
+				{
+				case 4:  index.size[i] = (i & 1) ? (p[i / 2] & 0xF) : (p[i / 2] >> 4); break;
+				case 8:  index.size[i] = p[i]; break;
+				default: index.size[i] = mp4_be16(p + i * 2); break;
+				}
+			}
+		}
+		else
+		{
+			return false;
+		}
+		if (count == 0)
+			return false;
+
+		// Decode times from stts run lengths
+		if (!mp4_full_box(stbl.stts, 4, &version))
+			return false;
+		uint32_t runs = mp4_be32(stbl.stts.data + 4);
+		if ((stbl.stts.size - 8) / 8 < runs)
+			return false;
+		index.dts.resize(count);
+		int64_t dts = 0;
+		uint32_t sample = 0;
+		for (uint32_t r = 0; r < runs && sample < count; r++)
+		{
+			uint32_t run = mp4_be32(stbl.stts.data + 8 + r * 8);
+			uint32_t delta = mp4_be32(stbl.stts.data + 12 + r * 8);
+			for (uint32_t i = 0; i < run && sample < count; i++, sample++, dts += delta)
+				index.dts[sample] = dts;
+		}
+		if (sample < count)
+			return false;
+		index.end_dts = dts;
+
+		// Composition offsets. Version 0 is unsigned on paper, but plenty of
+		// muxers write negative offsets with it anyway, so both read as signed.
+		index.cts_offset.assign(count, 0);
+		if (mp4_full_box(stbl.ctts, 4, &version))
+		{
+			runs = mp4_be32(stbl.ctts.data + 4);
+			if ((stbl.ctts.size - 8) / 8 < runs)
+				return false;
+			sample = 0;
+			for (uint32_t r = 0; r < runs && sample < count; r++)
+			{
+				uint32_t run = mp4_be32(stbl.ctts.data + 8 + r * 8);
+				int32_t offset = static_cast<int32_t>(mp4_be32(stbl.ctts.data + 12 + r * 8));
+				for (uint32_t i = 0; i < run && sample < count; i++, sample++)
+					index.cts_offset[sample] = offset;
+			}
+		}
+
+		// Sync samples; without stss every sample is one
+		index.sync.clear();
+		if (mp4_full_box(stbl.stss, 4, &version))
+		{
+			uint32_t entries = mp4_be32(stbl.stss.data + 4);
+			if ((stbl.stss.size - 8) / 4 < entries)
+				return false;
+			index.sync.reserve(entries);
+			for (uint32_t i = 0; i < entries; i++)
+			{
+				uint32_t number = mp4_be32(stbl.stss.data + 8 + i * 4);
+				if (number == 0 || number > count || (!index.sync.empty() && number - 1 <= index.sync.back()))
+					return false;
+				index.sync.push_back(number - 1);
+			}
+			// An empty table means no sync samples at all; decoding still has to
+			// start somewhere
+			if (index.sync.empty())
+				index.sync.push_back(0);
+		}
+
+		// Chunk offsets, 32 or 64 bit
+		const mp4_box_t& chunks = stbl.stco.data ? stbl.stco : stbl.co64;
+		bool wide = !stbl.stco.data;
+		if (!mp4_full_box(chunks, 4, &version))
+			return false;
+		uint32_t chunk_count = mp4_be32(chunks.data + 4);
+		if ((chunks.size - 8) / (wide ? 8 : 4) < chunk_count)
+			return false;
+
+		// Walk the sample-to-chunk runs, laying each chunk's samples out back to back
+		if (!mp4_full_box(stbl.stsc, 4, &version))
+			return false;
+		uint32_t stsc_count = mp4_be32(stbl.stsc.data + 4);
+		if ((stbl.stsc.size - 8) / 12 < stsc_count)
+			return false;
+		index.offset.resize(count);
+		sample = 0;
+		bool valid = true;
+		for (uint32_t e = 0; e < stsc_count && sample < count && valid; e++)
+		{
+			const uint8_t* entry = stbl.stsc.data + 8 + e * 12;
+			uint32_t first = mp4_be32(entry);
+			uint32_t per_chunk = mp4_be32(entry + 4);
+			uint32_t last = e + 1 < stsc_count ? mp4_be32(entry + 12) : chunk_count + 1;
+			if (first == 0 || last < first)
+				return false;
+			last = std::min(last, chunk_count + 1);
+
+			for (uint32_t c = first; c < last && sample < count && valid; c++)
+			{
+				const uint8_t* entry_offset = chunks.data + 8 + static_cast<size_t>(c - 1) * (wide ? 8 : 4);
+				uint64_t offset = wide ? mp4_be64(entry_offset) : mp4_be32(entry_offset);
+				for (uint32_t i = 0; i < per_chunk && sample < count; i++, sample++)
+				{
+					if (offset > file_size || index.size[sample] > file_size - offset)
+					{
+						valid = false;
+						break;
+					}
+					index.offset[sample] = offset;
+					offset += index.size[sample];
+				}
+			}
+		}
+
+		// Keep the prefix of samples that are actually in the file
+		if (sample < count)
+		{
+			if (sample == 0)
+				return false;
+			count = sample;
+			index.end_dts = index.dts[count - 1] + (index.dts.size() > count ? index.dts[count] - index.dts[count - 1] : 0);
+			index.offset.resize(count);
+			index.size.resize(count);
+			index.dts.resize(count);
+			index.cts_offset.resize(count);
+			while (!index.sync.empty() && index.sync.back() >= count)
+				index.sync.pop_back();
+			if (index.sync.empty() && mp4_full_box(stbl.stss, 4, &version))
+				index.sync.push_back(0);
+		}
+		return true;
+	}
+
+	static bool mp4_parse_trak(const mp4_box_t& trak, uint64_t file_size, /**[out]**/ mp4_track_t* track)
+	{
+		mp4_box_t tkhd, mdia, mdhd, hdlr, minf, stbl;
+		uint8_t version;
+		if (!mp4_find_box(trak, mp4_fourcc('t', 'k', 'h', 'd'), &tkhd) || !mp4_full_box(tkhd, 20, &version))
+			return false;
+		// track_ID follows the creation and modification times
+		track->id = mp4_be32(tkhd.data + (version == 1 ? 20 : 12));
+
+		if (!mp4_find_box(trak, mp4_fourcc('m', 'd', 'i', 'a'), &mdia) ||
+			!mp4_find_box(mdia, mp4_fourcc('m', 'd', 'h', 'd'), &mdhd) || !mp4_full_box(mdhd, 16, &version))
+			return false;
+		if (version == 1)
+		{
+			if (mdhd.size < 32)
+				return false;
+			track->timescale = mp4_be32(mdhd.data + 20);
+			track->duration = mp4_be64(mdhd.data + 24);
+		}
+		else
+		{
+			track->timescale = mp4_be32(mdhd.data + 12);
+			track->duration = mp4_be32(mdhd.data + 16);
+		}
+		if (track->timescale == 0)
+			return false;
+
+		if (!mp4_find_box(mdia, mp4_fourcc('h', 'd', 'l', 'r'), &hdlr) || !mp4_full_box(hdlr, 8, &version))
+			return false;
+		track->handler = mp4_be32(hdlr.data + 8);
+
+		if (!mp4_find_box(mdia, mp4_fourcc('m', 'i', 'n', 'f'), &minf) ||
+			!mp4_find_box(minf, mp4_fourcc('s', 't', 'b', 'l'), &stbl))
+			return false;
+
+		mp4_stbl_boxes_t boxes = {};
+		const uint8_t* p = stbl.data;
+		mp4_box_t box;
+		while (mp4_next_box(p, stbl.data + stbl.size, &box))
+		{
+			switch (box.type)
+			{
+			case mp4_fourcc('s', 't', 's', 'd'): boxes.stsd = box; break;
+			case mp4_fourcc('s', 't', 't', 's'): boxes.stts = box; break;
+			case mp4_fourcc('c', 't', 't', 's'): boxes.ctts = box; break;
+			case mp4_fourcc('s', 't', 's', 's'): boxes.stss = box; break;
+			case mp4_fourcc('s', 't', 's', 'z'): boxes.stsz = box; break;
+			case mp4_fourcc('s', 't', 'z', '2'): boxes.stz2 = box; break;
+			case mp4_fourcc('s', 't', 's', 'c'): boxes.stsc = box; break;
+			case mp4_fourcc('s', 't', 'c', 'o'): boxes.stco = box; break;
+			case mp4_fourcc('c', 'o', '6', '4'): boxes.co64 = box; break;
+			}
+		}
+
+		return mp4_parse_stsd(boxes.stsd, track) && mp4_build_index(boxes, file_size, track);
+	}
+
+	bool mp4_demuxer::open(const char* path)
+	{
+		close();
+		if (!_file.open(path))
+			return false;
+		_data = _file.data();
+		_size = _file.size();
+		if (!parse())
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+#ifdef _WIN32
+	bool mp4_demuxer::open(const wchar_t* path)
+	{
+		close();
+		if (!_file.open(path))
+			return false;
+		_data = _file.data();
+		_size = _file.size();
+		if (!parse())
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+#endif
+
+	bool mp4_demuxer::open_memory(const uint8_t* data, size_t size)
+	{
+		close();
+		_data = data;
+		_size = size;
+		if (!parse())
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void mp4_demuxer::close()
+	{
+		_tracks.clear();
+		_file.close();
+		_data = nullptr;
+		_size = 0;
+	}
+
+	bool mp4_demuxer::parse()
+	{
+		// moov can be at either end of the file; the mdat it indexes isn't touched
+		const uint8_t* p = _data;
+		const uint8_t* end = _data + _size;
+		mp4_box_t box, moov = {};
+		while (mp4_next_box(p, end, &box))
+		{
+			if (box.type == mp4_fourcc('m', 'o', 'o', 'v'))
+				moov = box;
+		}
+		if (!moov.data)
+			return false;
+
+		p = moov.data;
+		end = moov.data + moov.size;
+		while (mp4_next_box(p, end, &box))
+		{
+			if (box.type != mp4_fourcc('t', 'r', 'a', 'k'))
+				continue;
+			mp4_track_t track = {};
+			if (mp4_parse_trak(box, _size, &track))
+				_tracks.push_back(std::move(track));
+		}
+		return !_tracks.empty();
+	}
+
+	int32_t mp4_demuxer::find_track(uint32_t handler, uint32_t codec) const
+	{
+		for (size_t i = 0; i < _tracks.size(); i++)
+		{
+			if (_tracks[i].handler == handler && (codec == 0 || _tracks[i].codec == codec))
+				return static_cast<int32_t>(i);
+		}
+		return -1;
+	}
+
+	bool mp4_demuxer::get_sample(int32_t track, size_t index, mp4_sample_t* sample) const
+	{
+		if (track < 0 || static_cast<size_t>(track) >= _tracks.size())
+			return false;
+		const mp4_sample_index_t& samples = _tracks[track].samples;
+		if (index >= samples.count())
+			return false;
+
+		sample->data = _data + samples.offset[index];
+		sample->size = samples.size[index];
+		sample->dts = samples.dts[index];
+		sample->pts = samples.dts[index] + samples.cts_offset[index];
+		int64_t next = index + 1 < samples.count() ? samples.dts[index + 1] : samples.end_dts;
+		sample->duration = static_cast<uint32_t>(next - samples.dts[index]);
+		sample->sync = samples.sync.empty() || std::binary_search(samples.sync.begin(), samples.sync.end(), static_cast<uint32_t>(index));
+		return true;
+	}
+
+	size_t mp4_demuxer::find_sync_sample(int32_t track, int64_t pts) const
+	{
+		if (track < 0 || static_cast<size_t>(track) >= _tracks.size())
+			return 0;
+		const mp4_sample_index_t& samples = _tracks[track].samples;
+		if (samples.sync.empty())
+			return find_sample(track, pts);
+
+		// Sync samples start a new presentation run, so their pts increase
+		auto it = std::upper_bound(samples.sync.begin(), samples.sync.end(), pts,
+			[&samples](int64_t value, uint32_t i) { return value < samples.dts[i] + samples.cts_offset[i]; });
+		return it == samples.sync.begin() ? samples.sync.front() : *(it - 1);
+	}
+
+	size_t mp4_demuxer::find_sample(int32_t track, int64_t pts) const
+	{
+		if (track < 0 || static_cast<size_t>(track) >= _tracks.size())
+			return 0;
+		const mp4_sample_index_t& samples = _tracks[track].samples;
+
+		// Every frame is a keyframe, so presentation order is decode order
+		if (samples.sync.empty())
+		{
+			size_t lo = 0, hi = samples.count();
+			while (lo < hi)
+			{
+				size_t mid = lo + (hi - lo) / 2;
+				if (samples.dts[mid] + samples.cts_offset[mid] <= pts) lo = mid + 1;
+				else hi = mid;
+			}
+			return lo == 0 ? 0 : lo - 1;
+		}
+
+		// Reordered frames stay within their GOP, so search from the sync sample
+		// before pts up to the next one
+		size_t first = find_sync_sample(track, pts);
+		auto next = std::upper_bound(samples.sync.begin(), samples.sync.end(), static_cast<uint32_t>(first));
+		size_t last = next == samples.sync.end() ? samples.count() : *next;
+		size_t best = first;
+		int64_t best_pts = INT64_MIN;
+		for (size_t i = first; i < last; i++)
+		{
+			int64_t sample_pts = samples.dts[i] + samples.cts_offset[i];
+			if (sample_pts <= pts && sample_pts > best_pts)
+			{
+				best = i;
+				best_pts = sample_pts;
+			}
+		}
+		return best;
+	}
+
+	void mp4_demuxer::prefetch(int32_t track, size_t index, size_t count) const
+	{
+		if (!_file.is_open() || track < 0 || static_cast<size_t>(track) >= _tracks.size())
+			return;
+		const mp4_sample_index_t& samples = _tracks[track].samples;
+		if (index >= samples.count())
+			return;
+		count = std::min(count, samples.count() - index);
+
+		// Interleaved tracks put other data between our samples, but it is one
+		// range of the file either way
+		uint64_t begin = UINT64_MAX, end = 0;
+		for (size_t i = index; i < index + count; i++)
+		{
+			begin = std::min(begin, samples.offset[i]);
+			end = std::max(end, samples.offset[i] + samples.size[i]);
+		}
+		_file.prefetch(begin, end - begin);
+	}
+
+	size_t mp4_avcc_to_annexb(const uint8_t* src, size_t size, uint32_t nal_length_size, uint8_t* dst)
+	{
+		if (nal_length_size < 1 || nal_length_size > 4)
+			return 0;
+		const uint8_t* end = src + size;
+		uint8_t* out = dst;
+		while (src < end)
+		{
+			if (static_cast<size_t>(end - src) < nal_length_size)
+				return 0;
+			size_t length = 0;
+			for (uint32_t i = 0; i < nal_length_size; i++)
+				length = (length << 8) | src[i];
+			src += nal_length_size;
+			// An empty unit would grow the output without using up any input,
+			// past what mp4_annexb_max_size allows for
+			if (length == 0 || static_cast<size_t>(end - src) < length)
+				return 0;
+
+			out[0] = 0; out[1] = 0; out[2] = 0; out[3] = 1;
+			// memmove, as with 4 byte lengths this may run in place
+			memmove(out + 4, src, length);
+			out += 4 + length;
+			src += length;
+		}
+		return static_cast<size_t>(out - dst);
+	}
+
+	std::vector<uint8_t> mp4_track_annexb_header(const mp4_track_t& track)
+	{
+		static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+		std::vector<uint8_t> header;
+		for (const std::vector<std::vector<uint8_t>>* sets : { &track.sps, &track.pps })
+		{
+			for (const std::vector<uint8_t>& nal : *sets)
+			{
+				header.insert(header.end(), start_code, start_code + 4);
+				header.insert(header.end(), nal.begin(), nal.end());
+			}
+		}
+		return header;
+	}
+
+} // namespace nakamir
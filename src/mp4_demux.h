@@ -0,0 +1,124 @@
+#pragma once
+
+#include "mapped_file.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nakamir {
+
+	constexpr uint32_t mp4_fourcc(char a, char b, char c, char d)
+	{
+		return (static_cast<uint32_t>(static_cast<uint8_t>(a)) << 24) | (static_cast<uint32_t>(static_cast<uint8_t>(b)) << 16) |
+			(static_cast<uint32_t>(static_cast<uint8_t>(c)) << 8) | static_cast<uint32_t>(static_cast<uint8_t>(d));
+	}
+
+	// One sample as it sits in the file. data points into the mapping, so it
+	// stays valid for as long as the demuxer is open. Times are in the track's
+	// timescale; pts is dts plus the composition offset.
+	struct mp4_sample_t {
+		const uint8_t* data;
+		uint32_t size;
+		int64_t dts;
+		int64_t pts;
+		uint32_t duration;
+		bool sync;
+	};
+
+	// Sample table flattened out of stbl once at open, one entry per sample in
+	// decode order. Kept as parallel arrays so a seek or prefetch only touches
+	// the column it searches.
+	struct mp4_sample_index_t {
+		std::vector<uint64_t> offset;
+		std::vector<uint32_t> size;
+		std::vector<int64_t> dts;
+		std::vector<int32_t> cts_offset;  // pts - dts
+		std::vector<uint32_t> sync;       // Sorted indices of sync samples; empty if every sample is one
+		int64_t end_dts;                  // dts + duration of the last sample
+
+		size_t count() const { return offset.size(); }
+	};
+
+	struct mp4_track_t {
+		uint32_t id;
+		uint32_t handler;           // 'vide', 'soun', ...
+		uint32_t codec;             // Sample entry type: 'avc1', 'avc3', 'hvc1', 'mp4a', ...
+		uint32_t timescale;         // Ticks per second of every time in the track
+		uint64_t duration;          // In timescale ticks
+		uint32_t width;             // Visual sample entries only
+		uint32_t height;
+
+		// From avcC, for 'avc1'/'avc3' tracks
+		uint32_t nal_length_size;   // Bytes in each NAL unit's length prefix: 1, 2 or 4
+		uint8_t profile_idc;
+		uint8_t level_idc;
+		std::vector<std::vector<uint8_t>> sps;  // NAL units, header byte included
+		std::vector<std::vector<uint8_t>> pps;
+
+		mp4_sample_index_t samples;
+	};
+
+	// Demuxes a progressive (non-fragmented) ISO-BMFF/MP4 file straight out of a
+	// read-only memory mapping. Edit lists are ignored, so times are media times.
+	class mp4_demuxer {
+	public:
+		// Maps and indexes a file. Returns false if it can't be mapped or has no
+		// usable moov; tracks with a broken sample table are skipped.
+		bool open(const char* path);
+#ifdef _WIN32
+		bool open(const wchar_t* path);
+#endif
+		// Indexes a file already in memory, which must outlive the demuxer
+		bool open_memory(const uint8_t* data, size_t size);
+		void close();
+
+		const std::vector<mp4_track_t>& tracks() const { return _tracks; }
+		// First track with the given handler and, if non-zero, codec; -1 if none
+		int32_t find_track(uint32_t handler, uint32_t codec = 0) const;
+
+		// Zero-copy view of a sample; false past the end of the track
+		bool get_sample(int32_t track, size_t index, /**[out]**/ mp4_sample_t* sample) const;
+
+		// Index of the last sync sample presented at or before pts, for seeking.
+		// Frame-accurate seeks decode from here and drop output before pts.
+		size_t find_sync_sample(int32_t track, int64_t pts) const;
+		// Index of the sample presented at pts (the last one starting at or before it)
+		size_t find_sample(int32_t track, int64_t pts) const;
+
+		// Asks the OS to start reading samples [index, index + count) in the
+		// background, so the feeding thread doesn't stall on page faults
+		void prefetch(int32_t track, size_t index, size_t count) const;
+
+	private:
+		bool parse();
+
+		mapped_file _file;
+		const uint8_t* _data = nullptr;
+		uint64_t _size = 0;
+		std::vector<mp4_track_t> _tracks;
+	};
+
+	// Rewrites length-prefixed (AVCC) NAL units as Annex-B with 4 byte start
+	// codes. dst needs mp4_annexb_max_size bytes; returns the bytes written, or
+	// 0 if a length is zero or runs past the end of the sample, or
+	// nal_length_size isn't 1 to 4.
+	size_t mp4_avcc_to_annexb(const uint8_t* src, size_t size, uint32_t nal_length_size, /**[out]**/ uint8_t* dst);
+	inline size_t mp4_annexb_max_size(size_t size, uint32_t nal_length_size)
+	{
+		// Every NAL unit is at least one byte, and grows by 4 - nal_length_size
+		return nal_length_size >= 4 ? size : size + size / (nal_length_size + 1) * (4 - nal_length_size);
+	}
+
+	// The track's SPS and PPS as an Annex-B buffer, e.g. for
+	// MF_MT_MPEG_SEQUENCE_HEADER or to put in front of a sync sample
+	std::vector<uint8_t> mp4_track_annexb_header(const mp4_track_t& track);
+
+	// Converts a time in a track's timescale to another timescale, rounding down,
+	// without overflowing for long files with fine timescales
+	inline int64_t mp4_rescale(int64_t value, uint32_t from, uint32_t to)
+	{
+		int64_t whole = value / from, part = value % from;
+		return whole * to + part * static_cast<int64_t>(to) / from;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,467 @@
+#include "mp4_recorder.h"
+#include "mp4_demux.h"
+#include "h264_nal.h"
+#include "h264_sps.h"
+#include <cstring>
+
+namespace nakamir {
+
+	// trun sample_flags (ISO/IEC 14496-12 8.8.3.1): a sync sample depends on
+	// nothing; anything else depends on others and is a non-sync sample
+	const uint32_t mp4_sample_flags_sync = 0x02000000;
+	const uint32_t mp4_sample_flags_delta = 0x01010000;
+	// tfhd: offsets are relative to the moof, which is all a reader needs
+	const uint32_t mp4_tfhd_default_base_is_moof = 0x020000;
+	// trun: data offset, then per sample duration, size, flags and composition offset
+	const uint32_t mp4_trun_flags = 0x000001 | 0x000100 | 0x000200 | 0x000400 | 0x000800;
+	// Fixed part of a moof with one traf: moof 8, mfhd 16, traf 8, tfhd 16,
+	// tfdt (version 1) 20, trun 20; each sample adds 16 bytes of trun
+	const size_t mp4_moof_fixed_size = 88;
+	const size_t mp4_trun_sample_size = 16;
+	const uint32_t mp4_track_id = 1;
+	// mdat sizes stay below 32 bits so its header is always 8 bytes
+	const size_t mp4_max_fragment_limit = 1024 * 1024 * 1024;
+
+	static void mp4_put8(std::vector<uint8_t>& v, uint32_t value)
+	{
+		v.push_back(static_cast<uint8_t>(value));
+	}
+
+	static void mp4_put16(std::vector<uint8_t>& v, uint32_t value)
+	{
+		v.push_back(static_cast<uint8_t>(value >> 8));
+		v.push_back(static_cast<uint8_t>(value));
+	}
+
+	static void mp4_put32(std::vector<uint8_t>& v, uint32_t value)
+	{
+		for (int32_t shift = 24; shift >= 0; shift -= 8)
+			v.push_back(static_cast<uint8_t>(value >> shift));
+	}
+
+	static void mp4_put_bytes(std::vector<uint8_t>& v, const uint8_t* data, size_t size)
+	{
+		v.insert(v.end(), data, data + size);
+	}
+
+	static void mp4_put_zeros(std::vector<uint8_t>& v, size_t count)
+	{
+		v.insert(v.end(), count, 0);
+	}
+
+	// Opens a box and returns where it starts, for mp4_end_box to fill in its size
+	static size_t mp4_begin_box(std::vector<uint8_t>& v, uint32_t type)
+	{
+		size_t start = v.size();
+		mp4_put32(v, 0);
+		mp4_put32(v, type);
+		return start;
+	}
+
+	static size_t mp4_begin_full_box(std::vector<uint8_t>& v, uint32_t type, uint8_t version, uint32_t flags)
+	{
+		size_t start = mp4_begin_box(v, type);
+		mp4_put32(v, (static_cast<uint32_t>(version) << 24) | flags);
+		return start;
+	}
+
+	static void mp4_end_box(std::vector<uint8_t>& v, size_t start)
+	{
+		uint32_t size = static_cast<uint32_t>(v.size() - start);
+		v[start + 0] = static_cast<uint8_t>(size >> 24);
+		v[start + 1] = static_cast<uint8_t>(size >> 16);
+		v[start + 2] = static_cast<uint8_t>(size >> 8);
+		v[start + 3] = static_cast<uint8_t>(size);
+	}
+
+	static void mp4_put_unity_matrix(std::vector<uint8_t>& v)
+	{
+		static const uint32_t matrix[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+		for (uint32_t value : matrix)
+			mp4_put32(v, value);
+	}
+
+	static uint8_t* mp4_store32(uint8_t* p, uint32_t value)
+	{
+		p[0] = static_cast<uint8_t>(value >> 24);
+		p[1] = static_cast<uint8_t>(value >> 16);
+		p[2] = static_cast<uint8_t>(value >> 8);
+		p[3] = static_cast<uint8_t>(value);
+		return p + 4;
+	}
+
+	static uint8_t* mp4_store64(uint8_t* p, uint64_t value)
+	{
+		p = mp4_store32(p, static_cast<uint32_t>(value >> 32));
+		return mp4_store32(p, static_cast<uint32_t>(value));
+	}
+
+	size_t mp4_annexb_to_avcc(const uint8_t* src, size_t size, uint32_t drop_type_mask, uint8_t* dst)
+	{
+		uint8_t* out = dst;
+		size_t offset = 0;
+		h264_nal_t nal;
+		while (h264_next_nal(src, size, &offset, &nal))
+		{
+			if (drop_type_mask & (1u << nal.type))
+				continue;
+			out = mp4_store32(out, static_cast<uint32_t>(nal.size));
+			memcpy(out, nal.data, nal.size);
+			out += nal.size;
+		}
+		return static_cast<size_t>(out - dst);
+	}
+
+	mp4_recorder::~mp4_recorder()
+	{
+		close();
+	}
+
+	bool mp4_recorder::open(const char* path, uint32_t timescale, size_t max_fragment_bytes, size_t buffer_size)
+	{
+		close();
+		if (timescale == 0 || !_writer.open(path, buffer_size))
+			return false;
+
+		_timescale = timescale;
+		_max_fragment_bytes = max_fragment_bytes == 0 || max_fragment_bytes > mp4_max_fragment_limit ? mp4_max_fragment_limit : max_fragment_bytes;
+		_initialized = false;
+		_sps.clear();
+		_pps.clear();
+		_base_dts = 0;
+		_last_duration = 0;
+		_sequence = 0;
+		_samples.clear();
+		_payload_size = 0;
+		_sample_count = 0;
+		_keyframes = 0;
+		_fragments = 0;
+		_dropped = 0;
+		_parameter_changes = 0;
+		_largest_fragment = 0;
+		return true;
+	}
+
+	bool mp4_recorder::close()
+	{
+		if (!_writer.is_open())
+			return true;
+		if (!_samples.empty())
+			write_fragment(-1);
+		return _writer.close();
+	}
+
+	bool mp4_recorder::write_sample(const uint8_t* data, size_t size, int64_t pts, int64_t dts)
+	{
+		if (!_writer.is_open())
+			return false;
+
+		// Parameter sets matching the init segment's come out of the samples;
+		// changed ones stay in band, where decoders pick them up
+		h264_access_unit_info_t info = h264_scan_access_unit(data, size);
+		uint32_t drop_mask = (1u << h264_nal_aud) | (1u << h264_nal_filler);
+		if (info.has_sps || info.has_pps)
+		{
+			bool changed = false;
+			size_t offset = 0;
+			h264_nal_t nal;
+			while (h264_next_nal(data, size, &offset, &nal))
+			{
+				if (nal.type != h264_nal_sps && nal.type != h264_nal_pps)
+					continue;
+				std::vector<uint8_t>& stored = nal.type == h264_nal_sps ? _sps : _pps;
+				if (!_initialized)
+					stored.assign(nal.data, nal.data + nal.size);
+				else if (stored.size() != nal.size || memcmp(stored.data(), nal.data, nal.size) != 0)
+					changed = true;
+			}
+			if (changed)
+				_parameter_changes++;
+			else
+				drop_mask |= (1u << h264_nal_sps) | (1u << h264_nal_pps);
+		}
+
+		if (!_initialized)
+		{
+			// A player needs the init segment's SPS/PPS and a keyframe to start from
+			if (!info.idr || _sps.empty() || _pps.empty() || !write_init())
+			{
+				_dropped++;
+				return true;
+			}
+			drop_mask |= (1u << h264_nal_sps) | (1u << h264_nal_pps);
+			_base_dts = dts;
+		}
+
+		// A keyframe starts a GOP, and with it a fragment
+		size_t max_size = mp4_avcc_max_size(size);
+		if (!_samples.empty() && (info.idr || _payload_size + max_size > _max_fragment_bytes))
+			write_fragment(dts);
+
+		if (_payload.size() < _payload_size + max_size)
+			_payload.resize(_payload_size + max_size);
+		size_t written = mp4_annexb_to_avcc(data, size, drop_mask, _payload.data() + _payload_size);
+		if (written == 0)
+			return !_writer.failed();
+		_payload_size += written;
+
+		sample_t sample;
+		sample.size = static_cast<uint32_t>(written);
+		sample.flags = info.idr ? mp4_sample_flags_sync : mp4_sample_flags_delta;
+		sample.dts = dts - _base_dts;
+		sample.cts_offset = static_cast<int32_t>(pts - dts);
+		_samples.push_back(sample);
+		_sample_count++;
+		if (info.idr)
+			_keyframes++;
+		return !_writer.failed();
+	}
+
+	bool mp4_recorder::write_init()
+	{
+		h264_sps_t sps = {};
+		if (_sps.size() < 4 || !h264_parse_sps(_sps.data(), _sps.size(), &sps))
+			return false;
+
+		std::vector<uint8_t> v;
+		v.reserve(1024);
+
+		size_t ftyp = mp4_begin_box(v, mp4_fourcc('f', 't', 'y', 'p'));
+		mp4_put32(v, mp4_fourcc('i', 's', 'o', '5'));
+		mp4_put32(v, 512);
+		mp4_put32(v, mp4_fourcc('i', 's', 'o', '5'));
+		mp4_put32(v, mp4_fourcc('i', 's', 'o', '6'));
+		mp4_put32(v, mp4_fourcc('a', 'v', 'c', '1'));
+		mp4_put32(v, mp4_fourcc('m', 'p', '4', '1'));
+		mp4_end_box(v, ftyp);
+
+		size_t moov = mp4_begin_box(v, mp4_fourcc('m', 'o', 'o', 'v'));
+		{
+			// Durations are 0: the fragments carry all of the timing
+			size_t mvhd = mp4_begin_full_box(v, mp4_fourcc('m', 'v', 'h', 'd'), 0, 0);
+			mp4_put32(v, 0);                  // creation_time
+			mp4_put32(v, 0);                  // modification_time
+			mp4_put32(v, _timescale);
+			mp4_put32(v, 0);                  // duration
+			mp4_put32(v, 0x00010000);         // rate 1.0
+			mp4_put16(v, 0x0100);             // volume 1.0
+			mp4_put_zeros(v, 10);
+			mp4_put_unity_matrix(v);
+			mp4_put_zeros(v, 24);             // pre_defined
+			mp4_put32(v, mp4_track_id + 1);   // next_track_ID
+			mp4_end_box(v, mvhd);
+
+			size_t trak = mp4_begin_box(v, mp4_fourcc('t', 'r', 'a', 'k'));
+			{
+				size_t tkhd = mp4_begin_full_box(v, mp4_fourcc('t', 'k', 'h', 'd'), 0, 0x000003); // enabled, in movie
+				mp4_put32(v, 0);
+				mp4_put32(v, 0);
+				mp4_put32(v, mp4_track_id);
+				mp4_put32(v, 0);
+				mp4_put32(v, 0);              // duration
+				mp4_put_zeros(v, 8);
+				mp4_put16(v, 0);              // layer
+				mp4_put16(v, 0);              // alternate_group
+				mp4_put16(v, 0);              // volume, 0 for video
+				mp4_put16(v, 0);
+				mp4_put_unity_matrix(v);
+				mp4_put32(v, sps.width << 16);
+				mp4_put32(v, sps.height << 16);
+				mp4_end_box(v, tkhd);
+
+				size_t mdia = mp4_begin_box(v, mp4_fourcc('m', 'd', 'i', 'a'));
+				{
+					size_t mdhd = mp4_begin_full_box(v, mp4_fourcc('m', 'd', 'h', 'd'), 0, 0);
+					mp4_put32(v, 0);
+					mp4_put32(v, 0);
+					mp4_put32(v, _timescale);
+					mp4_put32(v, 0);
+					mp4_put16(v, 0x55C4);     // 'und'
+					mp4_put16(v, 0);
+					mp4_end_box(v, mdhd);
+
+					static const char handler_name[] = "VideoHandler";
+					size_t hdlr = mp4_begin_full_box(v, mp4_fourcc('h', 'd', 'l', 'r'), 0, 0);
+					mp4_put32(v, 0);
+					mp4_put32(v, mp4_fourcc('v', 'i', 'd', 'e'));
+					mp4_put_zeros(v, 12);
+					mp4_put_bytes(v, reinterpret_cast<const uint8_t*>(handler_name), sizeof(handler_name));
+					mp4_end_box(v, hdlr);
+
+					size_t minf = mp4_begin_box(v, mp4_fourcc('m', 'i', 'n', 'f'));
+					{
+						size_t vmhd = mp4_begin_full_box(v, mp4_fourcc('v', 'm', 'h', 'd'), 0, 1);
+						mp4_put_zeros(v, 8);  // graphicsmode, opcolor
+						mp4_end_box(v, vmhd);
+
+						size_t dinf = mp4_begin_box(v, mp4_fourcc('d', 'i', 'n', 'f'));
+						size_t dref = mp4_begin_full_box(v, mp4_fourcc('d', 'r', 'e', 'f'), 0, 0);
+						mp4_put32(v, 1);
+						size_t url = mp4_begin_full_box(v, mp4_fourcc('u', 'r', 'l', ' '), 0, 1); // Media is in this file
+						mp4_end_box(v, url);
+						mp4_end_box(v, dref);
+						mp4_end_box(v, dinf);
+
+						size_t stbl = mp4_begin_box(v, mp4_fourcc('s', 't', 'b', 'l'));
+						{
+							size_t stsd = mp4_begin_full_box(v, mp4_fourcc('s', 't', 's', 'd'), 0, 0);
+							mp4_put32(v, 1);
+							size_t avc1 = mp4_begin_box(v, mp4_fourcc('a', 'v', 'c', '1'));
+							mp4_put_zeros(v, 6);
+							mp4_put16(v, 1);          // data_reference_index
+							mp4_put_zeros(v, 16);     // pre_defined, reserved
+							mp4_put16(v, sps.width);
+							mp4_put16(v, sps.height);
+							mp4_put32(v, 0x00480000); // 72 dpi
+							mp4_put32(v, 0x00480000);
+							mp4_put32(v, 0);
+							mp4_put16(v, 1);          // frame_count
+							mp4_put_zeros(v, 32);     // compressorname
+							mp4_put16(v, 0x0018);     // depth
+							mp4_put16(v, 0xFFFF);     // pre_defined = -1
+
+							// ISO/IEC 14496-15 5.3.3.1, with 4 byte NAL lengths
+							size_t avcc = mp4_begin_box(v, mp4_fourcc('a', 'v', 'c', 'C'));
+							mp4_put8(v, 1);
+							mp4_put8(v, _sps[1]);     // profile_idc
+							mp4_put8(v, _sps[2]);     // constraint flags
+							mp4_put8(v, _sps[3]);     // level_idc
+							mp4_put8(v, 0xFC | 3);
+							mp4_put8(v, 0xE0 | 1);
+							mp4_put16(v, static_cast<uint32_t>(_sps.size()));
+							mp4_put_bytes(v, _sps.data(), _sps.size());
+							mp4_put8(v, 1);
+							mp4_put16(v, static_cast<uint32_t>(_pps.size()));
+							mp4_put_bytes(v, _pps.data(), _pps.size());
+							if (sps.profile_idc == 100 || sps.profile_idc == 110 || sps.profile_idc == 122 || sps.profile_idc == 144)
+							{
+								mp4_put8(v, 0xFC | sps.chroma_format_idc);
+								mp4_put8(v, 0xF8 | (sps.bit_depth_luma - 8));
+								mp4_put8(v, 0xF8 | (sps.bit_depth_chroma - 8));
+								mp4_put8(v, 0);       // numOfSequenceParameterSetExt
+							}
+							mp4_end_box(v, avcc);
+
+							if (sps.sar_width != sps.sar_height)
+							{
+								size_t pasp = mp4_begin_box(v, mp4_fourcc('p', 'a', 's', 'p'));
+								mp4_put32(v, sps.sar_width);
+								mp4_put32(v, sps.sar_height);
+								mp4_end_box(v, pasp);
+							}
+							mp4_end_box(v, avc1);
+							mp4_end_box(v, stsd);
+
+							// The sample tables proper are empty, samples live in the fragments
+							static const uint32_t empty_tables[] = {
+								mp4_fourcc('s', 't', 't', 's'), mp4_fourcc('s', 't', 's', 'c'), mp4_fourcc('s', 't', 'c', 'o'),
+							};
+							for (uint32_t type : empty_tables)
+							{
+								size_t table = mp4_begin_full_box(v, type, 0, 0);
+								mp4_put32(v, 0);
+								mp4_end_box(v, table);
+							}
+							size_t stsz = mp4_begin_full_box(v, mp4_fourcc('s', 't', 's', 'z'), 0, 0);
+							mp4_put32(v, 0);
+							mp4_put32(v, 0);
+							mp4_end_box(v, stsz);
+						}
+						mp4_end_box(v, stbl);
+					}
+					mp4_end_box(v, minf);
+				}
+				mp4_end_box(v, mdia);
+			}
+			mp4_end_box(v, trak);
+
+			size_t mvex = mp4_begin_box(v, mp4_fourcc('m', 'v', 'e', 'x'));
+			size_t trex = mp4_begin_full_box(v, mp4_fourcc('t', 'r', 'e', 'x'), 0, 0);
+			mp4_put32(v, mp4_track_id);
+			mp4_put32(v, 1);                  // default_sample_description_index
+			mp4_put32(v, 0);
+			mp4_put32(v, 0);
+			mp4_put32(v, 0);
+			mp4_end_box(v, trex);
+			mp4_end_box(v, mvex);
+		}
+		mp4_end_box(v, moov);
+
+		_initialized = true;
+		return _writer.write(v.data(), v.size());
+	}
+
+	void mp4_recorder::write_fragment(int64_t next_dts)
+	{
+		size_t count = _samples.size();
+		size_t moof_size = mp4_moof_fixed_size + count * mp4_trun_sample_size;
+		uint32_t mdat_size = static_cast<uint32_t>(8 + _payload_size);
+		_moof.resize(moof_size + 8);
+
+		// Every size is known up front, so the boxes go out in one pass
+		uint8_t* p = _moof.data();
+		p = mp4_store32(p, static_cast<uint32_t>(moof_size));
+		p = mp4_store32(p, mp4_fourcc('m', 'o', 'o', 'f'));
+		p = mp4_store32(p, 16);
+		p = mp4_store32(p, mp4_fourcc('m', 'f', 'h', 'd'));
+		p = mp4_store32(p, 0);
+		p = mp4_store32(p, ++_sequence);
+		p = mp4_store32(p, static_cast<uint32_t>(moof_size - 24));
+		p = mp4_store32(p, mp4_fourcc('t', 'r', 'a', 'f'));
+		p = mp4_store32(p, 16);
+		p = mp4_store32(p, mp4_fourcc('t', 'f', 'h', 'd'));
+		p = mp4_store32(p, mp4_tfhd_default_base_is_moof);
+		p = mp4_store32(p, mp4_track_id);
+		p = mp4_store32(p, 20);
+		p = mp4_store32(p, mp4_fourcc('t', 'f', 'd', 't'));
+		p = mp4_store32(p, 0x01000000);       // Version 1, 64 bit time
+		p = mp4_store64(p, static_cast<uint64_t>(_samples[0].dts));
+		p = mp4_store32(p, static_cast<uint32_t>(20 + count * mp4_trun_sample_size));
+		p = mp4_store32(p, mp4_fourcc('t', 'r', 'u', 'n'));
+		p = mp4_store32(p, 0x01000000 | mp4_trun_flags); // Version 1, signed composition offsets
+		p = mp4_store32(p, static_cast<uint32_t>(count));
+		p = mp4_store32(p, static_cast<uint32_t>(moof_size + 8)); // data_offset: past the mdat header
+		for (size_t i = 0; i < count; i++)
+		{
+			// Each sample lasts until the next; the last one until next_dts, or
+			// as long as the one before it when the stream ends
+			int64_t end = -1;
+			if (i + 1 < count)
+				end = _samples[i + 1].dts;
+			else if (next_dts >= 0)
+				end = next_dts - _base_dts;
+			if (end > _samples[i].dts)
+				_last_duration = static_cast<uint32_t>(end - _samples[i].dts);
+			p = mp4_store32(p, _last_duration);
+			p = mp4_store32(p, _samples[i].size);
+			p = mp4_store32(p, _samples[i].flags);
+			p = mp4_store32(p, static_cast<uint32_t>(_samples[i].cts_offset));
+		}
+		p = mp4_store32(p, mdat_size);
+		mp4_store32(p, mp4_fourcc('m', 'd', 'a', 't'));
+
+		_writer.write(_moof.data(), _moof.size());
+		_writer.write(_payload.data(), _payload_size);
+
+		uint64_t fragment_size = _moof.size() + _payload_size;
+		if (fragment_size > _largest_fragment.load(std::memory_order_relaxed))
+			_largest_fragment.store(fragment_size, std::memory_order_relaxed);
+		_fragments++;
+		_samples.clear();
+		_payload_size = 0;
+	}
+
+	mp4_recorder_stats_t mp4_recorder::get_stats()
+	{
+		mp4_recorder_stats_t stats = {};
+		stats.samples = _sample_count.load(std::memory_order_relaxed);
+		stats.keyframes = _keyframes.load(std::memory_order_relaxed);
+		stats.fragments = _fragments.load(std::memory_order_relaxed);
+		stats.dropped = _dropped.load(std::memory_order_relaxed);
+		stats.parameter_changes = _parameter_changes.load(std::memory_order_relaxed);
+		stats.largest_fragment = _largest_fragment.load(std::memory_order_relaxed);
+		stats.writer = _writer.get_stats();
+		return stats;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "file_writer.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nakamir {
+
+	struct mp4_recorder_stats_t {
+		uint64_t samples;            // Access units written into fragments
+		uint64_t keyframes;
+		uint64_t fragments;          // moof + mdat pairs written
+		uint64_t dropped;            // Samples before the first keyframe with SPS and PPS
+		uint64_t parameter_changes;  // Keyframes whose SPS/PPS differ from the init segment's; kept in band
+		uint64_t largest_fragment;   // Bytes, moof included
+		file_writer_stats_t writer;
+	};
+
+	// Records an Annex-B H.264 elementary stream, e.g. encoder output, as a
+	// fragmented MP4 (ISO-BMFF with an avc1 track and a moov up front). Nothing
+	// has to be rewritten at the end, so the file stays playable if the process
+	// dies mid-recording, and memory is bounded by one fragment plus the
+	// file_writer's two buffers however long it runs.
+	//
+	// Samples are rewritten as AVCC (4 byte lengths instead of start codes)
+	// into the current fragment; each keyframe closes the fragment before it,
+	// so a fragment is one GOP, and moof/mdat go out through the file_writer.
+	// The init segment is built once from the first keyframe's SPS/PPS, and
+	// moof sizes follow from the sample count, so no box is ever patched after
+	// it is written.
+	//
+	// write_sample and close belong to one thread (the encoder's); get_stats
+	// may be called from any.
+	class mp4_recorder {
+	public:
+		static const size_t default_fragment_bytes = 32 * 1024 * 1024;
+
+		mp4_recorder() = default;
+		~mp4_recorder();
+
+		mp4_recorder(const mp4_recorder&) = delete;
+		mp4_recorder& operator=(const mp4_recorder&) = delete;
+
+		// Creates the file, UTF-8 path. Times given to write_sample are in
+		// timescale ticks per second, 10000000 for MF sample times. A GOP that
+		// outgrows max_fragment_bytes is split into more than one fragment.
+		bool open(const char* path, uint32_t timescale, size_t max_fragment_bytes = default_fragment_bytes,
+			size_t buffer_size = file_writer::default_buffer_size);
+		// Writes out the last fragment and closes the file. False if any write
+		// failed since open.
+		bool close();
+		bool is_open() const { return _writer.is_open(); }
+
+		// Appends one access unit in Annex-B form, in decode order. AUD and
+		// filler NAL units are dropped, as are parameter sets the init segment
+		// already carries. False once the file has failed.
+		bool write_sample(const uint8_t* data, size_t size, int64_t pts, int64_t dts);
+
+		mp4_recorder_stats_t get_stats();
+
+	private:
+		struct sample_t {
+			uint32_t size;
+			uint32_t flags;       // trun sample_flags
+			int64_t dts;
+			int32_t cts_offset;
+		};
+
+		bool write_init();
+		// Writes the pending samples as one moof + mdat; next_dts ends the last
+		// sample, or is -1 to repeat the duration before it
+		void write_fragment(int64_t next_dts);
+
+		file_writer _writer;
+		uint32_t _timescale = 0;
+		size_t _max_fragment_bytes = 0;
+		bool _initialized = false;
+		std::vector<uint8_t> _sps;           // NAL units of the init segment, header byte included
+		std::vector<uint8_t> _pps;
+		int64_t _base_dts = 0;               // dts of the first sample, 0 in the file
+		uint32_t _last_duration = 0;
+		uint32_t _sequence = 0;
+
+		// The fragment being gathered. _payload only grows; _payload_size is
+		// what is used of it.
+		std::vector<sample_t> _samples;
+		std::vector<uint8_t> _payload;
+		size_t _payload_size = 0;
+		std::vector<uint8_t> _moof;
+
+		std::atomic<uint64_t> _sample_count = 0;
+		std::atomic<uint64_t> _keyframes = 0;
+		std::atomic<uint64_t> _fragments = 0;
+		std::atomic<uint64_t> _dropped = 0;
+		std::atomic<uint64_t> _parameter_changes = 0;
+		std::atomic<uint64_t> _largest_fragment = 0;
+	};
+
+	// Rewrites Annex-B NAL units as AVCC, each behind a 4 byte big endian
+	// length, dropping those whose type bit is in drop_type_mask. dst needs
+	// mp4_avcc_max_size bytes; returns the bytes written.
+	size_t mp4_annexb_to_avcc(const uint8_t* src, size_t size, uint32_t drop_type_mask, /**[out]**/ uint8_t* dst);
+	inline size_t mp4_avcc_max_size(size_t size)
+	{
+		// A 3 byte start code becomes a 4 byte length, and a NAL unit with its
+		// start code takes at least 4 bytes
+		return size + size / 4 + 4;
+	}
+
+} // namespace nakamir
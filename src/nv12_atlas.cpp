@@ -0,0 +1,216 @@
+#include "nv12_atlas.h"
+#include "error.h"
+#include "plane_copy.h"
+#include <cstring>
+
+namespace nakamir {
+
+	// Tiles not drawn for this long are fair game when the atlas is full
+	const double nv12_atlas_evict_seconds = 2.0;
+	// Kept clear between tiles, in luma texels, so filtering never reaches a neighbour
+	const uint32_t nv12_atlas_padding = 2;
+
+	static std::mutex atlas_registry_mtx;
+	static std::vector<nv12_atlas_t> atlas_registry;
+
+	static uint64_t nv12_atlas_now_ms() {
+		return static_cast<uint64_t>(time_total_unscaled() * 1000.0);
+	}
+
+	nv12_atlas_t nv12_atlas_find_or_create(const char* atlas_id, int width, int height) {
+		std::lock_guard<std::mutex> lock(atlas_registry_mtx);
+		for (nv12_atlas_t atlas : atlas_registry) {
+			if (strcmp(atlas->id, atlas_id) == 0) {
+				atlas->refs++;
+				return atlas;
+			}
+		}
+
+		shader_t nv12_quad_shader = shader_create_file("nv12_quad.hlsl");
+		if (nv12_quad_shader == nullptr) {
+			log_err("NV12 quad shader not found!");
+			return nullptr;
+		}
+
+		// Holds a C++ allocator and mutex, so unlike nv12_tex this isn't sk_malloc'd
+		nv12_atlas_t atlas = new _nv12_atlas_t();
+		strncpy(atlas->id, atlas_id, sizeof(atlas->id) - 1);
+		atlas->refs = 1;
+		atlas->width = width;
+		atlas->height = height;
+
+		// Written with UpdateSubresource rather than mapped, so not dynamic
+		atlas->luminance_tex = tex_create(tex_type_image_nomips, tex_format_r8);
+		atlas->chrominance_tex = tex_create(tex_type_image_nomips, tex_format_r8g8);
+		uint8_t* luminance_data = new uint8_t[static_cast<size_t>(width) * height]();
+		tex_set_colors(atlas->luminance_tex, width, height, luminance_data);
+		delete[] luminance_data;
+		uint16_t* chrominance_data = new uint16_t[static_cast<size_t>(width / 2) * (height / 2)]();
+		tex_set_colors(atlas->chrominance_tex, width / 2, height / 2, chrominance_data);
+		delete[] chrominance_data;
+		atlas->luminance_view = (ID3D11Texture2D*)tex_get_surface(atlas->luminance_tex);
+		atlas->chrominance_view = (ID3D11Texture2D*)tex_get_surface(atlas->chrominance_tex);
+
+		atlas->material = material_create(nv12_quad_shader);
+		shader_release(nv12_quad_shader);
+		material_set_texture(atlas->material, "luminance", atlas->luminance_tex);
+		material_set_texture(atlas->material, "chrominance", atlas->chrominance_tex);
+
+		// Even origins and sizes keep each tile's chroma on whole texels
+		atlas->allocator.reset(width, height, 2, nv12_atlas_padding);
+		atlas->stats = {};
+		atlas_registry.push_back(atlas);
+		return atlas;
+	}
+
+	void nv12_atlas_release(nv12_atlas_t nv12_atlas) {
+		std::lock_guard<std::mutex> lock(atlas_registry_mtx);
+		if (--nv12_atlas->refs > 0)
+			return;
+
+		for (size_t i = 0; i < atlas_registry.size(); i++) {
+			if (atlas_registry[i] == nv12_atlas) {
+				atlas_registry.erase(atlas_registry.begin() + i);
+				break;
+			}
+		}
+		tex_release(nv12_atlas->luminance_tex);
+		tex_release(nv12_atlas->chrominance_tex);
+		material_release(nv12_atlas->material);
+		delete nv12_atlas;
+	}
+
+	void nv12_atlas_attach(nv12_atlas_t nv12_atlas, nv12_tex_t nv12_tex) {
+		if (nv12_tex->atlas)
+			nv12_atlas_detach(nv12_tex);
+		std::lock_guard<std::mutex> lock(nv12_atlas->mtx);
+		nv12_tex->atlas = nv12_atlas;
+		nv12_tex->atlas_tile = -1;
+		nv12_tex->atlas_ready = false;
+	}
+
+	void nv12_atlas_detach(nv12_tex_t nv12_tex) {
+		nv12_atlas_t atlas = nv12_tex->atlas;
+		if (!atlas)
+			return;
+		std::lock_guard<std::mutex> lock(atlas->mtx);
+		if (nv12_tex->atlas_tile >= 0) {
+			atlas->allocator.release(nv12_tex->atlas_tile);
+			atlas->tiles[nv12_tex->atlas_tile] = nullptr;
+		}
+		nv12_tex->atlas = nullptr;
+		nv12_tex->atlas_tile = -1;
+		nv12_tex->atlas_ready = false;
+	}
+
+	// Finds a tile for the stream, evicting idle tiles and then repacking if it
+	// has to. Called with the atlas locked.
+	static int32_t nv12_atlas_place(nv12_atlas_t atlas, nv12_tex_t nv12_tex, uint64_t now) {
+		// Don't evict anyone for a stream that could never fit
+		if (nv12_tex->width + static_cast<int>(nv12_atlas_padding) > atlas->width || nv12_tex->height + static_cast<int>(nv12_atlas_padding) > atlas->height)
+			return -1;
+
+		atlas_allocator& allocator = atlas->allocator;
+		int32_t tile = allocator.allocate(nv12_tex->width, nv12_tex->height);
+
+		if (tile < 0) {
+			uint64_t idle = static_cast<uint64_t>(nv12_atlas_evict_seconds * 1000.0);
+			std::vector<int32_t> evicted;
+			allocator.evict(now > idle ? now - idle : 0, &evicted);
+			for (int32_t id : evicted) {
+				atlas->tiles[id]->atlas_tile = -1;
+				atlas->tiles[id]->atlas_ready = false;
+				atlas->tiles[id] = nullptr;
+			}
+			tile = allocator.allocate(nv12_tex->width, nv12_tex->height);
+		}
+
+		if (tile < 0) {
+			std::vector<atlas_move_t> moves;
+			if (allocator.defragment(&moves)) {
+				// Nothing is copied; moved tiles wait for their next frame
+				for (const atlas_move_t& move : moves)
+					atlas->tiles[move.id]->atlas_ready = false;
+				tile = allocator.allocate(nv12_tex->width, nv12_tex->height);
+			}
+		}
+
+		if (tile < 0)
+			return -1;
+		if (atlas->tiles.size() <= static_cast<size_t>(tile))
+			atlas->tiles.resize(tile + 1, nullptr);
+		atlas->tiles[tile] = nv12_tex;
+		allocator.touch(tile, now);
+		return tile;
+	}
+
+	bool nv12_atlas_upload(nv12_tex_t nv12_tex, const unsigned char* luminance, int luminance_stride, const unsigned char* chrominance, int chrominance_stride,
+		const std::vector<tile_diff_rect_t>* dirty) {
+		nv12_atlas_t atlas = nv12_tex->atlas;
+		if (!atlas)
+			return false;
+		std::lock_guard<std::mutex> lock(atlas->mtx);
+		// Detached while we waited for the lock
+		if (nv12_tex->atlas != atlas)
+			return false;
+		if (nv12_tex->atlas_tile < 0) {
+			nv12_tex->atlas_tile = nv12_atlas_place(atlas, nv12_tex, nv12_atlas_now_ms());
+			if (nv12_tex->atlas_tile < 0) {
+				atlas->stats.fallbacks++;
+				return false;
+			}
+		}
+
+		// A tile that was moved or evicted since comes back not ready
+		bool partial = dirty && nv12_tex->atlas_ready && nv12_tex->target == nv12_tex_target_atlas;
+		if (partial && dirty->empty())
+			return true;
+
+		atlas_rect_t rect;
+		atlas->allocator.get_rect(nv12_tex->atlas_tile, &rect);
+		tile_diff_rect_t full = nv12_full_rect(nv12_tex->width, nv12_tex->height);
+
+		bool on_main;
+		ID3D11DeviceContext* pContext = nv12_d3d_context_begin(&on_main);
+		uint64_t bytes = partial
+			? nv12_update_rects(pContext, atlas->luminance_view, atlas->chrominance_view, rect.x, rect.y, dirty->data(), dirty->size(), luminance, luminance_stride, chrominance, chrominance_stride)
+			: nv12_update_rects(pContext, atlas->luminance_view, atlas->chrominance_view, rect.x, rect.y, &full, 1, luminance, luminance_stride, chrominance, chrominance_stride);
+		nv12_d3d_context_end(pContext, on_main);
+
+		nv12_tex->atlas_ready = true;
+		atlas->stats.uploads++;
+		atlas->stats.upload_bytes += bytes;
+		return true;
+	}
+
+	bool nv12_atlas_get_uv_rect(nv12_tex_t nv12_tex, vec4* uv_rect) {
+		nv12_atlas_t atlas = nv12_tex->atlas;
+		if (!atlas)
+			return false;
+		std::lock_guard<std::mutex> lock(atlas->mtx);
+		if (nv12_tex->atlas_tile < 0 || !nv12_tex->atlas_ready)
+			return false;
+
+		atlas_rect_t rect;
+		atlas->allocator.get_rect(nv12_tex->atlas_tile, &rect);
+		atlas->allocator.touch(nv12_tex->atlas_tile, nv12_atlas_now_ms());
+
+		// Inset by a luma texel, which puts the edge samples on chroma texel
+		// centres, so bilinear filtering never mixes in the padding
+		float width = static_cast<float>(atlas->width);
+		float height = static_cast<float>(atlas->height);
+		uv_rect->x = (rect.x + 1) / width;
+		uv_rect->y = (rect.y + 1) / height;
+		uv_rect->z = (rect.width - 2) / width;
+		uv_rect->w = (rect.height - 2) / height;
+		return true;
+	}
+
+	nv12_atlas_stats_t nv12_atlas_get_stats(nv12_atlas_t nv12_atlas) {
+		std::lock_guard<std::mutex> lock(nv12_atlas->mtx);
+		nv12_atlas_stats_t stats = nv12_atlas->stats;
+		stats.allocator = nv12_atlas->allocator.get_stats();
+		return stats;
+	}
+
+} // namespace nakamir
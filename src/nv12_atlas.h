@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stereokit.h>
+#include "nv12_tex.h"
+#include "atlas_allocator.h"
+#include <mutex>
+#include <vector>
+
+using namespace sk;
+
+namespace nakamir {
+
+	struct nv12_atlas_stats_t {
+		atlas_allocator_stats_t allocator;
+		uint64_t uploads;         // Frames written into a tile
+		uint64_t upload_bytes;
+		uint64_t fallbacks;       // Frames that found no room and went to the stream's own textures
+	};
+
+	// Luma and chroma textures shared by many small NV12 streams, e.g. a wall
+	// of thumbnails. Each stream gets a tile, frames are written into just that
+	// tile with UpdateSubresource, and every tile is drawn through the atlas'
+	// one material, so a wall of them binds one texture pair. The tile's UV
+	// rect goes in the quad mesh it is drawn with (see nv12_sprite).
+	//
+	// Tiles not drawn for a while are evicted when space runs out, and as a
+	// last resort the atlas is repacked; a stream whose tile moved is drawn
+	// from its own textures until its next frame lands in the new spot.
+	struct _nv12_atlas_t {
+		char id[64];
+		int32_t refs;
+		int width;
+		int height;
+		material_t material;
+		tex_t luminance_tex;
+		tex_t chrominance_tex;
+		ID3D11Texture2D* luminance_view;
+		ID3D11Texture2D* chrominance_view;
+
+		// Uploads may come from decoder threads while the main thread draws
+		std::mutex mtx;
+		atlas_allocator allocator;
+		std::vector<nv12_tex_t> tiles;    // Owner of each allocator id
+		nv12_atlas_stats_t stats;
+	};
+
+	// Shared by id, like nv12_sprite_create's atlas_id. Size only applies to
+	// the first call for an id.
+	nv12_atlas_t nv12_atlas_find_or_create(const char* atlas_id, int width = 2048, int height = 2048);
+	void nv12_atlas_release(nv12_atlas_t nv12_atlas);
+
+	// Routes the stream's frames into the atlas. Its tile is placed on the
+	// first upload.
+	void nv12_atlas_attach(nv12_atlas_t nv12_atlas, nv12_tex_t nv12_tex);
+	void nv12_atlas_detach(nv12_tex_t nv12_tex);
+
+	// Writes a frame into the stream's tile, placing it first if need be.
+	// Returns false if there is no room, for the caller to upload elsewhere.
+	// With dirty rects from the stream's differ, a tile that holds the
+	// previous frame only gets those; a new or moved tile gets everything.
+	bool nv12_atlas_upload(nv12_tex_t nv12_tex, const unsigned char* luminance, int luminance_stride, const unsigned char* chrominance, int chrominance_stride,
+		const std::vector<tile_diff_rect_t>* dirty = nullptr);
+	// UV offset in xy and scale in zw of the stream's tile, for drawing with
+	// the atlas material. Returns false if the tile holds no frame to draw.
+	bool nv12_atlas_get_uv_rect(nv12_tex_t nv12_tex, /**[out]**/ vec4* uv_rect);
+
+	nv12_atlas_stats_t nv12_atlas_get_stats(nv12_atlas_t nv12_atlas);
+
+} // namespace nakamir
@@ -0,0 +1,388 @@
+#include "nv12_convert.h"
+#include "plane_copy.h"
+#include "cpu_features.h"
+#include "parallel_for.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#if SKMF_NEON
+#include <arm_neon.h>
+#endif
+
+namespace nakamir {
+
+	static std::atomic<int> _nv12_convert_impl = nv12_convert_impl_auto;
+
+	static yuv_to_rgb_coeffs_t make_yuv_to_rgb_coeffs(double kr, double kb, color_range_ range)
+	{
+		// https://www.itu.int/rec/R-REC-BT.601 and BT.709, solved for R, G and B
+		double kg = 1.0 - kr - kb;
+		double y_scale = range == color_range_limited ? 255.0 / 219.0 : 1.0;
+		double c_scale = range == color_range_limited ? 255.0 / 224.0 : 1.0;
+		auto fixed = [](double value) { return static_cast<int32_t>(std::lround(value * 8192.0)); };
+
+		yuv_to_rgb_coeffs_t result = {};
+		result.y_offset = range == color_range_limited ? 16 : 0;
+		result.y_scale  = fixed(y_scale);
+		result.v_r      = fixed(c_scale * 2.0 * (1.0 - kr));
+		result.u_g      = fixed(-c_scale * 2.0 * (1.0 - kb) * kb / kg);
+		result.v_g      = fixed(-c_scale * 2.0 * (1.0 - kr) * kr / kg);
+		result.u_b      = fixed(c_scale * 2.0 * (1.0 - kb));
+		return result;
+	}
+
+	const yuv_to_rgb_coeffs_t* yuv_to_rgb_coeffs(color_matrix_ matrix, color_range_ range)
+	{
+		static const yuv_to_rgb_coeffs_t table[2][2] = {
+			{ make_yuv_to_rgb_coeffs(0.299,  0.114,  color_range_limited), make_yuv_to_rgb_coeffs(0.299,  0.114,  color_range_full) },
+			{ make_yuv_to_rgb_coeffs(0.2126, 0.0722, color_range_limited), make_yuv_to_rgb_coeffs(0.2126, 0.0722, color_range_full) },
+		};
+		return &table[matrix == color_matrix_bt709 ? 1 : 0][range == color_range_full ? 1 : 0];
+	}
+
+	static rgb_to_yuv_coeffs_t make_rgb_to_yuv_coeffs(double kr, double kb, color_range_ range)
+	{
+		double kg = 1.0 - kr - kb;
+		double y_scale = range == color_range_limited ? 219.0 / 255.0 : 1.0;
+		double c_scale = range == color_range_limited ? 224.0 / 255.0 : 1.0;
+		auto fixed = [](double value) { return static_cast<int32_t>(std::lround(value * 32768.0)); };
+
+		rgb_to_yuv_coeffs_t result = {};
+		result.y_r = fixed(y_scale * kr);
+		result.y_g = fixed(y_scale * kg);
+		result.y_b = fixed(y_scale * kb);
+		// U = (B - Y) / (2 (1 - kb)), V = (R - Y) / (2 (1 - kr))
+		result.u_r = fixed(-c_scale * kr / (2.0 * (1.0 - kb)));
+		result.u_g = fixed(-c_scale * kg / (2.0 * (1.0 - kb)));
+		result.u_b = fixed(c_scale * 0.5);
+		result.v_r = fixed(c_scale * 0.5);
+		result.v_g = fixed(-c_scale * kg / (2.0 * (1.0 - kr)));
+		result.v_b = fixed(-c_scale * kb / (2.0 * (1.0 - kr)));
+		result.y_bias = ((range == color_range_limited ? 16 : 0) << 15) + (1 << 14);
+		result.c_bias = (128 << 15) + (1 << 14);
+		return result;
+	}
+
+	const rgb_to_yuv_coeffs_t* rgb_to_yuv_coeffs(color_matrix_ matrix, color_range_ range)
+	{
+		static const rgb_to_yuv_coeffs_t table[2][2] = {
+			{ make_rgb_to_yuv_coeffs(0.299,  0.114,  color_range_limited), make_rgb_to_yuv_coeffs(0.299,  0.114,  color_range_full) },
+			{ make_rgb_to_yuv_coeffs(0.2126, 0.0722, color_range_limited), make_rgb_to_yuv_coeffs(0.2126, 0.0722, color_range_full) },
+		};
+		return &table[matrix == color_matrix_bt709 ? 1 : 0][range == color_range_full ? 1 : 0];
+	}
+
+	static bool nv12_convert_impl_supported(nv12_convert_impl_ impl)
+	{
+		switch (impl)
+		{
+		case nv12_convert_impl_auto:
+		case nv12_convert_impl_scalar: return true;
+		case nv12_convert_impl_sse41:  return SKMF_X86 && cpu_has(cpu_feature_sse41);
+		case nv12_convert_impl_avx2:   return SKMF_X86 && cpu_has(cpu_feature_avx2);
+		case nv12_convert_impl_neon:   return SKMF_NEON && cpu_has(cpu_feature_neon);
+		default:                       return false;
+		}
+	}
+
+	static nv12_convert_impl_ nv12_convert_resolve(nv12_convert_impl_ impl)
+	{
+		if (impl != nv12_convert_impl_auto)
+			return impl;
+		if (nv12_convert_impl_supported(nv12_convert_impl_avx2))  return nv12_convert_impl_avx2;
+		if (nv12_convert_impl_supported(nv12_convert_impl_sse41)) return nv12_convert_impl_sse41;
+		if (nv12_convert_impl_supported(nv12_convert_impl_neon))  return nv12_convert_impl_neon;
+		return nv12_convert_impl_scalar;
+	}
+
+	static nv12_to_rgb_row_fn nv12_to_rgb_row_kernel(nv12_convert_impl_ impl)
+	{
+		switch (impl)
+		{
+		case nv12_convert_impl_sse41: return nv12_to_rgb_row_sse41;
+		case nv12_convert_impl_avx2:  return nv12_to_rgb_row_avx2;
+		case nv12_convert_impl_neon:  return nv12_to_rgb_row_neon;
+		default:                      return nv12_to_rgb_row_scalar;
+		}
+	}
+
+	static rgb_to_nv12_row_fn rgb_to_nv12_row_kernel(nv12_convert_impl_ impl)
+	{
+		switch (impl)
+		{
+		case nv12_convert_impl_sse41: return rgb_to_nv12_row_sse41;
+		case nv12_convert_impl_avx2:  return rgb_to_nv12_row_avx2;
+		case nv12_convert_impl_neon:  return rgb_to_nv12_row_neon;
+		default:                      return rgb_to_nv12_row_scalar;
+		}
+	}
+
+	bool nv12_convert_set_impl(nv12_convert_impl_ impl)
+	{
+		if (!nv12_convert_impl_supported(impl))
+			return false;
+		_nv12_convert_impl = impl;
+		return true;
+	}
+
+	nv12_convert_impl_ nv12_convert_get_impl()
+	{
+		return nv12_convert_resolve(static_cast<nv12_convert_impl_>(_nv12_convert_impl.load()));
+	}
+
+	const char* nv12_convert_impl_name(nv12_convert_impl_ impl)
+	{
+		switch (impl)
+		{
+		case nv12_convert_impl_auto:   return "auto";
+		case nv12_convert_impl_scalar: return "scalar";
+		case nv12_convert_impl_sse41:  return "sse41";
+		case nv12_convert_impl_avx2:   return "avx2";
+		case nv12_convert_impl_neon:   return "neon";
+		default:                       return "unknown";
+		}
+	}
+
+	void nv12_to_rgb(uint8_t* dst, int32_t dst_stride,
+		const uint8_t* src_y, int32_t src_y_stride, const uint8_t* src_uv, int32_t src_uv_stride,
+		int32_t width, int32_t height, rgb_format_ format, color_matrix_ matrix, color_range_ range)
+	{
+		if (width <= 0 || height <= 0)
+			return;
+
+		const yuv_to_rgb_coeffs_t* coeffs = yuv_to_rgb_coeffs(matrix, range);
+		nv12_to_rgb_row_fn convert_row = nv12_to_rgb_row_kernel(nv12_convert_get_impl());
+		bool bgra = format == rgb_format_bgra;
+
+		for (int32_t y = 0; y < height; y++)
+		{
+			convert_row(dst + static_cast<ptrdiff_t>(dst_stride) * y,
+				src_y + static_cast<ptrdiff_t>(src_y_stride) * y,
+				src_uv + static_cast<ptrdiff_t>(src_uv_stride) * (y / 2),
+				0, width, coeffs, bgra);
+		}
+	}
+
+	struct _rgb_to_nv12_job_t {
+		uint8_t* dst_y;
+		int32_t dst_y_stride;
+		uint8_t* dst_uv;
+		int32_t dst_uv_stride;
+		const uint8_t* src;
+		int32_t src_stride;
+		int32_t width;
+		int32_t height;
+		const rgb_to_yuv_coeffs_t* coeffs;
+		rgb_to_nv12_row_fn convert_rows;
+		bool bgra;
+	};
+
+	static void rgb_to_nv12_band(int32_t begin, int32_t end, void* context)
+	{
+		const _rgb_to_nv12_job_t* job = static_cast<const _rgb_to_nv12_job_t*>(context);
+		for (int32_t pair = begin; pair < end; pair++)
+		{
+			int32_t y0 = pair * 2;
+			int32_t y1 = y0 + 1 < job->height ? y0 + 1 : y0;
+			job->convert_rows(
+				job->dst_y + static_cast<ptrdiff_t>(job->dst_y_stride) * y0,
+				job->dst_y + static_cast<ptrdiff_t>(job->dst_y_stride) * y1,
+				job->dst_uv + static_cast<ptrdiff_t>(job->dst_uv_stride) * pair,
+				job->src + static_cast<ptrdiff_t>(job->src_stride) * y0,
+				job->src + static_cast<ptrdiff_t>(job->src_stride) * y1,
+				0, job->width, job->coeffs, job->bgra);
+		}
+	}
+
+	void rgb_to_nv12(uint8_t* dst_y, int32_t dst_y_stride, uint8_t* dst_uv, int32_t dst_uv_stride,
+		const uint8_t* src, int32_t src_stride, int32_t width, int32_t height, rgb_format_ format,
+		color_matrix_ matrix, color_range_ range, int32_t max_threads)
+	{
+		if (width <= 0 || height <= 0)
+			return;
+
+		_rgb_to_nv12_job_t job = {};
+		job.dst_y = dst_y;
+		job.dst_y_stride = dst_y_stride;
+		job.dst_uv = dst_uv;
+		job.dst_uv_stride = dst_uv_stride;
+		job.src = src;
+		job.src_stride = src_stride;
+		job.width = width;
+		job.height = height;
+		job.coeffs = rgb_to_yuv_coeffs(matrix, range);
+		job.convert_rows = rgb_to_nv12_row_kernel(nv12_convert_get_impl());
+		job.bgra = format == rgb_format_bgra;
+
+		// Bands of at least ~64K pixels, below that the handoff costs more than it saves
+		int32_t min_pairs = std::max(1, 32768 / width);
+		parallel_for(nv12_chroma_rows(height), min_pairs, rgb_to_nv12_band, &job, max_threads);
+	}
+
+	static inline uint8_t clamp_u8(int32_t value)
+	{
+		return static_cast<uint8_t>(value < 0 ? 0 : value > 255 ? 255 : value);
+	}
+
+	void nv12_to_rgb_row_scalar(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* c, bool bgra)
+	{
+		int32_t r_index = bgra ? 2 : 0;
+		int32_t b_index = bgra ? 0 : 2;
+		for (int32_t x = x0; x < width; x++)
+		{
+			int32_t u = uv[(x / 2) * 2]     - 128;
+			int32_t v = uv[(x / 2) * 2 + 1] - 128;
+			int32_t luma = (y[x] - c->y_offset) * c->y_scale + 4096;
+
+			uint8_t* px = dst + x * 4;
+			px[r_index] = clamp_u8((luma + c->v_r * v) >> 13);
+			px[1]       = clamp_u8((luma + c->u_g * u + c->v_g * v) >> 13);
+			px[b_index] = clamp_u8((luma + c->u_b * u) >> 13);
+			px[3]       = 255;
+		}
+	}
+
+	void rgb_to_nv12_row_scalar(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* c, bool bgra)
+	{
+		int32_t r_index = bgra ? 2 : 0;
+		int32_t b_index = bgra ? 0 : 2;
+		for (int32_t x = x0; x < width; x += 2)
+		{
+			int32_t x1 = x + 1 < width ? x + 1 : x;
+			const uint8_t* block[4] = { src0 + x * 4, src0 + x1 * 4, src1 + x * 4, src1 + x1 * 4 };
+			int32_t luma[4];
+			int32_t r = 0, g = 0, b = 0;
+			for (int32_t i = 0; i < 4; i++)
+			{
+				const uint8_t* px = block[i];
+				luma[i] = (c->y_r * px[r_index] + c->y_g * px[1] + c->y_b * px[b_index] + c->y_bias) >> 15;
+				r += px[r_index];
+				g += px[1];
+				b += px[b_index];
+			}
+			r = (r + 2) >> 2;
+			g = (g + 2) >> 2;
+			b = (b + 2) >> 2;
+
+			dst_y0[x] = clamp_u8(luma[0]);
+			dst_y1[x] = clamp_u8(luma[2]);
+			if (x1 != x)
+			{
+				dst_y0[x1] = clamp_u8(luma[1]);
+				dst_y1[x1] = clamp_u8(luma[3]);
+			}
+			dst_uv[x]     = clamp_u8((c->u_r * r + c->u_g * g + c->u_b * b + c->c_bias) >> 15);
+			dst_uv[x + 1] = clamp_u8((c->v_r * r + c->v_g * g + c->v_b * b + c->c_bias) >> 15);
+		}
+	}
+
+#if SKMF_NEON
+	// Converts 4 pixels of 16 bit luma/chroma to R, G and B, saturated to [0, 65535]
+	static inline void yuv_to_rgb_4(int16x4_t luma, int16x4_t u, int16x4_t v, const yuv_to_rgb_coeffs_t* c, uint16x4_t* r, uint16x4_t* g, uint16x4_t* b)
+	{
+		int32x4_t y_term = vmull_n_s16(luma, static_cast<int16_t>(c->y_scale));
+		// vqrshrun adds the 4096 rounding term before shifting, like the scalar code
+		*r = vqrshrun_n_s32(vmlal_n_s16(y_term, v, static_cast<int16_t>(c->v_r)), 13);
+		*g = vqrshrun_n_s32(vmlal_n_s16(vmlal_n_s16(y_term, u, static_cast<int16_t>(c->u_g)), v, static_cast<int16_t>(c->v_g)), 13);
+		*b = vqrshrun_n_s32(vmlal_n_s16(y_term, u, static_cast<int16_t>(c->u_b)), 13);
+	}
+
+	void nv12_to_rgb_row_neon(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* c, bool bgra)
+	{
+		const int16x8_t y_offset = vdupq_n_s16(static_cast<int16_t>(c->y_offset));
+		const int16x8_t bias     = vdupq_n_s16(128);
+
+		int32_t x = x0;
+		for (; x + 16 <= width; x += 16)
+		{
+			uint8x16_t luma8 = vld1q_u8(y + x);
+			uint8x8x2_t chroma = vld2_u8(uv + x);
+			// Each chroma pair covers two pixels, so spread the Us and Vs out to match
+			uint8x8x2_t u8 = vzip_u8(chroma.val[0], chroma.val[0]);
+			uint8x8x2_t v8 = vzip_u8(chroma.val[1], chroma.val[1]);
+
+			uint8x8_t r8[2], g8[2], b8[2];
+			for (int half = 0; half < 2; half++)
+			{
+				int16x8_t luma = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(half ? vget_high_u8(luma8) : vget_low_u8(luma8))), y_offset);
+				int16x8_t u    = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8.val[half])), bias);
+				int16x8_t v    = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8.val[half])), bias);
+
+				uint16x4_t r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+				yuv_to_rgb_4(vget_low_s16(luma),  vget_low_s16(u),  vget_low_s16(v),  c, &r_lo, &g_lo, &b_lo);
+				yuv_to_rgb_4(vget_high_s16(luma), vget_high_s16(u), vget_high_s16(v), c, &r_hi, &g_hi, &b_hi);
+				r8[half] = vqmovn_u16(vcombine_u16(r_lo, r_hi));
+				g8[half] = vqmovn_u16(vcombine_u16(g_lo, g_hi));
+				b8[half] = vqmovn_u16(vcombine_u16(b_lo, b_hi));
+			}
+
+			uint8x16x4_t px;
+			px.val[0] = bgra ? vcombine_u8(b8[0], b8[1]) : vcombine_u8(r8[0], r8[1]);
+			px.val[1] = vcombine_u8(g8[0], g8[1]);
+			px.val[2] = bgra ? vcombine_u8(r8[0], r8[1]) : vcombine_u8(b8[0], b8[1]);
+			px.val[3] = vdupq_n_u8(255);
+			vst4q_u8(dst + x * 4, px);
+		}
+		nv12_to_rgb_row_scalar(dst, y, uv, x, width, c, bgra);
+	}
+
+	// Weighted sum of 8 pixels' channels plus bias, shifted down and saturated to bytes
+	static inline uint8x8_t rgb_dot_8(uint16x8_t r, uint16x8_t g, uint16x8_t b, int32_t cr, int32_t cg, int32_t cb, int32_t bias)
+	{
+		int32x4_t lo = vdupq_n_s32(bias), hi = vdupq_n_s32(bias);
+		lo = vmlal_n_s16(lo, vreinterpret_s16_u16(vget_low_u16(r)),  static_cast<int16_t>(cr));
+		hi = vmlal_n_s16(hi, vreinterpret_s16_u16(vget_high_u16(r)), static_cast<int16_t>(cr));
+		lo = vmlal_n_s16(lo, vreinterpret_s16_u16(vget_low_u16(g)),  static_cast<int16_t>(cg));
+		hi = vmlal_n_s16(hi, vreinterpret_s16_u16(vget_high_u16(g)), static_cast<int16_t>(cg));
+		lo = vmlal_n_s16(lo, vreinterpret_s16_u16(vget_low_u16(b)),  static_cast<int16_t>(cb));
+		hi = vmlal_n_s16(hi, vreinterpret_s16_u16(vget_high_u16(b)), static_cast<int16_t>(cb));
+		return vqmovn_u16(vcombine_u16(vqmovun_s32(vshrq_n_s32(lo, 15)), vqmovun_s32(vshrq_n_s32(hi, 15))));
+	}
+
+	static inline uint8x16_t rgb_luma_16(uint8x16x4_t px, const rgb_to_yuv_coeffs_t* c, int r_index, int b_index)
+	{
+		uint8x8_t lo = rgb_dot_8(vmovl_u8(vget_low_u8(px.val[r_index])), vmovl_u8(vget_low_u8(px.val[1])),
+			vmovl_u8(vget_low_u8(px.val[b_index])), c->y_r, c->y_g, c->y_b, c->y_bias);
+		uint8x8_t hi = rgb_dot_8(vmovl_u8(vget_high_u8(px.val[r_index])), vmovl_u8(vget_high_u8(px.val[1])),
+			vmovl_u8(vget_high_u8(px.val[b_index])), c->y_r, c->y_g, c->y_b, c->y_bias);
+		return vcombine_u8(lo, hi);
+	}
+
+	void rgb_to_nv12_row_neon(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* c, bool bgra)
+	{
+		int r_index = bgra ? 2 : 0;
+		int b_index = bgra ? 0 : 2;
+
+		int32_t x = x0;
+		for (; x + 16 <= width; x += 16)
+		{
+			uint8x16x4_t px0 = vld4q_u8(src0 + x * 4);
+			uint8x16x4_t px1 = vld4q_u8(src1 + x * 4);
+			vst1q_u8(dst_y0 + x, rgb_luma_16(px0, c, r_index, b_index));
+			vst1q_u8(dst_y1 + x, rgb_luma_16(px1, c, r_index, b_index));
+
+			// Horizontal pairs of both rows, then (sum + 2) >> 2
+			uint16x8_t r = vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(px0.val[r_index]), px1.val[r_index]), 2);
+			uint16x8_t g = vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(px0.val[1]), px1.val[1]), 2);
+			uint16x8_t b = vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(px0.val[b_index]), px1.val[b_index]), 2);
+			uint8x8x2_t uv;
+			uv.val[0] = rgb_dot_8(r, g, b, c->u_r, c->u_g, c->u_b, c->c_bias);
+			uv.val[1] = rgb_dot_8(r, g, b, c->v_r, c->v_g, c->v_b, c->c_bias);
+			vst2_u8(dst_uv + x, uv);
+		}
+		rgb_to_nv12_row_scalar(dst_y0, dst_y1, dst_uv, src0, src1, x, width, c, bgra);
+	}
+#else
+	void nv12_to_rgb_row_neon(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* c, bool bgra)
+	{
+		nv12_to_rgb_row_scalar(dst, y, uv, x0, width, c, bgra);
+	}
+
+	void rgb_to_nv12_row_neon(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* c, bool bgra)
+	{
+		rgb_to_nv12_row_scalar(dst_y0, dst_y1, dst_uv, src0, src1, x0, width, c, bgra);
+	}
+#endif
+
+} // namespace nakamir
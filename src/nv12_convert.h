@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nakamir {
+
+	enum color_matrix_ {
+		color_matrix_bt601,     // SD content, and what nv12_quad.hlsl assumes
+		color_matrix_bt709,     // HD content
+	};
+
+	enum color_range_ {
+		color_range_limited,    // Y in [16, 235], UV in [16, 240]
+		color_range_full,       // Everything in [0, 255], e.g. JPEG and most webcams
+	};
+
+	enum rgb_format_ {
+		rgb_format_rgba,        // R G B A bytes in memory, tex_format_rgba32
+		rgb_format_bgra,        // B G R A bytes in memory, MFVideoFormat_RGB32/ARGB32
+	};
+
+	enum nv12_convert_impl_ {
+		nv12_convert_impl_auto, // Best available on this CPU
+		nv12_convert_impl_scalar,
+		nv12_convert_impl_sse41,
+		nv12_convert_impl_avx2,
+		nv12_convert_impl_neon,
+	};
+
+	// Fixed point YUV to RGB coefficients with 13 fractional bits, small enough
+	// for 16 bit multiply-adds. Every kernel does exactly this integer math, so
+	// the SIMD paths are bit-exact with the scalar one:
+	//   y' = (Y - y_offset) * y_scale + 4096, u' = U - 128, v' = V - 128
+	//   R = clamp((y' + v_r * v') >> 13), G = clamp((y' + u_g * u' + v_g * v') >> 13)
+	//   B = clamp((y' + u_b * u') >> 13)
+	struct yuv_to_rgb_coeffs_t {
+		int32_t y_offset;
+		int32_t y_scale;
+		int32_t v_r;
+		int32_t u_g;
+		int32_t v_g;
+		int32_t u_b;
+	};
+
+	const yuv_to_rgb_coeffs_t* yuv_to_rgb_coeffs(color_matrix_ matrix, color_range_ range);
+
+	// Converts an NV12 image to 32 bit RGB with opaque alpha, doing the same math as
+	// the nv12_quad shader but with each chroma sample covering its 2x2 luma block
+	// rather than being filtered. Strides are in bytes; odd sizes are fine as long
+	// as the chroma plane has (width + 1) / 2 pairs per row.
+	void nv12_to_rgb(/**[out]**/ uint8_t* dst, int32_t dst_stride,
+		/**[in]**/ const uint8_t* src_y, int32_t src_y_stride, /**[in]**/ const uint8_t* src_uv, int32_t src_uv_stride,
+		int32_t width, int32_t height, rgb_format_ format = rgb_format_rgba,
+		color_matrix_ matrix = color_matrix_bt601, color_range_ range = color_range_limited);
+
+	// Fixed point RGB to YUV coefficients with 15 fractional bits. As above, all
+	// kernels do exactly this integer math:
+	//   Y = clamp((y_r * R + y_g * G + y_b * B + y_bias) >> 15)
+	// and for each 2x2 block, with R, G and B each averaged as (sum + 2) >> 2:
+	//   U = clamp((u_r * R + u_g * G + u_b * B + c_bias) >> 15), likewise V
+	struct rgb_to_yuv_coeffs_t {
+		int32_t y_r, y_g, y_b;
+		int32_t u_r, u_g, u_b;
+		int32_t v_r, v_g, v_b;
+		int32_t y_bias;  // Black level plus rounding
+		int32_t c_bias;  // 128 plus rounding
+	};
+
+	const rgb_to_yuv_coeffs_t* rgb_to_yuv_coeffs(color_matrix_ matrix, color_range_ range);
+
+	// Converts 32 bit RGB (alpha ignored) to NV12, averaging each 2x2 block for
+	// chroma. Odd sizes repeat the last column/row into the final block. Bands of
+	// rows are converted in parallel; max_threads caps that, 0 for no limit.
+	// Writing dst_uv right after dst_y with nv12_packed_stride gives the layout
+	// mf_create_sample and the encoder expect.
+	void rgb_to_nv12(/**[out]**/ uint8_t* dst_y, int32_t dst_y_stride, /**[out]**/ uint8_t* dst_uv, int32_t dst_uv_stride,
+		/**[in]**/ const uint8_t* src, int32_t src_stride, int32_t width, int32_t height, rgb_format_ format = rgb_format_rgba,
+		color_matrix_ matrix = color_matrix_bt601, color_range_ range = color_range_limited, int32_t max_threads = 0);
+
+	// Forces a specific kernel, for benchmarking or to rule out a SIMD path.
+	// Returns false, leaving the current choice alone, if the CPU can't run it.
+	bool nv12_convert_set_impl(nv12_convert_impl_ impl);
+	nv12_convert_impl_ nv12_convert_get_impl();
+	const char* nv12_convert_impl_name(nv12_convert_impl_ impl);
+
+	// Per-row kernels, exposed for the dispatcher and benchmarks. x0 is the first
+	// pixel to convert and must be even; pointers are to the start of the row.
+	typedef void(*nv12_to_rgb_row_fn)(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* coeffs, bool bgra);
+	void nv12_to_rgb_row_scalar(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* coeffs, bool bgra);
+	void nv12_to_rgb_row_sse41(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* coeffs, bool bgra);
+	void nv12_to_rgb_row_avx2(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* coeffs, bool bgra);
+	void nv12_to_rgb_row_neon(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* coeffs, bool bgra);
+
+	// Converts a pair of source rows to two luma rows and one chroma row. For the
+	// last row of an odd height image, src1 == src0 and dst_y1 == dst_y0.
+	typedef void(*rgb_to_nv12_row_fn)(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* coeffs, bool bgra);
+	void rgb_to_nv12_row_scalar(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* coeffs, bool bgra);
+	void rgb_to_nv12_row_sse41(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* coeffs, bool bgra);
+	void rgb_to_nv12_row_avx2(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* coeffs, bool bgra);
+	void rgb_to_nv12_row_neon(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* coeffs, bool bgra);
+
+} // namespace nakamir
@@ -0,0 +1,159 @@
+#include "nv12_convert.h"
+#include "cpu_features.h"
+
+// Built with AVX2 code generation enabled (see CMakeLists.txt), and only ever
+// called after the dispatcher has checked the CPU supports it
+#if SKMF_X86
+#include <immintrin.h>
+#endif
+
+namespace nakamir {
+
+#if SKMF_X86
+	// Converts 16 pixels of 16 bit luma/chroma to saturated 16 bit R, G and B.
+	// Pairing luma with a chroma component lets one madd do two multiplies.
+	static inline void yuv_to_rgb_16(__m256i luma, __m256i u, __m256i v, const yuv_to_rgb_coeffs_t* c, __m256i* r, __m256i* g, __m256i* b)
+	{
+		const __m256i round   = _mm256_set1_epi32(4096);
+		const __m256i y_vr    = _mm256_set1_epi32((c->v_r << 16) | (c->y_scale & 0xFFFF));
+		const __m256i y_ug    = _mm256_set1_epi32((c->u_g << 16) | (c->y_scale & 0xFFFF));
+		const __m256i y_ub    = _mm256_set1_epi32((c->u_b << 16) | (c->y_scale & 0xFFFF));
+		const __m256i vg_one  = _mm256_set1_epi32((1 << 16) | (c->v_g & 0xFFFF));
+
+		// unpack and pack both work within 128 bit lanes, so pixel order survives the round trip
+		__m256i luma_v_lo = _mm256_unpacklo_epi16(luma, v), luma_v_hi = _mm256_unpackhi_epi16(luma, v);
+		__m256i luma_u_lo = _mm256_unpacklo_epi16(luma, u), luma_u_hi = _mm256_unpackhi_epi16(luma, u);
+		// (v, 4096) pairs against (v_g, 1) also fold in the rounding term
+		__m256i v_round_lo = _mm256_unpacklo_epi16(v, _mm256_set1_epi16(4096));
+		__m256i v_round_hi = _mm256_unpackhi_epi16(v, _mm256_set1_epi16(4096));
+
+		*r = _mm256_packs_epi32(
+			_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(luma_v_lo, y_vr), round), 13),
+			_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(luma_v_hi, y_vr), round), 13));
+		*g = _mm256_packs_epi32(
+			_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(luma_u_lo, y_ug), _mm256_madd_epi16(v_round_lo, vg_one)), 13),
+			_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(luma_u_hi, y_ug), _mm256_madd_epi16(v_round_hi, vg_one)), 13));
+		*b = _mm256_packs_epi32(
+			_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(luma_u_lo, y_ub), round), 13),
+			_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(luma_u_hi, y_ub), round), 13));
+	}
+
+	void nv12_to_rgb_row_avx2(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* c, bool bgra)
+	{
+		const __m256i y_offset = _mm256_set1_epi16(static_cast<int16_t>(c->y_offset));
+		const __m256i bias     = _mm256_set1_epi16(128);
+		const __m256i alpha    = _mm256_set1_epi16(255);
+		// Each chroma pair covers two pixels, so spread the Us and Vs out to match
+		const __m128i u_spread = _mm_setr_epi8(0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14);
+		const __m128i v_spread = _mm_setr_epi8(1, 1, 3, 3, 5, 5, 7, 7, 9, 9, 11, 11, 13, 13, 15, 15);
+		// Interleaves the two 8 byte halves of each lane
+		const __m256i zip = _mm256_setr_epi8(
+			0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15,
+			0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15);
+
+		int32_t x = x0;
+		for (; x + 16 <= width; x += 16)
+		{
+			__m128i luma8   = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x));
+			__m128i chroma8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(uv + x));
+			__m256i luma = _mm256_sub_epi16(_mm256_cvtepu8_epi16(luma8), y_offset);
+			__m256i u    = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_shuffle_epi8(chroma8, u_spread)), bias);
+			__m256i v    = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_shuffle_epi8(chroma8, v_spread)), bias);
+
+			__m256i r, g, b;
+			yuv_to_rgb_16(luma, u, v, c, &r, &g, &b);
+			if (bgra) { __m256i t = r; r = b; b = t; }
+
+			// Lane 0 holds pixels 0-7 and lane 1 pixels 8-15 throughout
+			__m256i rg = _mm256_shuffle_epi8(_mm256_packus_epi16(r, g), zip);
+			__m256i ba = _mm256_shuffle_epi8(_mm256_packus_epi16(b, alpha), zip);
+			__m256i rgba_a = _mm256_unpacklo_epi16(rg, ba); // Pixels 0-3, 8-11
+			__m256i rgba_b = _mm256_unpackhi_epi16(rg, ba); // Pixels 4-7, 12-15
+			__m256i* out = reinterpret_cast<__m256i*>(dst + x * 4);
+			_mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(rgba_a, rgba_b, 0x20));
+			_mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(rgba_a, rgba_b, 0x31));
+		}
+		_mm256_zeroupper();
+		nv12_to_rgb_row_scalar(dst, y, uv, x, width, c, bgra);
+	}
+
+	// Weighted channel sum of 8 pixels, given as (R, B) and (G, A) 16 bit pairs
+	// with coefficients laid out to match
+	static inline __m256i rgb_dot_8(__m256i rb, __m256i ga, __m256i c_rb, __m256i c_g, __m256i bias)
+	{
+		return _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(rb, c_rb), _mm256_madd_epi16(ga, c_g)), bias), 15);
+	}
+
+	// Saturates two registers of 8 x 32 bit lanes down to 16 bytes in order
+	static inline __m128i pack_luma(__m256i lo, __m256i hi)
+	{
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+		return _mm_packus_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+	}
+
+	void rgb_to_nv12_row_avx2(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* c, bool bgra)
+	{
+		// Masking every other byte of RGBA pixels leaves (R, B) and (G, A) pairs,
+		// or (B, R) for BGRA, which is just a matter of swapping coefficients
+		auto pair = [bgra](int32_t r, int32_t b) {
+			return bgra ? _mm256_set1_epi32((r << 16) | (b & 0xFFFF)) : _mm256_set1_epi32((b << 16) | (r & 0xFFFF));
+		};
+		const __m256i mask   = _mm256_set1_epi32(0x00FF00FF);
+		const __m256i y_rb   = pair(c->y_r, c->y_b);
+		const __m256i y_g    = _mm256_set1_epi32(c->y_g & 0xFFFF);
+		const __m256i u_rb   = pair(c->u_r, c->u_b);
+		const __m256i u_g    = _mm256_set1_epi32(c->u_g & 0xFFFF);
+		const __m256i v_rb   = pair(c->v_r, c->v_b);
+		const __m256i v_g    = _mm256_set1_epi32(c->v_g & 0xFFFF);
+		const __m256i y_bias = _mm256_set1_epi32(c->y_bias);
+		const __m256i c_bias = _mm256_set1_epi32(c->c_bias);
+		const __m256i two    = _mm256_set1_epi16(2);
+		// hadd works within lanes, leaving chroma samples as 0 1 4 5 | 2 3 6 7
+		const __m256i reorder = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+
+		int32_t x = x0;
+		for (; x + 16 <= width; x += 16)
+		{
+			__m256i luma[2][2];
+			__m256i rb_sum[2], ga_sum[2];
+			for (int32_t i = 0; i < 2; i++)
+			{
+				__m256i p0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src0 + (x + i * 8) * 4));
+				__m256i p1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src1 + (x + i * 8) * 4));
+				__m256i rb0 = _mm256_and_si256(p0, mask), ga0 = _mm256_and_si256(_mm256_srli_epi32(p0, 8), mask);
+				__m256i rb1 = _mm256_and_si256(p1, mask), ga1 = _mm256_and_si256(_mm256_srli_epi32(p1, 8), mask);
+				luma[0][i] = rgb_dot_8(rb0, ga0, y_rb, y_g, y_bias);
+				luma[1][i] = rgb_dot_8(rb1, ga1, y_rb, y_g, y_bias);
+				rb_sum[i] = _mm256_add_epi16(rb0, rb1);
+				ga_sum[i] = _mm256_add_epi16(ga0, ga1);
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst_y0 + x), pack_luma(luma[0][0], luma[0][1]));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst_y1 + x), pack_luma(luma[1][0], luma[1][1]));
+
+			// Adding neighbouring 32 bit lanes sums both 16 bit channels of a
+			// horizontal pixel pair at once, since neither can carry past 1020
+			__m256i rb = _mm256_srli_epi16(_mm256_add_epi16(_mm256_hadd_epi32(rb_sum[0], rb_sum[1]), two), 2);
+			__m256i ga = _mm256_srli_epi16(_mm256_add_epi16(_mm256_hadd_epi32(ga_sum[0], ga_sum[1]), two), 2);
+			__m256i u = _mm256_permutevar8x32_epi32(rgb_dot_8(rb, ga, u_rb, u_g, c_bias), reorder);
+			__m256i v = _mm256_permutevar8x32_epi32(rgb_dot_8(rb, ga, v_rb, v_g, c_bias), reorder);
+			// u0 v0 u1 v1 ... as 16 bit, still per lane: samples 0-3 | 4-7
+			__m256i uv = _mm256_packs_epi32(_mm256_unpacklo_epi32(u, v), _mm256_unpackhi_epi32(u, v));
+			uv = _mm256_permute4x64_epi64(_mm256_packus_epi16(uv, uv), 0x08);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst_uv + x), _mm256_castsi256_si128(uv));
+		}
+		_mm256_zeroupper();
+		rgb_to_nv12_row_scalar(dst_y0, dst_y1, dst_uv, src0, src1, x, width, c, bgra);
+	}
+#else
+	void nv12_to_rgb_row_avx2(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* c, bool bgra)
+	{
+		nv12_to_rgb_row_scalar(dst, y, uv, x0, width, c, bgra);
+	}
+
+	void rgb_to_nv12_row_avx2(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* c, bool bgra)
+	{
+		rgb_to_nv12_row_scalar(dst_y0, dst_y1, dst_uv, src0, src1, x0, width, c, bgra);
+	}
+#endif
+
+} // namespace nakamir
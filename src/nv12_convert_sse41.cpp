@@ -0,0 +1,160 @@
+#include "nv12_convert.h"
+#include "cpu_features.h"
+
+// Built with SSE4.1 code generation enabled (see CMakeLists.txt), and only
+// ever called after the dispatcher has checked the CPU supports it
+#if SKMF_X86
+#include <smmintrin.h>
+#endif
+
+namespace nakamir {
+
+#if SKMF_X86
+	// Converts 8 pixels of 16 bit luma/chroma to saturated 16 bit R, G and B.
+	// Pairing luma with a chroma component lets one madd do two multiplies.
+	static inline void yuv_to_rgb_8(__m128i luma, __m128i u, __m128i v, const yuv_to_rgb_coeffs_t* c, __m128i* r, __m128i* g, __m128i* b)
+	{
+		const __m128i round   = _mm_set1_epi32(4096);
+		const __m128i y_vr    = _mm_set1_epi32((c->v_r << 16) | (c->y_scale & 0xFFFF));
+		const __m128i y_ug    = _mm_set1_epi32((c->u_g << 16) | (c->y_scale & 0xFFFF));
+		const __m128i y_ub    = _mm_set1_epi32((c->u_b << 16) | (c->y_scale & 0xFFFF));
+		const __m128i vg_one  = _mm_set1_epi32((1 << 16) | (c->v_g & 0xFFFF));
+
+		__m128i luma_v_lo = _mm_unpacklo_epi16(luma, v), luma_v_hi = _mm_unpackhi_epi16(luma, v);
+		__m128i luma_u_lo = _mm_unpacklo_epi16(luma, u), luma_u_hi = _mm_unpackhi_epi16(luma, u);
+		// (v, 4096) pairs against (v_g, 1) also fold in the rounding term
+		__m128i v_round_lo = _mm_unpacklo_epi16(v, _mm_set1_epi16(4096));
+		__m128i v_round_hi = _mm_unpackhi_epi16(v, _mm_set1_epi16(4096));
+
+		*r = _mm_packs_epi32(
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(luma_v_lo, y_vr), round), 13),
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(luma_v_hi, y_vr), round), 13));
+		*g = _mm_packs_epi32(
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(luma_u_lo, y_ug), _mm_madd_epi16(v_round_lo, vg_one)), 13),
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(luma_u_hi, y_ug), _mm_madd_epi16(v_round_hi, vg_one)), 13));
+		*b = _mm_packs_epi32(
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(luma_u_lo, y_ub), round), 13),
+			_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(luma_u_hi, y_ub), round), 13));
+	}
+
+	void nv12_to_rgb_row_sse41(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* c, bool bgra)
+	{
+		const __m128i zero     = _mm_setzero_si128();
+		const __m128i y_offset = _mm_set1_epi16(static_cast<int16_t>(c->y_offset));
+		const __m128i bias     = _mm_set1_epi16(128);
+		const __m128i alpha    = _mm_set1_epi8(-1);
+		// Each chroma pair covers two pixels, so spread the Us and Vs out to match
+		const __m128i u_spread = _mm_setr_epi8(0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14);
+		const __m128i v_spread = _mm_setr_epi8(1, 1, 3, 3, 5, 5, 7, 7, 9, 9, 11, 11, 13, 13, 15, 15);
+
+		int32_t x = x0;
+		for (; x + 16 <= width; x += 16)
+		{
+			__m128i luma8   = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x));
+			__m128i chroma8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(uv + x));
+			__m128i u8 = _mm_shuffle_epi8(chroma8, u_spread);
+			__m128i v8 = _mm_shuffle_epi8(chroma8, v_spread);
+
+			__m128i r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+			yuv_to_rgb_8(
+				_mm_sub_epi16(_mm_unpacklo_epi8(luma8, zero), y_offset),
+				_mm_sub_epi16(_mm_unpacklo_epi8(u8, zero), bias),
+				_mm_sub_epi16(_mm_unpacklo_epi8(v8, zero), bias), c, &r_lo, &g_lo, &b_lo);
+			yuv_to_rgb_8(
+				_mm_sub_epi16(_mm_unpackhi_epi8(luma8, zero), y_offset),
+				_mm_sub_epi16(_mm_unpackhi_epi8(u8, zero), bias),
+				_mm_sub_epi16(_mm_unpackhi_epi8(v8, zero), bias), c, &r_hi, &g_hi, &b_hi);
+
+			__m128i r8 = _mm_packus_epi16(r_lo, r_hi);
+			__m128i g8 = _mm_packus_epi16(g_lo, g_hi);
+			__m128i b8 = _mm_packus_epi16(b_lo, b_hi);
+			if (bgra) { __m128i t = r8; r8 = b8; b8 = t; }
+
+			__m128i rg_lo = _mm_unpacklo_epi8(r8, g8);
+			__m128i rg_hi = _mm_unpackhi_epi8(r8, g8);
+			__m128i ba_lo = _mm_unpacklo_epi8(b8, alpha);
+			__m128i ba_hi = _mm_unpackhi_epi8(b8, alpha);
+			__m128i* out = reinterpret_cast<__m128i*>(dst + x * 4);
+			_mm_storeu_si128(out + 0, _mm_unpacklo_epi16(rg_lo, ba_lo));
+			_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(rg_lo, ba_lo));
+			_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(rg_hi, ba_hi));
+			_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(rg_hi, ba_hi));
+		}
+		nv12_to_rgb_row_scalar(dst, y, uv, x, width, c, bgra);
+	}
+
+	// Weighted channel sum of 4 pixels, given as (R, B) and (G, A) 16 bit pairs
+	// with coefficients laid out to match
+	static inline __m128i rgb_dot_4(__m128i rb, __m128i ga, __m128i c_rb, __m128i c_g, __m128i bias)
+	{
+		return _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(rb, c_rb), _mm_madd_epi16(ga, c_g)), bias), 15);
+	}
+
+	void rgb_to_nv12_row_sse41(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* c, bool bgra)
+	{
+		// Masking every other byte of RGBA pixels leaves (R, B) and (G, A) pairs,
+		// or (B, R) for BGRA, which is just a matter of swapping coefficients
+		auto pair = [bgra](int32_t r, int32_t b) {
+			return bgra ? _mm_set1_epi32((r << 16) | (b & 0xFFFF)) : _mm_set1_epi32((b << 16) | (r & 0xFFFF));
+		};
+		const __m128i mask   = _mm_set1_epi32(0x00FF00FF);
+		const __m128i y_rb   = pair(c->y_r, c->y_b);
+		const __m128i y_g    = _mm_set1_epi32(c->y_g & 0xFFFF);
+		const __m128i u_rb   = pair(c->u_r, c->u_b);
+		const __m128i u_g    = _mm_set1_epi32(c->u_g & 0xFFFF);
+		const __m128i v_rb   = pair(c->v_r, c->v_b);
+		const __m128i v_g    = _mm_set1_epi32(c->v_g & 0xFFFF);
+		const __m128i y_bias = _mm_set1_epi32(c->y_bias);
+		const __m128i c_bias = _mm_set1_epi32(c->c_bias);
+		const __m128i two    = _mm_set1_epi16(2);
+
+		int32_t x = x0;
+		for (; x + 16 <= width; x += 16)
+		{
+			__m128i luma[2][4];
+			__m128i rb_sum[4], ga_sum[4];
+			for (int32_t i = 0; i < 4; i++)
+			{
+				__m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + (x + i * 4) * 4));
+				__m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + (x + i * 4) * 4));
+				__m128i rb0 = _mm_and_si128(p0, mask), ga0 = _mm_and_si128(_mm_srli_epi32(p0, 8), mask);
+				__m128i rb1 = _mm_and_si128(p1, mask), ga1 = _mm_and_si128(_mm_srli_epi32(p1, 8), mask);
+				luma[0][i] = rgb_dot_4(rb0, ga0, y_rb, y_g, y_bias);
+				luma[1][i] = rgb_dot_4(rb1, ga1, y_rb, y_g, y_bias);
+				rb_sum[i] = _mm_add_epi16(rb0, rb1);
+				ga_sum[i] = _mm_add_epi16(ga0, ga1);
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst_y0 + x), _mm_packus_epi16(
+				_mm_packs_epi32(luma[0][0], luma[0][1]), _mm_packs_epi32(luma[0][2], luma[0][3])));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst_y1 + x), _mm_packus_epi16(
+				_mm_packs_epi32(luma[1][0], luma[1][1]), _mm_packs_epi32(luma[1][2], luma[1][3])));
+
+			// Adding neighbouring 32 bit lanes sums both 16 bit channels of a
+			// horizontal pixel pair at once, since neither can carry past 1020
+			__m128i uv[2];
+			for (int32_t i = 0; i < 2; i++)
+			{
+				__m128i rb = _mm_srli_epi16(_mm_add_epi16(_mm_hadd_epi32(rb_sum[i * 2], rb_sum[i * 2 + 1]), two), 2);
+				__m128i ga = _mm_srli_epi16(_mm_add_epi16(_mm_hadd_epi32(ga_sum[i * 2], ga_sum[i * 2 + 1]), two), 2);
+				__m128i u = rgb_dot_4(rb, ga, u_rb, u_g, c_bias);
+				__m128i v = rgb_dot_4(rb, ga, v_rb, v_g, c_bias);
+				// Interleave into u0 v0 u1 v1 ... as 16 bit
+				uv[i] = _mm_packs_epi32(_mm_unpacklo_epi32(u, v), _mm_unpackhi_epi32(u, v));
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst_uv + x), _mm_packus_epi16(uv[0], uv[1]));
+		}
+		rgb_to_nv12_row_scalar(dst_y0, dst_y1, dst_uv, src0, src1, x, width, c, bgra);
+	}
+#else
+	void nv12_to_rgb_row_sse41(uint8_t* dst, const uint8_t* y, const uint8_t* uv, int32_t x0, int32_t width, const yuv_to_rgb_coeffs_t* c, bool bgra)
+	{
+		nv12_to_rgb_row_scalar(dst, y, uv, x0, width, c, bgra);
+	}
+
+	void rgb_to_nv12_row_sse41(uint8_t* dst_y0, uint8_t* dst_y1, uint8_t* dst_uv, const uint8_t* src0, const uint8_t* src1, int32_t x0, int32_t width, const rgb_to_yuv_coeffs_t* c, bool bgra)
+	{
+		rgb_to_nv12_row_scalar(dst_y0, dst_y1, dst_uv, src0, src1, x0, width, c, bgra);
+	}
+#endif
+
+} // namespace nakamir
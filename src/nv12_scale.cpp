@@ -0,0 +1,389 @@
+#include "nv12_scale.h"
+#include "cpu_features.h"
+#include "parallel_for.h"
+#include "plane_copy.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+#if SKMF_X86
+#include <emmintrin.h>
+#endif
+#if SKMF_NEON
+#include <arm_neon.h>
+#endif
+
+namespace nakamir {
+
+	static std::atomic<int> _nv12_scale_impl = nv12_scale_impl_auto;
+
+	static bool nv12_scale_impl_supported(nv12_scale_impl_ impl)
+	{
+		switch (impl)
+		{
+		case nv12_scale_impl_auto:
+		case nv12_scale_impl_scalar: return true;
+		case nv12_scale_impl_sse2:   return SKMF_X86 && cpu_has(cpu_feature_sse2);
+		case nv12_scale_impl_neon:   return SKMF_NEON && cpu_has(cpu_feature_neon);
+		default:                     return false;
+		}
+	}
+
+	static nv12_scale_impl_ nv12_scale_resolve(nv12_scale_impl_ impl)
+	{
+		if (impl != nv12_scale_impl_auto)
+			return impl;
+		if (nv12_scale_impl_supported(nv12_scale_impl_sse2)) return nv12_scale_impl_sse2;
+		if (nv12_scale_impl_supported(nv12_scale_impl_neon)) return nv12_scale_impl_neon;
+		return nv12_scale_impl_scalar;
+	}
+
+	bool nv12_scale_set_impl(nv12_scale_impl_ impl)
+	{
+		if (!nv12_scale_impl_supported(impl))
+			return false;
+		_nv12_scale_impl = impl;
+		return true;
+	}
+
+	nv12_scale_impl_ nv12_scale_get_impl()
+	{
+		return nv12_scale_resolve(static_cast<nv12_scale_impl_>(_nv12_scale_impl.load()));
+	}
+
+	const char* nv12_scale_impl_name(nv12_scale_impl_ impl)
+	{
+		switch (impl)
+		{
+		case nv12_scale_impl_auto:   return "auto";
+		case nv12_scale_impl_scalar: return "scalar";
+		case nv12_scale_impl_sse2:   return "sse2";
+		case nv12_scale_impl_neon:   return "neon";
+		default:                     return "unknown";
+		}
+	}
+
+	///////////////////////////////////////////
+	// Plane passes
+	///////////////////////////////////////////
+
+	struct _nv12_scale_pass_t {
+		uint8_t* dst;
+		int32_t dst_stride;
+		int32_t dst_width;       // Pixels, or UV pairs
+		int32_t dst_height;
+		const uint8_t* src;
+		int32_t src_stride;
+		int32_t src_width;
+		int32_t src_height;
+		int32_t channels;
+		nv12_halve_row_fn halve_row;
+		nv12_blend_row_fn blend_row;
+		// Bilinear only: per output column, the left source column and the
+		// weight of the one right of it in 1/256ths
+		const int32_t* x_index;
+		const uint8_t* x_fraction;
+	};
+
+	static void nv12_halve_band(int32_t begin, int32_t end, void* context)
+	{
+		const _nv12_scale_pass_t* pass = static_cast<const _nv12_scale_pass_t*>(context);
+		for (int32_t y = begin; y < end; y++)
+		{
+			int32_t y0 = y * 2;
+			int32_t y1 = std::min(y0 + 1, pass->src_height - 1);
+			pass->halve_row(pass->dst + static_cast<ptrdiff_t>(pass->dst_stride) * y,
+				pass->src + static_cast<ptrdiff_t>(pass->src_stride) * y0,
+				pass->src + static_cast<ptrdiff_t>(pass->src_stride) * y1,
+				pass->src_width, pass->channels);
+		}
+	}
+
+	// Source position of an output pixel's center in 16.16 fixed point,
+	// clamped to the first and last source pixel
+	static int64_t nv12_scale_position(int32_t dst, int32_t dst_size, int32_t src_size)
+	{
+		int64_t position = ((2 * static_cast<int64_t>(dst) + 1) * src_size * 65536) / (2 * static_cast<int64_t>(dst_size)) - 32768;
+		return std::clamp<int64_t>(position, 0, static_cast<int64_t>(src_size - 1) * 65536);
+	}
+
+	static void nv12_bilinear_band(int32_t begin, int32_t end, void* context)
+	{
+		const _nv12_scale_pass_t* pass = static_cast<const _nv12_scale_pass_t*>(context);
+		const int32_t channels = pass->channels;
+		static thread_local std::vector<uint8_t> blended;
+		blended.resize(static_cast<size_t>(pass->src_width) * channels);
+
+		for (int32_t y = begin; y < end; y++)
+		{
+			int64_t position = nv12_scale_position(y, pass->dst_height, pass->src_height);
+			int32_t y0 = static_cast<int32_t>(position >> 16);
+			int32_t y1 = std::min(y0 + 1, pass->src_height - 1);
+			pass->blend_row(blended.data(),
+				pass->src + static_cast<ptrdiff_t>(pass->src_stride) * y0,
+				pass->src + static_cast<ptrdiff_t>(pass->src_stride) * y1,
+				pass->src_width * channels, static_cast<int32_t>((position >> 8) & 0xFF));
+
+			uint8_t* dst = pass->dst + static_cast<ptrdiff_t>(pass->dst_stride) * y;
+			for (int32_t x = 0; x < pass->dst_width; x++)
+			{
+				const uint8_t* left = blended.data() + pass->x_index[x] * channels;
+				// At the last column the right neighbour is the pixel itself
+				const uint8_t* right = pass->x_index[x] + 1 < pass->src_width ? left + channels : left;
+				int32_t fraction = pass->x_fraction[x];
+				for (int32_t c = 0; c < channels; c++)
+					dst[x * channels + c] = static_cast<uint8_t>((left[c] * (256 - fraction) + right[c] * fraction + 128) >> 8);
+			}
+		}
+	}
+
+	static void nv12_scale_run(_nv12_scale_pass_t* pass, bool halve, int32_t max_threads)
+	{
+		std::vector<int32_t> x_index;
+		std::vector<uint8_t> x_fraction;
+		if (!halve)
+		{
+			x_index.resize(pass->dst_width);
+			x_fraction.resize(pass->dst_width);
+			for (int32_t x = 0; x < pass->dst_width; x++)
+			{
+				int64_t position = nv12_scale_position(x, pass->dst_width, pass->src_width);
+				x_index[x] = static_cast<int32_t>(position >> 16);
+				x_fraction[x] = static_cast<uint8_t>((position >> 8) & 0xFF);
+			}
+			pass->x_index = x_index.data();
+			pass->x_fraction = x_fraction.data();
+		}
+
+		// Bands of at least ~32K output bytes, below that the handoff costs more than it saves
+		int32_t min_rows = std::max(1, 32768 / (pass->dst_width * pass->channels));
+		parallel_for(pass->dst_height, min_rows, halve ? nv12_halve_band : nv12_bilinear_band, pass, max_threads);
+	}
+
+	void nv12_scale(uint8_t* dst_y, int32_t dst_y_stride, uint8_t* dst_uv, int32_t dst_uv_stride, int32_t dst_width, int32_t dst_height,
+		const uint8_t* src_y, int32_t src_y_stride, const uint8_t* src_uv, int32_t src_uv_stride, int32_t src_width, int32_t src_height,
+		nv12_scale_filter_ filter, int32_t max_threads)
+	{
+		if (dst_width <= 0 || dst_height <= 0 || src_width <= 0 || src_height <= 0)
+			return;
+
+		nv12_halve_row_fn halve_row = nv12_halve_row_scalar;
+		nv12_blend_row_fn blend_row = nv12_blend_row_scalar;
+		switch (nv12_scale_get_impl())
+		{
+		case nv12_scale_impl_sse2: halve_row = nv12_halve_row_sse2; blend_row = nv12_blend_row_sse2; break;
+		case nv12_scale_impl_neon: halve_row = nv12_halve_row_neon; blend_row = nv12_blend_row_neon; break;
+		default: break;
+		}
+
+		// Halvings go through two packed scratch images in turn, and the last
+		// step, halving or not, writes straight into dst
+		static thread_local std::vector<uint8_t> scratch[2];
+		int32_t width = src_width;
+		int32_t height = src_height;
+		for (int32_t level = 0; ; level++)
+		{
+			bool halve = filter == nv12_scale_filter_box && width >= 2 * dst_width && height >= 2 * dst_height;
+			int32_t next_width = halve ? (width + 1) / 2 : dst_width;
+			int32_t next_height = halve ? (height + 1) / 2 : dst_height;
+			if (!halve && width == dst_width && height == dst_height)
+			{
+				// Only reached when nothing needed scaling at all
+				nv12_copy(dst_y, dst_y_stride, dst_uv, dst_uv_stride, src_y, src_y_stride, src_uv, src_uv_stride, width, height);
+				return;
+			}
+
+			bool last = next_width == dst_width && next_height == dst_height;
+			uint8_t* out_y = dst_y;
+			uint8_t* out_uv = dst_uv;
+			int32_t out_y_stride = dst_y_stride;
+			int32_t out_uv_stride = dst_uv_stride;
+			if (!last)
+			{
+				std::vector<uint8_t>& buffer = scratch[level & 1];
+				out_y_stride = nv12_packed_stride(next_width);
+				out_uv_stride = out_y_stride;
+				buffer.resize(nv12_packed_size(next_width, next_height));
+				out_y = buffer.data();
+				out_uv = buffer.data() + static_cast<size_t>(out_y_stride) * next_height;
+			}
+
+			_nv12_scale_pass_t luma = { out_y, out_y_stride, next_width, next_height, src_y, src_y_stride, width, height, 1, halve_row, blend_row, nullptr, nullptr };
+			nv12_scale_run(&luma, halve, max_threads);
+			_nv12_scale_pass_t chroma = { out_uv, out_uv_stride, nv12_chroma_row_bytes(next_width) / 2, nv12_chroma_rows(next_height),
+				src_uv, src_uv_stride, nv12_chroma_row_bytes(width) / 2, nv12_chroma_rows(height), 2, halve_row, blend_row, nullptr, nullptr };
+			nv12_scale_run(&chroma, halve, max_threads);
+
+			if (last)
+				return;
+			src_y = out_y;
+			src_uv = out_uv;
+			src_y_stride = out_y_stride;
+			src_uv_stride = out_uv_stride;
+			width = next_width;
+			height = next_height;
+		}
+	}
+
+	///////////////////////////////////////////
+	// Row kernels
+	///////////////////////////////////////////
+
+	// The part of a halved row the vector loops leave, from output pixel x0
+	static void nv12_halve_row_tail(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t src_width, int32_t channels, int32_t x0)
+	{
+		int32_t dst_width = (src_width + 1) / 2;
+		for (int32_t x = x0; x < dst_width; x++)
+		{
+			int32_t a = 2 * x * channels;
+			int32_t b = std::min(2 * x + 1, src_width - 1) * channels;
+			for (int32_t c = 0; c < channels; c++)
+				dst[x * channels + c] = static_cast<uint8_t>((src0[a + c] + src0[b + c] + src1[a + c] + src1[b + c] + 2) >> 2);
+		}
+	}
+
+	void nv12_halve_row_scalar(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t src_width, int32_t channels)
+	{
+		nv12_halve_row_tail(dst, src0, src1, src_width, channels, 0);
+	}
+
+	void nv12_blend_row_scalar(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t bytes, int32_t fraction)
+	{
+		for (int32_t i = 0; i < bytes; i++)
+			dst[i] = static_cast<uint8_t>((src0[i] * (256 - fraction) + src1[i] * fraction + 128) >> 8);
+	}
+
+#if SKMF_X86
+	void nv12_halve_row_sse2(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t src_width, int32_t channels)
+	{
+		// 32 source bytes of each row make 16 output bytes. Bytes are split
+		// into even and odd 16 bit lanes; for luma those are the horizontal
+		// neighbours, for chroma they are U and V, and neighbouring pairs are
+		// then added with a multiply-add against ones.
+		const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+		const __m128i ones = _mm_set1_epi16(1);
+		const __m128i two = _mm_set1_epi16(2);
+		int32_t src_bytes = src_width * channels;
+		int32_t i = 0;
+		for (; 2 * (i + 16) <= src_bytes; i += 16)
+		{
+			__m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + 2 * i));
+			__m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + 2 * i + 16));
+			__m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + 2 * i));
+			__m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + 2 * i + 16));
+			__m128i result;
+			if (channels == 1)
+			{
+				__m128i sum0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, low_bytes), _mm_srli_epi16(a0, 8)),
+					_mm_add_epi16(_mm_and_si128(b0, low_bytes), _mm_srli_epi16(b0, 8)));
+				__m128i sum1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, low_bytes), _mm_srli_epi16(a1, 8)),
+					_mm_add_epi16(_mm_and_si128(b1, low_bytes), _mm_srli_epi16(b1, 8)));
+				result = _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(sum0, two), 2), _mm_srli_epi16(_mm_add_epi16(sum1, two), 2));
+			}
+			else
+			{
+				__m128i u0 = _mm_add_epi32(_mm_madd_epi16(_mm_and_si128(a0, low_bytes), ones), _mm_madd_epi16(_mm_and_si128(b0, low_bytes), ones));
+				__m128i u1 = _mm_add_epi32(_mm_madd_epi16(_mm_and_si128(a1, low_bytes), ones), _mm_madd_epi16(_mm_and_si128(b1, low_bytes), ones));
+				__m128i v0 = _mm_add_epi32(_mm_madd_epi16(_mm_srli_epi16(a0, 8), ones), _mm_madd_epi16(_mm_srli_epi16(b0, 8), ones));
+				__m128i v1 = _mm_add_epi32(_mm_madd_epi16(_mm_srli_epi16(a1, 8), ones), _mm_madd_epi16(_mm_srli_epi16(b1, 8), ones));
+				__m128i u = _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(u0, u1), two), 2);
+				__m128i v = _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(v0, v1), two), 2);
+				result = _mm_or_si128(u, _mm_slli_epi16(v, 8));
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), result);
+		}
+		nv12_halve_row_tail(dst, src0, src1, src_width, channels, i / channels);
+	}
+
+	void nv12_blend_row_sse2(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t bytes, int32_t fraction)
+	{
+		// 255 * 256 + 128 still fits an unsigned 16 bit lane
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i weight0 = _mm_set1_epi16(static_cast<int16_t>(256 - fraction));
+		const __m128i weight1 = _mm_set1_epi16(static_cast<int16_t>(fraction));
+		const __m128i round = _mm_set1_epi16(128);
+		int32_t i = 0;
+		for (; i + 16 <= bytes; i += 16)
+		{
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + i));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + i));
+			__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), weight0), _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), weight1)), round);
+			__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), weight0), _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), weight1)), round);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+		}
+		nv12_blend_row_scalar(dst + i, src0 + i, src1 + i, bytes - i, fraction);
+	}
+#else
+	void nv12_halve_row_sse2(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t src_width, int32_t channels)
+	{
+		nv12_halve_row_scalar(dst, src0, src1, src_width, channels);
+	}
+
+	void nv12_blend_row_sse2(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t bytes, int32_t fraction)
+	{
+		nv12_blend_row_scalar(dst, src0, src1, bytes, fraction);
+	}
+#endif
+
+#if SKMF_NEON
+	void nv12_halve_row_neon(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t src_width, int32_t channels)
+	{
+		// Pairwise widening adds do the horizontal half, a rounding narrow the (sum + 2) >> 2
+		int32_t src_bytes = src_width * channels;
+		int32_t i = 0;
+		for (; 2 * (i + 16) <= src_bytes; i += 16)
+		{
+			if (channels == 1)
+			{
+				uint16x8_t sum0 = vaddq_u16(vpaddlq_u8(vld1q_u8(src0 + 2 * i)), vpaddlq_u8(vld1q_u8(src1 + 2 * i)));
+				uint16x8_t sum1 = vaddq_u16(vpaddlq_u8(vld1q_u8(src0 + 2 * i + 16)), vpaddlq_u8(vld1q_u8(src1 + 2 * i + 16)));
+				vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(sum0, 2), vrshrn_n_u16(sum1, 2)));
+			}
+			else
+			{
+				uint8x16x2_t a = vld2q_u8(src0 + 2 * i);
+				uint8x16x2_t b = vld2q_u8(src1 + 2 * i);
+				uint8x8x2_t result;
+				result.val[0] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[0]), vpaddlq_u8(b.val[0])), 2);
+				result.val[1] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[1]), vpaddlq_u8(b.val[1])), 2);
+				vst2_u8(dst + i, result);
+			}
+		}
+		nv12_halve_row_tail(dst, src0, src1, src_width, channels, i / channels);
+	}
+
+	void nv12_blend_row_neon(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t bytes, int32_t fraction)
+	{
+		// Weights have to fit a byte, and at the ends one row is all there is
+		if (fraction == 0)
+		{
+			memcpy(dst, src0, bytes);
+			return;
+		}
+		const uint8x8_t weight0 = vdup_n_u8(static_cast<uint8_t>(256 - fraction));
+		const uint8x8_t weight1 = vdup_n_u8(static_cast<uint8_t>(fraction));
+		int32_t i = 0;
+		for (; i + 16 <= bytes; i += 16)
+		{
+			uint8x16_t a = vld1q_u8(src0 + i);
+			uint8x16_t b = vld1q_u8(src1 + i);
+			uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(a), weight0), vget_low_u8(b), weight1);
+			uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(a), weight0), vget_high_u8(b), weight1);
+			vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+		}
+		nv12_blend_row_scalar(dst + i, src0 + i, src1 + i, bytes - i, fraction);
+	}
+#else
+	void nv12_halve_row_neon(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t src_width, int32_t channels)
+	{
+		nv12_halve_row_scalar(dst, src0, src1, src_width, channels);
+	}
+
+	void nv12_blend_row_neon(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t bytes, int32_t fraction)
+	{
+		nv12_blend_row_scalar(dst, src0, src1, bytes, fraction);
+	}
+#endif
+
+} // namespace nakamir
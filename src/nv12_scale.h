@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nakamir {
+
+	enum nv12_scale_filter_ {
+		// Halves with 2x2 averages while the source is at least twice the
+		// target, then bilinear for what's left. Exact for power of two ratios
+		// and alias free at any ratio, which suits shrinking video a lot.
+		nv12_scale_filter_box,
+		// Straight bilinear, cheaper but aliases below half size
+		nv12_scale_filter_bilinear,
+	};
+
+	enum nv12_scale_impl_ {
+		nv12_scale_impl_auto,   // Best available on this CPU
+		nv12_scale_impl_scalar,
+		nv12_scale_impl_sse2,
+		nv12_scale_impl_neon,
+	};
+
+	// Scales both planes of an NV12 image down (or up, for bilinear) to
+	// dst_width x dst_height. Chroma is scaled as its own plane of UV pairs,
+	// with sizes rounded up as nv12_chroma_row_bytes/nv12_chroma_rows do.
+	// Strides are in bytes. Bands of rows run in parallel on parallel_for;
+	// max_threads caps that, 0 for no limit. Every kernel does the same
+	// integer math, so the SIMD paths are bit-exact with the scalar one.
+	void nv12_scale(/**[out]**/ uint8_t* dst_y, int32_t dst_y_stride, /**[out]**/ uint8_t* dst_uv, int32_t dst_uv_stride, int32_t dst_width, int32_t dst_height,
+		/**[in]**/ const uint8_t* src_y, int32_t src_y_stride, /**[in]**/ const uint8_t* src_uv, int32_t src_uv_stride, int32_t src_width, int32_t src_height,
+		nv12_scale_filter_ filter = nv12_scale_filter_box, int32_t max_threads = 0);
+
+	// Forces a specific kernel, for benchmarking or to rule out a SIMD path.
+	// Returns false, leaving the current choice alone, if the CPU can't run it.
+	bool nv12_scale_set_impl(nv12_scale_impl_ impl);
+	nv12_scale_impl_ nv12_scale_get_impl();
+	const char* nv12_scale_impl_name(nv12_scale_impl_ impl);
+
+	// Per-row kernels, exposed for the dispatcher and benchmarks. channels is
+	// 1 for luma and 2 for UV pairs; widths are in pixels (pairs for chroma).
+	//
+	// Halves two source rows into one: each output is the rounded average of a
+	// 2x2 block. An odd last column averages with itself.
+	typedef void(*nv12_halve_row_fn)(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t src_width, int32_t channels);
+	void nv12_halve_row_scalar(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t src_width, int32_t channels);
+	void nv12_halve_row_sse2(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t src_width, int32_t channels);
+	void nv12_halve_row_neon(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t src_width, int32_t channels);
+	// Blends two rows of bytes as (src0 * (256 - fraction) + src1 * fraction + 128) >> 8,
+	// the vertical half of bilinear; the horizontal half is a table walk in plain C++
+	typedef void(*nv12_blend_row_fn)(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t bytes, int32_t fraction);
+	void nv12_blend_row_scalar(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t bytes, int32_t fraction);
+	void nv12_blend_row_sse2(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t bytes, int32_t fraction);
+	void nv12_blend_row_neon(uint8_t* dst, const uint8_t* src0, const uint8_t* src1, int32_t bytes, int32_t fraction);
+
+} // namespace nakamir
@@ -1,24 +1,139 @@
 #include "nv12_sprite.h"
 #include "sk_memory.h"
+#include <cstddef>
+#include <cstring>
+#include <vector>
 
 namespace nakamir {
 
+	// The batch hands its vertices straight to mesh_set_data
+	static_assert(sizeof(quad_vertex_t) == sizeof(vert_t), "quad_vertex_t must match vert_t");
+	static_assert(offsetof(quad_vertex_t, norm) == offsetof(vert_t, norm), "quad_vertex_t must match vert_t");
+	static_assert(offsetof(quad_vertex_t, uv) == offsetof(vert_t, uv), "quad_vertex_t must match vert_t");
+	static_assert(offsetof(quad_vertex_t, color) == offsetof(vert_t, col), "quad_vertex_t must match vert_t");
+
+	// Quads queued by nv12_sprite_batch_add, main thread only
+	static quad_batch sprite_batch;
+	static quad_batch_stats_t sprite_batch_stats;
+	// One mesh per draw of the last submit, reused frame to frame
+	static std::vector<mesh_t> sprite_batch_meshes;
+
+	// Points the sprite's own quad mesh at its atlas tile: SK's default quad,
+	// corners, normal and winding alike, with its UVs squeezed into uv_rect,
+	// so the stock nv12_quad shader samples just the tile. Only rebuilt when
+	// the tile moves.
+	static void nv12_sprite_update_tile_mesh(nv12_sprite_t nv12_sprite, const vec4& uv_rect) {
+		if (nv12_sprite->atlas_mesh && memcmp(&nv12_sprite->atlas_uv_rect, &uv_rect, sizeof(vec4)) == 0)
+			return;
+		quad_vertex_t verts[4];
+		quad_batch_write_quad(nullptr, &uv_rect.x, verts);
+		if (!nv12_sprite->atlas_mesh)
+			nv12_sprite->atlas_mesh = mesh_create();
+		mesh_set_data(nv12_sprite->atlas_mesh, (const vert_t*)verts, 4, quad_batch_indices, 6);
+		nv12_sprite->atlas_uv_rect = uv_rect;
+	}
+
+	// Roughly how many pixels wide a unit quad with this world transform is
+	// on the display, from its width over its distance to the head. Good
+	// enough to pick a level of detail, which is all it's for.
+	static float nv12_sprite_screen_width(const matrix& world) {
+		float width = vec3_magnitude(matrix_transform_dir(world, vec3_right));
+		float distance = vec3_magnitude(matrix_transform_pt(world, vec3_zero) - input_head()->position);
+		if (distance <= 0)
+			return 0;
+		// m[0] of the projection is cot(horizontal fov / 2)
+		matrix projection = render_get_projection_matrix();
+		return width / distance * projection.m[0] * system_info().display_width * 0.5f;
+	}
+
 	nv12_sprite_t nv12_sprite_create(nv12_tex_t nv12_tex, sprite_type_ sprite_type, const char* atlas_id) {
 		nv12_sprite_t nv12_sprite = (nv12_sprite_t)sk_malloc(sizeof(_nv12_sprite_t));
 		nv12_sprite->nv12_tex = nv12_tex;
 		nv12_sprite->material = nv12_tex->material;
 		material_addref(nv12_sprite->material);
+		nv12_sprite->atlas = nullptr;
+		nv12_sprite->atlas_mesh = nullptr;
+		nv12_sprite->atlas_uv_rect = {};
+		if (sprite_type == sprite_type_atlased) {
+			nv12_sprite->atlas = nv12_atlas_find_or_create(atlas_id);
+			if (nv12_sprite->atlas)
+				nv12_atlas_attach(nv12_sprite->atlas, nv12_tex);
+		}
 		return nv12_sprite;
 	}
 
 	void nv12_sprite_release(nv12_sprite_t nv12_sprite) {
+		if (nv12_sprite->atlas) {
+			if (nv12_sprite->nv12_tex->atlas == nv12_sprite->atlas)
+				nv12_atlas_detach(nv12_sprite->nv12_tex);
+			nv12_atlas_release(nv12_sprite->atlas);
+		}
+		if (nv12_sprite->atlas_mesh)
+			mesh_release(nv12_sprite->atlas_mesh);
 		material_release(nv12_sprite->material);
 		sk_free(nv12_sprite);
 	}
 
 	void nv12_sprite_ui_image(nv12_sprite_t nv12_sprite, matrix render_matrix) {
+		if (nv12_sprite->nv12_tex->lod)
+			nv12_tex_set_screen_width(nv12_sprite->nv12_tex, nv12_sprite_screen_width(render_matrix * hierarchy_to_world()));
+		nv12_tex_acquire(nv12_sprite->nv12_tex);
+		// Atlased tiles all draw with the atlas material; the tile's UV rect
+		// lives in the sprite's own mesh, as the shader takes UVs from the mesh
+		vec4 uv_rect;
+		if (nv12_sprite->atlas && nv12_atlas_get_uv_rect(nv12_sprite->nv12_tex, &uv_rect)) {
+			nv12_sprite_update_tile_mesh(nv12_sprite, uv_rect);
+			mesh_draw(nv12_sprite->atlas_mesh, nv12_sprite->atlas->material, render_matrix);
+			return;
+		}
 		mesh_t mesh_quad = mesh_find(default_id_mesh_quad);
 		mesh_draw(mesh_quad, nv12_sprite->material, render_matrix);
 		mesh_release(mesh_quad);
 	}
+
+	void nv12_sprite_batch_add(nv12_sprite_t nv12_sprite, matrix render_matrix) {
+		// Resolve the hierarchy now, the submit happens outside of it
+		matrix world = render_matrix * hierarchy_to_world();
+		if (nv12_sprite->nv12_tex->lod)
+			nv12_tex_set_screen_width(nv12_sprite->nv12_tex, nv12_sprite_screen_width(world));
+		nv12_tex_acquire(nv12_sprite->nv12_tex);
+		vec4 uv_rect;
+		if (nv12_sprite->atlas && nv12_atlas_get_uv_rect(nv12_sprite->nv12_tex, &uv_rect)) {
+			sprite_batch.add(nv12_sprite->atlas->material, world.m, &uv_rect.x);
+		}
+		else {
+			const float whole[4] = { 0, 0, 1, 1 };
+			sprite_batch.add(nv12_sprite->material, world.m, whole);
+		}
+	}
+
+	void nv12_sprite_batch_submit() {
+		sprite_batch.build();
+		sprite_batch_stats = sprite_batch.get_stats();
+		const std::vector<quad_batch_draw_t>& draws = sprite_batch.draws();
+		while (sprite_batch_meshes.size() < draws.size())
+			sprite_batch_meshes.push_back(mesh_create());
+		// The vertices are already in world space, so every draw is one mesh
+		// at identity, however many sprites went into it
+		const quad_vertex_t* verts = sprite_batch.vertices().data();
+		const uint32_t* inds = sprite_batch.indices().data();
+		for (size_t i = 0; i < draws.size(); i++) {
+			const quad_batch_draw_t& draw = draws[i];
+			mesh_t mesh = sprite_batch_meshes[i];
+			mesh_set_data(mesh, (const vert_t*)(verts + draw.first * 4), draw.count * 4, inds + draw.first * 6, draw.count * 6);
+			mesh_draw(mesh, (material_t)draw.material, matrix_identity);
+		}
+		sprite_batch.clear();
+	}
+
+	void nv12_sprite_batch_release() {
+		for (mesh_t mesh : sprite_batch_meshes)
+			mesh_release(mesh);
+		sprite_batch_meshes.clear();
+		sprite_batch.clear();
+	}
+
+	quad_batch_stats_t nv12_sprite_batch_get_stats() {
+		return sprite_batch_stats;
+	}
 } // namespace nakamir
@@ -2,6 +2,8 @@
 
 #include <stereokit.h>
 #include "nv12_tex.h"
+#include "nv12_atlas.h"
+#include "quad_batch.h"
 
 using namespace sk;
 
@@ -12,10 +14,30 @@ namespace nakamir {
 	struct _nv12_sprite_t {
 		nv12_tex_t nv12_tex;
 		material_t material;
+		// Shared with other atlased sprites of the same atlas_id, nullptr for sprite_type_single
+		nv12_atlas_t atlas;
+		// The quad the tile is drawn with, UVs covering atlas_uv_rect; created on first draw
+		mesh_t atlas_mesh;
+		vec4 atlas_uv_rect;
 	};
 
+	// sprite_type_atlased packs the stream into the shared atlas named
+	// atlas_id (see nv12_atlas.h), which suits many small streams drawn at
+	// once; sprite_type_single draws it from its own textures.
 	nv12_sprite_t nv12_sprite_create(nv12_tex_t nv12_tex, sprite_type_ sprite_type, const char* atlas_id = "default");
 	void nv12_sprite_release(nv12_sprite_t nv12_sprite);
 	void nv12_sprite_ui_image(nv12_sprite_t nv12_sprite, matrix render_matrix);
 
+	// Batched alternative to nv12_sprite_ui_image for walls of video. Queue
+	// each sprite during the frame (render_matrix is relative to the current
+	// hierarchy, as with nv12_sprite_ui_image), then submit once from outside
+	// any hierarchy push. Sprites are grouped by material and their quads
+	// baked into one world space mesh per group, so all tiles of an atlas
+	// go out as a single draw. Release frees the meshes kept for reuse.
+	void nv12_sprite_batch_add(nv12_sprite_t nv12_sprite, matrix render_matrix);
+	void nv12_sprite_batch_submit();
+	void nv12_sprite_batch_release();
+	// What the last submit drew
+	quad_batch_stats_t nv12_sprite_batch_get_stats();
+
 } // namespace nakamir
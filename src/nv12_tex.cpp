@@ -1,10 +1,34 @@
 #include "nv12_tex.h"
+#include "nv12_atlas.h"
 #include "sk_memory.h"
 #include "error.h"
+#include "plane_copy.h"
+#include "nv12_scale.h"
 
 namespace nakamir {
 
-	nv12_tex_t nv12_tex_create(int width, int height) {
+	static void nv12_planes_create(nv12_planes_t* planes, int width, int height, tex_type_ type) {
+		planes->luminance_tex = tex_create(type, tex_format_r8);
+		planes->chrominance_tex = tex_create(type, tex_format_r8g8);
+
+		uint8_t* luminance_data = sk_malloc_t(uint8_t, static_cast<size_t>(width) * static_cast<size_t>(height));
+		tex_set_colors(planes->luminance_tex, width, height, luminance_data);
+		sk_free(luminance_data);
+
+		// Odd sizes round up, the last chroma sample covers a single luma column/row
+		int chrominance_width = nv12_chroma_row_bytes(width) / 2;
+		int chrominance_height = nv12_chroma_rows(height);
+		uint16_t* chrominance_data = sk_malloc_t(uint16_t, static_cast<size_t>(chrominance_width) * static_cast<size_t>(chrominance_height));
+		tex_set_colors(planes->chrominance_tex, chrominance_width, chrominance_height, chrominance_data);
+		sk_free(chrominance_data);
+
+		planes->luminance_view = (ID3D11Texture2D*)tex_get_surface(planes->luminance_tex);
+		planes->chrominance_view = (ID3D11Texture2D*)tex_get_surface(planes->chrominance_tex);
+		planes->width = width;
+		planes->height = height;
+	}
+
+	nv12_tex_t nv12_tex_create(int width, int height, nv12_tex_upload_ upload, uint32_t dirty_threshold, int ring_size) {
 		shader_t nv12_quad_shader = shader_create_file("nv12_quad.hlsl");
 		if (nv12_quad_shader == nullptr) {
 			log_err("NV12 quad shader not found!");
@@ -13,78 +37,274 @@ namespace nakamir {
 		material_t material = material_create(nv12_quad_shader);
 		shader_release(nv12_quad_shader);
 
-		tex_t luminance_tex = tex_create(tex_type_image_nomips | tex_type_dynamic, tex_format_r8);
-		tex_t chrominance_tex = tex_create(tex_type_image_nomips | tex_type_dynamic, tex_format_r8g8);
+		// UpdateSubresource can't write to dynamic textures, and mapping one
+		// with discard would throw away the tiles that didn't change
+		tex_type_ type = upload == nv12_tex_upload_dirty_tiles ? tex_type_image_nomips : tex_type_image_nomips | tex_type_dynamic;
+		slot_ring* ring = upload == nv12_tex_upload_ring ? new slot_ring(static_cast<uint32_t>(ring_size)) : nullptr;
+		int32_t plane_count = ring ? static_cast<int32_t>(ring->slots()) : 1;
+		nv12_planes_t* planes = sk_malloc_t(nv12_planes_t, plane_count);
+		for (int32_t i = 0; i < plane_count; i++)
+			nv12_planes_create(&planes[i], width, height, type);
 
-		uint8_t* luminance_data = sk_malloc_t(uint8_t, static_cast<size_t>(width) * static_cast<size_t>(height));
-		tex_set_colors(luminance_tex, width, height, luminance_data);
-		sk_free(luminance_data);
-
-		uint16_t* chrominance_data = sk_malloc_t(uint16_t, static_cast<size_t>(width / 2) * static_cast<size_t>(height / 2));
-		tex_set_colors(chrominance_tex, width / 2, height / 2, chrominance_data);
-		sk_free(chrominance_data);
-
-		material_set_texture(material, "luminance", luminance_tex);
-		material_set_texture(material, "chrominance", chrominance_tex);
+		// With a ring, set 0 is shown blank until the first frame is acquired
+		material_set_texture(material, "luminance", planes[0].luminance_tex);
+		material_set_texture(material, "chrominance", planes[0].chrominance_tex);
 
 		nv12_tex_t nv12_tex = (nv12_tex_t)sk_malloc(sizeof(_nv12_tex_t));
 		nv12_tex->width = width;
 		nv12_tex->height = height;
 		nv12_tex->material = material;
-		nv12_tex->luminance_tex = luminance_tex;
-		nv12_tex->luminance_view = (ID3D11Texture2D*)tex_get_surface(luminance_tex);
-		nv12_tex->chrominance_tex = chrominance_tex;
-		nv12_tex->chrominance_view = (ID3D11Texture2D*)tex_get_surface(chrominance_tex);
+		nv12_tex->planes = planes;
+		nv12_tex->plane_count = plane_count;
+		nv12_tex->ring = ring;
+		nv12_tex->drawn = 0;
+		nv12_tex->acquired_at = -1;
+		nv12_tex->atlas = nullptr;
+		nv12_tex->atlas_tile = -1;
+		nv12_tex->atlas_ready = false;
+		nv12_tex->differ = upload == nv12_tex_upload_dirty_tiles ? new tile_differ(width, height, dirty_threshold) : nullptr;
+		nv12_tex->target = nv12_tex_target_none;
+		nv12_tex->lod = nullptr;
+		nv12_tex->lod_filter = nv12_scale_filter_box;
 		return nv12_tex;
 	}
 
 	void nv12_tex_release(nv12_tex_t nv12_tex) {
-		tex_release(nv12_tex->luminance_tex);
-		tex_release(nv12_tex->chrominance_tex);
+		if (nv12_tex->atlas)
+			nv12_atlas_detach(nv12_tex);
+		for (int32_t i = 0; i < nv12_tex->plane_count; i++) {
+			tex_release(nv12_tex->planes[i].luminance_tex);
+			tex_release(nv12_tex->planes[i].chrominance_tex);
+		}
+		sk_free(nv12_tex->planes);
 		material_release(nv12_tex->material);
+		delete nv12_tex->ring;
+		delete nv12_tex->differ;
+		delete nv12_tex->lod;
 		sk_free(nv12_tex);
 	}
 
-	void nv12_tex_set_buffer(nv12_tex_t nv12_tex, const unsigned char* encoded_image_buffer, int offset) {
+	void nv12_tex_set_buffer(nv12_tex_t nv12_tex, const unsigned char* encoded_image_buffer, int offset, int stride, int plane_rows) {
 
 		// add the offset if there is one
 		encoded_image_buffer += offset;
 
-		ID3D11Device* pD3D_device = (ID3D11Device*)backend_d3d11_get_d3d_device();
+		if (stride == 0) stride = nv12_packed_stride(nv12_tex->width);
+		if (plane_rows == 0) plane_rows = nv12_tex->height;
 
-		// For dynamic textures, just upload the new value into the texture!
-		D3D11_MAPPED_SUBRESOURCE tex_mem = {};
+		const unsigned char* chrominance = encoded_image_buffer + static_cast<ptrdiff_t>(stride) * plane_rows;
+		nv12_tex_set_planes(nv12_tex, encoded_image_buffer, stride, chrominance, stride);
+	}
 
-		bool on_main = backend_d3d11_get_main_thread_id() == GetCurrentThreadId();
-		ID3D11DeviceContext* pContext;
-		if (on_main) {
-			pD3D_device->GetImmediateContext(&pContext);
+	void nv12_tex_set_planes(nv12_tex_t nv12_tex, const unsigned char* luminance, int luminance_stride, const unsigned char* chrominance, int chrominance_stride) {
+
+		// In dirty tile mode every frame goes through the differ, wherever it
+		// ends up, so its reference always matches the last frame uploaded
+		static thread_local std::vector<tile_diff_rect_t> dirty_rects;
+		const std::vector<tile_diff_rect_t>* dirty = nullptr;
+		if (nv12_tex->differ) {
+			nv12_tex->differ->diff(luminance, luminance_stride, chrominance, chrominance_stride, &dirty_rects);
+			dirty = &dirty_rects;
 		}
-		else {
-			pContext = (ID3D11DeviceContext*)backend_d3d11_get_deferred_d3d_context();
-			WaitForSingleObject(backend_d3d11_get_deferred_mtx(), INFINITE);
+
+		// Streams drawn from an atlas upload into their tile, unless it is full
+		if (nv12_tex->atlas && nv12_atlas_upload(nv12_tex, luminance, luminance_stride, chrominance, chrominance_stride, dirty)) {
+			nv12_tex->target = nv12_tex_target_atlas;
+			return;
+		}
+
+		bool on_main;
+		if (dirty) {
+			// Only the textures can be patched; if the last frame went to the
+			// atlas, or nowhere, this one is written whole
+			bool partial = nv12_tex->target == nv12_tex_target_textures;
+			nv12_tex->target = nv12_tex_target_textures;
+			if (partial && dirty->empty())
+				return;
+
+			tile_diff_rect_t full = nv12_full_rect(nv12_tex->width, nv12_tex->height);
+			ID3D11DeviceContext* pContext = nv12_d3d_context_begin(&on_main);
+			if (partial)
+				nv12_update_rects(pContext, nv12_tex->planes[0].luminance_view, nv12_tex->planes[0].chrominance_view, 0, 0, dirty->data(), dirty->size(), luminance, luminance_stride, chrominance, chrominance_stride);
+			else
+				nv12_update_rects(pContext, nv12_tex->planes[0].luminance_view, nv12_tex->planes[0].chrominance_view, 0, 0, &full, 1, luminance, luminance_stride, chrominance, chrominance_stride);
+			nv12_d3d_context_end(pContext, on_main);
+			return;
 		}
 
+		// Without a ring there is one set to write, drawn or not
+		int32_t slot = 0;
+		if (nv12_tex->ring) {
+			slot = nv12_tex->ring->begin_write();
+			if (slot < 0)
+				return;
+		}
+		nv12_planes_t& planes = nv12_tex->planes[slot];
+
+		// Scaled down to what the panel needs on screen, into a packed frame
+		int width = nv12_tex->width;
+		int height = nv12_tex->height;
+		static thread_local std::vector<uint8_t> scaled;
+		if (nv12_tex->lod && (nv12_tex->lod->width() != width || nv12_tex->lod->height() != height)) {
+			int lod_width = nv12_tex->lod->width();
+			int lod_height = nv12_tex->lod->height();
+			int32_t scaled_stride = nv12_packed_stride(lod_width);
+			scaled.resize(nv12_packed_size(lod_width, lod_height));
+			uint8_t* scaled_uv = scaled.data() + static_cast<size_t>(scaled_stride) * lod_height;
+			nv12_scale(scaled.data(), scaled_stride, scaled_uv, scaled_stride, lod_width, lod_height,
+				luminance, luminance_stride, chrominance, chrominance_stride, width, height, nv12_tex->lod_filter);
+			luminance = scaled.data();
+			chrominance = scaled_uv;
+			luminance_stride = chrominance_stride = scaled_stride;
+			width = lod_width;
+			height = lod_height;
+		}
+
+		// A new size means new textures, which SK makes from rows with no
+		// padding. Level changes are damped by the selector, so this is rare.
+		if (planes.width != width || planes.height != height) {
+			int32_t chrominance_bytes = nv12_chroma_row_bytes(width);
+			if (luminance_stride != width || chrominance_stride != chrominance_bytes) {
+				size_t luminance_size = static_cast<size_t>(width) * height;
+				std::vector<uint8_t> packed(luminance_size + static_cast<size_t>(chrominance_bytes) * nv12_chroma_rows(height));
+				nv12_copy(packed.data(), width, packed.data() + luminance_size, chrominance_bytes,
+					luminance, luminance_stride, chrominance, chrominance_stride, width, height);
+				scaled.swap(packed);
+				luminance = scaled.data();
+				chrominance = scaled.data() + luminance_size;
+			}
+			tex_set_colors(planes.luminance_tex, width, height, (void*)luminance);
+			tex_set_colors(planes.chrominance_tex, chrominance_bytes / 2, nv12_chroma_rows(height), (void*)chrominance);
+			planes.luminance_view = (ID3D11Texture2D*)tex_get_surface(planes.luminance_tex);
+			planes.chrominance_view = (ID3D11Texture2D*)tex_get_surface(planes.chrominance_tex);
+			planes.width = width;
+			planes.height = height;
+			if (nv12_tex->ring)
+				nv12_tex->ring->publish();
+			return;
+		}
+
+		// For dynamic textures, just upload the new value into the texture!
+		D3D11_MAPPED_SUBRESOURCE tex_mem = {};
+
+		ID3D11DeviceContext* pContext = nv12_d3d_context_begin(&on_main);
+
 		try
 		{
-			int luminance_size = nv12_tex->width * nv12_tex->height;
-			ThrowIfFailed(pContext->Map(nv12_tex->luminance_view, 0, D3D11_MAP_WRITE_DISCARD, 0, &tex_mem));
-			memcpy(tex_mem.pData, encoded_image_buffer, (size_t)luminance_size);
-			pContext->Unmap(nv12_tex->luminance_view, 0);
-
-			encoded_image_buffer += luminance_size;
+			// The mapped rows are RowPitch apart, which is usually wider than the texture
+			ThrowIfFailed(pContext->Map(planes.luminance_view, 0, D3D11_MAP_WRITE_DISCARD, 0, &tex_mem));
+			plane_copy((uint8_t*)tex_mem.pData, (int32_t)tex_mem.RowPitch, luminance, luminance_stride, width, height);
+			pContext->Unmap(planes.luminance_view, 0);
 
-			int chrominance_size = (nv12_tex->width / 2) * (nv12_tex->height / 2) * sizeof(uint16_t);
-			ThrowIfFailed(pContext->Map(nv12_tex->chrominance_view, 0, D3D11_MAP_WRITE_DISCARD, 0, &tex_mem));
-			memcpy(tex_mem.pData, encoded_image_buffer, (size_t)chrominance_size);
-			pContext->Unmap(nv12_tex->chrominance_view, 0);
+			ThrowIfFailed(pContext->Map(planes.chrominance_view, 0, D3D11_MAP_WRITE_DISCARD, 0, &tex_mem));
+			plane_copy((uint8_t*)tex_mem.pData, (int32_t)tex_mem.RowPitch, chrominance, chrominance_stride, nv12_chroma_row_bytes(width), nv12_chroma_rows(height));
+			pContext->Unmap(planes.chrominance_view, 0);
 		}
 		catch (const std::exception& e)
 		{
 			log_err(e.what());
 		}
 
-		if (!on_main) {
+		nv12_d3d_context_end(pContext, on_main);
+
+		if (nv12_tex->ring)
+			nv12_tex->ring->publish();
+	}
+
+	void nv12_tex_acquire(nv12_tex_t nv12_tex) {
+		if (!nv12_tex->ring)
+			return;
+		double now = time_total_unscaled();
+		if (now == nv12_tex->acquired_at)
+			return;
+		nv12_tex->acquired_at = now;
+
+		int32_t slot = nv12_tex->ring->acquire_latest();
+		if (slot >= 0 && slot != nv12_tex->drawn) {
+			material_set_texture(nv12_tex->material, "luminance", nv12_tex->planes[slot].luminance_tex);
+			material_set_texture(nv12_tex->material, "chrominance", nv12_tex->planes[slot].chrominance_tex);
+			nv12_tex->drawn = slot;
+		}
+	}
+
+	void nv12_tex_set_lod(nv12_tex_t nv12_tex, bool enabled, nv12_scale_filter_ filter) {
+		delete nv12_tex->lod;
+		nv12_tex->lod = nullptr;
+		// Dirty tiles patch a full size texture, so they keep the full size
+		if (enabled && !nv12_tex->differ)
+			nv12_tex->lod = new lod_selector(nv12_tex->width, nv12_tex->height);
+		nv12_tex->lod_filter = filter;
+	}
+
+	void nv12_tex_set_screen_width(nv12_tex_t nv12_tex, float pixels) {
+		if (nv12_tex->lod)
+			nv12_tex->lod->update(pixels);
+	}
+
+	lod_selector_stats_t nv12_tex_get_lod_stats(nv12_tex_t nv12_tex) {
+		if (!nv12_tex->lod)
+			return {};
+		return nv12_tex->lod->get_stats();
+	}
+
+	slot_ring_stats_t nv12_tex_get_ring_stats(nv12_tex_t nv12_tex) {
+		if (!nv12_tex->ring)
+			return {};
+		return nv12_tex->ring->get_stats();
+	}
+
+	tile_diff_stats_t nv12_tex_get_upload_stats(nv12_tex_t nv12_tex) {
+		if (!nv12_tex->differ)
+			return {};
+		return nv12_tex->differ->get_stats();
+	}
+
+	uint64_t nv12_update_rects(ID3D11DeviceContext* pContext, ID3D11Texture2D* luminance_view, ID3D11Texture2D* chrominance_view, uint32_t x, uint32_t y,
+		const tile_diff_rect_t* rects, size_t rect_count, const unsigned char* luminance, int luminance_stride, const unsigned char* chrominance, int chrominance_stride) {
+		uint64_t bytes = 0;
+		for (size_t i = 0; i < rect_count; i++) {
+			const tile_diff_rect_t& rect = rects[i];
+			D3D11_BOX luminance_box = { x + rect.x, y + rect.y, 0, x + rect.x + rect.width, y + rect.y + rect.height, 1 };
+			D3D11_BOX chrominance_box = { x / 2 + rect.chroma_x, y / 2 + rect.chroma_y, 0, x / 2 + rect.chroma_x + rect.chroma_width, y / 2 + rect.chroma_y + rect.chroma_height, 1 };
+			// The source pointer is the box's first texel, the pitch stays the frame's
+			const unsigned char* luminance_src = luminance + static_cast<ptrdiff_t>(rect.y) * luminance_stride + rect.x;
+			const unsigned char* chrominance_src = chrominance + static_cast<ptrdiff_t>(rect.chroma_y) * chrominance_stride + rect.chroma_x * 2;
+			pContext->UpdateSubresource(luminance_view, 0, &luminance_box, luminance_src, luminance_stride, 0);
+			pContext->UpdateSubresource(chrominance_view, 0, &chrominance_box, chrominance_src, chrominance_stride, 0);
+			bytes += static_cast<uint64_t>(rect.width) * rect.height + static_cast<uint64_t>(rect.chroma_width) * 2 * rect.chroma_height;
+		}
+		return bytes;
+	}
+
+	tile_diff_rect_t nv12_full_rect(int width, int height) {
+		tile_diff_rect_t rect = {};
+		rect.width = static_cast<uint32_t>(width);
+		rect.height = static_cast<uint32_t>(height);
+		rect.chroma_width = static_cast<uint32_t>(nv12_chroma_row_bytes(width) / 2);
+		rect.chroma_height = static_cast<uint32_t>(nv12_chroma_rows(height));
+		return rect;
+	}
+
+	ID3D11DeviceContext* nv12_d3d_context_begin(bool* on_main) {
+		ID3D11Device* pD3D_device = (ID3D11Device*)backend_d3d11_get_d3d_device();
+
+		*on_main = backend_d3d11_get_main_thread_id() == GetCurrentThreadId();
+		ID3D11DeviceContext* pContext;
+		if (*on_main) {
+			pD3D_device->GetImmediateContext(&pContext);
+		}
+		else {
+			pContext = (ID3D11DeviceContext*)backend_d3d11_get_deferred_d3d_context();
+			WaitForSingleObject(backend_d3d11_get_deferred_mtx(), INFINITE);
+		}
+		return pContext;
+	}
+
+	void nv12_d3d_context_end(ID3D11DeviceContext* pContext, bool on_main) {
+		if (on_main) {
+			pContext->Release();
+		}
+		else {
 			ReleaseMutex(backend_d3d11_get_deferred_mtx());
 		}
 	}
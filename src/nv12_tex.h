@@ -6,25 +6,121 @@
 #define WIN32_LEAN_AND_MEAN
 #endif
 #include <d3d11.h>
+#include "tile_diff.h"
+#include "slot_ring.h"
+#include "lod_selector.h"
+#include "nv12_scale.h"
 
 using namespace sk;
 
 namespace nakamir {
 
 	SK_DeclarePrivateType(nv12_tex_t);
+	SK_DeclarePrivateType(nv12_atlas_t);
 
-	struct _nv12_tex_t {
-		int width;
-		int height;
-		material_t material;
+	enum nv12_tex_upload_ {
+		// Every frame rewrites both planes of a dynamic texture
+		nv12_tex_upload_full,
+		// Frames are compared with the last one in 64x64 tiles and only tiles
+		// that changed are written, see tile_diff.h. Meant for mostly static
+		// content: screen share, or a fixed camera after a decoder, whose skipped
+		// macroblocks come out identical to the frame before.
+		nv12_tex_upload_dirty_tiles,
+		// Frames go round a ring of plane textures, see slot_ring.h, so the
+		// upload never maps the set being drawn, or one the GPU may still be
+		// sampling from the last ring_size - 3 frames
+		nv12_tex_upload_ring,
+	};
+
+	const int nv12_tex_default_ring = 4;
+
+	// One luma and chroma texture pair
+	struct nv12_planes_t {
 		tex_t luminance_tex;
 		tex_t chrominance_tex;
 		ID3D11Texture2D* luminance_view;
 		ID3D11Texture2D* chrominance_view;
+		int width;              // Luma size as allocated, smaller than the stream's with a LOD
+		int height;
 	};
 
-	nv12_tex_t nv12_tex_create(int width, int height);
+	// Which texels hold the frame the differ last took in
+	enum nv12_tex_target_ {
+		nv12_tex_target_none,
+		nv12_tex_target_textures,   // planes[0]
+		nv12_tex_target_atlas,      // atlas_tile
+	};
+
+	struct _nv12_tex_t {
+		int width;
+		int height;
+		material_t material;
+		// A single set written in place, unless the upload mode is
+		// nv12_tex_upload_ring, in which case ring hands them out and the
+		// material is pointed at the newest one by nv12_tex_acquire
+		nv12_planes_t* planes;
+		int32_t plane_count;
+		slot_ring* ring;
+		int32_t drawn;          // Set the material samples
+		double acquired_at;     // time_total_unscaled of the last acquire, which runs once a frame
+		// Set while an atlased sprite draws this stream, see nv12_atlas.h. Its
+		// frames then go to atlas_tile instead of the textures above, which
+		// only take over when the atlas has no room.
+		nv12_atlas_t atlas;
+		int32_t atlas_tile;   // -1 while the stream has no tile
+		bool atlas_ready;     // The tile holds a frame, i.e. it is safe to draw from
+		// Only with nv12_tex_upload_dirty_tiles. Dirty rects are only applied to
+		// the target that got the previous frame; anywhere else gets it whole.
+		tile_differ* differ;
+		nv12_tex_target_ target;
+		// Only after nv12_tex_set_lod; frames bound for planes are scaled to its size first
+		lod_selector* lod;
+		nv12_scale_filter_ lod_filter;
+	};
+
+	// dirty_threshold is the per tile sum of absolute differences, over both
+	// planes, below which a tile counts as unchanged with nv12_tex_upload_dirty_tiles.
+	// ring_size is the number of texture sets for nv12_tex_upload_ring, at least 4.
+	nv12_tex_t nv12_tex_create(int width, int height, nv12_tex_upload_ upload = nv12_tex_upload_full, uint32_t dirty_threshold = 0, int ring_size = nv12_tex_default_ring);
 	void nv12_tex_release(nv12_tex_t nv12_tex);
-	void nv12_tex_set_buffer(nv12_tex_t nv12_tex, const unsigned char* encoded_image_buffer, int offset = 0);
+	// Uploads an NV12 frame whose chroma plane follows the luma plane. stride is the
+	// byte pitch of both planes (0 for packed, see nv12_packed_stride) and plane_rows the number of
+	// rows in the luma plane including padding, e.g. 1088 for 1080p H.264 output
+	// (0 for the texture height).
+	void nv12_tex_set_buffer(nv12_tex_t nv12_tex, const unsigned char* encoded_image_buffer, int offset = 0, int stride = 0, int plane_rows = 0);
+	void nv12_tex_set_planes(nv12_tex_t nv12_tex, const unsigned char* luminance, int luminance_stride, const unsigned char* chrominance, int chrominance_stride);
+	// Tiles compared and bytes the dirty rects covered, against what full
+	// uploads would have written; bytes - dirty_bytes is what was saved. All
+	// zero unless the texture was created with nv12_tex_upload_dirty_tiles.
+	// Read from the thread that uploads.
+	tile_diff_stats_t nv12_tex_get_upload_stats(nv12_tex_t nv12_tex);
+	// Main thread, before drawing with the material. With nv12_tex_upload_ring
+	// it switches the material to the newest uploaded set; further calls in
+	// the same frame do nothing. Sprites call it themselves.
+	void nv12_tex_acquire(nv12_tex_t nv12_tex);
+	// Scales frames down before they upload to what the panel covers on
+	// screen, see lod_selector.h, and reallocates the textures as that
+	// changes. Applies to the stream's own textures in nv12_tex_upload_full
+	// and nv12_tex_upload_ring; atlas tiles and dirty tiles keep full size.
+	// Call before uploads start.
+	void nv12_tex_set_lod(nv12_tex_t nv12_tex, bool enabled, nv12_scale_filter_ filter = nv12_scale_filter_box);
+	// Main thread, once a frame: how many pixels wide the video is drawn.
+	// Sprites call it themselves.
+	void nv12_tex_set_screen_width(nv12_tex_t nv12_tex, float pixels);
+	lod_selector_stats_t nv12_tex_get_lod_stats(nv12_tex_t nv12_tex);
+	// Handoff counts of the ring, all zero without nv12_tex_upload_ring
+	slot_ring_stats_t nv12_tex_get_ring_stats(nv12_tex_t nv12_tex);
+
+	// The context uploads go through: SK's immediate context on the main thread,
+	// otherwise its deferred context with the deferred mutex held until end
+	ID3D11DeviceContext* nv12_d3d_context_begin(/**[out]**/ bool* on_main);
+	void nv12_d3d_context_end(ID3D11DeviceContext* pContext, bool on_main);
+	// Writes rects of both planes with UpdateSubresource, moved by x, y luma
+	// texels in the destination (an atlas tile's origin, which is even). The
+	// textures must not be dynamic. Returns the bytes written.
+	uint64_t nv12_update_rects(ID3D11DeviceContext* pContext, ID3D11Texture2D* luminance_view, ID3D11Texture2D* chrominance_view, uint32_t x, uint32_t y,
+		const tile_diff_rect_t* rects, size_t rect_count, const unsigned char* luminance, int luminance_stride, const unsigned char* chrominance, int chrominance_stride);
+	// The whole frame as one rect, for nv12_update_rects
+	tile_diff_rect_t nv12_full_rect(int width, int height);
 
 } // namespace nakamir
@@ -0,0 +1,140 @@
+#include "parallel_for.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nakamir {
+
+	class parallel_pool {
+	public:
+		parallel_pool()
+		{
+			unsigned int cores = std::thread::hardware_concurrency();
+			int32_t workers = cores > 1 ? static_cast<int32_t>(cores) - 1 : 0;
+			for (int32_t i = 0; i < workers; i++)
+				_threads.emplace_back(&parallel_pool::worker, this);
+		}
+
+		~parallel_pool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stop = true;
+			}
+			_work_cv.notify_all();
+			for (std::thread& thread : _threads)
+				thread.join();
+		}
+
+		int32_t thread_count() const { return static_cast<int32_t>(_threads.size()) + 1; }
+
+		void run(int32_t count, int32_t ranges, parallel_for_fn fn, void* context)
+		{
+			std::unique_lock<std::mutex> submit(_submit_mutex, std::try_to_lock);
+			if (ranges <= 1 || _threads.empty() || !submit.owns_lock())
+			{
+				fn(0, count, context);
+				return;
+			}
+
+			int32_t helpers = std::min(ranges - 1, static_cast<int32_t>(_threads.size()));
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_fn = fn;
+				_context = context;
+				_count = count;
+				_ranges = ranges;
+				_next_range = 0;
+				_helpers_wanted = helpers;
+				_helpers_running = helpers;
+				_generation++;
+			}
+			_work_cv.notify_all();
+
+			run_ranges();
+
+			// Workers read the job fields, so they must all be done before the next call
+			std::unique_lock<std::mutex> lock(_mutex);
+			_done_cv.wait(lock, [this] { return _helpers_running == 0; });
+		}
+
+	private:
+		void run_ranges()
+		{
+			for (;;)
+			{
+				int32_t range = _next_range.fetch_add(1, std::memory_order_relaxed);
+				if (range >= _ranges)
+					break;
+				int32_t begin = static_cast<int32_t>(static_cast<int64_t>(_count) * range / _ranges);
+				int32_t end = static_cast<int32_t>(static_cast<int64_t>(_count) * (range + 1) / _ranges);
+				_fn(begin, end, _context);
+			}
+		}
+
+		void worker()
+		{
+			uint64_t seen = 0;
+			std::unique_lock<std::mutex> lock(_mutex);
+			for (;;)
+			{
+				_work_cv.wait(lock, [&] { return _stop || (_generation != seen && _helpers_wanted > 0); });
+				if (_stop)
+					return;
+				seen = _generation;
+				_helpers_wanted--;
+
+				lock.unlock();
+				run_ranges();
+				lock.lock();
+
+				if (--_helpers_running == 0)
+					_done_cv.notify_one();
+			}
+		}
+
+		std::mutex _submit_mutex;
+		std::mutex _mutex;
+		std::condition_variable _work_cv;
+		std::condition_variable _done_cv;
+		std::vector<std::thread> _threads;
+		bool _stop = false;
+
+		uint64_t _generation = 0;
+		int32_t _helpers_wanted = 0;
+		int32_t _helpers_running = 0;
+		parallel_for_fn _fn = nullptr;
+		void* _context = nullptr;
+		int32_t _count = 0;
+		int32_t _ranges = 0;
+		std::atomic<int32_t> _next_range = 0;
+	};
+
+	static parallel_pool& parallel_pool_get()
+	{
+		static parallel_pool pool;
+		return pool;
+	}
+
+	void parallel_for(int32_t count, int32_t min_range, parallel_for_fn fn, void* context, int32_t max_tasks)
+	{
+		if (count <= 0)
+			return;
+
+		parallel_pool& pool = parallel_pool_get();
+		int32_t tasks = pool.thread_count();
+		if (max_tasks > 0)
+			tasks = std::min(tasks, max_tasks);
+		int32_t ranges = std::min(tasks, std::max(1, count / std::max(1, min_range)));
+		pool.run(count, ranges, fn, context);
+	}
+
+	int32_t parallel_for_thread_count()
+	{
+		return parallel_pool_get().thread_count();
+	}
+
+} // namespace nakamir
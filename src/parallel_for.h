@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+namespace nakamir {
+
+	typedef void(*parallel_for_fn)(int32_t begin, int32_t end, void* context);
+
+	// Splits [0, count) into contiguous ranges of at least min_range items and
+	// runs fn over them on a persistent process-wide pool, with the calling
+	// thread taking ranges too. Returns once every range is done. max_tasks caps
+	// how many threads take part, 0 for all of them. If the pool is already busy
+	// with another call (including a nested one) the work runs on the caller.
+	void parallel_for(int32_t count, int32_t min_range, parallel_for_fn fn, void* context, int32_t max_tasks = 0);
+
+	// Threads parallel_for can use at most, the caller included
+	int32_t parallel_for_thread_count();
+
+} // namespace nakamir
@@ -0,0 +1,209 @@
+#include "plane_copy.h"
+#include "cpu_features.h"
+#include <atomic>
+#include <cstring>
+
+#if SKMF_X86
+#include <emmintrin.h>
+#endif
+#if SKMF_NEON
+#include <arm_neon.h>
+#endif
+
+namespace nakamir {
+
+	static std::atomic<int> _plane_copy_impl = plane_copy_impl_auto;
+	static std::atomic<size_t> _plane_copy_nt_threshold = 2 * 1024 * 1024;
+
+	static bool plane_copy_impl_supported(plane_copy_impl_ impl)
+	{
+		switch (impl)
+		{
+		case plane_copy_impl_auto:
+		case plane_copy_impl_scalar: return true;
+		case plane_copy_impl_sse2:   return SKMF_X86 && cpu_has(cpu_feature_sse2);
+		case plane_copy_impl_avx2:   return SKMF_X86 && cpu_has(cpu_feature_avx2);
+		case plane_copy_impl_neon:   return SKMF_NEON && cpu_has(cpu_feature_neon);
+		default:                     return false;
+		}
+	}
+
+	static plane_copy_impl_ plane_copy_resolve(plane_copy_impl_ impl)
+	{
+		if (impl != plane_copy_impl_auto)
+			return impl;
+		if (plane_copy_impl_supported(plane_copy_impl_avx2)) return plane_copy_impl_avx2;
+		if (plane_copy_impl_supported(plane_copy_impl_sse2)) return plane_copy_impl_sse2;
+		if (plane_copy_impl_supported(plane_copy_impl_neon)) return plane_copy_impl_neon;
+		return plane_copy_impl_scalar;
+	}
+
+	static plane_copy_row_fn plane_copy_row_kernel(plane_copy_impl_ impl)
+	{
+		switch (impl)
+		{
+		case plane_copy_impl_sse2: return plane_copy_row_sse2;
+		case plane_copy_impl_avx2: return plane_copy_row_avx2;
+		case plane_copy_impl_neon: return plane_copy_row_neon;
+		default:                   return plane_copy_row_scalar;
+		}
+	}
+
+	bool plane_copy_set_impl(plane_copy_impl_ impl)
+	{
+		if (!plane_copy_impl_supported(impl))
+			return false;
+		_plane_copy_impl = impl;
+		return true;
+	}
+
+	plane_copy_impl_ plane_copy_get_impl()
+	{
+		return plane_copy_resolve(static_cast<plane_copy_impl_>(_plane_copy_impl.load()));
+	}
+
+	const char* plane_copy_impl_name(plane_copy_impl_ impl)
+	{
+		switch (impl)
+		{
+		case plane_copy_impl_auto:   return "auto";
+		case plane_copy_impl_scalar: return "scalar";
+		case plane_copy_impl_sse2:   return "sse2";
+		case plane_copy_impl_avx2:   return "avx2";
+		case plane_copy_impl_neon:   return "neon";
+		default:                     return "unknown";
+		}
+	}
+
+	void plane_copy_set_nontemporal_threshold(size_t bytes)
+	{
+		_plane_copy_nt_threshold = bytes;
+	}
+
+	size_t plane_copy_get_nontemporal_threshold()
+	{
+		return _plane_copy_nt_threshold;
+	}
+
+	void plane_copy(uint8_t* dst, int32_t dst_stride, const uint8_t* src, int32_t src_stride, int32_t row_bytes, int32_t rows)
+	{
+		if (row_bytes <= 0 || rows <= 0)
+			return;
+
+		// Both sides tightly packed in the same direction: one big contiguous copy
+		bool contiguous = dst_stride == src_stride && (dst_stride == row_bytes || dst_stride == -row_bytes);
+		size_t total = static_cast<size_t>(row_bytes) * rows;
+		size_t threshold = _plane_copy_nt_threshold;
+		bool nontemporal = threshold != 0 && total >= threshold;
+
+		plane_copy_impl_ impl = plane_copy_get_impl();
+		plane_copy_row_fn copy_row = plane_copy_row_kernel(impl);
+
+		if (contiguous && dst_stride > 0)
+		{
+			copy_row(dst, src, total, nontemporal);
+		}
+		else
+		{
+			for (int32_t y = 0; y < rows; y++)
+			{
+				copy_row(dst, src, static_cast<size_t>(row_bytes), nontemporal);
+				dst += dst_stride;
+				src += src_stride;
+			}
+		}
+
+		if (nontemporal)
+			plane_copy_fence();
+	}
+
+	void nv12_copy(uint8_t* dst_y, int32_t dst_y_stride, uint8_t* dst_uv, int32_t dst_uv_stride,
+		const uint8_t* src_y, int32_t src_y_stride, const uint8_t* src_uv, int32_t src_uv_stride,
+		int32_t width, int32_t height)
+	{
+		plane_copy(dst_y, dst_y_stride, src_y, src_y_stride, width, height);
+		plane_copy(dst_uv, dst_uv_stride, src_uv, src_uv_stride, nv12_chroma_row_bytes(width), nv12_chroma_rows(height));
+	}
+
+	void plane_copy_row_scalar(uint8_t* dst, const uint8_t* src, size_t bytes, bool /*nontemporal*/)
+	{
+		memcpy(dst, src, bytes);
+	}
+
+	void plane_copy_fence()
+	{
+#if SKMF_X86
+		_mm_sfence();
+#endif
+	}
+
+#if SKMF_X86
+	void plane_copy_row_sse2(uint8_t* dst, const uint8_t* src, size_t bytes, bool nontemporal)
+	{
+		// Streaming stores need an aligned destination, so peel off the head. They
+		// also shouldn't share a cache line with regular stores, so go to a line.
+		size_t alignment = nontemporal ? 64 : 16;
+		size_t head = (alignment - (reinterpret_cast<uintptr_t>(dst) & (alignment - 1))) & (alignment - 1);
+		if (head > bytes) head = bytes;
+		memcpy(dst, src, head);
+		dst += head; src += head; bytes -= head;
+
+		size_t blocks = bytes / 64;
+		if (nontemporal)
+		{
+			for (size_t i = 0; i < blocks; i++, dst += 64, src += 64)
+			{
+				__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+				__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+				__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+				__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 48));
+				_mm_stream_si128(reinterpret_cast<__m128i*>(dst), a);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(dst + 16), b);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(dst + 32), c);
+				_mm_stream_si128(reinterpret_cast<__m128i*>(dst + 48), d);
+			}
+		}
+		else
+		{
+			for (size_t i = 0; i < blocks; i++, dst += 64, src += 64)
+			{
+				__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+				__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+				__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+				__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 48));
+				_mm_store_si128(reinterpret_cast<__m128i*>(dst), a);
+				_mm_store_si128(reinterpret_cast<__m128i*>(dst + 16), b);
+				_mm_store_si128(reinterpret_cast<__m128i*>(dst + 32), c);
+				_mm_store_si128(reinterpret_cast<__m128i*>(dst + 48), d);
+			}
+		}
+		memcpy(dst, src, bytes & 63);
+	}
+#else
+	void plane_copy_row_sse2(uint8_t* dst, const uint8_t* src, size_t bytes, bool nontemporal)
+	{
+		plane_copy_row_scalar(dst, src, bytes, nontemporal);
+	}
+#endif
+
+#if SKMF_NEON
+	void plane_copy_row_neon(uint8_t* dst, const uint8_t* src, size_t bytes, bool nontemporal)
+	{
+		// ARM has no non-temporal hint worth using from here; the wide
+		// load/store pairs are what beats memcpy on small in-order cores
+		size_t blocks = bytes / 64;
+		for (size_t i = 0; i < blocks; i++, dst += 64, src += 64)
+		{
+			uint8x16x4_t v = vld1q_u8_x4(src);
+			vst1q_u8_x4(dst, v);
+		}
+		memcpy(dst, src, bytes & 63);
+	}
+#else
+	void plane_copy_row_neon(uint8_t* dst, const uint8_t* src, size_t bytes, bool nontemporal)
+	{
+		plane_copy_row_scalar(dst, src, bytes, nontemporal);
+	}
+#endif
+
+} // namespace nakamir
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nakamir {
+
+	enum plane_copy_impl_ {
+		plane_copy_impl_auto,   // Best available on this CPU
+		plane_copy_impl_scalar,
+		plane_copy_impl_sse2,
+		plane_copy_impl_avx2,
+		plane_copy_impl_neon,
+	};
+
+	// Copies rows of row_bytes from one strided plane to another. Strides are in
+	// bytes and may be negative for bottom-up images (see MF_MT_DEFAULT_STRIDE),
+	// in which case the pointer is the first row in memory order of the image's
+	// top line, as returned by IMF2DBuffer::Lock2D. Planes bigger than the
+	// non-temporal threshold are written with streaming stores so they don't
+	// evict the rest of the cache, which also suits write-combined mapped GPU memory.
+	void plane_copy(/**[out]**/ uint8_t* dst, int32_t dst_stride, /**[in]**/ const uint8_t* src, int32_t src_stride, int32_t row_bytes, int32_t rows);
+
+	// Copies both planes of an NV12 image. The chroma plane has (height + 1) / 2
+	// rows of interleaved UV pairs, (width + 1) / 2 pairs per row, so odd sizes
+	// round up like D3D and MF do.
+	void nv12_copy(/**[out]**/ uint8_t* dst_y, int32_t dst_y_stride, /**[out]**/ uint8_t* dst_uv, int32_t dst_uv_stride,
+		/**[in]**/ const uint8_t* src_y, int32_t src_y_stride, /**[in]**/ const uint8_t* src_uv, int32_t src_uv_stride,
+		int32_t width, int32_t height);
+
+	inline int32_t nv12_chroma_row_bytes(int32_t width) { return ((width + 1) / 2) * 2; }
+	inline int32_t nv12_chroma_rows(int32_t height) { return (height + 1) / 2; }
+	// Layout we use for NV12 frames in system memory: both planes share an even
+	// stride and the chroma plane directly follows the luma plane
+	inline int32_t nv12_packed_stride(int32_t width) { return nv12_chroma_row_bytes(width); }
+	inline size_t nv12_packed_size(int32_t width, int32_t height)
+	{
+		return static_cast<size_t>(nv12_packed_stride(width)) * (height + nv12_chroma_rows(height));
+	}
+
+	// Forces a specific kernel, for benchmarking or to rule out a SIMD path.
+	// Returns false, leaving the current choice alone, if the CPU can't run it.
+	bool plane_copy_set_impl(plane_copy_impl_ impl);
+	plane_copy_impl_ plane_copy_get_impl();
+	const char* plane_copy_impl_name(plane_copy_impl_ impl);
+
+	// Planes of at least this many bytes use non-temporal stores, 0 disables them
+	void plane_copy_set_nontemporal_threshold(size_t bytes);
+	size_t plane_copy_get_nontemporal_threshold();
+
+	// Per-row kernels, exposed for the dispatcher and benchmarks
+	typedef void(*plane_copy_row_fn)(uint8_t* dst, const uint8_t* src, size_t bytes, bool nontemporal);
+	void plane_copy_row_scalar(uint8_t* dst, const uint8_t* src, size_t bytes, bool nontemporal);
+	void plane_copy_row_sse2(uint8_t* dst, const uint8_t* src, size_t bytes, bool nontemporal);
+	void plane_copy_row_avx2(uint8_t* dst, const uint8_t* src, size_t bytes, bool nontemporal);
+	void plane_copy_row_neon(uint8_t* dst, const uint8_t* src, size_t bytes, bool nontemporal);
+	// Orders any streaming stores issued by the row kernels before later writes
+	void plane_copy_fence();
+
+} // namespace nakamir
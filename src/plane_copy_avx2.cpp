@@ -0,0 +1,64 @@
+#include "plane_copy.h"
+#include "cpu_features.h"
+#include <cstring>
+
+// Built with AVX2 code generation enabled (see CMakeLists.txt), and only ever
+// called after the dispatcher has checked the CPU supports it
+#if SKMF_X86
+#include <immintrin.h>
+#endif
+
+namespace nakamir {
+
+#if SKMF_X86
+	void plane_copy_row_avx2(uint8_t* dst, const uint8_t* src, size_t bytes, bool nontemporal)
+	{
+		// Streaming stores need an aligned destination, so peel off the head. They
+		// also shouldn't share a cache line with regular stores, so go to a line.
+		size_t alignment = nontemporal ? 64 : 32;
+		size_t head = (alignment - (reinterpret_cast<uintptr_t>(dst) & (alignment - 1))) & (alignment - 1);
+		if (head > bytes) head = bytes;
+		memcpy(dst, src, head);
+		dst += head; src += head; bytes -= head;
+
+		size_t blocks = bytes / 128;
+		if (nontemporal)
+		{
+			for (size_t i = 0; i < blocks; i++, dst += 128, src += 128)
+			{
+				__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+				__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32));
+				__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 64));
+				__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 96));
+				_mm256_stream_si256(reinterpret_cast<__m256i*>(dst), a);
+				_mm256_stream_si256(reinterpret_cast<__m256i*>(dst + 32), b);
+				_mm256_stream_si256(reinterpret_cast<__m256i*>(dst + 64), c);
+				_mm256_stream_si256(reinterpret_cast<__m256i*>(dst + 96), d);
+			}
+		}
+		else
+		{
+			for (size_t i = 0; i < blocks; i++, dst += 128, src += 128)
+			{
+				__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+				__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32));
+				__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 64));
+				__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 96));
+				_mm256_store_si256(reinterpret_cast<__m256i*>(dst), a);
+				_mm256_store_si256(reinterpret_cast<__m256i*>(dst + 32), b);
+				_mm256_store_si256(reinterpret_cast<__m256i*>(dst + 64), c);
+				_mm256_store_si256(reinterpret_cast<__m256i*>(dst + 96), d);
+			}
+		}
+		memcpy(dst, src, bytes & 127);
+		// Don't pay the AVX to SSE transition penalty in the caller
+		_mm256_zeroupper();
+	}
+#else
+	void plane_copy_row_avx2(uint8_t* dst, const uint8_t* src, size_t bytes, bool nontemporal)
+	{
+		plane_copy_row_scalar(dst, src, bytes, nontemporal);
+	}
+#endif
+
+} // namespace nakamir
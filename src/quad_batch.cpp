@@ -0,0 +1,105 @@
+#include "quad_batch.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace nakamir {
+
+	void quad_batch_write_quad(const float* transform, const float uv_rect[4], quad_vertex_t vertices[4])
+	{
+		// Row vectors, as SK's matrices are laid out: p' = p * transform
+		float normal[3] = { 0, 0, -1 };
+		if (transform)
+		{
+			float x = -transform[8];
+			float y = -transform[9];
+			float z = -transform[10];
+			float length = std::sqrt(x * x + y * y + z * z);
+			if (length > 0)
+			{
+				normal[0] = x / length;
+				normal[1] = y / length;
+				normal[2] = z / length;
+			}
+		}
+		for (int i = 0; i < 4; i++)
+		{
+			quad_vertex_t& vertex = vertices[i];
+			float cx = quad_batch_corners[i][0];
+			float cy = quad_batch_corners[i][1];
+			if (transform)
+			{
+				for (int axis = 0; axis < 3; axis++)
+					vertex.pos[axis] = cx * transform[axis] + cy * transform[4 + axis] + transform[12 + axis];
+			}
+			else
+			{
+				vertex.pos[0] = cx;
+				vertex.pos[1] = cy;
+				vertex.pos[2] = 0;
+			}
+			memcpy(vertex.norm, normal, sizeof(normal));
+			vertex.uv[0] = uv_rect[0] + quad_batch_uvs[i][0] * uv_rect[2];
+			vertex.uv[1] = uv_rect[1] + quad_batch_uvs[i][1] * uv_rect[3];
+			memset(vertex.color, 255, sizeof(vertex.color));
+		}
+	}
+
+	void quad_batch::clear()
+	{
+		_added.clear();
+		_order.clear();
+		_vertices.clear();
+		_indices.clear();
+		_draws.clear();
+		_materials = 0;
+	}
+
+	void quad_batch::add(const void* material, const float transform[16], const float uv_rect[4])
+	{
+		quad_instance_t instance;
+		memcpy(instance.transform, transform, sizeof(instance.transform));
+		memcpy(instance.uv_rect, uv_rect, sizeof(instance.uv_rect));
+		_order.push_back({ material, static_cast<uint32_t>(_added.size()) });
+		_added.push_back(instance);
+	}
+
+	void quad_batch::build()
+	{
+		// Stable, so quads keep their submission order within a material, which
+		// is what the caller would have got drawing them one at a time
+		std::stable_sort(_order.begin(), _order.end(),
+			[](const entry_t& a, const entry_t& b) { return a.material < b.material; });
+
+		_vertices.resize(_order.size() * 4);
+		_indices.resize(_order.size() * 6);
+		_draws.clear();
+		_materials = 0;
+		for (size_t i = 0; i < _order.size(); i++)
+		{
+			bool new_material = i == 0 || _order[i].material != _order[i - 1].material;
+			if (new_material)
+				_materials++;
+			if (new_material || _draws.back().count == _max_quads)
+				_draws.push_back({ _order[i].material, static_cast<uint32_t>(i), 0 });
+			quad_batch_draw_t& draw = _draws.back();
+
+			const quad_instance_t& instance = _added[_order[i].index];
+			quad_batch_write_quad(instance.transform, instance.uv_rect, &_vertices[i * 4]);
+			uint32_t base = draw.count * 4;
+			for (int k = 0; k < 6; k++)
+				_indices[i * 6 + k] = base + quad_batch_indices[k];
+			draw.count++;
+		}
+	}
+
+	quad_batch_stats_t quad_batch::get_stats() const
+	{
+		quad_batch_stats_t stats = {};
+		stats.quads = static_cast<uint32_t>(_order.size());
+		stats.draws = static_cast<uint32_t>(_draws.size());
+		stats.materials = _materials;
+		return stats;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nakamir {
+
+	// Laid out like StereoKit's vert_t, so a batch's vertices upload as they are
+	struct quad_vertex_t {
+		float pos[3];
+		float norm[3];
+		float uv[2];
+		uint8_t color[4];
+	};
+
+	// A quad as added: a row-major world transform for the unit quad, and the
+	// UV offset (xy) and scale (zw) its texture covers, e.g. an atlas tile
+	struct quad_instance_t {
+		float transform[16];
+		float uv_rect[4];
+	};
+
+	// A run of quads sharing a material, drawn as one mesh. Its vertices start
+	// at first * 4 and its indices at first * 6; indices count from the
+	// draw's own first vertex.
+	struct quad_batch_draw_t {
+		const void* material;
+		uint32_t first;
+		uint32_t count;
+	};
+
+	struct quad_batch_stats_t {
+		uint32_t quads;
+		uint32_t draws;
+		uint32_t materials;
+	};
+
+	// Keeps a draw's vertices within 16 bit indices
+	const uint32_t quad_batch_max_quads = 16384;
+
+	// SK's default quad, which the batch reproduces: corners, UVs and winding
+	const float quad_batch_corners[4][2] = { { -0.5f, -0.5f }, { 0.5f, -0.5f }, { 0.5f, 0.5f }, { -0.5f, 0.5f } };
+	const float quad_batch_uvs[4][2] = { { 1, 1 }, { 0, 1 }, { 0, 0 }, { 1, 0 } };
+	const uint32_t quad_batch_indices[6] = { 2, 1, 0, 3, 2, 0 };
+
+	// The unit quad's four vertices, moved by transform (nullptr for none)
+	// with UVs squeezed into uv_rect
+	void quad_batch_write_quad(/**[in]**/ const float* transform, const float uv_rect[4], /**[out]**/ quad_vertex_t vertices[4]);
+
+	// Collects a frame's worth of quads and turns them into as few draws as
+	// possible. StereoKit has no way to hand it a custom instance buffer, and
+	// nv12_quad.hlsl takes its UVs from the mesh, so instead of instancing the
+	// batch builds the geometry on the CPU: quads are ordered by material,
+	// keeping the order they were added in within one, each material's run is
+	// cut into draws of at most max_quads, and every draw's quads are written
+	// out in world space, ready to go as one mesh. Materials are opaque keys,
+	// so this runs without a GPU.
+	class quad_batch {
+	public:
+		explicit quad_batch(uint32_t max_quads = quad_batch_max_quads) : _max_quads(max_quads ? max_quads : 1) {}
+
+		void clear();
+		void add(/**[in]**/ const void* material, const float transform[16], const float uv_rect[4]);
+		// Sorts what was added and fills vertices, indices and draws
+		void build();
+
+		const std::vector<quad_vertex_t>& vertices() const { return _vertices; }
+		const std::vector<uint32_t>& indices() const { return _indices; }
+		const std::vector<quad_batch_draw_t>& draws() const { return _draws; }
+		quad_batch_stats_t get_stats() const;
+
+	private:
+		struct entry_t {
+			const void* material;
+			uint32_t index;
+		};
+
+		uint32_t _max_quads;
+		// Kept between frames so a steady scene doesn't allocate
+		std::vector<quad_instance_t> _added;
+		std::vector<entry_t> _order;
+		std::vector<quad_vertex_t> _vertices;
+		std::vector<uint32_t> _indices;
+		std::vector<quad_batch_draw_t> _draws;
+		uint32_t _materials = 0;
+	};
+
+} // namespace nakamir
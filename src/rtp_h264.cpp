@@ -0,0 +1,604 @@
+#include "rtp_h264.h"
+#include <cstring>
+
+namespace nakamir {
+
+	// Smallest MTU that still leaves FU-A fragments some payload
+	const size_t rtp_min_mtu = rtp_header_size + 16;
+	// Arena bytes to allow per packet: the RTP header plus a FU-A indicator and
+	// header, rounded up. A STAP-A of k NAL units takes 13 + 2k, within what its
+	// k units would have been given on their own.
+	const size_t rtp_arena_per_packet = 16;
+
+	// A jump of this many packets or more is a restarted sender, not loss,
+	// and this far back is a straggler rather than a jump (RFC 3550 A.1)
+	const uint16_t rtp_max_dropout = 3000;
+	const uint16_t rtp_max_misorder = 100;
+
+	static const uint8_t rtp_start_code[4] = { 0, 0, 0, 1 };
+
+	static bool rtp_is_parameter_set(uint8_t type)
+	{
+		return type == h264_nal_sps || type == h264_nal_pps;
+	}
+
+	void rtp_h264_packetizer::reset(uint32_t ssrc, uint8_t payload_type, size_t mtu)
+	{
+		_ssrc = ssrc;
+		_payload_type = payload_type & 0x7F;
+		_mtu = mtu < rtp_min_mtu ? rtp_min_mtu : mtu;
+		_sequence = 0;
+		_timestamp = 0;
+		_nals.clear();
+		_packets.clear();
+		_spans.clear();
+		_arena_used = 0;
+		_stats = {};
+	}
+
+	uint8_t* rtp_h264_packetizer::begin_packet(size_t extra)
+	{
+		uint8_t* header = _arena.data() + _arena_used;
+		_arena_used += rtp_header_size + extra;
+
+		header[0] = 0x80;                 // Version 2, no padding, extension or CSRCs
+		header[1] = _payload_type;
+		header[2] = static_cast<uint8_t>(_sequence >> 8);
+		header[3] = static_cast<uint8_t>(_sequence);
+		header[4] = static_cast<uint8_t>(_timestamp >> 24);
+		header[5] = static_cast<uint8_t>(_timestamp >> 16);
+		header[6] = static_cast<uint8_t>(_timestamp >> 8);
+		header[7] = static_cast<uint8_t>(_timestamp);
+		header[8] = static_cast<uint8_t>(_ssrc >> 24);
+		header[9] = static_cast<uint8_t>(_ssrc >> 16);
+		header[10] = static_cast<uint8_t>(_ssrc >> 8);
+		header[11] = static_cast<uint8_t>(_ssrc);
+
+		rtp_packet_t packet = {};
+		packet.first_span = static_cast<uint32_t>(_spans.size());
+		packet.sequence = _sequence++;
+		_packets.push_back(packet);
+		add_span(header, rtp_header_size + extra);
+		return header + rtp_header_size;
+	}
+
+	void rtp_h264_packetizer::add_span(const uint8_t* data, size_t size)
+	{
+		_spans.push_back({ data, size });
+		rtp_packet_t& packet = _packets.back();
+		packet.span_count++;
+		packet.size += static_cast<uint32_t>(size);
+	}
+
+	size_t rtp_h264_packetizer::packetize(const uint8_t* data, size_t size, uint32_t timestamp)
+	{
+		_packets.clear();
+		_spans.clear();
+		_nals.clear();
+		_arena_used = 0;
+		_timestamp = timestamp;
+
+		// First pass: what goes out, and a bound on the headers it needs
+		size_t payload_max = _mtu - rtp_header_size;
+		size_t fragment_max = payload_max - 2;
+		size_t packet_bound = 0;
+		size_t offset = 0;
+		h264_nal_t nal;
+		while (h264_next_nal(data, size, &offset, &nal))
+		{
+			if (nal.size == 0 || nal.type == h264_nal_aud || nal.type == h264_nal_filler)
+				continue;
+			_nals.push_back(nal);
+			packet_bound += nal.size <= payload_max ? 1 : (nal.size - 1 + fragment_max - 1) / fragment_max;
+		}
+		if (_nals.empty())
+			return 0;
+
+		size_t arena_bound = packet_bound * rtp_arena_per_packet + _nals.size() * 2;
+		if (_arena.size() < arena_bound)
+			_arena.resize(arena_bound);
+		_spans.reserve(packet_bound * 2 + _nals.size() * 2);
+		_packets.reserve(packet_bound);
+
+		for (size_t i = 0; i < _nals.size();)
+		{
+			const h264_nal_t& unit = _nals[i];
+
+			// Parameter sets travel together, so a receiver gets both or neither
+			if (rtp_is_parameter_set(unit.type))
+			{
+				size_t count = 0;
+				size_t total = 1;
+				while (i + count < _nals.size() && rtp_is_parameter_set(_nals[i + count].type) && total + 2 + _nals[i + count].size <= payload_max)
+				{
+					total += 2 + _nals[i + count].size;
+					count++;
+				}
+				if (count >= 2)
+				{
+					// STAP-A: F is the OR and NRI the highest of the aggregated units
+					uint8_t forbidden = 0, nri = 0;
+					for (size_t j = 0; j < count; j++)
+					{
+						forbidden |= _nals[i + j].data[0] & 0x80;
+						uint8_t unit_nri = _nals[i + j].data[0] & 0x60;
+						nri = unit_nri > nri ? unit_nri : nri;
+					}
+					uint8_t* header = begin_packet(1);
+					header[0] = static_cast<uint8_t>(forbidden | nri | rtp_h264_nal_stap_a);
+					for (size_t j = 0; j < count; j++)
+					{
+						uint8_t* length = _arena.data() + _arena_used;
+						_arena_used += 2;
+						length[0] = static_cast<uint8_t>(_nals[i + j].size >> 8);
+						length[1] = static_cast<uint8_t>(_nals[i + j].size);
+						add_span(length, 2);
+						add_span(_nals[i + j].data, _nals[i + j].size);
+					}
+					_stats.stap_a++;
+					i += count;
+					continue;
+				}
+			}
+
+			if (unit.size <= payload_max)
+			{
+				begin_packet(0);
+				add_span(unit.data, unit.size);
+				_stats.single_nal++;
+			}
+			else
+			{
+				// FU-A: the NAL header is replaced by an indicator carrying its F
+				// and NRI, and a header per fragment with its type and start/end bits
+				uint8_t indicator = static_cast<uint8_t>((unit.data[0] & 0xE0) | rtp_h264_nal_fu_a);
+				uint8_t type = unit.data[0] & 0x1F;
+				const uint8_t* payload = unit.data + 1;
+				size_t left = unit.size - 1;
+				// Even fragments, rather than full ones and a runt at the end: the
+				// first left % fragments of them take a byte more than the rest
+				size_t fragments = (left + fragment_max - 1) / fragment_max;
+				size_t fragment = left / fragments;
+				size_t longer = left % fragments;
+				for (size_t f = 0; f < fragments; f++)
+				{
+					size_t chunk = f < longer ? fragment + 1 : fragment;
+					uint8_t* header = begin_packet(2);
+					header[0] = indicator;
+					header[1] = static_cast<uint8_t>((f == 0 ? 0x80 : 0) | (f + 1 == fragments ? 0x40 : 0) | type);
+					add_span(payload, chunk);
+					payload += chunk;
+					left -= chunk;
+				}
+				_stats.fu_a += fragments;
+			}
+			i++;
+		}
+
+		// The marker bit goes on the access unit's last packet
+		rtp_packet_t& last = _packets.back();
+		last.marker = true;
+		_arena[_spans[last.first_span].data - _arena.data() + 1] |= 0x80;
+
+		_stats.access_units++;
+		_stats.packets += _packets.size();
+		_stats.copied_bytes += _arena_used;
+		for (const h264_nal_t& unit : _nals)
+			_stats.payload_bytes += unit.size;
+		return _packets.size();
+	}
+
+	void rtp_h264_packetizer::copy_packet(const rtp_packet_t& packet, uint8_t* dst) const
+	{
+		const rtp_span_t* spans = packet_spans(packet);
+		for (uint32_t i = 0; i < packet.span_count; i++)
+		{
+			memcpy(dst, spans[i].data, spans[i].size);
+			dst += spans[i].size;
+		}
+	}
+
+	///////////////////////////////////////////
+	// Depacketizer
+	///////////////////////////////////////////
+
+	void rtp_h264_depacketizer::reset(uint32_t reorder_depth, size_t max_packet, size_t max_frame)
+	{
+		// A power of two, so slots line up across the sequence number wrapping,
+		// and short of what counts as a restart
+		uint32_t depth = 1;
+		while (depth < reorder_depth && depth * 2 < rtp_max_dropout)
+			depth *= 2;
+		reorder_depth = depth;
+		_max_packet = max_packet < rtp_min_mtu ? rtp_min_mtu : max_packet > 0xFFFF ? 0xFFFF : max_packet;
+		_max_frame = max_frame;
+		_slots.assign(reorder_depth, slot_t{});
+		_slot_data.resize(reorder_depth * _max_packet);
+		_held = 0;
+
+		// A call takes in at most the frame in progress plus the window's worth
+		// of packets, and rewriting NAL unit lengths as start codes no more
+		// than doubles a payload
+		_slab.resize(_max_frame + (reorder_depth + 1) * _max_packet * 2);
+		_slab_used = 0;
+		_frames.clear();
+		_frames.reserve(reorder_depth + 1);
+
+		_started = false;
+		_bad_sequence_set = false;
+		_frame_open = false;
+		_fragment_open = false;
+		_loss_pending = false;
+		_timed = false;
+		_time = 0;
+		_waiting_keyframe = true;
+		_stats = {};
+	}
+
+	void rtp_h264_depacketizer::begin_call()
+	{
+		// Frames handed out last call are done with; keep only the one in progress
+		if (_frame_open && _frame_begin > 0)
+			memmove(_slab.data(), _slab.data() + _frame_begin, _slab_used - _frame_begin);
+		_slab_used = _frame_open ? _slab_used - _frame_begin : 0;
+		_frame_begin = 0;
+		_frames.clear();
+	}
+
+	size_t rtp_h264_depacketizer::receive(const uint8_t* packet, size_t size)
+	{
+		begin_call();
+
+		// RFC 3550 5.1: version 2, then CSRCs, an extension and padding to skip
+		if (size < rtp_header_size || (packet[0] >> 6) != 2)
+		{
+			_stats.invalid++;
+			return 0;
+		}
+		size_t header = rtp_header_size + (packet[0] & 0x0F) * 4;
+		if ((packet[0] & 0x10) && header + 4 <= size)
+			header += 4 + ((static_cast<size_t>(packet[header + 2]) << 8) | packet[header + 3]) * 4;
+		else if (packet[0] & 0x10)
+			header = size + 1;
+		size_t end = size;
+		if ((packet[0] & 0x20) && size > 0)
+			end = packet[size - 1] <= size ? size - packet[size - 1] : 0;
+		if (header > end)
+		{
+			_stats.invalid++;
+			return 0;
+		}
+
+		bool marker = (packet[1] & 0x80) != 0;
+		uint16_t sequence = static_cast<uint16_t>((packet[2] << 8) | packet[3]);
+		uint32_t timestamp = (static_cast<uint32_t>(packet[4]) << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+		uint32_t ssrc = (static_cast<uint32_t>(packet[8]) << 24) | (packet[9] << 16) | (packet[10] << 8) | packet[11];
+		const uint8_t* payload = packet + header;
+		size_t payload_size = end - header;
+		_stats.packets++;
+
+		if (!_started || ssrc != _ssrc)
+			restart(sequence, ssrc);
+
+		uint16_t ahead = static_cast<uint16_t>(sequence - _next);
+		if (ahead >= rtp_max_dropout)
+		{
+			// Stragglers from as far back as the window reaches are late too
+			size_t misorder = _slots.size() > rtp_max_misorder ? _slots.size() : rtp_max_misorder;
+			if (ahead <= 0xFFFF - misorder)
+			{
+				// A big jump either way: believe it once the next packet follows on
+				if (!_bad_sequence_set || sequence != _bad_sequence)
+				{
+					_bad_sequence = static_cast<uint16_t>(sequence + 1);
+					_bad_sequence_set = true;
+					_stats.invalid++;
+					return _frames.size();
+				}
+				restart(sequence, ssrc);
+				ahead = 0;
+			}
+			else
+			{
+				_stats.late++;
+				return _frames.size();
+			}
+		}
+		_bad_sequence_set = false;
+
+		if (ahead == 0)
+		{
+			if (_held > 0)
+				_stats.reordered++;
+			consume(payload, payload_size, timestamp, marker);
+			_next++;
+			drain();
+			return _frames.size();
+		}
+
+		// Early: make room in the window by giving up on the oldest missing
+		// packets, then hold this one until its turn
+		while (static_cast<uint16_t>(sequence - _next) >= _slots.size())
+		{
+			skip();
+			drain();
+		}
+		if (sequence == _next)
+		{
+			consume(payload, payload_size, timestamp, marker);
+			_next++;
+			drain();
+		}
+		else
+			store(sequence, payload, payload_size, timestamp, marker);
+		return _frames.size();
+	}
+
+	size_t rtp_h264_depacketizer::flush()
+	{
+		begin_call();
+		while (_held > 0)
+		{
+			skip();
+			drain();
+		}
+		return _frames.size();
+	}
+
+	void rtp_h264_depacketizer::restart(uint16_t sequence, uint32_t ssrc)
+	{
+		if (_started)
+		{
+			_stats.resyncs++;
+			for (slot_t& slot : _slots)
+				slot.used = false;
+			_held = 0;
+			// Whatever was in progress is cut short, and a new sender has to
+			// start from a keyframe anyway
+			if (_frame_open)
+			{
+				_frame_damaged = true;
+				end_frame();
+			}
+			_waiting_keyframe = true;
+			_loss_pending = false;
+			_timed = false;
+		}
+		_losses = 0;
+		_parameter_sets = 0;
+		_started = true;
+		_ssrc = ssrc;
+		_next = sequence;
+	}
+
+	void rtp_h264_depacketizer::store(uint16_t sequence, const uint8_t* payload, size_t size, uint32_t timestamp, bool marker)
+	{
+		slot_t& slot = _slots[sequence % _slots.size()];
+		if (slot.used)
+		{
+			// The window is never wider than the slots, so it can only be this packet again
+			_stats.duplicates++;
+			return;
+		}
+		// Too big to hold: let it count as lost when its turn comes
+		if (size > _max_packet)
+			return;
+
+		memcpy(_slot_data.data() + (sequence % _slots.size()) * _max_packet, payload, size);
+		slot.timestamp = timestamp;
+		slot.sequence = sequence;
+		slot.size = static_cast<uint16_t>(size);
+		slot.used = true;
+		slot.marker = marker;
+		_held++;
+	}
+
+	void rtp_h264_depacketizer::skip()
+	{
+		slot_t& slot = _slots[_next % _slots.size()];
+		if (slot.used && slot.sequence == _next)
+		{
+			slot.used = false;
+			_held--;
+			consume(_slot_data.data() + (_next % _slots.size()) * _max_packet, slot.size, slot.timestamp, slot.marker);
+		}
+		else
+			lose();
+		_next++;
+	}
+
+	void rtp_h264_depacketizer::drain()
+	{
+		while (_held > 0)
+		{
+			slot_t& slot = _slots[_next % _slots.size()];
+			if (!slot.used || slot.sequence != _next)
+				return;
+			skip();
+		}
+	}
+
+	void rtp_h264_depacketizer::lose()
+	{
+		_stats.lost++;
+		_losses++;
+		// After a marker the loss is the start of the next frame. In a frame
+		// whose marker hasn't been seen it's the frame's own, unless the run
+		// of losses goes on long enough to take in the next frame's start too;
+		// the next packet says which, by its timestamp.
+		if (_frame_open)
+		{
+			_frame_damaged = true;
+			_loss_pending = _losses >= 2;
+		}
+		else
+			_loss_pending = true;
+	}
+
+	void rtp_h264_depacketizer::consume(const uint8_t* payload, size_t size, uint32_t timestamp, bool marker)
+	{
+		if (_frame_open && timestamp != _frame_timestamp)
+			end_frame();
+		else if (_frame_open)
+			_loss_pending = false;
+		if (!_frame_open)
+			begin_frame(timestamp);
+		_losses = 0;
+
+		if (size == 0)
+		{
+			_stats.invalid++;
+			_frame_damaged = true;
+		}
+		else
+		{
+			uint8_t type = payload[0] & 0x1F;
+			// A new NAL unit before the last fragment's end: the rest went missing
+			if (_fragment_open && type != rtp_h264_nal_fu_a)
+			{
+				_frame_damaged = true;
+				_fragment_open = false;
+			}
+
+			if (type >= 1 && type <= 23)
+				append_nal(payload, size);
+			else if (type == rtp_h264_nal_stap_a)
+			{
+				size_t offset = 1;
+				while (offset + 2 <= size)
+				{
+					size_t length = (static_cast<size_t>(payload[offset]) << 8) | payload[offset + 1];
+					offset += 2;
+					if (length == 0 || offset + length > size)
+					{
+						_frame_damaged = true;
+						break;
+					}
+					append_nal(payload + offset, length);
+					offset += length;
+				}
+			}
+			else if (type == rtp_h264_nal_fu_a && size > 2)
+			{
+				bool start = (payload[1] & 0x80) != 0;
+				bool end = (payload[1] & 0x40) != 0;
+				if (start)
+				{
+					if (_fragment_open)
+						_frame_damaged = true;
+					begin_nal(static_cast<uint8_t>((payload[0] & 0xE0) | (payload[1] & 0x1F)));
+					_fragment_open = true;
+				}
+				if (_fragment_open)
+				{
+					append(payload + 2, size - 2);
+					_fragment_open = !end;
+				}
+				else
+					_frame_damaged = true;    // The fragment's start went missing
+			}
+			else
+			{
+				// STAP-B, MTAP and FU-B only appear in interleaved mode
+				_stats.invalid++;
+				_frame_damaged = true;
+			}
+		}
+
+		if (marker)
+			end_frame();
+	}
+
+	void rtp_h264_depacketizer::begin_frame(uint32_t timestamp)
+	{
+		if (_timed)
+			_time += static_cast<int32_t>(timestamp - _frame_timestamp);
+		_timed = true;
+		_frame_open = true;
+		_frame_begin = _slab_used;
+		_frame_timestamp = timestamp;
+		_frame_damaged = _loss_pending;
+		_frame_keyframe = false;
+		_frame_parameter_sets = 0;
+		_fragment_open = false;
+		_loss_pending = false;
+	}
+
+	void rtp_h264_depacketizer::end_frame()
+	{
+		_frame_open = false;
+		if (_fragment_open)
+			_frame_damaged = true;
+		_fragment_open = false;
+
+		size_t size = _slab_used - _frame_begin;
+		bool usable = false;
+		if (_frame_damaged)
+		{
+			_stats.frames_damaged++;
+			if (!_waiting_keyframe)
+				_stats.keyframe_requests++;
+			_waiting_keyframe = true;
+		}
+		else if (_waiting_keyframe && (!_frame_keyframe || (_parameter_sets | _frame_parameter_sets) != 3))
+		{
+			// Including a keyframe the decoder has no SPS and PPS for yet, as
+			// when a stream is joined with those reordered ahead of its start
+			if (size > 0)
+				_stats.frames_skipped++;
+		}
+		else
+			usable = size > 0;
+
+		if (!usable)
+		{
+			_slab_used = _frame_begin;
+			return;
+		}
+		_waiting_keyframe = false;
+		_parameter_sets |= _frame_parameter_sets;
+		rtp_frame_t frame = {};
+		frame.data = _slab.data() + _frame_begin;
+		frame.size = size;
+		frame.timestamp = _frame_timestamp;
+		frame.time = _time;
+		frame.keyframe = _frame_keyframe;
+		_frames.push_back(frame);
+		_stats.frames++;
+	}
+
+	void rtp_h264_depacketizer::append(const uint8_t* data, size_t size)
+	{
+		// Damaged frames are thrown away, so don't bother copying them
+		if (_frame_damaged)
+			return;
+		if (_slab_used + size > _slab.size() || _slab_used - _frame_begin + size > _max_frame)
+		{
+			_frame_damaged = true;
+			return;
+		}
+		memcpy(_slab.data() + _slab_used, data, size);
+		_slab_used += size;
+		_stats.copied_bytes += size;
+	}
+
+	void rtp_h264_depacketizer::begin_nal(uint8_t header)
+	{
+		uint8_t type = header & 0x1F;
+		if (type == h264_nal_slice_idr)
+			_frame_keyframe = true;
+		else if (type == h264_nal_sps)
+			_frame_parameter_sets |= 1;
+		else if (type == h264_nal_pps)
+			_frame_parameter_sets |= 2;
+		append(rtp_start_code, sizeof(rtp_start_code));
+		append(&header, 1);
+	}
+
+	void rtp_h264_depacketizer::append_nal(const uint8_t* nal, size_t size)
+	{
+		begin_nal(nal[0]);
+		append(nal + 1, size - 1);
+	}
+
+} // namespace nakamir
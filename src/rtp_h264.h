@@ -0,0 +1,236 @@
+#pragma once
+
+#include "h264_nal.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nakamir {
+
+	// Bytes of a fixed RTP header without CSRCs or extensions (RFC 3550 5.1)
+	const size_t rtp_header_size = 12;
+	// H.264 over RTP uses a 90kHz clock
+	const uint32_t rtp_h264_clock_rate = 90000;
+
+	// RFC 6184 NAL unit types beyond those of H.264 itself
+	enum rtp_h264_nal_type_ {
+		rtp_h264_nal_stap_a = 24,
+		rtp_h264_nal_fu_a   = 28,
+	};
+
+	// One piece of a packet, scatter-gather style like an iovec: either a
+	// header the packetizer wrote, or a range of the encoded access unit
+	struct rtp_span_t {
+		const uint8_t* data;
+		size_t size;
+	};
+
+	// A packet is span_count spans from first_span on, sent back to back
+	struct rtp_packet_t {
+		uint32_t first_span;
+		uint32_t span_count;
+		uint32_t size;             // Bytes on the wire, RTP header included
+		uint16_t sequence;
+		bool marker;               // Last packet of the access unit
+	};
+
+	struct rtp_packetizer_stats_t {
+		uint64_t access_units;
+		uint64_t packets;
+		uint64_t single_nal;       // Packets carrying one whole NAL unit
+		uint64_t stap_a;           // Packets aggregating parameter sets
+		uint64_t fu_a;             // Fragments of NAL units bigger than a packet
+		uint64_t payload_bytes;    // Bytes of the access units referenced, not copied
+		uint64_t copied_bytes;     // Bytes the packetizer wrote itself: RTP, STAP-A and FU headers
+	};
+
+	// Splits Annex-B H.264 access units, e.g. encoder output, into RTP packets
+	// per RFC 6184 in non-interleaved mode: NAL units that fit go out whole,
+	// runs of SPS/PPS are aggregated into one STAP-A, and anything bigger than
+	// a packet is split into FU-A fragments of near equal size. AUD and filler
+	// NAL units are dropped, as the RFC allows.
+	//
+	// Nothing of the access unit is copied: each packet is a list of spans,
+	// headers from a small arena the packetizer owns and payload straight from
+	// the caller's buffer, ready for sendmsg/WSASendTo. Both stay valid until
+	// the next packetize call, and the payload spans only as long as the
+	// caller's buffer.
+	//
+	// Not thread safe; one packetizer per stream.
+	class rtp_h264_packetizer {
+	public:
+		static const size_t default_mtu = 1200;
+
+		rtp_h264_packetizer() = default;
+		explicit rtp_h264_packetizer(uint32_t ssrc, uint8_t payload_type = 96, size_t mtu = default_mtu) { reset(ssrc, payload_type, mtu); }
+
+		// mtu is the largest RTP packet, header included, e.g. 1200 to stay
+		// clear of IP fragmentation on most paths. The sequence starts at 0.
+		void reset(uint32_t ssrc, uint8_t payload_type = 96, size_t mtu = default_mtu);
+
+		// Packetizes one access unit stamped with a 90kHz timestamp. Returns
+		// the number of packets, 0 if it holds no NAL unit worth sending.
+		size_t packetize(const uint8_t* data, size_t size, uint32_t timestamp);
+
+		const std::vector<rtp_packet_t>& packets() const { return _packets; }
+		const rtp_span_t* packet_spans(const rtp_packet_t& packet) const { return _spans.data() + packet.first_span; }
+		// Copies one packet into contiguous memory, for transports without
+		// scatter-gather. dst needs packet.size bytes.
+		void copy_packet(const rtp_packet_t& packet, /**[out]**/ uint8_t* dst) const;
+
+		const rtp_packetizer_stats_t& get_stats() const { return _stats; }
+
+	private:
+		// Starts a packet: writes the RTP header plus extra bytes of payload
+		// header into the arena and returns where the extra bytes go
+		uint8_t* begin_packet(size_t extra);
+		void add_span(const uint8_t* data, size_t size);
+
+		uint32_t _ssrc = 0;
+		uint8_t _payload_type = 96;
+		size_t _mtu = default_mtu;
+		uint16_t _sequence = 0;
+		uint32_t _timestamp = 0;
+
+		std::vector<h264_nal_t> _nals;
+		std::vector<rtp_packet_t> _packets;
+		std::vector<rtp_span_t> _spans;
+		// Headers of the current access unit. Sized before any is written, so
+		// spans into it stay put; only grows.
+		std::vector<uint8_t> _arena;
+		size_t _arena_used = 0;
+		rtp_packetizer_stats_t _stats = {};
+	};
+
+	// A whole access unit put back together, Annex-B with 4 byte start codes
+	struct rtp_frame_t {
+		const uint8_t* data;
+		size_t size;
+		uint32_t timestamp;        // RTP timestamp as sent
+		int64_t time;              // 90kHz ticks since the first frame, unwrapped, carrying on across restarts
+		bool keyframe;             // Holds an IDR slice
+	};
+
+	struct rtp_depacketizer_stats_t {
+		uint64_t packets;          // Packets taken in, RTP header intact
+		uint64_t invalid;          // Not RTP, or a payload the depacketizer can't handle
+		uint64_t reordered;        // Arrived after later packets, but in time to be used
+		uint64_t duplicates;       // Second copy of a packet still waiting its turn
+		uint64_t late;             // Arrived after its turn: a copy of one used, or one given up on
+		uint64_t lost;             // Given up on
+		uint64_t resyncs;          // Sequence restarts: a new SSRC or a big jump
+		uint64_t frames;           // Access units handed out
+		uint64_t frames_damaged;   // Dropped for missing or malformed packets
+		uint64_t frames_skipped;   // Intact, but dropped while waiting for a keyframe
+		uint64_t keyframe_requests;// Times a loss left the stream waiting for a keyframe
+		uint64_t copied_bytes;     // Payload bytes written into the frame slab
+	};
+
+	// Puts RFC 6184 non-interleaved H.264 back into access units, the inverse
+	// of rtp_h264_packetizer: single NAL units, STAP-A and FU-A come out as
+	// Annex-B, one contiguous buffer per access unit, the way a decoder that
+	// wants whole samples needs its input.
+	//
+	// Packets are put back in sequence order with a window of reorder_depth
+	// packets. One that arrives early waits in a preallocated slot; a missing
+	// one is given up on once a packet reorder_depth past it turns up, or on
+	// flush(), e.g. when the socket has been quiet for a while. Packets in
+	// order, the usual case, go straight from the caller's buffer into the
+	// frame slab without being held.
+	//
+	// An access unit ends on the marker bit, or when the timestamp moves on.
+	// Any loss inside one, or a fragment without its start, damages it, and
+	// damaged frames are never handed out: the decoder would only show the
+	// corruption spreading until the next IDR. Instead the stream waits for a
+	// keyframe, skipping intact P frames until one arrives; needs_keyframe()
+	// says when it's worth asking the sender for one. A stream starts out
+	// waiting for its first keyframe too, one with SPS and PPS in it or
+	// before it.
+	//
+	// Not thread safe; one depacketizer per stream.
+	class rtp_h264_depacketizer {
+	public:
+		static const uint32_t default_reorder_depth = 64;
+		static const size_t default_max_packet = 1500;
+		static const size_t default_max_frame = 2 * 1024 * 1024;
+
+		rtp_h264_depacketizer() { reset(); }
+
+		// Allocates everything up front: reorder_depth slots of max_packet
+		// bytes, and a slab for access units up to max_frame bytes. The depth
+		// rounds up to a power of two.
+		void reset(uint32_t reorder_depth = default_reorder_depth, size_t max_packet = default_max_packet, size_t max_frame = default_max_frame);
+
+		// Takes one RTP packet. Returns the number of access units it
+		// completed, found in frames(). Anything that isn't a usable RTP
+		// packet is counted and ignored.
+		size_t receive(const uint8_t* packet, size_t size);
+		// Gives up on every missing packet, and returns what that completes
+		size_t flush();
+
+		// Frames completed by the last receive or flush call, valid until the
+		// next one
+		const std::vector<rtp_frame_t>& frames() const { return _frames; }
+		bool needs_keyframe() const { return _waiting_keyframe; }
+
+		const rtp_depacketizer_stats_t& get_stats() const { return _stats; }
+
+	private:
+		struct slot_t {
+			uint32_t timestamp;
+			uint16_t sequence;
+			uint16_t size;
+			bool used;
+			bool marker;
+		};
+
+		void begin_call();
+		void restart(uint16_t sequence, uint32_t ssrc);
+		void store(uint16_t sequence, const uint8_t* payload, size_t size, uint32_t timestamp, bool marker);
+		// Moves _next on by one: consumes its held packet, or counts it lost
+		void skip();
+		// Consumes held packets for as long as they follow on from _next
+		void drain();
+		void consume(const uint8_t* payload, size_t size, uint32_t timestamp, bool marker);
+		void lose();
+
+		void begin_frame(uint32_t timestamp);
+		void end_frame();
+		void append(const uint8_t* data, size_t size);
+		void append_nal(const uint8_t* nal, size_t size);
+		void begin_nal(uint8_t header);
+
+		std::vector<slot_t> _slots;
+		std::vector<uint8_t> _slot_data;
+		size_t _max_packet = default_max_packet;
+		uint32_t _held = 0;
+
+		bool _started = false;
+		uint32_t _ssrc = 0;
+		uint16_t _next = 0;
+		uint16_t _bad_sequence = 0;
+		bool _bad_sequence_set = false;
+
+		// Access units in the making, and those finished this call before it
+		std::vector<uint8_t> _slab;
+		size_t _slab_used = 0;
+		size_t _max_frame = default_max_frame;
+		bool _frame_open = false;
+		bool _frame_damaged = false;
+		bool _frame_keyframe = false;
+		uint8_t _frame_parameter_sets = 0; // Bit 0 SPS, bit 1 PPS
+		uint8_t _parameter_sets = 0;       // Seen in frames handed out since the stream (re)started
+		bool _fragment_open = false;
+		bool _loss_pending = false;
+		uint32_t _losses = 0;              // Packets lost in a row
+		size_t _frame_begin = 0;
+		uint32_t _frame_timestamp = 0;
+		bool _timed = false;
+		int64_t _time = 0;
+		bool _waiting_keyframe = true;
+
+		std::vector<rtp_frame_t> _frames;
+		rtp_depacketizer_stats_t _stats = {};
+	};
+
+} // namespace nakamir
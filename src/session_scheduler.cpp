@@ -0,0 +1,328 @@
+#include "session_scheduler.h"
+#include <chrono>
+
+namespace nakamir {
+
+	static uint64_t session_now_us()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	session_scheduler::session_scheduler(uint32_t thread_count)
+	{
+		if (thread_count == 0)
+		{
+			uint32_t cores = std::thread::hardware_concurrency();
+			thread_count = cores > 1 ? cores - 1 : 1;
+		}
+		for (uint32_t i = 0; i < thread_count; i++)
+			_workers.push_back(std::make_unique<worker_t>());
+		for (uint32_t i = 0; i < thread_count; i++)
+			_workers[i]->thread = std::thread(&session_scheduler::worker_loop, this, i);
+	}
+
+	session_scheduler::~session_scheduler()
+	{
+		stop();
+	}
+
+	int32_t session_scheduler::add(session_step_fn step, void* context)
+	{
+		session_t* session = nullptr;
+		int32_t id = -1;
+		uint32_t worker = 0;
+		{
+			std::lock_guard<std::mutex> lock(_sessions_mtx);
+			for (size_t i = 0; i < _sessions.size(); i++)
+			{
+				if (_sessions[i]->state.load() == state_free)
+				{
+					session = _sessions[i].get();
+					id = static_cast<int32_t>(i);
+					break;
+				}
+			}
+			if (!session)
+			{
+				_sessions.push_back(std::make_unique<session_t>());
+				session = _sessions.back().get();
+				id = static_cast<int32_t>(_sessions.size() - 1);
+			}
+
+			session->step = step;
+			session->context = context;
+			session->removing = false;
+			session->steps = 0;
+			session->blocks = 0;
+			session->wakes = 0;
+			session->run_us = 0;
+			session->max_wait_us = 0;
+			session->failed = false;
+			// Spread new sessions over the workers; stealing evens out the rest
+			worker = _next_worker++ % thread_count();
+			session->worker = worker;
+			session->state = state_queued;
+		}
+		push(session, worker);
+		return id;
+	}
+
+	void session_scheduler::wake(int32_t id)
+	{
+		session_t* session;
+		{
+			std::lock_guard<std::mutex> lock(_sessions_mtx);
+			if (id < 0 || id >= static_cast<int32_t>(_sessions.size()))
+				return;
+			session = _sessions[id].get();
+		}
+
+		uint32_t state = session->state.load();
+		for (;;)
+		{
+			if (state == state_idle)
+			{
+				if (session->state.compare_exchange_weak(state, state_queued))
+				{
+					session->wakes++;
+					push(session, session->worker);
+					return;
+				}
+			}
+			else if (state == state_running)
+			{
+				// Its step may be about to report blocked; make it go round again
+				if (session->state.compare_exchange_weak(state, state_running_woken))
+					return;
+			}
+			else
+			{
+				return;
+			}
+		}
+	}
+
+	void session_scheduler::remove(int32_t id)
+	{
+		session_t* session;
+		{
+			std::lock_guard<std::mutex> lock(_sessions_mtx);
+			if (id < 0 || id >= static_cast<int32_t>(_sessions.size()))
+				return;
+			session = _sessions[id].get();
+		}
+
+		session->removing = true;
+		for (;;)
+		{
+			uint32_t state = session->state.load();
+			if (state == state_free || state == state_removed)
+				break;
+			// Blocked and finished sessions aren't in any queue, so they are ours to
+			// take; once the workers are gone, so are queued ones
+			bool idle = state == state_idle || state == state_finished;
+			if ((idle || _stopping) && session->state.compare_exchange_strong(state, state_removed))
+				break;
+
+			// A worker has it and will retire it, or park it, and tell us
+			std::unique_lock<std::mutex> lock(_sessions_mtx);
+			_removed.wait(lock, [&] {
+				uint32_t s = session->state.load();
+				return s == state_removed || s == state_idle || s == state_finished || _stopping;
+			});
+		}
+
+		std::lock_guard<std::mutex> lock(_sessions_mtx);
+		session->step = nullptr;
+		session->context = nullptr;
+		session->state = state_free;
+	}
+
+	void session_scheduler::stop()
+	{
+		if (_stopping.exchange(true))
+			return;
+		{
+			std::lock_guard<std::mutex> lock(_idle_mtx);
+			_idle_cv.notify_all();
+		}
+		for (std::unique_ptr<worker_t>& worker : _workers)
+		{
+			if (worker->thread.joinable())
+				worker->thread.join();
+		}
+		std::lock_guard<std::mutex> lock(_sessions_mtx);
+		_removed.notify_all();
+	}
+
+	session_scheduler_stats_t session_scheduler::get_stats()
+	{
+		session_scheduler_stats_t stats = {};
+		stats.steps = _steps.load();
+		stats.steals = _steals.load();
+		stats.sleeps = _sleeps.load();
+		stats.threads = thread_count();
+		stats.runnable = _queued.load();
+
+		std::lock_guard<std::mutex> lock(_sessions_mtx);
+		for (const std::unique_ptr<session_t>& session : _sessions)
+		{
+			if (session->state.load() != state_free)
+				stats.sessions++;
+		}
+		return stats;
+	}
+
+	bool session_scheduler::get_session_stats(int32_t id, session_stats_t* stats)
+	{
+		std::lock_guard<std::mutex> lock(_sessions_mtx);
+		if (id < 0 || id >= static_cast<int32_t>(_sessions.size()))
+			return false;
+		const session_t& session = *_sessions[id];
+		stats->steps = session.steps.load();
+		stats->blocks = session.blocks.load();
+		stats->wakes = session.wakes.load();
+		stats->run_us = session.run_us.load();
+		stats->max_wait_us = session.max_wait_us.load();
+		stats->finished = session.state.load() == state_finished;
+		stats->failed = session.failed.load();
+		return true;
+	}
+
+	void session_scheduler::push(session_t* session, uint32_t index)
+	{
+		session->queued_us = session_now_us();
+		{
+			worker_t& worker = *_workers[index];
+			std::lock_guard<std::mutex> lock(worker.mtx);
+			worker.queue.push_back(session);
+		}
+		_queued++;
+		// Sleepers bump _sleeping before checking _queued, so either they see
+		// this push or we see them
+		if (_sleeping.load() > 0)
+		{
+			std::lock_guard<std::mutex> lock(_idle_mtx);
+			_idle_cv.notify_one();
+		}
+	}
+
+	session_scheduler::session_t* session_scheduler::pop(uint32_t index, bool* stolen)
+	{
+		uint32_t count = thread_count();
+		for (uint32_t i = 0; i < count; i++)
+		{
+			// Own queue first, then the others in turn. Thieves take the oldest
+			// entry too, so stealing never lets a session jump the queue.
+			worker_t& worker = *_workers[(index + i) % count];
+			std::lock_guard<std::mutex> lock(worker.mtx);
+			if (worker.queue.empty())
+				continue;
+			session_t* session = worker.queue.front();
+			worker.queue.pop_front();
+			_queued--;
+			*stolen = i != 0;
+			return session;
+		}
+		return nullptr;
+	}
+
+	void session_scheduler::worker_loop(uint32_t index)
+	{
+		while (!_stopping)
+		{
+			bool stolen = false;
+			session_t* session = pop(index, &stolen);
+			if (!session)
+			{
+				std::unique_lock<std::mutex> lock(_idle_mtx);
+				_sleeping++;
+				_sleeps++;
+				_idle_cv.wait(lock, [this] { return _stopping || _queued.load() > 0; });
+				_sleeping--;
+				continue;
+			}
+			if (stolen)
+				_steals++;
+			run(session, index);
+		}
+	}
+
+	void session_scheduler::run(session_t* session, uint32_t index)
+	{
+		if (session->removing)
+		{
+			retire(session);
+			return;
+		}
+
+		// Only the worker that popped a queued session touches it, and wake leaves
+		// queued sessions alone, so this needn't be a compare-exchange
+		session->state = state_running;
+		session->worker = index;
+		uint64_t start = session_now_us();
+		uint64_t wait = start - session->queued_us;
+		if (wait > session->max_wait_us.load(std::memory_order_relaxed))
+			session->max_wait_us.store(wait, std::memory_order_relaxed);
+
+		session_step_ result;
+		try
+		{
+			result = session->step(session->context);
+		}
+		catch (...)
+		{
+			// Steps shouldn't throw; if one does, retire the session rather than
+			// take the worker and every other session down with it
+			session->failed = true;
+			result = session_step_finished;
+		}
+		session->run_us += session_now_us() - start;
+		session->steps++;
+		_steps++;
+
+		if (session->removing)
+		{
+			retire(session);
+			return;
+		}
+
+		switch (result)
+		{
+		case session_step_continue:
+			session->state = state_queued;
+			push(session, index);
+			break;
+		case session_step_blocked:
+		{
+			session->blocks++;
+			uint32_t state = state_running;
+			if (session->state.compare_exchange_strong(state, state_idle))
+				break;
+			// Woken while it ran, so what it was waiting for may already be there
+			session->state = state_queued;
+			push(session, index);
+			break;
+		}
+		default:
+			session->state = state_finished;
+			break;
+		}
+
+		// remove may have started waiting after the check above
+		if (session->removing)
+		{
+			std::lock_guard<std::mutex> lock(_sessions_mtx);
+			_removed.notify_all();
+		}
+	}
+
+	void session_scheduler::retire(session_t* session)
+	{
+		std::lock_guard<std::mutex> lock(_sessions_mtx);
+		session->state = state_removed;
+		_removed.notify_all();
+	}
+
+} // namespace nakamir
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nakamir {
+
+	enum session_step_ {
+		session_step_continue,  // More work is ready; run again once the others have had a turn
+		session_step_blocked,   // Waiting on its consumer; sleeps until session_scheduler::wake
+		session_step_finished,  // Done for good, e.g. end of stream
+	};
+
+	// One bounded quantum of a session's work, such as decoding a frame. It must
+	// not wait on anything that only another session's step would provide.
+	typedef session_step_(*session_step_fn)(void* context);
+
+	struct session_stats_t {
+		uint64_t steps;
+		uint64_t blocks;        // Steps that returned session_step_blocked
+		uint64_t wakes;         // wake calls that made it runnable again
+		uint64_t run_us;        // Time spent inside step
+		uint64_t max_wait_us;   // Longest a runnable session waited for a worker
+		bool finished;
+		bool failed;            // Its step threw, which also finishes it
+	};
+
+	struct session_scheduler_stats_t {
+		uint64_t steps;
+		uint64_t steals;        // Steps a worker took from another worker's queue
+		uint64_t sleeps;        // Times a worker found nothing to do and went idle
+		uint32_t threads;
+		uint32_t sessions;
+		uint32_t runnable;      // Sessions queued for a worker right now
+	};
+
+	// Multiplexes many sessions (e.g. one per video panel) over a fixed pool of
+	// worker threads, instead of a thread each. A session runs on one worker at a
+	// time, a step at a go. Each worker keeps a FIFO of runnable sessions and puts
+	// a session that wants to continue at the back, so every runnable session gets
+	// a step before any gets a second one; idle workers steal from the others.
+	//
+	// Backpressure is per session: a step that can't hand its output on returns
+	// session_step_blocked and the session sits out, costing nothing, until its
+	// consumer calls wake. A wake that lands while the session is mid-step isn't
+	// lost; the session goes straight back in the queue.
+	class session_scheduler {
+	public:
+		// 0 threads for one per core, less one for the render thread
+		explicit session_scheduler(uint32_t thread_count = 0);
+		~session_scheduler();
+
+		session_scheduler(const session_scheduler&) = delete;
+		session_scheduler& operator=(const session_scheduler&) = delete;
+
+		// Adds a runnable session, returning its id
+		int32_t add(/**[in]**/ session_step_fn step, /**[in]**/ void* context);
+		// Makes a blocked session runnable. Cheap when it isn't blocked, so it is
+		// fine to call whenever the consumer frees up room. Thread safe.
+		void wake(int32_t session);
+		// Takes a session out, waiting for a step in progress to return. Its id
+		// may be reused afterwards. Don't call it from the session's own step.
+		void remove(int32_t session);
+		// Joins the workers; sessions are left where they are
+		void stop();
+
+		uint32_t thread_count() const { return static_cast<uint32_t>(_workers.size()); }
+		session_scheduler_stats_t get_stats();
+		bool get_session_stats(int32_t session, /**[out]**/ session_stats_t* stats);
+
+	private:
+		enum state_ : uint32_t {
+			state_free,
+			state_idle,          // Blocked, waiting for wake
+			state_queued,
+			state_running,
+			state_running_woken, // Woken during its step, so it must run again
+			state_finished,
+			state_removed,       // Taken out by remove, slot not yet free
+		};
+
+		struct session_t {
+			std::atomic<uint32_t> state = state_free;
+			std::atomic<bool> removing = false;
+			session_step_fn step = nullptr;
+			void* context = nullptr;
+			uint32_t worker = 0;           // Queue it last ran from, for cache locality
+			uint64_t queued_us = 0;        // Written before each push, read after the pop
+			std::atomic<uint64_t> steps = 0;
+			std::atomic<uint64_t> blocks = 0;
+			std::atomic<uint64_t> wakes = 0;
+			std::atomic<uint64_t> run_us = 0;
+			std::atomic<uint64_t> max_wait_us = 0;
+			std::atomic<bool> failed = false;
+		};
+
+		struct worker_t {
+			std::mutex mtx;
+			std::deque<session_t*> queue;
+			std::thread thread;
+		};
+
+		void worker_loop(uint32_t index);
+		session_t* pop(uint32_t index, /**[out]**/ bool* stolen);
+		void push(session_t* session, uint32_t worker);
+		void run(session_t* session, uint32_t index);
+		void retire(session_t* session);
+
+		std::vector<std::unique_ptr<worker_t>> _workers;
+
+		// Slots are never freed, so a late wake on a removed id is harmless
+		std::mutex _sessions_mtx;
+		std::condition_variable _removed;
+		std::vector<std::unique_ptr<session_t>> _sessions;
+		uint32_t _next_worker = 0;
+
+		// Sleeping workers wait here; pushers only take the lock when someone sleeps
+		std::mutex _idle_mtx;
+		std::condition_variable _idle_cv;
+		std::atomic<uint32_t> _queued = 0;
+		std::atomic<uint32_t> _sleeping = 0;
+		std::atomic<bool> _stopping = false;
+
+		std::atomic<uint64_t> _steps = 0;
+		std::atomic<uint64_t> _steals = 0;
+		std::atomic<uint64_t> _sleeps = 0;
+	};
+
+} // namespace nakamir
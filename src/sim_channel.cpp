@@ -0,0 +1,131 @@
+#include "sim_channel.h"
+#include <cstring>
+
+namespace nakamir {
+
+	void sim_channel::reset(const sim_channel_config_t& config)
+	{
+		_config = config;
+		if (_config.loss_burst < 1)
+			_config.loss_burst = 1;
+		if (_config.reorder_depth < 1)
+			_config.reorder_depth = 1;
+		_random = config.seed ? config.seed : 1;
+		_losing = false;
+		_clock = 0;
+		_order = 0;
+		_free.clear();
+		for (uint32_t i = 0; i < _buffers.size(); i++)
+			_free.push_back(i);
+		_in_flight.clear();
+		_handed_out = ~0u;
+		_stats = {};
+	}
+
+	double sim_channel::next_random()
+	{
+		// xorshift64*, top 53 bits as a double in [0, 1)
+		_random ^= _random >> 12;
+		_random ^= _random << 25;
+		_random ^= _random >> 27;
+		return static_cast<double>((_random * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+	}
+
+	uint32_t sim_channel::acquire_buffer()
+	{
+		if (_free.empty())
+		{
+			_buffers.emplace_back();
+			return static_cast<uint32_t>(_buffers.size() - 1);
+		}
+		uint32_t buffer = _free.back();
+		_free.pop_back();
+		return buffer;
+	}
+
+	void sim_channel::queue(uint32_t buffer, uint64_t delay)
+	{
+		entry_t entry = { _clock + delay, _order++, buffer };
+		// Kept sorted soonest last; only a few are ever in flight
+		size_t at = _in_flight.size();
+		while (at > 0 && (_in_flight[at - 1].due < entry.due || (_in_flight[at - 1].due == entry.due && _in_flight[at - 1].order < entry.order)))
+			at--;
+		_in_flight.insert(_in_flight.begin() + at, entry);
+	}
+
+	bool sim_channel::send(const uint8_t* data, size_t size)
+	{
+		rtp_span_t span = { data, size };
+		return send(&span, 1);
+	}
+
+	bool sim_channel::send(const rtp_span_t* spans, uint32_t count)
+	{
+		_clock++;
+		_stats.sent++;
+
+		// Gilbert model: the bad state loses everything and lasts loss_burst
+		// packets on average; entering it is as likely as keeps the mean loss
+		if (_config.loss > 0)
+		{
+			if (_losing)
+				_losing = next_random() >= 1.0 / _config.loss_burst;
+			else
+			{
+				double enter = _config.loss < 1 ? _config.loss / (_config.loss_burst * (1 - _config.loss)) : 1;
+				_losing = next_random() < enter;
+			}
+			if (_losing)
+			{
+				_stats.lost++;
+				return true;
+			}
+		}
+
+		uint32_t copies = _config.duplicate > 0 && next_random() < _config.duplicate ? 2 : 1;
+		if (copies == 2)
+			_stats.duplicated++;
+		for (uint32_t c = 0; c < copies; c++)
+		{
+			uint32_t buffer = acquire_buffer();
+			std::vector<uint8_t>& bytes = _buffers[buffer];
+			bytes.clear();
+			for (uint32_t i = 0; i < count; i++)
+				bytes.insert(bytes.end(), spans[i].data, spans[i].data + spans[i].size);
+
+			uint64_t delay = 0;
+			if (_config.reorder > 0 && next_random() < _config.reorder)
+			{
+				delay = 1 + static_cast<uint64_t>(next_random() * _config.reorder_depth);
+				_stats.reordered++;
+			}
+			queue(buffer, delay);
+		}
+		return true;
+	}
+
+	bool sim_channel::receive(const uint8_t** data, size_t* size)
+	{
+		if (_handed_out != ~0u)
+		{
+			_free.push_back(_handed_out);
+			_handed_out = ~0u;
+		}
+		if (_in_flight.empty() || _in_flight.back().due > _clock)
+			return false;
+
+		_handed_out = _in_flight.back().buffer;
+		_in_flight.pop_back();
+		*data = _buffers[_handed_out].data();
+		*size = _buffers[_handed_out].size();
+		_stats.delivered++;
+		return true;
+	}
+
+	void sim_channel::flush()
+	{
+		for (entry_t& entry : _in_flight)
+			entry.due = _clock;
+	}
+
+} // namespace nakamir
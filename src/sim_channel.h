@@ -0,0 +1,88 @@
+#pragma once
+
+#include "rtp_h264.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nakamir {
+
+	struct sim_channel_config_t {
+		// Share of packets lost on average
+		double loss = 0;
+		// Mean length of a run of lost packets: 1 for independent losses, more
+		// for the bursts a congested or wireless link produces
+		double loss_burst = 1;
+		// Share of packets held back, to arrive after up to reorder_depth
+		// packets sent later
+		double reorder = 0;
+		uint32_t reorder_depth = 8;
+		// Share of packets delivered twice, the copy also subject to reordering
+		double duplicate = 0;
+		uint64_t seed = 1;
+	};
+
+	struct sim_channel_stats_t {
+		uint64_t sent;
+		uint64_t lost;
+		uint64_t reordered;
+		uint64_t duplicated;
+		uint64_t delivered;
+	};
+
+	// Pure C++ stand-in for a lossy network path, so the RTP receive side can be
+	// run and measured against loss, reordering and duplication without one.
+	// Like udp_socket it takes packets as spans and hands them out whole, but
+	// time is counted in packets sent: one held back for n packets comes out
+	// after the n-th packet sent after it. Losses follow a two state Gilbert
+	// model. The same seed gives the same packets in the same order.
+	//
+	// Not thread safe.
+	class sim_channel {
+	public:
+		explicit sim_channel(const sim_channel_config_t& config = {}) { reset(config); }
+
+		sim_channel(const sim_channel&) = delete;
+		sim_channel& operator=(const sim_channel&) = delete;
+
+		// Drops everything in flight and starts over
+		void reset(const sim_channel_config_t& config);
+
+		// Sends one packet made of count spans; it's copied
+		bool send(const rtp_span_t* spans, uint32_t count);
+		bool send(const uint8_t* data, size_t size);
+		// Next packet due, valid until the next call on the channel. False
+		// when nothing is due yet.
+		bool receive(/**[out]**/ const uint8_t** data, /**[out]**/ size_t* size);
+		// Makes every packet still held back due, as if the sender went quiet
+		void flush();
+
+		const sim_channel_stats_t& get_stats() const { return _stats; }
+
+	private:
+		struct entry_t {
+			uint64_t due;
+			uint64_t order;       // Ties on due go out in the order they were queued
+			uint32_t buffer;
+		};
+
+		double next_random();
+		void queue(uint32_t buffer, uint64_t delay);
+		uint32_t acquire_buffer();
+
+		sim_channel_config_t _config;
+		uint64_t _random = 1;
+		bool _losing = false;
+		uint64_t _clock = 0;
+		uint64_t _order = 0;
+		// In flight by due time, soonest last so receive pops from the back
+		std::vector<entry_t> _in_flight;
+		// Packet buffers, reused; _free lists the idle ones
+		std::vector<std::vector<uint8_t>> _buffers;
+		std::vector<uint32_t> _free;
+		// The buffer receive last handed out, freed on the next call
+		uint32_t _handed_out = ~0u;
+		sim_channel_stats_t _stats = {};
+	};
+
+} // namespace nakamir
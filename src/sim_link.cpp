@@ -0,0 +1,215 @@
+#include "sim_link.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace nakamir {
+
+	const uint64_t sim_link_never = ~0ull;
+
+	bool sim_link_load_trace(const char* path, std::vector<sim_link_trace_point_t>* trace)
+	{
+		trace->clear();
+		FILE* file = fopen(path, "r");
+		if (!file)
+			return false;
+
+		char line[256];
+		while (fgets(line, sizeof(line), file))
+		{
+			char* comment = strchr(line, '#');
+			if (comment)
+				*comment = 0;
+			double seconds = 0, kbps = 0;
+			if (sscanf(line, "%lf %lf", &seconds, &kbps) != 2 || seconds < 0 || kbps < 0)
+				continue;
+			uint64_t time_us = static_cast<uint64_t>(seconds * 1e6);
+			if (!trace->empty() && time_us <= trace->back().time_us)
+				continue;
+			trace->push_back({ time_us, static_cast<uint32_t>(kbps * 1000) });
+		}
+		fclose(file);
+		return !trace->empty();
+	}
+
+	void sim_link::reset(const sim_link_config_t& config)
+	{
+		_config = config;
+		_busy_until_us = 0;
+		_last_time_us = 0;
+		_random = config.seed ? config.seed : 1;
+		_in_flight.clear();
+		_in_flight_head = 0;
+		_feedback_us = 0;
+		_interval_bytes = 0;
+		_interval_packets = 0;
+		_interval_missing = 0;
+		_last_queue_delay_us = 0;
+		_stats = {};
+	}
+
+	double sim_link::next_random()
+	{
+		// xorshift64*, top 53 bits as a double in [0, 1)
+		_random ^= _random >> 12;
+		_random ^= _random << 25;
+		_random ^= _random >> 27;
+		return static_cast<double>((_random * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+	}
+
+	uint32_t sim_link::segment(uint64_t time_us, uint64_t* end_us) const
+	{
+		const std::vector<sim_link_trace_point_t>& trace = _config.trace;
+		// Looping, the last point marks where the trace starts over
+		uint64_t period = _config.loop && trace.size() > 1 ? trace.back().time_us : 0;
+		uint64_t local = period ? time_us % period : time_us;
+		uint64_t base = time_us - local;
+
+		auto next = std::upper_bound(trace.begin(), trace.end(), local,
+			[](uint64_t t, const sim_link_trace_point_t& point) { return t < point.time_us; });
+		size_t index = next == trace.begin() ? 0 : (next - trace.begin()) - 1;
+		if (next == trace.end())
+			*end_us = period ? base + period : sim_link_never;
+		else
+			*end_us = base + next->time_us;
+		return trace[index].bitrate;
+	}
+
+	uint32_t sim_link::capacity(uint64_t time_us) const
+	{
+		if (_config.trace.empty())
+			return ~0u;
+		uint64_t end_us;
+		return segment(time_us, &end_us);
+	}
+
+	uint64_t sim_link::transmit(uint64_t start_us, uint64_t bytes) const
+	{
+		if (_config.trace.empty())
+			return start_us;
+
+		double bits = bytes * 8.0;
+		uint64_t time_us = start_us;
+		for (;;)
+		{
+			uint64_t end_us;
+			uint32_t rate = segment(time_us, &end_us);
+			if (rate == 0)
+			{
+				// An outage: nothing moves until it ends, if it ever does
+				if (end_us == sim_link_never)
+					return sim_link_never;
+				time_us = end_us;
+				continue;
+			}
+			double needed_us = bits * 1e6 / rate;
+			if (end_us == sim_link_never || time_us + needed_us <= end_us)
+				return time_us + static_cast<uint64_t>(needed_us + 0.5);
+			bits -= static_cast<double>(rate) * (end_us - time_us) / 1e6;
+			time_us = end_us;
+		}
+	}
+
+	double sim_link::capacity_bits(uint64_t from_us, uint64_t to_us) const
+	{
+		if (_config.trace.empty())
+			return 0;
+		double bits = 0;
+		while (from_us < to_us)
+		{
+			uint64_t end_us;
+			uint32_t rate = segment(from_us, &end_us);
+			uint64_t until = end_us < to_us ? end_us : to_us;
+			bits += static_cast<double>(rate) * (until - from_us) / 1e6;
+			from_us = until;
+		}
+		return bits;
+	}
+
+	bool sim_link::send(size_t bytes, uint64_t time_us)
+	{
+		_last_time_us = time_us > _last_time_us ? time_us : _last_time_us;
+		time_us = _last_time_us;
+		_stats.packets++;
+		_stats.bytes += bytes;
+
+		uint64_t start_us = _busy_until_us > time_us ? _busy_until_us : time_us;
+		uint64_t queue_delay_us = start_us - time_us;
+		in_flight_t packet = {};
+		packet.queue_delay_us = static_cast<uint32_t>(queue_delay_us < 0xFFFFFFFF ? queue_delay_us : 0xFFFFFFFF);
+		if (queue_delay_us > _config.max_queue_delay_us)
+		{
+			// Dropped at the tail; the receiver notices about when it would have arrived
+			_stats.dropped++;
+			packet.arrival_us = start_us == sim_link_never ? sim_link_never : start_us + _config.base_delay_us;
+			packet.lost = true;
+			_in_flight.push_back(packet);
+			return false;
+		}
+
+		uint64_t finish_us = transmit(start_us, bytes);
+		_busy_until_us = finish_us;
+		packet.arrival_us = finish_us == sim_link_never ? sim_link_never : finish_us + _config.base_delay_us;
+		packet.bytes = static_cast<uint32_t>(bytes);
+		if (_config.random_loss > 0 && next_random() < _config.random_loss)
+		{
+			_stats.lost++;
+			packet.lost = true;
+			_in_flight.push_back(packet);
+			return false;
+		}
+
+		_stats.delivered++;
+		_stats.delivered_bytes += bytes;
+		_stats.queue_delay_us += queue_delay_us;
+		_stats.max_queue_delay_us = queue_delay_us > _stats.max_queue_delay_us ? queue_delay_us : _stats.max_queue_delay_us;
+		if (packet.arrival_us - time_us > _config.late_us)
+			_stats.late++;
+		_in_flight.push_back(packet);
+		return true;
+	}
+
+	bitrate_feedback_t sim_link::feedback(uint64_t time_us)
+	{
+		_last_time_us = time_us > _last_time_us ? time_us : _last_time_us;
+		time_us = _last_time_us;
+
+		// Reports take a base delay to come back too
+		uint64_t heard_until = time_us > _config.base_delay_us ? time_us - _config.base_delay_us : 0;
+		while (_in_flight_head < _in_flight.size() && _in_flight[_in_flight_head].arrival_us <= heard_until)
+		{
+			const in_flight_t& packet = _in_flight[_in_flight_head++];
+			if (packet.lost)
+			{
+				_interval_missing++;
+				continue;
+			}
+			if (_interval_packets == 0 || packet.queue_delay_us < _last_queue_delay_us)
+				_last_queue_delay_us = packet.queue_delay_us;
+			_interval_packets++;
+			_interval_bytes += packet.bytes;
+		}
+		if (_in_flight_head > 1024 && _in_flight_head * 2 > _in_flight.size())
+		{
+			_in_flight.erase(_in_flight.begin(), _in_flight.begin() + _in_flight_head);
+			_in_flight_head = 0;
+		}
+
+		bitrate_feedback_t feedback = {};
+		feedback.time_us = time_us;
+		feedback.queue_delay_us = _last_queue_delay_us;
+		uint64_t expected = _interval_packets + _interval_missing;
+		feedback.loss = expected ? static_cast<float>(_interval_missing) / expected : 0.0f;
+		if (time_us > _feedback_us)
+			feedback.received_bitrate = static_cast<uint32_t>(_interval_bytes * 8 * 1000000 / (time_us - _feedback_us));
+
+		_stats.capacity_bytes += static_cast<uint64_t>(capacity_bits(_feedback_us, time_us) / 8);
+		_feedback_us = time_us;
+		_interval_bytes = 0;
+		_interval_packets = 0;
+		_interval_missing = 0;
+		return feedback;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "bitrate_controller.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nakamir {
+
+	// Capacity from time_us on, until the next point
+	struct sim_link_trace_point_t {
+		uint64_t time_us;
+		uint32_t bitrate;
+	};
+
+	// Reads a bandwidth trace: one "seconds kbps" pair per line, times rising,
+	// # starting a comment. False if the file can't be read or holds no point.
+	bool sim_link_load_trace(const char* path, /**[out]**/ std::vector<sim_link_trace_point_t>* trace);
+
+	struct sim_link_config_t {
+		// Capacity over time. Looping, the last point marks where the trace
+		// starts over; otherwise its rate holds from then on. Empty for an
+		// unlimited link.
+		std::vector<sim_link_trace_point_t> trace;
+		bool loop = true;
+		// One way propagation delay, paid by packets and by feedback on the
+		// way back alike
+		uint32_t base_delay_us = 20000;
+		// Drop-tail queue: a packet that would wait longer than this is lost
+		uint32_t max_queue_delay_us = 400000;
+		// Independent loss on top of the queue's, as a radio link has
+		double random_loss = 0;
+		uint64_t seed = 1;
+		// Packets delayed past this in total count as late, e.g. too late to
+		// show for an interactive stream
+		uint32_t late_us = 150000;
+	};
+
+	struct sim_link_stats_t {
+		uint64_t packets;
+		uint64_t bytes;
+		uint64_t dropped;          // Queue overflow
+		uint64_t lost;             // Random loss
+		uint64_t delivered;
+		uint64_t delivered_bytes;
+		uint64_t late;             // Delivered after late_us
+		uint64_t queue_delay_us;   // Summed over delivered packets
+		uint64_t max_queue_delay_us;
+		uint64_t capacity_bytes;   // What the link could have carried so far
+	};
+
+	// Pure C++ stand-in for a bottleneck link, so bitrate_controller can be run
+	// against bandwidth traces without a network or an encoder. A fluid model:
+	// packets join a FIFO that drains at the trace's capacity, wait their turn,
+	// then take base_delay_us to arrive. feedback reports what has arrived by
+	// then, a base delay late, the way a receiver's reports would, with the
+	// lowest queuing delay among those packets.
+	//
+	// Time is the caller's, in microseconds, and must not go backwards.
+	// Not thread safe.
+	class sim_link {
+	public:
+		sim_link() = default;
+		explicit sim_link(const sim_link_config_t& config) { reset(config); }
+
+		sim_link(const sim_link&) = delete;
+		sim_link& operator=(const sim_link&) = delete;
+
+		void reset(const sim_link_config_t& config);
+
+		// Offers a packet at time_us. False if the link dropped or lost it.
+		bool send(size_t bytes, uint64_t time_us);
+		// What the sender hears at time_us about arrivals since the last call
+		bitrate_feedback_t feedback(uint64_t time_us);
+
+		// Capacity at time_us, in bits per second
+		uint32_t capacity(uint64_t time_us) const;
+		const sim_link_stats_t& get_stats() const { return _stats; }
+
+	private:
+		struct in_flight_t {
+			uint64_t arrival_us;
+			uint32_t bytes;
+			uint32_t queue_delay_us;
+			bool lost;
+		};
+
+		// Where the trace stands at time_us: the rate, and when it next changes
+		uint32_t segment(uint64_t time_us, /**[out]**/ uint64_t* end_us) const;
+		// When a transmission of bytes starting at start_us finishes
+		uint64_t transmit(uint64_t start_us, uint64_t bytes) const;
+		double capacity_bits(uint64_t from_us, uint64_t to_us) const;
+		double next_random();
+
+		sim_link_config_t _config;
+		uint64_t _busy_until_us = 0;    // When the link finishes what's queued
+		uint64_t _last_time_us = 0;
+		uint64_t _random = 1;
+		std::vector<in_flight_t> _in_flight;   // By arrival, oldest first
+		size_t _in_flight_head = 0;
+
+		// Since the last feedback
+		uint64_t _feedback_us = 0;
+		uint64_t _interval_bytes = 0;
+		uint64_t _interval_packets = 0;
+		uint64_t _interval_missing = 0;
+		// Lowest of the interval's packets, so a keyframe's burst draining
+		// isn't taken for a standing queue; held over an interval without any
+		uint32_t _last_queue_delay_us = 0;
+		sim_link_stats_t _stats = {};
+	};
+
+} // namespace nakamir
@@ -0,0 +1,301 @@
+#include "sim_transform.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace nakamir {
+
+	sim_transform::sim_transform(const sim_transform_config_t& config) : _config(config)
+	{
+		if (_config.outputs_per_input_num == 0 || _config.outputs_per_input_den == 0)
+			throw std::invalid_argument("sim_transform output ratio must be non-zero");
+		if (_config.input_queue_depth == 0)
+			_config.input_queue_depth = 1;
+
+		if (_config.async)
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			for (uint32_t i = 0; i < _config.input_queue_depth; i++)
+				request_input_locked();
+		}
+	}
+
+	sim_transform::~sim_transform()
+	{
+		shutdown();
+		for (media_sample* sample : _pending)
+			sample->release();
+	}
+
+	transform_stream_info_t sim_transform::get_output_stream_info()
+	{
+		transform_stream_info_t info = {};
+		info.flags = _config.provides_samples ? transform_stream_flags_provides_samples : transform_stream_flags_none;
+		info.size = _config.output_size;
+		info.alignment = _config.output_alignment;
+		return info;
+	}
+
+	transform_status_ sim_transform::process_input(media_sample* sample)
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+
+		// Async transforms take whatever they asked for, sync ones refuse input
+		// while too much output is waiting to be collected
+		bool accepting = _config.async
+			? _input_requests > 0
+			: ready_outputs_locked() < _config.max_ready_outputs;
+		if (!accepting)
+		{
+			_stats.rejected_inputs++;
+			return transform_status_not_accepting;
+		}
+
+		sample->add_ref();
+		_pending.push_back(sample);
+		_stats.inputs++;
+		if (_config.async)
+			_input_requests--;
+
+		complete_inputs_locked(_draining ? 0 : _config.latency);
+
+		if (_config.async)
+		{
+			signal_outputs_locked();
+			request_input_locked();
+		}
+		return transform_status_ok;
+	}
+
+	transform_status_ sim_transform::process_output(media_sample* output, media_sample** ppResult)
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		*ppResult = nullptr;
+
+		if (ready_outputs_locked() == 0)
+			return transform_status_need_more_input;
+
+		// Stream changes are raised in place of an output, which stays ready until
+		// the caller has renegotiated
+		uint64_t index = _stats.outputs;
+		if (_change_pending || (_config.format_change_interval && index > 0 && index % _config.format_change_interval == 0 && _stats.stream_changes < index / _config.format_change_interval))
+		{
+			if (!_change_pending)
+				_stats.stream_changes++;
+			_change_pending = true;
+			return transform_status_stream_change;
+		}
+
+		// Spend the credits, oldest input first
+		completed_t from = {};
+		for (uint32_t need = _config.outputs_per_input_den; need > 0;)
+		{
+			completed_t& front = _completed.front();
+			uint32_t spent = std::min(need, front.credits);
+			front.credits -= spent;
+			need -= spent;
+			if (need == 0)
+				from = front;
+			if (need == 0 && front.credits > 0)
+				front.outputs++;
+			else
+				_completed.pop_front();
+		}
+
+		size_t length = _config.output_size ? _config.output_size : from.length;
+		media_sample* result = output;
+		if (_config.provides_samples)
+		{
+			result = memory_sample_create(length, _config.output_alignment);
+		}
+		else
+		{
+			if (!output)
+				throw std::invalid_argument("sim_transform needs an output sample");
+			output->add_ref();
+		}
+
+		media_buffer* buffer = result->get_buffer();
+		size_t max_length = 0;
+		uint8_t* data = buffer->lock(&max_length, nullptr);
+		if (max_length < length)
+		{
+			buffer->unlock();
+			result->release();
+			throw std::length_error("sim_transform output sample is too small");
+		}
+		memset(data, static_cast<int>(index & 0xFF), length);
+		buffer->unlock();
+		buffer->set_current_length(length);
+
+		int64_t step = from.duration / _config.outputs_per_input_num;
+		result->set_sample_time(from.time + step * from.outputs);
+		result->set_sample_duration(step);
+
+		_credits -= _config.outputs_per_input_den;
+		_stats.outputs++;
+		if (_signalled_outputs > 0)
+			_signalled_outputs--;
+
+		if (_config.async)
+		{
+			// Room freed up in the output, hand back the input requests we held
+			while (_deferred_requests > 0 && ready_outputs_locked() < _config.max_ready_outputs)
+			{
+				_deferred_requests--;
+				request_input_locked();
+			}
+			if (_draining && _pending.empty() && ready_outputs_locked() == 0)
+			{
+				_draining = false;
+				post_event_locked(transform_event_drain_complete);
+			}
+		}
+
+		*ppResult = result;
+		return transform_status_ok;
+	}
+
+	void sim_transform::renegotiate_output_type()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		_change_pending = false;
+		_output_type_id++;
+	}
+
+	void sim_transform::flush()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		for (media_sample* sample : _pending)
+			sample->release();
+		_pending.clear();
+		_events.clear();
+		_completed.clear();
+		_credits = 0;
+		_signalled_outputs = 0;
+		_draining = false;
+
+		if (_config.async)
+		{
+			_input_requests = 0;
+			_deferred_requests = 0;
+			for (uint32_t i = 0; i < _config.input_queue_depth; i++)
+				request_input_locked();
+		}
+	}
+
+	void sim_transform::drain()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		_draining = true;
+		complete_inputs_locked(0);
+
+		if (_config.async)
+		{
+			signal_outputs_locked();
+			if (ready_outputs_locked() == 0)
+			{
+				_draining = false;
+				post_event_locked(transform_event_drain_complete);
+			}
+		}
+	}
+
+	bool sim_transform::is_async()
+	{
+		return _config.async;
+	}
+
+	transform_event_ sim_transform::get_event(bool wait)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		if (wait)
+			_events_cv.wait(lock, [this] { return !_events.empty() || _shutdown; });
+		if (_events.empty() || _shutdown)
+			return transform_event_none;
+
+		transform_event_ event = _events.front();
+		_events.pop_front();
+		return event;
+	}
+
+	media_sample* sim_transform::create_output_sample(const transform_stream_info_t& info)
+	{
+		// Mirror the input when no fixed size is configured, so leave headroom
+		size_t size = info.size ? info.size : std::max<size_t>(_last_length, 4096);
+		return memory_sample_create(size, info.alignment);
+	}
+
+	void sim_transform::shutdown()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			_shutdown = true;
+		}
+		_events_cv.notify_all();
+	}
+
+	sim_transform_stats_t sim_transform::get_stats()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		return _stats;
+	}
+
+	uint32_t sim_transform::get_output_type_id()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		return _output_type_id;
+	}
+
+	size_t sim_transform::ready_outputs_locked() const
+	{
+		return static_cast<size_t>(_credits / _config.outputs_per_input_den);
+	}
+
+	void sim_transform::complete_inputs_locked(size_t keep)
+	{
+		while (_pending.size() > keep)
+		{
+			media_sample* sample = _pending.front();
+			_pending.pop_front();
+
+			completed_t completed = {};
+			completed.time = sample->get_sample_time();
+			completed.duration = sample->get_sample_duration();
+			completed.length = sample->get_buffer()->get_current_length();
+			completed.credits = _config.outputs_per_input_num;
+			_completed.push_back(completed);
+			_last_length = completed.length;
+			_credits += _config.outputs_per_input_num;
+			sample->release();
+		}
+	}
+
+	void sim_transform::request_input_locked()
+	{
+		if (ready_outputs_locked() >= _config.max_ready_outputs)
+		{
+			_deferred_requests++;
+			return;
+		}
+		_input_requests++;
+		post_event_locked(transform_event_need_input);
+	}
+
+	void sim_transform::post_event_locked(transform_event_ event)
+	{
+		_events.push_back(event);
+		_events_cv.notify_one();
+	}
+
+	void sim_transform::signal_outputs_locked()
+	{
+		size_t ready = ready_outputs_locked();
+		while (_signalled_outputs < ready)
+		{
+			_signalled_outputs++;
+			post_event_locked(transform_event_have_output);
+		}
+	}
+
+} // namespace nakamir
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "transform.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace nakamir {
+
+	struct sim_transform_config_t {
+		// Inputs swallowed before the first output appears, like an encoder's
+		// lookahead or a decoder's reorder depth
+		uint32_t latency = 0;
+		// Outputs produced per input as a ratio, e.g. 1/1 for a decoder,
+		// 2/1 for a deinterlacer or 1/2 for something that pairs fields
+		uint32_t outputs_per_input_num = 1;
+		uint32_t outputs_per_input_den = 1;
+		// Behave like an async MFT that raises need-input / have-output events
+		bool async = false;
+		// Allocate output samples ourselves (MFT_OUTPUT_STREAM_PROVIDES_SAMPLES)
+		bool provides_samples = false;
+		// Output buffer size, 0 to mirror the length of the input
+		uint32_t output_size = 0;
+		uint32_t output_alignment = 16;
+		// Raise a stream change before every Nth output, 0 for never
+		uint32_t format_change_interval = 0;
+		// Undelivered outputs held before process_input reports not-accepting
+		uint32_t max_ready_outputs = 8;
+		// Need-input requests an async transform keeps outstanding, i.e. how many
+		// inputs a driver may have in flight
+		uint32_t input_queue_depth = 1;
+	};
+
+	struct sim_transform_stats_t {
+		uint64_t inputs;
+		uint64_t outputs;
+		uint64_t stream_changes;
+		uint64_t rejected_inputs;
+	};
+
+	// Pure C++ stand-in for an MFT, so the pump loop, draining and stream change
+	// handling can be run and measured without Media Foundation. Each output
+	// sample carries the time of the input that completed it and is filled with
+	// its output index, so consumers can check ordering.
+	class sim_transform final : public media_transform {
+	public:
+		explicit sim_transform(const sim_transform_config_t& config);
+		~sim_transform() override;
+
+		transform_stream_info_t get_output_stream_info() override;
+		transform_status_ process_input(media_sample* sample) override;
+		transform_status_ process_output(media_sample* output, media_sample** ppResult) override;
+		void renegotiate_output_type() override;
+		void flush() override;
+		void drain() override;
+		bool is_async() override;
+		transform_event_ get_event(bool wait) override;
+		media_sample* create_output_sample(const transform_stream_info_t& info) override;
+
+		void shutdown() override;
+		sim_transform_stats_t get_stats();
+		// Output type generation, bumped by every renegotiate_output_type
+		uint32_t get_output_type_id();
+
+	private:
+		size_t ready_outputs_locked() const;
+		void complete_inputs_locked(size_t keep);
+		void request_input_locked();
+		void post_event_locked(transform_event_ event);
+		void signal_outputs_locked();
+
+		sim_transform_config_t _config;
+		std::mutex _mtx;
+		std::condition_variable _events_cv;
+		std::deque<media_sample*> _pending;  // Inputs held back to model latency
+		std::deque<transform_event_> _events;
+		// An input that completed but whose outputs aren't all collected
+		struct completed_t {
+			int64_t time;
+			int64_t duration;
+			size_t length;
+			uint32_t credits;   // Left for outputs to spend
+			uint32_t outputs;   // Stamped from it so far
+		};
+
+		// Output credits; each completed input adds outputs_per_input_num and each
+		// output costs outputs_per_input_den, spent oldest input first. An output
+		// is stamped from the input that paid its last credit.
+		uint64_t _credits = 0;
+		std::deque<completed_t> _completed;
+		size_t _last_length = 0;             // Of the latest input, to size outputs
+		uint32_t _input_requests = 0;        // Outstanding need-input events
+		uint32_t _deferred_requests = 0;     // Need-input events held back while output is full
+		size_t _signalled_outputs = 0;       // Ready outputs already announced with have-output
+		bool _draining = false;
+		bool _change_pending = false;
+		bool _shutdown = false;
+		uint32_t _output_type_id = 0;
+		sim_transform_stats_t _stats = {};
+	};
+
+} // namespace nakamir
@@ -0,0 +1,141 @@
+#include "slot_ring.h"
+#include "cpu_features.h"
+
+namespace nakamir {
+
+	void slot_ring::reset(uint32_t slots)
+	{
+		if (slots < min_slots) slots = min_slots;
+		if (slots > max_slots) slots = max_slots;
+		_slots = slots;
+
+		// The producer starts out holding slot 0, everything else is free
+		_write = 0;
+		_read = -1;
+		_last_published = -1;
+		_retired_count = 0;
+		_frame = 0;
+		_free.store(((1u << slots) - 1) & ~1u, std::memory_order_relaxed);
+		_held.store(0, std::memory_order_relaxed);
+		_published.store(0, std::memory_order_relaxed);
+		_overwritten.store(0, std::memory_order_relaxed);
+		_stalls_avoided.store(0, std::memory_order_relaxed);
+		_starved.store(0, std::memory_order_relaxed);
+		_acquired.store(0, std::memory_order_relaxed);
+		_shared.store(empty_slot, std::memory_order_release);
+	}
+
+	bool slot_ring::take_free(int32_t* slot)
+	{
+		uint32_t free = _free.load(std::memory_order_acquire);
+		while (free)
+		{
+			uint32_t bit = bit_scan_forward(free);
+			if (_free.compare_exchange_weak(free, free & ~(1u << bit), std::memory_order_acquire))
+			{
+				*slot = static_cast<int32_t>(bit);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	int32_t slot_ring::begin_write()
+	{
+		if (_write >= 0)
+			return _write;
+		if (!take_free(&_write))
+		{
+			_starved.fetch_add(1, std::memory_order_relaxed);
+			return -1;
+		}
+
+		// With one slot this write would have had to wait for the consumer to
+		// be done with the last one. An unread last slot comes straight back
+		// through publish instead, so it never gets here.
+		if (_last_published >= 0 && (_held.load(std::memory_order_relaxed) & (1u << _last_published)))
+			_stalls_avoided.fetch_add(1, std::memory_order_relaxed);
+		return _write;
+	}
+
+	void slot_ring::publish()
+	{
+		if (_write < 0)
+			return;
+		_published.fetch_add(1, std::memory_order_relaxed);
+		_last_published = _write;
+
+		// An unread slot that comes back was never drawn, so it can be written
+		// straight away; otherwise the next begin_write takes a free one
+		uint32_t previous = _shared.exchange(static_cast<uint32_t>(_write), std::memory_order_acq_rel);
+		if (previous != empty_slot)
+		{
+			_write = static_cast<int32_t>(previous);
+			_overwritten.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+		{
+			_write = -1;
+		}
+	}
+
+	int32_t slot_ring::acquire_latest(bool* fresh)
+	{
+		_frame++;
+		if (fresh)
+			*fresh = false;
+
+		if (_shared.load(std::memory_order_relaxed) != empty_slot)
+		{
+			uint32_t latest = _shared.exchange(empty_slot, std::memory_order_acq_rel);
+			if (latest != empty_slot)
+			{
+				if (_read >= 0)
+				{
+					_retired[_retired_count] = _read;
+					_retired_frame[_retired_count] = _frame;
+					_retired_count++;
+				}
+				_read = static_cast<int32_t>(latest);
+				_acquired.fetch_add(1, std::memory_order_relaxed);
+				if (fresh)
+					*fresh = true;
+			}
+		}
+
+		// At most one slot retires per call, so no more than slots - 3 are ever
+		// held here, which leaves the producer at least one free. min_slots
+		// makes that at least one frame, so the slot let go of isn't handed
+		// back while the frame drawn from it may still be in flight.
+		uint64_t hold = _slots - 3;
+		uint32_t released = 0;
+		while (released < _retired_count && _frame - _retired_frame[released] >= hold)
+		{
+			_free.fetch_or(1u << _retired[released], std::memory_order_release);
+			released++;
+		}
+		uint32_t held = _read >= 0 ? 1u << _read : 0;
+		for (uint32_t i = released; i < _retired_count; i++)
+		{
+			_retired[i - released] = _retired[i];
+			_retired_frame[i - released] = _retired_frame[i];
+			held |= 1u << _retired[i];
+		}
+		_retired_count -= released;
+		_held.store(held, std::memory_order_relaxed);
+
+		return _read;
+	}
+
+	slot_ring_stats_t slot_ring::get_stats() const
+	{
+		slot_ring_stats_t stats = {};
+		stats.published = _published.load(std::memory_order_relaxed);
+		stats.acquired = _acquired.load(std::memory_order_relaxed);
+		stats.overwritten = _overwritten.load(std::memory_order_relaxed);
+		stats.stalls_avoided = _stalls_avoided.load(std::memory_order_relaxed);
+		stats.starved = _starved.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+} // namespace nakamir
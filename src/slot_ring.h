@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace nakamir {
+
+	struct slot_ring_stats_t {
+		uint64_t published;       // Slots handed over by the producer
+		uint64_t acquired;        // Published slots the consumer switched to
+		uint64_t overwritten;     // Published slots written again before the consumer saw them
+		uint64_t stalls_avoided;  // Writes started while the consumer held the slot last published, which with one slot would have waited on it
+		uint64_t starved;         // begin_write calls that found no free slot
+	};
+
+	// Latest-wins handoff of a ring of resources, e.g. sets of textures, from
+	// one producer thread to one consumer that renders from them. Like
+	// frame_mailbox the producer owns a write slot, the consumer owns a read
+	// slot and the newest unread slot is swapped between them through one
+	// atomic, so neither side ever waits for the other.
+	//
+	// The difference is what happens to the slot the consumer lets go of: a
+	// GPU may still be sampling it for a few frames, so it is retired for
+	// slots - 3 calls to acquire_latest before the producer can have it back.
+	// The consumer calls acquire_latest once per rendered frame, so a ring of
+	// 4, the least it takes, is a triple buffer that keeps the slot let go of
+	// for one more frame, and every slot past that covers another frame of
+	// GPU latency.
+	class slot_ring {
+	public:
+		static const uint32_t min_slots = 4;
+		static const uint32_t max_slots = 16;
+
+		slot_ring() = default;
+		explicit slot_ring(uint32_t slots) { reset(slots); }
+
+		slot_ring(const slot_ring&) = delete;
+		slot_ring& operator=(const slot_ring&) = delete;
+
+		// Sets the slot count, from min_slots to max_slots, and forgets
+		// everything. Not thread safe; call it before the producer and consumer start.
+		void reset(uint32_t slots);
+		uint32_t slots() const { return _slots; }
+
+		// Producer side. The slot to write, which stays the producer's until
+		// publish. -1 if none is free, which the retire limit below rules out,
+		// but it is checked rather than handing out a slot that is in use.
+		int32_t begin_write();
+		void publish();
+
+		// Consumer side, once per rendered frame. Returns the slot to draw,
+		// switching to the newest published one if there is one, or -1 before
+		// the first publish. fresh is set if it switched.
+		int32_t acquire_latest(/**[out]**/ bool* fresh = nullptr);
+
+		slot_ring_stats_t get_stats() const;
+
+	private:
+		static const uint32_t empty_slot = 0xFF;
+
+		bool take_free(/**[out]**/ int32_t* slot);
+
+		uint32_t _slots = 0;
+		int32_t _write = -1;                   // Owned by the producer
+		int32_t _read = -1;                    // Owned by the consumer
+		int32_t _last_published = -1;          // Owned by the producer
+		// Retired by the consumer, oldest first, with the frame they were let go
+		int32_t _retired[max_slots] = {};
+		uint64_t _retired_frame[max_slots] = {};
+		uint32_t _retired_count = 0;
+		uint64_t _frame = 0;                   // acquire_latest calls
+		alignas(64) std::atomic<uint32_t> _shared = empty_slot;   // Newest unread slot
+		std::atomic<uint32_t> _free = 0;       // Bit per slot the producer may take
+		std::atomic<uint32_t> _held = 0;       // Bit per slot the consumer reads or has retired
+
+		alignas(64) std::atomic<uint64_t> _published = 0;
+		std::atomic<uint64_t> _overwritten = 0;
+		std::atomic<uint64_t> _stalls_avoided = 0;
+		std::atomic<uint64_t> _starved = 0;
+		alignas(64) std::atomic<uint64_t> _acquired = 0;
+	};
+
+} // namespace nakamir
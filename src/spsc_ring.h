@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace nakamir {
+
+	// Bounded lock-free queue for exactly one producer thread and one consumer
+	// thread. Capacity is rounded up to a power of two. Each side caches the
+	// other side's index so the shared cache lines are only touched when the
+	// ring looks full (producer) or empty (consumer).
+	template <typename T>
+	class spsc_ring {
+	public:
+		explicit spsc_ring(size_t capacity)
+		{
+			size_t size = 2;
+			while (size < capacity) size <<= 1;
+			_items.resize(size);
+			_mask = size - 1;
+		}
+
+		spsc_ring(const spsc_ring&) = delete;
+		spsc_ring& operator=(const spsc_ring&) = delete;
+
+		size_t capacity() const { return _items.size(); }
+
+		// Producer side. Returns false without side effects when the ring is full.
+		template <typename U>
+		bool try_push(U&& item)
+		{
+			size_t head = _head.load(std::memory_order_relaxed);
+			if (head - _tail_cache == _items.size())
+			{
+				_tail_cache = _tail.load(std::memory_order_acquire);
+				if (head - _tail_cache == _items.size())
+					return false;
+			}
+			_items[head & _mask] = std::forward<U>(item);
+			_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer side. Returns false when the ring is empty.
+		bool try_pop(T& item)
+		{
+			size_t tail = _tail.load(std::memory_order_relaxed);
+			if (tail == _head_cache)
+			{
+				_head_cache = _head.load(std::memory_order_acquire);
+				if (tail == _head_cache)
+					return false;
+			}
+			item = std::move(_items[tail & _mask]);
+			_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer side. Looks at the oldest item without removing it.
+		T* peek()
+		{
+			size_t tail = _tail.load(std::memory_order_relaxed);
+			if (tail == _head_cache)
+			{
+				_head_cache = _head.load(std::memory_order_acquire);
+				if (tail == _head_cache)
+					return nullptr;
+			}
+			return &_items[tail & _mask];
+		}
+
+		// Only a snapshot; either side may move it immediately after
+		size_t size_approx() const
+		{
+			return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+		}
+
+	private:
+		std::vector<T> _items;
+		size_t _mask;
+
+		alignas(64) std::atomic<size_t> _head = 0; // Written by the producer
+		size_t _tail_cache = 0;                    // Producer's view of _tail
+		alignas(64) std::atomic<size_t> _tail = 0; // Written by the consumer
+		size_t _head_cache = 0;                    // Consumer's view of _head
+	};
+
+} // namespace nakamir
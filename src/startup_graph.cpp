@@ -0,0 +1,236 @@
+#include "startup_graph.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+
+namespace nakamir {
+
+	int32_t startup_graph::add(const char* name, startup_step_fn fn, void* context, std::initializer_list<int32_t> after, bool main_thread)
+	{
+		int32_t id = static_cast<int32_t>(_steps.size());
+		for (int32_t dependency : after)
+		{
+			if (dependency < 0 || dependency >= id)
+				return -1;
+		}
+
+		step_t step = {};
+		step.name = name;
+		step.fn = fn;
+		step.context = context;
+		step.after.assign(after.begin(), after.end());
+		step.main_thread = main_thread;
+		step.waiting = static_cast<uint32_t>(after.size());
+		step.state = startup_step_state_pending;
+		step.previous = -1;
+		_steps.push_back(std::move(step));
+		for (int32_t dependency : after)
+			_steps[dependency].before.push_back(id);
+		return id;
+	}
+
+	bool startup_graph::run(uint32_t worker_count, startup_thread_fn thread_begin, startup_thread_fn thread_end)
+	{
+		if (worker_count == 0)
+		{
+			uint32_t cores = std::thread::hardware_concurrency();
+			worker_count = cores > 1 ? cores - 1 : 1;
+		}
+		// More threads than steps would only sit idle
+		worker_count = std::min(worker_count, static_cast<uint32_t>(_steps.size()));
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_start_us = metrics_now_us();
+			for (int32_t i = 0; i < static_cast<int32_t>(_steps.size()); i++)
+			{
+				if (_steps[i].waiting == 0)
+					(_steps[i].main_thread ? _main_ready : _ready).push_back(i);
+			}
+		}
+
+		std::vector<std::thread> workers;
+		for (uint32_t i = 0; i < worker_count; i++)
+		{
+			workers.emplace_back([this, i, thread_begin, thread_end]() {
+				if (thread_begin)
+					thread_begin();
+				work(i + 1);
+				if (thread_end)
+					thread_end();
+			});
+		}
+		work(0);
+		for (std::thread& worker : workers)
+			worker.join();
+
+		return std::none_of(_steps.begin(), _steps.end(), [](const step_t& step) { return step.state != startup_step_state_ran; });
+	}
+
+	void startup_graph::work(uint32_t thread)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		int32_t last = -1;
+		for (;;)
+		{
+			if (_finished == _steps.size())
+				break;
+
+			// The caller takes its own steps first, as no one else can
+			int32_t id = -1;
+			if (thread == 0 && !_main_ready.empty())
+			{
+				id = _main_ready.front();
+				_main_ready.pop_front();
+			}
+			else if (!_ready.empty())
+			{
+				id = _ready.front();
+				_ready.pop_front();
+			}
+			if (id < 0)
+			{
+				_cv.wait(lock);
+				continue;
+			}
+
+			step_t& step = _steps[id];
+			step.thread = thread;
+			step.previous = last;
+			step.start_us = metrics_now_us() - _start_us;
+			startup_step_fn fn = step.fn;
+			void* context = step.context;
+			lock.unlock();
+
+			bool succeeded = false;
+			try
+			{
+				succeeded = fn(context);
+			}
+			catch (...)
+			{
+				succeeded = false;
+			}
+
+			lock.lock();
+			uint64_t now = metrics_now_us() - _start_us;
+			_steps[id].end_us = now;
+			_steps[id].state = succeeded ? startup_step_state_ran : startup_step_state_failed;
+			finish(id, now);
+			last = id;
+			_cv.notify_all();
+		}
+	}
+
+	void startup_graph::finish(int32_t id, uint64_t now)
+	{
+		_finished++;
+		bool failed = _steps[id].state != startup_step_state_ran;
+		for (int32_t next : _steps[id].before)
+		{
+			step_t& step = _steps[next];
+			step.blocked = step.blocked || failed;
+			if (--step.waiting > 0)
+				continue;
+			step.ready_us = now;
+			if (step.blocked)
+			{
+				// Never runs; what comes after it is skipped in turn
+				step.state = startup_step_state_skipped;
+				step.start_us = now;
+				step.end_us = now;
+				finish(next, now);
+				continue;
+			}
+			(step.main_thread ? _main_ready : _ready).push_back(next);
+		}
+	}
+
+	uint64_t startup_graph::mark(const char* name)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (const startup_mark_t& mark : _marks)
+		{
+			if (mark.name == name)
+				return mark.time_us;
+		}
+		uint64_t now = metrics_now_us();
+		uint64_t time_us = _start_us && now > _start_us ? now - _start_us : 0;
+		_marks.push_back({ name, time_us });
+		return time_us;
+	}
+
+	std::vector<startup_step_stats_t> startup_graph::get_step_stats()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		std::vector<startup_step_stats_t> stats;
+		for (const step_t& step : _steps)
+			stats.push_back({ step.name, step.state, step.main_thread, false, step.thread, step.ready_us, step.start_us, step.end_us });
+		if (_finished < _steps.size())
+			return stats;
+
+		// From the last step to finish, back through whatever it started
+		// after last: a dependency, or the step before it on its thread. On a
+		// tie the later step wins, as a step can only come after earlier ones.
+		int32_t at = -1;
+		for (int32_t i = 0; i < static_cast<int32_t>(_steps.size()); i++)
+		{
+			if (at < 0 || _steps[i].end_us >= _steps[at].end_us)
+				at = i;
+		}
+		while (at >= 0)
+		{
+			stats[at].critical = true;
+			const step_t& step = _steps[at];
+			// Both ran strictly before this one, so the walk always ends, even
+			// where timestamps tie
+			int32_t blocker = step.previous;
+			for (int32_t dependency : step.after)
+			{
+				if (blocker < 0 || _steps[dependency].end_us > _steps[blocker].end_us)
+					blocker = dependency;
+			}
+			at = blocker;
+		}
+		return stats;
+	}
+
+	std::vector<startup_mark_t> startup_graph::get_marks()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _marks;
+	}
+
+	std::string startup_graph::to_text()
+	{
+		std::vector<startup_step_stats_t> steps = get_step_stats();
+		std::vector<startup_mark_t> marks = get_marks();
+		std::stable_sort(steps.begin(), steps.end(), [](const startup_step_stats_t& a, const startup_step_stats_t& b) { return a.start_us < b.start_us; });
+
+		static const char* state_names[] = { "pending", "", "failed", "skipped" };
+		std::string text;
+		char line[256];
+		uint64_t end_us = 0;
+		for (const startup_step_stats_t& step : steps)
+			end_us = std::max(end_us, step.end_us);
+		snprintf(line, sizeof(line), "Startup: %.1f ms, critical path starred\n", end_us / 1000.0);
+		text += line;
+		for (const startup_step_stats_t& step : steps)
+		{
+			snprintf(line, sizeof(line), "%c %-20s %8.1f ms +%8.1f ms  thread %u%s%s%s\n", step.critical ? '*' : ' ', step.name.c_str(),
+				step.start_us / 1000.0, (step.end_us - step.start_us) / 1000.0, step.thread,
+				step.start_us > step.ready_us + 1000 ? ", waited for a thread" : "",
+				step.state != startup_step_state_ran ? ", " : "", state_names[step.state]);
+			text += line;
+		}
+		std::stable_sort(marks.begin(), marks.end(), [](const startup_mark_t& a, const startup_mark_t& b) { return a.time_us < b.time_us; });
+		for (const startup_mark_t& mark : marks)
+		{
+			snprintf(line, sizeof(line), "  %-20s %8.1f ms\n", mark.name.c_str(), mark.time_us / 1000.0);
+			text += line;
+		}
+		return text;
+	}
+
+} // namespace nakamir
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace nakamir {
+
+	// One initialization step, e.g. opening a camera or creating a decoder.
+	// Returns false, or throws, if it failed.
+	typedef bool(*startup_step_fn)(void* context);
+	// Called on each worker thread as it starts and before it exits, e.g. to
+	// join the COM apartment the steps need
+	typedef void(*startup_thread_fn)();
+
+	enum startup_step_state_ {
+		startup_step_state_pending,
+		startup_step_state_ran,
+		startup_step_state_failed,
+		startup_step_state_skipped,   // Something it comes after failed
+	};
+
+	struct startup_step_stats_t {
+		std::string name;
+		startup_step_state_ state;
+		bool main_thread;
+		bool critical;                // On the path that decided when the graph finished
+		uint32_t thread;              // 0 is the thread that called run
+		// Since run started: when its last dependency finished, when a thread
+		// took it and when it returned. Waiting for a free thread is start - ready.
+		uint64_t ready_us;
+		uint64_t start_us;
+		uint64_t end_us;
+	};
+
+	struct startup_mark_t {
+		std::string name;
+		uint64_t time_us;             // Since run started
+	};
+
+	// Brings a session up as a small dependency graph instead of a fixed
+	// sequence: every step runs as soon as the steps it comes after have, on
+	// the thread calling run or on a few workers started for the occasion,
+	// so independent steps such as graphics init, camera open and codec
+	// creation overlap. Steps pinned to the main thread, e.g. anything that
+	// owns a window, run on the caller.
+	//
+	// Each step is timed, and so are milestones marked after run, such as the
+	// first frame reaching the screen. The report walks back from the last
+	// step to finish through whatever held each step up, a dependency or the
+	// thread it ran on, to show the critical path of a cold start.
+	//
+	// add and run belong to one thread, and run goes once; mark and the
+	// reports may be called from any thread.
+	class startup_graph {
+	public:
+		startup_graph() = default;
+
+		startup_graph(const startup_graph&) = delete;
+		startup_graph& operator=(const startup_graph&) = delete;
+
+		// Adds a step to run once every step in after has, returning its id,
+		// or -1 if after names a step not added yet
+		int32_t add(const char* name, /**[in]**/ startup_step_fn fn, /**[in]**/ void* context, std::initializer_list<int32_t> after = {}, bool main_thread = false);
+		// Runs every step and returns once they are done, with up to
+		// worker_count threads besides the caller, 0 for one per core less
+		// one. False if any step failed; steps after a failed one are skipped.
+		bool run(uint32_t worker_count = 0, /**[in]**/ startup_thread_fn thread_begin = nullptr, /**[in]**/ startup_thread_fn thread_end = nullptr);
+
+		// Records a milestone, timed from the start of run, and returns its
+		// time. Only the first mark of a name counts, so per frame code can
+		// call it freely.
+		uint64_t mark(const char* name);
+
+		std::vector<startup_step_stats_t> get_step_stats();
+		std::vector<startup_mark_t> get_marks();
+		// Steps in the order they started, critical ones starred, then the
+		// marks; one line each, for the log
+		std::string to_text();
+
+	private:
+		struct step_t {
+			std::string name;
+			startup_step_fn fn;
+			void* context;
+			std::vector<int32_t> after;
+			std::vector<int32_t> before;   // Steps that come after this one
+			bool main_thread;
+			uint32_t waiting;              // Dependencies yet to finish
+			bool blocked;                  // One of them failed
+			startup_step_state_ state;
+			uint32_t thread;
+			int32_t previous;              // Step its thread ran before it, -1 for none
+			uint64_t ready_us;
+			uint64_t start_us;
+			uint64_t end_us;
+		};
+
+		void work(uint32_t thread);
+		// Under the lock: releases the steps after id
+		void finish(int32_t id, uint64_t now);
+
+		std::mutex _mutex;
+		std::condition_variable _cv;
+		std::vector<step_t> _steps;
+		std::deque<int32_t> _ready;        // For any thread
+		std::deque<int32_t> _main_ready;   // For the thread calling run
+		size_t _finished = 0;
+		uint64_t _start_us = 0;
+		std::vector<startup_mark_t> _marks;
+	};
+
+} // namespace nakamir
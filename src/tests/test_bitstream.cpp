@@ -0,0 +1,1280 @@
+#include "tests.h"
+#include "../h264_nal.h"
+#include "../h264_sps.h"
+#include "../mp4_demux.h"
+#include "../mp4_recorder.h"
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Parsing and rewriting of H.264 bitstreams and the MP4 files that carry
+// them, and the fragmented MP4 the recorder writes, against hand-built
+// buffers whose every byte or bit is known
+
+namespace nakamir {
+
+	///////////////////////////////////////////
+	// H.264 NAL units
+	///////////////////////////////////////////
+
+	// Leading garbage, then AUD, SPS, PPS, filler with zero padding after it
+	// and an IDR slice, mixing 4 and 3 byte start codes
+	static const uint8_t test_h264_stream[] = {
+		0xAB, 0xCD,
+		0x00, 0x00, 0x00, 0x01, 0x09, 0xF0,
+		0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1F,
+		0x00, 0x00, 0x00, 0x01, 0x68, 0xCE, 0x3C, 0x80,
+		0x00, 0x00, 0x01, 0x0C, 0xFF, 0xFF, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x01, 0x65, 0x88, 0x84, 0x00, 0x21,
+	};
+
+	// Units that survive keep their start code length; the garbage and the
+	// padding go
+	static void test_h264_filter_nals(test_state_t* state, void*)
+	{
+		const uint8_t expected[] = {
+			0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1F,
+			0x00, 0x00, 0x00, 0x01, 0x68, 0xCE, 0x3C, 0x80,
+			0x00, 0x00, 0x00, 0x01, 0x65, 0x88, 0x84, 0x00, 0x21,
+		};
+		std::vector<uint8_t> buffer(test_h264_stream, test_h264_stream + sizeof(test_h264_stream));
+		size_t size = h264_filter_nals(buffer.data(), buffer.size(), (1u << h264_nal_aud) | (1u << h264_nal_filler));
+		if (!TEST_CHECK(state, size == sizeof(expected)))
+			return;
+		TEST_CHECK(state, memcmp(buffer.data(), expected, size) == 0);
+
+		// Split again, the kept units are unchanged, start codes included
+		h264_nal_t before[8];
+		h264_nal_t after[8];
+		TEST_CHECK(state, h264_split_nals(test_h264_stream, sizeof(test_h264_stream), before, 8) == 5);
+		if (!TEST_CHECK(state, h264_split_nals(buffer.data(), size, after, 8) == 3))
+			return;
+		const int kept[] = { 1, 2, 4 };
+		for (int i = 0; i < 3; i++)
+		{
+			const h264_nal_t& a = after[i];
+			const h264_nal_t& b = before[kept[i]];
+			TEST_CHECK(state, a.type == b.type && a.size == b.size && a.start_code_size == b.start_code_size);
+			TEST_CHECK(state, memcmp(a.data, b.data, a.size) == 0);
+		}
+
+		// Without garbage or padding, keeping everything changes nothing
+		std::vector<uint8_t> clean(expected, expected + sizeof(expected));
+		TEST_CHECK(state, h264_filter_nals(clean.data(), clean.size(), 0) == sizeof(expected));
+		TEST_CHECK(state, memcmp(clean.data(), expected, sizeof(expected)) == 0);
+
+		// Dropping everything, or having nothing, leaves nothing
+		buffer.assign(test_h264_stream, test_h264_stream + sizeof(test_h264_stream));
+		TEST_CHECK(state, h264_filter_nals(buffer.data(), buffer.size(), 0xFFFFFFFFu) == 0);
+		TEST_CHECK(state, h264_filter_nals(buffer.data(), 0, 0) == 0);
+	}
+
+	// Splitting reports every unit even past max_nals, and the access unit
+	// summary sees what is in it
+	static void test_h264_split_nals(test_state_t* state, void*)
+	{
+		h264_nal_t nals[2];
+		TEST_CHECK(state, h264_split_nals(test_h264_stream, sizeof(test_h264_stream), nals, 2) == 5);
+		TEST_CHECK(state, nals[0].type == h264_nal_aud && nals[0].start_code_size == 4 && nals[0].size == 2);
+		TEST_CHECK(state, nals[1].type == h264_nal_sps && nals[1].start_code_size == 3 && nals[1].size == 4);
+		TEST_CHECK(state, nals[1].ref_idc == 3);
+
+		h264_access_unit_info_t info = h264_scan_access_unit(test_h264_stream, sizeof(test_h264_stream));
+		TEST_CHECK(state, info.nal_count == 5 && info.slice_count == 1);
+		TEST_CHECK(state, info.idr && info.has_sps && info.has_pps);
+		TEST_CHECK(state, info.type_mask == ((1u << h264_nal_aud) | (1u << h264_nal_sps) | (1u << h264_nal_pps) | (1u << h264_nal_filler) | (1u << h264_nal_slice_idr)));
+	}
+
+	///////////////////////////////////////////
+	// H.264 parameter sets
+	///////////////////////////////////////////
+
+	// MSB-first writer for building parameter sets field by field
+	class test_bit_writer {
+	public:
+		void u(uint32_t bits, uint64_t value)
+		{
+			for (uint32_t i = bits; i-- > 0;)
+			{
+				if ((_bits & 7) == 0)
+					_bytes.push_back(0);
+				_bytes.back() |= static_cast<uint8_t>(((value >> i) & 1) << (7 - (_bits & 7)));
+				_bits++;
+			}
+		}
+
+		void flag(bool value) { u(1, value ? 1 : 0); }
+
+		void ue(uint32_t value)
+		{
+			uint64_t code = static_cast<uint64_t>(value) + 1;
+			uint32_t length = 0;
+			while ((code >> (length + 1)) != 0)
+				length++;
+			u(length, 0);
+			u(length + 1, code);
+		}
+
+		void se(int32_t value) { ue(value > 0 ? 2 * static_cast<uint32_t>(value) - 1 : 2 * static_cast<uint32_t>(-value)); }
+
+		// Adds the stop bit and the emulation prevention bytes, behind the
+		// NAL header byte
+		std::vector<uint8_t> nal(uint8_t header)
+		{
+			u(1, 1);
+			std::vector<uint8_t> result(1, header);
+			uint32_t zeros = 0;
+			for (uint8_t byte : _bytes)
+			{
+				if (zeros >= 2 && byte <= 3)
+				{
+					result.push_back(3);
+					zeros = 0;
+				}
+				result.push_back(byte);
+				zeros = byte == 0 ? zeros + 1 : 0;
+			}
+			return result;
+		}
+
+	private:
+		std::vector<uint8_t> _bytes;
+		uint32_t _bits = 0;
+	};
+
+	struct test_sps_params_t {
+		uint8_t profile_idc;
+		uint8_t constraint_flags;
+		uint8_t level_idc;
+		uint32_t max_num_ref_frames;
+		uint32_t width_mbs;
+		uint32_t height_map_units;
+		bool frame_mbs_only;
+		uint32_t crop[4];       // Left, right, top, bottom in crop units, all 0 for none
+		bool vui;               // With SAR, full range BT.709, 30000/1001 timing, HRD and restrictions
+		uint32_t max_num_reorder_frames;
+		uint32_t max_dec_frame_buffering;
+	};
+
+	static std::vector<uint8_t> test_write_sps(const test_sps_params_t& params)
+	{
+		test_bit_writer bits;
+		bits.u(8, params.profile_idc);
+		bits.u(8, params.constraint_flags);
+		bits.u(8, params.level_idc);
+		bits.ue(0);                  // seq_parameter_set_id
+		if (params.profile_idc == 100)
+		{
+			bits.ue(1);              // chroma_format_idc
+			bits.ue(0);              // bit_depth_luma_minus8
+			bits.ue(0);              // bit_depth_chroma_minus8
+			bits.flag(false);        // qpprime_y_zero_transform_bypass_flag
+			bits.flag(false);        // seq_scaling_matrix_present_flag
+		}
+		bits.ue(0);                  // log2_max_frame_num_minus4
+		bits.ue(0);                  // pic_order_cnt_type
+		bits.ue(2);                  // log2_max_pic_order_cnt_lsb_minus4
+		bits.ue(params.max_num_ref_frames);
+		bits.flag(false);            // gaps_in_frame_num_value_allowed_flag
+		bits.ue(params.width_mbs - 1);
+		bits.ue(params.height_map_units - 1);
+		bits.flag(params.frame_mbs_only);
+		if (!params.frame_mbs_only)
+			bits.flag(false);        // mb_adaptive_frame_field_flag
+		bits.flag(true);             // direct_8x8_inference_flag
+		bool crop = params.crop[0] || params.crop[1] || params.crop[2] || params.crop[3];
+		bits.flag(crop);
+		if (crop)
+		{
+			for (uint32_t offset : params.crop)
+				bits.ue(offset);
+		}
+		bits.flag(params.vui);
+		if (params.vui)
+		{
+			bits.flag(true);         // aspect_ratio_info_present_flag
+			bits.u(8, 255);          // Extended_SAR
+			bits.u(16, 4);
+			bits.u(16, 3);
+			bits.flag(false);        // overscan_info_present_flag
+			bits.flag(true);         // video_signal_type_present_flag
+			bits.u(3, 5);            // video_format
+			bits.flag(true);         // video_full_range_flag
+			bits.flag(true);         // colour_description_present_flag
+			bits.u(8, 1);
+			bits.u(8, 1);
+			bits.u(8, 1);
+			bits.flag(false);        // chroma_loc_info_present_flag
+			bits.flag(true);         // timing_info_present_flag
+			bits.u(32, 1001);
+			bits.u(32, 60000);
+			bits.flag(true);         // fixed_frame_rate_flag
+			bits.flag(true);         // nal_hrd_parameters_present_flag
+			bits.ue(1);              // cpb_cnt_minus1
+			bits.u(4, 3);
+			bits.u(4, 5);
+			for (int i = 0; i < 2; i++)
+			{
+				bits.ue(1000 + i);
+				bits.ue(2000 + i);
+				bits.flag(i == 0);
+			}
+			bits.u(20, 0xABCDE);     // Delay and offset field lengths
+			bits.flag(false);        // vcl_hrd_parameters_present_flag
+			bits.flag(false);        // low_delay_hrd_flag
+			bits.flag(false);        // pic_struct_present_flag
+			bits.flag(true);         // bitstream_restriction_flag
+			bits.flag(true);         // motion_vectors_over_pic_boundaries_flag
+			bits.ue(2);
+			bits.ue(1);
+			bits.ue(16);
+			bits.ue(16);
+			bits.ue(params.max_num_reorder_frames);
+			bits.ue(params.max_dec_frame_buffering);
+		}
+		return bits.nal(0x67);
+	}
+
+	// 1080p High with cropping and a full VUI: the displayed size, aspect,
+	// colour, frame rate and DPB all come from the stream
+	static void test_h264_sps_vui(test_state_t* state, void*)
+	{
+		test_sps_params_t params = {};
+		params.profile_idc = 100;
+		params.level_idc = 40;
+		params.max_num_ref_frames = 4;
+		params.width_mbs = 120;
+		params.height_map_units = 68;
+		params.frame_mbs_only = true;
+		params.crop[3] = 4;
+		params.vui = true;
+		params.max_num_reorder_frames = 2;
+		params.max_dec_frame_buffering = 4;
+		std::vector<uint8_t> nal = test_write_sps(params);
+
+		h264_sps_t sps;
+		if (!TEST_CHECK(state, h264_parse_sps(nal.data(), nal.size(), &sps)))
+			return;
+		TEST_CHECK(state, sps.profile_idc == 100 && sps.level_idc == 40 && sps.chroma_format_idc == 1);
+		TEST_CHECK(state, sps.coded_width == 1920 && sps.coded_height == 1088);
+		TEST_CHECK(state, sps.width == 1920 && sps.height == 1080 && sps.crop_bottom == 8);
+		TEST_CHECK(state, sps.vui_present && sps.sar_width == 4 && sps.sar_height == 3);
+		TEST_CHECK(state, sps.video_full_range && sps.matrix_coefficients == 1);
+		TEST_CHECK(state, h264_sps_color_matrix(&sps) == color_matrix_bt709);
+		TEST_CHECK(state, h264_sps_color_range(&sps) == color_range_full);
+		uint32_t numerator = 0;
+		uint32_t denominator = 0;
+		TEST_CHECK(state, h264_sps_frame_rate(&sps, &numerator, &denominator));
+		TEST_CHECK(state, numerator == 30000 && denominator == 1001);
+		TEST_CHECK(state, sps.fixed_frame_rate);
+		TEST_CHECK(state, h264_sps_reorder_depth(&sps) == 2);
+		TEST_CHECK(state, h264_sps_dpb_frames(&sps) == 4);
+
+		// Every shorter prefix is refused or, if all it lost was padding,
+		// parses to the same thing
+		for (size_t size = 0; size < nal.size(); size++)
+		{
+			h264_sps_t truncated;
+			if (h264_parse_sps(nal.data(), size, &truncated))
+			{
+				if (!TEST_CHECK(state, size + 1 == nal.size() && truncated.max_dec_frame_buffering == 4))
+					break;
+			}
+		}
+	}
+
+	// Without restrictions the DPB comes from the level, and only profiles
+	// that can have B frames reorder
+	static void test_h264_sps_dpb(test_state_t* state, void*)
+	{
+		struct dpb_case_t {
+			uint8_t profile_idc;
+			uint8_t level_idc;
+			uint32_t width_mbs;
+			uint32_t height_mbs;
+			uint32_t dpb;
+			uint32_t reorder;
+			color_matrix_ matrix;
+		};
+		const dpb_case_t cases[] = {
+			// 8100 / (40 * 30) = 6 frames, but Baseline has no B frames
+			{ 66, 30, 40, 30, 6, 0, color_matrix_bt601 },
+			// 18000 / (80 * 45) = 5, and 720p with unspecified colour is BT.709
+			{ 77, 31, 80, 45, 5, 5, color_matrix_bt709 },
+			// 32768 / (120 * 68) = 4
+			{ 100, 41, 120, 68, 4, 4, color_matrix_bt709 },
+			// Capped at 16
+			{ 77, 51, 20, 15, 16, 16, color_matrix_bt601 },
+		};
+		for (const dpb_case_t& c : cases)
+		{
+			test_sps_params_t params = {};
+			params.profile_idc = c.profile_idc;
+			params.level_idc = c.level_idc;
+			params.max_num_ref_frames = 1;
+			params.width_mbs = c.width_mbs;
+			params.height_map_units = c.height_mbs;
+			params.frame_mbs_only = true;
+			std::vector<uint8_t> nal = test_write_sps(params);
+			h264_sps_t sps;
+			if (!TEST_CHECK(state, h264_parse_sps(nal.data(), nal.size(), &sps)))
+				continue;
+			TEST_CHECK(state, !sps.vui_present && sps.sar_width == 1 && sps.sar_height == 1);
+			TEST_CHECK(state, h264_sps_dpb_frames(&sps) == c.dpb);
+			TEST_CHECK(state, h264_sps_reorder_depth(&sps) == c.reorder);
+			TEST_CHECK(state, h264_sps_color_matrix(&sps) == c.matrix);
+			TEST_CHECK(state, h264_sps_color_range(&sps) == color_range_limited);
+			uint32_t numerator, denominator;
+			TEST_CHECK(state, !h264_sps_frame_rate(&sps, &numerator, &denominator));
+		}
+	}
+
+	// Field coding doubles the map units and the vertical crop unit, and a
+	// crop that leaves nothing is refused
+	static void test_h264_sps_cropping(test_state_t* state, void*)
+	{
+		test_sps_params_t params = {};
+		params.profile_idc = 77;
+		params.level_idc = 30;
+		params.max_num_ref_frames = 2;
+		params.width_mbs = 45;
+		params.height_map_units = 18;
+		params.frame_mbs_only = false;
+		params.crop[0] = 4;
+		params.crop[1] = 4;
+		params.crop[2] = 1;
+		params.crop[3] = 2;
+		std::vector<uint8_t> nal = test_write_sps(params);
+		h264_sps_t sps;
+		if (TEST_CHECK(state, h264_parse_sps(nal.data(), nal.size(), &sps)))
+		{
+			TEST_CHECK(state, !sps.frame_mbs_only);
+			TEST_CHECK(state, sps.coded_width == 720 && sps.coded_height == 576);
+			TEST_CHECK(state, sps.crop_left == 8 && sps.crop_right == 8 && sps.crop_top == 4 && sps.crop_bottom == 8);
+			TEST_CHECK(state, sps.width == 704 && sps.height == 564);
+		}
+
+		params.frame_mbs_only = true;
+		params.crop[0] = 360;
+		params.crop[1] = 0;
+		nal = test_write_sps(params);
+		TEST_CHECK(state, !h264_parse_sps(nal.data(), nal.size(), &sps));
+
+		// Not an SPS at all
+		nal[0] = 0x68;
+		TEST_CHECK(state, !h264_parse_sps(nal.data(), nal.size(), &sps));
+	}
+
+	// Emulation prevention is undone before parsing, and the first SPS and
+	// PPS of an Annex-B header are found and parsed together
+	static void test_h264_parameter_sets(test_state_t* state, void*)
+	{
+		const uint8_t escaped[] = { 0x00, 0x00, 0x03, 0x01, 0x00, 0x00, 0x03, 0x00, 0x03, 0x00, 0x00, 0x03 };
+		const uint8_t plain[] = { 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00 };
+		uint8_t rbsp[sizeof(escaped)];
+		size_t size = h264_nal_to_rbsp(escaped, sizeof(escaped), rbsp);
+		TEST_CHECK(state, size == sizeof(plain) && memcmp(rbsp, plain, size) == 0);
+
+		test_sps_params_t params = {};
+		params.profile_idc = 100;
+		params.level_idc = 31;
+		params.max_num_ref_frames = 1;
+		params.width_mbs = 80;
+		params.height_map_units = 45;
+		params.frame_mbs_only = true;
+		std::vector<uint8_t> sps_nal = test_write_sps(params);
+
+		test_bit_writer pps_bits;
+		pps_bits.ue(3);              // pic_parameter_set_id
+		pps_bits.ue(0);              // seq_parameter_set_id
+		pps_bits.flag(true);         // entropy_coding_mode_flag
+		pps_bits.flag(false);
+		pps_bits.ue(0);              // num_slice_groups_minus1
+		pps_bits.ue(2);
+		pps_bits.ue(0);
+		pps_bits.flag(false);
+		pps_bits.u(2, 0);
+		pps_bits.se(-3);             // pic_init_qp_minus26
+		pps_bits.se(0);
+		pps_bits.se(-2);             // chroma_qp_index_offset
+		pps_bits.flag(true);
+		pps_bits.flag(false);
+		pps_bits.flag(false);
+		pps_bits.flag(true);         // transform_8x8_mode_flag
+		pps_bits.flag(false);        // pic_scaling_matrix_present_flag
+		pps_bits.se(1);              // second_chroma_qp_index_offset
+		std::vector<uint8_t> pps_nal = pps_bits.nal(0x68);
+
+		std::vector<uint8_t> header = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xF0, 0x00, 0x00, 0x00, 0x01 };
+		header.insert(header.end(), sps_nal.begin(), sps_nal.end());
+		header.insert(header.end(), { 0x00, 0x00, 0x01 });
+		header.insert(header.end(), pps_nal.begin(), pps_nal.end());
+
+		h264_sps_t sps;
+		h264_pps_t pps;
+		if (!TEST_CHECK(state, h264_parse_parameter_sets(header.data(), header.size(), &sps, &pps)))
+			return;
+		TEST_CHECK(state, sps.width == 1280 && sps.height == 720);
+		TEST_CHECK(state, pps.pps_id == 3 && pps.sps_id == 0 && pps.entropy_coding_mode);
+		TEST_CHECK(state, pps.num_ref_idx_l0_default_active == 3 && pps.pic_init_qp == 23);
+		TEST_CHECK(state, pps.chroma_qp_index_offset == -2 && pps.deblocking_filter_control_present);
+		TEST_CHECK(state, pps.transform_8x8_mode && pps.second_chroma_qp_index_offset == 1);
+
+		// Asking for a PPS the header doesn't have fails
+		std::vector<uint8_t> sps_only(header.begin(), header.begin() + 10 + sps_nal.size());
+		TEST_CHECK(state, h264_parse_parameter_sets(sps_only.data(), sps_only.size(), &sps));
+		TEST_CHECK(state, !h264_parse_parameter_sets(sps_only.data(), sps_only.size(), &sps, &pps));
+	}
+
+	///////////////////////////////////////////
+	// MP4 demuxing
+	///////////////////////////////////////////
+
+	// Big-endian box writer. Boxes nest between begin and end, which patches
+	// in the size once the payload is known.
+	class test_box_writer {
+	public:
+		void u8(uint32_t value) { _bytes.push_back(static_cast<uint8_t>(value)); }
+		void u16(uint32_t value) { u8(value >> 8); u8(value); }
+		void u32(uint32_t value) { u16(value >> 16); u16(value); }
+		void u64(uint64_t value) { u32(static_cast<uint32_t>(value >> 32)); u32(static_cast<uint32_t>(value)); }
+		void zeros(size_t count) { _bytes.insert(_bytes.end(), count, 0); }
+		void bytes(const std::vector<uint8_t>& data) { _bytes.insert(_bytes.end(), data.begin(), data.end()); }
+
+		void begin(const char* type)
+		{
+			_open.push_back(_bytes.size());
+			u32(0);
+			for (int i = 0; i < 4; i++)
+				u8(static_cast<uint8_t>(type[i]));
+		}
+		void begin_full(const char* type, uint32_t version_flags) { begin(type); u32(version_flags); }
+		void end()
+		{
+			size_t start = _open.back();
+			_open.pop_back();
+			uint32_t size = static_cast<uint32_t>(_bytes.size() - start);
+			for (int i = 0; i < 4; i++)
+				_bytes[start + i] = static_cast<uint8_t>(size >> (24 - i * 8));
+		}
+
+		size_t size() const { return _bytes.size(); }
+		std::vector<uint8_t>& data() { return _bytes; }
+
+	private:
+		std::vector<uint8_t> _bytes;
+		std::vector<size_t> _open;
+	};
+
+	// Which of the interchangeable tables a test file is written with
+	struct test_mp4_options_t {
+		uint32_t stz2_field_size;   // 4, 8 or 16 for stz2; 0 for stsz
+		bool co64;
+		bool reorder;               // I P B B GOPs with ctts and stss, else all sync with two stts runs
+		bool moov_first;
+	};
+
+	// 12 samples of 5 to 7 bytes in chunks of 5, 3, 3 and 1, with a few bytes
+	// of another track between the chunks. At 1200 ticks a second, reordered
+	// files step 100 ticks a sample and present each GOP as I B B P one frame
+	// late; the others step 100 for 8 samples, then 50.
+	static const uint32_t test_mp4_samples = 12;
+	static const uint32_t test_mp4_chunks[] = { 5, 3, 3, 1 };
+	static const uint8_t test_mp4_sps[] = { 0x67, 0x42, 0xC0, 0x1E, 0xDA, 0x02, 0x80 };
+	static const uint8_t test_mp4_pps[] = { 0x68, 0xCE, 0x3C, 0x80 };
+
+	static bool test_mp4_sync(uint32_t i, bool reorder) { return !reorder || i % 4 == 0; }
+	static int64_t test_mp4_dts(uint32_t i, bool reorder) { return reorder || i < 8 ? i * 100 : 800 + (i - 8) * 50; }
+	static int32_t test_mp4_cts_offset(uint32_t i, bool reorder)
+	{
+		static const int32_t gop[4] = { 100, 300, 0, 0 };
+		return reorder ? gop[i % 4] : 0;
+	}
+
+	// One NAL unit of 1 to 3 bytes behind a 4 byte length
+	static std::vector<uint8_t> test_mp4_sample(uint32_t i, bool reorder)
+	{
+		uint32_t length = 1 + i % 3;
+		std::vector<uint8_t> sample = { 0, 0, 0, static_cast<uint8_t>(length) };
+		sample.push_back(test_mp4_sync(i, reorder) ? 0x65 : 0x41);
+		sample.insert(sample.end(), length - 1, static_cast<uint8_t>(i));
+		return sample;
+	}
+
+	static void test_write_moov(test_box_writer* w, const test_mp4_options_t& options, const std::vector<uint64_t>& chunk_offsets)
+	{
+		bool reorder = options.reorder;
+		w->begin("moov");
+		w->begin("trak");
+		w->begin_full("tkhd", 7);
+		w->u32(0); w->u32(0);        // Creation and modification times
+		w->u32(1);                   // track_ID
+		w->u32(0);
+		w->u32(1200);                // duration
+		w->end();
+		w->begin("mdia");
+		w->begin_full("mdhd", 0);
+		w->u32(0); w->u32(0);
+		w->u32(1200);                // timescale
+		w->u32(1200);                // duration
+		w->u16(0x55C4); w->u16(0);
+		w->end();
+		w->begin_full("hdlr", 0);
+		w->u32(0);
+		w->u32(mp4_fourcc('v', 'i', 'd', 'e'));
+		w->zeros(13);                // Reserved, then an empty name
+		w->end();
+		w->begin("minf");
+		w->begin("stbl");
+
+		w->begin_full("stsd", 0);
+		w->u32(1);
+		w->begin("avc1");
+		w->zeros(6); w->u16(1);      // data_reference_index
+		w->zeros(16);
+		w->u16(320); w->u16(240);
+		w->u32(0x00480000); w->u32(0x00480000); w->u32(0);
+		w->u16(1);                   // frame_count
+		w->zeros(32);                // compressorname
+		w->u16(0x18); w->u16(0xFFFF);
+		w->begin("avcC");
+		w->u8(1); w->u8(66); w->u8(0xC0); w->u8(30);
+		w->u8(0xFF);                 // 4 byte lengths
+		w->u8(0xE1); w->u16(sizeof(test_mp4_sps));
+		w->bytes(std::vector<uint8_t>(test_mp4_sps, test_mp4_sps + sizeof(test_mp4_sps)));
+		w->u8(1); w->u16(sizeof(test_mp4_pps));
+		w->bytes(std::vector<uint8_t>(test_mp4_pps, test_mp4_pps + sizeof(test_mp4_pps)));
+		w->end();
+		w->end();
+		w->end();
+
+		w->begin_full("stts", 0);
+		if (reorder)
+		{
+			w->u32(1);
+			w->u32(test_mp4_samples); w->u32(100);
+		}
+		else
+		{
+			w->u32(2);
+			w->u32(8); w->u32(100);
+			w->u32(test_mp4_samples - 8); w->u32(50);
+		}
+		w->end();
+
+		if (reorder)
+		{
+			// Run-length coded, so one GOP is three runs
+			w->begin_full("ctts", 0);
+			w->u32(test_mp4_samples / 4 * 3);
+			for (uint32_t g = 0; g < test_mp4_samples / 4; g++)
+			{
+				w->u32(1); w->u32(static_cast<uint32_t>(test_mp4_cts_offset(0, true)));
+				w->u32(1); w->u32(static_cast<uint32_t>(test_mp4_cts_offset(1, true)));
+				w->u32(2); w->u32(static_cast<uint32_t>(test_mp4_cts_offset(2, true)));
+			}
+			w->end();
+
+			w->begin_full("stss", 0);
+			w->u32(test_mp4_samples / 4);
+			for (uint32_t i = 0; i < test_mp4_samples; i += 4)
+				w->u32(i + 1);
+			w->end();
+		}
+
+		if (options.stz2_field_size == 0)
+		{
+			w->begin_full("stsz", 0);
+			w->u32(0);
+			w->u32(test_mp4_samples);
+			for (uint32_t i = 0; i < test_mp4_samples; i++)
+				w->u32(static_cast<uint32_t>(test_mp4_sample(i, reorder).size()));
+			w->end();
+		}
+		else
+		{
+			w->begin_full("stz2", 0);
+			w->u16(0); w->u8(0); w->u8(options.stz2_field_size);
+			w->u32(test_mp4_samples);
+			for (uint32_t i = 0; i < test_mp4_samples; i++)
+			{
+				uint32_t size = static_cast<uint32_t>(test_mp4_sample(i, reorder).size());
+				if (options.stz2_field_size == 4)
+				{
+					if (i & 1)
+						w->data().back() |= static_cast<uint8_t>(size);
+					else
+						w->u8(size << 4);
+				}
+				else if (options.stz2_field_size == 8)
+				{
+					w->u8(size);
+				}
+				else
+				{
+					w->u16(size);
+				}
+			}
+			w->end();
+		}
+
+		// First chunk of 5, then chunks of 3 until the samples run out
+		w->begin_full("stsc", 0);
+		w->u32(2);
+		w->u32(1); w->u32(test_mp4_chunks[0]); w->u32(1);
+		w->u32(2); w->u32(test_mp4_chunks[1]); w->u32(1);
+		w->end();
+
+		w->begin_full(options.co64 ? "co64" : "stco", 0);
+		w->u32(static_cast<uint32_t>(chunk_offsets.size()));
+		for (uint64_t offset : chunk_offsets)
+		{
+			if (options.co64)
+				w->u64(offset);
+			else
+				w->u32(static_cast<uint32_t>(offset));
+		}
+		w->end();
+
+		w->end();
+		w->end();
+		w->end();
+		w->end();
+		w->end();
+	}
+
+	static std::vector<uint8_t> test_make_mp4(const test_mp4_options_t& options, /**[out]**/ std::vector<uint64_t>* sample_offsets)
+	{
+		const uint32_t chunk_count = sizeof(test_mp4_chunks) / sizeof(test_mp4_chunks[0]);
+		const size_t gap = 3;
+		std::vector<uint64_t> chunk_offsets(chunk_count, 0);
+
+		test_box_writer w;
+		w.begin("ftyp");
+		w.u32(mp4_fourcc('i', 's', 'o', 'm')); w.u32(0x200); w.u32(mp4_fourcc('a', 'v', 'c', '1'));
+		w.end();
+
+		// The offsets don't change the size of the moov, so a first pass finds
+		// where the mdat payload will start
+		size_t moov_size = 0;
+		if (options.moov_first)
+		{
+			test_box_writer scratch;
+			test_write_moov(&scratch, options, chunk_offsets);
+			moov_size = scratch.size();
+		}
+		uint64_t offset = w.size() + moov_size + 8;
+		sample_offsets->clear();
+		for (uint32_t c = 0, i = 0; c < chunk_count; c++)
+		{
+			chunk_offsets[c] = offset;
+			for (uint32_t k = 0; k < test_mp4_chunks[c]; k++, i++)
+			{
+				sample_offsets->push_back(offset);
+				offset += test_mp4_sample(i, options.reorder).size();
+			}
+			offset += gap;
+		}
+
+		if (options.moov_first)
+			test_write_moov(&w, options, chunk_offsets);
+		w.begin("mdat");
+		for (uint32_t c = 0, i = 0; c < chunk_count; c++)
+		{
+			for (uint32_t k = 0; k < test_mp4_chunks[c]; k++, i++)
+				w.bytes(test_mp4_sample(i, options.reorder));
+			w.bytes(std::vector<uint8_t>(gap, 0xEE));
+		}
+		w.end();
+		if (!options.moov_first)
+			test_write_moov(&w, options, chunk_offsets);
+		return w.data();
+	}
+
+	static test_mp4_options_t test_mp4_variants[] = {
+		{ 0, false, true, false },
+		{ 4, true, true, true },
+		{ 8, false, false, false },
+		{ 16, true, false, true },
+	};
+
+	// Every way of writing the same sample table reads back the same samples
+	static void test_mp4_index(test_state_t* state, void* context)
+	{
+		const test_mp4_options_t& options = *static_cast<const test_mp4_options_t*>(context);
+		std::vector<uint64_t> offsets;
+		std::vector<uint8_t> file = test_make_mp4(options, &offsets);
+
+		mp4_demuxer demuxer;
+		if (!TEST_CHECK(state, demuxer.open_memory(file.data(), file.size())))
+			return;
+		int32_t track = demuxer.find_track(mp4_fourcc('v', 'i', 'd', 'e'), mp4_fourcc('a', 'v', 'c', '1'));
+		if (!TEST_CHECK(state, track == 0 && demuxer.tracks().size() == 1))
+			return;
+		const mp4_track_t& info = demuxer.tracks()[0];
+		TEST_CHECK(state, info.id == 1 && info.timescale == 1200 && info.duration == 1200);
+		TEST_CHECK(state, info.width == 320 && info.height == 240);
+		TEST_CHECK(state, info.nal_length_size == 4 && info.profile_idc == 66 && info.level_idc == 30);
+		TEST_CHECK(state, info.sps.size() == 1 && info.sps[0] == std::vector<uint8_t>(test_mp4_sps, test_mp4_sps + sizeof(test_mp4_sps)));
+		TEST_CHECK(state, info.pps.size() == 1 && info.pps[0] == std::vector<uint8_t>(test_mp4_pps, test_mp4_pps + sizeof(test_mp4_pps)));
+		if (!TEST_CHECK(state, info.samples.count() == test_mp4_samples))
+			return;
+		TEST_CHECK(state, info.samples.end_dts == (options.reorder ? 1200 : 1000));
+		TEST_CHECK(state, info.samples.sync.empty() == !options.reorder);
+
+		for (uint32_t i = 0; i < test_mp4_samples; i++)
+		{
+			mp4_sample_t sample;
+			if (!TEST_CHECK(state, demuxer.get_sample(track, i, &sample)))
+				return;
+			std::vector<uint8_t> expected = test_mp4_sample(i, options.reorder);
+			TEST_CHECK(state, sample.data == file.data() + offsets[i]);
+			TEST_CHECK(state, sample.size == expected.size() && memcmp(sample.data, expected.data(), expected.size()) == 0);
+			TEST_CHECK(state, sample.dts == test_mp4_dts(i, options.reorder));
+			TEST_CHECK(state, sample.pts == sample.dts + test_mp4_cts_offset(i, options.reorder));
+			TEST_CHECK(state, sample.duration == (options.reorder || i < 8 ? 100u : 50u));
+			TEST_CHECK(state, sample.sync == test_mp4_sync(i, options.reorder));
+		}
+		mp4_sample_t past;
+		TEST_CHECK(state, !demuxer.get_sample(track, test_mp4_samples, &past));
+		TEST_CHECK(state, !demuxer.get_sample(1, 0, &past));
+
+		std::vector<uint8_t> header = { 0, 0, 0, 1 };
+		header.insert(header.end(), test_mp4_sps, test_mp4_sps + sizeof(test_mp4_sps));
+		header.insert(header.end(), { 0, 0, 0, 1 });
+		header.insert(header.end(), test_mp4_pps, test_mp4_pps + sizeof(test_mp4_pps));
+		TEST_CHECK(state, mp4_track_annexb_header(info) == header);
+	}
+
+	// Seeks land on the sync sample before the target, and on the frame shown
+	// at it, with B frames presented out of decode order
+	static void test_mp4_seek(test_state_t* state, void*)
+	{
+		std::vector<uint64_t> offsets;
+		std::vector<uint8_t> file = test_make_mp4(test_mp4_variants[0], &offsets);
+		mp4_demuxer demuxer;
+		if (!TEST_CHECK(state, demuxer.open_memory(file.data(), file.size())))
+			return;
+
+		// Each GOP of 400 ticks shows I at +100, B at +200 and +300, P at +400
+		TEST_CHECK(state, demuxer.find_sync_sample(0, 50) == 0);
+		TEST_CHECK(state, demuxer.find_sync_sample(0, 499) == 0);
+		TEST_CHECK(state, demuxer.find_sync_sample(0, 500) == 4);
+		TEST_CHECK(state, demuxer.find_sync_sample(0, 899) == 4);
+		TEST_CHECK(state, demuxer.find_sync_sample(0, 900) == 8);
+		TEST_CHECK(state, demuxer.find_sync_sample(0, 100000) == 8);
+
+		TEST_CHECK(state, demuxer.find_sample(0, 50) == 0);
+		TEST_CHECK(state, demuxer.find_sample(0, 100) == 0);
+		TEST_CHECK(state, demuxer.find_sample(0, 250) == 2);
+		TEST_CHECK(state, demuxer.find_sample(0, 300) == 3);
+		TEST_CHECK(state, demuxer.find_sample(0, 450) == 1);
+		TEST_CHECK(state, demuxer.find_sample(0, 500) == 4);
+		TEST_CHECK(state, demuxer.find_sample(0, 650) == 6);
+		TEST_CHECK(state, demuxer.find_sample(0, 100000) == 9);
+
+		// All sync, with the sample duration halving after the 8th
+		file = test_make_mp4(test_mp4_variants[2], &offsets);
+		if (!TEST_CHECK(state, demuxer.open_memory(file.data(), file.size())))
+			return;
+		TEST_CHECK(state, demuxer.find_sample(0, -10) == 0);
+		TEST_CHECK(state, demuxer.find_sample(0, 0) == 0);
+		TEST_CHECK(state, demuxer.find_sample(0, 150) == 1);
+		TEST_CHECK(state, demuxer.find_sample(0, 800) == 8);
+		TEST_CHECK(state, demuxer.find_sample(0, 849) == 8);
+		TEST_CHECK(state, demuxer.find_sample(0, 875) == 9);
+		TEST_CHECK(state, demuxer.find_sample(0, 100000) == 11);
+		TEST_CHECK(state, demuxer.find_sync_sample(0, 875) == 9);
+	}
+
+	// A cut-off download keeps the samples that made it, and drops the sync
+	// samples and duration of the rest
+	static void test_mp4_truncated(test_state_t* state, void*)
+	{
+		std::vector<uint64_t> offsets;
+		test_mp4_options_t options = { 0, false, true, true };
+		std::vector<uint8_t> file = test_make_mp4(options, &offsets);
+
+		mp4_demuxer demuxer;
+		size_t cut = static_cast<size_t>(offsets[10]) + 2;
+		if (!TEST_CHECK(state, demuxer.open_memory(file.data(), cut)))
+			return;
+		const mp4_sample_index_t& samples = demuxer.tracks()[0].samples;
+		TEST_CHECK(state, samples.count() == 10);
+		TEST_CHECK(state, samples.end_dts == 1000);
+		TEST_CHECK(state, samples.sync == std::vector<uint32_t>({ 0, 4, 8 }));
+		mp4_sample_t sample;
+		TEST_CHECK(state, demuxer.get_sample(0, 9, &sample) && sample.data + sample.size <= file.data() + cut);
+		TEST_CHECK(state, !demuxer.get_sample(0, 10, &sample));
+		TEST_CHECK(state, demuxer.find_sample(0, 100000) == 9);
+
+		// Without a single whole sample there is no track, and so no file
+		TEST_CHECK(state, !demuxer.open_memory(file.data(), static_cast<size_t>(offsets[0]) + 2));
+		TEST_CHECK(state, !demuxer.open_memory(file.data(), 16));
+	}
+
+	static std::vector<uint8_t> test_avcc(const std::vector<std::vector<uint8_t>>& units, uint32_t nal_length_size)
+	{
+		std::vector<uint8_t> sample;
+		for (const std::vector<uint8_t>& unit : units)
+		{
+			for (uint32_t i = nal_length_size; i-- > 0;)
+				sample.push_back(static_cast<uint8_t>(unit.size() >> (i * 8)));
+			sample.insert(sample.end(), unit.begin(), unit.end());
+		}
+		return sample;
+	}
+
+	// Converts into a buffer of exactly mp4_annexb_max_size bytes followed by
+	// a guard, returning the bytes written or SIZE_MAX if the guard was hit
+	static size_t test_avcc_to_annexb(const std::vector<uint8_t>& sample, uint32_t nal_length_size, /**[out]**/ std::vector<uint8_t>* annexb)
+	{
+		const size_t guard = 64;
+		size_t max_size = mp4_annexb_max_size(sample.size(), nal_length_size);
+		annexb->assign(max_size + guard, 0xEE);
+		size_t size = mp4_avcc_to_annexb(sample.data(), sample.size(), nal_length_size, annexb->data());
+		for (size_t i = max_size; i < max_size + guard; i++)
+		{
+			if ((*annexb)[i] != 0xEE)
+				return SIZE_MAX;
+		}
+		annexb->resize(size);
+		return size;
+	}
+
+	// Length prefixes of every size become start codes within the worst case
+	// size, and malformed samples are refused without writing past it
+	static void test_mp4_avcc_to_annexb(test_state_t* state, void*)
+	{
+		const std::vector<std::vector<uint8_t>> units = { { 0x65, 1, 2, 3 }, { 0x06 }, { 0x41, 9 } };
+		std::vector<uint8_t> expected;
+		for (const std::vector<uint8_t>& unit : units)
+		{
+			expected.insert(expected.end(), { 0, 0, 0, 1 });
+			expected.insert(expected.end(), unit.begin(), unit.end());
+		}
+
+		std::vector<uint8_t> annexb;
+		for (uint32_t length_size : { 1u, 2u, 3u, 4u })
+		{
+			std::vector<uint8_t> sample = test_avcc(units, length_size);
+			TEST_CHECK(state, test_avcc_to_annexb(sample, length_size, &annexb) == expected.size());
+			TEST_CHECK(state, annexb == expected);
+		}
+
+		// With 4 byte lengths the output is the same size, so it runs in place
+		std::vector<uint8_t> in_place = test_avcc(units, 4);
+		TEST_CHECK(state, mp4_avcc_to_annexb(in_place.data(), in_place.size(), 4, in_place.data()) == expected.size());
+		TEST_CHECK(state, in_place == expected);
+
+		// One byte units behind one byte lengths are the worst case, and fill
+		// the bound exactly
+		std::vector<uint8_t> tiny = test_avcc(std::vector<std::vector<uint8_t>>(16, { 0x09 }), 1);
+		TEST_CHECK(state, test_avcc_to_annexb(tiny, 1, &annexb) == mp4_annexb_max_size(tiny.size(), 1));
+
+		// Zero lengths used to write a start code for each prefix, four bytes
+		// out for every one in
+		std::vector<uint8_t> zeros(20, 0);
+		TEST_CHECK(state, test_avcc_to_annexb(zeros, 1, &annexb) == 0);
+		TEST_CHECK(state, test_avcc_to_annexb(zeros, 2, &annexb) == 0);
+		std::vector<uint8_t> empty_unit = test_avcc({ { 0x65, 1 }, {}, { 0x41 } }, 4);
+		TEST_CHECK(state, test_avcc_to_annexb(empty_unit, 4, &annexb) == 0);
+
+		// A length prefix cut short, or a length past the end of the sample
+		std::vector<uint8_t> short_prefix = test_avcc(units, 4);
+		short_prefix.insert(short_prefix.end(), { 0, 0 });
+		TEST_CHECK(state, test_avcc_to_annexb(short_prefix, 4, &annexb) == 0);
+		std::vector<uint8_t> long_unit = test_avcc(units, 2);
+		long_unit.pop_back();
+		TEST_CHECK(state, test_avcc_to_annexb(long_unit, 2, &annexb) == 0);
+		std::vector<uint8_t> huge = { 0xFF, 0xFF, 0xFF, 0xFF, 0x65 };
+		TEST_CHECK(state, test_avcc_to_annexb(huge, 4, &annexb) == 0);
+
+		// Length sizes that avcC can't describe
+		std::vector<uint8_t> sample = test_avcc(units, 4);
+		annexb.assign(sample.size() * 4, 0);
+		TEST_CHECK(state, mp4_avcc_to_annexb(sample.data(), sample.size(), 0, annexb.data()) == 0);
+		TEST_CHECK(state, mp4_avcc_to_annexb(sample.data(), sample.size(), 5, annexb.data()) == 0);
+	}
+
+	static void test_mp4_rescale(test_state_t* state, void*)
+	{
+		TEST_CHECK(state, mp4_rescale(1001, 30000, 10000000) == 333666);
+		TEST_CHECK(state, mp4_rescale(3003, 90000, 1000) == 33);
+		TEST_CHECK(state, mp4_rescale(48000, 48000, 44100) == 44100);
+		// A century at 90 kHz in 100 ns units overflows a plain value * to / from
+		const int64_t century = 100LL * 365 * 24 * 3600;
+		TEST_CHECK(state, mp4_rescale(century * 90000 + 45000, 90000, 10000000) == century * 10000000 + 5000000);
+	}
+
+	///////////////////////////////////////////
+	// MP4 recording
+	///////////////////////////////////////////
+
+	static uint32_t test_load32(const uint8_t* p)
+	{
+		return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+	}
+
+	// A box in a file read back whole; offset is where its header starts
+	struct test_box_t {
+		uint32_t type;
+		size_t offset;
+		size_t size;
+	};
+
+	// The boxes between begin and end, which must tile that range exactly
+	static bool test_read_boxes(const std::vector<uint8_t>& file, size_t begin, size_t end, /**[out]**/ std::vector<test_box_t>* boxes)
+	{
+		boxes->clear();
+		while (begin < end)
+		{
+			if (end - begin < 8)
+				return false;
+			test_box_t box = { test_load32(&file[begin + 4]), begin, test_load32(&file[begin]) };
+			if (box.size < 8 || box.size > end - begin)
+				return false;
+			boxes->push_back(box);
+			begin += box.size;
+		}
+		return true;
+	}
+
+	// Walks down a path of box types from the top of the file; false if any
+	// step is missing
+	static bool test_find_box(const std::vector<uint8_t>& file, std::initializer_list<uint32_t> path, /**[out]**/ test_box_t* found)
+	{
+		size_t begin = 0, end = file.size();
+		for (uint32_t type : path)
+		{
+			std::vector<test_box_t> boxes;
+			if (!test_read_boxes(file, begin, end, &boxes))
+				return false;
+			size_t i = 0;
+			while (i < boxes.size() && boxes[i].type != type)
+				i++;
+			if (i == boxes.size())
+				return false;
+			*found = boxes[i];
+			begin = found->offset + 8;
+			end = found->offset + found->size;
+		}
+		return true;
+	}
+
+	static std::vector<uint8_t> test_read_file(const std::string& path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+
+	static std::string test_recording_path()
+	{
+		return (std::filesystem::temp_directory_path() / "skmf_tests_recording.mp4").string();
+	}
+
+	// Annex-B access unit out of NAL units, each behind a 4 byte start code
+	static std::vector<uint8_t> test_annexb(const std::vector<std::vector<uint8_t>>& units)
+	{
+		std::vector<uint8_t> result;
+		for (const std::vector<uint8_t>& unit : units)
+		{
+			result.insert(result.end(), { 0x00, 0x00, 0x00, 0x01 });
+			result.insert(result.end(), unit.begin(), unit.end());
+		}
+		return result;
+	}
+
+	// One fragment as the recorder lays it out: moof with one traf, then the
+	// mdat its trun points into
+	struct test_fragment_t {
+		uint32_t sequence;
+		uint64_t base_dts;
+		std::vector<uint32_t> duration;
+		std::vector<uint32_t> flags;
+		std::vector<int32_t> cts_offset;
+		std::vector<std::vector<uint8_t>> samples;
+	};
+
+	static bool test_read_fragment(test_state_t* state, const std::vector<uint8_t>& file, const test_box_t& moof, const test_box_t& mdat, /**[out]**/ test_fragment_t* fragment)
+	{
+		test_box_t box;
+		std::vector<test_box_t> children;
+		if (!TEST_CHECK(state, test_read_boxes(file, moof.offset + 8, moof.offset + moof.size, &children)) ||
+			!TEST_CHECK(state, children.size() == 2 && children[0].type == mp4_fourcc('m', 'f', 'h', 'd') && children[1].type == mp4_fourcc('t', 'r', 'a', 'f')))
+			return false;
+		fragment->sequence = test_load32(&file[children[0].offset + 12]);
+
+		box = children[1];
+		if (!TEST_CHECK(state, test_read_boxes(file, box.offset + 8, box.offset + box.size, &children)) ||
+			!TEST_CHECK(state, children.size() == 3 && children[0].type == mp4_fourcc('t', 'f', 'h', 'd') &&
+				children[1].type == mp4_fourcc('t', 'f', 'd', 't') && children[2].type == mp4_fourcc('t', 'r', 'u', 'n')))
+			return false;
+
+		// Offsets from the moof, track 1, and a 64 bit decode time
+		const uint8_t* tfhd = &file[children[0].offset];
+		TEST_CHECK(state, test_load32(tfhd + 8) == 0x020000 && test_load32(tfhd + 12) == 1);
+		const uint8_t* tfdt = &file[children[1].offset];
+		TEST_CHECK(state, tfdt[8] == 1);
+		fragment->base_dts = static_cast<uint64_t>(test_load32(tfdt + 12)) << 32 | test_load32(tfdt + 16);
+
+		// Version 1 for signed offsets; data offset, then duration, size, flags
+		// and composition offset for each sample
+		const uint8_t* trun = &file[children[2].offset];
+		uint32_t count = test_load32(trun + 12);
+		TEST_CHECK(state, test_load32(trun + 8) == 0x01000F01);
+		if (!TEST_CHECK(state, children[2].size == 20 + count * 16))
+			return false;
+		uint32_t data_offset = test_load32(trun + 16);
+		TEST_CHECK(state, data_offset == moof.size + 8 && mdat.offset == moof.offset + moof.size);
+
+		size_t data = moof.offset + data_offset;
+		fragment->duration.clear();
+		fragment->flags.clear();
+		fragment->cts_offset.clear();
+		fragment->samples.clear();
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const uint8_t* entry = trun + 20 + i * 16;
+			uint32_t size = test_load32(entry + 4);
+			if (!TEST_CHECK(state, data + size <= mdat.offset + mdat.size))
+				return false;
+			fragment->duration.push_back(test_load32(entry));
+			fragment->flags.push_back(test_load32(entry + 8));
+			fragment->cts_offset.push_back(static_cast<int32_t>(test_load32(entry + 12)));
+			fragment->samples.emplace_back(file.begin() + data, file.begin() + data + size);
+			data += size;
+		}
+		// The samples fill the mdat with nothing left over
+		return TEST_CHECK(state, data == mdat.offset + mdat.size);
+	}
+
+	// Reads every moof + mdat pair after the init segment
+	static bool test_read_fragments(test_state_t* state, const std::vector<uint8_t>& file, /**[out]**/ std::vector<test_fragment_t>* fragments)
+	{
+		std::vector<test_box_t> boxes;
+		if (!TEST_CHECK(state, test_read_boxes(file, 0, file.size(), &boxes)) ||
+			!TEST_CHECK(state, boxes.size() >= 2 && boxes[0].type == mp4_fourcc('f', 't', 'y', 'p') && boxes[1].type == mp4_fourcc('m', 'o', 'o', 'v')) ||
+			!TEST_CHECK(state, boxes.size() % 2 == 0))
+			return false;
+		fragments->clear();
+		for (size_t i = 2; i < boxes.size(); i += 2)
+		{
+			if (!TEST_CHECK(state, boxes[i].type == mp4_fourcc('m', 'o', 'o', 'f') && boxes[i + 1].type == mp4_fourcc('m', 'd', 'a', 't')))
+				return false;
+			fragments->emplace_back();
+			if (!test_read_fragment(state, file, boxes[i], boxes[i + 1], &fragments->back()))
+				return false;
+		}
+		return true;
+	}
+
+	// A keyframe with its parameter sets in front and what comes of it: the
+	// init segment takes the first SPS and PPS, repeats of them are dropped,
+	// changed ones stay in band, and each keyframe opens a fragment. Timing
+	// starts at 0 in the file, and the last sample lasts as long as the one
+	// before it.
+	static void test_mp4_recorder_layout(test_state_t* state, void*)
+	{
+		test_sps_params_t params = {};
+		params.profile_idc = 100;
+		params.level_idc = 31;
+		params.max_num_ref_frames = 1;
+		params.width_mbs = 80;
+		params.height_map_units = 45;
+		params.frame_mbs_only = true;
+		params.vui = true;
+		std::vector<uint8_t> sps = test_write_sps(params);
+		params.level_idc = 40;
+		std::vector<uint8_t> changed_sps = test_write_sps(params);
+		const std::vector<uint8_t> pps = { 0x68, 0xCE, 0x3C, 0x80 };
+		const std::vector<uint8_t> aud = { 0x09, 0xF0 };
+		const std::vector<uint8_t> filler = { 0x0C, 0xFF, 0xFF };
+
+		// Slices, then the units of each access unit and what its AVCC
+		// sample keeps of them
+		const std::vector<uint8_t> slices[] = {
+			{ 0x65, 0x88, 0x84, 0x21, 0xA0 }, { 0x41, 0x9A, 0x22 }, { 0x41, 0x9A, 0x44, 0x55 }, { 0x01, 0x9E, 0x66 },
+			{ 0x65, 0x88, 0x80 }, { 0x41, 0x9A, 0x77 }, { 0x65, 0x88, 0x99 }, { 0x41, 0x9A, 0x88 },
+		};
+		const std::vector<std::vector<uint8_t>> units[] = {
+			{ aud, sps, pps, slices[0] }, { slices[1], filler }, { aud, slices[2] }, { slices[3] },
+			{ sps, pps, slices[4] }, { slices[5] }, { changed_sps, pps, slices[6] }, { slices[7] },
+		};
+		const std::vector<std::vector<uint8_t>> kept[] = {
+			{ slices[0] }, { slices[1] }, { slices[2] }, { slices[3] },
+			{ slices[4] }, { slices[5] }, { changed_sps, pps, slices[6] }, { slices[7] },
+		};
+		const int64_t dts[] = { 0, 100, 200, 300, 400, 450, 600, 750 };
+		const uint32_t duration[] = { 100, 100, 100, 100, 50, 150, 150, 150 };
+		const size_t first_sample[] = { 0, 4, 6, 8 };
+
+		std::string path = test_recording_path();
+		mp4_recorder recorder;
+		if (!TEST_CHECK(state, recorder.open(path.c_str(), 1200)))
+			return;
+		// Nothing can be decoded before the first keyframe
+		std::vector<uint8_t> early = test_annexb({ slices[1] });
+		TEST_CHECK(state, recorder.write_sample(early.data(), early.size(), 900, 900));
+		for (uint32_t i = 0; i < 8; i++)
+		{
+			std::vector<uint8_t> sample = test_annexb(units[i]);
+			TEST_CHECK(state, recorder.write_sample(sample.data(), sample.size(), 1000 + dts[i] + 100 * (i % 3), 1000 + dts[i]));
+		}
+		TEST_CHECK(state, recorder.close());
+
+		mp4_recorder_stats_t stats = recorder.get_stats();
+		TEST_CHECK(state, stats.samples == 8 && stats.keyframes == 3 && stats.fragments == 3);
+		TEST_CHECK(state, stats.dropped == 1 && stats.parameter_changes == 1);
+
+		std::vector<uint8_t> file = test_read_file(path);
+		std::filesystem::remove(path);
+		TEST_CHECK(state, stats.writer.written == file.size());
+
+		// The init segment: one avc1 track, sized from the SPS, with every
+		// time in the file in the given timescale
+		const uint32_t moov = mp4_fourcc('m', 'o', 'o', 'v');
+		const uint32_t trak = mp4_fourcc('t', 'r', 'a', 'k');
+		const uint32_t mdia = mp4_fourcc('m', 'd', 'i', 'a');
+		const uint32_t stbl[] = { moov, trak, mdia, mp4_fourcc('m', 'i', 'n', 'f'), mp4_fourcc('s', 't', 'b', 'l') };
+		test_box_t box;
+		if (TEST_CHECK(state, test_find_box(file, { moov, mp4_fourcc('m', 'v', 'h', 'd') }, &box)))
+			TEST_CHECK(state, test_load32(&file[box.offset + 20]) == 1200);
+		if (TEST_CHECK(state, test_find_box(file, { moov, trak, mp4_fourcc('t', 'k', 'h', 'd') }, &box)))
+		{
+			TEST_CHECK(state, test_load32(&file[box.offset + 20]) == 1);
+			TEST_CHECK(state, test_load32(&file[box.offset + box.size - 8]) == 1280u << 16 && test_load32(&file[box.offset + box.size - 4]) == 720u << 16);
+		}
+		if (TEST_CHECK(state, test_find_box(file, { moov, trak, mdia, mp4_fourcc('m', 'd', 'h', 'd') }, &box)))
+			TEST_CHECK(state, test_load32(&file[box.offset + 20]) == 1200);
+		if (TEST_CHECK(state, test_find_box(file, { moov, trak, mdia, mp4_fourcc('h', 'd', 'l', 'r') }, &box)))
+			TEST_CHECK(state, test_load32(&file[box.offset + 16]) == mp4_fourcc('v', 'i', 'd', 'e'));
+		TEST_CHECK(state, test_find_box(file, { moov, mp4_fourcc('m', 'v', 'e', 'x'), mp4_fourcc('t', 'r', 'e', 'x') }, &box));
+
+		// The sample tables proper are empty, the fragments have the samples
+		if (TEST_CHECK(state, test_find_box(file, { stbl[0], stbl[1], stbl[2], stbl[3], stbl[4], mp4_fourcc('s', 't', 's', 'z') }, &box)))
+			TEST_CHECK(state, test_load32(&file[box.offset + 16]) == 0);
+		if (TEST_CHECK(state, test_find_box(file, { stbl[0], stbl[1], stbl[2], stbl[3], stbl[4], mp4_fourcc('s', 't', 's', 'd') }, &box)))
+		{
+			// stsd has one entry; avcC and pasp follow avc1's 78 bytes of fields
+			std::vector<test_box_t> entries;
+			size_t avc1 = box.offset + 16;
+			if (TEST_CHECK(state, test_load32(&file[box.offset + 12]) == 1 && test_load32(&file[avc1 + 4]) == mp4_fourcc('a', 'v', 'c', '1')) &&
+				TEST_CHECK(state, test_read_boxes(file, avc1 + 86, avc1 + test_load32(&file[avc1]), &entries)) &&
+				TEST_CHECK(state, entries.size() == 2 && entries[0].type == mp4_fourcc('a', 'v', 'c', 'C') && entries[1].type == mp4_fourcc('p', 'a', 's', 'p')))
+			{
+				// 4 byte lengths and the first SPS and PPS; High profile adds
+				// chroma format and bit depths after them
+				const uint8_t* avcc = &file[entries[0].offset + 8];
+				TEST_CHECK(state, avcc[1] == 100 && avcc[3] == 31 && avcc[4] == 0xFF && avcc[5] == 0xE1);
+				TEST_CHECK(state, entries[0].size == 8 + 6 + 2 + sps.size() + 3 + pps.size() + 4);
+				TEST_CHECK(state, std::vector<uint8_t>(avcc + 8, avcc + 8 + sps.size()) == sps);
+				TEST_CHECK(state, std::vector<uint8_t>(avcc + 11 + sps.size(), avcc + 11 + sps.size() + pps.size()) == pps);
+				const uint8_t* pasp = &file[entries[1].offset + 8];
+				TEST_CHECK(state, test_load32(pasp) == 4 && test_load32(pasp + 4) == 3);
+			}
+		}
+
+		std::vector<test_fragment_t> fragments;
+		if (!test_read_fragments(state, file, &fragments) || !TEST_CHECK(state, fragments.size() == 3))
+			return;
+		for (uint32_t f = 0; f < 3; f++)
+		{
+			const test_fragment_t& fragment = fragments[f];
+			size_t count = first_sample[f + 1] - first_sample[f];
+			TEST_CHECK(state, fragment.sequence == f + 1);
+			TEST_CHECK(state, fragment.base_dts == static_cast<uint64_t>(dts[first_sample[f]]));
+			if (!TEST_CHECK(state, fragment.samples.size() == count))
+				continue;
+			for (size_t k = 0; k < count; k++)
+			{
+				size_t i = first_sample[f] + k;
+				TEST_CHECK(state, fragment.duration[k] == duration[i]);
+				TEST_CHECK(state, fragment.flags[k] == (k == 0 ? 0x02000000u : 0x01010000u));
+				TEST_CHECK(state, fragment.cts_offset[k] == static_cast<int32_t>(100 * (i % 3)));
+				TEST_CHECK(state, fragment.samples[k] == test_avcc(kept[i], 4));
+			}
+		}
+	}
+
+	// A GOP that outgrows the fragment limit is split, and the fragments
+	// after the first start on a non-sync sample but carry on the timing
+	static void test_mp4_recorder_split(test_state_t* state, void*)
+	{
+		test_sps_params_t params = {};
+		params.profile_idc = 66;
+		params.level_idc = 30;
+		params.max_num_ref_frames = 1;
+		params.width_mbs = 40;
+		params.height_map_units = 30;
+		params.frame_mbs_only = true;
+		std::vector<uint8_t> sps = test_write_sps(params);
+		const std::vector<uint8_t> pps = { 0x68, 0xCE, 0x3C, 0x80 };
+
+		// Each 24 byte sample can take up to 34 bytes of AVCC, so two fit in 64
+		std::string path = test_recording_path();
+		mp4_recorder recorder;
+		if (!TEST_CHECK(state, recorder.open(path.c_str(), 90000, 64)))
+			return;
+		std::vector<std::vector<uint8_t>> slices;
+		for (uint32_t i = 0; i < 10; i++)
+		{
+			std::vector<uint8_t> slice(20, static_cast<uint8_t>(0x10 + i));
+			slice[0] = i == 0 ? 0x65 : 0x41;
+			slices.push_back(slice);
+			std::vector<uint8_t> sample = i == 0 ? test_annexb({ sps, pps, slice }) : test_annexb({ slice });
+			TEST_CHECK(state, recorder.write_sample(sample.data(), sample.size(), i * 3000, i * 3000));
+		}
+		TEST_CHECK(state, recorder.close());
+
+		mp4_recorder_stats_t stats = recorder.get_stats();
+		TEST_CHECK(state, stats.samples == 10 && stats.keyframes == 1 && stats.fragments == 5);
+		TEST_CHECK(state, stats.largest_fragment == 88 + 2 * 16 + 8 + 2 * 24);
+
+		std::vector<uint8_t> file = test_read_file(path);
+		std::filesystem::remove(path);
+		std::vector<test_fragment_t> fragments;
+		if (!test_read_fragments(state, file, &fragments) || !TEST_CHECK(state, fragments.size() == 5))
+			return;
+		for (uint32_t f = 0; f < 5; f++)
+		{
+			const test_fragment_t& fragment = fragments[f];
+			TEST_CHECK(state, fragment.sequence == f + 1 && fragment.base_dts == f * 6000);
+			if (!TEST_CHECK(state, fragment.samples.size() == 2))
+				continue;
+			for (uint32_t k = 0; k < 2; k++)
+			{
+				uint32_t i = f * 2 + k;
+				TEST_CHECK(state, fragment.duration[k] == 3000);
+				TEST_CHECK(state, fragment.flags[k] == (i == 0 ? 0x02000000u : 0x01010000u));
+				TEST_CHECK(state, fragment.samples[k] == test_avcc({ slices[i] }, 4));
+			}
+		}
+	}
+
+	void test_register_bitstream()
+	{
+		test_register("h264_nal/filter", test_h264_filter_nals);
+		test_register("h264_nal/split", test_h264_split_nals);
+		test_register("h264_sps/vui", test_h264_sps_vui);
+		test_register("h264_sps/dpb", test_h264_sps_dpb);
+		test_register("h264_sps/cropping", test_h264_sps_cropping);
+		test_register("h264_sps/parameter_sets", test_h264_parameter_sets);
+		test_register("mp4_demux/index/stsz", test_mp4_index, &test_mp4_variants[0]);
+		test_register("mp4_demux/index/stz2_4", test_mp4_index, &test_mp4_variants[1]);
+		test_register("mp4_demux/index/stz2_8", test_mp4_index, &test_mp4_variants[2]);
+		test_register("mp4_demux/index/stz2_16", test_mp4_index, &test_mp4_variants[3]);
+		test_register("mp4_demux/seek", test_mp4_seek);
+		test_register("mp4_demux/truncated", test_mp4_truncated);
+		test_register("mp4_demux/avcc_to_annexb", test_mp4_avcc_to_annexb);
+		test_register("mp4_demux/rescale", test_mp4_rescale);
+		test_register("mp4_recorder/layout", test_mp4_recorder_layout);
+		test_register("mp4_recorder/split", test_mp4_recorder_split);
+	}
+
+} // namespace nakamir
@@ -0,0 +1,1113 @@
+#include "tests.h"
+#include "../atlas_allocator.h"
+#include "../frame_pool.h"
+#include "../lod_selector.h"
+#include "../nv12_convert.h"
+#include "../nv12_scale.h"
+#include "../plane_copy.h"
+#include "../tile_diff.h"
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// Per-frame memory work checked against plain byte loops and the scalar
+// reference: every kernel, at awkward sizes and strides, must write exactly
+// the bytes it was asked to. Also how frame buffers are pooled, what size
+// a frame is scaled to for the screen and where tiles go in an atlas.
+
+namespace nakamir {
+
+	///////////////////////////////////////////
+	// Frame pool
+	///////////////////////////////////////////
+
+	// Every size maps to a class that holds it with under 25% slack, and
+	// classes are ordered, distinct and map back to themselves
+	static void test_frame_pool_size_classes(test_state_t* state, void*)
+	{
+		TEST_CHECK(state, frame_pool::size_class_of(0) == 0);
+		TEST_CHECK(state, frame_pool::size_class_of(4096) == 0);
+		TEST_CHECK(state, frame_pool::size_class_of(4097) == 1);
+		TEST_CHECK(state, frame_pool::size_class_capacity(1) == 5120);
+
+		uint32_t failures = 0;
+		uint32_t previous = 0;
+		for (size_t size = 1; size <= (size_t(1) << 26); size += 1 + size / 61)
+		{
+			uint32_t size_class = frame_pool::size_class_of(size);
+			size_t capacity = frame_pool::size_class_capacity(size_class);
+			bool ok = capacity >= size && size_class >= previous;
+			if (size > 4096)
+				ok = ok && capacity - size < size / 4 && frame_pool::size_class_capacity(size_class - 1) < size;
+			if (!ok && failures++ < 4)
+				TEST_CHECK(state, ok);
+			previous = size_class;
+		}
+		TEST_CHECK(state, failures == 0);
+
+		for (uint32_t size_class = 0; size_class < 80; size_class++)
+		{
+			size_t capacity = frame_pool::size_class_capacity(size_class);
+			TEST_CHECK(state, frame_pool::size_class_of(capacity) == size_class);
+			TEST_CHECK(state, frame_pool::size_class_of(capacity + 1) == size_class + 1);
+		}
+	}
+
+	// Blocks come back aligned as asked, and a pooled block is only reused
+	// for a request it is aligned enough for
+	static void test_frame_pool_alignment(test_state_t* state, void*)
+	{
+		frame_pool pool;
+		const size_t alignments[] = { 0, 1, 16, 64, 4096 };
+		for (size_t alignment : alignments)
+		{
+			frame_block_t* block = pool.acquire(10000, alignment);
+			TEST_CHECK(state, block->alignment >= alignof(std::max_align_t));
+			TEST_CHECK(state, block->alignment >= alignment);
+			TEST_CHECK(state, reinterpret_cast<uintptr_t>(block->data) % block->alignment == 0);
+			TEST_CHECK(state, block->capacity >= 10000);
+			pool.release(block);
+		}
+
+		// A pooled block that is aligned too little is passed over
+		frame_pool reuse_pool;
+		frame_block_t* low = reuse_pool.acquire(10000, 16);
+		reuse_pool.release(low);
+		frame_block_t* high = reuse_pool.acquire(10000, 256);
+		TEST_CHECK(state, high != low);
+		TEST_CHECK(state, reuse_pool.get_stats().misses == 2);
+		reuse_pool.release(high);
+		// while one aligned more than asked serves the request
+		frame_block_t* reused = reuse_pool.acquire(9000, 128);
+		TEST_CHECK(state, reused == high);
+		TEST_CHECK(state, reuse_pool.get_stats().hits == 1);
+		reuse_pool.release(reused);
+	}
+
+	// Hits, misses, the idle budget, reserve and trim all show in the stats,
+	// and a recycled sample is the same object, reset
+	static void test_frame_pool_recycle(test_state_t* state, void*)
+	{
+		const size_t capacity = frame_pool::size_class_capacity(frame_pool::size_class_of(20000));
+		frame_pool pool(3 * capacity);
+		pool.reserve(20000, 16, 2);
+		frame_pool_stats_t stats = pool.get_stats();
+		TEST_CHECK(state, stats.pooled_blocks == 2 && stats.misses == 0);
+
+		frame_block_t* blocks[5];
+		for (frame_block_t*& block : blocks)
+			block = pool.acquire(20000, 16);
+		stats = pool.get_stats();
+		TEST_CHECK(state, stats.hits == 2 && stats.misses == 3);
+		TEST_CHECK(state, stats.outstanding_blocks == 5 && stats.pooled_blocks == 0);
+		TEST_CHECK(state, stats.high_water_blocks == 5);
+
+		// Only three fit the budget, the rest are freed on release
+		for (frame_block_t* block : blocks)
+			pool.release(block);
+		stats = pool.get_stats();
+		TEST_CHECK(state, stats.releases == 5 && stats.evictions == 2);
+		TEST_CHECK(state, stats.pooled_blocks == 3 && stats.outstanding_blocks == 0);
+		TEST_CHECK(state, stats.pooled_bytes == 3 * capacity);
+		pool.trim();
+		stats = pool.get_stats();
+		TEST_CHECK(state, stats.pooled_blocks == 0 && stats.pooled_bytes == 0);
+
+		frame_pool_allocator allocator(&pool);
+		transform_stream_info_t info = { transform_stream_flags_none, 20000, 16 };
+		media_sample* sample = allocator.allocate(info);
+		sample->set_sample_time(42);
+		sample->get_buffer()->set_current_length(100);
+		bool threw = false;
+		try
+		{
+			sample->get_buffer()->set_current_length(sample->get_buffer()->get_max_length() + 1);
+		}
+		catch (const std::length_error&)
+		{
+			threw = true;
+		}
+		TEST_CHECK(state, threw);
+		media_sample* first = sample;
+		sample->release();
+		sample = allocator.allocate(info);
+		TEST_CHECK(state, sample == first);
+		TEST_CHECK(state, sample->get_sample_time() == 0 && sample->get_buffer()->get_current_length() == 0);
+		sample->release();
+		TEST_CHECK(state, pool.get_stats().outstanding_blocks == 0);
+	}
+
+	///////////////////////////////////////////
+	// Plane copy
+	///////////////////////////////////////////
+
+	static const plane_copy_impl_ test_plane_copy_impls[] = {
+		plane_copy_impl_scalar, plane_copy_impl_sse2, plane_copy_impl_avx2, plane_copy_impl_neon,
+	};
+
+	// Copies row_bytes x rows with the forced kernel and compares the whole
+	// destination, padding included, with what a row by row memcpy leaves
+	static bool test_plane_copy_case(test_state_t* state, int32_t row_bytes, int32_t rows, int32_t src_pad, int32_t dst_pad, bool bottom_up, bool nontemporal)
+	{
+		int32_t src_stride = row_bytes + src_pad;
+		int32_t dst_stride = row_bytes + dst_pad;
+		// One spare byte either side, to start rows off alignment
+		std::vector<uint8_t> src(static_cast<size_t>(src_stride) * rows + 1);
+		std::vector<uint8_t> dst(static_cast<size_t>(dst_stride) * rows + 1);
+		test_fill_random(src.data(), src.size(), row_bytes * 31 + rows);
+		memset(dst.data(), 0xCD, dst.size());
+		std::vector<uint8_t> expected = dst;
+
+		uint8_t* src_top = src.data() + 1;
+		uint8_t* dst_top = dst.data() + 1;
+		int32_t src_step = src_stride;
+		int32_t dst_step = dst_stride;
+		if (bottom_up)
+		{
+			src_top += static_cast<size_t>(src_stride) * (rows - 1);
+			src_step = -src_stride;
+		}
+		for (int32_t y = 0; y < rows; y++)
+			memcpy(expected.data() + 1 + static_cast<ptrdiff_t>(y) * dst_step, src_top + static_cast<ptrdiff_t>(y) * src_step, row_bytes);
+
+		plane_copy_set_nontemporal_threshold(nontemporal ? 1 : 0);
+		plane_copy(dst_top, dst_step, src_top, src_step, row_bytes, rows);
+		return TEST_CHECK(state, dst == expected);
+	}
+
+	static void test_plane_copy(test_state_t* state, void* context)
+	{
+		plane_copy_impl_ impl = *static_cast<const plane_copy_impl_*>(context);
+		plane_copy_impl_ previous = plane_copy_get_impl();
+		size_t threshold = plane_copy_get_nontemporal_threshold();
+		if (!plane_copy_set_impl(impl))
+		{
+			test_skip(state, "not supported on this CPU");
+			return;
+		}
+
+		// Around each vector width, plus a padded 1080p luma plane
+		const int32_t widths[] = { 1, 3, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 129, 255, 1921 };
+		for (int32_t width : widths)
+		{
+			for (int32_t pad : { 0, 5, 64 })
+			{
+				for (bool nontemporal : { false, true })
+				{
+					if (!test_plane_copy_case(state, width, 7, pad, 64 - pad, false, nontemporal) ||
+						!test_plane_copy_case(state, width, 7, pad, pad, true, nontemporal))
+						break;
+				}
+			}
+		}
+		test_plane_copy_case(state, 1920, 1080, 0, 128, false, true);
+		test_plane_copy_case(state, 1920, 1080, 128, 0, true, false);
+
+		// Nothing to copy writes nothing
+		uint8_t untouched[4] = { 1, 2, 3, 4 };
+		plane_copy(untouched, 4, untouched + 2, 4, 0, 1);
+		plane_copy(untouched, 4, untouched + 2, 4, 2, 0);
+		TEST_CHECK(state, untouched[0] == 1 && untouched[1] == 2);
+
+		plane_copy_set_nontemporal_threshold(threshold);
+		plane_copy_set_impl(previous);
+	}
+
+	static void test_nv12_copy(test_state_t* state, void*)
+	{
+		// Odd sizes round the chroma plane up, like D3D and MF
+		const int32_t sizes[][2] = { { 1, 1 }, { 3, 5 }, { 17, 9 }, { 640, 360 }, { 1279, 719 } };
+		for (const int32_t* size : sizes)
+		{
+			int32_t width = size[0];
+			int32_t height = size[1];
+			int32_t src_stride = nv12_packed_stride(width);
+			int32_t dst_stride = src_stride + 32;
+			int32_t chroma_rows = nv12_chroma_rows(height);
+			std::vector<uint8_t> src(nv12_packed_size(width, height));
+			test_fill_random(src.data(), src.size(), static_cast<uint64_t>(width) * height);
+			std::vector<uint8_t> dst(static_cast<size_t>(dst_stride) * (height + chroma_rows), 0xCD);
+			std::vector<uint8_t> expected = dst;
+
+			const uint8_t* src_uv = src.data() + static_cast<size_t>(src_stride) * height;
+			uint8_t* dst_uv = dst.data() + static_cast<size_t>(dst_stride) * height;
+			for (int32_t y = 0; y < height; y++)
+				memcpy(expected.data() + static_cast<size_t>(y) * dst_stride, src.data() + static_cast<size_t>(y) * src_stride, width);
+			for (int32_t y = 0; y < chroma_rows; y++)
+				memcpy(expected.data() + static_cast<size_t>(dst_stride) * (height + y), src_uv + static_cast<size_t>(y) * src_stride, nv12_chroma_row_bytes(width));
+
+			nv12_copy(dst.data(), dst_stride, dst_uv, dst_stride, src.data(), src_stride, src_uv, src_stride, width, height);
+			TEST_CHECK(state, dst == expected);
+		}
+	}
+
+	///////////////////////////////////////////
+	// NV12 to RGB
+	///////////////////////////////////////////
+
+	static const nv12_convert_impl_ test_nv12_convert_impls[] = {
+		nv12_convert_impl_sse41, nv12_convert_impl_avx2, nv12_convert_impl_neon,
+	};
+
+	static void test_nv12_to_rgb_convert(nv12_convert_impl_ impl, std::vector<uint8_t>* dst, int32_t dst_stride, const std::vector<uint8_t>& src, int32_t src_stride,
+		int32_t width, int32_t height, rgb_format_ format, color_matrix_ matrix, color_range_ range)
+	{
+		nv12_convert_set_impl(impl);
+		const uint8_t* src_uv = src.data() + static_cast<size_t>(src_stride) * height;
+		nv12_to_rgb(dst->data(), dst_stride, src.data(), src_stride, src_uv, src_stride, width, height, format, matrix, range);
+	}
+
+	// Every SIMD kernel must match the scalar reference byte for byte, tails
+	// and row padding included, for every matrix, range and byte order
+	static void test_nv12_to_rgb(test_state_t* state, void* context)
+	{
+		nv12_convert_impl_ impl = *static_cast<const nv12_convert_impl_*>(context);
+		nv12_convert_impl_ previous = nv12_convert_get_impl();
+		if (!nv12_convert_set_impl(impl))
+		{
+			test_skip(state, "not supported on this CPU");
+			return;
+		}
+
+		const int32_t sizes[][2] = { { 1, 1 }, { 2, 2 }, { 7, 3 }, { 15, 4 }, { 16, 2 }, { 33, 5 }, { 63, 7 }, { 64, 2 }, { 97, 3 }, { 1280, 4 } };
+		for (const int32_t* size : sizes)
+		{
+			int32_t width = size[0];
+			int32_t height = size[1];
+			int32_t src_stride = nv12_packed_stride(width) + 6;
+			int32_t dst_stride = width * 4 + 12;
+			std::vector<uint8_t> src(static_cast<size_t>(src_stride) * (height + nv12_chroma_rows(height)));
+			test_fill_random(src.data(), src.size(), static_cast<uint64_t>(width) * 7 + height);
+			for (rgb_format_ format : { rgb_format_rgba, rgb_format_bgra })
+			for (color_matrix_ matrix : { color_matrix_bt601, color_matrix_bt709 })
+			for (color_range_ range : { color_range_limited, color_range_full })
+			{
+				std::vector<uint8_t> expected(static_cast<size_t>(dst_stride) * height, 0xCD);
+				std::vector<uint8_t> actual = expected;
+				test_nv12_to_rgb_convert(nv12_convert_impl_scalar, &expected, dst_stride, src, src_stride, width, height, format, matrix, range);
+				test_nv12_to_rgb_convert(impl, &actual, dst_stride, src, src_stride, width, height, format, matrix, range);
+				TEST_CHECK(state, actual == expected);
+			}
+		}
+
+		// Limited range black and white land on the ends of full range
+		uint8_t yuv[2 * 2 + 2] = { 16, 235, 16, 235, 128, 128 };
+		uint8_t rgba[2 * 4 * 2] = {};
+		nv12_to_rgb(rgba, 8, yuv, 2, yuv + 4, 2, 2, 2);
+		TEST_CHECK(state, rgba[0] == 0 && rgba[1] == 0 && rgba[2] == 0 && rgba[3] == 255);
+		TEST_CHECK(state, rgba[4] == 255 && rgba[5] == 255 && rgba[6] == 255 && rgba[7] == 255);
+
+		nv12_convert_set_impl(previous);
+	}
+
+	///////////////////////////////////////////
+	// RGB to NV12
+	///////////////////////////////////////////
+
+	static uint8_t test_clamp_u8(int32_t value)
+	{
+		return static_cast<uint8_t>(value < 0 ? 0 : value > 255 ? 255 : value);
+	}
+
+	// The integer math documented on rgb_to_yuv_coeffs_t, written out for a
+	// whole image rather than a pair of rows
+	static void test_rgb_to_nv12_reference(std::vector<uint8_t>* dst, int32_t dst_stride, const std::vector<uint8_t>& src, int32_t src_stride,
+		int32_t width, int32_t height, rgb_format_ format, const rgb_to_yuv_coeffs_t* c)
+	{
+		int32_t r_index = format == rgb_format_bgra ? 2 : 0;
+		int32_t b_index = format == rgb_format_bgra ? 0 : 2;
+		uint8_t* dst_uv = dst->data() + static_cast<size_t>(dst_stride) * height;
+		for (int32_t y = 0; y < height; y++)
+		{
+			for (int32_t x = 0; x < width; x++)
+			{
+				const uint8_t* px = src.data() + static_cast<size_t>(y) * src_stride + x * 4;
+				(*dst)[static_cast<size_t>(y) * dst_stride + x] = test_clamp_u8((c->y_r * px[r_index] + c->y_g * px[1] + c->y_b * px[b_index] + c->y_bias) >> 15);
+			}
+		}
+		for (int32_t y = 0; y < height; y += 2)
+		{
+			for (int32_t x = 0; x < width; x += 2)
+			{
+				// The last column and row repeat into an odd sized final block
+				int32_t r = 0, g = 0, b = 0;
+				for (int32_t dy = 0; dy < 2; dy++)
+				{
+					for (int32_t dx = 0; dx < 2; dx++)
+					{
+						int32_t sx = x + dx < width ? x + dx : x;
+						int32_t sy = y + dy < height ? y + dy : y;
+						const uint8_t* px = src.data() + static_cast<size_t>(sy) * src_stride + sx * 4;
+						r += px[r_index];
+						g += px[1];
+						b += px[b_index];
+					}
+				}
+				r = (r + 2) >> 2;
+				g = (g + 2) >> 2;
+				b = (b + 2) >> 2;
+				uint8_t* uv = dst_uv + static_cast<size_t>(y / 2) * dst_stride + x;
+				uv[0] = test_clamp_u8((c->u_r * r + c->u_g * g + c->u_b * b + c->c_bias) >> 15);
+				uv[1] = test_clamp_u8((c->v_r * r + c->v_g * g + c->v_b * b + c->c_bias) >> 15);
+			}
+		}
+	}
+
+	static void test_rgb_to_nv12_convert(nv12_convert_impl_ impl, std::vector<uint8_t>* dst, int32_t dst_stride, const std::vector<uint8_t>& src, int32_t src_stride,
+		int32_t width, int32_t height, rgb_format_ format, color_matrix_ matrix, color_range_ range, int32_t max_threads)
+	{
+		nv12_convert_set_impl(impl);
+		uint8_t* dst_uv = dst->data() + static_cast<size_t>(dst_stride) * height;
+		rgb_to_nv12(dst->data(), dst_stride, dst_uv, dst_stride, src.data(), src_stride, width, height, format, matrix, range, max_threads);
+	}
+
+	// The scalar kernel follows the documented math, and every kernel matches
+	// it byte for byte, odd edges, row padding and banding over threads
+	// included, for every matrix, range and byte order
+	static void test_rgb_to_nv12(test_state_t* state, void* context)
+	{
+		nv12_convert_impl_ impl = *static_cast<const nv12_convert_impl_*>(context);
+		nv12_convert_impl_ previous = nv12_convert_get_impl();
+		if (!nv12_convert_set_impl(impl))
+		{
+			test_skip(state, "not supported on this CPU");
+			return;
+		}
+
+		const int32_t sizes[][2] = { { 1, 1 }, { 2, 2 }, { 3, 3 }, { 7, 5 }, { 15, 4 }, { 16, 2 }, { 33, 7 }, { 63, 3 }, { 64, 2 }, { 97, 9 }, { 1280, 67 } };
+		for (const int32_t* size : sizes)
+		{
+			int32_t width = size[0];
+			int32_t height = size[1];
+			int32_t src_stride = width * 4 + 12;
+			int32_t dst_stride = nv12_packed_stride(width) + 6;
+			std::vector<uint8_t> src(static_cast<size_t>(src_stride) * height);
+			test_fill_random(src.data(), src.size(), static_cast<uint64_t>(width) * 13 + height);
+			for (rgb_format_ format : { rgb_format_rgba, rgb_format_bgra })
+			for (color_matrix_ matrix : { color_matrix_bt601, color_matrix_bt709 })
+			for (color_range_ range : { color_range_limited, color_range_full })
+			{
+				std::vector<uint8_t> expected(static_cast<size_t>(dst_stride) * (height + nv12_chroma_rows(height)), 0xCD);
+				std::vector<uint8_t> actual = expected;
+				test_rgb_to_nv12_reference(&expected, dst_stride, src, src_stride, width, height, format, rgb_to_yuv_coeffs(matrix, range));
+				if (impl == nv12_convert_impl_scalar)
+				{
+					test_rgb_to_nv12_convert(impl, &actual, dst_stride, src, src_stride, width, height, format, matrix, range, 1);
+					TEST_CHECK(state, actual == expected);
+					continue;
+				}
+				// Banded over the worker threads, against the scalar kernel on one
+				test_rgb_to_nv12_convert(nv12_convert_impl_scalar, &expected, dst_stride, src, src_stride, width, height, format, matrix, range, 1);
+				test_rgb_to_nv12_convert(impl, &actual, dst_stride, src, src_stride, width, height, format, matrix, range, 0);
+				TEST_CHECK(state, actual == expected);
+			}
+		}
+
+		// Full range black and white land on the ends of limited range luma,
+		// with neutral chroma
+		nv12_convert_set_impl(impl);
+		uint8_t rgba[2 * 4 * 2] = { 0, 0, 0, 255, 255, 255, 255, 255, 0, 0, 0, 255, 255, 255, 255, 255 };
+		uint8_t yuv[2 * 2 + 2] = {};
+		rgb_to_nv12(yuv, 2, yuv + 4, 2, rgba, 8, 2, 2);
+		TEST_CHECK(state, yuv[0] == 16 && yuv[1] == 235 && yuv[2] == 16 && yuv[3] == 235);
+		TEST_CHECK(state, yuv[4] == 128 && yuv[5] == 128);
+
+		nv12_convert_set_impl(previous);
+	}
+
+	///////////////////////////////////////////
+	// Scaling
+	///////////////////////////////////////////
+
+	static const nv12_scale_impl_ test_nv12_scale_impls[] = {
+		nv12_scale_impl_scalar, nv12_scale_impl_sse2, nv12_scale_impl_neon,
+	};
+
+	// One plane of pixels (channels 1) or UV pairs (channels 2), packed
+	struct test_plane_t {
+		std::vector<uint8_t> data;
+		int32_t width;
+		int32_t height;
+		int32_t channels;
+
+		uint8_t at(int32_t x, int32_t y, int32_t c) const { return data[(static_cast<size_t>(y) * width + x) * channels + c]; }
+	};
+
+	static test_plane_t test_halve_reference(const test_plane_t& src)
+	{
+		test_plane_t dst = { {}, (src.width + 1) / 2, (src.height + 1) / 2, src.channels };
+		dst.data.resize(static_cast<size_t>(dst.width) * dst.height * dst.channels);
+		for (int32_t y = 0; y < dst.height; y++)
+		{
+			int32_t y0 = 2 * y;
+			int32_t y1 = y0 + 1 < src.height ? y0 + 1 : y0;
+			for (int32_t x = 0; x < dst.width; x++)
+			{
+				int32_t x0 = 2 * x;
+				int32_t x1 = x0 + 1 < src.width ? x0 + 1 : x0;
+				for (int32_t c = 0; c < src.channels; c++)
+					dst.data[(static_cast<size_t>(y) * dst.width + x) * dst.channels + c] =
+						static_cast<uint8_t>((src.at(x0, y0, c) + src.at(x1, y0, c) + src.at(x0, y1, c) + src.at(x1, y1, c) + 2) >> 2);
+			}
+		}
+		return dst;
+	}
+
+	// Center of output pixel i in the source, 16.16 fixed point, clamped to
+	// the first and last source pixel
+	static int64_t test_scale_position(int32_t i, int32_t dst_size, int32_t src_size)
+	{
+		int64_t position = ((2 * static_cast<int64_t>(i) + 1) * src_size * 65536) / (2 * static_cast<int64_t>(dst_size)) - 32768;
+		int64_t last = static_cast<int64_t>(src_size - 1) * 65536;
+		return position < 0 ? 0 : position > last ? last : position;
+	}
+
+	static uint8_t test_blend(int32_t a, int32_t b, int32_t fraction)
+	{
+		return static_cast<uint8_t>((a * (256 - fraction) + b * fraction + 128) >> 8);
+	}
+
+	// Vertical blend first, then horizontal, each rounded to a byte
+	static test_plane_t test_bilinear_reference(const test_plane_t& src, int32_t width, int32_t height)
+	{
+		test_plane_t dst = { {}, width, height, src.channels };
+		dst.data.resize(static_cast<size_t>(width) * height * dst.channels);
+		for (int32_t y = 0; y < height; y++)
+		{
+			int64_t py = test_scale_position(y, height, src.height);
+			int32_t y0 = static_cast<int32_t>(py >> 16);
+			int32_t y1 = y0 + 1 < src.height ? y0 + 1 : y0;
+			int32_t fy = static_cast<int32_t>((py >> 8) & 0xFF);
+			for (int32_t x = 0; x < width; x++)
+			{
+				int64_t px = test_scale_position(x, width, src.width);
+				int32_t x0 = static_cast<int32_t>(px >> 16);
+				int32_t x1 = x0 + 1 < src.width ? x0 + 1 : x0;
+				int32_t fx = static_cast<int32_t>((px >> 8) & 0xFF);
+				for (int32_t c = 0; c < src.channels; c++)
+				{
+					uint8_t left = test_blend(src.at(x0, y0, c), src.at(x0, y1, c), fy);
+					uint8_t right = test_blend(src.at(x1, y0, c), src.at(x1, y1, c), fy);
+					dst.data[(static_cast<size_t>(y) * width + x) * dst.channels + c] = test_blend(left, right, fx);
+				}
+			}
+		}
+		return dst;
+	}
+
+	// The documented filters step by step: for box, halvings while the luma
+	// plane is at least twice the target both ways, then bilinear unless that
+	// landed exactly on it
+	static void test_nv12_scale_reference(test_plane_t* y, test_plane_t* uv, int32_t width, int32_t height, nv12_scale_filter_ filter)
+	{
+		while (filter == nv12_scale_filter_box && y->width >= 2 * width && y->height >= 2 * height)
+		{
+			*y = test_halve_reference(*y);
+			*uv = test_halve_reference(*uv);
+		}
+		if (y->width != width || y->height != height)
+		{
+			*y = test_bilinear_reference(*y, width, height);
+			*uv = test_bilinear_reference(*uv, nv12_chroma_row_bytes(width) / 2, nv12_chroma_rows(height));
+		}
+	}
+
+	// Every kernel follows the documented math byte for byte, at odd sizes,
+	// odd ratios, upscales and with padded rows it must leave alone, and the
+	// row kernels match the scalar ones at every vector tail
+	static void test_nv12_scale(test_state_t* state, void* context)
+	{
+		nv12_scale_impl_ impl = *static_cast<const nv12_scale_impl_*>(context);
+		nv12_scale_impl_ previous = nv12_scale_get_impl();
+		if (!nv12_scale_set_impl(impl))
+		{
+			test_skip(state, "not supported on this CPU");
+			return;
+		}
+
+		nv12_halve_row_fn halve_row = nv12_halve_row_scalar;
+		nv12_blend_row_fn blend_row = nv12_blend_row_scalar;
+		if (impl == nv12_scale_impl_sse2) { halve_row = nv12_halve_row_sse2; blend_row = nv12_blend_row_sse2; }
+		if (impl == nv12_scale_impl_neon) { halve_row = nv12_halve_row_neon; blend_row = nv12_blend_row_neon; }
+		for (int32_t channels = 1; channels <= 2; channels++)
+		{
+			for (int32_t width = 1; width <= 80; width++)
+			{
+				std::vector<uint8_t> src(static_cast<size_t>(width) * channels * 2);
+				test_fill_random(src.data(), src.size(), static_cast<uint64_t>(width) * 3 + channels);
+				const uint8_t* row0 = src.data();
+				const uint8_t* row1 = src.data() + static_cast<size_t>(width) * channels;
+				std::vector<uint8_t> expected(static_cast<size_t>(width) * channels + 1, 0xCD);
+				std::vector<uint8_t> actual = expected;
+				nv12_halve_row_scalar(expected.data(), row0, row1, width, channels);
+				halve_row(actual.data(), row0, row1, width, channels);
+				TEST_CHECK(state, actual == expected);
+				for (int32_t fraction : { 0, 1, 128, 255 })
+				{
+					nv12_blend_row_scalar(expected.data(), row0, row1, width * channels, fraction);
+					blend_row(actual.data(), row0, row1, width * channels, fraction);
+					TEST_CHECK(state, actual == expected);
+				}
+			}
+		}
+
+		// Source width and height, then target
+		const int32_t sizes[][4] = {
+			{ 1, 1, 1, 1 }, { 7, 5, 7, 5 }, { 8, 8, 4, 4 }, { 9, 7, 4, 3 }, { 5, 5, 2, 2 }, { 2, 2, 1, 1 },
+			{ 33, 17, 3, 2 }, { 64, 48, 16, 12 }, { 97, 41, 30, 11 }, { 5, 3, 17, 9 }, { 640, 360, 240, 136 },
+		};
+		for (const int32_t* size : sizes)
+		{
+			int32_t src_width = size[0];
+			int32_t src_height = size[1];
+			int32_t dst_width = size[2];
+			int32_t dst_height = size[3];
+			test_plane_t src_y = { {}, src_width, src_height, 1 };
+			test_plane_t src_uv = { {}, nv12_chroma_row_bytes(src_width) / 2, nv12_chroma_rows(src_height), 2 };
+			src_y.data.resize(static_cast<size_t>(src_y.width) * src_y.height);
+			src_uv.data.resize(static_cast<size_t>(src_uv.width) * src_uv.height * 2);
+			test_fill_random(src_y.data.data(), src_y.data.size(), static_cast<uint64_t>(src_width) * 7 + dst_width);
+			test_fill_random(src_uv.data.data(), src_uv.data.size(), static_cast<uint64_t>(src_height) * 5 + dst_height);
+
+			// Both planes laid out with padding at the end of each row
+			int32_t src_y_stride = src_width + 5;
+			int32_t src_uv_stride = src_uv.width * 2 + 3;
+			std::vector<uint8_t> src_y_rows(static_cast<size_t>(src_y_stride) * src_height, 0xEE);
+			std::vector<uint8_t> src_uv_rows(static_cast<size_t>(src_uv_stride) * src_uv.height, 0xEE);
+			for (int32_t y = 0; y < src_y.height; y++)
+				memcpy(src_y_rows.data() + static_cast<size_t>(y) * src_y_stride, &src_y.data[static_cast<size_t>(y) * src_y.width], src_y.width);
+			for (int32_t y = 0; y < src_uv.height; y++)
+				memcpy(src_uv_rows.data() + static_cast<size_t>(y) * src_uv_stride, &src_uv.data[static_cast<size_t>(y) * src_uv.width * 2], src_uv.width * 2);
+
+			int32_t dst_y_stride = dst_width + 6;
+			int32_t dst_uv_stride = nv12_chroma_row_bytes(dst_width) + 4;
+			for (nv12_scale_filter_ filter : { nv12_scale_filter_box, nv12_scale_filter_bilinear })
+			{
+				test_plane_t y = src_y;
+				test_plane_t uv = src_uv;
+				test_nv12_scale_reference(&y, &uv, dst_width, dst_height, filter);
+				std::vector<uint8_t> expected_y(static_cast<size_t>(dst_y_stride) * dst_height, 0xCD);
+				std::vector<uint8_t> expected_uv(static_cast<size_t>(dst_uv_stride) * nv12_chroma_rows(dst_height), 0xCD);
+				for (int32_t row = 0; row < y.height; row++)
+					memcpy(expected_y.data() + static_cast<size_t>(row) * dst_y_stride, &y.data[static_cast<size_t>(row) * y.width], y.width);
+				for (int32_t row = 0; row < uv.height; row++)
+					memcpy(expected_uv.data() + static_cast<size_t>(row) * dst_uv_stride, &uv.data[static_cast<size_t>(row) * uv.width * 2], uv.width * 2);
+
+				// Banded over the worker threads as well as on one
+				for (int32_t max_threads : { 1, 0 })
+				{
+					std::vector<uint8_t> actual_y(expected_y.size(), 0xCD);
+					std::vector<uint8_t> actual_uv(expected_uv.size(), 0xCD);
+					nv12_scale(actual_y.data(), dst_y_stride, actual_uv.data(), dst_uv_stride, dst_width, dst_height,
+						src_y_rows.data(), src_y_stride, src_uv_rows.data(), src_uv_stride, src_width, src_height, filter, max_threads);
+					TEST_CHECK(state, actual_y == expected_y);
+					TEST_CHECK(state, actual_uv == expected_uv);
+				}
+			}
+		}
+
+		// A 2x2 block averages with rounding, and bilinear at exactly half
+		// size weighs both neighbours evenly
+		const uint8_t y4[4] = { 0, 1, 2, 3 };
+		const uint8_t uv2[2] = { 10, 20 };
+		uint8_t y1 = 0;
+		uint8_t uv1[2] = {};
+		nv12_scale(&y1, 1, uv1, 2, 1, 1, y4, 2, uv2, 2, 2, 2, nv12_scale_filter_box, 1);
+		TEST_CHECK(state, y1 == 2 && uv1[0] == 10 && uv1[1] == 20);
+		nv12_scale(&y1, 1, uv1, 2, 1, 1, y4, 2, uv2, 2, 2, 2, nv12_scale_filter_bilinear, 1);
+		TEST_CHECK(state, y1 == 2);
+
+		nv12_scale_set_impl(previous);
+	}
+
+	// The ladder: the source first, then even sizes a factor of sqrt(2) apart
+	// down to min_width. Sharper is taken at once, softer only after
+	// settle_frames updates in a row that want it, and panels that aren't on
+	// screen change nothing.
+	static void test_lod_selector(test_state_t* state, void*)
+	{
+		lod_selector lod(1920, 1080, 128, 0.15f, 3);
+		lod_selector_stats_t stats = lod.get_stats();
+		TEST_CHECK(state, stats.levels == 8);
+		TEST_CHECK(state, stats.level == 0 && lod.width() == 1920 && lod.height() == 1080);
+		TEST_CHECK(state, stats.changes == 0);
+
+		// 1150 covers 1358 comfortably but not 960
+		TEST_CHECK(state, !lod.update(1000));
+		TEST_CHECK(state, !lod.update(1000));
+		TEST_CHECK(state, lod.update(1000));
+		TEST_CHECK(state, lod.width() == 1358 && lod.height() == 764);
+		TEST_CHECK(state, lod.get_stats().level == 1);
+
+		// Inside the margin nothing moves; past it the level steps up at once
+		TEST_CHECK(state, !lod.update(1500));
+		TEST_CHECK(state, lod.update(1600));
+		TEST_CHECK(state, lod.width() == 1920 && lod.get_stats().level == 0);
+
+		// One update that doesn't want softer starts the count again
+		TEST_CHECK(state, !lod.update(1000));
+		TEST_CHECK(state, !lod.update(1000));
+		TEST_CHECK(state, !lod.update(1800));
+		TEST_CHECK(state, !lod.update(1000));
+		TEST_CHECK(state, !lod.update(1000));
+		TEST_CHECK(state, lod.update(1000));
+		TEST_CHECK(state, lod.get_stats().level == 1);
+
+		// Softening goes as deep as it needs in one change, and off-screen
+		// widths are ignored
+		TEST_CHECK(state, !lod.update(100));
+		TEST_CHECK(state, !lod.update(0));
+		TEST_CHECK(state, !lod.update(-5));
+		TEST_CHECK(state, !lod.update(100));
+		TEST_CHECK(state, lod.update(100));
+		TEST_CHECK(state, lod.width() == 170 && lod.height() == 96);
+		TEST_CHECK(state, lod.get_stats().level == 7);
+		TEST_CHECK(state, !lod.update(0));
+		TEST_CHECK(state, lod.get_stats().level == 7);
+
+		// Sharpening picks the smallest level that covers the panel
+		TEST_CHECK(state, lod.update(500));
+		TEST_CHECK(state, lod.width() == 678 && lod.height() == 382);
+
+		stats = lod.get_stats();
+		TEST_CHECK(state, stats.level == 3 && stats.width == 678 && stats.height == 382);
+		TEST_CHECK(state, stats.updates == 18);
+		TEST_CHECK(state, stats.changes == 5);
+
+		// Every step is even and about sqrt(2) from the last
+		lod_selector ladder(3840, 2160, 64, 0.15f, 1);
+		int32_t previous = ladder.width();
+		for (uint32_t level = 1; level < ladder.get_stats().levels; level++)
+		{
+			// One update well below the next level takes exactly one step
+			ladder.update(static_cast<float>(previous) * 0.6f);
+			int32_t width = ladder.width();
+			TEST_CHECK(state, ladder.get_stats().level == level);
+			TEST_CHECK(state, width % 2 == 0 && ladder.height() % 2 == 0);
+			TEST_CHECK(state, width >= 64 && width * 141 / 100 <= previous + 2 && width * 142 / 100 >= previous - 2);
+			previous = width;
+		}
+		TEST_CHECK(state, previous * 0.7071f < 64);
+	}
+
+	///////////////////////////////////////////
+	// Texture atlas
+	///////////////////////////////////////////
+
+	const uint32_t test_atlas_size = 512;
+	const uint32_t test_atlas_alignment = 2;
+	const uint32_t test_atlas_padding = 2;
+
+	struct test_atlas_tile_t {
+		int32_t id;
+		uint32_t width;
+		uint32_t height;
+	};
+
+	// Every live tile keeps its size, sits aligned inside the atlas with its
+	// padding, and overlaps no other tile's padded rect
+	static bool test_atlas_layout(test_state_t* state, const atlas_allocator& allocator, const std::vector<test_atlas_tile_t>& tiles)
+	{
+		std::vector<atlas_rect_t> rects;
+		for (const test_atlas_tile_t& tile : tiles)
+		{
+			atlas_rect_t rect;
+			if (!TEST_CHECK(state, allocator.get_rect(tile.id, &rect)) ||
+				!TEST_CHECK(state, rect.width == tile.width && rect.height == tile.height) ||
+				!TEST_CHECK(state, rect.x % test_atlas_alignment == 0 && rect.y % test_atlas_alignment == 0) ||
+				!TEST_CHECK(state, rect.x + rect.width + test_atlas_padding <= test_atlas_size && rect.y + rect.height + test_atlas_padding <= test_atlas_size))
+				return false;
+			rects.push_back(rect);
+		}
+		for (size_t i = 0; i < rects.size(); i++)
+		{
+			for (size_t j = i + 1; j < rects.size(); j++)
+			{
+				const atlas_rect_t& a = rects[i];
+				const atlas_rect_t& b = rects[j];
+				bool apart = a.x + a.width + test_atlas_padding <= b.x || b.x + b.width + test_atlas_padding <= a.x ||
+					a.y + a.height + test_atlas_padding <= b.y || b.y + b.height + test_atlas_padding <= a.y;
+				if (!apart)
+					return TEST_CHECK(state, apart);
+			}
+		}
+		atlas_allocator_stats_t stats = allocator.get_stats();
+		return TEST_CHECK(state, stats.allocations == tiles.size()) &&
+			TEST_CHECK(state, stats.used_area + stats.free_area == static_cast<uint64_t>(test_atlas_size) * test_atlas_size);
+	}
+
+	// Random churn with evictions and repacks never breaks the layout, and
+	// releasing everything hands the whole area back
+	static void test_atlas_churn(test_state_t* state, void*)
+	{
+		atlas_allocator allocator(test_atlas_size, test_atlas_size, test_atlas_alignment, test_atlas_padding);
+		std::vector<test_atlas_tile_t> tiles;
+		uint32_t seed = 7;
+		auto next = [&seed]() { seed = seed * 1664525 + 1013904223; return seed >> 8; };
+		for (uint64_t frame = 1; frame <= 3000; frame++)
+		{
+			uint32_t op = next() % 16;
+			if (op < 9)
+			{
+				test_atlas_tile_t tile = { -1, 1 + next() % 120, 1 + next() % 90 };
+				tile.id = allocator.allocate(tile.width, tile.height);
+				if (tile.id < 0 && allocator.defragment())
+					tile.id = allocator.allocate(tile.width, tile.height);
+				if (tile.id >= 0)
+				{
+					allocator.touch(tile.id, frame);
+					tiles.push_back(tile);
+				}
+			}
+			else if (op < 14 && !tiles.empty())
+			{
+				size_t victim = next() % tiles.size();
+				allocator.release(tiles[victim].id);
+				tiles.erase(tiles.begin() + victim);
+			}
+			else if (op == 14)
+			{
+				std::vector<int32_t> evicted;
+				allocator.evict(frame > 200 ? frame - 200 : 0, &evicted);
+				for (int32_t id : evicted)
+				{
+					for (size_t i = 0; i < tiles.size(); i++)
+					{
+						if (tiles[i].id == id)
+						{
+							tiles.erase(tiles.begin() + i);
+							break;
+						}
+					}
+				}
+			}
+			else
+			{
+				// Rects reported moved are where get_rect now says they are
+				std::vector<atlas_move_t> moves;
+				if (TEST_CHECK(state, allocator.defragment(&moves)))
+				{
+					for (const atlas_move_t& move : moves)
+					{
+						atlas_rect_t rect;
+						allocator.get_rect(move.id, &rect);
+						TEST_CHECK(state, rect.x == move.to.x && rect.y == move.to.y);
+					}
+				}
+			}
+			if (!test_atlas_layout(state, allocator, tiles))
+				return;
+		}
+		TEST_CHECK(state, allocator.get_stats().allocated > 500);
+
+		for (const test_atlas_tile_t& tile : tiles)
+			allocator.release(tile.id);
+		atlas_allocator_stats_t stats = allocator.get_stats();
+		TEST_CHECK(state, stats.allocations == 0);
+		TEST_CHECK(state, stats.shelves == 0);
+		TEST_CHECK(state, stats.free_top_area == static_cast<uint64_t>(test_atlas_size) * test_atlas_size);
+	}
+
+	// Only tiles untouched since the cutoff go, and their ids are reported
+	static void test_atlas_evict(test_state_t* state, void*)
+	{
+		atlas_allocator allocator(test_atlas_size, test_atlas_size, test_atlas_alignment, test_atlas_padding);
+		int32_t a = allocator.allocate(100, 100);
+		int32_t b = allocator.allocate(100, 100);
+		int32_t c = allocator.allocate(100, 100);
+		allocator.touch(a, 10);
+		allocator.touch(b, 3);
+		allocator.touch(c, 5);
+
+		std::vector<int32_t> evicted;
+		TEST_CHECK(state, allocator.evict(5, &evicted) == 1);
+		TEST_CHECK(state, evicted == std::vector<int32_t>{ b });
+		atlas_rect_t rect;
+		TEST_CHECK(state, !allocator.get_rect(b, &rect));
+		TEST_CHECK(state, allocator.get_rect(a, &rect) && allocator.get_rect(c, &rect));
+		// New allocations start at the latest touch, so they aren't evicted at once
+		int32_t d = allocator.allocate(100, 100);
+		TEST_CHECK(state, allocator.evict(10) == 1);
+		TEST_CHECK(state, allocator.get_rect(d, &rect) && !allocator.get_rect(c, &rect));
+		TEST_CHECK(state, allocator.get_stats().evicted == 2);
+	}
+
+	// Space stranded between long-lived tiles is only usable after a repack,
+	// which keeps ids
+	static void test_atlas_defragment(test_state_t* state, void*)
+	{
+		atlas_allocator allocator(test_atlas_size, test_atlas_size, test_atlas_alignment, test_atlas_padding);
+		std::vector<test_atlas_tile_t> tiles;
+		for (uint32_t i = 0; i < 16; i++)
+		{
+			// Four full shelves of four, padded to 128 square
+			test_atlas_tile_t tile = { -1, 126, 126 };
+			tile.id = allocator.allocate(tile.width, tile.height);
+			if (!TEST_CHECK(state, tile.id >= 0))
+				return;
+			tiles.push_back(tile);
+		}
+		// Every other tile goes, leaving holes no 200 wide tile fits in
+		for (size_t i = tiles.size(); i-- > 0;)
+		{
+			if (i % 2)
+			{
+				allocator.release(tiles[i].id);
+				tiles.erase(tiles.begin() + i);
+			}
+		}
+		TEST_CHECK(state, allocator.allocate(200, 120) < 0);
+
+		std::vector<atlas_move_t> moves;
+		TEST_CHECK(state, allocator.defragment(&moves));
+		TEST_CHECK(state, !moves.empty());
+		if (!test_atlas_layout(state, allocator, tiles))
+			return;
+		test_atlas_tile_t wide = { allocator.allocate(200, 120), 200, 120 };
+		if (TEST_CHECK(state, wide.id >= 0))
+			tiles.push_back(wide);
+		test_atlas_layout(state, allocator, tiles);
+	}
+
+	///////////////////////////////////////////
+	// Tile diff
+	///////////////////////////////////////////
+
+	static const tile_diff_impl_ test_tile_diff_impls[] = {
+		tile_diff_impl_scalar, tile_diff_impl_sse2, tile_diff_impl_avx2, tile_diff_impl_neon,
+	};
+
+	static tile_diff_block_fn test_tile_diff_kernel(tile_diff_impl_ impl)
+	{
+		switch (impl)
+		{
+		case tile_diff_impl_sse2: return tile_diff_block_sse2;
+		case tile_diff_impl_avx2: return tile_diff_block_avx2;
+		case tile_diff_impl_neon: return tile_diff_block_neon;
+		default:                  return tile_diff_block_scalar;
+		}
+	}
+
+	// Applies dirty rects from a frame onto what a texture last received
+	static void test_tile_diff_upload(const std::vector<tile_diff_rect_t>& dirty, const uint8_t* y, const uint8_t* uv, int32_t stride, std::vector<uint8_t>* texture, int32_t height)
+	{
+		uint8_t* tex_y = texture->data();
+		uint8_t* tex_uv = tex_y + static_cast<size_t>(stride) * height;
+		for (const tile_diff_rect_t& rect : dirty)
+		{
+			for (uint32_t row = rect.y; row < rect.y + rect.height; row++)
+				memcpy(tex_y + static_cast<size_t>(row) * stride + rect.x, y + static_cast<size_t>(row) * stride + rect.x, rect.width);
+			for (uint32_t row = rect.chroma_y; row < rect.chroma_y + rect.chroma_height; row++)
+				memcpy(tex_uv + static_cast<size_t>(row) * stride + rect.chroma_x * 2, uv + static_cast<size_t>(row) * stride + rect.chroma_x * 2, rect.chroma_width * 2);
+		}
+	}
+
+	// Whether two packed NV12 frames show the same image, padding aside
+	static bool test_nv12_equal(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b, int32_t width, int32_t height)
+	{
+		int32_t stride = nv12_packed_stride(width);
+		for (int32_t row = 0; row < height; row++)
+		{
+			if (memcmp(a.data() + static_cast<size_t>(row) * stride, b.data() + static_cast<size_t>(row) * stride, width) != 0)
+				return false;
+		}
+		size_t chroma = static_cast<size_t>(stride) * height;
+		return memcmp(a.data() + chroma, b.data() + chroma, a.size() - chroma) == 0;
+	}
+
+	// Each kernel's sum matches the scalar one wherever it is exact, i.e. at
+	// or under the limit, and is over the limit whenever the scalar one is
+	static void test_tile_diff_block(test_state_t* state, void* context)
+	{
+		tile_diff_impl_ impl = *static_cast<const tile_diff_impl_*>(context);
+		tile_diff_impl_ previous = tile_diff_get_impl();
+		if (!tile_diff_set_impl(impl))
+		{
+			test_skip(state, "not supported on this CPU");
+			return;
+		}
+		tile_diff_set_impl(previous);
+		tile_diff_block_fn sad = test_tile_diff_kernel(impl);
+
+		const int32_t stride = 80;
+		std::vector<uint8_t> a(static_cast<size_t>(stride) * tile_diff_size + 1);
+		std::vector<uint8_t> b(a.size());
+		for (uint32_t bytes : { 1u, 2u, 15u, 16u, 17u, 31u, 32u, 33u, 48u, 63u, 64u })
+		{
+			for (uint32_t rows : { 1u, 2u, 31u, 64u })
+			{
+				test_fill_random(a.data(), a.size(), bytes * 100 + rows);
+				b = a;
+				// Sparse, small changes, like sensor noise, plus a few big ones
+				std::vector<uint8_t> noise(b.size());
+				test_fill_random(noise.data(), noise.size(), bytes + rows * 100);
+				for (size_t i = 0; i < b.size(); i++)
+				{
+					if (noise[i] < 24)
+						b[i] = static_cast<uint8_t>(b[i] + (noise[i] & 7) - 3);
+					else if (noise[i] == 255)
+						b[i] = static_cast<uint8_t>(~b[i]);
+				}
+				// Off alignment by a byte, as tiles of odd width frames are
+				uint32_t exact = tile_diff_block_scalar(a.data() + 1, stride, b.data() + 1, stride, bytes, rows, UINT32_MAX);
+				TEST_CHECK(state, sad(a.data() + 1, stride, b.data() + 1, stride, bytes, rows, UINT32_MAX) == exact);
+				for (uint32_t limit : { 0u, exact / 2, exact, exact + 1 })
+				{
+					uint32_t sum = sad(a.data() + 1, stride, b.data() + 1, stride, bytes, rows, limit);
+					TEST_CHECK(state, exact <= limit ? sum == exact : sum > limit);
+				}
+			}
+		}
+	}
+
+	// A differ fed a sequence of edited frames hands out rects that, copied
+	// onto a texture holding the previous upload, reproduce every frame; and
+	// an edit dirties just the tile it falls in
+	static void test_tile_differ(test_state_t* state, void* context)
+	{
+		tile_diff_impl_ impl = *static_cast<const tile_diff_impl_*>(context);
+		tile_diff_impl_ previous = tile_diff_get_impl();
+		if (!tile_diff_set_impl(impl))
+		{
+			test_skip(state, "not supported on this CPU");
+			return;
+		}
+
+		// Odd sizes leave partial tiles and an odd chroma row at the edges
+		const int32_t width = 201;
+		const int32_t height = 131;
+		const int32_t stride = nv12_packed_stride(width);
+		std::vector<uint8_t> frame(nv12_packed_size(width, height));
+		test_fill_random(frame.data(), frame.size(), 17);
+		uint8_t* y = frame.data();
+		uint8_t* uv = y + static_cast<size_t>(stride) * height;
+		std::vector<uint8_t> texture(frame.size(), 0);
+		std::vector<tile_diff_rect_t> dirty;
+
+		tile_differ differ(width, height);
+		TEST_CHECK(state, differ.diff(y, stride, uv, stride, &dirty));
+		// Changed everywhere comes back as one rect
+		if (TEST_CHECK(state, dirty.size() == 1))
+		{
+			const tile_diff_rect_t& rect = dirty[0];
+			TEST_CHECK(state, rect.x == 0 && rect.y == 0 && rect.width == width && rect.height == height);
+			TEST_CHECK(state, rect.chroma_x == 0 && rect.chroma_y == 0 && rect.chroma_width == (width + 1) / 2 && rect.chroma_height == (height + 1) / 2);
+		}
+		test_tile_diff_upload(dirty, y, uv, stride, &texture, height);
+		TEST_CHECK(state, test_nv12_equal(texture, frame, width, height));
+
+		TEST_CHECK(state, !differ.diff(y, stride, uv, stride, &dirty));
+		TEST_CHECK(state, dirty.empty());
+
+		// One luma texel in the middle tile
+		y[70 * stride + 100]++;
+		TEST_CHECK(state, differ.diff(y, stride, uv, stride, &dirty));
+		if (TEST_CHECK(state, dirty.size() == 1))
+		{
+			const tile_diff_rect_t& rect = dirty[0];
+			TEST_CHECK(state, rect.x == 64 && rect.y == 64 && rect.width == 64 && rect.height == 64);
+			TEST_CHECK(state, rect.chroma_x == 32 && rect.chroma_y == 32 && rect.chroma_width == 32 && rect.chroma_height == 32);
+		}
+
+		// The last UV pair of the odd chroma row, in the clipped corner tile
+		uv[(height / 2) * stride + stride - 1]++;
+		TEST_CHECK(state, differ.diff(y, stride, uv, stride, &dirty));
+		if (TEST_CHECK(state, dirty.size() == 1))
+		{
+			const tile_diff_rect_t& rect = dirty[0];
+			TEST_CHECK(state, rect.x == 192 && rect.y == 128 && rect.width == 9 && rect.height == 3);
+			TEST_CHECK(state, rect.chroma_x == 96 && rect.chroma_y == 64 && rect.chroma_width == 5 && rect.chroma_height == 2);
+		}
+
+		// Neighbours in a row merge
+		y[10 * stride + 10]++;
+		y[10 * stride + 70]++;
+		TEST_CHECK(state, differ.diff(y, stride, uv, stride, &dirty));
+		if (TEST_CHECK(state, dirty.size() == 1))
+			TEST_CHECK(state, dirty[0].x == 0 && dirty[0].width == 128 && dirty[0].height == 64);
+
+		// Random edits, read bottom-up through a negative stride half the time
+		texture = frame;
+		std::vector<uint8_t> edits(64);
+		for (uint32_t i = 0; i < 40; i++)
+		{
+			test_fill_random(edits.data(), edits.size(), 1000 + i);
+			for (uint32_t e = 0; e + 4 <= edits.size(); e += 4)
+			{
+				if (edits[e] < 160)
+					continue;
+				size_t at = (static_cast<size_t>(edits[e + 1]) << 8 | edits[e + 2]) * 7 % frame.size();
+				frame[at] = static_cast<uint8_t>(frame[at] + 1 + edits[e + 3] % 200);
+			}
+			bool changed = false;
+			if (i & 1)
+			{
+				std::vector<uint8_t> flipped(frame.size());
+				plane_copy(flipped.data(), stride, y + static_cast<size_t>(stride) * (height - 1), -stride, stride, height);
+				uint8_t* flipped_uv = flipped.data() + static_cast<size_t>(stride) * height;
+				int32_t chroma_rows = nv12_chroma_rows(height);
+				plane_copy(flipped_uv, stride, uv + static_cast<size_t>(stride) * (chroma_rows - 1), -stride, stride, chroma_rows);
+				changed = differ.diff(flipped.data() + static_cast<size_t>(stride) * (height - 1), -stride,
+					flipped_uv + static_cast<size_t>(stride) * (chroma_rows - 1), -stride, &dirty);
+			}
+			else
+				changed = differ.diff(y, stride, uv, stride, &dirty);
+			TEST_CHECK(state, changed == !test_nv12_equal(texture, frame, width, height));
+			test_tile_diff_upload(dirty, y, uv, stride, &texture, height);
+			TEST_CHECK(state, test_nv12_equal(texture, frame, width, height));
+		}
+
+		// With a threshold, drift too small to report is kept against the
+		// reference until it adds up
+		tile_differ drift(width, height, 100);
+		drift.diff(y, stride, uv, stride, &dirty);
+		y[5] = static_cast<uint8_t>(y[5] < 128 ? y[5] + 60 : y[5] - 60);
+		TEST_CHECK(state, !drift.diff(y, stride, uv, stride, &dirty));
+		y[6] = static_cast<uint8_t>(y[6] < 128 ? y[6] + 60 : y[6] - 60);
+		TEST_CHECK(state, drift.diff(y, stride, uv, stride, &dirty));
+		TEST_CHECK(state, dirty.size() == 1);
+
+		tile_diff_set_impl(previous);
+	}
+
+	void test_register_memory()
+	{
+		test_register("frame_pool/size_classes", test_frame_pool_size_classes);
+		test_register("frame_pool/alignment", test_frame_pool_alignment);
+		test_register("frame_pool/recycle", test_frame_pool_recycle);
+
+		static const char* impl_names[] = { "plane_copy/scalar", "plane_copy/sse2", "plane_copy/avx2", "plane_copy/neon" };
+		for (size_t i = 0; i < sizeof(test_plane_copy_impls) / sizeof(test_plane_copy_impls[0]); i++)
+			test_register(impl_names[i], test_plane_copy, (void*)&test_plane_copy_impls[i]);
+		test_register("plane_copy/nv12", test_nv12_copy);
+
+		static const char* convert_names[] = { "nv12_to_rgb/sse41", "nv12_to_rgb/avx2", "nv12_to_rgb/neon" };
+		for (size_t i = 0; i < sizeof(test_nv12_convert_impls) / sizeof(test_nv12_convert_impls[0]); i++)
+			test_register(convert_names[i], test_nv12_to_rgb, (void*)&test_nv12_convert_impls[i]);
+
+		static const nv12_convert_impl_ rgb_to_nv12_impls[] = {
+			nv12_convert_impl_scalar, nv12_convert_impl_sse41, nv12_convert_impl_avx2, nv12_convert_impl_neon,
+		};
+		static const char* rgb_to_nv12_names[] = { "rgb_to_nv12/scalar", "rgb_to_nv12/sse41", "rgb_to_nv12/avx2", "rgb_to_nv12/neon" };
+		for (size_t i = 0; i < sizeof(rgb_to_nv12_impls) / sizeof(rgb_to_nv12_impls[0]); i++)
+			test_register(rgb_to_nv12_names[i], test_rgb_to_nv12, (void*)&rgb_to_nv12_impls[i]);
+
+		static const char* scale_names[] = { "nv12_scale/scalar", "nv12_scale/sse2", "nv12_scale/neon" };
+		for (size_t i = 0; i < sizeof(test_nv12_scale_impls) / sizeof(test_nv12_scale_impls[0]); i++)
+			test_register(scale_names[i], test_nv12_scale, (void*)&test_nv12_scale_impls[i]);
+		test_register("lod_selector/hysteresis", test_lod_selector);
+
+		test_register("atlas/churn", test_atlas_churn);
+		test_register("atlas/evict", test_atlas_evict);
+		test_register("atlas/defragment", test_atlas_defragment);
+
+		static const char* block_names[] = { "tile_diff/block/scalar", "tile_diff/block/sse2", "tile_diff/block/avx2", "tile_diff/block/neon" };
+		static const char* differ_names[] = { "tile_diff/differ/scalar", "tile_diff/differ/sse2", "tile_diff/differ/avx2", "tile_diff/differ/neon" };
+		for (size_t i = 0; i < sizeof(test_tile_diff_impls) / sizeof(test_tile_diff_impls[0]); i++)
+		{
+			test_register(block_names[i], test_tile_diff_block, (void*)&test_tile_diff_impls[i]);
+			test_register(differ_names[i], test_tile_differ, (void*)&test_tile_diff_impls[i]);
+		}
+	}
+
+} // namespace nakamir
@@ -0,0 +1,795 @@
+#include "tests.h"
+#include "../bitrate_controller.h"
+#include "../rtp_h264.h"
+#include "../sim_channel.h"
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// The RTP receive path against sim_channel: whatever the network does to
+// the packets, every frame handed to the decoder must be exactly one the
+// sender packetized, and after a loss the next one must be a keyframe.
+// Also the packets themselves, byte for byte, at the edges of each mode,
+// and the bitrate control law driven by hand-written feedback.
+
+namespace nakamir {
+
+	// RTP timestamps 30 fps apart, so a frame's index is its timestamp / 3000
+	const uint32_t test_rtp_frame_ticks = rtp_h264_clock_rate / 30;
+	const uint32_t test_rtp_gop = 10;
+
+	struct test_access_unit_t {
+		std::vector<uint8_t> stream;    // As an encoder writes it: AUD, mixed start code lengths
+		std::vector<uint8_t> expected;  // What the depacketizer should hand out
+		bool keyframe;
+	};
+
+	// Seeded random access units: SPS, PPS and IDR every test_rtp_gop
+	// frames, otherwise one to three slices, small ones that aggregate or
+	// fit a packet and big ones that fragment
+	static std::vector<test_access_unit_t> test_make_access_units(uint32_t count, uint64_t seed)
+	{
+		std::vector<test_access_unit_t> units(count);
+		std::vector<uint8_t> random(16);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			test_access_unit_t& unit = units[i];
+			unit.keyframe = i % test_rtp_gop == 0;
+			auto append = [](std::vector<uint8_t>* out, const uint8_t* nal, size_t size, bool long_start) {
+				static const uint8_t start[] = { 0, 0, 0, 1 };
+				out->insert(out->end(), long_start ? start : start + 1, start + 4);
+				out->insert(out->end(), nal, nal + size);
+			};
+
+			static const uint8_t aud[] = { 0x09, 0xF0 };
+			static const uint8_t sps[] = { 0x67, 0x42, 0xC0, 0x1F, 0x8C, 0x8D };
+			static const uint8_t pps[] = { 0x68, 0xCE, 0x3C };
+			append(&unit.stream, aud, sizeof(aud), true);
+			if (unit.keyframe)
+			{
+				append(&unit.stream, sps, sizeof(sps), true);
+				append(&unit.stream, pps, sizeof(pps), false);
+				append(&unit.expected, sps, sizeof(sps), true);
+				append(&unit.expected, pps, sizeof(pps), true);
+			}
+
+			test_fill_random(random.data(), random.size(), seed * 1000003 + i);
+			uint32_t slices = 1 + random[0] % 3;
+			for (uint32_t s = 0; s < slices; s++)
+			{
+				size_t size = 1 + (random[1 + s * 2] & 1 ? random[2 + s * 2] % 50 : (random[2 + s * 2] * 23) % 6000);
+				std::vector<uint8_t> nal(size);
+				test_fill_random(nal.data(), size, seed + i * 7 + s);
+				// No zero bytes, so the payload never needs emulation prevention
+				for (uint8_t& b : nal)
+					b = static_cast<uint8_t>(5 + b % 250);
+				nal[0] = unit.keyframe && s == 0 ? 0x65 : 0x41;
+				append(&unit.stream, nal.data(), size, s % 2 == 0);
+				append(&unit.expected, nal.data(), size, true);
+			}
+		}
+		return units;
+	}
+
+	struct test_rtp_result_t {
+		uint32_t delivered;
+		uint32_t wrong;                 // Frames handed out that don't match what was sent
+		uint32_t gaps_without_keyframe; // Frames handed out after a missing one that aren't keyframes
+		rtp_depacketizer_stats_t stats;
+		sim_channel_stats_t channel;
+	};
+
+	struct test_rtp_receiver_t {
+		const std::vector<test_access_unit_t>* units;
+		test_rtp_result_t* result;
+		int64_t last_index;
+
+		void take(const rtp_h264_depacketizer& depacketizer)
+		{
+			for (const rtp_frame_t& frame : depacketizer.frames())
+			{
+				int64_t index = frame.timestamp / test_rtp_frame_ticks;
+				const test_access_unit_t* unit = frame.timestamp % test_rtp_frame_ticks == 0 && index < static_cast<int64_t>(units->size()) ? &(*units)[index] : nullptr;
+				if (!unit || index <= last_index || frame.keyframe != unit->keyframe || frame.size != unit->expected.size() ||
+					memcmp(frame.data, unit->expected.data(), frame.size) != 0 || frame.time != static_cast<int64_t>(frame.timestamp))
+					result->wrong++;
+				else if (index != last_index + 1 && !frame.keyframe)
+					result->gaps_without_keyframe++;
+				last_index = index;
+				result->delivered++;
+			}
+		}
+	};
+
+	// Packetizes every unit into the channel, feeding whatever it delivers to
+	// a depacketizer as it goes, then flushes both
+	static test_rtp_result_t test_rtp_run(const std::vector<test_access_unit_t>& units, size_t mtu, const sim_channel_config_t& config, uint32_t reorder_depth = 64, bool flush_each = false)
+	{
+		rtp_h264_packetizer packetizer(0x1234, 96, mtu);
+		sim_channel channel(config);
+		rtp_h264_depacketizer depacketizer;
+		depacketizer.reset(reorder_depth, 1500);
+		test_rtp_result_t result = {};
+		test_rtp_receiver_t receiver = { &units, &result, -1 };
+
+		const uint8_t* data = nullptr;
+		size_t size = 0;
+		for (size_t i = 0; i < units.size(); i++)
+		{
+			size_t count = packetizer.packetize(units[i].stream.data(), units[i].stream.size(), static_cast<uint32_t>(i * test_rtp_frame_ticks));
+			for (size_t p = 0; p < count; p++)
+			{
+				const rtp_packet_t& packet = packetizer.packets()[p];
+				channel.send(packetizer.packet_spans(packet), packet.span_count);
+				while (channel.receive(&data, &size))
+				{
+					depacketizer.receive(data, size);
+					receiver.take(depacketizer);
+				}
+			}
+			if (flush_each)
+			{
+				// The socket going quiet between frames
+				channel.flush();
+				while (channel.receive(&data, &size))
+				{
+					depacketizer.receive(data, size);
+					receiver.take(depacketizer);
+				}
+				depacketizer.flush();
+				receiver.take(depacketizer);
+			}
+		}
+		channel.flush();
+		while (channel.receive(&data, &size))
+		{
+			depacketizer.receive(data, size);
+			receiver.take(depacketizer);
+		}
+		depacketizer.flush();
+		receiver.take(depacketizer);
+
+		result.stats = depacketizer.get_stats();
+		result.channel = channel.get_stats();
+		return result;
+	}
+
+	static void test_rtp_clean(test_state_t* state, void* context)
+	{
+		size_t mtu = reinterpret_cast<size_t>(context);
+		std::vector<test_access_unit_t> units = test_make_access_units(300, 5);
+		test_rtp_result_t result = test_rtp_run(units, mtu, {});
+		TEST_CHECK(state, result.delivered == units.size());
+		TEST_CHECK(state, result.wrong == 0);
+		TEST_CHECK(state, result.stats.lost == 0 && result.stats.frames_damaged == 0);
+
+		// Reordering and duplicates within the window cost nothing, except
+		// that a stream joined on a packet that overtook the first ones waits
+		// for the next keyframe
+		sim_channel_config_t config;
+		config.reorder = 0.2;
+		config.reorder_depth = 8;
+		config.duplicate = 0.05;
+		config.seed = 3;
+		result = test_rtp_run(units, mtu, config);
+		TEST_CHECK(state, result.channel.reordered > 0 && result.channel.duplicated > 0);
+		TEST_CHECK(state, result.delivered + result.stats.frames_skipped == units.size());
+		TEST_CHECK(state, result.stats.frames_skipped <= test_rtp_gop);
+		TEST_CHECK(state, result.wrong == 0);
+		TEST_CHECK(state, result.stats.lost == 0 && result.stats.frames_damaged == 0);
+		TEST_CHECK(state, result.stats.duplicates + result.stats.late >= result.channel.duplicated);
+	}
+
+	static void test_rtp_lossy(test_state_t* state, void* context)
+	{
+		size_t mtu = reinterpret_cast<size_t>(context);
+		std::vector<test_access_unit_t> units = test_make_access_units(300, 5);
+
+		// Bursty loss on top of reordering: frames go missing, but none
+		// handed out is damaged, and each gap restarts on a keyframe
+		sim_channel_config_t config;
+		config.loss = 0.01;
+		config.loss_burst = 2;
+		config.reorder = 0.2;
+		config.reorder_depth = 8;
+		config.duplicate = 0.05;
+		config.seed = 3;
+		test_rtp_result_t result = test_rtp_run(units, mtu, config);
+		TEST_CHECK(state, result.channel.lost > 0);
+		TEST_CHECK(state, result.wrong == 0);
+		TEST_CHECK(state, result.gaps_without_keyframe == 0);
+		TEST_CHECK(state, result.stats.lost == result.channel.lost);
+		TEST_CHECK(state, result.delivered < units.size() && result.delivered > 0);
+		TEST_CHECK(state, result.stats.keyframe_requests > 0);
+
+		// Reordering deeper than the window turns into loss, and flushing
+		// between frames gives up on stragglers early; neither may corrupt
+		config.loss = 0.001;
+		config.loss_burst = 1;
+		config.reorder = 0.3;
+		config.reorder_depth = 30;
+		for (bool flush_each : { false, true })
+		{
+			result = test_rtp_run(units, mtu, config, 16, flush_each);
+			TEST_CHECK(state, result.wrong == 0);
+			TEST_CHECK(state, result.gaps_without_keyframe == 0);
+			TEST_CHECK(state, result.delivered > 0);
+		}
+	}
+
+	// Small packets run the 16 bit sequence number round several times
+	static void test_rtp_sequence_wrap(test_state_t* state, void*)
+	{
+		std::vector<test_access_unit_t> units = test_make_access_units(900, 7);
+		sim_channel_config_t config;
+		config.reorder = 0.1;
+		config.seed = 9;
+		test_rtp_result_t result = test_rtp_run(units, 28, config);
+		TEST_CHECK(state, result.stats.packets > 2 * 65536);
+		TEST_CHECK(state, result.delivered + result.stats.frames_skipped == units.size());
+		TEST_CHECK(state, result.stats.lost == 0 && result.stats.frames_damaged == 0);
+		TEST_CHECK(state, result.wrong == 0);
+	}
+
+	// A sender restarting with a new SSRC and sequence carries on without loss
+	static void test_rtp_ssrc_change(test_state_t* state, void*)
+	{
+		std::vector<test_access_unit_t> units = test_make_access_units(40, 5);
+		rtp_h264_packetizer first(1, 96, 1200);
+		rtp_h264_packetizer second(2, 96, 1200);
+		rtp_h264_depacketizer depacketizer;
+		std::vector<uint8_t> wire(1200);
+		size_t frames = 0;
+		for (uint32_t i = 0; i < units.size(); i++)
+		{
+			rtp_h264_packetizer& packetizer = i < 20 ? first : second;
+			size_t count = packetizer.packetize(units[i].stream.data(), units[i].stream.size(), i * test_rtp_frame_ticks);
+			for (size_t p = 0; p < count; p++)
+			{
+				const rtp_packet_t& packet = packetizer.packets()[p];
+				packetizer.copy_packet(packet, wire.data());
+				frames += depacketizer.receive(wire.data(), packet.size);
+			}
+		}
+		TEST_CHECK(state, frames == units.size());
+		TEST_CHECK(state, depacketizer.get_stats().resyncs == 1);
+	}
+
+	// Random bytes, some dressed up with a valid RTP version, are ignored
+	// without handing out anything empty or reading out of bounds
+	static void test_rtp_garbage(test_state_t* state, void*)
+	{
+		rtp_h264_depacketizer depacketizer;
+		std::vector<uint8_t> packet(2000);
+		std::vector<uint8_t> random(4);
+		bool empty = false;
+		for (uint32_t i = 0; i < 20000; i++)
+		{
+			test_fill_random(random.data(), random.size(), i);
+			size_t size = (random[0] | random[1] << 8) % packet.size();
+			test_fill_random(packet.data(), size, i + 1000000);
+			if (size > 0 && random[2] & 1)
+				packet[0] = 0x80 | (packet[0] & 0x3F);
+			if (size > 2 && random[3] % 4 == 0)
+				packet[2] = 0;
+			depacketizer.receive(packet.data(), size);
+			for (const rtp_frame_t& frame : depacketizer.frames())
+				empty = empty || frame.size == 0;
+			if (i % 1000 == 0)
+			{
+				depacketizer.flush();
+				for (const rtp_frame_t& frame : depacketizer.frames())
+					empty = empty || frame.size == 0;
+			}
+		}
+		TEST_CHECK(state, !empty);
+		TEST_CHECK(state, depacketizer.get_stats().invalid > 0);
+	}
+
+	///////////////////////////////////////////
+	// Packetizer
+	///////////////////////////////////////////
+
+	// Annex-B out of whole NAL units, each behind a 4 byte start code
+	static std::vector<uint8_t> test_rtp_stream(const std::vector<std::vector<uint8_t>>& nals)
+	{
+		std::vector<uint8_t> stream;
+		for (const std::vector<uint8_t>& nal : nals)
+		{
+			stream.insert(stream.end(), { 0, 0, 0, 1 });
+			stream.insert(stream.end(), nal.begin(), nal.end());
+		}
+		return stream;
+	}
+
+	// A NAL unit of size bytes with the given header, and a payload without
+	// zero bytes
+	static std::vector<uint8_t> test_rtp_nal(uint8_t header, size_t size, uint64_t seed)
+	{
+		std::vector<uint8_t> nal(size);
+		test_fill_random(nal.data(), size, seed);
+		for (uint8_t& b : nal)
+			b = static_cast<uint8_t>(5 + b % 250);
+		nal[0] = header;
+		return nal;
+	}
+
+	// The packets of the last packetize call, as they go on the wire
+	static std::vector<std::vector<uint8_t>> test_rtp_packets(const rtp_h264_packetizer& packetizer)
+	{
+		std::vector<std::vector<uint8_t>> packets;
+		for (const rtp_packet_t& packet : packetizer.packets())
+		{
+			packets.emplace_back(packet.size);
+			packetizer.copy_packet(packet, packets.back().data());
+		}
+		return packets;
+	}
+
+	// NAL units that just fit go out whole; one byte more and they split into
+	// FU-A fragments no bigger than the MTU and at most a byte apart in size,
+	// start bit on the first, end bit on the last, with the NAL header's F and
+	// NRI in the indicator and its type in each FU header
+	static void test_rtp_fu_a(test_state_t* state, void*)
+	{
+		for (size_t mtu : { size_t(28), size_t(100), size_t(1200) })
+		{
+			rtp_h264_packetizer packetizer(1, 96, mtu);
+			size_t payload_max = mtu - rtp_header_size;
+			size_t fragment_max = payload_max - 2;
+			const size_t sizes[] = { 2, payload_max - 1, payload_max, payload_max + 1, payload_max + 2, 2 * fragment_max + 1, 2 * fragment_max + 2, 7 * payload_max + 3 };
+			for (size_t size : sizes)
+			{
+				std::vector<uint8_t> nal = test_rtp_nal(0xE5, size, size * 31 + mtu);
+				std::vector<uint8_t> stream = test_rtp_stream({ nal });
+				size_t count = packetizer.packetize(stream.data(), stream.size(), 0);
+				std::vector<std::vector<uint8_t>> packets = test_rtp_packets(packetizer);
+				if (!TEST_CHECK(state, count == packets.size() && count > 0))
+					continue;
+				if (size <= payload_max)
+				{
+					TEST_CHECK(state, count == 1);
+					TEST_CHECK(state, std::vector<uint8_t>(packets[0].begin() + rtp_header_size, packets[0].end()) == nal);
+					continue;
+				}
+
+				size_t fragments = (size - 1 + fragment_max - 1) / fragment_max;
+				TEST_CHECK(state, count == fragments && count >= 2);
+				std::vector<uint8_t> joined(1, nal[0]);
+				size_t smallest = SIZE_MAX, largest = 0;
+				for (size_t f = 0; f < count; f++)
+				{
+					const std::vector<uint8_t>& packet = packets[f];
+					size_t chunk = packet.size() - rtp_header_size - 2;
+					TEST_CHECK(state, packet.size() <= mtu && chunk > 0);
+					TEST_CHECK(state, packet[rtp_header_size] == (0xE0 | rtp_h264_nal_fu_a));
+					TEST_CHECK(state, packet[rtp_header_size + 1] == ((f == 0 ? 0x80 : 0) | (f + 1 == count ? 0x40 : 0) | 0x05));
+					joined.insert(joined.end(), packet.begin() + rtp_header_size + 2, packet.end());
+					smallest = chunk < smallest ? chunk : smallest;
+					largest = chunk > largest ? chunk : largest;
+				}
+				TEST_CHECK(state, largest - smallest <= 1);
+				TEST_CHECK(state, joined == nal);
+			}
+		}
+	}
+
+	// Runs of SPS and PPS that fit a packet together go out as one STAP-A,
+	// whose header has the OR of their F bits and the highest NRI. A lone
+	// parameter set, or a run too big to share a packet, goes out as usual.
+	static void test_rtp_stap_a(test_state_t* state, void*)
+	{
+		rtp_h264_packetizer packetizer(1, 96, 100);
+		const size_t payload_max = 100 - rtp_header_size;
+		std::vector<uint8_t> sps = test_rtp_nal(0x27, 10, 1);
+		std::vector<uint8_t> pps = test_rtp_nal(0x68, 4, 2);
+		std::vector<uint8_t> pps2 = test_rtp_nal(0x48, 5, 3);
+		std::vector<uint8_t> idr = test_rtp_nal(0x65, 20, 4);
+
+		std::vector<uint8_t> stream = test_rtp_stream({ sps, pps, pps2, idr });
+		if (TEST_CHECK(state, packetizer.packetize(stream.data(), stream.size(), 0) == 2))
+		{
+			std::vector<std::vector<uint8_t>> packets = test_rtp_packets(packetizer);
+			std::vector<uint8_t> expected(1, 0x60 | rtp_h264_nal_stap_a);
+			for (const std::vector<uint8_t>* nal : { &sps, &pps, &pps2 })
+			{
+				expected.push_back(static_cast<uint8_t>(nal->size() >> 8));
+				expected.push_back(static_cast<uint8_t>(nal->size()));
+				expected.insert(expected.end(), nal->begin(), nal->end());
+			}
+			TEST_CHECK(state, std::vector<uint8_t>(packets[0].begin() + rtp_header_size, packets[0].end()) == expected);
+			TEST_CHECK(state, std::vector<uint8_t>(packets[1].begin() + rtp_header_size, packets[1].end()) == idr);
+		}
+
+		// The F bit of any unit carries over
+		std::vector<uint8_t> broken = pps;
+		broken[0] |= 0x80;
+		stream = test_rtp_stream({ sps, broken });
+		if (TEST_CHECK(state, packetizer.packetize(stream.data(), stream.size(), 0) == 1))
+			TEST_CHECK(state, test_rtp_packets(packetizer)[0][rtp_header_size] == (0x80 | 0x60 | rtp_h264_nal_stap_a));
+
+		// A parameter set on its own needs no aggregation
+		stream = test_rtp_stream({ sps, idr });
+		if (TEST_CHECK(state, packetizer.packetize(stream.data(), stream.size(), 0) == 2))
+			TEST_CHECK(state, test_rtp_packets(packetizer)[0][rtp_header_size] == sps[0]);
+
+		// Exactly filling the packet still aggregates: 1 + 2 + 60 + 2 + 23
+		std::vector<uint8_t> big_sps = test_rtp_nal(0x67, 60, 5);
+		std::vector<uint8_t> fitting_pps = test_rtp_nal(0x68, payload_max - 1 - 2 - 60 - 2, 6);
+		stream = test_rtp_stream({ big_sps, fitting_pps });
+		if (TEST_CHECK(state, packetizer.packetize(stream.data(), stream.size(), 0) == 1))
+			TEST_CHECK(state, packetizer.packets()[0].size == 100);
+
+		// One byte more and each goes out whole
+		std::vector<uint8_t> bigger_pps = test_rtp_nal(0x68, fitting_pps.size() + 1, 7);
+		stream = test_rtp_stream({ big_sps, bigger_pps });
+		if (TEST_CHECK(state, packetizer.packetize(stream.data(), stream.size(), 0) == 2))
+		{
+			std::vector<std::vector<uint8_t>> packets = test_rtp_packets(packetizer);
+			TEST_CHECK(state, std::vector<uint8_t>(packets[0].begin() + rtp_header_size, packets[0].end()) == big_sps);
+			TEST_CHECK(state, std::vector<uint8_t>(packets[1].begin() + rtp_header_size, packets[1].end()) == bigger_pps);
+		}
+
+		// A parameter set bigger than a packet is fragmented, and the rest of
+		// the run still aggregates where it can
+		std::vector<uint8_t> huge_sps = test_rtp_nal(0x67, 200, 8);
+		stream = test_rtp_stream({ huge_sps, pps, pps2, idr });
+		size_t count = packetizer.packetize(stream.data(), stream.size(), 0);
+		std::vector<std::vector<uint8_t>> packets = test_rtp_packets(packetizer);
+		if (TEST_CHECK(state, count == 5))
+		{
+			for (size_t i = 0; i < 3; i++)
+				TEST_CHECK(state, (packets[i][rtp_header_size] & 0x1F) == rtp_h264_nal_fu_a);
+			TEST_CHECK(state, (packets[3][rtp_header_size] & 0x1F) == rtp_h264_nal_stap_a);
+			TEST_CHECK(state, packets[4][rtp_header_size] == idr[0]);
+		}
+		rtp_packetizer_stats_t stats = packetizer.get_stats();
+		TEST_CHECK(state, stats.stap_a == 4 && stats.fu_a == 3);
+
+		// Whatever the mix, the depacketizer gets back the same units
+		rtp_h264_depacketizer depacketizer;
+		size_t frames = 0;
+		for (const std::vector<uint8_t>& packet : packets)
+			frames += depacketizer.receive(packet.data(), packet.size());
+		if (TEST_CHECK(state, frames == 1))
+		{
+			const rtp_frame_t& frame = depacketizer.frames()[0];
+			std::vector<uint8_t> expected = test_rtp_stream({ huge_sps, pps, pps2, idr });
+			TEST_CHECK(state, frame.keyframe && std::vector<uint8_t>(frame.data, frame.data + frame.size) == expected);
+		}
+	}
+
+	// RTP headers, the marker on the last packet only, sequence numbers that
+	// carry on across access units, payload that stays in the caller's
+	// buffer, and units that are never sent
+	static void test_rtp_packetize_headers(test_state_t* state, void*)
+	{
+		// Below the smallest MTU that leaves fragments any payload, the MTU is raised to it
+		rtp_h264_packetizer packetizer(0xA1B2C3D4, 0xE1, 5);
+		std::vector<uint8_t> sps = test_rtp_nal(0x67, 6, 1);
+		std::vector<uint8_t> pps = test_rtp_nal(0x68, 3, 2);
+		std::vector<uint8_t> idr = test_rtp_nal(0x65, 100, 3);
+		std::vector<uint8_t> stream = test_rtp_stream({ { 0x09, 0xF0 }, sps, pps, idr, { 0x0C, 0xFF, 0xFF } });
+		// An empty unit between two start codes is skipped too
+		stream.insert(stream.end(), { 0, 0, 0, 1, 0, 0, 0, 1 });
+		stream.insert(stream.end(), idr.begin(), idr.end());
+
+		uint16_t sequence = 0;
+		uint64_t copied = 0;
+		uint64_t referenced = 0;
+		for (uint32_t timestamp : { 0x01020304u, 0x01020304u + 3000 })
+		{
+			size_t count = packetizer.packetize(stream.data(), stream.size(), timestamp);
+			std::vector<std::vector<uint8_t>> packets = test_rtp_packets(packetizer);
+			if (!TEST_CHECK(state, count == packets.size() && count == 1 + 2 * 8))
+				return;
+			for (size_t p = 0; p < count; p++)
+			{
+				const std::vector<uint8_t>& packet = packets[p];
+				const rtp_packet_t& info = packetizer.packets()[p];
+				bool last = p + 1 == count;
+				TEST_CHECK(state, packet.size() <= 28);
+				TEST_CHECK(state, info.marker == last && info.sequence == sequence);
+				TEST_CHECK(state, packet[0] == 0x80 && packet[1] == (0x61 | (last ? 0x80 : 0)));
+				TEST_CHECK(state, packet[2] == (sequence >> 8) && packet[3] == (sequence & 0xFF));
+				TEST_CHECK(state, packet[4] == (timestamp >> 24) && packet[5] == ((timestamp >> 16) & 0xFF) &&
+					packet[6] == ((timestamp >> 8) & 0xFF) && packet[7] == (timestamp & 0xFF));
+				TEST_CHECK(state, packet[8] == 0xA1 && packet[9] == 0xB2 && packet[10] == 0xC3 && packet[11] == 0xD4);
+				sequence++;
+
+				// Headers first and payload last, the payload pointing into the stream
+				const rtp_span_t* spans = packetizer.packet_spans(info);
+				for (uint32_t s = 0; s < info.span_count; s++)
+				{
+					bool in_stream = spans[s].data >= stream.data() && spans[s].data + spans[s].size <= stream.data() + stream.size();
+					(in_stream ? referenced : copied) += spans[s].size;
+					if (s == 0 || s + 1 == info.span_count)
+						TEST_CHECK(state, in_stream == (s > 0));
+				}
+			}
+		}
+
+		// One STAP-A of two units and two fragmented slices, per access unit
+		rtp_packetizer_stats_t stats = packetizer.get_stats();
+		TEST_CHECK(state, stats.access_units == 2 && stats.packets == 34);
+		TEST_CHECK(state, stats.stap_a == 2 && stats.fu_a == 32 && stats.single_nal == 0);
+		TEST_CHECK(state, stats.copied_bytes == copied);
+		TEST_CHECK(state, copied == 2 * ((rtp_header_size + 1 + 2 * 2) + 16 * (rtp_header_size + 2)));
+		// The FU-A fragments leave out the NAL header they replace
+		TEST_CHECK(state, stats.payload_bytes == 2 * (sps.size() + pps.size() + 2 * idr.size()));
+		TEST_CHECK(state, referenced == stats.payload_bytes - 2 * 2);
+
+		// Nothing worth sending: no packets, and the sequence doesn't move
+		const uint8_t nothing[] = { 0, 0, 0, 1, 0x09, 0xF0, 0, 0, 1, 0x0C, 0xFF };
+		TEST_CHECK(state, packetizer.packetize(nothing, sizeof(nothing), 0) == 0);
+		TEST_CHECK(state, packetizer.packetize(nothing, 0, 0) == 0);
+		TEST_CHECK(state, packetizer.get_stats().access_units == 2);
+		std::vector<uint8_t> single = test_rtp_stream({ pps });
+		if (TEST_CHECK(state, packetizer.packetize(single.data(), single.size(), 0) == 1))
+			TEST_CHECK(state, packetizer.packets()[0].sequence == sequence && packetizer.packets()[0].marker);
+	}
+
+	///////////////////////////////////////////
+	// Bitrate control
+	///////////////////////////////////////////
+
+	static bool test_abr_feedback(bitrate_controller* controller, uint64_t time_us, uint32_t delay_us, float loss = 0, uint32_t received = 0)
+	{
+		bitrate_feedback_t feedback = { time_us, delay_us, loss, received };
+		return controller->on_feedback(feedback);
+	}
+
+	static bool test_near(double value, double expected, double tolerance)
+	{
+		return std::fabs(value - expected) <= tolerance;
+	}
+
+	// Quiet feedback grows the target fast until the path first overuses,
+	// and increases reach the encoder at most every min_update_interval_us.
+	// Rising delay cuts to a share of what got through at once, delay that
+	// is high but draining holds, and growth after a cut creeps linearly
+	// near the rate that overused.
+	static void test_abr_delay(test_state_t* state, void*)
+	{
+		bitrate_controller_config_t config;
+		config.decrease_factor = 0.9f;
+		bitrate_controller controller(config);
+		TEST_CHECK(state, controller.settings().bitrate == 1000000 && controller.settings().width == 1280 && controller.settings().fps == 30);
+
+		// The first feedback has nothing to measure growth against
+		uint64_t time = 0;
+		uint64_t last_update = 0;
+		bool spaced = true;
+		TEST_CHECK(state, !test_abr_feedback(&controller, time, 0));
+		for (uint32_t i = 0; i < 10; i++)
+		{
+			time += 100000;
+			if (test_abr_feedback(&controller, time, 0))
+			{
+				spaced = spaced && time - last_update >= config.min_update_interval_us;
+				last_update = time;
+			}
+		}
+		bitrate_controller_stats_t stats = controller.get_stats();
+		TEST_CHECK(state, test_near(stats.target_bitrate, 1000000 * 1.5, 2));
+		TEST_CHECK(state, stats.state == bitrate_state_increase && stats.decreases == 0);
+		TEST_CHECK(state, spaced && stats.updates == 2);
+		TEST_CHECK(state, controller.settings().bitrate == stats.target_bitrate);
+
+		// Delay past the threshold and rising: cut below what got through,
+		// and tell the encoder straight away
+		time += 100000;
+		TEST_CHECK(state, test_abr_feedback(&controller, time, 60000, 0, 1000000));
+		stats = controller.get_stats();
+		TEST_CHECK(state, test_near(stats.target_bitrate, 900000, 1));
+		TEST_CHECK(state, stats.state == bitrate_state_decrease && stats.decreases == 1);
+		TEST_CHECK(state, controller.settings().bitrate == stats.target_bitrate);
+
+		// Still as high isn't a second cut while the target is already under
+		// it, and draining only holds
+		time += 100000;
+		TEST_CHECK(state, !test_abr_feedback(&controller, time, 60000, 0, 1000000));
+		TEST_CHECK(state, controller.get_stats().decreases == 1);
+		time += 100000;
+		TEST_CHECK(state, !test_abr_feedback(&controller, time, 50000, 0, 1000000));
+		stats = controller.get_stats();
+		TEST_CHECK(state, stats.state == bitrate_state_hold && test_near(stats.target_bitrate, 900000, 1));
+		time += 100000;
+		TEST_CHECK(state, !test_abr_feedback(&controller, time, 30000, 0, 1000000));
+		TEST_CHECK(state, controller.get_stats().state == bitrate_state_hold);
+
+		// Quiet again, right by the rate that overused: 100 kbps a second
+		for (uint32_t i = 0; i < 10; i++)
+		{
+			time += 100000;
+			test_abr_feedback(&controller, time, 0, 0, 1000000);
+		}
+		stats = controller.get_stats();
+		TEST_CHECK(state, stats.state == bitrate_state_increase);
+		TEST_CHECK(state, test_near(stats.target_bitrate, 1000000, 2));
+
+		// Growth stops a little way past what the path has shown it carries
+		for (uint32_t i = 0; i < 100; i++)
+		{
+			time += 100000;
+			test_abr_feedback(&controller, time, 0, 0, 400000);
+		}
+		TEST_CHECK(state, test_near(controller.get_stats().target_bitrate, 1000000, 2));
+		for (uint32_t i = 0; i < 100; i++)
+		{
+			time += 100000;
+			test_abr_feedback(&controller, time, 0, 0, 800000);
+		}
+		TEST_CHECK(state, test_near(controller.get_stats().target_bitrate, 800000 * 1.5 + 10000, 1));
+	}
+
+	// Heavy loss cuts in proportion but never below half of what got
+	// through, moderate loss holds, and the target stays within its bounds.
+	// After a loss-driven cut, growth is the post-startup 8% a second.
+	static void test_abr_loss(test_state_t* state, void*)
+	{
+		bitrate_controller_config_t config;
+		bitrate_controller controller(config);
+		uint64_t time = 0;
+		test_abr_feedback(&controller, time, 0);
+		time += 100000;
+		TEST_CHECK(state, test_abr_feedback(&controller, time, 0, 0.2f, 0));
+		bitrate_controller_stats_t stats = controller.get_stats();
+		TEST_CHECK(state, test_near(stats.target_bitrate, 900000, 1));
+		TEST_CHECK(state, stats.state == bitrate_state_decrease && stats.decreases == 1);
+
+		// Between the thresholds nothing grows
+		for (uint32_t i = 0; i < 5; i++)
+		{
+			time += 100000;
+			test_abr_feedback(&controller, time, 0, 0.05f, 0);
+		}
+		stats = controller.get_stats();
+		TEST_CHECK(state, stats.state == bitrate_state_hold && test_near(stats.target_bitrate, 900000, 1));
+
+		for (uint32_t i = 0; i < 10; i++)
+		{
+			time += 100000;
+			test_abr_feedback(&controller, time, 0);
+		}
+		TEST_CHECK(state, test_near(controller.get_stats().target_bitrate, 900000 * 1.08, 2));
+
+		// What got through puts a floor under the cut
+		double target = controller.get_stats().target_bitrate;
+		time += 100000;
+		TEST_CHECK(state, test_abr_feedback(&controller, time, 0, 0.9f, static_cast<uint32_t>(target * 1.6)));
+		TEST_CHECK(state, test_near(controller.get_stats().target_bitrate, target * 0.8, 1));
+		target = controller.get_stats().target_bitrate;
+		time += 100000;
+		test_abr_feedback(&controller, time, 0, 0.9f, 0);
+		TEST_CHECK(state, test_near(controller.get_stats().target_bitrate, target * 0.55, 1));
+
+		// Down to min_bitrate and no further, then up to max_bitrate and no further
+		for (uint32_t i = 0; i < 50; i++)
+		{
+			time += 100000;
+			test_abr_feedback(&controller, time, 0, 0.5f, 0);
+		}
+		stats = controller.get_stats();
+		TEST_CHECK(state, stats.target_bitrate == config.min_bitrate && controller.settings().bitrate == config.min_bitrate);
+		for (uint32_t i = 0; i < 1000; i++)
+		{
+			time += 100000;
+			test_abr_feedback(&controller, time, 0);
+		}
+		// The encoder hears of it unless the last step was under min_change
+		TEST_CHECK(state, controller.get_stats().target_bitrate == config.max_bitrate);
+		TEST_CHECK(state, controller.settings().bitrate <= config.max_bitrate && controller.settings().bitrate >= config.max_bitrate * (1 - config.min_change));
+	}
+
+	// An encoder that puts out more than it is asked for is asked for less,
+	// up to a cap, and one that undershoots is never asked for more than the
+	// target
+	static void test_abr_overshoot(test_state_t* state, void*)
+	{
+		for (double factor : { 1.2, 3.0, 0.6 })
+		{
+			bitrate_controller_config_t config;
+			bitrate_controller controller(config);
+			uint64_t time = 0;
+			uint64_t next_feedback = 0;
+			for (uint32_t frame = 0; frame < 30 * 30; frame++)
+			{
+				time = frame * 1000000ull / 30;
+				controller.on_frame(static_cast<size_t>(controller.settings().bitrate * factor / 30 / 8), time);
+				if (time >= next_feedback)
+				{
+					// Queued enough to hold the target where it is
+					test_abr_feedback(&controller, time, 30000);
+					next_feedback += 100000;
+				}
+			}
+			bitrate_controller_stats_t stats = controller.get_stats();
+			double expected = 1000000 / (factor > 1.5 ? 1.5 : factor < 1 ? 1 : factor);
+			TEST_CHECK(state, stats.target_bitrate == 1000000);
+			TEST_CHECK(state, test_near(stats.overshoot, factor, factor * 0.03));
+						// Within min_change of it, as smaller corrections aren't passed on
+			TEST_CHECK(state, test_near(controller.settings().bitrate, expected, controller.settings().bitrate * config.min_change));
+			TEST_CHECK(state, test_near(stats.encoded_bitrate, controller.settings().bitrate * factor, controller.settings().bitrate * factor * 0.05));
+		}
+	}
+
+	// Too few bits per pixel steps the format down the ladder, resolution
+	// first and then frame rate, one step per degrade_us; plenty steps it
+	// back up one step per restore_us, never overlapping the two
+	static void test_abr_format(test_state_t* state, void*)
+	{
+		bitrate_controller_config_t config;
+		config.allow_resolution = true;
+		config.min_fps = 15;
+		config.start_bitrate = 300000;
+		bitrate_controller controller(config);
+
+		// 1280x720, 906x510, then 640x360 carries 300 kbps at over 0.04 bits a pixel
+		uint64_t time = 0;
+		uint64_t changed = 0;
+		std::vector<uint32_t> widths;
+		for (uint32_t i = 0; i <= 50; i++, time += 100000)
+		{
+			if (test_abr_feedback(&controller, time, 30000) && controller.settings().width != (widths.empty() ? 1280 : widths.back()))
+			{
+				TEST_CHECK(state, time - changed >= config.degrade_us);
+				changed = time;
+				widths.push_back(controller.settings().width);
+			}
+		}
+		bitrate_controller_stats_t stats = controller.get_stats();
+		TEST_CHECK(state, widths == std::vector<uint32_t>({ 906, 640 }));
+		TEST_CHECK(state, stats.level == 2 && stats.format_changes == 2);
+		TEST_CHECK(state, controller.settings().height == 360 && controller.settings().fps == 30);
+		TEST_CHECK(state, controller.settings().bitrate == 300000);
+
+		// Growing again: back up a step at a time, each after restore_us
+		uint32_t level = stats.level;
+		bool monotonic = true;
+		changed = time;
+		for (uint32_t i = 0; i < 300 && controller.get_stats().level > 0; i++, time += 100000)
+		{
+			test_abr_feedback(&controller, time, 0);
+			uint32_t now = controller.get_stats().level;
+			if (now != level)
+			{
+				monotonic = monotonic && now + 1 == level;
+				TEST_CHECK(state, time - changed >= config.restore_us);
+				changed = time;
+				level = now;
+			}
+		}
+		TEST_CHECK(state, monotonic && level == 0);
+		TEST_CHECK(state, controller.settings().width == 1280 && controller.settings().height == 720);
+		TEST_CHECK(state, controller.get_stats().format_changes == 4);
+
+		// Without resolution changes only the frame rate gives, down to min_fps
+		config.allow_resolution = false;
+		config.start_bitrate = 150000;
+		controller.reset(config);
+		for (uint32_t i = 0; i <= 50; i++)
+			test_abr_feedback(&controller, i * 100000ull, 30000);
+		TEST_CHECK(state, controller.settings().width == 1280 && controller.settings().fps == 15);
+		TEST_CHECK(state, controller.get_stats().format_changes == 1);
+	}
+
+	void test_register_network()
+	{
+		test_register("rtp_h264/clean/mtu100", test_rtp_clean, reinterpret_cast<void*>(size_t(100)));
+		test_register("rtp_h264/clean/mtu1200", test_rtp_clean, reinterpret_cast<void*>(size_t(1200)));
+		test_register("rtp_h264/lossy/mtu100", test_rtp_lossy, reinterpret_cast<void*>(size_t(100)));
+		test_register("rtp_h264/lossy/mtu1200", test_rtp_lossy, reinterpret_cast<void*>(size_t(1200)));
+		test_register("rtp_h264/sequence_wrap", test_rtp_sequence_wrap);
+		test_register("rtp_h264/ssrc_change", test_rtp_ssrc_change);
+		test_register("rtp_h264/garbage", test_rtp_garbage);
+		test_register("rtp_h264/fu_a", test_rtp_fu_a);
+		test_register("rtp_h264/stap_a", test_rtp_stap_a);
+		test_register("rtp_h264/packetize_headers", test_rtp_packetize_headers);
+		test_register("bitrate_controller/delay", test_abr_delay);
+		test_register("bitrate_controller/loss", test_abr_loss);
+		test_register("bitrate_controller/overshoot", test_abr_overshoot);
+		test_register("bitrate_controller/format", test_abr_format);
+	}
+
+} // namespace nakamir
@@ -0,0 +1,1511 @@
+#include "tests.h"
+#include "../frame_mailbox.h"
+#include "../frame_pool.h"
+#include "../frame_presenter.h"
+#include "../metrics.h"
+#include "../quad_batch.h"
+#include "../session_scheduler.h"
+#include "../sim_transform.h"
+#include "../slot_ring.h"
+#include "../spsc_ring.h"
+#include "../transform_driver.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Transform plumbing driven against sim_transform, so the event thread,
+// draining and error paths run without Media Foundation. Also the queues
+// that hand samples and frames between threads, the scheduler that shares
+// workers between sessions, the latency metrics kept along the way, and the
+// quad batching that draws the decoded frames, with materials as plain keys.
+
+namespace nakamir {
+
+	const int64_t test_frame_duration = 333333;
+
+	///////////////////////////////////////////
+	// Thread handoff
+	///////////////////////////////////////////
+
+	// Capacity rounds up to a power of two, a full ring refuses without
+	// touching the item, and move-only items come out in order across many
+	// wraps of the indices
+	static void test_spsc_ring_single(test_state_t* state, void*)
+	{
+		TEST_CHECK(state, spsc_ring<int>(0).capacity() == 2);
+		TEST_CHECK(state, spsc_ring<int>(3).capacity() == 4);
+		TEST_CHECK(state, spsc_ring<int>(8).capacity() == 8);
+
+		spsc_ring<std::unique_ptr<int>> ring(4);
+		std::unique_ptr<int> item;
+		TEST_CHECK(state, !ring.try_pop(item) && ring.peek() == nullptr);
+
+		int next_in = 0;
+		int next_out = 0;
+		for (int round = 0; round < 100; round++)
+		{
+			// Fill up a varying amount, then empty part of it
+			while (ring.try_push(std::make_unique<int>(next_in)))
+				next_in++;
+			TEST_CHECK(state, ring.size_approx() == 4);
+			std::unique_ptr<int> refused = std::make_unique<int>(-1);
+			TEST_CHECK(state, !ring.try_push(std::move(refused)) && refused && *refused == -1);
+
+			for (int i = 0; i <= round % 4; i++)
+			{
+				std::unique_ptr<int>* oldest = ring.peek();
+				if (!TEST_CHECK(state, oldest && **oldest == next_out))
+					return;
+				TEST_CHECK(state, ring.try_pop(item) && *item == next_out);
+				next_out++;
+			}
+		}
+		while (ring.try_pop(item))
+			TEST_CHECK(state, *item == next_out++);
+		TEST_CHECK(state, next_out == next_in && ring.size_approx() == 0);
+	}
+
+	// A producer and consumer on their own threads see every value once and
+	// in order, through a ring small enough to run full and empty often
+	static void test_spsc_ring_threads(test_state_t* state, void*)
+	{
+		const uint64_t count = 200000;
+		spsc_ring<uint64_t> ring(16);
+		std::thread producer([&ring, count] {
+			for (uint64_t i = 0; i < count; i++)
+			{
+				while (!ring.try_push(i))
+					std::this_thread::yield();
+			}
+		});
+
+		uint64_t expected = 0;
+		uint64_t out_of_order = 0;
+		uint64_t value = 0;
+		while (expected < count)
+		{
+			if (!ring.try_pop(value))
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			if (value != expected)
+				out_of_order++;
+			expected++;
+		}
+		producer.join();
+		TEST_CHECK(state, out_of_order == 0);
+		TEST_CHECK(state, !ring.try_pop(value));
+	}
+
+	static void test_mailbox_write(frame_mailbox* mailbox, uint64_t value)
+	{
+		mailbox_frame_t* frame = mailbox->begin_write();
+		memset(frame->data, static_cast<int>(value & 0xFF), frame->capacity);
+		frame->size = frame->capacity;
+		frame->time = static_cast<int64_t>(value);
+		mailbox->publish();
+	}
+
+	// Only the newest frame is handed over, each at most once, and what was
+	// replaced or dropped shows in the stats
+	static void test_frame_mailbox_latest(test_state_t* state, void*)
+	{
+		frame_mailbox mailbox(256);
+		TEST_CHECK(state, mailbox.acquire_latest() == nullptr);
+
+		for (uint64_t i = 0; i < 3; i++)
+			test_mailbox_write(&mailbox, i);
+		mailbox.drop();
+		mailbox_frame_t* frame = mailbox.acquire_latest();
+		if (!TEST_CHECK(state, frame != nullptr))
+			return;
+		TEST_CHECK(state, frame->time == 2 && frame->sequence == 2 && frame->data[255] == 2);
+		TEST_CHECK(state, mailbox.acquire_latest() == nullptr);
+
+		// The producer can't reach the slot the consumer holds
+		for (uint64_t i = 3; i < 10; i++)
+			test_mailbox_write(&mailbox, i);
+		TEST_CHECK(state, frame->time == 2 && frame->data[0] == 2);
+		frame = mailbox.acquire_latest();
+		TEST_CHECK(state, frame && frame->time == 9);
+
+		frame_mailbox_stats_t stats = mailbox.get_stats();
+		TEST_CHECK(state, stats.published == 10);
+		TEST_CHECK(state, stats.consumed == 2);
+		TEST_CHECK(state, stats.overwritten == 8);
+		TEST_CHECK(state, stats.dropped == 1);
+	}
+
+	// Across threads the consumer only ever sees whole frames, newer each
+	// time, and every published frame is either consumed or overwritten
+	static void test_frame_mailbox_threads(test_state_t* state, void*)
+	{
+		const uint64_t count = 20000;
+		frame_mailbox mailbox(4096);
+		std::atomic<bool> done = false;
+		std::thread producer([&mailbox, &done, count] {
+			for (uint64_t i = 0; i < count; i++)
+				test_mailbox_write(&mailbox, i);
+			done.store(true, std::memory_order_release);
+		});
+
+		int64_t last = -1;
+		uint64_t torn = 0;
+		uint64_t stale = 0;
+		for (bool finished = false; !finished;)
+		{
+			finished = done.load(std::memory_order_acquire);
+			mailbox_frame_t* frame = mailbox.acquire_latest();
+			if (!frame)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			uint8_t expected = static_cast<uint8_t>(frame->time & 0xFF);
+			for (size_t i = 0; i < frame->size; i++)
+			{
+				if (frame->data[i] != expected)
+				{
+					torn++;
+					break;
+				}
+			}
+			if (frame->time <= last)
+				stale++;
+			last = frame->time;
+		}
+		producer.join();
+		TEST_CHECK(state, torn == 0);
+		TEST_CHECK(state, stale == 0);
+		TEST_CHECK(state, last == static_cast<int64_t>(count) - 1);
+		frame_mailbox_stats_t stats = mailbox.get_stats();
+		TEST_CHECK(state, stats.published == count);
+		TEST_CHECK(state, stats.consumed + stats.overwritten == count);
+	}
+
+	// Against a model of who holds what: the producer never gets the slot
+	// being drawn, or one let go of fewer than slots - 3 frames ago (and
+	// never fewer than one), never runs out, and a fresh slot always holds
+	// the newest write
+	static void test_slot_ring_retire(test_state_t* state, void*)
+	{
+		const uint32_t sizes[] = { 3, 4, 5, 8, slot_ring::max_slots };
+		for (uint32_t size : sizes)
+		{
+			slot_ring ring(size);
+			uint32_t slots = ring.slots();
+			if (!TEST_CHECK(state, slots == (size < slot_ring::min_slots ? slot_ring::min_slots : size)))
+				continue;
+			uint64_t hold = slots - 3;
+
+			std::vector<uint8_t> ops(4096);
+			test_fill_random(ops.data(), ops.size(), size);
+			std::vector<uint64_t> content(slots, 0);
+			std::vector<int64_t> let_go(slots, -1);
+			int64_t frame = 0;
+			int32_t read = -1;
+			uint64_t sequence = 0;
+			uint32_t violations = 0;
+			uint32_t stale = 0;
+			for (uint8_t op : ops)
+			{
+				// Bursts of writes and of frames, as either side runs ahead
+				if (op & 1)
+				{
+					for (uint32_t n = 0; n <= (op >> 1) % 4; n++)
+					{
+						int32_t write = ring.begin_write();
+						if (write < 0 || write == read || (let_go[write] >= 0 && (frame - let_go[write] < static_cast<int64_t>(hold) || frame == let_go[write])))
+							violations++;
+						if (write < 0)
+							continue;
+						content[write] = ++sequence;
+						ring.publish();
+					}
+				}
+				else
+				{
+					for (uint32_t n = 0; n <= (op >> 1) % 4; n++)
+					{
+						bool fresh = false;
+						frame++;
+						int32_t slot = ring.acquire_latest(&fresh);
+						if (fresh)
+						{
+							if (content[slot] != sequence)
+								stale++;
+							if (read >= 0)
+								let_go[read] = frame;
+						}
+						else if (slot != read)
+						{
+							violations++;
+						}
+						read = slot;
+					}
+				}
+			}
+			TEST_CHECK(state, violations == 0);
+			TEST_CHECK(state, stale == 0);
+			TEST_CHECK(state, ring.get_stats().starved == 0);
+		}
+	}
+
+	// Only writes that had to go around the slot the consumer holds count as
+	// stalls avoided, not every write once the consumer has started
+	static void test_slot_ring_stats(test_state_t* state, void*)
+	{
+		slot_ring ring(4);
+		auto write = [&ring] {
+			ring.begin_write();
+			ring.publish();
+		};
+
+		// Nothing drawn yet, so the producer just keeps replacing its last write
+		for (int i = 0; i < 5; i++)
+			write();
+		slot_ring_stats_t stats = ring.get_stats();
+		TEST_CHECK(state, stats.published == 5 && stats.overwritten == 4 && stats.stalls_avoided == 0);
+
+		// Holding the last write doesn't get in the producer's way while it
+		// still has the slot the last overwrite gave back, and after that its
+		// last write is an unread one again
+		bool fresh = false;
+		TEST_CHECK(state, ring.acquire_latest(&fresh) >= 0 && fresh);
+		for (int i = 0; i < 10; i++)
+			write();
+		stats = ring.get_stats();
+		TEST_CHECK(state, stats.published == 15 && stats.overwritten == 13 && stats.stalls_avoided == 0);
+
+		// In lockstep every write after the first needs a new slot while the
+		// consumer draws from the one it last wrote
+		ring.acquire_latest();
+		for (int i = 0; i < 20; i++)
+		{
+			write();
+			TEST_CHECK(state, ring.acquire_latest(&fresh) >= 0 && fresh);
+		}
+		stats = ring.get_stats();
+		TEST_CHECK(state, stats.acquired == 22);
+		TEST_CHECK(state, stats.stalls_avoided == 19);
+		TEST_CHECK(state, stats.overwritten == 13 && stats.starved == 0);
+	}
+
+	// Across threads the consumer sees whole writes, and slots it let go of
+	// keep what it drew from them for as long as they are held back
+	static void test_slot_ring_threads(test_state_t* state, void*)
+	{
+		const uint64_t count = 20000;
+		const size_t slot_size = 1024;
+		slot_ring ring(6);
+		uint64_t hold = ring.slots() - 3;
+		std::vector<std::vector<uint8_t>> slots(ring.slots(), std::vector<uint8_t>(slot_size, 0));
+		std::atomic<bool> done = false;
+		std::thread producer([&] {
+			for (uint64_t i = 1; i <= count; i++)
+			{
+				int32_t write;
+				while ((write = ring.begin_write()) < 0)
+					std::this_thread::yield();
+				memset(slots[write].data(), static_cast<int>(i & 0xFF), slot_size);
+				ring.publish();
+			}
+			done.store(true, std::memory_order_release);
+		});
+
+		struct retired_t { int32_t slot; uint8_t value; uint64_t frame; };
+		std::deque<retired_t> retired;
+		uint64_t frame = 0;
+		int32_t read = -1;
+		uint32_t torn = 0;
+		uint32_t changed = 0;
+		for (bool finished = false; !finished;)
+		{
+			finished = done.load(std::memory_order_acquire);
+			bool fresh = false;
+			frame++;
+			int32_t slot = ring.acquire_latest(&fresh);
+			if (fresh && read >= 0)
+				retired.push_back({ read, slots[read][0], frame });
+			read = slot;
+			while (!retired.empty() && frame - retired.front().frame >= hold)
+				retired.pop_front();
+			if (read < 0)
+				continue;
+
+			const std::vector<uint8_t>& data = slots[read];
+			for (size_t i = 0; i < slot_size; i += 64)
+			{
+				if (data[i] != data[0])
+				{
+					torn++;
+					break;
+				}
+			}
+			for (const retired_t& r : retired)
+			{
+				if (slots[r.slot][0] != r.value || slots[r.slot][slot_size - 1] != r.value)
+					changed++;
+			}
+		}
+		producer.join();
+		TEST_CHECK(state, torn == 0);
+		TEST_CHECK(state, changed == 0);
+		TEST_CHECK(state, read >= 0 && slots[read][0] == static_cast<uint8_t>(count & 0xFF));
+		TEST_CHECK(state, ring.get_stats().starved == 0);
+	}
+
+	///////////////////////////////////////////
+	// Frame presenter
+	///////////////////////////////////////////
+
+	static bool test_presenter_write(frame_presenter* presenter, int64_t time, bool wait = false)
+	{
+		mailbox_frame_t* frame = presenter->begin_write(wait);
+		if (!frame)
+			return false;
+		memset(frame->data, static_cast<int>(time / test_frame_duration & 0xFF), frame->capacity);
+		frame->size = frame->capacity;
+		frame->time = time;
+		presenter->publish();
+		return true;
+	}
+
+	// Frames are held until the clock reaches them, overtaken ones are
+	// dropped, a full buffer refuses the producer, and running dry counts once
+	// per gap
+	static void test_frame_presenter_pacing(test_state_t* state, void*)
+	{
+		const int64_t d = test_frame_duration;
+		const int64_t start = 1000;
+		frame_presenter presenter(64, 4);
+		presenter.set_latency(2 * d);
+		TEST_CHECK(state, presenter.present(start) == nullptr);
+		TEST_CHECK(state, presenter.get_stats().underruns == 0);
+
+		for (int64_t i = 0; i < 4; i++)
+			TEST_CHECK(state, test_presenter_write(&presenter, i * d));
+		TEST_CHECK(state, !presenter.can_write());
+		TEST_CHECK(state, presenter.get_stats().dropped_full == 0);
+		TEST_CHECK(state, !test_presenter_write(&presenter, 4 * d));
+		TEST_CHECK(state, presenter.get_stats().dropped_full == 1);
+
+		// The first frame is anchored latency after the call that sees it
+		TEST_CHECK(state, presenter.present(start) == nullptr);
+		mailbox_frame_t* frame = presenter.present(start + 2 * d);
+		if (!TEST_CHECK(state, frame && frame->time == 0))
+			return;
+		TEST_CHECK(state, presenter.present(start + 2 * d + d / 2) == nullptr);
+		TEST_CHECK(state, presenter.can_write());
+
+		// Three frames late, only the newest is shown
+		frame = presenter.present(start + 5 * d);
+		if (!TEST_CHECK(state, frame && frame->time == 3 * d && frame->data[0] == 3))
+			return;
+		frame_presenter_stats_t stats = presenter.get_stats();
+		TEST_CHECK(state, stats.dropped_late == 2 && stats.depth == 0 && stats.drift == 0);
+
+		// The producer fills every other slot but can't reach the one on screen
+		for (int64_t i = 4; i < 8; i++)
+			TEST_CHECK(state, test_presenter_write(&presenter, i * d));
+		TEST_CHECK(state, !presenter.can_write());
+		TEST_CHECK(state, frame->time == 3 * d && frame->data[63] == 3);
+		while (presenter.present(start + 100 * d))
+		{
+		}
+		TEST_CHECK(state, presenter.present(start + 101 * d) == nullptr);
+		TEST_CHECK(state, presenter.get_stats().underruns == 1);
+
+		// Played late by half a frame
+		TEST_CHECK(state, test_presenter_write(&presenter, 100 * d));
+		frame = presenter.present(start + 102 * d + d / 2);
+		TEST_CHECK(state, frame && frame->time == 100 * d);
+
+		stats = presenter.get_stats();
+		TEST_CHECK(state, stats.queued == 9);
+		TEST_CHECK(state, stats.presented == 4);
+		TEST_CHECK(state, stats.dropped_late == 5);
+		TEST_CHECK(state, stats.dropped_full == 1);
+		TEST_CHECK(state, stats.underruns == 1);
+		TEST_CHECK(state, stats.capacity == 4 && stats.max_depth == 4);
+		TEST_CHECK(state, stats.drift == d / 2 && stats.max_drift == 91 * d);
+	}
+
+	// Frames queued out of order come out by time, and a reset re-anchors
+	// the clock on whatever comes next
+	static void test_frame_presenter_order(test_state_t* state, void*)
+	{
+		const int64_t d = test_frame_duration;
+		frame_presenter presenter(64, 4);
+		const int64_t times[] = { 2 * d, 0, 3 * d, d };
+		for (int64_t time : times)
+			TEST_CHECK(state, test_presenter_write(&presenter, time));
+		for (int64_t i = 0; i < 4; i++)
+		{
+			mailbox_frame_t* frame = presenter.present(i * d);
+			TEST_CHECK(state, frame && frame->time == i * d);
+		}
+		TEST_CHECK(state, presenter.get_stats().dropped_late == 0);
+
+		// After a seek the new times are far from the old clock
+		TEST_CHECK(state, test_presenter_write(&presenter, 500 * d));
+		TEST_CHECK(state, test_presenter_write(&presenter, 501 * d));
+		presenter.reset();
+		TEST_CHECK(state, presenter.get_stats().depth == 0);
+		TEST_CHECK(state, presenter.present(10 * d) == nullptr);
+		TEST_CHECK(state, presenter.get_stats().underruns == 0);
+		TEST_CHECK(state, test_presenter_write(&presenter, 900 * d));
+		TEST_CHECK(state, test_presenter_write(&presenter, 901 * d));
+		mailbox_frame_t* frame = presenter.present(11 * d);
+		TEST_CHECK(state, frame && frame->time == 900 * d);
+		frame = presenter.present(12 * d);
+		TEST_CHECK(state, frame && frame->time == 901 * d);
+		TEST_CHECK(state, presenter.get_stats().dropped_late == 0);
+
+		// Cancelled writes give the slot back
+		TEST_CHECK(state, presenter.begin_write(false) != nullptr);
+		presenter.cancel_write();
+		TEST_CHECK(state, presenter.get_stats().queued == 8);
+	}
+
+	// A decoder thread that outruns playback blocks instead of dropping, the
+	// renderer sees whole frames in order, and close releases a blocked
+	// producer
+	static void test_frame_presenter_threads(test_state_t* state, void*)
+	{
+		const int64_t d = test_frame_duration;
+		const int64_t count = 2000;
+		frame_presenter presenter(1024, 3);
+		std::thread producer([&presenter, count, d] {
+			for (int64_t i = 0; i < count; i++)
+				test_presenter_write(&presenter, i * d, true);
+		});
+
+		int64_t now = 0;
+		int64_t last = -1;
+		uint64_t torn = 0;
+		uint64_t stale = 0;
+		for (;;)
+		{
+			frame_presenter_stats_t stats = presenter.get_stats();
+			if (stats.presented + stats.dropped_late == static_cast<uint64_t>(count))
+				break;
+			now += d / 2;
+			mailbox_frame_t* frame = presenter.present(now);
+			if (!frame)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			uint8_t expected = static_cast<uint8_t>(frame->time / d & 0xFF);
+			for (size_t i = 0; i < frame->size; i++)
+			{
+				if (frame->data[i] != expected)
+				{
+					torn++;
+					break;
+				}
+			}
+			if (frame->time <= last)
+				stale++;
+			last = frame->time;
+		}
+		producer.join();
+		TEST_CHECK(state, torn == 0);
+		TEST_CHECK(state, stale == 0);
+		TEST_CHECK(state, last == (count - 1) * d);
+		frame_presenter_stats_t stats = presenter.get_stats();
+		TEST_CHECK(state, stats.queued == static_cast<uint64_t>(count));
+		TEST_CHECK(state, stats.dropped_full == 0);
+		TEST_CHECK(state, stats.max_depth <= 3);
+
+		// Fill up, then block a producer until close
+		while (presenter.can_write())
+			test_presenter_write(&presenter, now + d);
+		bool released = false;
+		std::thread waiter([&presenter, &released] { released = presenter.begin_write(true) == nullptr; });
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		presenter.close();
+		waiter.join();
+		TEST_CHECK(state, released);
+		TEST_CHECK(state, presenter.begin_write(false) == nullptr);
+	}
+
+	///////////////////////////////////////////
+	// Metrics
+	///////////////////////////////////////////
+
+	// Records on this thread and returns just what was recorded, whatever
+	// else went into the global counters before
+	static metric_stage_stats_t test_record_latencies(metric_stage_ stage, const std::vector<uint64_t>& latencies)
+	{
+		metrics_snapshot_t before, after, delta;
+		metrics_snapshot(&before);
+		for (uint64_t latency : latencies)
+			metrics_record(stage, latency, 10);
+		metrics_snapshot(&after);
+		metrics_delta(before, after, &delta);
+		return delta.stages[stage];
+	}
+
+	// A percentile is never below the sample at its rank, and overstates it
+	// by at most one bucket: 1us below 8us, 12.5% above
+	static void test_metrics_percentiles(test_state_t* state, void*)
+	{
+		// Log-uniform from 0 to ~17 minutes, plus the ends of the range
+		std::vector<uint8_t> random(4096 * 8);
+		test_fill_random(random.data(), random.size(), 12);
+		std::vector<uint64_t> latencies;
+		for (size_t i = 0; i < random.size(); i += 8)
+		{
+			uint64_t bits;
+			memcpy(&bits, &random[i], sizeof(bits));
+			latencies.push_back((bits >> 8) & ((1ull << (bits % 31)) - 1));
+		}
+		latencies.push_back(0);
+		latencies.push_back(7);
+		latencies.push_back(8);
+		latencies.push_back(10000000000ull);    // Past the last bucket
+
+		metric_stage_stats_t stats = test_record_latencies(metric_stage_upload, latencies);
+		if (!TEST_CHECK(state, stats.count == latencies.size()))
+			return;
+		TEST_CHECK(state, stats.bytes == latencies.size() * 10);
+		TEST_CHECK(state, stats.max_us >= 10000000000ull);
+
+		std::sort(latencies.begin(), latencies.end());
+		const double fractions[] = { 0, 0.001, 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99, 0.999, 1 };
+		for (double fraction : fractions)
+		{
+			uint64_t rank = static_cast<uint64_t>(fraction * latencies.size() + 0.5);
+			rank = std::min<uint64_t>(std::max<uint64_t>(rank, 1), latencies.size());
+			double value = static_cast<double>(latencies[rank - 1]);
+			double percentile = metrics_percentile_us(stats, fraction);
+			TEST_CHECK(state, percentile >= value);
+			TEST_CHECK(state, percentile <= std::max(value + 1, value * 1.125));
+		}
+		TEST_CHECK(state, metrics_percentile_us(stats, 1) == static_cast<double>(stats.max_us));
+
+		// Every bucket boundary, where an off by one would land a sample in
+		// the next bucket up, over the 2^32us the buckets cover
+		for (uint64_t value = 1; value < (1ull << 32) - 1; value = value * 5 / 4 + 1)
+		{
+			for (uint64_t v : { value - 1, value, value + 1 })
+			{
+				metric_stage_stats_t one = test_record_latencies(metric_stage_upload, { v });
+				one.max_us = 0;
+				double percentile = metrics_percentile_us(one, 0.5);
+				TEST_CHECK(state, percentile > static_cast<double>(v));
+				TEST_CHECK(state, percentile <= std::max(v + 1.0, v * 1.125));
+			}
+		}
+
+		metric_stage_stats_t empty = {};
+		TEST_CHECK(state, metrics_percentile_us(empty, 0.5) == 0);
+	}
+
+	// Summaries and deltas over counters written from several threads,
+	// including threads that have since exited
+	static void test_metrics_summary(test_state_t* state, void*)
+	{
+		metrics_snapshot_t before, after, delta;
+		metrics_snapshot(&before);
+		std::vector<std::thread> threads;
+		for (uint64_t t = 0; t < 4; t++)
+		{
+			threads.emplace_back([t] {
+				for (uint64_t i = 0; i < 100; i++)
+					metrics_record(metric_stage_decode, 100 + t, 1000);
+			});
+		}
+		for (std::thread& thread : threads)
+			thread.join();
+		metrics_snapshot(&after);
+		metrics_delta(before, after, &delta);
+
+		const metric_stage_stats_t& stats = delta.stages[metric_stage_decode];
+		TEST_CHECK(state, stats.count == 400 && stats.bytes == 400000);
+		TEST_CHECK(state, stats.total_us == 100 * (100 + 101 + 102 + 103));
+		TEST_CHECK(state, stats.max_us >= 103);
+
+		metric_stage_summary_t summary;
+		metrics_summarize(stats, 2, &summary);
+		TEST_CHECK(state, summary.count == 400);
+		TEST_CHECK(state, summary.per_second == 200 && summary.bytes_per_second == 200000);
+		TEST_CHECK(state, summary.mean_us == 101.5);
+		TEST_CHECK(state, summary.p50_us >= 101 && summary.p50_us <= 104);
+		TEST_CHECK(state, summary.p999_us >= 103 && summary.p999_us <= summary.max_us);
+		metrics_summarize(stats, 0, &summary);
+		TEST_CHECK(state, summary.per_second == 0 && summary.mean_us == 101.5);
+
+		std::string json = metrics_to_json(delta, 2);
+		TEST_CHECK(state, json.find("\"decode\":{\"count\":400,\"bytes\":400000,\"per_second\":200.000") != std::string::npos);
+		TEST_CHECK(state, json.front() == '{' && json.back() == '}');
+	}
+
+	// Latency across threads is matched by key, and keys the tracker has
+	// forgotten, or never saw, aren't recorded
+	static void test_metrics_latency_tracker(test_state_t* state, void*)
+	{
+		metrics_latency_tracker tracker(metric_stage_present);
+		metrics_snapshot_t before, after, delta;
+		metrics_snapshot(&before);
+
+		tracker.begin(1);
+		tracker.begin(2);
+		bool ended = false;
+		std::thread other([&tracker, &ended] { ended = tracker.end(2, 5); });
+		other.join();
+		TEST_CHECK(state, ended);
+		TEST_CHECK(state, !tracker.end(2));
+		TEST_CHECK(state, tracker.end(1));
+		TEST_CHECK(state, !tracker.end(3));
+		TEST_CHECK(state, !tracker.end(INT64_MIN));
+
+		// Only the last slot_count keys are held
+		for (int64_t key = 100; key < 100 + metrics_latency_tracker::slot_count + 1; key++)
+			tracker.begin(key);
+		TEST_CHECK(state, !tracker.end(100));
+		TEST_CHECK(state, tracker.end(101));
+		TEST_CHECK(state, tracker.end(100 + metrics_latency_tracker::slot_count));
+
+		metrics_snapshot(&after);
+		metrics_delta(before, after, &delta);
+		TEST_CHECK(state, delta.stages[metric_stage_present].count == 4);
+		TEST_CHECK(state, delta.stages[metric_stage_present].bytes == 5);
+	}
+
+	///////////////////////////////////////////
+	// Sim transform
+	///////////////////////////////////////////
+
+	struct test_sim_output_t {
+		std::vector<uint8_t> indices;
+		std::vector<int64_t> times;
+		std::vector<int64_t> durations;
+	};
+
+	static void test_on_sim_output(media_transform* /*transform*/, media_sample* sample, void* context)
+	{
+		test_sim_output_t* output = static_cast<test_sim_output_t*>(context);
+		media_buffer* buffer = sample->get_buffer();
+		size_t length = 0;
+		uint8_t* data = buffer->lock(nullptr, &length);
+		output->indices.push_back(length ? data[0] : 0);
+		buffer->unlock();
+		output->times.push_back(sample->get_sample_time());
+		output->durations.push_back(sample->get_sample_duration());
+	}
+
+	static media_sample* test_sim_input(uint64_t index)
+	{
+		media_sample* sample = memory_sample_create(64);
+		sample->get_buffer()->set_current_length(64);
+		sample->set_sample_time(static_cast<int64_t>(index) * test_frame_duration);
+		sample->set_sample_duration(test_frame_duration);
+		return sample;
+	}
+
+	static std::vector<transform_event_> test_sim_events(sim_transform* sim)
+	{
+		std::vector<transform_event_> events;
+		transform_event_ event;
+		while ((event = sim->get_event(false)) != transform_event_none)
+			events.push_back(event);
+		return events;
+	}
+
+	// Latency holds outputs back until enough input is queued, the ratio sets
+	// how many come out per input, and each is stamped from the input that
+	// completed it. Run once with caller supplied samples, once with the
+	// transform providing its own.
+	static void test_sim_transform_sync(test_state_t* state, void* context)
+	{
+		sim_transform_config_t config;
+		config.latency = 2;
+		config.outputs_per_input_num = 2;
+		config.provides_samples = context != nullptr;
+		sim_transform sim(config);
+		test_sim_output_t output;
+
+		for (uint64_t i = 0; i < 5; i++)
+		{
+			media_sample* sample = test_sim_input(i);
+			TEST_CHECK(state, sim.process_input(sample) == transform_status_ok);
+			sample->release();
+			size_t delivered = transform_process_output(&sim, test_on_sim_output, &output);
+			TEST_CHECK(state, delivered == (i < 2 ? 0u : 2u));
+		}
+		sim.drain();
+		TEST_CHECK(state, transform_process_output(&sim, test_on_sim_output, &output) == 4);
+
+		if (!TEST_CHECK(state, output.indices.size() == 10))
+			return;
+		for (size_t k = 0; k < 10; k++)
+		{
+			TEST_CHECK(state, output.indices[k] == k);
+			int64_t time = static_cast<int64_t>(k / 2) * test_frame_duration + static_cast<int64_t>(k % 2) * (test_frame_duration / 2);
+			TEST_CHECK(state, output.times[k] == time);
+			TEST_CHECK(state, output.durations[k] == test_frame_duration / 2);
+		}
+		sim_transform_stats_t stats = sim.get_stats();
+		TEST_CHECK(state, stats.inputs == 5 && stats.outputs == 10 && stats.rejected_inputs == 0);
+	}
+
+	// Pairing inputs, one output comes out per two, stamped from the second
+	static void test_sim_transform_pairs(test_state_t* state, void*)
+	{
+		sim_transform_config_t config;
+		config.outputs_per_input_den = 2;
+		sim_transform sim(config);
+		test_sim_output_t output;
+
+		for (uint64_t i = 0; i < 6; i++)
+		{
+			media_sample* sample = test_sim_input(i);
+			sim.process_input(sample);
+			sample->release();
+			transform_process_output(&sim, test_on_sim_output, &output);
+		}
+		if (!TEST_CHECK(state, output.times.size() == 3))
+			return;
+		for (size_t k = 0; k < 3; k++)
+			TEST_CHECK(state, output.times[k] == static_cast<int64_t>(2 * k + 1) * test_frame_duration);
+	}
+
+	// A sync transform refuses input while its output is full, and raises a
+	// stream change in place of every Nth output until renegotiated
+	static void test_sim_transform_backpressure(test_state_t* state, void*)
+	{
+		sim_transform_config_t config;
+		config.max_ready_outputs = 2;
+		config.format_change_interval = 3;
+		sim_transform sim(config);
+
+		media_sample* sample = test_sim_input(0);
+		TEST_CHECK(state, sim.process_input(sample) == transform_status_ok);
+		TEST_CHECK(state, sim.process_input(sample) == transform_status_ok);
+		TEST_CHECK(state, sim.process_input(sample) == transform_status_not_accepting);
+		sample->release();
+		TEST_CHECK(state, sim.get_stats().rejected_inputs == 1);
+
+		test_sim_output_t output;
+		TEST_CHECK(state, transform_process_output(&sim, test_on_sim_output, &output) == 2);
+		for (uint64_t i = 1; i < 8; i++)
+		{
+			sample = test_sim_input(i);
+			TEST_CHECK(state, sim.process_input(sample) == transform_status_ok);
+			sample->release();
+			transform_process_output(&sim, test_on_sim_output, &output);
+		}
+		// Outputs 3 and 6 each came after a change; nothing was lost to them
+		TEST_CHECK(state, output.indices.size() == 9);
+		TEST_CHECK(state, sim.get_stats().stream_changes == 2);
+		TEST_CHECK(state, sim.get_output_type_id() == 2);
+		for (size_t k = 0; k < output.indices.size(); k++)
+			TEST_CHECK(state, output.indices[k] == k);
+	}
+
+	// An async transform asks for input with events, holds its requests back
+	// while output is full, and reports the end of a drain once the last
+	// output is collected
+	static void test_sim_transform_async(test_state_t* state, void*)
+	{
+		sim_transform_config_t config;
+		config.async = true;
+		config.max_ready_outputs = 2;
+		sim_transform sim(config);
+		typedef std::vector<transform_event_> events_t;
+
+		TEST_CHECK(state, test_sim_events(&sim) == events_t({ transform_event_need_input }));
+		media_sample* sample = test_sim_input(0);
+		TEST_CHECK(state, sim.process_input(sample) == transform_status_ok);
+		TEST_CHECK(state, test_sim_events(&sim) == events_t({ transform_event_have_output, transform_event_need_input }));
+		TEST_CHECK(state, sim.process_input(sample) == transform_status_ok);
+		// Full, so the request is held back
+		TEST_CHECK(state, test_sim_events(&sim) == events_t({ transform_event_have_output }));
+		TEST_CHECK(state, sim.process_input(sample) == transform_status_not_accepting);
+		sample->release();
+
+		transform_stream_info_t info = sim.get_output_stream_info();
+		media_sample* result = nullptr;
+		media_sample* out = sim.create_output_sample(info);
+		TEST_CHECK(state, sim.process_output(out, &result) == transform_status_ok);
+		TEST_CHECK(state, result == out);
+		result->release();
+		out->release();
+		TEST_CHECK(state, test_sim_events(&sim) == events_t({ transform_event_need_input }));
+
+		sim.drain();
+		TEST_CHECK(state, test_sim_events(&sim).empty());
+		out = sim.create_output_sample(info);
+		TEST_CHECK(state, sim.process_output(out, &result) == transform_status_ok);
+		result->release();
+		out->release();
+		TEST_CHECK(state, test_sim_events(&sim) == events_t({ transform_event_drain_complete }));
+
+		// After shutdown a blocking wait returns straight away
+		sim.shutdown();
+		TEST_CHECK(state, sim.get_event(true) == transform_event_none);
+	}
+
+	///////////////////////////////////////////
+	// Transform driver
+	///////////////////////////////////////////
+
+	struct test_driver_output_t {
+		// First byte of each, which sim_transform fills with its output index
+		std::vector<uint8_t> indices;
+		uint32_t throw_at;            // Output that throws from the callback, 0 for none
+	};
+
+	static void test_on_output(media_transform* /*transform*/, media_sample* sample, void* context)
+	{
+		test_driver_output_t* output = static_cast<test_driver_output_t*>(context);
+		media_buffer* buffer = sample->get_buffer();
+		size_t length = 0;
+		uint8_t* data = buffer->lock(nullptr, &length);
+		output->indices.push_back(length ? data[0] : 0);
+		buffer->unlock();
+		if (output->throw_at && output->indices.size() == output->throw_at)
+			throw std::runtime_error("sink failed");
+	}
+
+	static media_sample* test_input_sample(sample_allocator* allocator, uint64_t index)
+	{
+		transform_stream_info_t info = { transform_stream_flags_none, 256, 16 };
+		media_sample* sample = allocator->allocate(info);
+		sample->get_buffer()->set_current_length(256);
+		sample->set_sample_time(static_cast<int64_t>(index) * test_frame_duration);
+		sample->set_sample_duration(test_frame_duration);
+		return sample;
+	}
+
+	// Every input comes out once and in order, whether the transform is driven
+	// from its own event thread or inline from submit
+	static void test_transform_driver(test_state_t* state, void* context)
+	{
+		bool async = context != nullptr;
+		// The pool outlives the transform, which may still hold samples from it
+		frame_pool pool;
+		frame_pool_allocator allocator(&pool);
+		sim_transform_config_t config;
+		config.async = async;
+		config.latency = 2;
+		config.input_queue_depth = 3;
+		sim_transform sim(config);
+
+		const uint32_t frames = 60;
+		test_driver_output_t output = {};
+		transform_driver driver(&sim, test_on_output, &output, &allocator);
+		driver.start();
+		for (uint32_t i = 0; i < frames; i++)
+		{
+			media_sample* sample = test_input_sample(&allocator, i);
+			TEST_CHECK(state, driver.submit(sample));
+			sample->release();
+		}
+		driver.drain();
+
+		transform_driver_stats_t stats = driver.get_stats();
+		TEST_CHECK(state, stats.submitted == frames);
+		TEST_CHECK(state, stats.inputs == frames);
+		TEST_CHECK(state, stats.outputs == frames);
+		if (TEST_CHECK(state, output.indices.size() == frames))
+		{
+			for (uint32_t i = 0; i < frames; i++)
+				TEST_CHECK(state, output.indices[i] == static_cast<uint8_t>(i));
+		}
+		if (async)
+			TEST_CHECK(state, stats.max_in_flight > 1);
+
+		driver.stop();
+		media_sample* late = test_input_sample(&allocator, frames);
+		TEST_CHECK(state, !driver.submit(late, false));
+		late->release();
+	}
+
+	// A callback that throws ends the event thread. The error reaches the
+	// submitting thread, and stop still releases what was queued, shuts the
+	// transform down and joins the thread, or the destructor would terminate
+	// the process on a joinable std::thread.
+	static void test_transform_driver_error(test_state_t* state, void*)
+	{
+		frame_pool pool;
+		frame_pool_allocator allocator(&pool);
+		sim_transform_config_t config;
+		config.async = true;
+		config.input_queue_depth = 2;
+		sim_transform sim(config);
+
+		test_driver_output_t output = {};
+		output.throw_at = 3;
+		{
+			transform_driver driver(&sim, test_on_output, &output, &allocator, 4);
+			driver.start();
+			bool rethrown = false;
+			for (uint32_t i = 0; i < 1000 && !rethrown; i++)
+			{
+				media_sample* sample = test_input_sample(&allocator, i);
+				try
+				{
+					driver.submit(sample);
+				}
+				catch (const std::runtime_error&)
+				{
+					rethrown = true;
+				}
+				sample->release();
+			}
+			if (!rethrown)
+			{
+				try
+				{
+					driver.drain();
+				}
+				catch (const std::runtime_error&)
+				{
+					rethrown = true;
+				}
+			}
+			TEST_CHECK(state, rethrown);
+
+			driver.stop();
+			TEST_CHECK(state, driver.get_stats().queued == 0);
+			// A second stop, here from the destructor, has nothing left to do
+		}
+		TEST_CHECK(state, output.indices.size() == 3);
+		// Everything the driver had queued went back to the pool
+		TEST_CHECK(state, pool.get_stats().outstanding_blocks == 0);
+	}
+
+	// Without a bound from the caller, the queue holds as many inputs as the
+	// transform asks for before its first output, and never fewer than 2
+	static void test_transform_driver_capacity(test_state_t* state, void*)
+	{
+		struct case_t { uint32_t input_queue_depth; uint32_t latency; uint32_t max_queued; uint32_t capacity; };
+		const case_t cases[] = {
+			{ 1, 0, 0, 2 },
+			{ 4, 0, 0, 4 },
+			{ 4, 2, 0, 6 },   // A lookahead adds the inputs it swallows first
+			{ 4, 0, 7, 7 },
+		};
+		for (const case_t& c : cases)
+		{
+			frame_pool pool;
+			frame_pool_allocator allocator(&pool);
+			sim_transform_config_t config;
+			config.async = true;
+			config.input_queue_depth = c.input_queue_depth;
+			config.latency = c.latency;
+			sim_transform sim(config);
+
+			test_driver_output_t output = {};
+			transform_driver driver(&sim, test_on_output, &output, &allocator, c.max_queued);
+			TEST_CHECK(state, driver.get_stats().queue_capacity == (c.max_queued ? c.max_queued : 2));
+			driver.start();
+			for (uint32_t i = 0; i < 20; i++)
+			{
+				media_sample* sample = test_input_sample(&allocator, i);
+				TEST_CHECK(state, driver.submit(sample));
+				sample->release();
+			}
+			driver.drain();
+			transform_driver_stats_t stats = driver.get_stats();
+			TEST_CHECK(state, stats.queue_capacity == c.capacity);
+			TEST_CHECK(state, output.indices.size() == 20);
+		}
+	}
+
+	// Forwards to a sim_transform, holding the first process_input until the
+	// test lets it go
+	class test_gated_transform final : public media_transform {
+	public:
+		explicit test_gated_transform(sim_transform* sim) : _sim(sim) {}
+
+		transform_stream_info_t get_output_stream_info() override { return _sim->get_output_stream_info(); }
+		transform_status_ process_input(media_sample* sample) override
+		{
+			std::unique_lock<std::mutex> lock(_mtx);
+			if (!_entered)
+			{
+				_entered = true;
+				_cv.notify_all();
+				// Long enough that a driver still holding its lock would show
+				timed_out = !_cv.wait_for(lock, std::chrono::seconds(2), [this] { return _released; });
+			}
+			lock.unlock();
+			return _sim->process_input(sample);
+		}
+		transform_status_ process_output(media_sample* output, media_sample** ppResult) override { return _sim->process_output(output, ppResult); }
+		void renegotiate_output_type() override { _sim->renegotiate_output_type(); }
+		void flush() override { _sim->flush(); }
+		void drain() override { _sim->drain(); }
+		bool is_async() override { return _sim->is_async(); }
+		transform_event_ get_event(bool wait) override { return _sim->get_event(wait); }
+		void shutdown() override { _sim->shutdown(); }
+		media_sample* create_output_sample(const transform_stream_info_t& info) override { return _sim->create_output_sample(info); }
+
+		void wait_entered()
+		{
+			std::unique_lock<std::mutex> lock(_mtx);
+			_cv.wait(lock, [this] { return _entered; });
+		}
+		void release()
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			_released = true;
+			_cv.notify_all();
+		}
+
+		bool timed_out = false;
+
+	private:
+		sim_transform* _sim;
+		std::mutex _mtx;
+		std::condition_variable _cv;
+		bool _entered = false;
+		bool _released = false;
+	};
+
+	// process_input runs without the driver's lock, so stats and submits from
+	// other threads go ahead while the transform is busy taking an input, and
+	// what queues up meanwhile still goes in in order
+	static void test_transform_driver_unlocked_input(test_state_t* state, void*)
+	{
+		frame_pool pool;
+		frame_pool_allocator allocator(&pool);
+		sim_transform_config_t config;
+		config.async = true;
+		config.input_queue_depth = 2;
+		sim_transform sim(config);
+		test_gated_transform gated(&sim);
+
+		const uint32_t frames = 12;
+		test_driver_output_t output = {};
+		transform_driver driver(&gated, test_on_output, &output, &allocator, 4);
+		driver.start();
+		std::thread producer([&driver, &allocator] {
+			media_sample* sample = test_input_sample(&allocator, 0);
+			driver.submit(sample);
+			sample->release();
+		});
+
+		gated.wait_entered();
+		transform_driver_stats_t stats = driver.get_stats();
+		TEST_CHECK(state, stats.submitted == 1 && stats.inputs == 0);
+		for (uint32_t i = 1; i < 4; i++)
+		{
+			media_sample* sample = test_input_sample(&allocator, i);
+			TEST_CHECK(state, driver.submit(sample, false));
+			sample->release();
+		}
+		gated.release();
+		producer.join();
+		TEST_CHECK(state, !gated.timed_out);
+
+		for (uint32_t i = 4; i < frames; i++)
+		{
+			media_sample* sample = test_input_sample(&allocator, i);
+			TEST_CHECK(state, driver.submit(sample));
+			sample->release();
+		}
+		driver.drain();
+		stats = driver.get_stats();
+		TEST_CHECK(state, stats.inputs == frames && stats.outputs == frames);
+		if (TEST_CHECK(state, output.indices.size() == frames))
+		{
+			for (uint32_t i = 0; i < frames; i++)
+				TEST_CHECK(state, output.indices[i] == static_cast<uint8_t>(i));
+		}
+	}
+
+	///////////////////////////////////////////
+	// Session scheduler
+	///////////////////////////////////////////
+
+	struct test_round_robin_t {
+		std::atomic<bool>* go;
+		std::vector<int32_t>* log;   // Only ever written by the one worker
+		int32_t id;
+		uint32_t steps;
+	};
+
+	static session_step_ test_round_robin_step(void* context)
+	{
+		test_round_robin_t* session = static_cast<test_round_robin_t*>(context);
+		if (!session->go->load())
+			return session_step_continue;
+		session->log->push_back(session->id);
+		return ++session->steps == 50 ? session_step_finished : session_step_continue;
+	}
+
+	// On one worker, every runnable session gets a step before any gets a
+	// second one
+	static void test_session_scheduler_fairness(test_state_t* state, void*)
+	{
+		const int32_t count = 5;
+		std::atomic<bool> go = false;
+		std::vector<int32_t> log;
+		test_round_robin_t sessions[count];
+		session_scheduler scheduler(1);
+		for (int32_t i = 0; i < count; i++)
+		{
+			sessions[i] = { &go, &log, i, 0 };
+			TEST_CHECK(state, scheduler.add(test_round_robin_step, &sessions[i]) == i);
+		}
+		go = true;
+
+		session_stats_t stats = {};
+		for (int32_t i = 0; i < count; i++)
+		{
+			while (scheduler.get_session_stats(i, &stats) && !stats.finished)
+				std::this_thread::yield();
+		}
+		scheduler.stop();
+
+		if (!TEST_CHECK(state, log.size() == count * 50))
+			return;
+		uint32_t repeats = 0;
+		for (size_t i = 0; i + count <= log.size(); i++)
+		{
+			uint32_t seen = 0;
+			for (size_t k = i; k < i + count; k++)
+				seen |= 1u << log[k];
+			if (seen != (1u << count) - 1)
+				repeats++;
+		}
+		TEST_CHECK(state, repeats == 0);
+	}
+
+	// Sessions spread over several workers all run to the end, and each one
+	// only ever runs on one worker at a time
+	static void test_session_scheduler_workers(test_state_t* state, void*)
+	{
+		struct counter_t {
+			std::atomic<uint32_t> running;
+			uint32_t steps;
+			uint32_t overlaps;
+		};
+		const int32_t count = 16;
+		counter_t counters[count] = {};
+		session_scheduler scheduler(4);
+		for (int32_t i = 0; i < count; i++)
+		{
+			scheduler.add([](void* context) {
+				counter_t* counter = static_cast<counter_t*>(context);
+				if (counter->running.fetch_add(1) != 0)
+					counter->overlaps++;
+				std::this_thread::yield();
+				counter->running.fetch_sub(1);
+				return ++counter->steps == 500 ? session_step_finished : session_step_continue;
+			}, &counters[i]);
+		}
+
+		session_stats_t stats = {};
+		for (int32_t i = 0; i < count; i++)
+		{
+			while (scheduler.get_session_stats(i, &stats) && !stats.finished)
+				std::this_thread::yield();
+			TEST_CHECK(state, stats.steps == 500 && !stats.failed);
+		}
+		scheduler.stop();
+		for (const counter_t& counter : counters)
+			TEST_CHECK(state, counter.steps == 500 && counter.overlaps == 0);
+		session_scheduler_stats_t totals = scheduler.get_stats();
+		TEST_CHECK(state, totals.steps == count * 500u);
+		TEST_CHECK(state, totals.threads == 4 && totals.sessions == count && totals.runnable == 0);
+	}
+
+	struct test_backpressure_t {
+		spsc_ring<uint32_t>* ring;
+		uint32_t next;
+		uint32_t count;
+	};
+
+	static session_step_ test_backpressure_step(void* context)
+	{
+		test_backpressure_t* producer = static_cast<test_backpressure_t*>(context);
+		if (!producer->ring->try_push(producer->next))
+			return session_step_blocked;
+		return ++producer->next == producer->count ? session_step_finished : session_step_continue;
+	}
+
+	// A producer that fills its consumer's ring blocks until the consumer
+	// wakes it, and no wake is lost however the two interleave
+	static void test_session_scheduler_backpressure(test_state_t* state, void*)
+	{
+		const uint32_t count = 20000;
+		spsc_ring<uint32_t> ring(4);
+		test_backpressure_t producer = { &ring, 0, count };
+		session_scheduler scheduler(2);
+		int32_t id = scheduler.add(test_backpressure_step, &producer);
+
+		uint32_t expected = 0;
+		uint32_t out_of_order = 0;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+		while (expected < count && std::chrono::steady_clock::now() < deadline)
+		{
+			uint32_t value;
+			if (!ring.try_pop(value))
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			if (value != expected)
+				out_of_order++;
+			expected++;
+			scheduler.wake(id);
+		}
+		TEST_CHECK(state, expected == count);
+		TEST_CHECK(state, out_of_order == 0);
+
+		session_stats_t stats = {};
+		while (scheduler.get_session_stats(id, &stats) && !stats.finished && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::yield();
+		TEST_CHECK(state, stats.finished);
+		TEST_CHECK(state, stats.blocks > 0 && stats.wakes > 0);
+		// Every step either pushed or blocked
+		TEST_CHECK(state, stats.steps == count + stats.blocks);
+		// Woken only out of blocks, at most once each
+		TEST_CHECK(state, stats.wakes <= stats.blocks);
+
+		// Wakes for sessions that aren't blocked, or don't exist, do nothing
+		scheduler.wake(id);
+		scheduler.wake(-1);
+		scheduler.wake(1000);
+		TEST_CHECK(state, scheduler.get_session_stats(id, &stats) && stats.finished);
+	}
+
+	// A step that throws retires its session only, and removing sessions in
+	// any state frees their ids for reuse
+	static void test_session_scheduler_remove(test_state_t* state, void*)
+	{
+		session_scheduler scheduler(2);
+		int32_t thrower = scheduler.add([](void*) -> session_step_ { throw std::runtime_error("step failed"); }, nullptr);
+		int32_t blocked = scheduler.add([](void*) { return session_step_blocked; }, nullptr);
+		std::atomic<uint32_t> spins = 0;
+		int32_t spinner = scheduler.add([](void* context) {
+			static_cast<std::atomic<uint32_t>*>(context)->fetch_add(1);
+			return session_step_continue;
+		}, &spins);
+
+		session_stats_t stats = {};
+		while (scheduler.get_session_stats(thrower, &stats) && !stats.finished)
+			std::this_thread::yield();
+		TEST_CHECK(state, stats.failed && stats.steps == 1);
+		while (scheduler.get_session_stats(blocked, &stats) && stats.blocks == 0)
+			std::this_thread::yield();
+		while (spins.load() < 100)
+			std::this_thread::yield();
+		TEST_CHECK(state, scheduler.get_stats().sessions == 3);
+
+		// Running, blocked and finished alike
+		scheduler.remove(spinner);
+		uint32_t after = spins.load();
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		TEST_CHECK(state, spins.load() == after);
+		scheduler.remove(blocked);
+		scheduler.remove(thrower);
+		TEST_CHECK(state, scheduler.get_stats().sessions == 0);
+
+		int32_t reused = scheduler.add([](void*) { return session_step_finished; }, nullptr);
+		TEST_CHECK(state, reused >= 0 && reused < 3);
+		while (scheduler.get_session_stats(reused, &stats) && !stats.finished)
+			std::this_thread::yield();
+		TEST_CHECK(state, !stats.failed && stats.steps == 1);
+	}
+
+	///////////////////////////////////////////
+	// Quad batch
+	///////////////////////////////////////////
+
+	static bool test_near(float a, float b)
+	{
+		return std::fabs(a - b) < 1e-5f;
+	}
+
+	// Quads come out grouped by material, one draw per group, in the order
+	// they were added within each; indices restart at every draw
+	static void test_quad_batch_grouping(test_state_t* state, void*)
+	{
+		int materials[3];
+		const float uv_rect[4] = { 0, 0, 1, 1 };
+		float transform[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+		const int pattern[] = { 2, 0, 1, 0, 2, 2, 1, 0 };
+		quad_batch batch;
+		for (int i = 0; i < 8; i++)
+		{
+			transform[12] = static_cast<float>(i);
+			batch.add(&materials[pattern[i]], transform, uv_rect);
+		}
+		batch.build();
+
+		quad_batch_stats_t stats = batch.get_stats();
+		TEST_CHECK(state, stats.quads == 8);
+		TEST_CHECK(state, stats.materials == 3);
+		if (!TEST_CHECK(state, stats.draws == 3 && batch.draws().size() == 3))
+			return;
+		TEST_CHECK(state, batch.vertices().size() == 8 * 4);
+		TEST_CHECK(state, batch.indices().size() == 8 * 6);
+
+		uint32_t next = 0;
+		for (const quad_batch_draw_t& draw : batch.draws())
+		{
+			TEST_CHECK(state, draw.first == next);
+			float last_x = -1;
+			for (uint32_t q = draw.first; q < draw.first + draw.count; q++)
+			{
+				// Quad q sits at x = the order it was added in, plus its corner
+				const quad_vertex_t* quad = &batch.vertices()[q * 4];
+				float x = quad[0].pos[0] + 0.5f;
+				int added = static_cast<int>(std::lround(x));
+				TEST_CHECK(state, &materials[pattern[added]] == draw.material);
+				TEST_CHECK(state, x > last_x);
+				last_x = x;
+				for (int k = 0; k < 6; k++)
+					TEST_CHECK(state, batch.indices()[q * 6 + k] == (q - draw.first) * 4 + quad_batch_indices[k]);
+			}
+			next += draw.count;
+		}
+		TEST_CHECK(state, next == 8);
+	}
+
+	// A material's run longer than the limit splits into several draws, each
+	// indexing from its own first vertex
+	static void test_quad_batch_split(test_state_t* state, void*)
+	{
+		int material;
+		const float uv_rect[4] = { 0, 0, 1, 1 };
+		const float transform[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+		quad_batch batch(4);
+		for (int i = 0; i < 10; i++)
+			batch.add(&material, transform, uv_rect);
+		batch.build();
+
+		if (!TEST_CHECK(state, batch.draws().size() == 3))
+			return;
+		TEST_CHECK(state, batch.draws()[0].first == 0 && batch.draws()[0].count == 4);
+		TEST_CHECK(state, batch.draws()[1].first == 4 && batch.draws()[1].count == 4);
+		TEST_CHECK(state, batch.draws()[2].first == 8 && batch.draws()[2].count == 2);
+		TEST_CHECK(state, batch.get_stats().materials == 1);
+		uint32_t highest = 0;
+		for (uint32_t index : batch.indices())
+			highest = index > highest ? index : highest;
+		TEST_CHECK(state, highest == 4 * 4 - 1);
+	}
+
+	// Corners land where SK's default quad would under the same matrix, with
+	// the normal following the quad and the UVs inside the rect
+	static void test_quad_batch_vertices(test_state_t* state, void*)
+	{
+		int material;
+		// Scale x by 2, turn 90 degrees about y, then move to (10, 20, 30)
+		const float transform[16] = {
+			0, 0, -2, 0,
+			0, 1, 0, 0,
+			1, 0, 0, 0,
+			10, 20, 30, 1 };
+		const float uv_rect[4] = { 0.25f, 0.5f, 0.25f, 0.125f };
+		quad_batch batch;
+		batch.add(&material, transform, uv_rect);
+		batch.build();
+		if (!TEST_CHECK(state, batch.vertices().size() == 4))
+			return;
+
+		for (int i = 0; i < 4; i++)
+		{
+			const quad_vertex_t& vertex = batch.vertices()[i];
+			float cx = quad_batch_corners[i][0];
+			float cy = quad_batch_corners[i][1];
+			TEST_CHECK(state, test_near(vertex.pos[0], 10));
+			TEST_CHECK(state, test_near(vertex.pos[1], 20 + cy));
+			TEST_CHECK(state, test_near(vertex.pos[2], 30 - 2 * cx));
+			TEST_CHECK(state, test_near(vertex.norm[0], -1) && test_near(vertex.norm[1], 0) && test_near(vertex.norm[2], 0));
+			TEST_CHECK(state, test_near(vertex.uv[0], 0.25f + quad_batch_uvs[i][0] * 0.25f));
+			TEST_CHECK(state, test_near(vertex.uv[1], 0.5f + quad_batch_uvs[i][1] * 0.125f));
+			TEST_CHECK(state, vertex.color[0] == 255 && vertex.color[3] == 255);
+		}
+
+		// Without a transform it is the default quad itself
+		quad_vertex_t quad[4];
+		const float whole[4] = { 0, 0, 1, 1 };
+		quad_batch_write_quad(nullptr, whole, quad);
+		for (int i = 0; i < 4; i++)
+		{
+			TEST_CHECK(state, quad[i].pos[0] == quad_batch_corners[i][0] && quad[i].pos[1] == quad_batch_corners[i][1] && quad[i].pos[2] == 0);
+			TEST_CHECK(state, quad[i].norm[2] == -1);
+			TEST_CHECK(state, quad[i].uv[0] == quad_batch_uvs[i][0] && quad[i].uv[1] == quad_batch_uvs[i][1]);
+		}
+	}
+
+	// Nothing added builds nothing, and a cleared batch starts over
+	static void test_quad_batch_reuse(test_state_t* state, void*)
+	{
+		int materials[2];
+		const float uv_rect[4] = { 0, 0, 1, 1 };
+		const float transform[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+		quad_batch batch;
+		batch.build();
+		TEST_CHECK(state, batch.draws().empty() && batch.vertices().empty());
+		TEST_CHECK(state, batch.get_stats().quads == 0 && batch.get_stats().materials == 0);
+
+		for (int frame = 0; frame < 3; frame++)
+		{
+			for (int i = 0; i <= frame; i++)
+				batch.add(&materials[i & 1], transform, uv_rect);
+			batch.build();
+			TEST_CHECK(state, batch.get_stats().quads == static_cast<uint32_t>(frame + 1));
+			TEST_CHECK(state, batch.draws().size() == (frame == 0 ? 1u : 2u));
+			batch.clear();
+			TEST_CHECK(state, batch.get_stats().quads == 0 && batch.draws().empty());
+		}
+	}
+
+	void test_register_pipeline()
+	{
+		test_register("spsc_ring/single_thread", test_spsc_ring_single);
+		test_register("spsc_ring/threads", test_spsc_ring_threads);
+		test_register("frame_mailbox/latest", test_frame_mailbox_latest);
+		test_register("frame_mailbox/threads", test_frame_mailbox_threads);
+		test_register("slot_ring/retire", test_slot_ring_retire);
+		test_register("slot_ring/stats", test_slot_ring_stats);
+		test_register("slot_ring/threads", test_slot_ring_threads);
+		test_register("frame_presenter/pacing", test_frame_presenter_pacing);
+		test_register("frame_presenter/order", test_frame_presenter_order);
+		test_register("frame_presenter/threads", test_frame_presenter_threads);
+		test_register("metrics/percentiles", test_metrics_percentiles);
+		test_register("metrics/summary", test_metrics_summary);
+		test_register("metrics/latency_tracker", test_metrics_latency_tracker);
+		test_register("sim_transform/sync", test_sim_transform_sync, nullptr);
+		test_register("sim_transform/provides_samples", test_sim_transform_sync, (void*)1);
+		test_register("sim_transform/pairs", test_sim_transform_pairs);
+		test_register("sim_transform/backpressure", test_sim_transform_backpressure);
+		test_register("sim_transform/async", test_sim_transform_async);
+		test_register("transform_driver/sync", test_transform_driver, nullptr);
+		test_register("transform_driver/async", test_transform_driver, (void*)1);
+		test_register("transform_driver/event_thread_error", test_transform_driver_error);
+		test_register("transform_driver/capacity", test_transform_driver_capacity);
+		test_register("transform_driver/unlocked_input", test_transform_driver_unlocked_input);
+		test_register("session_scheduler/fairness", test_session_scheduler_fairness);
+		test_register("session_scheduler/workers", test_session_scheduler_workers);
+		test_register("session_scheduler/backpressure", test_session_scheduler_backpressure);
+		test_register("session_scheduler/remove", test_session_scheduler_remove);
+		test_register("quad_batch/grouping", test_quad_batch_grouping);
+		test_register("quad_batch/split", test_quad_batch_split);
+		test_register("quad_batch/vertices", test_quad_batch_vertices);
+		test_register("quad_batch/reuse", test_quad_batch_reuse);
+	}
+
+} // namespace nakamir
@@ -0,0 +1,408 @@
+#include "tests.h"
+#include "../codec_registry.h"
+#include "../startup_graph.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// What runs once at startup: the codec ranking cache, driven through a stub
+// enumerator in place of MFTEnumEx, and the step graph that brings a session up
+
+namespace nakamir {
+
+	///////////////////////////////////////////
+	// Codec registry
+	///////////////////////////////////////////
+
+	// Answers every key with a fixed list, counting how often it was asked
+	class test_codec_enumerator : public codec_enumerator {
+	public:
+		std::vector<codec_candidate_t> found;
+		uint32_t calls = 0;
+		bool fail = false;
+
+		bool enumerate(const char* /*key*/, std::vector<codec_candidate_t>* candidates) override
+		{
+			calls++;
+			*candidates = found;
+			return !fail;
+		}
+	};
+
+	static codec_candidate_t test_codec(const char* id, uint32_t flags)
+	{
+		codec_candidate_t candidate = {};
+		candidate.id = id;
+		candidate.name = std::string("Codec ") + id;
+		candidate.flags = flags;
+		return candidate;
+	}
+
+	// In enumeration order: a software codec first, as MFTEnumEx may well put
+	// it, two hardware ones, and one whose id couldn't be read back from a file
+	static void test_codec_fill(test_codec_enumerator* enumerator)
+	{
+		enumerator->found = {
+			test_codec("soft", codec_flag_async),
+			test_codec("hw_a", codec_flag_hardware),
+			test_codec("hw_b", codec_flag_hardware | codec_flag_async),
+			test_codec("bad id", codec_flag_hardware),
+		};
+	}
+
+	static std::vector<std::string> test_codec_ids(codec_registry* registry, const char* key)
+	{
+		std::vector<codec_candidate_t> ranked;
+		std::vector<std::string> ids;
+		registry->candidates(key, nullptr, &ranked);
+		for (const codec_candidate_t& candidate : ranked)
+			ids.push_back(candidate.id);
+		return ids;
+	}
+
+	static std::string test_codec_cache_path()
+	{
+		return (std::filesystem::temp_directory_path() / "skmf_tests_codec_cache.txt").string();
+	}
+
+	// Hardware ranks first, then asynchronous; ids that can't be stored are
+	// dropped, and a second lookup is answered without enumerating
+	static void test_codec_registry_rank(test_state_t* state, void*)
+	{
+		test_codec_enumerator enumerator;
+		test_codec_fill(&enumerator);
+		codec_registry registry;
+		const char* key = "encoder:NV12:H264";
+
+		std::vector<codec_candidate_t> ranked;
+		TEST_CHECK(state, registry.candidates(key, &enumerator, &ranked));
+		TEST_CHECK(state, enumerator.calls == 1);
+		if (TEST_CHECK(state, ranked.size() == 3))
+		{
+			TEST_CHECK(state, ranked[0].id == "hw_b");
+			TEST_CHECK(state, ranked[1].id == "hw_a");
+			TEST_CHECK(state, ranked[2].id == "soft");
+			TEST_CHECK(state, ranked[0].order == 2);
+			TEST_CHECK(state, ranked[2].order == 0);
+		}
+
+		TEST_CHECK(state, registry.candidates(key, &enumerator, &ranked));
+		TEST_CHECK(state, enumerator.calls == 1);
+		TEST_CHECK(state, ranked.size() == 3);
+
+		// Another key enumerates for itself
+		TEST_CHECK(state, registry.candidates("decoder:H264:NV12", &enumerator, &ranked));
+		TEST_CHECK(state, enumerator.calls == 2);
+
+		codec_registry_stats_t stats = registry.get_stats();
+		TEST_CHECK(state, stats.lookups == 3);
+		TEST_CHECK(state, stats.hits == 1);
+		TEST_CHECK(state, stats.enumerations == 2);
+
+		// Nothing usable, or a failed enumeration, caches nothing
+		enumerator.found = { test_codec("bad id", codec_flag_hardware) };
+		TEST_CHECK(state, !registry.candidates("encoder:NV12:HEVC", &enumerator, &ranked));
+		TEST_CHECK(state, ranked.empty());
+		test_codec_fill(&enumerator);
+		enumerator.fail = true;
+		TEST_CHECK(state, !registry.candidates("encoder:NV12:HEVC", &enumerator, &ranked));
+		TEST_CHECK(state, !registry.candidates("encoder:NV12:HEVC", nullptr, &ranked));
+	}
+
+	// A failure demotes a candidate behind every one that hasn't failed, a
+	// success clears it, and measured activation time breaks ties
+	static void test_codec_registry_activation(test_state_t* state, void*)
+	{
+		test_codec_enumerator enumerator;
+		test_codec_fill(&enumerator);
+		enumerator.found[1].flags |= codec_flag_async;
+		codec_registry registry;
+		const char* key = "encoder:NV12:H264";
+		std::vector<codec_candidate_t> ranked;
+		registry.candidates(key, &enumerator, &ranked);
+		// Equal flags, so enumeration order decides until one is measured
+		TEST_CHECK(state, (test_codec_ids(&registry, key) == std::vector<std::string>{ "hw_a", "hw_b", "soft" }));
+
+		registry.record_activation(key, "hw_b", true, 2000);
+		TEST_CHECK(state, (test_codec_ids(&registry, key) == std::vector<std::string>{ "hw_b", "hw_a", "soft" }));
+		registry.record_activation(key, "hw_a", true, 1000);
+		TEST_CHECK(state, (test_codec_ids(&registry, key) == std::vector<std::string>{ "hw_a", "hw_b", "soft" }));
+
+		registry.record_activation(key, "hw_a", false, 0);
+		registry.record_activation(key, "hw_b", false, 0);
+		// Both failed once, so the faster one leads again
+		TEST_CHECK(state, (test_codec_ids(&registry, key) == std::vector<std::string>{ "soft", "hw_a", "hw_b" }));
+		registry.record_activation(key, "hw_a", true, 1000);
+		TEST_CHECK(state, (test_codec_ids(&registry, key) == std::vector<std::string>{ "hw_a", "soft", "hw_b" }));
+
+		// The live object can add flags but not take hardware away
+		registry.record_activation(key, "soft", true, 500, codec_flag_d3d_aware);
+		registry.candidates(key, nullptr, &ranked);
+		if (TEST_CHECK(state, ranked.size() == 3 && ranked[1].id == "soft"))
+			TEST_CHECK(state, ranked[1].flags == codec_flag_d3d_aware);
+		registry.record_activation(key, "hw_a", true, 1000, codec_flag_async);
+		registry.candidates(key, nullptr, &ranked);
+		TEST_CHECK(state, ranked[0].flags == (codec_flag_hardware | codec_flag_async));
+
+		// Unknown keys and ids are counted and otherwise ignored
+		registry.record_activation("decoder:H264:NV12", "hw_a", false, 0);
+		registry.record_activation(key, "missing", false, 0);
+		codec_registry_stats_t stats = registry.get_stats();
+		TEST_CHECK(state, stats.activations == 9);
+		TEST_CHECK(state, stats.failures == 4);
+
+		registry.invalidate(key);
+		TEST_CHECK(state, !registry.candidates(key, nullptr, &ranked));
+		TEST_CHECK(state, registry.candidates(key, &enumerator, &ranked));
+		TEST_CHECK(state, enumerator.calls == 2);
+	}
+
+	// Rankings saved under one environment load under it, ids and names
+	// intact, and are thrown away under another
+	static void test_codec_registry_persist(test_state_t* state, void*)
+	{
+		std::string path = test_codec_cache_path();
+		remove(path.c_str());
+		const char* key = "encoder:NV12:H264";
+		{
+			test_codec_enumerator enumerator;
+			test_codec_fill(&enumerator);
+			enumerator.found[0].name = "Soft\r\nwith a line break";
+			codec_registry registry;
+			TEST_CHECK(state, !registry.load(path.c_str(), "os 1 gpu 2"));
+			TEST_CHECK(state, registry.get_stats().rejected == 0);
+			std::vector<codec_candidate_t> ranked;
+			registry.candidates(key, &enumerator, &ranked);
+			registry.record_activation(key, "hw_a", false, 0);
+			registry.record_activation(key, "soft", true, 1500);
+			TEST_CHECK(state, registry.save());
+			TEST_CHECK(state, registry.get_stats().saves == 1);
+			// Unchanged since, so nothing to write
+			TEST_CHECK(state, registry.save());
+			TEST_CHECK(state, registry.get_stats().saves == 1);
+		}
+		{
+			codec_registry registry;
+			TEST_CHECK(state, registry.load(path.c_str(), "os 1 gpu 2"));
+			TEST_CHECK(state, registry.get_stats().loads == 1);
+			std::vector<codec_candidate_t> ranked;
+			test_codec_enumerator enumerator;
+			TEST_CHECK(state, registry.candidates(key, &enumerator, &ranked));
+			TEST_CHECK(state, enumerator.calls == 0);
+			if (TEST_CHECK(state, ranked.size() == 3))
+			{
+				TEST_CHECK(state, ranked[0].id == "hw_b");
+				TEST_CHECK(state, ranked[1].id == "soft");
+				TEST_CHECK(state, ranked[1].name == "Soft  with a line break");
+				TEST_CHECK(state, ranked[1].init_us == 1500);
+				TEST_CHECK(state, ranked[1].order == 0);
+				TEST_CHECK(state, ranked[2].id == "hw_a");
+				TEST_CHECK(state, ranked[2].failures == 1);
+				TEST_CHECK(state, ranked[2].flags == codec_flag_hardware);
+			}
+		}
+		{
+			codec_registry registry;
+			TEST_CHECK(state, !registry.load(path.c_str(), "os 1 gpu 3"));
+			TEST_CHECK(state, registry.get_stats().rejected == 1);
+			std::vector<codec_candidate_t> ranked;
+			TEST_CHECK(state, !registry.candidates(key, nullptr, &ranked));
+		}
+
+		// A torn file is rejected whole
+		FILE* file = fopen(path.c_str(), "wb");
+		if (TEST_CHECK(state, file != nullptr))
+		{
+			fprintf(file, "skmf-codec-cache 1\nenvironment os 1 gpu 2\nkey %s\ncandidate 1 0 0\n", key);
+			fclose(file);
+			codec_registry registry;
+			TEST_CHECK(state, !registry.load(path.c_str(), "os 1 gpu 2"));
+			TEST_CHECK(state, registry.get_stats().rejected == 1);
+			TEST_CHECK(state, registry.get_stats().loads == 0);
+		}
+		remove(path.c_str());
+	}
+
+	///////////////////////////////////////////
+	// Startup graph
+	///////////////////////////////////////////
+
+	struct test_startup_log_t {
+		std::mutex mutex;
+		std::vector<int32_t> order;       // Steps as they ran
+		std::vector<std::thread::id> threads;
+	};
+
+	struct test_startup_step_t {
+		test_startup_log_t* log;
+		int32_t index;
+		bool succeeds;
+	};
+
+	static bool test_startup_step(void* context)
+	{
+		test_startup_step_t* step = static_cast<test_startup_step_t*>(context);
+		std::lock_guard<std::mutex> lock(step->log->mutex);
+		step->log->order.push_back(step->index);
+		step->log->threads.push_back(std::this_thread::get_id());
+		return step->succeeds;
+	}
+
+	static bool test_startup_throw(void*)
+	{
+		throw std::runtime_error("step failed");
+	}
+
+	static bool test_startup_noop(void*)
+	{
+		return true;
+	}
+
+	static size_t test_startup_position(const test_startup_log_t& log, int32_t index)
+	{
+		for (size_t i = 0; i < log.order.size(); i++)
+		{
+			if (log.order[i] == index)
+				return i;
+		}
+		return SIZE_MAX;
+	}
+
+	// Steps that take no time finish on the same microsecond, so the critical
+	// path walk can't lean on timestamps to get back to the start
+	static void test_startup_graph_noop(test_state_t* state, void* context)
+	{
+		uint32_t workers = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(context));
+		for (uint32_t round = 0; round < 50; round++)
+		{
+			startup_graph graph;
+			for (uint32_t i = 0; i < 6; i++)
+				graph.add("noop", test_startup_noop, nullptr, {}, i % 2 == 0);
+			TEST_CHECK(state, graph.run(workers));
+			std::vector<startup_step_stats_t> stats = graph.get_step_stats();
+			uint32_t critical = 0;
+			for (const startup_step_stats_t& step : stats)
+				critical += step.critical ? 1 : 0;
+			if (!TEST_CHECK(state, critical >= 1 && critical <= 6) || !TEST_CHECK(state, !graph.to_text().empty()))
+				return;
+		}
+	}
+
+	// Steps run after everything they come after, main thread ones on the
+	// caller, and a chain is critical end to end
+	static void test_startup_graph_order(test_state_t* state, void*)
+	{
+		test_startup_log_t log;
+		test_startup_step_t contexts[7] = {};
+		for (int32_t i = 0; i < 7; i++)
+			contexts[i] = { &log, i, true };
+
+		startup_graph graph;
+		int32_t a = graph.add("a", test_startup_step, &contexts[0]);
+		int32_t b = graph.add("b", test_startup_step, &contexts[1], { a });
+		int32_t c = graph.add("c", test_startup_step, &contexts[2], { a }, true);
+		int32_t d = graph.add("d", test_startup_step, &contexts[3], { b, c });
+		int32_t e = graph.add("e", test_startup_step, &contexts[4]);
+		int32_t f = graph.add("f", test_startup_step, &contexts[5], { e }, true);
+		int32_t g = graph.add("g", test_startup_step, &contexts[6], { d, f });
+		TEST_CHECK(state, g == 6);
+		TEST_CHECK(state, graph.add("bad", test_startup_noop, nullptr, { 7 }) == -1);
+		TEST_CHECK(state, graph.add("bad", test_startup_noop, nullptr, { -1 }) == -1);
+
+		TEST_CHECK(state, graph.run(2));
+		if (!TEST_CHECK(state, log.order.size() == 7))
+			return;
+		TEST_CHECK(state, test_startup_position(log, a) < test_startup_position(log, b));
+		TEST_CHECK(state, test_startup_position(log, a) < test_startup_position(log, c));
+		TEST_CHECK(state, test_startup_position(log, b) < test_startup_position(log, d));
+		TEST_CHECK(state, test_startup_position(log, c) < test_startup_position(log, d));
+		TEST_CHECK(state, test_startup_position(log, e) < test_startup_position(log, f));
+		TEST_CHECK(state, test_startup_position(log, d) < test_startup_position(log, g));
+		TEST_CHECK(state, test_startup_position(log, f) < test_startup_position(log, g));
+		TEST_CHECK(state, log.threads[test_startup_position(log, c)] == std::this_thread::get_id());
+		TEST_CHECK(state, log.threads[test_startup_position(log, f)] == std::this_thread::get_id());
+
+		std::vector<startup_step_stats_t> stats = graph.get_step_stats();
+		for (const startup_step_stats_t& step : stats)
+		{
+			TEST_CHECK(state, step.state == startup_step_state_ran);
+			TEST_CHECK(state, step.ready_us <= step.start_us && step.start_us <= step.end_us);
+			if (step.main_thread)
+				TEST_CHECK(state, step.thread == 0);
+		}
+		TEST_CHECK(state, stats[d].start_us >= stats[b].end_us && stats[d].start_us >= stats[c].end_us);
+		// g finishes last, and d or f held it up, whichever ended later
+		TEST_CHECK(state, stats[g].critical);
+		TEST_CHECK(state, stats[d].critical || stats[f].critical);
+	}
+
+	// A failed or throwing step skips everything after it, and nothing else
+	static void test_startup_graph_failure(test_state_t* state, void*)
+	{
+		test_startup_log_t log;
+		test_startup_step_t contexts[4] = {
+			{ &log, 0, false },
+			{ &log, 1, true },
+			{ &log, 2, true },
+			{ &log, 3, true },
+		};
+		startup_graph graph;
+		int32_t failed = graph.add("failed", test_startup_step, &contexts[0]);
+		int32_t thrown = graph.add("thrown", test_startup_throw, nullptr);
+		int32_t after_failed = graph.add("after_failed", test_startup_step, &contexts[1], { failed });
+		int32_t after_both = graph.add("after_both", test_startup_step, &contexts[2], { after_failed, thrown }, true);
+		int32_t independent = graph.add("independent", test_startup_step, &contexts[3]);
+
+		static std::atomic<uint32_t> begins;
+		static std::atomic<uint32_t> ends;
+		begins = 0;
+		ends = 0;
+		TEST_CHECK(state, !graph.run(2,
+			[]() { begins++; },
+			[]() { ends++; }));
+		TEST_CHECK(state, begins == 2 && ends == 2);
+		TEST_CHECK(state, (log.order == std::vector<int32_t>{ 0, 3 } || log.order == std::vector<int32_t>{ 3, 0 }));
+
+		std::vector<startup_step_stats_t> stats = graph.get_step_stats();
+		TEST_CHECK(state, stats[failed].state == startup_step_state_failed);
+		TEST_CHECK(state, stats[thrown].state == startup_step_state_failed);
+		TEST_CHECK(state, stats[after_failed].state == startup_step_state_skipped);
+		TEST_CHECK(state, stats[after_both].state == startup_step_state_skipped);
+		TEST_CHECK(state, stats[independent].state == startup_step_state_ran);
+		TEST_CHECK(state, graph.to_text().find("skipped") != std::string::npos);
+	}
+
+	// Only the first mark of a name counts
+	static void test_startup_graph_marks(test_state_t* state, void*)
+	{
+		startup_graph graph;
+		graph.add("noop", test_startup_noop, nullptr);
+		TEST_CHECK(state, graph.run(1));
+		uint64_t first = graph.mark("first_frame");
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		TEST_CHECK(state, graph.mark("first_frame") == first);
+		TEST_CHECK(state, graph.mark("second_frame") >= first + 1000);
+		std::vector<startup_mark_t> marks = graph.get_marks();
+		TEST_CHECK(state, marks.size() == 2);
+		TEST_CHECK(state, graph.to_text().find("second_frame") != std::string::npos);
+	}
+
+	void test_register_startup()
+	{
+		test_register("codec_registry/rank", test_codec_registry_rank);
+		test_register("codec_registry/activation", test_codec_registry_activation);
+		test_register("codec_registry/persist", test_codec_registry_persist);
+		test_register("startup_graph/noop_one_worker", test_startup_graph_noop, (void*)1);
+		test_register("startup_graph/noop_workers", test_startup_graph_noop, (void*)4);
+		test_register("startup_graph/order", test_startup_graph_order);
+		test_register("startup_graph/failure", test_startup_graph_failure);
+		test_register("startup_graph/marks", test_startup_graph_marks);
+	}
+
+} // namespace nakamir
@@ -0,0 +1,104 @@
+#include "tests.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace nakamir {
+
+	struct test_case_t {
+		std::string name;
+		test_fn fn;
+		void* context;
+	};
+
+	static std::vector<test_case_t>& test_cases()
+	{
+		static std::vector<test_case_t> cases;
+		return cases;
+	}
+
+	void test_register(const char* name, test_fn fn, void* context)
+	{
+		test_cases().push_back({ name, fn, context });
+	}
+
+	bool test_check(test_state_t* state, bool ok, const char* expression, const char* file, int line)
+	{
+		state->checks++;
+		if (!ok)
+		{
+			state->failures++;
+			fprintf(stderr, "  %s:%d: check failed: %s\n", file, line, expression);
+		}
+		return ok;
+	}
+
+	void test_skip(test_state_t* state, const char* reason)
+	{
+		state->skip_reason = reason;
+	}
+
+	void test_fill_random(uint8_t* data, size_t size, uint64_t seed)
+	{
+		// splitmix64, as the bench fixtures use
+		uint64_t x = seed;
+		for (size_t i = 0; i < size; i++)
+		{
+			if ((i & 7) == 0)
+			{
+				x += 0x9E3779B97F4A7C15ull;
+				uint64_t z = x;
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+				seed = z ^ (z >> 31);
+			}
+			data[i] = static_cast<uint8_t>(seed >> ((i & 7) * 8));
+		}
+	}
+
+	static int test_main(int argc, char** argv)
+	{
+		const char* filter = argc > 1 ? argv[1] : nullptr;
+
+		test_register_memory();
+		test_register_pipeline();
+		test_register_bitstream();
+		test_register_network();
+		test_register_startup();
+
+		uint32_t run = 0;
+		uint32_t skipped = 0;
+		uint32_t failed = 0;
+		for (const test_case_t& c : test_cases())
+		{
+			if (filter && !strstr(c.name.c_str(), filter))
+				continue;
+			test_state_t state = {};
+			state.name = c.name.c_str();
+			fprintf(stderr, "%s\n", state.name);
+			c.fn(&state, c.context);
+			if (state.failures)
+			{
+				printf("FAIL %s (%u of %u checks)\n", state.name, state.failures, state.checks);
+				failed++;
+			}
+			else if (state.skip_reason)
+			{
+				printf("skip %s: %s\n", state.name, state.skip_reason);
+				skipped++;
+			}
+			else
+				printf("ok   %s (%u checks)\n", state.name, state.checks);
+			run++;
+		}
+		printf("%u cases, %u failed, %u skipped\n", run, failed, skipped);
+		return failed || run == 0 ? 1 : 0;
+	}
+
+} // namespace nakamir
+
+int main(int argc, char** argv)
+{
+	return nakamir::test_main(argc, argv);
+}
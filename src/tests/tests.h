@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Small self-contained test harness for skmf_tests, run by ctest. Every case
+// checks a piece of the core against a reference or a simulated peer, on the
+// CPU alone, so it runs wherever the core builds. Inputs are seeded, so a
+// failure reproduces.
+
+namespace nakamir {
+
+	struct test_state_t {
+		const char* name;
+		uint32_t checks;
+		uint32_t failures;
+		const char* skip_reason;      // Set through test_skip
+	};
+
+	typedef void(*test_fn)(test_state_t* state, void* context);
+
+	// Adds a case. Names are slash separated, group first, like the bench
+	// cases, and an argument to skmf_tests matches on any substring.
+	void test_register(const char* name, test_fn fn, void* context = nullptr);
+
+	// Records a check, printing where it failed. Returns ok so a case can
+	// stop at the first failure that would make the rest meaningless.
+	bool test_check(test_state_t* state, bool ok, const char* expression, const char* file, int line);
+
+	// Marks the case as not runnable here, e.g. a SIMD path the CPU lacks
+	void test_skip(test_state_t* state, const char* reason);
+
+	// Fixed seed random bytes
+	void test_fill_random(/**[out]**/ uint8_t* data, size_t size, uint64_t seed);
+
+	// Registration of each group of cases, called once from main
+	void test_register_memory();
+	void test_register_pipeline();
+	void test_register_bitstream();
+	void test_register_network();
+	void test_register_startup();
+
+} // namespace nakamir
+
+#define TEST_CHECK(state, expression) nakamir::test_check((state), (expression), #expression, __FILE__, __LINE__)
@@ -0,0 +1,265 @@
+#include "tile_diff.h"
+#include "cpu_features.h"
+#include "plane_copy.h"
+#include <algorithm>
+#include <atomic>
+
+#if SKMF_X86
+#include <emmintrin.h>
+#endif
+#if SKMF_NEON
+#include <arm_neon.h>
+#endif
+
+namespace nakamir {
+
+	static std::atomic<int> _tile_diff_impl = tile_diff_impl_auto;
+
+	static bool tile_diff_impl_supported(tile_diff_impl_ impl)
+	{
+		switch (impl)
+		{
+		case tile_diff_impl_auto:
+		case tile_diff_impl_scalar: return true;
+		case tile_diff_impl_sse2:   return SKMF_X86 && cpu_has(cpu_feature_sse2);
+		case tile_diff_impl_avx2:   return SKMF_X86 && cpu_has(cpu_feature_avx2);
+		case tile_diff_impl_neon:   return SKMF_NEON && cpu_has(cpu_feature_neon);
+		default:                    return false;
+		}
+	}
+
+	static tile_diff_impl_ tile_diff_resolve(tile_diff_impl_ impl)
+	{
+		if (impl != tile_diff_impl_auto)
+			return impl;
+		if (tile_diff_impl_supported(tile_diff_impl_avx2)) return tile_diff_impl_avx2;
+		if (tile_diff_impl_supported(tile_diff_impl_sse2)) return tile_diff_impl_sse2;
+		if (tile_diff_impl_supported(tile_diff_impl_neon)) return tile_diff_impl_neon;
+		return tile_diff_impl_scalar;
+	}
+
+	static tile_diff_block_fn tile_diff_block_kernel(tile_diff_impl_ impl)
+	{
+		switch (impl)
+		{
+		case tile_diff_impl_sse2: return tile_diff_block_sse2;
+		case tile_diff_impl_avx2: return tile_diff_block_avx2;
+		case tile_diff_impl_neon: return tile_diff_block_neon;
+		default:                  return tile_diff_block_scalar;
+		}
+	}
+
+	bool tile_diff_set_impl(tile_diff_impl_ impl)
+	{
+		if (!tile_diff_impl_supported(impl))
+			return false;
+		_tile_diff_impl = impl;
+		return true;
+	}
+
+	tile_diff_impl_ tile_diff_get_impl()
+	{
+		return tile_diff_resolve(static_cast<tile_diff_impl_>(_tile_diff_impl.load()));
+	}
+
+	const char* tile_diff_impl_name(tile_diff_impl_ impl)
+	{
+		switch (impl)
+		{
+		case tile_diff_impl_auto:   return "auto";
+		case tile_diff_impl_scalar: return "scalar";
+		case tile_diff_impl_sse2:   return "sse2";
+		case tile_diff_impl_avx2:   return "avx2";
+		case tile_diff_impl_neon:   return "neon";
+		default:                    return "unknown";
+		}
+	}
+
+	///////////////////////////////////////////
+	// tile_differ
+	///////////////////////////////////////////
+
+	void tile_differ::reset(uint32_t width, uint32_t height, uint32_t threshold)
+	{
+		_width = width;
+		_height = height;
+		_threshold = threshold;
+		_chroma_row_bytes = static_cast<uint32_t>(nv12_chroma_row_bytes(static_cast<int32_t>(width)));
+		_chroma_rows = static_cast<uint32_t>(nv12_chroma_rows(static_cast<int32_t>(height)));
+		_luminance.assign(static_cast<size_t>(width) * height, 0);
+		_chrominance.assign(static_cast<size_t>(_chroma_row_bytes) * _chroma_rows, 0);
+		_valid = false;
+		_stats = {};
+	}
+
+	bool tile_differ::diff(const uint8_t* luminance, int32_t luminance_stride, const uint8_t* chrominance, int32_t chrominance_stride,
+		std::vector<tile_diff_rect_t>* dirty)
+	{
+		dirty->clear();
+		if (_width == 0 || _height == 0)
+			return false;
+
+		tile_diff_block_fn sad = tile_diff_block_kernel(tile_diff_get_impl());
+		int32_t ref_stride = static_cast<int32_t>(_width);
+		int32_t ref_chroma_stride = static_cast<int32_t>(_chroma_row_bytes);
+		uint32_t tiles_x = (_width + tile_diff_size - 1) / tile_diff_size;
+		uint32_t tiles_y = (_height + tile_diff_size - 1) / tile_diff_size;
+
+		_stats.frames++;
+		_stats.tiles += static_cast<uint64_t>(tiles_x) * tiles_y;
+		_stats.bytes += _luminance.size() + _chrominance.size();
+
+		for (uint32_t ty = 0; ty < tiles_y; ty++)
+		{
+			uint32_t y0 = ty * tile_diff_size;
+			uint32_t y1 = std::min(y0 + tile_diff_size, _height);
+			// The last row of tiles takes the odd chroma row, if there is one
+			uint32_t cy0 = y0 / 2;
+			uint32_t cy1 = y1 == _height ? _chroma_rows : y1 / 2;
+			size_t row_begin = dirty->size();
+			bool run = false;
+
+			for (uint32_t tx = 0; tx < tiles_x; tx++)
+			{
+				uint32_t x0 = tx * tile_diff_size;
+				uint32_t x1 = std::min(x0 + tile_diff_size, _width);
+				// Chroma bytes, which line up with luma columns two UV bytes per pair
+				uint32_t cx1 = x1 == _width ? _chroma_row_bytes : x1;
+
+				const uint8_t* src_y = luminance + static_cast<ptrdiff_t>(y0) * luminance_stride + x0;
+				const uint8_t* src_uv = chrominance + static_cast<ptrdiff_t>(cy0) * chrominance_stride + x0;
+				uint8_t* ref_y = _luminance.data() + static_cast<size_t>(y0) * _width + x0;
+				uint8_t* ref_uv = _chrominance.data() + static_cast<size_t>(cy0) * _chroma_row_bytes + x0;
+
+				bool changed = !_valid;
+				if (!changed)
+				{
+					uint32_t sum = sad(src_y, luminance_stride, ref_y, ref_stride, x1 - x0, y1 - y0, _threshold);
+					changed = sum > _threshold
+						|| sad(src_uv, chrominance_stride, ref_uv, ref_chroma_stride, cx1 - x0, cy1 - cy0, _threshold - sum) > _threshold - sum;
+				}
+				if (!changed)
+				{
+					run = false;
+					continue;
+				}
+
+				_stats.dirty_tiles++;
+				plane_copy(ref_y, ref_stride, src_y, luminance_stride, static_cast<int32_t>(x1 - x0), static_cast<int32_t>(y1 - y0));
+				plane_copy(ref_uv, ref_chroma_stride, src_uv, chrominance_stride, static_cast<int32_t>(cx1 - x0), static_cast<int32_t>(cy1 - cy0));
+
+				if (run)
+				{
+					tile_diff_rect_t& rect = dirty->back();
+					rect.width = x1 - rect.x;
+					rect.chroma_width = cx1 / 2 - rect.chroma_x;
+				}
+				else
+				{
+					dirty->push_back({ x0, y0, x1 - x0, y1 - y0, x0 / 2, cy0, (cx1 - x0) / 2, cy1 - cy0 });
+					run = true;
+				}
+			}
+
+			// Grow rects from rows above down into this one where the columns
+			// match exactly, then drop the ones that were absorbed
+			size_t kept = row_begin;
+			for (size_t i = row_begin; i < dirty->size(); i++)
+			{
+				tile_diff_rect_t rect = (*dirty)[i];
+				bool merged = false;
+				for (size_t j = 0; j < row_begin && !merged; j++)
+				{
+					tile_diff_rect_t& above = (*dirty)[j];
+					if (above.y + above.height == y0 && above.x == rect.x && above.width == rect.width)
+					{
+						above.height = y1 - above.y;
+						above.chroma_height = cy1 - above.chroma_y;
+						merged = true;
+					}
+				}
+				if (!merged)
+					(*dirty)[kept++] = rect;
+			}
+			dirty->resize(kept);
+		}
+		_valid = true;
+
+		for (const tile_diff_rect_t& rect : *dirty)
+			_stats.dirty_bytes += static_cast<uint64_t>(rect.width) * rect.height + static_cast<uint64_t>(rect.chroma_width) * 2 * rect.chroma_height;
+		_stats.rects += dirty->size();
+		if (dirty->empty())
+			_stats.clean_frames++;
+		return !dirty->empty();
+	}
+
+	///////////////////////////////////////////
+	// Block kernels
+	///////////////////////////////////////////
+
+	static uint32_t tile_diff_row_scalar(const uint8_t* a, const uint8_t* b, size_t bytes)
+	{
+		uint32_t sum = 0;
+		for (size_t i = 0; i < bytes; i++)
+			sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+		return sum;
+	}
+
+	uint32_t tile_diff_block_scalar(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit)
+	{
+		uint32_t sum = 0;
+		for (uint32_t y = 0; y < rows && sum <= limit; y++, a += a_stride, b += b_stride)
+			sum += tile_diff_row_scalar(a, b, bytes);
+		return sum;
+	}
+
+#if SKMF_X86
+	uint32_t tile_diff_block_sse2(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit)
+	{
+		// psadbw sums each 8 byte half into a 64 bit lane; they are folded
+		// together once per row, for the early out
+		uint32_t vector_bytes = bytes & ~15u;
+		uint32_t sum = 0;
+		for (uint32_t y = 0; y < rows && sum <= limit; y++, a += a_stride, b += b_stride)
+		{
+			__m128i row = _mm_setzero_si128();
+			for (uint32_t i = 0; i < vector_bytes; i += 16)
+			{
+				__m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+				__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+				row = _mm_add_epi64(row, _mm_sad_epu8(va, vb));
+			}
+			row = _mm_add_epi64(row, _mm_srli_si128(row, 8));
+			sum += static_cast<uint32_t>(_mm_cvtsi128_si32(row)) + tile_diff_row_scalar(a + vector_bytes, b + vector_bytes, bytes - vector_bytes);
+		}
+		return sum;
+	}
+#else
+	uint32_t tile_diff_block_sse2(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit)
+	{
+		return tile_diff_block_scalar(a, a_stride, b, b_stride, bytes, rows, limit);
+	}
+#endif
+
+#if SKMF_NEON
+	uint32_t tile_diff_block_neon(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit)
+	{
+		uint32_t vector_bytes = bytes & ~15u;
+		uint32_t sum = 0;
+		for (uint32_t y = 0; y < rows && sum <= limit; y++, a += a_stride, b += b_stride)
+		{
+			uint16x8_t row = vdupq_n_u16(0);
+			for (uint32_t i = 0; i < vector_bytes; i += 16)
+				row = vpadalq_u8(row, vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+			sum += vaddlvq_u16(row) + tile_diff_row_scalar(a + vector_bytes, b + vector_bytes, bytes - vector_bytes);
+		}
+		return sum;
+	}
+#else
+	uint32_t tile_diff_block_neon(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit)
+	{
+		return tile_diff_block_scalar(a, a_stride, b, b_stride, bytes, rows, limit);
+	}
+#endif
+
+} // namespace nakamir
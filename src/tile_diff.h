@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nakamir {
+
+	// Side of a square tile in luma texels
+	const uint32_t tile_diff_size = 64;
+
+	// A changed region of an NV12 frame, as both planes' texels. Chroma is in
+	// UV pairs, i.e. texels of an R8G8 texture, and rounds up at odd edges.
+	struct tile_diff_rect_t {
+		uint32_t x;
+		uint32_t y;
+		uint32_t width;
+		uint32_t height;
+		uint32_t chroma_x;
+		uint32_t chroma_y;
+		uint32_t chroma_width;
+		uint32_t chroma_height;
+	};
+
+	struct tile_diff_stats_t {
+		uint64_t frames;
+		uint64_t clean_frames;    // Frames with nothing to upload
+		uint64_t tiles;           // Tiles compared, over all frames
+		uint64_t dirty_tiles;
+		uint64_t rects;           // Upload boxes handed out
+		uint64_t bytes;           // What full uploads of every frame would have written
+		uint64_t dirty_bytes;     // What the dirty rects cover
+	};
+
+	// Finds the parts of an NV12 frame that changed since the last one, so
+	// mostly static content (screen share, a fixed camera) only uploads those.
+	// The frame is split into 64x64 luma tiles, each with its 32x32 chroma
+	// block, and a tile is dirty when the sum of absolute differences over
+	// both planes exceeds a threshold; 0 means any change at all.
+	//
+	// The comparison is against a private copy of what was last reported, not
+	// the previous frame, so with a threshold slow drift still gets uploaded
+	// once it adds up. Dirty tiles next to each other in a row are merged into
+	// one rect, and rows of rects that line up are merged again, so a frame
+	// that changed everywhere comes back as a single rect.
+	//
+	// Not thread safe; one differ per stream.
+	class tile_differ {
+	public:
+		tile_differ() = default;
+		tile_differ(uint32_t width, uint32_t height, uint32_t threshold = 0) { reset(width, height, threshold); }
+
+		// Forgets the reference frame, so the next one is dirty everywhere
+		void reset(uint32_t width, uint32_t height, uint32_t threshold = 0);
+		void invalidate() { _valid = false; }
+
+		// Replaces dirty with the regions of this frame that need uploading, and
+		// takes them into the reference. Strides are in bytes and may be
+		// negative, as for plane_copy. Returns false if nothing changed.
+		bool diff(/**[in]**/ const uint8_t* luminance, int32_t luminance_stride, /**[in]**/ const uint8_t* chrominance, int32_t chrominance_stride,
+			/**[out]**/ std::vector<tile_diff_rect_t>* dirty);
+
+		uint32_t width() const { return _width; }
+		uint32_t height() const { return _height; }
+		tile_diff_stats_t get_stats() const { return _stats; }
+
+	private:
+		uint32_t _width = 0;
+		uint32_t _height = 0;
+		uint32_t _threshold = 0;
+		uint32_t _chroma_row_bytes = 0;
+		uint32_t _chroma_rows = 0;
+		bool _valid = false;
+		std::vector<uint8_t> _luminance;     // Packed, width apart
+		std::vector<uint8_t> _chrominance;   // Packed, _chroma_row_bytes apart
+		tile_diff_stats_t _stats = {};
+	};
+
+	enum tile_diff_impl_ {
+		tile_diff_impl_auto,    // Best available on this CPU
+		tile_diff_impl_scalar,
+		tile_diff_impl_sse2,
+		tile_diff_impl_avx2,
+		tile_diff_impl_neon,
+	};
+
+	// Forces a specific comparison kernel, for benchmarking or to rule out a SIMD
+	// path. Returns false, leaving the current choice alone, if the CPU can't run it.
+	bool tile_diff_set_impl(tile_diff_impl_ impl);
+	tile_diff_impl_ tile_diff_get_impl();
+	const char* tile_diff_impl_name(tile_diff_impl_ impl);
+
+	// Sum of absolute differences of two blocks, exposed for the dispatcher and
+	// benchmarks. Stops after the first row that takes it over limit, so the
+	// result is only exact when it is at most limit; bytes is at most a
+	// tile's width of either plane.
+	typedef uint32_t(*tile_diff_block_fn)(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit);
+	uint32_t tile_diff_block_scalar(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit);
+	uint32_t tile_diff_block_sse2(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit);
+	uint32_t tile_diff_block_avx2(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit);
+	uint32_t tile_diff_block_neon(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit);
+
+} // namespace nakamir
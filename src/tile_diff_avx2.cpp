@@ -0,0 +1,49 @@
+#include "tile_diff.h"
+#include "cpu_features.h"
+
+// Built with AVX2 code generation enabled (see CMakeLists.txt), and only ever
+// called after the dispatcher has checked the CPU supports it
+#if SKMF_X86
+#include <immintrin.h>
+#endif
+
+namespace nakamir {
+
+#if SKMF_X86
+	uint32_t tile_diff_block_avx2(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit)
+	{
+		// Rows narrower than a register, e.g. the right edge of a frame, are
+		// better off with SSE2
+		if (bytes < 32)
+			return tile_diff_block_sse2(a, a_stride, b, b_stride, bytes, rows, limit);
+
+		uint32_t vector_bytes = bytes & ~31u;
+		uint32_t sum = 0;
+		const uint8_t* a_row = a;
+		const uint8_t* b_row = b;
+		for (uint32_t y = 0; y < rows && sum <= limit; y++, a_row += a_stride, b_row += b_stride)
+		{
+			__m256i row = _mm256_setzero_si256();
+			for (uint32_t i = 0; i < vector_bytes; i += 32)
+			{
+				__m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a_row + i));
+				__m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b_row + i));
+				row = _mm256_add_epi64(row, _mm256_sad_epu8(va, vb));
+			}
+			__m128i half = _mm_add_epi64(_mm256_castsi256_si128(row), _mm256_extracti128_si256(row, 1));
+			half = _mm_add_epi64(half, _mm_srli_si128(half, 8));
+			sum += static_cast<uint32_t>(_mm_cvtsi128_si32(half));
+			for (uint32_t i = vector_bytes; i < bytes; i++)
+				sum += a_row[i] > b_row[i] ? a_row[i] - b_row[i] : b_row[i] - a_row[i];
+		}
+		_mm256_zeroupper();
+		return sum;
+	}
+#else
+	uint32_t tile_diff_block_avx2(const uint8_t* a, int32_t a_stride, const uint8_t* b, int32_t b_stride, uint32_t bytes, uint32_t rows, uint32_t limit)
+	{
+		return tile_diff_block_scalar(a, a_stride, b, b_stride, bytes, rows, limit);
+	}
+#endif
+
+} // namespace nakamir
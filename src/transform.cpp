@@ -0,0 +1,156 @@
+#include "transform.h"
+#include "aligned_memory.h"
+#include <stdexcept>
+
+namespace nakamir {
+
+	class memory_buffer final : public media_buffer {
+	public:
+		memory_buffer(size_t capacity, size_t alignment)
+			: _data(static_cast<uint8_t*>(aligned_malloc(capacity, alignment))), _capacity(capacity) {}
+		~memory_buffer() override { aligned_free(_data); }
+
+		uint8_t* lock(size_t* max_length, size_t* current_length) override
+		{
+			if (max_length) *max_length = _capacity;
+			if (current_length) *current_length = _length;
+			return _data;
+		}
+		void unlock() override {}
+		size_t get_max_length() override { return _capacity; }
+		size_t get_current_length() override { return _length; }
+		void set_current_length(size_t length) override
+		{
+			if (length > _capacity) throw std::length_error("Buffer length exceeds its capacity");
+			_length = length;
+		}
+
+	private:
+		uint8_t* _data;
+		size_t _capacity;
+		size_t _length = 0;
+	};
+
+	class memory_sample final : public media_sample {
+	public:
+		memory_sample(size_t capacity, size_t alignment) : _buffer(capacity, alignment) {}
+
+		uint32_t add_ref() override { return ++_refs; }
+		uint32_t release() override
+		{
+			uint32_t refs = --_refs;
+			if (refs == 0) delete this;
+			return refs;
+		}
+		media_buffer* get_buffer() override { return &_buffer; }
+		int64_t get_sample_time() override { return _time; }
+		void set_sample_time(int64_t time) override { _time = time; }
+		int64_t get_sample_duration() override { return _duration; }
+		void set_sample_duration(int64_t duration) override { _duration = duration; }
+
+	private:
+		std::atomic<uint32_t> _refs = 1;
+		memory_buffer _buffer;
+		int64_t _time = 0;
+		int64_t _duration = 0;
+	};
+
+	media_sample* memory_sample_create(size_t capacity, size_t alignment)
+	{
+		return new memory_sample(capacity, alignment);
+	}
+
+	size_t transform_process_output(media_transform* transform, transform_on_receive_sample onReceiveSample, void* context, sample_allocator* allocator, size_t max_outputs)
+	{
+		transform_stream_info_t info = transform->get_output_stream_info();
+		size_t delivered = 0;
+
+		// Here, we generate new output by calling process_output until it results in
+		// transform_status_need_more_input which breaks out of the loop.
+		while (delivered < max_outputs)
+		{
+			ref_ptr<media_sample> output;
+			if ((info.flags & transform_stream_flags_provides_samples) == 0)
+			{
+				output = ref_ptr<media_sample>::attach(allocator
+					? allocator->allocate(info)
+					: transform->create_output_sample(info));
+			}
+
+			ref_ptr<media_sample> result;
+			transform_status_ status = transform->process_output(output.get(), result.release_and_get_address_of());
+
+			if (status == transform_status_stream_change)
+			{
+				// The output type was invalidated, pick the new one. Buffer requirements
+				// usually change with it (e.g. a new frame size), so query them again.
+				transform->renegotiate_output_type();
+				info = transform->get_output_stream_info();
+				continue;
+			}
+
+			// More input is not an error condition but it means the allocated output sample is empty
+			if (status == transform_status_need_more_input)
+				break;
+
+			if (status != transform_status_ok)
+				throw std::runtime_error("Error getting transform output");
+
+			delivered++;
+			if (onReceiveSample)
+				onReceiveSample(transform, result.get(), context);
+		}
+		return delivered;
+	}
+
+	void transform_sample_to_buffer(media_transform* transform, media_sample* sample, transform_on_receive_sample onReceiveSample, void* context, sample_allocator* allocator)
+	{
+		if (transform->is_async())
+		{
+			// Output can be signalled before the next input is asked for, so keep
+			// collecting it until the transform takes the sample
+			while (true)
+			{
+				transform_event_ event = transform->get_event(true);
+
+				if (event == transform_event_need_input)
+				{
+					if (transform->process_input(sample) != transform_status_ok)
+						throw std::runtime_error("Transform rejected the input sample");
+					break;
+				}
+
+				if (event == transform_event_have_output)
+				{
+					transform_process_output(transform, onReceiveSample, context, allocator, 1);
+				}
+				else if (event == transform_event_none)
+				{
+					throw std::runtime_error("Transform shut down before taking the input sample");
+				}
+			}
+		}
+		else
+		{
+			if (transform->process_input(sample) != transform_status_ok)
+				throw std::runtime_error("Transform rejected the input sample");
+			transform_process_output(transform, onReceiveSample, context, allocator);
+		}
+	}
+
+	void transform_drain_pending_outputs(media_transform* transform, transform_on_receive_sample onReceiveSample, void* context, sample_allocator* allocator)
+	{
+		if (!transform->is_async())
+			return;
+
+		transform_event_ event;
+		while ((event = transform->get_event(false)) != transform_event_none)
+		{
+			if (event == transform_event_have_output)
+			{
+				transform_process_output(transform, onReceiveSample, context, allocator, 1);
+			}
+		}
+	}
+
+} // namespace nakamir
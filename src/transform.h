@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// A platform-neutral view of a media transform (encoder, decoder, ...) that
+// mirrors the IMFTransform / IMFSample / IMFMediaBuffer model closely enough for
+// the MF code to be one backend of it. The pump loop, draining and format
+// change handling live here so they can be exercised without a Windows box,
+// e.g. against the stand-in transform in sim_transform.h.
+
+namespace nakamir {
+
+	enum transform_status_ {
+		transform_status_ok,
+		transform_status_need_more_input,  // MF_E_TRANSFORM_NEED_MORE_INPUT
+		transform_status_stream_change,    // MF_E_TRANSFORM_STREAM_CHANGE
+		transform_status_not_accepting,    // MF_E_NOTACCEPTING
+	};
+
+	enum transform_event_ {
+		transform_event_none,
+		transform_event_need_input,        // METransformNeedInput
+		transform_event_have_output,       // METransformHaveOutput
+		transform_event_drain_complete,    // METransformDrainComplete
+	};
+
+	enum transform_stream_flags_ {
+		transform_stream_flags_none             = 0,
+		transform_stream_flags_provides_samples = 1 << 0, // MFT_OUTPUT_STREAM_PROVIDES_SAMPLES
+	};
+
+	struct transform_stream_info_t {
+		uint32_t flags;
+		uint32_t size;      // Minimum size of an output buffer in bytes
+		uint32_t alignment; // Required alignment in bytes (a power of two, 1 for none)
+	};
+
+	// Equivalent of IMFMediaBuffer. Buffers belong to their sample.
+	class media_buffer {
+	public:
+		virtual uint8_t* lock(/**[out]**/ size_t* max_length, /**[out]**/ size_t* current_length) = 0;
+		virtual void unlock() = 0;
+		virtual size_t get_max_length() = 0;
+		virtual size_t get_current_length() = 0;
+		virtual void set_current_length(size_t length) = 0;
+
+	protected:
+		virtual ~media_buffer() = default;
+	};
+
+	// Equivalent of IMFSample with a single buffer, which is all our encoders and
+	// decoders accept. Samples are intrusively reference counted like COM objects
+	// so that backends and pools can decide what "release" means.
+	class media_sample {
+	public:
+		virtual uint32_t add_ref() = 0;
+		virtual uint32_t release() = 0;
+		virtual media_buffer* get_buffer() = 0;
+		virtual int64_t get_sample_time() = 0;
+		virtual void set_sample_time(int64_t time) = 0;
+		virtual int64_t get_sample_duration() = 0;
+		virtual void set_sample_duration(int64_t duration) = 0;
+
+	protected:
+		virtual ~media_sample() = default;
+	};
+
+	// Hands out output samples for transforms that don't provide their own
+	class sample_allocator {
+	public:
+		virtual ~sample_allocator() = default;
+		virtual media_sample* allocate(const transform_stream_info_t& info) = 0;
+	};
+
+	// Equivalent of IMFTransform for a single input and output stream
+	class media_transform {
+	public:
+		virtual ~media_transform() = default;
+
+		virtual transform_stream_info_t get_output_stream_info() = 0;
+		virtual transform_status_ process_input(/**[in]**/ media_sample* sample) = 0;
+		// If the transform doesn't provide samples, the caller passes one in as output.
+		// On transform_status_ok, *ppResult receives a new reference to the sample
+		// holding the data (output itself or one the transform allocated).
+		virtual transform_status_ process_output(/**[in]**/ media_sample* output, /**[out]**/ media_sample** ppResult) = 0;
+		// Selects the first available output type after a stream change
+		virtual void renegotiate_output_type() = 0;
+		virtual void flush() = 0;
+		virtual void drain() = 0;
+
+		// Asynchronous transforms signal when they want input or have output. Sync
+		// transforms always return false and transform_event_none.
+		virtual bool is_async() = 0;
+		virtual transform_event_ get_event(bool wait) = 0;
+		// Wakes any thread blocked in get_event, which returns transform_event_none
+		// from then on. The transform can't be used afterwards.
+		virtual void shutdown() = 0;
+
+		// Default allocation for output samples when no allocator is supplied
+		virtual media_sample* create_output_sample(const transform_stream_info_t& info) = 0;
+	};
+
+	typedef void(*transform_on_receive_sample)(media_transform* transform, media_sample* sample, void* context);
+
+	// COM style smart pointer for media_sample and friends
+	template <typename T>
+	class ref_ptr {
+	public:
+		ref_ptr() = default;
+		ref_ptr(const ref_ptr& other) : _ptr(other._ptr) { if (_ptr) _ptr->add_ref(); }
+		ref_ptr(ref_ptr&& other) noexcept : _ptr(std::exchange(other._ptr, nullptr)) {}
+		~ref_ptr() { reset(); }
+
+		ref_ptr& operator=(ref_ptr other) noexcept { std::swap(_ptr, other._ptr); return *this; }
+
+		// Takes ownership of an existing reference
+		static ref_ptr attach(T* ptr) { ref_ptr result; result._ptr = ptr; return result; }
+
+		T* get() const { return _ptr; }
+		T* operator->() const { return _ptr; }
+		explicit operator bool() const { return _ptr != nullptr; }
+		T* detach() { return std::exchange(_ptr, nullptr); }
+		T** release_and_get_address_of() { reset(); return &_ptr; }
+		void reset() { if (_ptr) std::exchange(_ptr, nullptr)->release(); }
+
+	private:
+		T* _ptr = nullptr;
+	};
+
+	// Plain heap-backed sample with one aligned buffer, starting with a refcount of one
+	media_sample* memory_sample_create(size_t capacity, size_t alignment = 16);
+
+	// Generates output until the transform asks for more input, handling stream
+	// changes along the way. Async transforms may only be asked for output once
+	// per have-output event, so pass max_outputs = 1 for those.
+	// Returns the number of samples delivered to onReceiveSample.
+	size_t transform_process_output(/**[in]**/ media_transform* transform, /**[in]**/ transform_on_receive_sample onReceiveSample = nullptr, /**[in]**/ void* context = nullptr, /**[in]**/ sample_allocator* allocator = nullptr, size_t max_outputs = SIZE_MAX);
+
+	// Feeds one sample through the transform and delivers whatever output it
+	// produces. For async transforms this collects any output signalled ahead of
+	// the input request, so only one frame is ever in flight; see transform_driver
+	// for keeping several queued.
+	void transform_sample_to_buffer(/**[in]**/ media_transform* transform, /**[in]**/ media_sample* sample, /**[in]**/ transform_on_receive_sample onReceiveSample, /**[in]**/ void* context = nullptr, /**[in]**/ sample_allocator* allocator = nullptr);
+
+	// Collects any output an async transform has already signalled, without blocking
+	void transform_drain_pending_outputs(/**[in]**/ media_transform* transform, /**[in]**/ transform_on_receive_sample onReceiveSample = nullptr, /**[in]**/ void* context = nullptr, /**[in]**/ sample_allocator* allocator = nullptr);
+
+} // namespace nakamir
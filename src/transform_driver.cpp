@@ -0,0 +1,310 @@
+#include "transform_driver.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace nakamir {
+
+	transform_driver::transform_driver(media_transform* transform, transform_on_receive_sample onReceiveSample, void* context, sample_allocator* allocator, uint32_t max_queued)
+		: _transform(transform), _on_receive(onReceiveSample), _context(context), _allocator(allocator), _max_queued(max_queued), _async(transform->is_async())
+	{
+	}
+
+	transform_driver::~transform_driver()
+	{
+		stop();
+	}
+
+	void transform_driver::start()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_running || _stopping)
+			return;
+		_running = true;
+		if (_async)
+			_thread = std::thread(&transform_driver::event_loop, this);
+	}
+
+	bool transform_driver::submit(media_sample* sample, bool wait)
+	{
+		if (!_async)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mtx);
+				if (!_running || _stopping)
+					return false;
+				_stats.submitted++;
+				_stats.inputs++;
+			}
+			transform_sample_to_buffer(_transform, sample, on_receive_sample, this, _allocator);
+			return true;
+		}
+
+		std::unique_lock<std::mutex> lock(_mtx);
+		if (_error)
+			std::rethrow_exception(_error);
+		if (!_running || _stopping)
+			return false;
+
+		// The transform is already waiting for this one
+		if (can_feed_locked())
+		{
+			_stats.submitted++;
+			sample->add_ref();
+			feed(lock, sample);
+			return true;
+		}
+
+		if (_queue.size() >= capacity_locked())
+		{
+			if (!wait)
+				return false;
+			_stats.submit_waits++;
+			_cv.wait(lock, [this] { return _stopping || _queue.size() < capacity_locked() || can_feed_locked(); });
+			if (_error)
+				std::rethrow_exception(_error);
+			if (_stopping)
+				return false;
+			if (can_feed_locked())
+			{
+				_stats.submitted++;
+				sample->add_ref();
+				feed(lock, sample);
+				return true;
+			}
+		}
+
+		sample->add_ref();
+		_queue.push_back(sample);
+		_stats.submitted++;
+		_stats.queued = static_cast<uint32_t>(_queue.size());
+		return true;
+	}
+
+	void transform_driver::drain()
+	{
+		if (!_async)
+		{
+			_transform->drain();
+			transform_process_output(_transform, on_receive_sample, this, _allocator);
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(_mtx);
+		if (!_running)
+			return;
+		_cv.wait(lock, [this] { return _stopping || (_queue.empty() && !_feeding); });
+		if (!_stopping)
+		{
+			_drained = false;
+			_transform->drain();
+			_cv.wait(lock, [this] { return _stopping || _drained; });
+		}
+		if (_error)
+			std::rethrow_exception(_error);
+	}
+
+	void transform_driver::flush()
+	{
+		// An input on its way in would land after the flush
+		std::unique_lock<std::mutex> lock(_mtx);
+		_cv.wait(lock, [this] { return !_feeding; });
+		for (media_sample* sample : _queue)
+			sample->release();
+		_queue.clear();
+		// The transform asks for input afresh after a flush
+		_requests = 0;
+		_stats.queued = 0;
+		_stats.requests = 0;
+		_transform->flush();
+		_cv.notify_all();
+	}
+
+	void transform_driver::stop()
+	{
+		{
+			// _stopping is also set by an event thread that failed, which still
+			// leaves the queue, the transform and the thread to clean up
+			std::lock_guard<std::mutex> lock(_mtx);
+			if (_stopped)
+				return;
+			_stopped = true;
+			_stopping = true;
+			for (media_sample* sample : _queue)
+				sample->release();
+			_queue.clear();
+			_stats.queued = 0;
+			_cv.notify_all();
+		}
+
+		// Nothing else gets a thread out of a blocking get_event
+		if (_async)
+			_transform->shutdown();
+		if (_thread.joinable())
+			_thread.join();
+	}
+
+	transform_driver_stats_t transform_driver::get_stats()
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		transform_driver_stats_t stats = _stats;
+		stats.queue_capacity = capacity_locked();
+		return stats;
+	}
+
+	void transform_driver::event_loop()
+	{
+		try
+		{
+			event_loop_until_stopped();
+		}
+		catch (...)
+		{
+			// Handed to the next submit or drain, as there's no one to catch it here
+			std::lock_guard<std::mutex> lock(_mtx);
+			_error = std::current_exception();
+			_stopping = true;
+			_cv.notify_all();
+		}
+	}
+
+	void transform_driver::event_loop_until_stopped()
+	{
+		while (true)
+		{
+			transform_event_ event = _transform->get_event(true);
+
+			std::unique_lock<std::mutex> lock(_mtx);
+			if (_stopping)
+				break;
+
+			switch (event)
+			{
+			case transform_event_need_input:
+				_stats.need_input_events++;
+				if (!_first_output)
+					_input_depth++;
+				_requests++;
+				_stats.requests = _requests;
+				if (!_queue.empty() && !_feeding)
+				{
+					media_sample* sample = _queue.front();
+					_queue.pop_front();
+					feed(lock, sample);
+				}
+				else if (_queue.empty())
+				{
+					_stats.starved++;
+				}
+				// Also wakes a submit waiting on a queue that just grew
+				_cv.notify_all();
+				break;
+
+			case transform_event_have_output:
+				_stats.have_output_events++;
+				_first_output = true;
+				// Deliver without the lock, the callback may well submit to another driver
+				lock.unlock();
+				transform_process_output(_transform, on_receive_sample, this, _allocator, 1);
+				break;
+
+			case transform_event_drain_complete:
+				_first_output = true;
+				_drained = true;
+				_cv.notify_all();
+				break;
+
+			default:
+				// Events we don't act on, e.g. markers
+				break;
+			}
+		}
+	}
+
+	void transform_driver::feed(std::unique_lock<std::mutex>& lock, media_sample* sample)
+	{
+		_feeding = true;
+		while (sample)
+		{
+			_requests--;
+			_stats.requests = _requests;
+
+			// MFTs can take their time over ProcessInput, and submit, get_stats
+			// and the callbacks of other drivers shouldn't wait on it
+			lock.unlock();
+			transform_status_ status;
+			try
+			{
+				status = _transform->process_input(sample);
+			}
+			catch (...)
+			{
+				lock.lock();
+				sample->release();
+				_feeding = false;
+				_cv.notify_all();
+				throw;
+			}
+			lock.lock();
+
+			if (status != transform_status_ok)
+			{
+				// A request that went stale across a flush; keep the sample for the next one
+				if (_stopping)
+					sample->release();
+				else
+					_queue.push_front(sample);
+				_requests = 0;
+				_stats.requests = 0;
+				break;
+			}
+			sample->release();
+			_stats.inputs++;
+			uint32_t in_flight = _stats.inputs > _stats.outputs ? static_cast<uint32_t>(_stats.inputs - _stats.outputs) : 0;
+			_stats.in_flight = in_flight;
+			_stats.max_in_flight = std::max(_stats.max_in_flight, in_flight);
+
+			// Requests that came in meanwhile found us busy and left the queue be
+			sample = nullptr;
+			if (_requests > 0 && !_queue.empty() && !_stopping)
+			{
+				sample = _queue.front();
+				_queue.pop_front();
+			}
+		}
+		_stats.queued = static_cast<uint32_t>(_queue.size());
+		_feeding = false;
+		_cv.notify_all();
+	}
+
+	bool transform_driver::can_feed_locked() const
+	{
+		// Only one thread feeds at a time, or inputs could reach the transform
+		// out of order
+		return _requests > 0 && _queue.empty() && !_feeding;
+	}
+
+	uint32_t transform_driver::capacity_locked() const
+	{
+		// Async MFTs ask for as many inputs as they can hold up front, so the
+		// need-input events before the first output are their queue depth
+		return _max_queued ? _max_queued : std::max<uint32_t>(_input_depth, 2);
+	}
+
+	void transform_driver::deliver(media_sample* sample)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			_stats.outputs++;
+			_stats.output_bytes += sample->get_buffer()->get_current_length();
+			_stats.in_flight = _stats.inputs > _stats.outputs ? static_cast<uint32_t>(_stats.inputs - _stats.outputs) : 0;
+		}
+		if (_on_receive)
+			_on_receive(_transform, sample, _context);
+	}
+
+	void transform_driver::on_receive_sample(media_transform* /*transform*/, media_sample* sample, void* context)
+	{
+		static_cast<transform_driver*>(context)->deliver(sample);
+	}
+
+} // namespace nakamir
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "transform.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace nakamir {
+
+	struct transform_driver_stats_t {
+		uint64_t submitted;           // Samples accepted by submit
+		uint64_t inputs;              // Samples handed to the transform
+		uint64_t outputs;             // Samples delivered to the callback
+		uint64_t output_bytes;
+		uint64_t need_input_events;
+		uint64_t have_output_events;
+		uint64_t starved;             // Need-input events that found the queue empty
+		uint64_t submit_waits;        // submit calls that blocked on a full queue
+		uint32_t queued;              // Samples waiting for the transform to ask
+		uint32_t queue_capacity;
+		uint32_t requests;            // Need-input requests not yet answered
+		uint32_t in_flight;           // Inputs given to the transform and not yet out again
+		uint32_t max_in_flight;
+	};
+
+	// Keeps an asynchronous transform saturated. A dedicated thread waits on the
+	// transform's events: each need-input is answered from a queue of submitted
+	// samples (or straight from submit when a request is already waiting), and
+	// each have-output is collected and handed to the callback on that thread.
+	// So unlike transform_sample_to_buffer, several frames can be in flight and
+	// no input is ever dropped because an output event came first.
+	//
+	// Synchronous transforms are driven inline from submit, the same way
+	// transform_sample_to_buffer does it, so callers needn't care which they got.
+	class transform_driver {
+	public:
+		// max_queued bounds the input queue; 0 sizes it to the need-input
+		// requests the transform makes before its first output, at least 2
+		transform_driver(/**[in]**/ media_transform* transform, /**[in]**/ transform_on_receive_sample onReceiveSample, /**[in]**/ void* context = nullptr,
+			/**[in]**/ sample_allocator* allocator = nullptr, uint32_t max_queued = 0);
+		~transform_driver();
+
+		transform_driver(const transform_driver&) = delete;
+		transform_driver& operator=(const transform_driver&) = delete;
+
+		void start();
+		// Queues a sample, taking a reference. Waits while the queue is full if
+		// wait is set; returns false if it is full and wait isn't, or after stop.
+		// Errors raised on the event thread are rethrown here and from drain.
+		bool submit(/**[in]**/ media_sample* sample, bool wait = true);
+		// Feeds everything queued, drains the transform and waits until its last
+		// output has been delivered
+		void drain();
+		// Drops queued input and flushes the transform
+		void flush();
+		// Shuts the transform down to wake the event thread and joins it. The
+		// transform can't be used afterwards.
+		void stop();
+
+		transform_driver_stats_t get_stats();
+
+	private:
+		void event_loop();
+		void event_loop_until_stopped();
+		// Takes over the caller's reference to sample. Drops the lock around
+		// process_input, so call it with the lock held in a unique_lock.
+		void feed(std::unique_lock<std::mutex>& lock, /**[in]**/ media_sample* sample);
+		bool can_feed_locked() const;
+		uint32_t capacity_locked() const;
+		void deliver(/**[in]**/ media_sample* sample);
+		static void on_receive_sample(media_transform* transform, media_sample* sample, void* context);
+
+		media_transform* _transform;
+		transform_on_receive_sample _on_receive;
+		void* _context;
+		sample_allocator* _allocator;
+		uint32_t _max_queued;
+		bool _async;
+
+		std::mutex _mtx;
+		std::condition_variable _cv;
+		std::deque<media_sample*> _queue;
+		uint32_t _requests = 0;
+		uint32_t _input_depth = 0;      // Need-input events before the first output
+		bool _first_output = false;
+		bool _feeding = false;          // A thread is in process_input
+		bool _running = false;
+		bool _stopping = false;         // Stop asked for, or the event thread failed
+		bool _stopped = false;          // stop has run
+		bool _drained = false;
+		std::exception_ptr _error;
+		std::thread _thread;
+		transform_driver_stats_t _stats = {};
+	};
+
+} // namespace nakamir
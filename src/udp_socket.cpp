@@ -0,0 +1,205 @@
+#include "udp_socket.h"
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mutex>
+#include <vector>
+#else
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+#endif
+
+namespace nakamir {
+
+	// Spans of one packet, kept per thread so send doesn't allocate
+	static thread_local std::vector<
+#ifdef _WIN32
+		WSABUF
+#else
+		iovec
+#endif
+	> udp_gather;
+
+	static bool udp_make_address(const char* address, uint16_t port, /**[out]**/ sockaddr_in* addr)
+	{
+		memset(addr, 0, sizeof(*addr));
+		addr->sin_family = AF_INET;
+		addr->sin_port = htons(port);
+		return inet_pton(AF_INET, address, &addr->sin_addr) == 1;
+	}
+
+	udp_socket::~udp_socket()
+	{
+		close();
+	}
+
+#ifdef _WIN32
+	static bool udp_startup()
+	{
+		static std::once_flag once;
+		static bool started = false;
+		std::call_once(once, [] {
+			WSADATA data = {};
+			started = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+		});
+		return started;
+	}
+
+	bool udp_socket::open(const char* address, uint16_t port)
+	{
+		close();
+		sockaddr_in addr;
+		if (!udp_startup() || !udp_make_address(address, port, &addr))
+			return false;
+
+		SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (s == INVALID_SOCKET)
+			return false;
+		if (bind(s, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+		{
+			closesocket(s);
+			return false;
+		}
+		_socket = static_cast<uintptr_t>(s);
+		return true;
+	}
+
+	void udp_socket::close()
+	{
+		if (is_open())
+			closesocket(static_cast<SOCKET>(_socket));
+		_socket = static_cast<uintptr_t>(INVALID_SOCKET);
+	}
+
+	bool udp_socket::is_open() const
+	{
+		return _socket != static_cast<uintptr_t>(INVALID_SOCKET);
+	}
+
+	bool udp_socket::send(const rtp_span_t* spans, uint32_t count)
+	{
+		udp_gather.resize(count);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			udp_gather[i].buf = const_cast<CHAR*>(reinterpret_cast<const CHAR*>(spans[i].data));
+			udp_gather[i].len = static_cast<ULONG>(spans[i].size);
+		}
+		DWORD sent = 0;
+		return WSASend(static_cast<SOCKET>(_socket), udp_gather.data(), count, &sent, 0, nullptr, nullptr) == 0;
+	}
+
+	int32_t udp_socket::receive(uint8_t* buffer, size_t size, int32_t timeout_ms)
+	{
+		WSAPOLLFD poll_fd = {};
+		poll_fd.fd = static_cast<SOCKET>(_socket);
+		poll_fd.events = POLLRDNORM;
+		int ready = WSAPoll(&poll_fd, 1, timeout_ms);
+		if (ready <= 0)
+			return ready;
+		int received = recv(static_cast<SOCKET>(_socket), reinterpret_cast<char*>(buffer), static_cast<int>(size), 0);
+		// A datagram cut short still counts as received
+		if (received < 0 && WSAGetLastError() == WSAEMSGSIZE)
+			return static_cast<int32_t>(size);
+		return received;
+	}
+#else
+	bool udp_socket::open(const char* address, uint16_t port)
+	{
+		close();
+		sockaddr_in addr;
+		if (!udp_make_address(address, port, &addr))
+			return false;
+
+		int s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+		if (s < 0)
+			return false;
+		if (bind(s, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0)
+		{
+			::close(s);
+			return false;
+		}
+		_socket = s;
+		return true;
+	}
+
+	void udp_socket::close()
+	{
+		if (_socket >= 0)
+			::close(_socket);
+		_socket = -1;
+	}
+
+	bool udp_socket::is_open() const
+	{
+		return _socket >= 0;
+	}
+
+	bool udp_socket::send(const rtp_span_t* spans, uint32_t count)
+	{
+		udp_gather.resize(count);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			udp_gather[i].iov_base = const_cast<uint8_t*>(spans[i].data);
+			udp_gather[i].iov_len = spans[i].size;
+		}
+		msghdr message = {};
+		message.msg_iov = udp_gather.data();
+		message.msg_iovlen = count;
+		for (;;)
+		{
+			ssize_t sent = sendmsg(_socket, &message, 0);
+			if (sent >= 0)
+				return true;
+			if (errno != EINTR)
+				return false;
+		}
+	}
+
+	int32_t udp_socket::receive(uint8_t* buffer, size_t size, int32_t timeout_ms)
+	{
+		pollfd poll_fd = {};
+		poll_fd.fd = _socket;
+		poll_fd.events = POLLIN;
+		int ready = poll(&poll_fd, 1, timeout_ms);
+		if (ready <= 0)
+			return ready < 0 && errno == EINTR ? 0 : ready;
+		ssize_t received = recv(_socket, buffer, size, 0);
+		return static_cast<int32_t>(received);
+	}
+#endif
+
+	uint16_t udp_socket::local_port() const
+	{
+		sockaddr_in addr = {};
+		socklen_t length = sizeof(addr);
+		if (!is_open() || getsockname(_socket, reinterpret_cast<sockaddr*>(&addr), &length) != 0)
+			return 0;
+		return ntohs(addr.sin_port);
+	}
+
+	bool udp_socket::connect(const char* address, uint16_t port)
+	{
+		sockaddr_in addr;
+		if (!is_open() || !udp_make_address(address, port, &addr))
+			return false;
+		return ::connect(_socket, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0;
+	}
+
+	bool udp_socket::set_receive_buffer(size_t bytes)
+	{
+		int value = static_cast<int>(bytes);
+		return is_open() && setsockopt(_socket, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&value), sizeof(value)) == 0;
+	}
+
+} // namespace nakamir
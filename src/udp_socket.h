@@ -0,0 +1,48 @@
+#pragma once
+
+#include "rtp_h264.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace nakamir {
+
+	// Minimal blocking IPv4 UDP socket for RTP. send gathers a packet's spans
+	// in one sendmsg/WSASendTo call, so the kernel copies the payload straight
+	// out of the encoder's buffer and nothing is assembled in between.
+	class udp_socket {
+	public:
+		udp_socket() = default;
+		~udp_socket();
+
+		udp_socket(const udp_socket&) = delete;
+		udp_socket& operator=(const udp_socket&) = delete;
+
+		// Binds to a dotted IPv4 address, port 0 for any free one. Returns
+		// false, leaving the socket closed, on failure.
+		bool open(const char* address = "127.0.0.1", uint16_t port = 0);
+		void close();
+		bool is_open() const;
+
+		// Port the socket is bound to
+		uint16_t local_port() const;
+		// Fixes where send goes, and drops datagrams from anywhere else
+		bool connect(const char* address, uint16_t port);
+		// Asks the OS for a bigger receive queue, so bursts such as a keyframe's
+		// packets aren't dropped while the receiver is busy
+		bool set_receive_buffer(size_t bytes);
+
+		// Sends one datagram made of count spans. False if it couldn't be sent.
+		bool send(const rtp_span_t* spans, uint32_t count);
+		// Waits up to timeout_ms for a datagram. Returns its size, 0 on timeout,
+		// or -1 on error; datagrams longer than size are cut short.
+		int32_t receive(/**[out]**/ uint8_t* buffer, size_t size, int32_t timeout_ms);
+
+	private:
+#ifdef _WIN32
+		uintptr_t _socket = ~static_cast<uintptr_t>(0);
+#else
+		int _socket = -1;
+#endif
+	};
+
+} // namespace nakamir